@@ -7,6 +7,7 @@
 #include "common.h"
 
 #include "utils.h"
+#include "trace.h"
 
 #include "log.h"
 
@@ -14,6 +15,7 @@
 #include <fcntl.h>
 #ifndef WIN32
 #include <dirent.h>
+#include <sys/mman.h>
 #endif
 
 #include "block-backend.h"
@@ -27,6 +29,9 @@ struct _BHandle {
     int     fd;
     int     rw_type;
     char    *tmp_file;
+    /* Set by block_backend_fs_map_block(). */
+    void    *map;
+    size_t  map_len;
 };
 
 typedef struct {
@@ -112,12 +117,62 @@ block_backend_fs_write_block (BlockBackend *bend,
     return (writen (handle->fd, buf, len));
 }
 
+#ifndef WIN32
+/* Committed blocks are only ever replaced by rename and removed by unlink,
+ * so the mapped file doesn't change under the mapping. */
+static const void *
+block_backend_fs_map_block (BlockBackend *bend,
+                            BHandle *handle,
+                            guint32 *len)
+{
+    SeafStat st;
+    void *map;
+
+    if (handle->rw_type != BLOCK_READ)
+        return NULL;
+
+    if (!handle->map) {
+        if (seaf_fstat (handle->fd, &st) < 0 ||
+            st.st_size <= 0 || st.st_size > G_MAXUINT32)
+            return NULL;
+
+        map = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+                    handle->fd, 0);
+        if (map == MAP_FAILED) {
+            seaf_warning ("[block bend] Failed to map block %s: %s.\n",
+                          handle->block_id, strerror(errno));
+            return NULL;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise (map, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+        handle->map = map;
+        handle->map_len = (size_t)st.st_size;
+    }
+
+    *len = (guint32)handle->map_len;
+    return handle->map;
+}
+#endif
+
+static void
+unmap_block (BHandle *handle)
+{
+#ifndef WIN32
+    if (handle->map) {
+        munmap (handle->map, handle->map_len);
+        handle->map = NULL;
+    }
+#endif
+}
+
 static int
 block_backend_fs_close_block (BlockBackend *bend,
                                 BHandle *handle)
 {
     int ret;
 
+    unmap_block (handle);
     ret = close (handle->fd);
 
     return ret;
@@ -127,6 +182,7 @@ static void
 block_backend_fs_block_handle_free (BlockBackend *bend,
                                     BHandle *handle)
 {
+    unmap_block (handle);
     if (handle->rw_type == BLOCK_WRITE) {
         /* make sure the tmp file is removed even on failure. */
         g_unlink (handle->tmp_file);
@@ -163,6 +219,7 @@ block_backend_fs_commit_block (BlockBackend *bend,
                                BHandle *handle)
 {
     char path[SEAF_PATH_MAX];
+    gint64 start = seaf_trace_begin ();
 
     g_return_val_if_fail (handle->rw_type == BLOCK_WRITE, -1);
 
@@ -180,6 +237,8 @@ block_backend_fs_commit_block (BlockBackend *bend,
         return -1;
     }
 
+    seaf_trace_end ("block", "commit", start, handle->block_id);
+
     return 0;
 }
     
@@ -494,6 +553,9 @@ block_backend_fs_new (const char *seaf_dir, const char *tmp_dir)
     bend->stat_block = block_backend_fs_stat_block;
     bend->stat_block_by_handle = block_backend_fs_stat_block_by_handle;
     bend->block_handle_free = block_backend_fs_block_handle_free;
+#ifndef WIN32
+    bend->map_block = block_backend_fs_map_block;
+#endif
     bend->foreach_block = block_backend_fs_foreach_block;
     bend->remove_store = block_backend_fs_remove_store;
     bend->copy = block_backend_fs_copy;
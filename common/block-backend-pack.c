@@ -0,0 +1,937 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "utils.h"
+
+#include "log.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#include <io.h>
+#endif
+
+#include "block-backend.h"
+#include "pack-store.h"
+
+/*
+ * Packed block store.
+ *
+ * Blocks of a store are appended to large pack files under
+ * storage/packs/<store_id>/ instead of being kept one file per block:
+ *
+ *   pack-XXXXXXXX.dat   records of [magic, block id, length, data]
+ *   index               append-only log of (block id -> pack, offset, length)
+ *                       entries, removals are logged as tombstones
+ *
+ * The index is loaded into memory the first time a store is used. Removed
+ * blocks leave dead space in the packs. Once the dead bytes outweigh the
+ * live ones, the store is compacted by copying the live blocks into new
+ * packs and writing a fresh index. The copy is done without the store
+ * lock, so reads and writes go on meanwhile.
+ *
+ * The files are handled by pack-store.c, this backend keeps the index of
+ * each store in a hash table.
+ *
+ * Blocks that still live in the one-file-per-block layout are served by a
+ * wrapped filesystem backend, so existing libraries keep working after
+ * switching to this backend.
+ */
+
+#define PACK_DIR "packs"
+#define PACK_MAX_SIZE ((guint64)256 << 20)
+#define PACK_COMPACT_MIN_DEAD ((guint64)64 << 20)
+
+#define PACK_RECORD_MAGIC 0x4b4c4253    /* "SBLK" */
+#define PACK_INDEX_MAGIC 0x58444953     /* "SIDX" */
+
+/* magic(4) id(20) pack(4) len(4) offset(8) */
+#define PACK_INDEX_ENTRY_SIZE 40
+
+typedef struct BlockPackStore {
+    PackStore base;
+    GHashTable *entries;        /* PackRecord set, keyed by id */
+    guint64 live_bytes;
+    guint64 total_bytes;
+    /* A compaction is copying blocks, see compact_store(). */
+    gboolean compacting;
+} BlockPackStore;
+
+typedef struct {
+    BlockBackend *loose;
+    PackStoreSet *stores;
+} PackPriv;
+
+struct _BHandle {
+    int rw_type;
+    char *store_id;
+    char block_id[41];
+    /* Handle of the wrapped backend for blocks not in a pack. */
+    struct _BHandle *loose;
+    /* BLOCK_READ */
+    int fd;
+    guint32 len;
+    guint32 pos;
+    /* Offset of the block data in the pack. */
+    guint64 offset;
+    /* Page aligned mapping around the block data, see
+     * block_backend_pack_map_block(). */
+    void *map;
+    size_t map_len;
+    /* BLOCK_WRITE */
+    GByteArray *buf;
+};
+
+static guint
+pack_record_hash (gconstpointer key)
+{
+    const PackRecord *e = key;
+    guint h;
+
+    /* Block ids are SHA-1 digests, any 4 bytes are well distributed. */
+    memcpy (&h, e->id, sizeof(h));
+    return h;
+}
+
+static gboolean
+pack_record_equal (gconstpointer a, gconstpointer b)
+{
+    return memcmp (((const PackRecord *)a)->id,
+                   ((const PackRecord *)b)->id, 20) == 0;
+}
+
+static void
+encode_index_entry (unsigned char *p, const PackRecord *e)
+{
+    guint32 u32;
+    guint64 u64;
+
+    u32 = GUINT32_TO_LE (PACK_INDEX_MAGIC);
+    memcpy (p, &u32, 4);
+    memcpy (p + 4, e->id, 20);
+    u32 = GUINT32_TO_LE (e->pack);
+    memcpy (p + 24, &u32, 4);
+    u32 = GUINT32_TO_LE (e->len);
+    memcpy (p + 28, &u32, 4);
+    u64 = GUINT64_TO_LE (e->offset);
+    memcpy (p + 32, &u64, 8);
+}
+
+static gboolean
+decode_index_entry (const unsigned char *p, PackRecord *e)
+{
+    guint32 u32;
+    guint64 u64;
+
+    memcpy (&u32, p, 4);
+    if (GUINT32_FROM_LE (u32) != PACK_INDEX_MAGIC)
+        return FALSE;
+    memcpy (e->id, p + 4, 20);
+    memcpy (&u32, p + 24, 4);
+    e->pack = GUINT32_FROM_LE (u32);
+    memcpy (&u32, p + 28, 4);
+    e->len = GUINT32_FROM_LE (u32);
+    memcpy (&u64, p + 32, 8);
+    e->offset = GUINT64_FROM_LE (u64);
+    return TRUE;
+}
+
+static int
+append_index_entry (BlockPackStore *store, const PackRecord *e)
+{
+    unsigned char buf[PACK_INDEX_ENTRY_SIZE];
+
+    encode_index_entry (buf, e);
+    return pack_store_append_index (&store->base, buf);
+}
+
+static void
+block_store_init (PackStore *base)
+{
+    BlockPackStore *store = (BlockPackStore *)base;
+
+    store->entries = g_hash_table_new_full (pack_record_hash, pack_record_equal,
+                                            g_free, NULL);
+}
+
+static void
+block_store_finalize (PackStore *base)
+{
+    BlockPackStore *store = (BlockPackStore *)base;
+
+    g_hash_table_destroy (store->entries);
+}
+
+/*
+ * Packs that the index doesn't reference are left over from a compaction
+ * and are removed, except the newest one which is appended to.
+ */
+static void
+remove_unreferenced_packs (BlockPackStore *store, GHashTable *sizes)
+{
+    GHashTable *referenced;
+    GHashTableIter iter;
+    gpointer key, value;
+    guint32 pack;
+    char *path;
+
+    referenced = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_hash_table_iter_init (&iter, store->entries);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        g_hash_table_add (referenced,
+                          GUINT_TO_POINTER(((PackRecord *)key)->pack));
+
+    store->total_bytes = 0;
+    g_hash_table_iter_init (&iter, sizes);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        pack = GPOINTER_TO_UINT(key);
+        if (pack != store->base.cur_pack &&
+            !g_hash_table_contains (referenced, key)) {
+            path = pack_store_pack_path (&store->base, pack);
+            g_unlink (path);
+            g_free (path);
+        } else {
+            store->total_bytes += GPOINTER_TO_UINT(value);
+        }
+    }
+
+    g_hash_table_destroy (referenced);
+}
+
+static gboolean
+block_store_load (PackStore *base, const unsigned char *entries,
+                  guint n_entries, GHashTable *sizes)
+{
+    BlockPackStore *store = (BlockPackStore *)base;
+    PackRecord e, *old;
+    gpointer value;
+    gboolean rewrite = FALSE;
+    guint i;
+
+    for (i = 0; i < n_entries; ++i) {
+        if (!decode_index_entry (entries + i * PACK_INDEX_ENTRY_SIZE, &e)) {
+            seaf_warning ("[pack bend] Corrupt entry %u in index of %s.\n",
+                          i, base->dir);
+            rewrite = TRUE;
+            break;
+        }
+
+        /* After a crash the index may reference data that never made it
+         * into the pack. */
+        if (e.pack != PACK_TOMBSTONE &&
+            (!g_hash_table_lookup_extended (sizes, GUINT_TO_POINTER(e.pack),
+                                            NULL, &value) ||
+             e.offset < PACK_RECORD_HEADER_SIZE ||
+             e.offset + e.len > GPOINTER_TO_UINT(value))) {
+            rewrite = TRUE;
+            continue;
+        }
+
+        old = g_hash_table_lookup (store->entries, &e);
+        if (old) {
+            store->live_bytes -= old->len + PACK_RECORD_HEADER_SIZE;
+            g_hash_table_remove (store->entries, old);
+        }
+        if (e.pack == PACK_TOMBSTONE)
+            continue;
+
+        g_hash_table_add (store->entries, g_memdup (&e, sizeof(e)));
+        store->live_bytes += e.len + PACK_RECORD_HEADER_SIZE;
+    }
+
+    remove_unreferenced_packs (store, sizes);
+
+    return rewrite;
+}
+
+static void
+block_store_unload (PackStore *base)
+{
+    BlockPackStore *store = (BlockPackStore *)base;
+
+    g_hash_table_remove_all (store->entries);
+    store->live_bytes = 0;
+    store->total_bytes = 0;
+}
+
+static void
+block_store_write_index (PackStore *base, PackIndexWriter *writer)
+{
+    BlockPackStore *store = (BlockPackStore *)base;
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init (&iter, store->entries);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        encode_index_entry (pack_index_writer_add (writer), key);
+}
+
+static const PackStoreClass block_store_class = {
+    PACK_RECORD_MAGIC,
+    PACK_MAX_SIZE,
+    PACK_INDEX_ENTRY_SIZE,
+    sizeof(BlockPackStore),
+    block_store_init,
+    block_store_finalize,
+    block_store_load,
+    block_store_unload,
+    block_store_write_index,
+};
+
+static BlockPackStore *
+get_store (BlockBackend *bend, const char *store_id, gboolean create)
+{
+    PackPriv *priv = bend->be_priv;
+
+    return (BlockPackStore *)pack_store_set_get (priv->stores, store_id, create);
+}
+
+/*
+ * Look up a block and lock its store. Returns NULL, with no lock held, if
+ * the block is not packed.
+ */
+static PackRecord *
+lock_entry (BlockBackend *bend, const char *store_id, const char *block_id,
+            BlockPackStore **pstore)
+{
+    PackPriv *priv = bend->be_priv;
+    BlockPackStore *store;
+    PackRecord key, *e;
+
+    store = (BlockPackStore *)pack_store_set_lock (priv->stores, store_id, FALSE);
+    if (!store)
+        return NULL;
+
+    hex_to_rawdata (block_id, key.id, 20);
+    e = g_hash_table_lookup (store->entries, &key);
+    if (!e) {
+        g_mutex_unlock (&store->base.lock);
+        return NULL;
+    }
+
+    *pstore = store;
+    return e;
+}
+
+/* Must be called with store->lock held. */
+static gboolean
+has_entry (BlockPackStore *store, const unsigned char *id)
+{
+    PackRecord key;
+
+    memcpy (key.id, id, 20);
+    return g_hash_table_contains (store->entries, &key);
+}
+
+/* Append a block and log it in the index. Must be called with
+ * store->lock held. */
+static int
+add_block (BlockPackStore *store, const unsigned char *id,
+           const void *data, guint32 len)
+{
+    PackRecord e;
+
+    if (pack_store_append (&store->base, id, data, len,
+                           &e.pack, &e.offset) < 0)
+        return -1;
+    store->total_bytes += len + PACK_RECORD_HEADER_SIZE;
+
+    memcpy (e.id, id, 20);
+    e.len = len;
+    if (append_index_entry (store, &e) < 0)
+        return -1;
+
+    g_hash_table_add (store->entries, g_memdup (&e, sizeof(e)));
+    store->live_bytes += e.len + PACK_RECORD_HEADER_SIZE;
+    return 0;
+}
+
+static int
+compare_entry_position (const void *a, const void *b)
+{
+    const PackRecord *ea = a, *eb = b;
+
+    if (ea->pack != eb->pack)
+        return (ea->pack < eb->pack) ? -1 : 1;
+    if (ea->offset != eb->offset)
+        return (ea->offset < eb->offset) ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Copy the live blocks into new packs, write a fresh index and drop the
+ * old packs. Called without store->lock, after the caller set
+ * store->compacting.
+ *
+ * The live entries are taken under the lock, and new blocks go to a new
+ * pack from then on. The blocks are copied without the lock. The lock is
+ * only taken again to put the new packs in place, point the entries that
+ * are still live at them and rewrite the index. Readers that already
+ * opened an old pack keep reading from their own fd.
+ */
+static int
+compact_store (BlockPackStore *store)
+{
+    PackStore *base = &store->base;
+    PackRecord *live = NULL, *moved = NULL, *e;
+    GHashTableIter iter;
+    gpointer key;
+    guint generation;
+    guint32 old_max, first, n_packs = 0;
+    guint64 old_bytes, last_size = 0, copied = 0;
+    guint n_live = 0, i;
+    int ret = 0;
+
+    g_mutex_lock (&base->lock);
+
+    if (!base->loaded) {
+        store->compacting = FALSE;
+        g_mutex_unlock (&base->lock);
+        return -1;
+    }
+
+    seaf_message ("[pack bend] Compacting %s: %" G_GUINT64_FORMAT
+                  " live bytes out of %" G_GUINT64_FORMAT ".\n",
+                  base->dir, store->live_bytes, store->total_bytes);
+
+    generation = base->generation;
+    live = g_new (PackRecord, g_hash_table_size (store->entries) + 1);
+    g_hash_table_iter_init (&iter, store->entries);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        live[n_live++] = *(PackRecord *)key;
+
+    /* Blocks written from now on go to packs that are kept. */
+    old_max = base->cur_pack;
+    old_bytes = store->total_bytes;
+    pack_store_next_pack (base);
+
+    g_mutex_unlock (&base->lock);
+
+    /* Read the old packs sequentially. */
+    qsort (live, n_live, sizeof(PackRecord), compare_entry_position);
+    moved = g_new (PackRecord, n_live + 1);
+    ret = pack_store_copy_records (base, live, n_live, moved, &n_packs,
+                                   &last_size, &copied);
+
+    g_mutex_lock (&base->lock);
+
+    /* The store was removed or reloaded meanwhile. */
+    if (ret == 0 && (base->generation != generation || !base->loaded))
+        ret = -1;
+    if (ret < 0)
+        goto out;
+
+    if (pack_store_install_compacted (base, n_packs, last_size, &first) < 0) {
+        /* The renamed packs are not referenced, reload from disk. */
+        pack_store_unload (base);
+        ret = -1;
+        goto out;
+    }
+
+    /* Blocks removed during the copy stay dead in the new packs. */
+    for (i = 0; i < n_live; ++i) {
+        e = g_hash_table_lookup (store->entries, &live[i]);
+        if (!e || e->pack != live[i].pack || e->offset != live[i].offset)
+            continue;
+        e->pack = first + moved[i].pack;
+        e->offset = moved[i].offset;
+    }
+    store->total_bytes = store->total_bytes - old_bytes + copied;
+
+    /* The old packs are only removed once the new packs, the index that
+     * points into them and the directory entries are all on disk. On
+     * failure the old index is still in place, reload it. */
+    if (pack_store_rewrite_index (base) < 0) {
+        pack_store_unload (base);
+        ret = -1;
+        goto out;
+    }
+    pack_store_remove_packs (base, old_max);
+
+out:
+    store->compacting = FALSE;
+    g_mutex_unlock (&base->lock);
+
+    if (ret < 0)
+        pack_store_discard_compacted (base, n_packs);
+
+    g_free (moved);
+    g_free (live);
+    return ret;
+}
+
+static BHandle *
+block_backend_pack_open_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id,
+                               int rw_type)
+{
+    PackPriv *priv = bend->be_priv;
+    BlockPackStore *store;
+    PackRecord *e;
+    BHandle *handle;
+    BHandle *loose;
+    int fd = -1;
+    guint32 len = 0;
+    guint64 offset = 0;
+
+    g_return_val_if_fail (block_id != NULL, NULL);
+    g_return_val_if_fail (strlen(block_id) == 40, NULL);
+    g_return_val_if_fail (rw_type == BLOCK_READ || rw_type == BLOCK_WRITE, NULL);
+
+    if (rw_type == BLOCK_READ) {
+        e = lock_entry (bend, store_id, block_id, &store);
+        if (!e) {
+            loose = priv->loose->open_block (priv->loose, store_id, version,
+                                             block_id, rw_type);
+            if (!loose)
+                return NULL;
+
+            handle = g_new0 (BHandle, 1);
+            handle->rw_type = rw_type;
+            handle->loose = loose;
+            memcpy (handle->block_id, block_id, 41);
+            return handle;
+        }
+
+        len = e->len;
+        offset = e->offset;
+        fd = pack_store_open_record (&store->base, e->pack, e->offset);
+        g_mutex_unlock (&store->base.lock);
+        if (fd < 0)
+            return NULL;
+    }
+
+    handle = g_new0 (BHandle, 1);
+    handle->rw_type = rw_type;
+    handle->store_id = g_strdup (store_id);
+    memcpy (handle->block_id, block_id, 41);
+    handle->fd = fd;
+    handle->len = len;
+    handle->offset = offset;
+    if (rw_type == BLOCK_WRITE)
+        handle->buf = g_byte_array_new ();
+
+    return handle;
+}
+
+static int
+block_backend_pack_read_block (BlockBackend *bend,
+                               BHandle *handle,
+                               void *buf, int len)
+{
+    PackPriv *priv = bend->be_priv;
+    int n;
+
+    if (handle->loose)
+        return priv->loose->read_block (priv->loose, handle->loose, buf, len);
+
+    if (len > handle->len - handle->pos)
+        len = handle->len - handle->pos;
+    if (len == 0)
+        return 0;
+
+    n = readn (handle->fd, buf, len);
+    if (n > 0)
+        handle->pos += n;
+    return n;
+}
+
+static int
+block_backend_pack_write_block (BlockBackend *bend,
+                                BHandle *handle,
+                                const void *buf, int len)
+{
+    g_byte_array_append (handle->buf, buf, len);
+    return len;
+}
+
+static int
+block_backend_pack_commit_block (BlockBackend *bend,
+                                 BHandle *handle)
+{
+    BlockPackStore *store;
+    unsigned char id[20];
+    int ret = 0;
+
+    g_return_val_if_fail (handle->rw_type == BLOCK_WRITE, -1);
+
+    store = get_store (bend, handle->store_id, TRUE);
+
+    hex_to_rawdata (handle->block_id, id, 20);
+
+    g_mutex_lock (&store->base.lock);
+
+    if (pack_store_ensure_loaded (&store->base) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    /* Block ids are content hashes, an existing copy is identical. */
+    if (has_entry (store, id))
+        goto out;
+
+    if (add_block (store, id, handle->buf->data, handle->buf->len) < 0) {
+        seaf_warning ("[pack bend] Failed to commit block %s:%s.\n",
+                      handle->store_id, handle->block_id);
+        ret = -1;
+    }
+
+out:
+    g_mutex_unlock (&store->base.lock);
+    return ret;
+}
+
+#ifndef WIN32
+/* Packs are only appended to, and replaced as a whole by compaction, so
+ * the mapped part of a pack doesn't change under the mapping. */
+static const void *
+block_backend_pack_map_block (BlockBackend *bend,
+                              BHandle *handle,
+                              guint32 *len)
+{
+    PackPriv *priv = bend->be_priv;
+    guint64 page, start;
+    void *map;
+
+    if (handle->loose)
+        return priv->loose->map_block (priv->loose, handle->loose, len);
+
+    if (handle->rw_type != BLOCK_READ || handle->fd < 0 || handle->len == 0)
+        return NULL;
+
+    page = (guint64)sysconf (_SC_PAGESIZE);
+    start = handle->offset - handle->offset % page;
+
+    if (!handle->map) {
+        map = mmap (NULL, (size_t)(handle->offset - start + handle->len),
+                    PROT_READ, MAP_SHARED, handle->fd, (off_t)start);
+        if (map == MAP_FAILED) {
+            seaf_warning ("[pack bend] Failed to map block %s: %s.\n",
+                          handle->block_id, strerror(errno));
+            return NULL;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise (map, (size_t)(handle->offset - start + handle->len),
+                 MADV_SEQUENTIAL);
+#endif
+        handle->map = map;
+        handle->map_len = (size_t)(handle->offset - start + handle->len);
+    }
+
+    *len = handle->len;
+    return (const char *)handle->map + (handle->offset - start);
+}
+#endif
+
+static void
+unmap_block (BHandle *handle)
+{
+#ifndef WIN32
+    if (handle->map) {
+        munmap (handle->map, handle->map_len);
+        handle->map = NULL;
+    }
+#endif
+}
+
+static int
+block_backend_pack_close_block (BlockBackend *bend,
+                                BHandle *handle)
+{
+    PackPriv *priv = bend->be_priv;
+    int ret = 0;
+
+    if (handle->loose)
+        return priv->loose->close_block (priv->loose, handle->loose);
+
+    unmap_block (handle);
+    if (handle->fd >= 0) {
+        ret = close (handle->fd);
+        handle->fd = -1;
+    }
+    return ret;
+}
+
+static void
+block_backend_pack_block_handle_free (BlockBackend *bend,
+                                      BHandle *handle)
+{
+    PackPriv *priv = bend->be_priv;
+
+    if (handle->loose)
+        priv->loose->block_handle_free (priv->loose, handle->loose);
+    unmap_block (handle);
+    if (handle->buf)
+        g_byte_array_free (handle->buf, TRUE);
+    g_free (handle->store_id);
+    g_free (handle);
+}
+
+static gboolean
+block_backend_pack_block_exists (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_sha1)
+{
+    PackPriv *priv = bend->be_priv;
+    BlockPackStore *store;
+
+    if (lock_entry (bend, store_id, block_sha1, &store)) {
+        g_mutex_unlock (&store->base.lock);
+        return TRUE;
+    }
+
+    return priv->loose->exists (priv->loose, store_id, version, block_sha1);
+}
+
+static int
+block_backend_pack_remove_block (BlockBackend *bend,
+                                 const char *store_id,
+                                 int version,
+                                 const char *block_id)
+{
+    PackPriv *priv = bend->be_priv;
+    BlockPackStore *store;
+    PackRecord *e, tombstone;
+    guint64 dead;
+    gboolean compact = FALSE;
+    int ret = 0;
+
+    e = lock_entry (bend, store_id, block_id, &store);
+    if (!e)
+        return priv->loose->remove_block (priv->loose, store_id, version, block_id);
+
+    tombstone = *e;
+    tombstone.pack = PACK_TOMBSTONE;
+    if (append_index_entry (store, &tombstone) < 0) {
+        ret = -1;
+        goto out;
+    }
+    store->live_bytes -= e->len + PACK_RECORD_HEADER_SIZE;
+    g_hash_table_remove (store->entries, e);
+
+    dead = store->total_bytes - store->live_bytes;
+    if (dead >= PACK_COMPACT_MIN_DEAD && dead > store->live_bytes &&
+        !store->compacting) {
+        store->compacting = TRUE;
+        compact = TRUE;
+    }
+
+out:
+    g_mutex_unlock (&store->base.lock);
+
+    if (compact)
+        compact_store (store);
+    return ret;
+}
+
+static BMetadata *
+block_backend_pack_stat_block (BlockBackend *bend,
+                               const char *store_id,
+                               int version,
+                               const char *block_id)
+{
+    PackPriv *priv = bend->be_priv;
+    BlockPackStore *store;
+    PackRecord *e;
+    BMetadata *block_md;
+
+    e = lock_entry (bend, store_id, block_id, &store);
+    if (!e)
+        return priv->loose->stat_block (priv->loose, store_id, version, block_id);
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, block_id, 40);
+    block_md->size = e->len;
+    g_mutex_unlock (&store->base.lock);
+
+    return block_md;
+}
+
+static BMetadata *
+block_backend_pack_stat_block_by_handle (BlockBackend *bend,
+                                         BHandle *handle)
+{
+    PackPriv *priv = bend->be_priv;
+    BMetadata *block_md;
+
+    if (handle->loose)
+        return priv->loose->stat_block_by_handle (priv->loose, handle->loose);
+
+    block_md = g_new0 (BMetadata, 1);
+    memcpy (block_md->id, handle->block_id, 40);
+    if (handle->rw_type == BLOCK_WRITE)
+        block_md->size = handle->buf->len;
+    else
+        block_md->size = handle->len;
+
+    return block_md;
+}
+
+static int
+block_backend_pack_foreach_block (BlockBackend *bend,
+                                  const char *store_id,
+                                  int version,
+                                  SeafBlockFunc process,
+                                  void *user_data)
+{
+    PackPriv *priv = bend->be_priv;
+    BlockPackStore *store;
+    GHashTableIter iter;
+    gpointer key;
+    char *ids = NULL;
+    guint n = 0, i;
+
+    store = get_store (bend, store_id, FALSE);
+    if (store) {
+        /* Don't call back with the lock held, process may remove blocks. */
+        g_mutex_lock (&store->base.lock);
+        if (pack_store_ensure_loaded (&store->base) == 0) {
+            ids = g_malloc (g_hash_table_size (store->entries) * 41 + 1);
+            g_hash_table_iter_init (&iter, store->entries);
+            while (g_hash_table_iter_next (&iter, &key, NULL)) {
+                rawdata_to_hex (((PackRecord *)key)->id, ids + n * 41, 20);
+                ++n;
+            }
+        }
+        g_mutex_unlock (&store->base.lock);
+
+        for (i = 0; i < n; ++i) {
+            if (!process (store_id, version, ids + i * 41, user_data)) {
+                g_free (ids);
+                return 0;
+            }
+        }
+        g_free (ids);
+    }
+
+    return priv->loose->foreach_block (priv->loose, store_id, version,
+                                       process, user_data);
+}
+
+static int
+block_backend_pack_copy (BlockBackend *bend,
+                         const char *src_store_id,
+                         int src_version,
+                         const char *dst_store_id,
+                         int dst_version,
+                         const char *block_id)
+{
+    PackPriv *priv = bend->be_priv;
+    BlockPackStore *src, *dst;
+    PackRecord *e, rec;
+    void *data = NULL;
+    int ret = 0;
+
+    if (block_backend_pack_block_exists (bend, dst_store_id, dst_version, block_id))
+        return 0;
+
+    /* Not packed in the source store, let the loose backend link it. */
+    e = lock_entry (bend, src_store_id, block_id, &src);
+    if (!e)
+        return priv->loose->copy (priv->loose, src_store_id, src_version,
+                                  dst_store_id, dst_version, block_id);
+
+    rec = *e;
+    g_mutex_unlock (&src->base.lock);
+
+    if (pack_store_read_record (&src->base, &rec, &data) < 0) {
+        seaf_warning ("[pack bend] Failed to read block %s:%s.\n",
+                      src_store_id, block_id);
+        return -1;
+    }
+
+    dst = get_store (bend, dst_store_id, TRUE);
+
+    g_mutex_lock (&dst->base.lock);
+    if (pack_store_ensure_loaded (&dst->base) < 0 ||
+        (!has_entry (dst, rec.id) && add_block (dst, rec.id, data, rec.len) < 0))
+        ret = -1;
+    g_mutex_unlock (&dst->base.lock);
+
+    g_free (data);
+    return ret;
+}
+
+static int
+block_backend_pack_remove_store (BlockBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->be_priv;
+
+    pack_store_set_remove_store (priv->stores, store_id);
+
+    return priv->loose->remove_store (priv->loose, store_id);
+}
+
+gboolean
+block_backend_pack_in_use (const char *seaf_dir)
+{
+    char *dir = g_build_filename (seaf_dir, "storage", PACK_DIR, NULL);
+    gboolean ret = g_file_test (dir, G_FILE_TEST_IS_DIR);
+
+    g_free (dir);
+    return ret;
+}
+
+extern BlockBackend *
+block_backend_fs_new (const char *seaf_dir, const char *tmp_dir);
+
+BlockBackend *
+block_backend_pack_new (const char *seaf_dir, const char *tmp_dir)
+{
+    BlockBackend *bend;
+    PackPriv *priv;
+    char *pack_dir = NULL;
+
+    bend = g_new0(BlockBackend, 1);
+    priv = g_new0(PackPriv, 1);
+    bend->be_priv = priv;
+
+    priv->loose = block_backend_fs_new (seaf_dir, tmp_dir);
+    if (!priv->loose)
+        goto onerror;
+
+    pack_dir = g_build_filename (seaf_dir, "storage", PACK_DIR, NULL);
+    if (checkdir_with_mkdir (pack_dir) < 0) {
+        seaf_warning ("Block pack dir %s does not exist and"
+                      " is unable to create\n", pack_dir);
+        goto onerror;
+    }
+
+    priv->stores = pack_store_set_new (pack_dir, &block_store_class);
+    g_free (pack_dir);
+
+    bend->open_block = block_backend_pack_open_block;
+    bend->read_block = block_backend_pack_read_block;
+    bend->write_block = block_backend_pack_write_block;
+    bend->commit_block = block_backend_pack_commit_block;
+    bend->close_block = block_backend_pack_close_block;
+    bend->exists = block_backend_pack_block_exists;
+    bend->remove_block = block_backend_pack_remove_block;
+    bend->stat_block = block_backend_pack_stat_block;
+    bend->stat_block_by_handle = block_backend_pack_stat_block_by_handle;
+    bend->block_handle_free = block_backend_pack_block_handle_free;
+#ifndef WIN32
+    bend->map_block = block_backend_pack_map_block;
+#endif
+    bend->foreach_block = block_backend_pack_foreach_block;
+    bend->remove_store = block_backend_pack_remove_store;
+    bend->copy = block_backend_pack_copy;
+
+    return bend;
+
+onerror:
+    g_free (pack_dir);
+    g_free (priv);
+    g_free (bend);
+
+    return NULL;
+}
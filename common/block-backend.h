@@ -37,6 +37,10 @@ struct BlockBackend {
 
     void     (*block_handle_free) (BlockBackend *bend, BHandle *handle);
 
+    /* Optional. Map the data of a block opened for read, see
+     * seaf_block_manager_map_block(). */
+    const void* (*map_block) (BlockBackend *bend, BHandle *handle, guint32 *len);
+
     int      (*foreach_block) (BlockBackend *bend,
                                const char *store_id,
                                int version,
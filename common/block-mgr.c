@@ -6,6 +6,7 @@
 #include "utils.h"
 #include "block-mgr.h"
 #include "log.h"
+#include "seafile-crypt.h"
 
 #include <stdio.h>
 #include <errno.h>
@@ -17,8 +18,10 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <glib/gstdio.h>
+#include <pthread.h>
 
 #include "block-backend.h"
+#include "seafile-config.h"
 
 #define SEAF_BLOCK_DIR "blocks"
 
@@ -26,22 +29,256 @@
 extern BlockBackend *
 block_backend_fs_new (const char *block_dir, const char *tmp_dir);
 
+extern BlockBackend *
+block_backend_pack_new (const char *seaf_dir, const char *tmp_dir);
+
+extern gboolean
+block_backend_pack_in_use (const char *seaf_dir);
+
+/* Block cache, see block-mgr.h. */
+
+typedef struct BlockCacheEntry {
+    /* "<store_id>/<block_id>" */
+    char key[78];
+    int version;
+    guint32 size;
+    gint64 atime;
+    GList link;
+} BlockCacheEntry;
+
+typedef struct BlockCache {
+    pthread_mutex_t lock;
+    GHashTable *entries;
+    /* Most recently used first. */
+    GQueue lru;
+    guint64 size;
+    guint64 max_size;
+} BlockCache;
+
+static BlockCache *
+block_cache_new (guint64 max_size)
+{
+    BlockCache *cache = g_new0 (BlockCache, 1);
+
+    pthread_mutex_init (&cache->lock, NULL);
+    cache->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            NULL, g_free);
+    g_queue_init (&cache->lru);
+    cache->max_size = max_size;
+
+    return cache;
+}
+
+static void
+block_cache_key (char *key, const char *store_id, const char *block_id)
+{
+    snprintf (key, 78, "%s/%s", store_id, block_id);
+}
+
+/* Called with the lock held. */
+static void
+block_cache_unlink (BlockCache *cache, BlockCacheEntry *entry)
+{
+    g_queue_unlink (&cache->lru, &entry->link);
+    cache->size -= entry->size;
+    g_hash_table_remove (cache->entries, entry->key);
+}
+
+static void
+block_cache_touch (BlockCache *cache, const char *store_id,
+                   const char *block_id)
+{
+    BlockCacheEntry *entry;
+    char key[78];
+
+    block_cache_key (key, store_id, block_id);
+
+    pthread_mutex_lock (&cache->lock);
+    entry = g_hash_table_lookup (cache->entries, key);
+    if (entry) {
+        entry->atime = (gint64)time(NULL);
+        g_queue_unlink (&cache->lru, &entry->link);
+        g_queue_push_head_link (&cache->lru, &entry->link);
+    }
+    pthread_mutex_unlock (&cache->lock);
+}
+
+static void
+block_cache_forget (BlockCache *cache, const char *store_id,
+                    const char *block_id)
+{
+    BlockCacheEntry *entry;
+    char key[78];
+
+    block_cache_key (key, store_id, block_id);
+
+    pthread_mutex_lock (&cache->lock);
+    entry = g_hash_table_lookup (cache->entries, key);
+    if (entry)
+        block_cache_unlink (cache, entry);
+    pthread_mutex_unlock (&cache->lock);
+}
+
+static void
+block_cache_forget_store (BlockCache *cache, const char *store_id)
+{
+    GList *ptr, *next;
+    BlockCacheEntry *entry;
+
+    pthread_mutex_lock (&cache->lock);
+    for (ptr = cache->lru.head; ptr; ptr = next) {
+        next = ptr->next;
+        entry = ptr->data;
+        if (strncmp (entry->key, store_id, 36) == 0)
+            block_cache_unlink (cache, entry);
+    }
+    pthread_mutex_unlock (&cache->lock);
+}
+
+/* Returns the entries to remove from the store, unlinked from the cache. */
+static GList *
+block_cache_pick_victims (BlockCache *cache)
+{
+    GList *victims = NULL;
+    GList *ptr;
+    BlockCacheEntry *entry;
+    gint64 now = (gint64)time(NULL);
+
+    while (cache->size > cache->max_size) {
+        ptr = g_queue_peek_tail_link (&cache->lru);
+        entry = ptr->data;
+        if (now - entry->atime < BLOCK_CACHE_MIN_AGE)
+            break;
+
+        g_queue_unlink (&cache->lru, ptr);
+        cache->size -= entry->size;
+        g_hash_table_steal (cache->entries, entry->key);
+        victims = g_list_prepend (victims, entry);
+    }
+
+    return victims;
+}
+
+/* Removes the block of @entry from the store and frees @entry, unless the
+ * block is pinned by a transfer. Blocks are unpinned and removed with
+ * pin_lock held, so it's held here too. Returns FALSE if it's pinned. */
+static gboolean
+block_cache_evict (SeafBlockManager *mgr, BlockCacheEntry *entry)
+{
+    pthread_mutex_lock (&mgr->pin_lock);
+    if (g_hash_table_contains (mgr->pins, entry->key)) {
+        pthread_mutex_unlock (&mgr->pin_lock);
+        return FALSE;
+    }
+    /* "<store_id>/<block_id>" */
+    entry->key[36] = '\0';
+    mgr->backend->remove_block (mgr->backend, entry->key, entry->version,
+                                entry->key + 37);
+    pthread_mutex_unlock (&mgr->pin_lock);
+
+    g_free (entry);
+    return TRUE;
+}
+
+/* Puts a pinned victim back to the front of the cache. It's evicted when
+ * it becomes the oldest again after the transfer has released it. */
+static void
+block_cache_readd (BlockCache *cache, BlockCacheEntry *entry)
+{
+    pthread_mutex_lock (&cache->lock);
+    if (g_hash_table_lookup (cache->entries, entry->key)) {
+        /* Added again in the meantime. */
+        pthread_mutex_unlock (&cache->lock);
+        g_free (entry);
+        return;
+    }
+    entry->atime = (gint64)time(NULL);
+    g_hash_table_insert (cache->entries, entry->key, entry);
+    g_queue_push_head_link (&cache->lru, &entry->link);
+    cache->size += entry->size;
+    pthread_mutex_unlock (&cache->lock);
+}
+
+void
+seaf_block_manager_cache_add (SeafBlockManager *mgr,
+                              const char *store_id,
+                              int version,
+                              const char *block_id,
+                              guint32 size)
+{
+    BlockCache *cache = mgr->cache;
+    BlockCacheEntry *entry;
+    GList *victims, *ptr;
+    char key[78];
+
+    if (!cache)
+        return;
+
+    block_cache_key (key, store_id, block_id);
+
+    pthread_mutex_lock (&cache->lock);
+
+    entry = g_hash_table_lookup (cache->entries, key);
+    if (entry) {
+        g_queue_unlink (&cache->lru, &entry->link);
+        cache->size -= entry->size;
+    } else {
+        entry = g_new0 (BlockCacheEntry, 1);
+        memcpy (entry->key, key, sizeof(key));
+        entry->link.data = entry;
+        g_hash_table_insert (cache->entries, entry->key, entry);
+    }
+    entry->version = version;
+    entry->size = size;
+    entry->atime = (gint64)time(NULL);
+    g_queue_push_head_link (&cache->lru, &entry->link);
+    cache->size += size;
+
+    victims = block_cache_pick_victims (cache);
+
+    pthread_mutex_unlock (&cache->lock);
+
+    for (ptr = victims; ptr; ptr = ptr->next) {
+        entry = ptr->data;
+        if (!block_cache_evict (mgr, entry))
+            block_cache_readd (cache, entry);
+    }
+    g_list_free (victims);
+}
+
 
 SeafBlockManager *
 seaf_block_manager_new (struct _SeafileSession *seaf,
                         const char *seaf_dir)
 {
     SeafBlockManager *mgr;
+    char *backend;
+    int cache_size;
 
     mgr = g_new0 (SeafBlockManager, 1);
     mgr->seaf = seaf;
 
-    mgr->backend = block_backend_fs_new (seaf_dir, seaf->tmp_file_dir);
+    /* Keep using the pack backend once blocks have been packed, even if the
+     * option is turned off again. Otherwise those blocks become invisible.
+     */
+    backend = seafile_session_config_get_string (seaf, KEY_BLOCK_BACKEND);
+    if (g_strcmp0 (backend, "pack") == 0 || block_backend_pack_in_use (seaf_dir))
+        mgr->backend = block_backend_pack_new (seaf_dir, seaf->tmp_file_dir);
+    else
+        mgr->backend = block_backend_fs_new (seaf_dir, seaf->tmp_file_dir);
+    g_free (backend);
     if (!mgr->backend) {
         seaf_warning ("[Block mgr] Failed to load backend.\n");
         goto onerror;
     }
 
+    mgr->pins = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+    pthread_mutex_init (&mgr->pin_lock, NULL);
+
+    cache_size = seafile_session_config_get_int (seaf, KEY_BLOCK_CACHE_SIZE, NULL);
+    if (cache_size > 0)
+        mgr->cache = block_cache_new ((guint64)cache_size << 20);
+
     return mgr;
 
 onerror:
@@ -68,6 +305,9 @@ seaf_block_manager_open_block (SeafBlockManager *mgr,
         !block_id || !is_object_id_valid(block_id))
         return NULL;
 
+    if (mgr->cache && rw_type == BLOCK_READ)
+        block_cache_touch (mgr->cache, store_id, block_id);
+
     return mgr->backend->open_block (mgr->backend,
                                      store_id, version,
                                      block_id, rw_type);
@@ -103,6 +343,16 @@ seaf_block_manager_block_handle_free (SeafBlockManager *mgr,
     mgr->backend->block_handle_free (mgr->backend, handle);
 }
 
+const void *
+seaf_block_manager_map_block (SeafBlockManager *mgr,
+                              BlockHandle *handle,
+                              guint32 *len)
+{
+    if (!mgr->backend->map_block)
+        return NULL;
+    return mgr->backend->map_block (mgr->backend, handle, len);
+}
+
 int
 seaf_block_manager_commit_block (SeafBlockManager *mgr,
                                  BlockHandle *handle)
@@ -132,9 +382,91 @@ seaf_block_manager_remove_block (SeafBlockManager *mgr,
         !block_id || !is_object_id_valid(block_id))
         return -1;
 
+    if (mgr->cache)
+        block_cache_forget (mgr->cache, store_id, block_id);
+
     return mgr->backend->remove_block (mgr->backend, store_id, version, block_id);
 }
 
+typedef struct BlockPin {
+    /* "<store_id>/<block_id>" */
+    char key[78];
+    int version;
+    int count;
+    gboolean remove;
+} BlockPin;
+
+void
+seaf_block_manager_pin_block (SeafBlockManager *mgr,
+                              const char *store_id,
+                              int version,
+                              const char *block_id)
+{
+    BlockPin *pin;
+    char key[78];
+
+    block_cache_key (key, store_id, block_id);
+
+    pthread_mutex_lock (&mgr->pin_lock);
+    pin = g_hash_table_lookup (mgr->pins, key);
+    if (!pin) {
+        pin = g_new0 (BlockPin, 1);
+        memcpy (pin->key, key, sizeof(key));
+        pin->version = version;
+        g_hash_table_insert (mgr->pins, pin->key, pin);
+    }
+    ++(pin->count);
+    pthread_mutex_unlock (&mgr->pin_lock);
+}
+
+void
+seaf_block_manager_unpin_block (SeafBlockManager *mgr,
+                                const char *store_id,
+                                const char *block_id,
+                                gboolean remove)
+{
+    BlockPin *pin;
+    char key[78];
+
+    block_cache_key (key, store_id, block_id);
+
+    /* The block is removed with the lock held, so it can't be pinned
+     * again in between. */
+    pthread_mutex_lock (&mgr->pin_lock);
+    pin = g_hash_table_lookup (mgr->pins, key);
+    if (!pin) {
+        pthread_mutex_unlock (&mgr->pin_lock);
+        return;
+    }
+
+    if (remove)
+        pin->remove = TRUE;
+    if (--(pin->count) == 0) {
+        if (pin->remove)
+            seaf_block_manager_remove_block (mgr, store_id, pin->version,
+                                             block_id);
+        g_hash_table_remove (mgr->pins, key);
+    }
+    pthread_mutex_unlock (&mgr->pin_lock);
+}
+
+gboolean
+seaf_block_manager_block_pinned (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 const char *block_id)
+{
+    gboolean ret;
+    char key[78];
+
+    block_cache_key (key, store_id, block_id);
+
+    pthread_mutex_lock (&mgr->pin_lock);
+    ret = g_hash_table_contains (mgr->pins, key);
+    pthread_mutex_unlock (&mgr->pin_lock);
+
+    return ret;
+}
+
 BlockMetadata *
 seaf_block_manager_stat_block (SeafBlockManager *mgr,
                                const char *store_id,
@@ -222,8 +554,9 @@ seaf_block_manager_verify_block (SeafBlockManager *mgr,
     BlockHandle *h;
     char buf[10240];
     int n;
-    GChecksum *cs;
-    const char *check_id;
+    SeafileSHA1Ctx *cs;
+    unsigned char sha1[20];
+    char check_id[41];
     gboolean ret;
 
     h = seaf_block_manager_open_block (mgr,
@@ -235,32 +568,32 @@ seaf_block_manager_verify_block (SeafBlockManager *mgr,
         return FALSE;
     }
 
-    cs = g_checksum_new (G_CHECKSUM_SHA1);
+    cs = seafile_sha1_new ();
     while (1) {
         n = seaf_block_manager_read_block (mgr, h, buf, sizeof(buf));
         if (n < 0) {
             seaf_warning ("Failed to read block %s:%.8s.\n", store_id, block_id);
             *io_error = TRUE;
-            g_checksum_free (cs);
+            seafile_sha1_free (cs);
             return FALSE;
         }
         if (n == 0)
             break;
 
-        g_checksum_update (cs, (guchar *)buf, n);
+        seafile_sha1_update (cs, buf, n);
     }
 
     seaf_block_manager_close_block (mgr, h);
     seaf_block_manager_block_handle_free (mgr, h);
 
-    check_id = g_checksum_get_string (cs);
+    seafile_sha1_final (cs, sha1);
+    rawdata_to_hex (sha1, check_id, 20);
 
     if (strcmp (check_id, block_id) == 0)
         ret = TRUE;
     else
         ret = FALSE;
 
-    g_checksum_free (cs);
     return ret;
 }
 
@@ -268,5 +601,8 @@ int
 seaf_block_manager_remove_store (SeafBlockManager *mgr,
                                  const char *store_id)
 {
+    if (mgr->cache)
+        block_cache_forget_store (mgr->cache, store_id);
+
     return mgr->backend->remove_store (mgr->backend, store_id);
 }
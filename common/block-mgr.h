@@ -6,6 +6,7 @@
 #include <glib.h>
 #include <glib-object.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "block.h"
 
@@ -13,10 +14,19 @@ struct _SeafileSession;
 
 typedef struct _SeafBlockManager SeafBlockManager;
 
+struct BlockCache;
+
 struct _SeafBlockManager {
     struct _SeafileSession *seaf;
 
     struct BlockBackend *backend;
+
+    /* Blocks that may be evicted, NULL if no cache size is configured. */
+    struct BlockCache *cache;
+
+    /* "<store_id>/<block_id>" -> BlockPin, see seaf_block_manager_pin_block(). */
+    GHashTable *pins;
+    pthread_mutex_t pin_lock;
 };
 
 
@@ -97,6 +107,17 @@ void
 seaf_block_manager_block_handle_free (SeafBlockManager *mgr,
                                       BlockHandle *handle);
 
+/*
+ * Map the data of a block opened for read into memory, so that it can be
+ * used without being copied. The mapping stays valid until the block is
+ * closed. Returns NULL and the block has to be read with
+ * seaf_block_manager_read_block() if the backend can't map it.
+ */
+const void *
+seaf_block_manager_map_block (SeafBlockManager *mgr,
+                              BlockHandle *handle,
+                              guint32 *len);
+
 gboolean 
 seaf_block_manager_block_exists (SeafBlockManager *mgr,
                                  const char *store_id,
@@ -109,6 +130,29 @@ seaf_block_manager_remove_block (SeafBlockManager *mgr,
                                  int version,
                                  const char *block_id);
 
+/*
+ * Blocks that are about to be checked out are pinned by their users, so
+ * that they are not removed under them. A block released with @remove
+ * set is removed once the last pin on it is dropped. Blocks that aren't
+ * pinned are left alone.
+ */
+void
+seaf_block_manager_pin_block (SeafBlockManager *mgr,
+                              const char *store_id,
+                              int version,
+                              const char *block_id);
+
+void
+seaf_block_manager_unpin_block (SeafBlockManager *mgr,
+                                const char *store_id,
+                                const char *block_id,
+                                gboolean remove);
+
+gboolean
+seaf_block_manager_block_pinned (SeafBlockManager *mgr,
+                                 const char *store_id,
+                                 const char *block_id);
+
 BlockMetadata *
 seaf_block_manager_stat_block (SeafBlockManager *mgr,
                                const char *store_id,
@@ -134,6 +178,27 @@ seaf_block_manager_copy_block (SeafBlockManager *mgr,
                                int dst_version,
                                const char *block_id);
 
+/*
+ * Block cache.
+ *
+ * If "block_cache_size" is set, blocks that can be downloaded again from
+ * the server are tracked in LRU order, by the time of their last read. When
+ * their total size is over the budget, the least recently used ones are
+ * removed from the store. Blocks used in the last BLOCK_CACHE_MIN_AGE
+ * seconds are never removed, since they may be waiting to be checked out.
+ * Blocks that are only stored locally are never tracked.
+ */
+
+#define BLOCK_CACHE_MIN_AGE 600
+
+/* Record that @block_id of @store_id also exists on the server. */
+void
+seaf_block_manager_cache_add (SeafBlockManager *mgr,
+                              const char *store_id,
+                              int version,
+                              const char *block_id,
+                              guint32 size);
+
 /* Remove all blocks for a repo. Only valid for version 1 repo. */
 int
 seaf_block_manager_remove_store (SeafBlockManager *mgr,
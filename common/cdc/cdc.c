@@ -6,6 +6,9 @@
 
 #ifndef WIN32
 #include <unistd.h>
+#include <sys/mman.h>
+#include <setjmp.h>
+#include <signal.h>
 #endif
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,13 +19,14 @@
 #include <glib/gstdio.h>
 
 #include "utils.h"
+#include "trace.h"
 
 #include "cdc.h"
 #include "../seafile-crypt.h"
 
 #include "rabin-checksum.h"
-#define finger rabin_checksum
-#define rolling_finger rabin_rolling_checksum
+#include "rabin-scan.h"
+#include "fastcdc.h"
 
 #define BLOCK_SZ        (1024*1024*1)
 #define BLOCK_MIN_SZ    (1024*256)
@@ -35,6 +39,9 @@
 
 #define READ_SIZE 1024 * 4
 
+/* Files at least this large are chunked directly from a memory mapping. */
+#define MMAP_MIN_SIZE   (1024*1024*4)
+
 #define BYTE_TO_HEX(b)  (((b)>=10)?('a'+b-10):('0'+b))
 
 static int default_write_chunk (CDCDescriptor *chunk_descr)
@@ -107,9 +114,275 @@ do {                                                         \
                                                              \
     memmove (buf, buf + _block_sz, tail - _block_sz);        \
     tail = tail - _block_sz;                                 \
-    cur = 0;                                                 \
+    scan.cur = 0;                                            \
+    scan.fingerprint = 0;                                    \
 }while(0);
 
+static uint32_t
+rabin_find_boundary (CDCFileDescriptor *file_descr,
+                     const char *buf, uint32_t len,
+                     CDCScanState *state)
+{
+    uint32_t block_min_sz = file_descr->block_min_sz;
+    uint32_t block_max_sz = file_descr->block_max_sz;
+    uint32_t block_mask = file_descr->block_sz - 1;
+    uint32_t cur = state->cur;
+    uint32_t end, pos;
+
+    /* 
+     * A block is at least of size block_min_sz.
+     */
+    if (cur < block_min_sz - 1)
+        cur = block_min_sz - 1;
+
+    /* A block is cut at block_max_sz whatever the fingerprint is. */
+    end = (len < block_max_sz - 1) ? len : block_max_sz - 1;
+
+    pos = rabin_scan ((const unsigned char *)buf, block_min_sz - 1,
+                      cur, end, block_mask, BREAK_VALUE & block_mask);
+    if (pos < end)
+        return pos + 1;
+
+    if (len >= block_max_sz)
+        return block_max_sz;
+
+    state->cur = len;
+    return 0;
+}
+
+/*
+ * FastCDC with normalized chunking: the first block_min_sz bytes are
+ * skipped without hashing, a harder mask is used before the average size
+ * and an easier one after it, which narrows the chunk size distribution.
+ */
+static uint32_t
+fastcdc_find_boundary (CDCFileDescriptor *file_descr,
+                       const char *buf, uint32_t len,
+                       CDCScanState *state)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    uint32_t block_min_sz = file_descr->block_min_sz;
+    uint32_t block_max_sz = file_descr->block_max_sz;
+    uint32_t normal_sz = file_descr->block_sz;
+    uint32_t cur = state->cur;
+    uint64_t hash = state->fingerprint;
+    uint64_t mask_s, mask_l;
+    uint32_t end;
+    int bits = 0;
+
+    while (bits < 31 && ((uint32_t)1 << (bits + 1)) <= normal_sz)
+        ++bits;
+    mask_s = fastcdc_mask (bits + 2);
+    mask_l = fastcdc_mask (bits - 2);
+
+    if (cur < block_min_sz) {
+        cur = block_min_sz;
+        hash = 0;
+    }
+    if (len > block_max_sz)
+        len = block_max_sz;
+
+    end = (normal_sz < len) ? normal_sz : len;
+    for (; cur < end; ++cur) {
+        hash = fastcdc_roll (hash, p[cur]);
+        if (!(hash & mask_s))
+            return cur + 1;
+    }
+    for (; cur < len; ++cur) {
+        hash = fastcdc_roll (hash, p[cur]);
+        if (!(hash & mask_l))
+            return cur + 1;
+    }
+
+    if (cur >= block_max_sz)
+        return block_max_sz;
+
+    state->cur = cur;
+    state->fingerprint = hash;
+    return 0;
+}
+
+static const CDCChunker chunkers[] = {
+    { CDC_ENGINE_RABIN, "rabin", rabin_find_boundary },
+    { CDC_ENGINE_FASTCDC, "fastcdc", fastcdc_find_boundary },
+};
+
+const CDCChunker *
+cdc_get_chunker (CDCEngineType engine)
+{
+    if (engine == CDC_ENGINE_FASTCDC)
+        return &chunkers[CDC_ENGINE_FASTCDC];
+    return &chunkers[CDC_ENGINE_RABIN];
+}
+
+#ifndef WIN32
+
+/*
+ * Reading a mapped page beyond the end of a file that was truncated while we
+ * were chunking it raises SIGBUS. The handler jumps back to the chunking loop
+ * of the faulting thread, which then fails the file like any other change
+ * during chunking. Only the scan and the copy out of the mapping are
+ * guarded, no lock is held there.
+ */
+static __thread sigjmp_buf *sigbus_jmp;
+static struct sigaction old_sigbus_action;
+
+static void
+sigbus_handler (int sig, siginfo_t *info, void *uctx)
+{
+    if (sigbus_jmp)
+        siglongjmp (*sigbus_jmp, 1);
+
+    /* Not caused by chunking. Pass it on to the previous handler. */
+    if (old_sigbus_action.sa_flags & SA_SIGINFO) {
+        old_sigbus_action.sa_sigaction (sig, info, uctx);
+        return;
+    }
+    if (old_sigbus_action.sa_handler != SIG_DFL &&
+        old_sigbus_action.sa_handler != SIG_IGN) {
+        old_sigbus_action.sa_handler (sig);
+        return;
+    }
+
+    /* The fault is fatal. Let the default action run when the faulting
+     * instruction is retried.
+     */
+    signal (SIGBUS, SIG_DFL);
+}
+
+static void
+install_sigbus_handler ()
+{
+    struct sigaction sa;
+
+    memset (&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sigbus_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGBUS, &sa, &old_sigbus_action);
+}
+
+/*
+ * Chunk a file from a read-only mapping. Boundaries are found in the
+ * mapping, without copying the data that is scanned. Each chunk is then
+ * copied to a private buffer before it's passed to write_block, since
+ * another process may change the file under the mapping: the block id must
+ * be computed on the same data that is stored.
+ *
+ * Returns 1 if the file cannot be mapped and the caller should fall back
+ * to reading it.
+ */
+static int
+chunk_file_mmap (int fd_src,
+                 uint64_t file_size,
+                 CDCFileDescriptor *file_descr,
+                 SeafileCrypt *crypt,
+                 gboolean write_data,
+                 GChecksum *file_ctx)
+{
+    const CDCChunker *chunker = cdc_get_chunker (file_descr->engine);
+    uint32_t block_min_sz = file_descr->block_min_sz;
+    uint32_t block_max_sz = file_descr->block_max_sz;
+    CDCDescriptor chunk_descr;
+    CDCScanState scan;
+    sigjmp_buf jmp;
+    SeafStat sb;
+    char *map, *buf;
+    uint64_t offset = 0, left;
+    uint32_t len, chunk_len;
+    gint64 start;
+    int ret = 0;
+
+    if ((uint64_t)(size_t)file_size != file_size)
+        return 1;
+
+    buf = malloc (block_max_sz);
+    if (!buf)
+        return -1;
+
+    map = mmap (NULL, (size_t)file_size, PROT_READ, MAP_SHARED, fd_src, 0);
+    if (map == MAP_FAILED) {
+        free (buf);
+        return 1;
+    }
+    posix_madvise (map, (size_t)file_size, POSIX_MADV_SEQUENTIAL);
+
+    if (sigsetjmp (jmp, 1) != 0) {
+        sigbus_jmp = NULL;
+        seaf_warning ("File size changed while chunking.\n");
+        munmap (map, (size_t)file_size);
+        free (buf);
+        return -1;
+    }
+
+    memset (&chunk_descr, 0, sizeof(chunk_descr));
+    while (offset < file_size) {
+        left = file_size - offset;
+        len = (left < block_max_sz) ? (uint32_t)left : block_max_sz;
+
+        sigbus_jmp = &jmp;
+
+        if (left < block_min_sz) {
+            chunk_len = (uint32_t)left;
+        } else {
+            memset (&scan, 0, sizeof(scan));
+            start = seaf_trace_begin ();
+            chunk_len = chunker->find_boundary (file_descr, map + offset,
+                                                len, &scan);
+            seaf_trace_end ("cdc", "find_boundary", start, NULL);
+            /* No boundary before the end of file. */
+            if (chunk_len == 0)
+                chunk_len = len;
+        }
+
+        memcpy (buf, map + offset, chunk_len);
+        sigbus_jmp = NULL;
+
+        if (file_descr->block_nr == file_descr->max_block_nr) {
+            seaf_warning ("Block id array is not large enough, bail out.\n");
+            ret = -1;
+            goto out;
+        }
+
+        chunk_descr.block_buf = buf;
+        /* Some writers hash the chunk more than once. */
+        chunk_descr.buf_cap = 0;
+        chunk_descr.user_data = file_descr->user_data;
+        chunk_descr.len = chunk_len;
+        chunk_descr.offset = offset;
+        ret = file_descr->write_block (file_descr->repo_id,
+                                       file_descr->version,
+                                       &chunk_descr,
+                                       crypt, chunk_descr.checksum,
+                                       write_data);
+        if (ret < 0) {
+            seaf_warning ("CDC: failed to write chunk.\n");
+            goto out;
+        }
+        memcpy (file_descr->blk_sha1s +
+                file_descr->block_nr * CHECKSUM_LENGTH,
+                chunk_descr.checksum, CHECKSUM_LENGTH);
+        g_checksum_update (file_ctx, chunk_descr.checksum, 20);
+        file_descr->block_nr++;
+        offset += chunk_len;
+    }
+
+    file_descr->file_size = file_size;
+
+    /* The mapping may not reflect data appended during the scan. */
+    if (seaf_fstat (fd_src, &sb) < 0 || (uint64_t)sb.st_size != file_size) {
+        seaf_warning ("File size changed while chunking.\n");
+        ret = -1;
+    }
+
+out:
+    munmap (map, (size_t)file_size);
+    free (buf);
+    return ret;
+}
+
+#endif  /* WIN32 */
+
 /* content-defined chunking */
 int file_chunk_cdc(int fd_src,
                    CDCFileDescriptor *file_descr,
@@ -120,6 +393,9 @@ int file_chunk_cdc(int fd_src,
     uint32_t buf_sz;
     GChecksum *file_ctx = g_checksum_new (G_CHECKSUM_SHA1);
     CDCDescriptor chunk_descr;
+    gsize chk_sum_len = CHECKSUM_LENGTH;
+    gint64 file_start = seaf_trace_begin ();
+    gint64 start;
     int ret = 0;
 
     SeafStat sb;
@@ -131,26 +407,48 @@ int file_chunk_cdc(int fd_src,
     uint64_t expected_size = sb.st_size;
 
     init_cdc_file_descriptor (fd_src, expected_size, file_descr);
+
+#ifndef WIN32
+    /* Memory mapping worktree files is not safe on Windows, since other
+     * programs may hold locks on them.
+     */
+    if (expected_size >= MMAP_MIN_SIZE) {
+        ret = chunk_file_mmap (fd_src, expected_size, file_descr,
+                               crypt, write_data, file_ctx);
+        if (ret < 0)
+            goto out;
+        if (ret == 0)
+            goto done;
+        /* Cannot map this file, read it instead. */
+        ret = 0;
+    }
+#endif
+
     uint32_t block_min_sz = file_descr->block_min_sz;
-    uint32_t block_mask = file_descr->block_sz - 1;
+    const CDCChunker *chunker = cdc_get_chunker (file_descr->engine);
+    CDCScanState scan;
+    uint32_t chunk_len;
 
-    int fingerprint = 0;
     int offset = 0;
-    int tail, cur, rsize;
+    int tail, rsize;
 
     buf_sz = file_descr->block_max_sz;
     buf = chunk_descr.block_buf = malloc (buf_sz);
+    /* The tail after a boundary is still needed, don't let the writer
+     * encrypt in place. */
+    chunk_descr.buf_cap = 0;
+    chunk_descr.user_data = file_descr->user_data;
     if (!buf) {
         ret = -1;
         goto out;
     }
 
     /* buf: a fix-sized buffer.
-     * cur: data behind (inclusive) this offset has been scanned.
-     *      cur + 1 is the bytes that has been scanned.
+     * scan.cur: data before this offset has been scanned.
      * tail: length of data loaded into memory. buf[tail] is invalid.
      */
-    tail = cur = 0;
+    memset (&scan, 0, sizeof(scan));
+    tail = 0;
     while (1) {
         if (tail < block_min_sz) {
             rsize = block_min_sz - tail + READ_SIZE;
@@ -177,7 +475,7 @@ int file_chunk_cdc(int fd_src,
          * 1. The data left in the file is less than block_min_sz;
          * 2. We cannot find the break value until the end of this file.
          */
-        if (tail < block_min_sz || cur >= tail) {
+        if (tail < block_min_sz || scan.cur >= tail) {
             if (tail > 0) {
                 if (file_descr->block_nr == file_descr->max_block_nr) {
                     seaf_warning ("Block id array is not large enough, bail out.\n");
@@ -189,43 +487,30 @@ int file_chunk_cdc(int fd_src,
             break;
         }
 
-        /* 
-         * A block is at least of size block_min_sz.
-         */
-        if (cur < block_min_sz - 1)
-            cur = block_min_sz - 1;
-
-        while (cur < tail) {
-            fingerprint = (cur == block_min_sz - 1) ?
-                finger(buf + cur - BLOCK_WIN_SZ + 1, BLOCK_WIN_SZ) :
-                rolling_finger (fingerprint, BLOCK_WIN_SZ, 
-                                *(buf+cur-BLOCK_WIN_SZ), *(buf + cur));
-
-            /* get a chunk, write block info to chunk file */
-            if (((fingerprint & block_mask) ==  ((BREAK_VALUE & block_mask)))
-                || cur + 1 >= file_descr->block_max_sz)
-            {
-                if (file_descr->block_nr == file_descr->max_block_nr) {
-                    seaf_warning ("Block id array is not large enough, bail out.\n");
-                    ret = -1;
-                    goto out;
-                }
-
-                WRITE_CDC_BLOCK (cur + 1, write_data);
-                break;
-            } else {
-                cur ++;
+        /* get a chunk, write block info to chunk file */
+        start = seaf_trace_begin ();
+        chunk_len = chunker->find_boundary (file_descr, buf, tail, &scan);
+        seaf_trace_end ("cdc", "find_boundary", start, NULL);
+        if (chunk_len > 0) {
+            if (file_descr->block_nr == file_descr->max_block_nr) {
+                seaf_warning ("Block id array is not large enough, bail out.\n");
+                ret = -1;
+                goto out;
             }
+
+            WRITE_CDC_BLOCK (chunk_len, write_data);
         }
     }
 
-    gsize chk_sum_len = CHECKSUM_LENGTH;
+done:
     g_checksum_get_digest (file_ctx, file_descr->file_sum, &chk_sum_len);
 
 out:
     free (buf);
     g_checksum_free (file_ctx);
 
+    seaf_trace_end ("cdc", "chunk_file", file_start, NULL);
+
     return ret;
 }
 
@@ -245,7 +530,289 @@ int filename_chunk_cdc(const char *filename,
     return ret;
 }
 
+int filename_first_chunk_cdc (const char *filename,
+                              CDCFileDescriptor *file_descr,
+                              SeafileCrypt *crypt,
+                              uint8_t *checksum)
+{
+    const CDCChunker *chunker = cdc_get_chunker (file_descr->engine);
+    CDCDescriptor chunk_descr;
+    CDCScanState scan;
+    char *buf = NULL;
+    uint32_t len, chunk_len = 0;
+    int n;
+    int ret = 0;
+
+    if (file_descr->block_min_sz <= 0)
+        file_descr->block_min_sz = BLOCK_MIN_SZ;
+    if (file_descr->block_max_sz <= 0)
+        file_descr->block_max_sz = BLOCK_MAX_SZ;
+    if (file_descr->block_sz <= 0)
+        file_descr->block_sz = BLOCK_SZ;
+    if (file_descr->write_block == NULL)
+        file_descr->write_block = (WriteblockFunc)default_write_chunk;
+
+    int fd_src = seaf_util_open (filename, O_RDONLY | O_BINARY);
+    if (fd_src < 0) {
+        seaf_warning ("CDC: failed to open %s.\n", filename);
+        return -1;
+    }
+
+    buf = malloc (file_descr->block_max_sz);
+    if (!buf) {
+        ret = -1;
+        goto out;
+    }
+
+    n = readn (fd_src, buf, file_descr->block_max_sz);
+    if (n <= 0) {
+        if (n < 0)
+            seaf_warning ("CDC: failed to read: %s.\n", strerror(errno));
+        ret = -1;
+        goto out;
+    }
+    len = (uint32_t)n;
+
+    /* Same boundary as in the first iteration of chunk_file_mmap(). */
+    if (len >= file_descr->block_min_sz) {
+        memset (&scan, 0, sizeof(scan));
+        chunk_len = chunker->find_boundary (file_descr, buf, len, &scan);
+    }
+    if (chunk_len == 0)
+        chunk_len = len;
+
+    memset (&chunk_descr, 0, sizeof(chunk_descr));
+    chunk_descr.block_buf = buf;
+    chunk_descr.len = chunk_len;
+    chunk_descr.user_data = file_descr->user_data;
+    if (file_descr->write_block (file_descr->repo_id,
+                                 file_descr->version,
+                                 &chunk_descr,
+                                 crypt, chunk_descr.checksum,
+                                 FALSE) < 0) {
+        seaf_warning ("CDC: failed to checksum chunk.\n");
+        ret = -1;
+        goto out;
+    }
+    memcpy (checksum, chunk_descr.checksum, CHECKSUM_LENGTH);
+
+out:
+    free (buf);
+    close (fd_src);
+    return ret;
+}
+
+static void
+chunk_content_sum (const char *buf, uint32_t len, uint8_t *sum)
+{
+    GChecksum *ctx = g_checksum_new (G_CHECKSUM_SHA1);
+    gsize sum_len = CHECKSUM_LENGTH;
+
+    g_checksum_update (ctx, (const guchar *)buf, len);
+    g_checksum_get_digest (ctx, sum, &sum_len);
+    g_checksum_free (ctx);
+}
+
+static int
+read_at (int fd, uint64_t offset, char *buf, uint32_t len)
+{
+    if (seaf_util_lseek (fd, (gint64)offset, SEEK_SET) < 0)
+        return -1;
+    return (readn (fd, buf, len) == (ssize_t)len) ? 0 : -1;
+}
+
+/* Index of the old chunk starting at @offset, or -1. */
+static int
+find_old_chunk (const uint64_t *offsets, uint32_t n, uint64_t offset)
+{
+    uint32_t lo = 0, hi = n, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (offsets[mid] == offset)
+            return (int)mid;
+        if (offsets[mid] < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+int file_rechunk_cdc(int fd_src,
+                     CDCFileDescriptor *file_descr,
+                     SeafileCrypt *crypt,
+                     const CDCChunkMap *old,
+                     const uint8_t *old_blk_ids,
+                     CDCChunkMap *new_map)
+{
+    const CDCChunker *chunker = cdc_get_chunker (file_descr->engine);
+    GChecksum *file_ctx = g_checksum_new (G_CHECKSUM_SHA1);
+    gsize chk_sum_len = CHECKSUM_LENGTH;
+    CDCDescriptor chunk_descr;
+    CDCScanState scan;
+    uint64_t *old_offsets = NULL;
+    uint64_t file_size, old_size, offset = 0, left;
+    int64_t shift;
+    uint32_t i, len, chunk_len;
+    gboolean verifying = TRUE;
+    uint8_t sum[CHECKSUM_LENGTH];
+    const uint8_t *blk_id;
+    char *buf = NULL;
+    SeafStat sb;
+    int j, ret = 0;
+
+    memset (new_map, 0, sizeof(*new_map));
+
+    if (seaf_fstat (fd_src, &sb) < 0) {
+        seaf_warning ("CDC: failed to stat: %s.\n", strerror(errno));
+        g_checksum_free (file_ctx);
+        return -1;
+    }
+    file_size = sb.st_size;
+
+    init_cdc_file_descriptor (fd_src, file_size, file_descr);
+
+    old_offsets = g_new (uint64_t, old->n_chunks + 1);
+    old_offsets[0] = 0;
+    for (i = 0; i < old->n_chunks; ++i)
+        old_offsets[i + 1] = old_offsets[i] + old->lens[i];
+    old_size = old_offsets[old->n_chunks];
+    /* Unchanged content after an insertion or removal is moved by this. */
+    shift = (int64_t)file_size - (int64_t)old_size;
+
+    new_map->lens = g_new (uint32_t, file_descr->max_block_nr);
+    new_map->sums = g_new (uint8_t, file_descr->max_block_nr * CHECKSUM_LENGTH);
+
+    buf = malloc (file_descr->block_max_sz);
+    if (!buf) {
+        ret = -1;
+        goto out;
+    }
+
+    memset (&chunk_descr, 0, sizeof(chunk_descr));
+    chunk_descr.block_buf = buf;
+    chunk_descr.user_data = file_descr->user_data;
+
+    i = 0;
+    while (offset < file_size) {
+        left = file_size - offset;
+
+        if (file_descr->block_nr == file_descr->max_block_nr) {
+            seaf_warning ("Block id array is not large enough, bail out.\n");
+            ret = -1;
+            goto out;
+        }
+
+        if (verifying && i < old->n_chunks) {
+            len = old->lens[i];
+            /* The last old chunk was cut at the end of the file, not at a
+             * boundary, so it can only be reused as the last chunk. */
+            if (len <= left &&
+                (i < old->n_chunks - 1 || len == left)) {
+                if (read_at (fd_src, offset, buf, len) < 0) {
+                    seaf_warning ("CDC: failed to read: %s.\n", strerror(errno));
+                    ret = -1;
+                    goto out;
+                }
+                chunk_content_sum (buf, len, sum);
+                if (memcmp (sum, old->sums + i * CHECKSUM_LENGTH,
+                            CHECKSUM_LENGTH) == 0) {
+                    blk_id = old_blk_ids + i * CHECKSUM_LENGTH;
+                    chunk_len = len;
+                    ++i;
+                    goto emit;
+                }
+            }
+            verifying = FALSE;
+        }
+
+        len = (left < file_descr->block_max_sz) ? (uint32_t)left :
+            file_descr->block_max_sz;
+        if (read_at (fd_src, offset, buf, len) < 0) {
+            seaf_warning ("CDC: failed to read: %s.\n", strerror(errno));
+            ret = -1;
+            goto out;
+        }
+
+        /* Same boundaries as in chunk_file_mmap(). */
+        if (left < file_descr->block_min_sz) {
+            chunk_len = len;
+        } else {
+            memset (&scan, 0, sizeof(scan));
+            chunk_len = chunker->find_boundary (file_descr, buf, len, &scan);
+            if (chunk_len == 0)
+                chunk_len = len;
+        }
+
+        chunk_content_sum (buf, chunk_len, sum);
+
+        chunk_descr.len = chunk_len;
+        chunk_descr.offset = offset;
+        if (file_descr->write_block (file_descr->repo_id,
+                                     file_descr->version,
+                                     &chunk_descr,
+                                     crypt, chunk_descr.checksum,
+                                     TRUE) < 0) {
+            seaf_warning ("CDC: failed to write chunk.\n");
+            ret = -1;
+            goto out;
+        }
+        blk_id = chunk_descr.checksum;
+
+        /* Continue with the old chunks if this boundary is an old one. */
+        j = find_old_chunk (old_offsets, old->n_chunks,
+                            (uint64_t)((int64_t)(offset + chunk_len) - shift));
+        if (j >= 0) {
+            verifying = TRUE;
+            i = (uint32_t)j;
+        }
+
+emit:
+        memcpy (file_descr->blk_sha1s + file_descr->block_nr * CHECKSUM_LENGTH,
+                blk_id, CHECKSUM_LENGTH);
+        g_checksum_update (file_ctx, blk_id, CHECKSUM_LENGTH);
+        new_map->lens[file_descr->block_nr] = chunk_len;
+        memcpy (new_map->sums + file_descr->block_nr * CHECKSUM_LENGTH,
+                sum, CHECKSUM_LENGTH);
+        file_descr->block_nr++;
+        offset += chunk_len;
+    }
+
+    new_map->n_chunks = file_descr->block_nr;
+    file_descr->file_size = file_size;
+
+    if (seaf_fstat (fd_src, &sb) < 0 || (uint64_t)sb.st_size != file_size) {
+        seaf_warning ("File size changed while chunking.\n");
+        ret = -1;
+        goto out;
+    }
+
+    g_checksum_get_digest (file_ctx, file_descr->file_sum, &chk_sum_len);
+
+out:
+    if (ret < 0)
+        cdc_chunk_map_clear (new_map);
+    free (buf);
+    g_free (old_offsets);
+    g_checksum_free (file_ctx);
+    return ret;
+}
+
+void
+cdc_chunk_map_clear (CDCChunkMap *map)
+{
+    g_free (map->lens);
+    g_free (map->sums);
+    memset (map, 0, sizeof(*map));
+}
+
 void cdc_init ()
 {
     rabin_init (BLOCK_WIN_SZ);
+    rabin_scan_init (BLOCK_WIN_SZ);
+    fastcdc_init ();
+#ifndef WIN32
+    install_sigbus_handler ();
+#endif
 }
@@ -16,6 +16,20 @@ struct _CDCFileDescriptor;
 struct _CDCDescriptor;
 struct SeafileCrypt;
 
+/*
+ * Pluggable chunking engines.
+ *
+ * Files are chunked with Rabin unless the caller asks for another engine.
+ * Clients must split the same content at the same boundaries for blocks
+ * to dedup, so the engine of a repo can't be derived from anything that
+ * changes by itself, such as the repo version. No repo is chunked with
+ * FastCDC yet, it's only selected by seaf-bench.
+ */
+typedef enum {
+    CDC_ENGINE_RABIN = 0,
+    CDC_ENGINE_FASTCDC,
+} CDCEngineType;
+
 typedef int (*WriteblockFunc)(const char *repo_id,
                               int version,
                               struct _CDCDescriptor *chunk_descr,
@@ -36,9 +50,13 @@ typedef struct _CDCFileDescriptor {
     uint8_t  file_sum[CHECKSUM_LENGTH];
 
     WriteblockFunc write_block;
+    /* Passed to write_block in each chunk. */
+    void *user_data;
 
     char repo_id[37];
     int version;
+    /* CDC_ENGINE_RABIN, the zero value, unless set explicitly. */
+    CDCEngineType engine;
 } CDCFileDescriptor;
 
 typedef struct _CDCDescriptor {
@@ -46,9 +64,36 @@ typedef struct _CDCDescriptor {
     uint32_t len;
     uint8_t  checksum[CHECKSUM_LENGTH];
     char    *block_buf;
+    /* Allocated size of block_buf if the writer may overwrite it, e.g. to
+     * encrypt in place. 0 when block_buf must not be modified. */
+    uint32_t buf_cap;
     int result;
+    /* Copied from the file descriptor. */
+    void *user_data;
 } CDCDescriptor;
 
+/* Scan state kept across reads while looking for the end of one chunk. */
+typedef struct _CDCScanState {
+    uint32_t cur;               /* data before this offset has been scanned */
+    uint64_t fingerprint;
+} CDCScanState;
+
+typedef struct _CDCChunker {
+    CDCEngineType type;
+    const char *name;
+    /*
+     * Look for a chunk boundary in buf[0, len). Returns the chunk length if
+     * a boundary is found, or 0 if more data is needed. Implementations
+     * must never return more than file_descr->block_max_sz.
+     */
+    uint32_t (*find_boundary) (struct _CDCFileDescriptor *file_descr,
+                               const char *buf, uint32_t len,
+                               CDCScanState *state);
+} CDCChunker;
+
+const CDCChunker *
+cdc_get_chunker (CDCEngineType engine);
+
 int file_chunk_cdc(int fd_src,
                    CDCFileDescriptor *file_descr,
                    struct SeafileCrypt *crypt,
@@ -59,6 +104,47 @@ int filename_chunk_cdc(const char *filename,
                        struct SeafileCrypt *crypt,
                        gboolean write_data);
 
+/*
+ * Checksum only the first chunk of @filename, as filename_chunk_cdc()
+ * would split it. The blocks are never written. Used to find out cheaply
+ * that a file doesn't match a known block list.
+ */
+int filename_first_chunk_cdc(const char *filename,
+                             CDCFileDescriptor *file_descr,
+                             struct SeafileCrypt *crypt,
+                             uint8_t *checksum);
+
+/*
+ * Chunk boundaries of a file version and a SHA1 of the plain content of
+ * each chunk. Block ids of encrypted repos are computed on the encrypted
+ * data, so they can't be used to compare content.
+ */
+typedef struct _CDCChunkMap {
+    uint32_t n_chunks;
+    uint32_t *lens;
+    uint8_t *sums;
+} CDCChunkMap;
+
+/*
+ * Chunk a file that changed since @old was recorded for its previous
+ * version, whose block ids are @old_blk_ids. Chunks of @old that are
+ * found unchanged are reused without writing their blocks again. Where
+ * the content differs, the file is chunked from the last old boundary
+ * with the CDC engine, until a boundary lines up with an old one again.
+ * The result is the same as with file_chunk_cdc(), since a chunk boundary
+ * only depends on the content after the previous boundary.
+ *
+ * @new_map receives the chunk map of the new version.
+ */
+int file_rechunk_cdc(int fd_src,
+                     CDCFileDescriptor *file_descr,
+                     struct SeafileCrypt *crypt,
+                     const CDCChunkMap *old,
+                     const uint8_t *old_blk_ids,
+                     CDCChunkMap *new_map);
+
+void cdc_chunk_map_clear (CDCChunkMap *map);
+
 void cdc_init ();
 
 #endif
@@ -0,0 +1,33 @@
+#include "fastcdc.h"
+
+#define FASTCDC_SEED 0x5eaf11e5eaf11e00ULL
+
+uint64_t fastcdc_gear[256];
+
+/* splitmix64, used only to fill the gear table deterministically. */
+static uint64_t
+next_random (uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void fastcdc_init ()
+{
+    uint64_t state = FASTCDC_SEED;
+    int i;
+
+    for (i = 0; i < 256; ++i)
+        fastcdc_gear[i] = next_random (&state);
+}
+
+uint64_t fastcdc_mask (int bits)
+{
+    if (bits <= 0)
+        return 0;
+    if (bits >= 64)
+        return ~(uint64_t)0;
+    return ~(uint64_t)0 << (64 - bits);
+}
@@ -0,0 +1,26 @@
+#ifndef _FASTCDC_H
+#define _FASTCDC_H
+
+#include <stdint.h>
+
+/*
+ * Gear-hash based content-defined chunking (FastCDC).
+ *
+ * The gear table is generated from a fixed seed, so chunk boundaries only
+ * depend on file content and chunk size parameters.
+ */
+
+void fastcdc_init ();
+
+/* Roll one byte into the gear hash. */
+static inline uint64_t
+fastcdc_roll (uint64_t hash, unsigned char c)
+{
+    extern uint64_t fastcdc_gear[256];
+    return (hash << 1) + fastcdc_gear[c];
+}
+
+/* Mask with the @bits most significant bits set. */
+uint64_t fastcdc_mask (int bits);
+
+#endif
@@ -0,0 +1,218 @@
+#include <stdint.h>
+
+#include "rabin-checksum.h"
+#include "rabin-scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2_SCAN 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define HAVE_NEON_SCAN 1
+#include <arm_neon.h>
+#endif
+
+typedef uint32_t (*ScanFunc) (const unsigned char *buf, uint32_t first,
+                              uint32_t start, uint32_t end,
+                              uint32_t mask, uint32_t value);
+
+/*
+ * out_term[c] is what rolling byte c out of the window xors into the
+ * rolled state: rabin_rolling_checksum(csum, window, c, d) ==
+ * ((csum << 8) | d) ^ out_term[c].
+ */
+static uint32_t out_term[256];
+static int win;
+static ScanFunc scan_func;
+
+static inline uint32_t
+out_at (const unsigned char *buf, uint32_t first, uint32_t pos)
+{
+    /* The initial window is computed by rolling zeros out. */
+    return (pos > first) ? out_term[buf[pos - win]] : 0;
+}
+
+static inline uint32_t
+fingerprint_at (const unsigned char *buf, uint32_t first, uint32_t pos)
+{
+    uint32_t fp;
+
+    fp = ((uint32_t)buf[pos - 3] << 24) | ((uint32_t)buf[pos - 2] << 16) |
+         ((uint32_t)buf[pos - 1] << 8) | (uint32_t)buf[pos];
+
+    return fp ^ out_at (buf, first, pos) ^
+        (out_at (buf, first, pos - 1) << 8) ^
+        (out_at (buf, first, pos - 2) << 16) ^
+        (out_at (buf, first, pos - 3) << 24);
+}
+
+static uint32_t
+scan_scalar (const unsigned char *buf, uint32_t first,
+             uint32_t start, uint32_t end,
+             uint32_t mask, uint32_t value)
+{
+    uint32_t i = start;
+    uint32_t fp;
+
+    if (i >= end)
+        return end;
+
+    fp = fingerprint_at (buf, first, i);
+    while (1) {
+        if ((fp & mask) == value)
+            return i;
+        if (++i >= end)
+            break;
+        fp = ((fp << 8) | buf[i]) ^ out_at (buf, first, i);
+    }
+
+    return end;
+}
+
+#ifdef HAVE_AVX2_SCAN
+
+__attribute__((target("avx2")))
+static uint32_t
+scan_avx2 (const unsigned char *buf, uint32_t first,
+           uint32_t start, uint32_t end,
+           uint32_t mask, uint32_t value)
+{
+    uint32_t i = start;
+    uint32_t head_end = first + 4;
+    int k;
+
+    /* Positions right after the initial window roll zeros out. */
+    if (i < head_end) {
+        uint32_t e = (end < head_end) ? end : head_end;
+        i = scan_scalar (buf, first, i, e, mask, value);
+        if (i < e)
+            return i;
+    }
+
+    /* Lane j of the fingerprint holds position i + j. Relative to
+     * buf + i - 3, its in-bytes are at j + 3 - k and its k-th out-byte
+     * is at j + 3 - k relative to buf + i - 3 - win.
+     */
+    const __m256i in_shuf = _mm256_setr_epi8 (
+        3, 2, 1, 0, 4, 3, 2, 1, 5, 4, 3, 2, 6, 5, 4, 3,
+        7, 6, 5, 4, 8, 7, 6, 5, 9, 8, 7, 6, 10, 9, 8, 7);
+    __m256i out_shuf[4];
+    for (k = 0; k < 4; ++k) {
+        out_shuf[k] = _mm256_setr_epi8 (
+            3 - k, -1, -1, -1, 4 - k, -1, -1, -1,
+            5 - k, -1, -1, -1, 6 - k, -1, -1, -1,
+            7 - k, -1, -1, -1, 8 - k, -1, -1, -1,
+            9 - k, -1, -1, -1, 10 - k, -1, -1, -1);
+    }
+    const __m256i vmask = _mm256_set1_epi32 ((int)mask);
+    const __m256i vvalue = _mm256_set1_epi32 ((int)value);
+
+    /* Each step loads 16 bytes starting at i - 3. */
+    for (; i + 13 <= end; i += 8) {
+        __m128i in = _mm_loadu_si128 ((const __m128i *)(buf + i - 3));
+        __m128i out = _mm_loadu_si128 ((const __m128i *)(buf + i - 3 - win));
+        __m256i in2 = _mm256_broadcastsi128_si256 (in);
+        __m256i out2 = _mm256_broadcastsi128_si256 (out);
+        __m256i fp = _mm256_shuffle_epi8 (in2, in_shuf);
+
+        for (k = 0; k < 4; ++k) {
+            __m256i idx = _mm256_shuffle_epi8 (out2, out_shuf[k]);
+            __m256i t = _mm256_i32gather_epi32 ((const int *)out_term, idx, 4);
+            fp = _mm256_xor_si256 (fp, _mm256_sllv_epi32 (t, _mm256_set1_epi32 (8 * k)));
+        }
+
+        __m256i hit = _mm256_cmpeq_epi32 (_mm256_and_si256 (fp, vmask), vvalue);
+        int bits = _mm256_movemask_ps (_mm256_castsi256_ps (hit));
+        if (bits)
+            return i + __builtin_ctz (bits);
+    }
+
+    return scan_scalar (buf, first, i, end, mask, value);
+}
+
+#endif  /* HAVE_AVX2_SCAN */
+
+#ifdef HAVE_NEON_SCAN
+
+static uint32_t
+scan_neon (const unsigned char *buf, uint32_t first,
+           uint32_t start, uint32_t end,
+           uint32_t mask, uint32_t value)
+{
+    static const uint8_t in_idx[16] = {
+        3, 2, 1, 0, 4, 3, 2, 1, 5, 4, 3, 2, 6, 5, 4, 3
+    };
+    uint32_t i = start;
+    uint32_t head_end = first + 4;
+    uint32_t terms[7];
+    uint32_t hits[4];
+    int k;
+
+    if (i < head_end) {
+        uint32_t e = (end < head_end) ? end : head_end;
+        i = scan_scalar (buf, first, i, e, mask, value);
+        if (i < e)
+            return i;
+    }
+
+    const uint8x16_t in_tbl = vld1q_u8 (in_idx);
+    const uint32x4_t vmask = vdupq_n_u32 (mask);
+    const uint32x4_t vvalue = vdupq_n_u32 (value);
+
+    for (; i + 13 <= end; i += 4) {
+        uint8x16_t in = vld1q_u8 (buf + i - 3);
+        uint32x4_t fp = vreinterpretq_u32_u8 (vqtbl1q_u8 (in, in_tbl));
+        const unsigned char *out = buf + i - 3 - win;
+
+        /* terms[k] is the out term of position i - 3 + k. */
+        for (k = 0; k < 7; ++k)
+            terms[k] = out_term[out[k]];
+
+        fp = veorq_u32 (fp, vld1q_u32 (terms + 3));
+        fp = veorq_u32 (fp, vshlq_n_u32 (vld1q_u32 (terms + 2), 8));
+        fp = veorq_u32 (fp, vshlq_n_u32 (vld1q_u32 (terms + 1), 16));
+        fp = veorq_u32 (fp, vshlq_n_u32 (vld1q_u32 (terms), 24));
+
+        uint32x4_t hit = vceqq_u32 (vandq_u32 (fp, vmask), vvalue);
+        if (vmaxvq_u32 (hit)) {
+            vst1q_u32 (hits, hit);
+            for (k = 0; k < 4; ++k)
+                if (hits[k])
+                    return i + k;
+        }
+    }
+
+    return scan_scalar (buf, first, i, end, mask, value);
+}
+
+#endif  /* HAVE_NEON_SCAN */
+
+void rabin_scan_init (int window)
+{
+    int c;
+
+    win = window;
+    for (c = 0; c < 256; ++c)
+        out_term[c] = rabin_rolling_checksum (0, window, (char)c, 0);
+
+    scan_func = scan_scalar;
+
+#ifdef HAVE_AVX2_SCAN
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2"))
+        scan_func = scan_avx2;
+#endif
+
+#ifdef HAVE_NEON_SCAN
+    scan_func = scan_neon;
+#endif
+}
+
+uint32_t
+rabin_scan (const unsigned char *buf, uint32_t first,
+            uint32_t start, uint32_t end,
+            uint32_t mask, uint32_t value)
+{
+    return scan_func (buf, first, start, end, mask, value);
+}
@@ -0,0 +1,35 @@
+#ifndef _RABIN_SCAN_H
+#define _RABIN_SCAN_H
+
+#include <stdint.h>
+
+/*
+ * Boundary scanning for the Rabin chunker.
+ *
+ * rabin_rolling_checksum() keeps a 32-bit state that is shifted by one byte
+ * per step, so the fingerprint at a position only depends on the last four
+ * bytes rolled in and the last four bytes rolled out of the window. That
+ * lets the fingerprints of many positions be computed independently, which
+ * is what the vectorized implementations do. All implementations return
+ * exactly the same positions as rolling byte by byte.
+ */
+
+/* Must be called after rabin_init(). */
+void rabin_scan_init (int window);
+
+/*
+ * Find the first position i in [start, end) where
+ * (fingerprint(i) & mask) == value.
+ *
+ * @first is the position of the initial window, whose fingerprint is
+ * rabin_checksum(buf + first - window + 1, window). Fingerprints after it
+ * are rolled with rabin_rolling_checksum(). @start must not be less than
+ * @first, and @first must not be less than window - 1.
+ *
+ * Returns @end if no position matches.
+ */
+uint32_t rabin_scan (const unsigned char *buf, uint32_t first,
+                     uint32_t start, uint32_t end,
+                     uint32_t mask, uint32_t value);
+
+#endif
@@ -0,0 +1,464 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "commit-graph.h"
+#include "utils.h"
+#include "log.h"
+
+#define COMMIT_GRAPH_SIGNATURE "SCG1"
+/* Signature and number of records. */
+#define COMMIT_GRAPH_HEADER_SIZE 8
+/* Id, two parent ids, ctime, generation and number of parents. */
+#define COMMIT_GRAPH_RECORD_SIZE (20 * 3 + 8 + 4 + 4)
+
+/* Rewrite the file once this many commits were added since it was loaded. */
+#define COMMIT_GRAPH_SAVE_THRESHOLD 64
+
+typedef struct GraphNode {
+    unsigned char id[20];
+    unsigned char parents[2][20];
+    int n_parents;
+    gint64 ctime;
+    guint32 generation;
+} GraphNode;
+
+typedef struct CommitGraph {
+    char *path;
+    /* Content of the graph file. Records are found by binary search. */
+    guint8 *data;
+    guint32 n_records;
+    /* Commits added since the file was loaded, raw id -> GraphNode. */
+    GHashTable *added;
+    /* Commits with some ancestor that couldn't be loaded, e.g. because
+     * history is not downloaded. Not saved, the history may show up later.
+     */
+    GHashTable *incomplete;
+} CommitGraph;
+
+/* A commit whose parents are not all in the graph yet. */
+typedef struct PendingCommit {
+    char id[41];
+    char parents[2][41];
+    int n_parents;
+    gint64 ctime;
+} PendingCommit;
+
+/* repo_id -> CommitGraph. All access is done with graphs_lock held. */
+static GHashTable *graphs;
+static pthread_mutex_t graphs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+commit_graph_free (CommitGraph *graph)
+{
+    g_free (graph->path);
+    g_free (graph->data);
+    g_hash_table_destroy (graph->added);
+    g_hash_table_destroy (graph->incomplete);
+    g_free (graph);
+}
+
+static char *
+commit_graph_path (const char *repo_id)
+{
+    return g_build_filename (seaf->seaf_dir, "commit-graph", repo_id, NULL);
+}
+
+static CommitGraph *
+commit_graph_load (const char *repo_id)
+{
+    CommitGraph *graph;
+    char *data = NULL;
+    gsize len = 0;
+    const guint8 *p;
+    guint32 n;
+
+    graph = g_new0 (CommitGraph, 1);
+    graph->path = commit_graph_path (repo_id);
+    graph->added = g_hash_table_new_full (ccnet_sha1_hash, ccnet_sha1_equal,
+                                          NULL, g_free);
+    graph->incomplete = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
+
+    if (!g_file_get_contents (graph->path, &data, &len, NULL))
+        return graph;
+
+    if (len < COMMIT_GRAPH_HEADER_SIZE ||
+        memcmp (data, COMMIT_GRAPH_SIGNATURE, 4) != 0)
+        goto bad;
+
+    p = (const guint8 *)data + 4;
+    n = get32bit (&p);
+    if (len != COMMIT_GRAPH_HEADER_SIZE + (gsize)n * COMMIT_GRAPH_RECORD_SIZE)
+        goto bad;
+
+    graph->data = (guint8 *)data;
+    graph->n_records = n;
+    return graph;
+
+bad:
+    seaf_warning ("Commit graph file %s is corrupt, ignore it.\n", graph->path);
+    g_free (data);
+    return graph;
+}
+
+static CommitGraph *
+get_commit_graph (const char *repo_id)
+{
+    CommitGraph *graph;
+
+    if (!graphs)
+        graphs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify)commit_graph_free);
+
+    graph = g_hash_table_lookup (graphs, repo_id);
+    if (!graph) {
+        graph = commit_graph_load (repo_id);
+        g_hash_table_insert (graphs, g_strdup(repo_id), graph);
+    }
+
+    return graph;
+}
+
+static void
+decode_record (const guint8 *rec, GraphNode *node)
+{
+    const guint8 *p = rec + 60;
+
+    memcpy (node->id, rec, 20);
+    memcpy (node->parents[0], rec + 20, 20);
+    memcpy (node->parents[1], rec + 40, 20);
+    node->ctime = (gint64)get64bit (&p);
+    node->generation = get32bit (&p);
+    node->n_parents = get32bit (&p);
+}
+
+static void
+encode_record (const GraphNode *node, guint8 *rec)
+{
+    guint8 *p = rec + 60;
+
+    memcpy (rec, node->id, 20);
+    memcpy (rec + 20, node->parents[0], 20);
+    memcpy (rec + 40, node->parents[1], 20);
+    put64bit (&p, (guint64)node->ctime);
+    put32bit (&p, node->generation);
+    put32bit (&p, (guint32)node->n_parents);
+}
+
+static gboolean
+graph_lookup (CommitGraph *graph, const unsigned char *id, GraphNode *node)
+{
+    GraphNode *added;
+    guint32 lo = 0, hi = graph->n_records, mid;
+    const guint8 *rec;
+    int cmp;
+
+    added = g_hash_table_lookup (graph->added, id);
+    if (added) {
+        *node = *added;
+        return TRUE;
+    }
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        rec = graph->data + COMMIT_GRAPH_HEADER_SIZE +
+            (gsize)mid * COMMIT_GRAPH_RECORD_SIZE;
+        cmp = memcmp (id, rec, 20);
+        if (cmp == 0) {
+            decode_record (rec, node);
+            return TRUE;
+        } else if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return FALSE;
+}
+
+static gboolean
+graph_lookup_hex (CommitGraph *graph, const char *commit_id, GraphNode *node)
+{
+    unsigned char id[20];
+
+    if (hex_to_rawdata (commit_id, id, 20) < 0)
+        return FALSE;
+    return graph_lookup (graph, id, node);
+}
+
+static PendingCommit *
+load_pending_commit (const char *repo_id, int version, const char *commit_id)
+{
+    SeafCommit *commit;
+    PendingCommit *pending;
+
+    commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                             repo_id, version, commit_id);
+    if (!commit)
+        return NULL;
+
+    pending = g_new0 (PendingCommit, 1);
+    memcpy (pending->id, commit->commit_id, 40);
+    pending->ctime = commit->ctime;
+    if (commit->parent_id)
+        memcpy (pending->parents[pending->n_parents++], commit->parent_id, 40);
+    if (commit->second_parent_id)
+        memcpy (pending->parents[pending->n_parents++],
+                commit->second_parent_id, 40);
+
+    seaf_commit_unref (commit);
+    return pending;
+}
+
+/*
+ * Make sure @commit_id and all its ancestors are in the graph. Commits are
+ * added parents first, so that their generation can be computed. An explicit
+ * stack is used since histories can be very long.
+ */
+static int
+add_to_graph (CommitGraph *graph, const char *repo_id, int version,
+              const char *commit_id)
+{
+    GPtrArray *stack;
+    PendingCommit *pending, *parent;
+    GraphNode pnode, *node;
+    guint32 generation;
+    gboolean missing;
+    int i;
+    int ret = 0;
+
+    if (graph_lookup_hex (graph, commit_id, &pnode))
+        return 0;
+    if (g_hash_table_contains (graph->incomplete, commit_id))
+        return -1;
+
+    pending = load_pending_commit (repo_id, version, commit_id);
+    if (!pending)
+        return -1;
+
+    stack = g_ptr_array_new_with_free_func (g_free);
+    g_ptr_array_add (stack, pending);
+
+    while (stack->len > 0) {
+        pending = g_ptr_array_index (stack, stack->len - 1);
+
+        /* Already added as the parent of another commit. */
+        if (graph_lookup_hex (graph, pending->id, &pnode)) {
+            g_ptr_array_remove_index (stack, stack->len - 1);
+            continue;
+        }
+
+        generation = 0;
+        missing = FALSE;
+        for (i = 0; i < pending->n_parents; ++i) {
+            if (graph_lookup_hex (graph, pending->parents[i], &pnode)) {
+                generation = MAX (generation, pnode.generation);
+                continue;
+            }
+
+            if (g_hash_table_contains (graph->incomplete, pending->parents[i]))
+                parent = NULL;
+            else
+                parent = load_pending_commit (repo_id, version,
+                                              pending->parents[i]);
+            if (!parent) {
+                ret = -1;
+                goto out;
+            }
+            g_ptr_array_add (stack, parent);
+            missing = TRUE;
+        }
+
+        if (missing)
+            continue;
+
+        node = g_new0 (GraphNode, 1);
+        hex_to_rawdata (pending->id, node->id, 20);
+        for (i = 0; i < pending->n_parents; ++i)
+            hex_to_rawdata (pending->parents[i], node->parents[i], 20);
+        node->n_parents = pending->n_parents;
+        node->ctime = pending->ctime;
+        node->generation = generation + 1;
+        g_hash_table_replace (graph->added, node->id, node);
+
+        g_ptr_array_remove_index (stack, stack->len - 1);
+    }
+
+out:
+    /* Everything left on the stack descends from the missing commit. */
+    if (ret < 0) {
+        guint j;
+        for (j = 0; j < stack->len; ++j) {
+            pending = g_ptr_array_index (stack, j);
+            g_hash_table_add (graph->incomplete, g_strdup(pending->id));
+        }
+    }
+    g_ptr_array_free (stack, TRUE);
+    return ret;
+}
+
+static int
+compare_records (const void *a, const void *b)
+{
+    return memcmp (a, b, 20);
+}
+
+static void
+commit_graph_save (CommitGraph *graph)
+{
+    guint32 n_added = g_hash_table_size (graph->added);
+    guint32 n = graph->n_records + n_added;
+    gsize len = COMMIT_GRAPH_HEADER_SIZE + (gsize)n * COMMIT_GRAPH_RECORD_SIZE;
+    guint8 *data, *rec, *p;
+    GHashTableIter iter;
+    gpointer key, value;
+    char *dir;
+    GError *error = NULL;
+
+    data = g_malloc (len);
+    memcpy (data, COMMIT_GRAPH_SIGNATURE, 4);
+    p = data + 4;
+    put32bit (&p, n);
+
+    rec = data + COMMIT_GRAPH_HEADER_SIZE;
+    if (graph->n_records > 0) {
+        memcpy (rec, graph->data + COMMIT_GRAPH_HEADER_SIZE,
+                (gsize)graph->n_records * COMMIT_GRAPH_RECORD_SIZE);
+        rec += (gsize)graph->n_records * COMMIT_GRAPH_RECORD_SIZE;
+    }
+
+    g_hash_table_iter_init (&iter, graph->added);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        encode_record (value, rec);
+        rec += COMMIT_GRAPH_RECORD_SIZE;
+    }
+
+    qsort (data + COMMIT_GRAPH_HEADER_SIZE, n, COMMIT_GRAPH_RECORD_SIZE,
+           compare_records);
+
+    dir = g_path_get_dirname (graph->path);
+    if (g_mkdir_with_parents (dir, 0777) < 0)
+        seaf_warning ("Failed to create dir %s: %s.\n", dir, strerror(errno));
+    g_free (dir);
+
+    if (!g_file_set_contents (graph->path, (char *)data, len, &error)) {
+        seaf_warning ("Failed to save commit graph %s: %s.\n",
+                      graph->path, error->message);
+        g_clear_error (&error);
+    }
+
+    /* Keep using the merged records even if they couldn't be saved. */
+    g_free (graph->data);
+    graph->data = data;
+    graph->n_records = n;
+    g_hash_table_remove_all (graph->added);
+}
+
+/*
+ * Walk back from @head. Commits with a generation not larger than the one of
+ * @ancestor can't lead to it, so they are not expanded.
+ */
+static int
+graph_reaches (CommitGraph *graph, const GraphNode *head,
+               const GraphNode *ancestor)
+{
+    GQueue queue = G_QUEUE_INIT;
+    GHashTable *visited;
+    GraphNode *node, parent;
+    int i;
+    int ret = 0;
+
+    visited = g_hash_table_new_full (ccnet_sha1_hash, ccnet_sha1_equal,
+                                     NULL, g_free);
+
+    node = g_memdup (head, sizeof(GraphNode));
+    g_hash_table_add (visited, node);
+    g_queue_push_tail (&queue, node);
+
+    while ((node = g_queue_pop_head (&queue)) != NULL) {
+        for (i = 0; i < node->n_parents; ++i) {
+            if (memcmp (node->parents[i], ancestor->id, 20) == 0) {
+                ret = 1;
+                goto out;
+            }
+
+            if (g_hash_table_contains (visited, node->parents[i]))
+                continue;
+
+            if (!graph_lookup (graph, node->parents[i], &parent)) {
+                ret = -1;
+                goto out;
+            }
+
+            if (parent.generation <= ancestor->generation)
+                continue;
+
+            GraphNode *copy = g_memdup (&parent, sizeof(GraphNode));
+            g_hash_table_add (visited, copy);
+            g_queue_push_tail (&queue, copy);
+        }
+    }
+
+out:
+    /* Nodes in the queue are owned by the hash table. */
+    g_queue_clear (&queue);
+    g_hash_table_destroy (visited);
+    return ret;
+}
+
+int
+commit_graph_is_ancestor (const char *repo_id, int version,
+                          const char *ancestor, const char *head)
+{
+    CommitGraph *graph;
+    GraphNode anode, hnode;
+    int ret;
+
+    if (strcmp (ancestor, head) == 0)
+        return 1;
+
+    pthread_mutex_lock (&graphs_lock);
+
+    graph = get_commit_graph (repo_id);
+
+    if (add_to_graph (graph, repo_id, version, ancestor) < 0 ||
+        add_to_graph (graph, repo_id, version, head) < 0 ||
+        !graph_lookup_hex (graph, ancestor, &anode) ||
+        !graph_lookup_hex (graph, head, &hnode)) {
+        ret = -1;
+        goto out;
+    }
+
+    if (anode.generation >= hnode.generation)
+        ret = 0;
+    else
+        ret = graph_reaches (graph, &hnode, &anode);
+
+out:
+    if (g_hash_table_size (graph->added) >= COMMIT_GRAPH_SAVE_THRESHOLD ||
+        (!graph->data && g_hash_table_size (graph->added) > 0))
+        commit_graph_save (graph);
+
+    pthread_mutex_unlock (&graphs_lock);
+
+    return ret;
+}
+
+void
+commit_graph_remove (const char *repo_id)
+{
+    char *path;
+
+    pthread_mutex_lock (&graphs_lock);
+    if (graphs)
+        g_hash_table_remove (graphs, repo_id);
+    pthread_mutex_unlock (&graphs_lock);
+
+    path = commit_graph_path (repo_id);
+    seaf_util_unlink (path);
+    g_free (path);
+}
@@ -0,0 +1,36 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_COMMIT_GRAPH_H
+#define SEAF_COMMIT_GRAPH_H
+
+#include <glib.h>
+
+/*
+ * Local cache of the commit history of a repo.
+ *
+ * For each commit, the graph records its parents, ctime and generation
+ * number. The generation of a commit without parents is 1, otherwise it's
+ * one more than the largest generation of its parents. A commit can only be
+ * an ancestor of commits with a larger generation, so ancestry queries can
+ * stop walking early, and don't need to load and parse commit objects once
+ * the commits are in the graph.
+ *
+ * The graph is saved to <seaf_dir>/commit-graph/<repo_id>, as a header and
+ * fixed-size records sorted by commit id. Commits are immutable, so the file
+ * never has to be invalidated, only extended.
+ */
+
+/*
+ * Returns 1 if @ancestor is @head or an ancestor of it, 0 if not.
+ * Returns -1 if some commit in the history of @head or @ancestor can't be
+ * loaded. The caller should fall back to walking the commit objects then.
+ */
+int
+commit_graph_is_ancestor (const char *repo_id, int version,
+                          const char *ancestor, const char *head);
+
+/* Free the graph of @repo_id and remove its file. */
+void
+commit_graph_remove (const char *repo_id);
+
+#endif
@@ -4,6 +4,7 @@
 
 #include "log.h"
 
+#include <pthread.h>
 #include <jansson.h>
 
 #include "utils.h"
@@ -13,10 +14,35 @@
 #include "seafile-session.h"
 #include "commit-mgr.h"
 
+#ifndef SEAFILE_SERVER
+#include "seafile-config.h"
+#endif
+
 #define MAX_TIME_SKEW 259200    /* 3 days */
 
+/*
+ * LRU cache of parsed commit objects, keyed by repo id and commit id.
+ *
+ * Callers sometimes modify the commits they get, and commit ref counts are
+ * not thread safe, so the cache keeps its own copy and each lookup returns
+ * a new copy. That's still much cheaper than reading and parsing the
+ * commit again.
+ */
+
+#define DEFAULT_COMMIT_CACHE_SIZE 1000 /* commits */
+
+typedef struct CommitCacheEntry {
+    char key[78];               /* repo_id(36) + commit_id(40) + '\0' */
+    SeafCommit *commit;
+    GList link;
+} CommitCacheEntry;
+
 struct _SeafCommitManagerPriv {
-    int dummy;
+    pthread_mutex_t cache_lock;
+    GHashTable *commit_cache;
+    /* Most recently used at head. */
+    GQueue cache_lru;
+    guint cache_max_size;
 };
 
 static SeafCommit *
@@ -163,11 +189,36 @@ seaf_commit_free (SeafCommit *commit)
     if (commit->repo_desc) g_free (commit->repo_desc);
     if (commit->device_name) g_free (commit->device_name);
     g_free (commit->client_version);
+    g_free (commit->repo_category);
     g_free (commit->magic);
     g_free (commit->random_key);
+    g_free (commit->salt);
     g_free (commit);
 }
 
+static SeafCommit *
+seaf_commit_dup (SeafCommit *commit)
+{
+    SeafCommit *copy = g_new (SeafCommit, 1);
+
+    *copy = *commit;
+    copy->ref = 1;
+    copy->desc = g_strdup (commit->desc);
+    copy->creator_name = g_strdup (commit->creator_name);
+    copy->parent_id = g_strdup (commit->parent_id);
+    copy->second_parent_id = g_strdup (commit->second_parent_id);
+    copy->repo_name = g_strdup (commit->repo_name);
+    copy->repo_desc = g_strdup (commit->repo_desc);
+    copy->repo_category = g_strdup (commit->repo_category);
+    copy->device_name = g_strdup (commit->device_name);
+    copy->client_version = g_strdup (commit->client_version);
+    copy->magic = g_strdup (commit->magic);
+    copy->random_key = g_strdup (commit->random_key);
+    copy->salt = g_strdup (commit->salt);
+
+    return copy;
+}
+
 void
 seaf_commit_ref (SeafCommit *commit)
 {
@@ -193,6 +244,11 @@ seaf_commit_manager_new (SeafileSession *seaf)
     mgr->seaf = seaf;
     mgr->obj_store = seaf_obj_store_new (mgr->seaf, "commits");
 
+    pthread_mutex_init (&mgr->priv->cache_lock, NULL);
+    mgr->priv->commit_cache = g_hash_table_new (g_str_hash, g_str_equal);
+    g_queue_init (&mgr->priv->cache_lru);
+    mgr->priv->cache_max_size = DEFAULT_COMMIT_CACHE_SIZE;
+
     return mgr;
 }
 
@@ -218,28 +274,135 @@ seaf_commit_manager_init (SeafCommitManager *mgr)
         seaf_warning ("[commit mgr] Failed to init commit object store.\n");
         return -1;
     }
+
+    int cache_size = seafile_session_config_get_int (seaf, KEY_COMMIT_CACHE_SIZE,
+                                                     NULL);
+    if (cache_size >= 0)
+        mgr->priv->cache_max_size = cache_size;
 #endif
 
     return 0;
 }
 
-#if 0
-inline static void
-add_commit_to_cache (SeafCommitManager *mgr, SeafCommit *commit)
+/* Commit cache. */
+
+static void
+commit_cache_make_key (char *key, const char *repo_id, const char *commit_id)
 {
-    g_hash_table_insert (mgr->priv->commit_cache,
-                         g_strdup(commit->commit_id),
-                         commit);
-    seaf_commit_ref (commit);
+    memcpy (key, repo_id, 36);
+    memcpy (key + 36, commit_id, 40);
+    key[76] = '\0';
 }
 
-inline static void
-remove_commit_from_cache (SeafCommitManager *mgr, SeafCommit *commit)
+/* Called with cache_lock held. */
+static void
+commit_cache_remove_entry (SeafCommitManagerPriv *priv, CommitCacheEntry *entry)
 {
-    g_hash_table_remove (mgr->priv->commit_cache, commit->commit_id);
-    seaf_commit_unref (commit);
+    g_hash_table_remove (priv->commit_cache, entry->key);
+    g_queue_unlink (&priv->cache_lru, &entry->link);
+    seaf_commit_unref (entry->commit);
+    g_free (entry);
+}
+
+/* Returns a copy of the cached commit, or NULL. */
+static SeafCommit *
+commit_cache_lookup (SeafCommitManager *mgr,
+                     const char *repo_id, const char *commit_id)
+{
+    SeafCommitManagerPriv *priv = mgr->priv;
+    char key[78];
+    CommitCacheEntry *entry;
+    SeafCommit *ret = NULL;
+
+    if (priv->cache_max_size == 0 || !commit_id || strlen(commit_id) != 40)
+        return NULL;
+
+    commit_cache_make_key (key, repo_id, commit_id);
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    entry = g_hash_table_lookup (priv->commit_cache, key);
+    if (entry) {
+        g_queue_unlink (&priv->cache_lru, &entry->link);
+        g_queue_push_head_link (&priv->cache_lru, &entry->link);
+        ret = seaf_commit_dup (entry->commit);
+    }
+
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    return ret;
+}
+
+/* Caches a copy of @commit. */
+static void
+commit_cache_insert (SeafCommitManager *mgr, const char *repo_id,
+                     SeafCommit *commit)
+{
+    SeafCommitManagerPriv *priv = mgr->priv;
+    CommitCacheEntry *entry, *old;
+
+    if (priv->cache_max_size == 0)
+        return;
+
+    entry = g_new0 (CommitCacheEntry, 1);
+    commit_cache_make_key (entry->key, repo_id, commit->commit_id);
+    entry->commit = seaf_commit_dup (commit);
+    entry->link.data = entry;
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    old = g_hash_table_lookup (priv->commit_cache, entry->key);
+    if (old)
+        commit_cache_remove_entry (priv, old);
+
+    g_hash_table_insert (priv->commit_cache, entry->key, entry);
+    g_queue_push_head_link (&priv->cache_lru, &entry->link);
+
+    while (priv->cache_lru.length > priv->cache_max_size)
+        commit_cache_remove_entry (priv, priv->cache_lru.tail->data);
+
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+static void
+commit_cache_remove (SeafCommitManager *mgr,
+                     const char *repo_id, const char *commit_id)
+{
+    SeafCommitManagerPriv *priv = mgr->priv;
+    char key[78];
+    CommitCacheEntry *entry;
+
+    if (!commit_id || strlen(commit_id) != 40)
+        return;
+
+    commit_cache_make_key (key, repo_id, commit_id);
+
+    pthread_mutex_lock (&priv->cache_lock);
+    entry = g_hash_table_lookup (priv->commit_cache, key);
+    if (entry)
+        commit_cache_remove_entry (priv, entry);
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+void
+seaf_commit_manager_drop_cached_commits (SeafCommitManager *mgr,
+                                         const char *repo_id)
+{
+    SeafCommitManagerPriv *priv = mgr->priv;
+    GList *ptr, *next;
+    CommitCacheEntry *entry;
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    for (ptr = priv->cache_lru.head; ptr; ptr = next) {
+        next = ptr->next;
+        entry = ptr->data;
+        if (strncmp (entry->key, repo_id, 36) == 0)
+            commit_cache_remove_entry (priv, entry);
+    }
+
+    pthread_mutex_unlock (&priv->cache_lock);
 }
-#endif
 
 int
 seaf_commit_manager_add_commit (SeafCommitManager *mgr,
@@ -247,10 +410,12 @@ seaf_commit_manager_add_commit (SeafCommitManager *mgr,
 {
     int ret;
 
-    /* add_commit_to_cache (mgr, commit); */
     if ((ret = save_commit (mgr, commit->repo_id, commit->version, commit)) < 0)
         return -1;
-    
+
+    /* New commits are usually read back soon, e.g. as the new head. */
+    commit_cache_insert (mgr, commit->repo_id, commit);
+
     return 0;
 }
 
@@ -262,20 +427,7 @@ seaf_commit_manager_del_commit (SeafCommitManager *mgr,
 {
     g_return_if_fail (id != NULL);
 
-#if 0
-    commit = g_hash_table_lookup(mgr->priv->commit_cache, id);
-    if (!commit)
-        goto delete;
-
-    /*
-     * Catch ref count bug here. We have bug in commit ref, the
-     * following assert can't pass. TODO: fix the commit ref bug
-     */
-    /* g_assert (commit->ref <= 1); */
-    remove_commit_from_cache (mgr, commit);
-
-delete:
-#endif
+    commit_cache_remove (mgr, repo_id, id);
 
     delete_commit (mgr, repo_id, version, id);
 }
@@ -288,19 +440,15 @@ seaf_commit_manager_get_commit (SeafCommitManager *mgr,
 {
     SeafCommit *commit;
 
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL) {
-        seaf_commit_ref (commit);
+    commit = commit_cache_lookup (mgr, repo_id, id);
+    if (commit != NULL)
         return commit;
-    }
-#endif
 
     commit = load_commit (mgr, repo_id, version, id);
     if (!commit)
         return NULL;
 
-    /* add_commit_to_cache (mgr, commit); */
+    commit_cache_insert (mgr, repo_id, commit);
 
     return commit;
 }
@@ -583,11 +731,18 @@ seaf_commit_manager_commit_exists (SeafCommitManager *mgr,
                                    int version,
                                    const char *id)
 {
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL)
-        return TRUE;
-#endif
+    SeafCommitManagerPriv *priv = mgr->priv;
+    char key[78];
+    gboolean cached = FALSE;
+
+    if (id && strlen(id) == 40) {
+        commit_cache_make_key (key, repo_id, id);
+        pthread_mutex_lock (&priv->cache_lock);
+        cached = g_hash_table_contains (priv->commit_cache, key);
+        pthread_mutex_unlock (&priv->cache_lock);
+        if (cached)
+            return TRUE;
+    }
 
     return seaf_obj_store_obj_exists (mgr->obj_store, repo_id, version, id);
 }
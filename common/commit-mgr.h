@@ -183,6 +183,11 @@ seaf_commit_manager_traverse_commit_tree_with_limit (SeafCommitManager *mgr,
                                                      void *data,
                                                      gboolean skip_errors);
 
+/* Remove the cached commits of @repo_id, e.g. when it's deleted. */
+void
+seaf_commit_manager_drop_cached_commits (SeafCommitManager *mgr,
+                                         const char *repo_id);
+
 gboolean
 seaf_commit_manager_commit_exists (SeafCommitManager *mgr,
                                    const char *repo_id,
@@ -46,6 +46,19 @@ diff_entry_new_from_dirent (char type, char status,
     return de;
 }
 
+DiffEntry *
+diff_entry_dup (DiffEntry *de)
+{
+    DiffEntry *copy = g_new (DiffEntry, 1);
+
+    *copy = *de;
+    copy->name = g_strdup (de->name);
+    copy->new_name = g_strdup (de->new_name);
+    copy->modifier = g_strdup (de->modifier);
+
+    return copy;
+}
+
 void
 diff_entry_free (DiffEntry *de)
 {
@@ -86,12 +99,205 @@ diff_files (int n, SeafDirent *dents[], const char *basedir, DiffOptions *opt)
     return opt->file_cb (n, basedir, files, opt->data);
 }
 
+static gboolean
+skip_dents (int n, SeafDirent *dents[], const char *basedir, DiffOptions *opt)
+{
+    const char *name = NULL;
+    gboolean is_dir = FALSE;
+    char *path;
+    gboolean ret;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (!dents[i])
+            continue;
+        name = dents[i]->name;
+        if (S_ISDIR(dents[i]->mode))
+            is_dir = TRUE;
+    }
+
+    path = g_strconcat (basedir, name, NULL);
+    ret = opt->skip_path (path, is_dir, opt->skip_data);
+    g_free (path);
+
+    return ret;
+}
+
+/*
+ * Prefetching of dir objects.
+ *
+ * Before the entries of a level are walked, the sub-dirs that are present
+ * in at least two trees and differ are queued to the thread pool. They are
+ * almost always recursed into. By the time the walk reaches one of them,
+ * it and its siblings have usually been loaded already. Sub-dirs only
+ * present in one tree are loaded when needed, since the dir callback often
+ * decides not to recurse into them.
+ */
+
+#define DIFF_PREFETCH_THREADS 8
+/* Bounds the memory used by loaded dirs waiting for the walk. */
+#define DIFF_PREFETCH_MAX_PER_LEVEL 64
+
+typedef struct DirPrefetch {
+    char id[41];
+    SeafDir *dir;
+    gboolean done;
+    GMutex lock;
+    GCond cond;
+} DirPrefetch;
+
+static void
+prefetch_dir_worker (gpointer vdata, gpointer user_data)
+{
+    DirPrefetch *pf = vdata;
+    DiffOptions *opt = user_data;
+    SeafDir *dir;
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                       opt->store_id, opt->version, pf->id);
+
+    g_mutex_lock (&pf->lock);
+    pf->dir = dir;
+    pf->done = TRUE;
+    g_cond_signal (&pf->cond);
+    g_mutex_unlock (&pf->lock);
+}
+
+/* Waits for the prefetch to finish and returns the loaded dir. */
+static SeafDir *
+dir_prefetch_finish (DirPrefetch *pf)
+{
+    SeafDir *dir;
+
+    g_mutex_lock (&pf->lock);
+    while (!pf->done)
+        g_cond_wait (&pf->cond, &pf->lock);
+    dir = pf->dir;
+    g_mutex_unlock (&pf->lock);
+
+    g_mutex_clear (&pf->lock);
+    g_cond_clear (&pf->cond);
+    g_free (pf);
+
+    return dir;
+}
+
+static void
+dir_prefetch_discard (gpointer data)
+{
+    seaf_dir_free (dir_prefetch_finish (data));
+}
+
+/*
+ * Set @dents to the entries with the "largest" name among @ptrs and advance
+ * the pointers past them. Dirents are sorted in descending order. Returns
+ * FALSE when all lists are exhausted.
+ */
+static gboolean
+next_dents (int n, GList *ptrs[], SeafDirent *dents[])
+{
+    SeafDirent *dent;
+    char *first_name = NULL;
+    int i;
+
+    memset (dents, 0, sizeof(dents[0])*n);
+
+    for (i = 0; i < n; ++i) {
+        if (ptrs[i] != NULL) {
+            dent = ptrs[i]->data;
+            if (!first_name)
+                first_name = dent->name;
+            else if (strcmp(dent->name, first_name) > 0)
+                first_name = dent->name;
+        }
+    }
+
+    if (!first_name)
+        return FALSE;
+
+    for (i = 0; i < n; ++i) {
+        if (ptrs[i] != NULL) {
+            dent = ptrs[i]->data;
+            if (strcmp(first_name, dent->name) == 0) {
+                dents[i] = dent;
+                ptrs[i] = ptrs[i]->next;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean
+dents_same (int n, SeafDirent *dents[])
+{
+    if (n == 2 && dents[0] && dents[1] && dirent_same(dents[0], dents[1]))
+        return TRUE;
+
+    if (n == 3 && dents[0] && dents[1] && dents[2] &&
+        dirent_same(dents[0], dents[1]) && dirent_same(dents[0], dents[2]))
+        return TRUE;
+
+    return FALSE;
+}
+
+/* Returns a table of dirent -> DirPrefetch for the sub-dirs of this level. */
+static GHashTable *
+prefetch_sub_dirs (int n, SeafDir *trees[], const char *basedir,
+                   DiffOptions *opt)
+{
+    GList *ptrs[3];
+    SeafDirent *dents[3];
+    GHashTable *prefetched = NULL;
+    DirPrefetch *pf;
+    int i, n_dirs, n_queued = 0;
+
+    for (i = 0; i < n; ++i)
+        ptrs[i] = trees[i] ? trees[i]->entries : NULL;
+
+    while (n_queued < DIFF_PREFETCH_MAX_PER_LEVEL &&
+           next_dents (n, ptrs, dents)) {
+        if (dents_same (n, dents))
+            continue;
+
+        n_dirs = 0;
+        for (i = 0; i < n; ++i)
+            if (dents[i] && S_ISDIR(dents[i]->mode) &&
+                strcmp (dents[i]->id, EMPTY_SHA1) != 0)
+                ++n_dirs;
+        if (n_dirs < 2)
+            continue;
+
+        if (opt->skip_path && skip_dents (n, dents, basedir, opt))
+            continue;
+
+        if (!prefetched)
+            prefetched = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                NULL, dir_prefetch_discard);
+
+        for (i = 0; i < n; ++i) {
+            if (!dents[i] || !S_ISDIR(dents[i]->mode))
+                continue;
+            pf = g_new0 (DirPrefetch, 1);
+            memcpy (pf->id, dents[i]->id, 40);
+            g_mutex_init (&pf->lock);
+            g_cond_init (&pf->cond);
+            g_hash_table_insert (prefetched, dents[i], pf);
+            g_thread_pool_push (opt->prefetch_pool, pf, NULL);
+            ++n_queued;
+        }
+    }
+
+    return prefetched;
+}
+
 static int
 diff_trees_recursive (int n, SeafDir *trees[],
                       const char *basedir, DiffOptions *opt);
 
 static int
-diff_directories (int n, SeafDirent *dents[], const char *basedir, DiffOptions *opt)
+diff_directories (int n, SeafDirent *dents[], const char *basedir,
+                  GHashTable *prefetched, DiffOptions *opt)
 {
     SeafDirent *dirs[3];
     int i, n_dirs = 0;
@@ -121,10 +327,18 @@ diff_directories (int n, SeafDirent *dents[], const char *basedir, DiffOptions *
     memset (sub_dirs, 0, sizeof(sub_dirs[0])*n);
     for (i = 0; i < n; ++i) {
         if (dents[i] != NULL && S_ISDIR(dents[i]->mode)) {
-            dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
-                                               opt->store_id,
-                                               opt->version,
-                                               dents[i]->id);
+            DirPrefetch *pf = NULL;
+
+            if (prefetched &&
+                (pf = g_hash_table_lookup (prefetched, dents[i])) != NULL) {
+                g_hash_table_steal (prefetched, dents[i]);
+                dir = dir_prefetch_finish (pf);
+            } else {
+                dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                                   opt->store_id,
+                                                   opt->version,
+                                                   dents[i]->id);
+            }
             if (!dir) {
                 seaf_warning ("Failed to find dir %s:%s.\n",
                               opt->store_id, dents[i]->id);
@@ -155,12 +369,13 @@ diff_trees_recursive (int n, SeafDir *trees[],
 {
     GList *ptrs[3];
     SeafDirent *dents[3];
+    GHashTable *prefetched = NULL;
     int i;
-    SeafDirent *dent;
-    char *first_name;
-    gboolean done;
     int ret = 0;
 
+    if (opt->prefetch_pool)
+        prefetched = prefetch_sub_dirs (n, trees, basedir, opt);
+
     for (i = 0; i < n; ++i) {
         if (trees[i])
             ptrs[i] = trees[i]->entries;
@@ -168,57 +383,29 @@ diff_trees_recursive (int n, SeafDir *trees[],
             ptrs[i] = NULL;
     }
 
-    while (1) {
-        first_name = NULL;
-        memset (dents, 0, sizeof(dents[0])*n);
-        done = TRUE;
-
-        /* Find the "largest" name, assuming dirents are sorted. */
-        for (i = 0; i < n; ++i) {
-            if (ptrs[i] != NULL) {
-                done = FALSE;
-                dent = ptrs[i]->data;
-                if (!first_name)
-                    first_name = dent->name;
-                else if (strcmp(dent->name, first_name) > 0)
-                    first_name = dent->name;
-            }
-        }
-
-        if (done)
-            break;
-
-        /*
-         * Setup dir entries for all names that equal to first_name
-         */
-        for (i = 0; i < n; ++i) {
-            if (ptrs[i] != NULL) {
-                dent = ptrs[i]->data;
-                if (strcmp(first_name, dent->name) == 0) {
-                    dents[i] = dent;
-                    ptrs[i] = ptrs[i]->next;
-                }
-            }
-        }
-
-        if (n == 2 && dents[0] && dents[1] && dirent_same(dents[0], dents[1]))
+    /* Walk the entries in the order of their names, assuming dirents are sorted. */
+    while (next_dents (n, ptrs, dents)) {
+        if (dents_same (n, dents))
             continue;
 
-        if (n == 3 && dents[0] && dents[1] && dents[2] &&
-            dirent_same(dents[0], dents[1]) && dirent_same(dents[0], dents[2]))
+        if (opt->skip_path && skip_dents (n, dents, basedir, opt))
             continue;
 
         /* Diff files of this level. */
         ret = diff_files (n, dents, basedir, opt);
         if (ret < 0)
-            return ret;
+            break;
 
         /* Recurse into sub level. */
-        ret = diff_directories (n, dents, basedir, opt);
+        ret = diff_directories (n, dents, basedir, prefetched, opt);
         if (ret < 0)
-            return ret;
+            break;
     }
 
+    /* Wait for and free the dirs that were not used, e.g. on error. */
+    if (prefetched)
+        g_hash_table_destroy (prefetched);
+
     return ret;
 }
 
@@ -244,8 +431,16 @@ diff_trees (int n, const char *roots[], DiffOptions *opt)
         trees[i] = root;
     }
 
+    opt->prefetch_pool = g_thread_pool_new (prefetch_dir_worker, opt,
+                                            DIFF_PREFETCH_THREADS, FALSE, NULL);
+
     ret = diff_trees_recursive (n, trees, "", opt);
 
+    if (opt->prefetch_pool) {
+        g_thread_pool_free (opt->prefetch_pool, FALSE, TRUE);
+        opt->prefetch_pool = NULL;
+    }
+
     for (i = 0; i < n; ++i)
         seaf_dir_free (trees[i]);
     g_free (trees);
@@ -253,16 +448,400 @@ diff_trees (int n, const char *roots[], DiffOptions *opt)
     return ret;
 }
 
+/*
+ * Renames of edited files.
+ *
+ * diff_resolve_renames() only pairs files with the same content. A file that
+ * is renamed and edited in the same commit would be a delete and an add, so
+ * the whole file would be transferred and re-created in the worktree.
+ *
+ * The files that are left unpaired are compared by their block lists. The
+ * blocks of the deleted files are indexed by block id, and each added file is
+ * paired with the deleted file it shares the most blocks with. A pair is
+ * reported as a rename of the old file followed by a modification of the new
+ * one, so that only the changed blocks have to be fetched.
+ */
+
+/* Least percentage of shared blocks, of the larger block list. */
+#define SIMILAR_RENAME_MIN_PERCENT 50
+/* Don't load objects for diffs with more unpaired files than this. */
+#define SIMILAR_RENAME_MAX_FILES 1000
+
+typedef struct SimilarFile {
+    DiffEntry *de;
+    Seafile *file;
+    /* Number of distinct blocks. */
+    int n_blocks;
+    int shared;
+    gboolean paired;
+} SimilarFile;
+
+static gboolean
+is_similar_rename_candidate (DiffEntry *de)
+{
+    static const unsigned char empty_sha1[20] = { 0 };
+
+    if (de->status != DIFF_STATUS_ADDED && de->status != DIFF_STATUS_DELETED)
+        return FALSE;
+    return (memcmp (de->sha1, empty_sha1, 20) != 0);
+}
+
+static GPtrArray *
+load_similar_files (const char *store_id, int version, GPtrArray *entries)
+{
+    GPtrArray *files;
+    SimilarFile *sf;
+    DiffEntry *de;
+    Seafile *file;
+    GHashTable *seen;
+    char file_id[41];
+    int i, j;
+
+    files = g_ptr_array_new_with_free_func (g_free);
+    seen = g_hash_table_new (ccnet_sha1_hash, ccnet_sha1_equal);
+
+    for (i = 0; i < entries->len; ++i) {
+        de = g_ptr_array_index (entries, i);
+
+        rawdata_to_hex (de->sha1, file_id, 20);
+        file = seaf_fs_manager_get_seafile (seaf->fs_mgr, store_id, version,
+                                            file_id);
+        if (!file)
+            continue;
+        if (file->n_blocks == 0) {
+            seafile_unref (file);
+            continue;
+        }
+
+        sf = g_new0 (SimilarFile, 1);
+        sf->de = de;
+        sf->file = file;
+        for (j = 0; j < file->n_blocks; ++j) {
+            if (!g_hash_table_lookup (seen, file->blk_ids + j * 20)) {
+                g_hash_table_insert (seen, file->blk_ids + j * 20, file);
+                ++(sf->n_blocks);
+            }
+        }
+        g_hash_table_remove_all (seen);
+
+        g_ptr_array_add (files, sf);
+    }
+
+    g_hash_table_destroy (seen);
+    return files;
+}
+
+static void
+free_similar_files (GPtrArray *files)
+{
+    SimilarFile *sf;
+    int i;
+
+    for (i = 0; i < files->len; ++i) {
+        sf = g_ptr_array_index (files, i);
+        seafile_unref (sf->file);
+    }
+    g_ptr_array_free (files, TRUE);
+}
+
+/*
+ * Find similar files among @deleted and @added entries.
+ * Returns an array of (deleted entry, added entry) pairs.
+ */
+static GPtrArray *
+find_similar_files (const char *store_id, int version,
+                    GPtrArray *deleted, GPtrArray *added)
+{
+    GPtrArray *pairs;
+    GPtrArray *del_files = NULL, *add_files = NULL;
+    GHashTable *index = NULL, *seen = NULL;
+    GList *touched = NULL, *ptr, *owners;
+    SimilarFile *sf, *add_sf, *best;
+    guint8 *blk_id;
+    int i, j, total;
+
+    pairs = g_ptr_array_new ();
+
+    if (deleted->len == 0 || added->len == 0 ||
+        deleted->len > SIMILAR_RENAME_MAX_FILES ||
+        added->len > SIMILAR_RENAME_MAX_FILES)
+        return pairs;
+
+    del_files = load_similar_files (store_id, version, deleted);
+    if (del_files->len == 0)
+        goto out;
+    add_files = load_similar_files (store_id, version, added);
+
+    /* Block id -> list of deleted files containing the block. */
+    index = g_hash_table_new_full (ccnet_sha1_hash, ccnet_sha1_equal,
+                                   NULL, (GDestroyNotify)g_list_free);
+    for (i = 0; i < del_files->len; ++i) {
+        sf = g_ptr_array_index (del_files, i);
+        for (j = 0; j < sf->file->n_blocks; ++j) {
+            blk_id = sf->file->blk_ids + j * 20;
+            owners = g_hash_table_lookup (index, blk_id);
+            if (owners && owners->data == sf)
+                continue;
+            g_hash_table_steal (index, blk_id);
+            g_hash_table_insert (index, blk_id, g_list_prepend (owners, sf));
+        }
+    }
+
+    seen = g_hash_table_new (ccnet_sha1_hash, ccnet_sha1_equal);
+
+    for (i = 0; i < add_files->len; ++i) {
+        add_sf = g_ptr_array_index (add_files, i);
+
+        for (j = 0; j < add_sf->file->n_blocks; ++j) {
+            blk_id = add_sf->file->blk_ids + j * 20;
+            if (g_hash_table_lookup (seen, blk_id))
+                continue;
+            g_hash_table_insert (seen, blk_id, blk_id);
+
+            owners = g_hash_table_lookup (index, blk_id);
+            for (ptr = owners; ptr; ptr = ptr->next) {
+                sf = ptr->data;
+                if (sf->paired)
+                    continue;
+                if (sf->shared++ == 0)
+                    touched = g_list_prepend (touched, sf);
+            }
+        }
+        g_hash_table_remove_all (seen);
+
+        best = NULL;
+        for (ptr = touched; ptr; ptr = ptr->next) {
+            sf = ptr->data;
+            if (!best || sf->shared > best->shared)
+                best = sf;
+        }
+
+        if (best) {
+            total = MAX (best->n_blocks, add_sf->n_blocks);
+            if (best->shared * 100 >= total * SIMILAR_RENAME_MIN_PERCENT) {
+                best->paired = TRUE;
+                g_ptr_array_add (pairs, best->de);
+                g_ptr_array_add (pairs, add_sf->de);
+            }
+        }
+
+        for (ptr = touched; ptr; ptr = ptr->next) {
+            sf = ptr->data;
+            sf->shared = 0;
+        }
+        g_list_free (touched);
+        touched = NULL;
+    }
+
+out:
+    if (seen)
+        g_hash_table_destroy (seen);
+    if (index)
+        g_hash_table_destroy (index);
+    if (add_files)
+        free_similar_files (add_files);
+    free_similar_files (del_files);
+    return pairs;
+}
+
+static DiffEntry *
+similar_rename_entry (DiffEntry *de_del, DiffEntry *de_add)
+{
+    DiffEntry *de_rename;
+
+    de_rename = diff_entry_new (de_del->type, DIFF_STATUS_RENAMED,
+                                de_del->sha1, de_del->name);
+    de_rename->new_name = g_strdup (de_add->name);
+
+    /* The added entry already carries the new content and attributes. */
+    de_add->status = DIFF_STATUS_MODIFIED;
+
+    return de_rename;
+}
+
+/*
+ * Streaming of diff results.
+ *
+ * Entries are passed to the callback as soon as the walk finds them, instead
+ * of being collected into a list. Only the added and deleted entries that may
+ * still be paired into renames are held back, in hash tables indexed by
+ * sha1. A pair is emitted as soon as both sides are seen. Unpaired entries
+ * are flushed at the end of the walk.
+ */
+
+typedef struct DiffStream {
+    DiffEntryCB cb;
+    void *data;
+    GHashTable *deleted;
+    GHashTable *added;
+    int ret;
+} DiffStream;
+
+static void
+diff_stream_emit (DiffStream *stream, DiffEntry *de)
+{
+    if (stream->ret == 0 && stream->cb (de, stream->data) < 0)
+        stream->ret = -1;
+    diff_entry_free (de);
+}
+
+static void
+diff_stream_emit_rename (DiffStream *stream, DiffEntry *de_del, DiffEntry *de_add)
+{
+    DiffEntry *de_rename;
+    int rename_status;
+
+    if (de_add->status == DIFF_STATUS_DIR_ADDED)
+        rename_status = DIFF_STATUS_DIR_RENAMED;
+    else
+        rename_status = DIFF_STATUS_RENAMED;
+
+    de_rename = diff_entry_new (de_del->type, rename_status,
+                                de_del->sha1, de_del->name);
+    de_rename->new_name = g_strdup(de_add->name);
+
+    diff_entry_free (de_add);
+    diff_entry_free (de_del);
+
+    diff_stream_emit (stream, de_rename);
+}
+
+/* Hold @de in @pending until its pair in @others shows up. */
+static void
+diff_stream_match (DiffStream *stream, DiffEntry *de,
+                   GHashTable *pending, GHashTable *others, gboolean is_delete)
+{
+    DiffEntry *pair, *old;
+
+    pair = g_hash_table_lookup (others, de->sha1);
+    if (pair) {
+        g_hash_table_steal (others, de->sha1);
+        if (is_delete)
+            diff_stream_emit_rename (stream, de, pair);
+        else
+            diff_stream_emit_rename (stream, pair, de);
+        return;
+    }
+
+    /* Only one entry per content can be paired. Older ones are final. */
+    old = g_hash_table_lookup (pending, de->sha1);
+    if (old) {
+        g_hash_table_steal (pending, de->sha1);
+        diff_stream_emit (stream, old);
+    }
+    g_hash_table_insert (pending, de->sha1, de);
+}
+
+static void
+diff_stream_add (DiffStream *stream, DiffEntry *de)
+{
+    static const unsigned char empty_sha1[20] = { 0 };
+
+    if (stream->ret < 0) {
+        diff_entry_free (de);
+        return;
+    }
+
+    /* Same rules as diff_resolve_renames(). */
+    if (memcmp (de->sha1, empty_sha1, 20) == 0) {
+        diff_stream_emit (stream, de);
+        return;
+    }
+
+    switch (de->status) {
+    case DIFF_STATUS_DELETED:
+    case DIFF_STATUS_DIR_DELETED:
+        diff_stream_match (stream, de, stream->deleted, stream->added, TRUE);
+        break;
+    case DIFF_STATUS_ADDED:
+    case DIFF_STATUS_DIR_ADDED:
+        diff_stream_match (stream, de, stream->added, stream->deleted, FALSE);
+        break;
+    default:
+        diff_stream_emit (stream, de);
+    }
+}
+
+static void
+diff_stream_flush (DiffStream *stream, GHashTable *pending)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init (&iter, pending);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        g_hash_table_iter_steal (&iter);
+        diff_stream_emit (stream, value);
+    }
+}
+
+/* Pair the held back files that were edited as well as renamed. */
+static void
+diff_stream_resolve_similar (DiffStream *stream,
+                             const char *store_id, int version)
+{
+    GPtrArray *deleted, *added, *pairs;
+    GHashTableIter iter;
+    gpointer key, value;
+    DiffEntry *de_del, *de_add, *de_rename;
+    int i;
+
+    deleted = g_ptr_array_new ();
+    added = g_ptr_array_new ();
+
+    g_hash_table_iter_init (&iter, stream->deleted);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        if (is_similar_rename_candidate (value))
+            g_ptr_array_add (deleted, value);
+    g_hash_table_iter_init (&iter, stream->added);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        if (is_similar_rename_candidate (value))
+            g_ptr_array_add (added, value);
+
+    pairs = find_similar_files (store_id, version, deleted, added);
+
+    for (i = 0; i < pairs->len; i += 2) {
+        de_del = g_ptr_array_index (pairs, i);
+        de_add = g_ptr_array_index (pairs, i + 1);
+
+        g_hash_table_steal (stream->deleted, de_del->sha1);
+        g_hash_table_steal (stream->added, de_add->sha1);
+
+        de_rename = similar_rename_entry (de_del, de_add);
+        diff_entry_free (de_del);
+
+        diff_stream_emit (stream, de_rename);
+        diff_stream_emit (stream, de_add);
+    }
+
+    g_ptr_array_free (pairs, TRUE);
+    g_ptr_array_free (deleted, TRUE);
+    g_ptr_array_free (added, TRUE);
+}
+
 typedef struct DiffData {
     GList **results;
     gboolean fold_dir_diff;
+    /* If set, entries are streamed instead of added to results. */
+    DiffStream *stream;
 } DiffData;
 
+static int
+diff_data_add (DiffData *data, DiffEntry *de)
+{
+    if (!data->stream) {
+        *(data->results) = g_list_prepend (*(data->results), de);
+        return 0;
+    }
+
+    diff_stream_add (data->stream, de);
+    return data->stream->ret;
+}
+
 static int
 twoway_diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
 {
     DiffData *data = vdata;
-    GList **results = data->results;
     DiffEntry *de;
     SeafDirent *tree1 = files[0];
     SeafDirent *tree2 = files[1];
@@ -270,21 +849,19 @@ twoway_diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
     if (!tree1) {
         de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_ADDED,
                                          tree2, basedir);
-        *results = g_list_prepend (*results, de);
-        return 0;
+        return diff_data_add (data, de);
     }
 
     if (!tree2) {
         de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_DELETED,
                                          tree1, basedir);
-        *results = g_list_prepend (*results, de);
-        return 0;
+        return diff_data_add (data, de);
     }
 
     if (!dirent_same (tree1, tree2)) {
         de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_MODIFIED,
                                          tree2, basedir);
-        *results = g_list_prepend (*results, de);
+        return diff_data_add (data, de);
     }
 
     return 0;
@@ -295,7 +872,6 @@ twoway_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
                   gboolean *recurse)
 {
     DiffData *data = vdata;
-    GList **results = data->results;
     DiffEntry *de;
     SeafDirent *tree1 = dirs[0];
     SeafDirent *tree2 = dirs[1];
@@ -304,8 +880,8 @@ twoway_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
         if (strcmp (tree2->id, EMPTY_SHA1) == 0 || data->fold_dir_diff) {
             de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS, DIFF_STATUS_DIR_ADDED,
                                              tree2, basedir);
-            *results = g_list_prepend (*results, de);
             *recurse = FALSE;
+            return diff_data_add (data, de);
         } else
             *recurse = TRUE;
         return 0;
@@ -315,13 +891,12 @@ twoway_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
         de = diff_entry_new_from_dirent (DIFF_TYPE_COMMITS,
                                          DIFF_STATUS_DIR_DELETED,
                                          tree1, basedir);
-        *results = g_list_prepend (*results, de);
 
         if (data->fold_dir_diff) {
             *recurse = FALSE;
         } else
             *recurse = TRUE;
-        return 0;
+        return diff_data_add (data, de);
     }
 
     return 0;
@@ -334,6 +909,7 @@ diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results,
     SeafRepo *repo = NULL;
     DiffOptions opt;
     const char *roots[2];
+    int ret;
 
     repo = seaf_repo_manager_get_repo (seaf->repo_mgr, commit1->repo_id);
     if (!repo) {
@@ -356,8 +932,11 @@ diff_commits (SeafCommit *commit1, SeafCommit *commit2, GList **results,
     roots[0] = commit1->root_id;
     roots[1] = commit2->root_id;
 
-    diff_trees (2, roots, &opt);
+    ret = diff_trees (2, roots, &opt);
+    if (ret < 0)
+        return ret;
     diff_resolve_renames (results);
+    diff_resolve_similar_renames (repo->id, repo->version, results);
 
     return 0;
 }
@@ -366,9 +945,20 @@ int
 diff_commit_roots (const char *store_id, int version,
                    const char *root1, const char *root2, GList **results,
                    gboolean fold_dir_diff)
+{
+    return diff_commit_roots_filtered (store_id, version, root1, root2,
+                                       results, fold_dir_diff, NULL, NULL);
+}
+
+int
+diff_commit_roots_filtered (const char *store_id, int version,
+                            const char *root1, const char *root2,
+                            GList **results, gboolean fold_dir_diff,
+                            DiffSkipFunc skip_path, void *skip_data)
 {
     DiffOptions opt;
     const char *roots[2];
+    int ret;
 
     DiffData data;
     memset (&data, 0, sizeof(data));
@@ -381,14 +971,68 @@ diff_commit_roots (const char *store_id, int version,
     opt.file_cb = twoway_diff_files;
     opt.dir_cb = twoway_diff_dirs;
     opt.data = &data;
+    opt.skip_path = skip_path;
+    opt.skip_data = skip_data;
 
     roots[0] = root1;
     roots[1] = root2;
 
-    diff_trees (2, roots, &opt);
+    ret = diff_trees (2, roots, &opt);
     diff_resolve_renames (results);
+    diff_resolve_similar_renames (store_id, version, results);
 
-    return 0;
+    return ret;
+}
+
+int
+diff_commit_roots_foreach (const char *store_id, int version,
+                           const char *root1, const char *root2,
+                           gboolean fold_dir_diff,
+                           DiffEntryCB callback, void *cb_data)
+{
+    DiffOptions opt;
+    const char *roots[2];
+    DiffStream stream;
+    DiffData data;
+    int ret;
+
+    memset (&stream, 0, sizeof(stream));
+    stream.cb = callback;
+    stream.data = cb_data;
+    stream.deleted = g_hash_table_new_full (ccnet_sha1_hash, ccnet_sha1_equal,
+                                            NULL,
+                                            (GDestroyNotify)diff_entry_free);
+    stream.added = g_hash_table_new_full (ccnet_sha1_hash, ccnet_sha1_equal,
+                                          NULL,
+                                          (GDestroyNotify)diff_entry_free);
+
+    memset (&data, 0, sizeof(data));
+    data.fold_dir_diff = fold_dir_diff;
+    data.stream = &stream;
+
+    memset (&opt, 0, sizeof(opt));
+    memcpy (opt.store_id, store_id, 36);
+    opt.version = version;
+    opt.file_cb = twoway_diff_files;
+    opt.dir_cb = twoway_diff_dirs;
+    opt.data = &data;
+
+    roots[0] = root1;
+    roots[1] = root2;
+
+    ret = diff_trees (2, roots, &opt);
+    if (ret == 0) {
+        diff_stream_resolve_similar (&stream, store_id, version);
+        diff_stream_flush (&stream, stream.deleted);
+        diff_stream_flush (&stream, stream.added);
+    }
+    if (stream.ret < 0)
+        ret = -1;
+
+    g_hash_table_destroy (stream.deleted);
+    g_hash_table_destroy (stream.added);
+
+    return ret;
 }
 
 static int
@@ -619,6 +1263,59 @@ diff_resolve_renames (GList **diff_entries)
     g_hash_table_destroy (deleted);
 }
 
+void
+diff_resolve_similar_renames (const char *store_id, int version,
+                              GList **diff_entries)
+{
+    GPtrArray *deleted, *added, *pairs;
+    GHashTable *renamed;
+    GList *p, *next;
+    DiffEntry *de, *de_del, *de_add;
+    int i;
+
+    deleted = g_ptr_array_new ();
+    added = g_ptr_array_new ();
+
+    for (p = *diff_entries; p != NULL; p = p->next) {
+        de = p->data;
+        if (!is_similar_rename_candidate (de))
+            continue;
+        if (de->status == DIFF_STATUS_DELETED)
+            g_ptr_array_add (deleted, de);
+        else
+            g_ptr_array_add (added, de);
+    }
+
+    pairs = find_similar_files (store_id, version, deleted, added);
+    if (pairs->len == 0)
+        goto out;
+
+    renamed = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (i = 0; i < pairs->len; i += 2) {
+        de_del = g_ptr_array_index (pairs, i);
+        de_add = g_ptr_array_index (pairs, i + 1);
+
+        *diff_entries = g_list_prepend (*diff_entries,
+                                        similar_rename_entry (de_del, de_add));
+        g_hash_table_insert (renamed, de_del, de_del);
+    }
+
+    for (p = *diff_entries; p != NULL; p = next) {
+        next = p->next;
+        de = p->data;
+        if (g_hash_table_lookup (renamed, de)) {
+            *diff_entries = g_list_delete_link (*diff_entries, p);
+            diff_entry_free (de);
+        }
+    }
+    g_hash_table_destroy (renamed);
+
+out:
+    g_ptr_array_free (pairs, TRUE);
+    g_ptr_array_free (deleted, TRUE);
+    g_ptr_array_free (added, TRUE);
+}
+
 static gboolean
 is_redundant_empty_dir (DiffEntry *de_dir, DiffEntry *de_file)
 {
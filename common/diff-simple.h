@@ -57,6 +57,9 @@ typedef struct DiffEntry {
 DiffEntry *
 diff_entry_new (char type, char status, unsigned char *sha1, const char *name);
 
+DiffEntry *
+diff_entry_dup (DiffEntry *de);
+
 void
 diff_entry_free (DiffEntry *de);
 
@@ -81,6 +84,36 @@ diff_commit_roots (const char *store_id, int version,
                    const char *root1, const char *root2, GList **results,
                    gboolean fold_dir_diff);
 
+/*
+ * Returns TRUE if @path (relative to the root, without leading slash)
+ * should be left out of a diff. A skipped dir is not recursed into.
+ */
+typedef gboolean (*DiffSkipFunc) (const char *path, gboolean is_dir,
+                                  void *data);
+
+/* Like diff_commit_roots(), but leaves out the paths @skip_path returns
+ * TRUE for. Returns -1 if the trees can't be walked. */
+int
+diff_commit_roots_filtered (const char *store_id, int version,
+                            const char *root1, const char *root2,
+                            GList **results, gboolean fold_dir_diff,
+                            DiffSkipFunc skip_path, void *skip_data);
+
+/*
+ * Like diff_commit_roots(), but passes each entry to @callback as soon as it
+ * is known instead of building a list. Renames are resolved the same way.
+ * Added and deleted entries that are never paired are passed at the end.
+ * The entry is freed after the callback returns. If the callback returns
+ * -1, the diff is stopped and -1 is returned.
+ */
+typedef int (*DiffEntryCB) (DiffEntry *de, void *data);
+
+int
+diff_commit_roots_foreach (const char *store_id, int version,
+                           const char *root1, const char *root2,
+                           gboolean fold_dir_diff,
+                           DiffEntryCB callback, void *cb_data);
+
 int
 diff_merge (SeafCommit *merge, GList **results, gboolean fold_dir_diff);
 
@@ -92,6 +125,15 @@ diff_merge_roots (const char *store_id, int version,
 void
 diff_resolve_renames (GList **diff_entries);
 
+/*
+ * Pair added and deleted files that share most of their blocks into
+ * a rename and a modification of the new file. Run it after
+ * diff_resolve_renames().
+ */
+void
+diff_resolve_similar_renames (const char *store_id, int version,
+                              GList **diff_entries);
+
 void
 diff_resolve_empty_dirs (GList **diff_entries);
 
@@ -122,8 +164,20 @@ typedef struct DiffOptions {
     DiffFileCB file_cb;
     DiffDirCB dir_cb;
     void *data;
+
+    /* Optional. Entries it returns TRUE for are not passed to the callbacks. */
+    DiffSkipFunc skip_path;
+    void *skip_data;
+
+    /* Set up by diff_trees() to load dir objects ahead of the walk. */
+    GThreadPool *prefetch_pool;
 } DiffOptions;
 
+/*
+ * The callbacks are always called from the calling thread, in the same
+ * order as a depth-first walk. Only loading the dir objects is done in
+ * parallel.
+ */
 int
 diff_trees (int n, const char *roots[], DiffOptions *opt);
 
@@ -2,7 +2,9 @@
 
 #include "common.h"
 
+#include <pthread.h>
 #include <sys/stat.h>
+#include <zlib.h>
 #include <fcntl.h>
 #ifndef WIN32
 #include <dirent.h>
@@ -21,6 +23,9 @@
 #include "utils.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_OTHER
 #include "log.h"
+#include "worker-pool.h"
+#include "trace.h"
+#include "json-scan.h"
 #include "../common/seafile-crypt.h"
 
 #ifndef SEAFILE_SERVER
@@ -30,9 +35,57 @@
 
 #include "db.h"
 
+#ifndef SEAFILE_SERVER
+#include "seafile-config.h"
+#endif
+
+/*
+ * LRU cache of parsed fs objects, keyed by repo id and object id.
+ *
+ * Seafile objects are shared with the callers through their ref count.
+ * SeafDir objects are not ref counted and callers often modify or sort
+ * the entries, so each lookup returns a copy. Copying is still much
+ * cheaper than reading, decompressing and parsing the object again.
+ */
+
+#define DEFAULT_FS_CACHE_SIZE (16 << 20) /* 16MB */
+
+typedef struct FSCacheEntry {
+    char key[78];               /* repo_id(36) + obj_id(40) + '\0' */
+    int type;
+    gpointer obj;
+    gsize size;
+    GList link;
+} FSCacheEntry;
+
 struct _SeafFSManagerPriv {
-    /* GHashTable      *seafile_cache; */
     GHashTable      *bl_cache;
+
+    /* Binary copies of dir objects, see seaf_dir_to_bin_data(). */
+    struct SeafObjStore *bin_store;
+
+    /* Chunk maps of large files by file id, see file_rechunk_cdc(). */
+    struct SeafObjStore *chunk_map_store;
+
+    /* Total size and file count of dirs by dir id, see get_dir_stats(). */
+    struct SeafObjStore *dir_stats_store;
+
+    pthread_mutex_t cache_lock;
+    GHashTable      *obj_cache;
+    /* Most recently used at head. */
+    GQueue          cache_lru;
+    gsize           cache_size;
+    gsize           cache_max_size;
+    guint64         cache_hits;
+    guint64         cache_misses;
+
+    /* repo id -> BlockSink, see seaf_fs_manager_set_block_sink(). */
+    pthread_mutex_t sink_lock;
+    GHashTable      *block_sinks;
+
+    /* Chunk length -> id of an unencrypted block of zeros of that length. */
+    pthread_mutex_t zero_lock;
+    GHashTable      *zero_block_ids;
 };
 
 #ifdef WIN32
@@ -103,6 +156,27 @@ seaf_fs_manager_new (SeafileSession *seaf,
 
     mgr->priv = g_new0(SeafFSManagerPriv, 1);
 
+#ifndef SEAFILE_SERVER
+    if (!seafile_session_config_get_bool (seaf, KEY_DISABLE_FS_BIN_CACHE))
+        mgr->priv->bin_store = seaf_obj_store_new (seaf, "fs-bin");
+    mgr->priv->chunk_map_store = seaf_obj_store_new (seaf, "chunk-maps");
+    mgr->priv->dir_stats_store = seaf_obj_store_new (seaf, "dir-stats");
+#endif
+
+    pthread_mutex_init (&mgr->priv->cache_lock, NULL);
+    mgr->priv->obj_cache = g_hash_table_new (g_str_hash, g_str_equal);
+    g_queue_init (&mgr->priv->cache_lru);
+    mgr->priv->cache_max_size = DEFAULT_FS_CACHE_SIZE;
+
+    pthread_mutex_init (&mgr->priv->sink_lock, NULL);
+    mgr->priv->block_sinks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, g_free);
+
+    pthread_mutex_init (&mgr->priv->zero_lock, NULL);
+    mgr->priv->zero_block_ids = g_hash_table_new_full (g_direct_hash,
+                                                       g_direct_equal,
+                                                       NULL, g_free);
+
     return mgr;
 }
 
@@ -128,11 +202,205 @@ seaf_fs_manager_init (SeafFSManager *mgr)
         seaf_warning ("[fs mgr] Failed to init fs object store.\n");
         return -1;
     }
+
+    int cache_mb = seafile_session_config_get_int (seaf, KEY_FS_CACHE_SIZE, NULL);
+    if (cache_mb >= 0)
+        mgr->priv->cache_max_size = (gsize)cache_mb << 20;
 #endif
 
     return 0;
 }
 
+/* fs object cache. */
+
+static void
+fs_cache_make_key (char *key, const char *repo_id, const char *obj_id)
+{
+    memcpy (key, repo_id, 36);
+    memcpy (key + 36, obj_id, 40);
+    key[76] = '\0';
+}
+
+static gsize
+seafile_cache_size (Seafile *file)
+{
+    return sizeof(Seafile) + file->n_blocks * (sizeof(char *) + 41 + 20);
+}
+
+static gsize
+seafdir_cache_size (SeafDir *dir)
+{
+    gsize size = sizeof(SeafDir);
+    GList *ptr;
+    SeafDirent *dent;
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        size += sizeof(GList) + sizeof(SeafDirent) + dent->name_len + 1;
+        if (dent->modifier)
+            size += strlen(dent->modifier) + 1;
+    }
+
+    return size;
+}
+
+static SeafDir *
+seaf_dir_dup (SeafDir *dir)
+{
+    SeafDir *copy = g_new0 (SeafDir, 1);
+    GList *ptr;
+
+    copy->object.type = dir->object.type;
+    copy->version = dir->version;
+    memcpy (copy->dir_id, dir->dir_id, 40);
+    for (ptr = dir->entries; ptr; ptr = ptr->next)
+        copy->entries = g_list_prepend (copy->entries,
+                                        seaf_dirent_dup (ptr->data));
+    copy->entries = g_list_reverse (copy->entries);
+
+    return copy;
+}
+
+static void
+fs_cache_entry_free (FSCacheEntry *entry)
+{
+    if (entry->type == SEAF_METADATA_TYPE_FILE)
+        seafile_unref (entry->obj);
+    else
+        seaf_dir_free (entry->obj);
+    g_free (entry);
+}
+
+/* Called with cache_lock held. */
+static void
+fs_cache_remove_entry (SeafFSManagerPriv *priv, FSCacheEntry *entry)
+{
+    g_hash_table_remove (priv->obj_cache, entry->key);
+    g_queue_unlink (&priv->cache_lru, &entry->link);
+    priv->cache_size -= entry->size;
+    fs_cache_entry_free (entry);
+}
+
+/*
+ * Returns a reference to the cached Seafile or a copy of the cached SeafDir,
+ * or NULL.
+ */
+static gpointer
+fs_cache_lookup (SeafFSManager *mgr, const char *repo_id, const char *obj_id,
+                 int type)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+    char key[78];
+    FSCacheEntry *entry;
+    gpointer ret = NULL;
+
+    if (priv->cache_max_size == 0)
+        return NULL;
+
+    fs_cache_make_key (key, repo_id, obj_id);
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    entry = g_hash_table_lookup (priv->obj_cache, key);
+    if (entry && entry->type == type) {
+        g_queue_unlink (&priv->cache_lru, &entry->link);
+        g_queue_push_head_link (&priv->cache_lru, &entry->link);
+
+        if (type == SEAF_METADATA_TYPE_FILE) {
+            seafile_ref (entry->obj);
+            ret = entry->obj;
+        } else {
+            ret = seaf_dir_dup (entry->obj);
+        }
+        priv->cache_hits++;
+    } else {
+        priv->cache_misses++;
+    }
+
+    pthread_mutex_unlock (&priv->cache_lock);
+
+    return ret;
+}
+
+/* Takes over @obj, a reference for a Seafile or a copy for a SeafDir. */
+static void
+fs_cache_insert (SeafFSManager *mgr, const char *repo_id, const char *obj_id,
+                 int type, gpointer obj)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+    FSCacheEntry *entry, *old;
+    gsize size;
+
+    if (type == SEAF_METADATA_TYPE_FILE)
+        size = seafile_cache_size (obj);
+    else
+        size = seafdir_cache_size (obj);
+
+    /* A single big object shouldn't flush the whole cache. */
+    if (size > priv->cache_max_size / 8) {
+        if (type == SEAF_METADATA_TYPE_FILE)
+            seafile_unref (obj);
+        else
+            seaf_dir_free (obj);
+        return;
+    }
+
+    entry = g_new0 (FSCacheEntry, 1);
+    fs_cache_make_key (entry->key, repo_id, obj_id);
+    entry->type = type;
+    entry->obj = obj;
+    entry->size = size;
+    entry->link.data = entry;
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    old = g_hash_table_lookup (priv->obj_cache, entry->key);
+    if (old)
+        fs_cache_remove_entry (priv, old);
+
+    g_hash_table_insert (priv->obj_cache, entry->key, entry);
+    g_queue_push_head_link (&priv->cache_lru, &entry->link);
+    priv->cache_size += size;
+
+    while (priv->cache_size > priv->cache_max_size)
+        fs_cache_remove_entry (priv, priv->cache_lru.tail->data);
+
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+void
+seaf_fs_manager_drop_cached_objects (SeafFSManager *mgr, const char *repo_id)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+    GList *ptr, *next;
+    FSCacheEntry *entry;
+
+    pthread_mutex_lock (&priv->cache_lock);
+
+    for (ptr = priv->cache_lru.head; ptr; ptr = next) {
+        next = ptr->next;
+        entry = ptr->data;
+        if (strncmp (entry->key, repo_id, 36) == 0)
+            fs_cache_remove_entry (priv, entry);
+    }
+
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
+void
+seaf_fs_manager_get_cache_stats (SeafFSManager *mgr, SeafFSCacheStats *stats)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+
+    pthread_mutex_lock (&priv->cache_lock);
+    stats->hits = priv->cache_hits;
+    stats->misses = priv->cache_misses;
+    stats->n_objects = g_queue_get_length (&priv->cache_lru);
+    stats->size = priv->cache_size;
+    stats->max_size = priv->cache_max_size;
+    pthread_mutex_unlock (&priv->cache_lock);
+}
+
 #ifndef SEAFILE_SERVER
 static int
 checkout_block (const char *repo_id,
@@ -144,7 +412,6 @@ checkout_block (const char *repo_id,
     SeafBlockManager *block_mgr = seaf->block_mgr;
     BlockHandle *handle;
     BlockMetadata *bmd;
-    char *dec_out = NULL;
     int dec_out_len = -1;
     char *blk_content = NULL;
 
@@ -189,12 +456,12 @@ checkout_block (const char *repo_id,
             goto checkout_blk_error;
         }
 
-        /* decrypt the block */
-        int ret = seafile_decrypt (&dec_out,
-                                   &dec_out_len,
-                                   blk_content,
-                                   bmd->size,
-                                   crypt);
+        /* decrypt the block in place, the plaintext is never longer */
+        int ret = seafile_decrypt_buf (blk_content,
+                                       &dec_out_len,
+                                       blk_content,
+                                       bmd->size,
+                                       crypt);
 
         if (ret != 0) {
             seaf_warning ("Decryt block %s failed. \n", block_id);
@@ -202,7 +469,7 @@ checkout_block (const char *repo_id,
         }
 
         /* write the decrypted content */
-        ret = writen (wfd, dec_out, dec_out_len);
+        ret = writen_sparse (wfd, blk_content, dec_out_len);
 
 
         if (ret !=  dec_out_len) {
@@ -212,11 +479,10 @@ checkout_block (const char *repo_id,
         }
 
         g_free (blk_content);
-        g_free (dec_out);
 
     } else {
         /* not an encrypted block */
-        if (writen(wfd, blk_content, bmd->size) != bmd->size) {
+        if (writen_sparse (wfd, blk_content, bmd->size) != bmd->size) {
             seaf_warning ("Failed to write the decryted block %s.\n",
                        block_id);
             goto checkout_blk_error;
@@ -233,8 +499,6 @@ checkout_blk_error:
 
     if (blk_content)
         free (blk_content);
-    if (dec_out)
-        g_free (dec_out);
     if (bmd)
         g_free (bmd);
 
@@ -243,6 +507,16 @@ checkout_blk_error:
     return -1;
 }
 
+int
+seaf_fs_manager_checkout_block (const char *repo_id,
+                                int version,
+                                const char *block_id,
+                                int wfd,
+                                SeafileCrypt *crypt)
+{
+    return checkout_block (repo_id, version, block_id, wfd, crypt);
+}
+
 #define SEAF_TMP_EXT "~"
 #define SEAF_BACKUP_EXT ".sbak"
 
@@ -267,6 +541,33 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
                                gboolean force_conflict,
                                gboolean *conflicted,
                                const char *email)
+{
+    return seaf_fs_manager_checkout_file_with_writer (mgr, repo_id, version,
+                                                      file_id, file_path,
+                                                      mode, mtime, crypt,
+                                                      in_repo_path,
+                                                      conflict_head_id,
+                                                      force_conflict,
+                                                      conflicted, email,
+                                                      NULL, NULL);
+}
+
+int
+seaf_fs_manager_checkout_file_with_writer (SeafFSManager *mgr,
+                                           const char *repo_id,
+                                           int version,
+                                           const char *file_id,
+                                           const char *file_path,
+                                           guint32 mode,
+                                           guint64 mtime,
+                                           SeafileCrypt *crypt,
+                                           const char *in_repo_path,
+                                           const char *conflict_head_id,
+                                           gboolean force_conflict,
+                                           gboolean *conflicted,
+                                           const char *email,
+                                           CheckoutWriteFunc write_func,
+                                           void *write_data)
 {
     Seafile *seafile = NULL;
     char *blk_id;
@@ -297,10 +598,22 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
         goto bad;
     }
 
-    for (i = 0; i < seafile->n_blocks; ++i) {
-        blk_id = seafile->blk_sha1s[i];
-        if (checkout_block (repo_id, version, blk_id, wfd, crypt) < 0)
+    if (write_func) {
+        if (write_func (wfd, write_data) < 0)
             goto bad;
+    } else {
+        for (i = 0; i < seafile->n_blocks; ++i) {
+            blk_id = seafile->blk_sha1s[i];
+            if (checkout_block (repo_id, version, blk_id, wfd, crypt) < 0)
+                goto bad;
+        }
+    }
+
+    /* Runs of zeros were skipped by the block writers. */
+    if (sparse_write_finish (wfd) < 0) {
+        seaf_warning ("Failed to set size of %s: %s.\n",
+                      tmp_path, strerror(errno));
+        goto bad;
     }
 
     close (wfd);
@@ -452,43 +765,207 @@ create_seafile_v0 (CDCFileDescriptor *cdc, int *ondisk_size, char *seafile_id)
     return ondisk;
 }
 
-static void *
-create_seafile_json (int repo_version,
-                     CDCFileDescriptor *cdc,
-                     int *ondisk_size,
-                     char *seafile_id)
+/*
+ * Json fs objects.
+ *
+ * The object id is the sha1 of the json text, so the writers below must
+ * produce exactly what json_dumps() with JSON_SORT_KEYS produced for the
+ * same object: keys in strcmp order, ", " and ": " separators, the same
+ * string escapes, and members whose string value is NULL or not valid
+ * UTF-8 left out, since json_string() refuses them. No json tree is built;
+ * the text is written into a buffer kept per thread.
+ */
+
+typedef struct FSJsonScratch {
+    /* Strings with escapes, for the scanner. */
+    GString *buf;
+    /* Hex block ids, 40 bytes each. */
+    GByteArray *ids;
+    /* Dumped objects. */
+    GString *out;
+} FSJsonScratch;
+
+static void
+fs_json_scratch_free (gpointer p)
 {
-    json_t *object, *block_id_array;
+    FSJsonScratch *scratch = p;
+
+    g_string_free (scratch->buf, TRUE);
+    g_byte_array_free (scratch->ids, TRUE);
+    g_string_free (scratch->out, TRUE);
+    g_free (scratch);
+}
 
-    object = json_object ();
+static GPrivate fs_json_scratch_key = G_PRIVATE_INIT (fs_json_scratch_free);
 
-    json_object_set_int_member (object, "type", SEAF_METADATA_TYPE_FILE);
-    json_object_set_int_member (object, "version",
-                                seafile_version_from_repo_version(repo_version));
+static FSJsonScratch *
+get_fs_json_scratch ()
+{
+    FSJsonScratch *scratch = g_private_get (&fs_json_scratch_key);
+
+    if (!scratch) {
+        scratch = g_new0 (FSJsonScratch, 1);
+        scratch->buf = g_string_sized_new (256);
+        scratch->ids = g_byte_array_new ();
+        scratch->out = g_string_sized_new (4096);
+        g_private_set (&fs_json_scratch_key, scratch);
+    }
+    return scratch;
+}
 
-    json_object_set_int_member (object, "size", cdc->file_size);
+/* Don't keep more than this after dumping a huge object. */
+#define MAX_KEPT_JSON_OUT (1 << 20)
 
-    block_id_array = json_array ();
-    int i;
-    uint8_t *ptr = cdc->blk_sha1s;
+static GString *
+get_json_out ()
+{
+    FSJsonScratch *scratch = get_fs_json_scratch ();
+
+    if (scratch->out->allocated_len > MAX_KEPT_JSON_OUT) {
+        g_string_free (scratch->out, TRUE);
+        scratch->out = g_string_sized_new (4096);
+    }
+    g_string_truncate (scratch->out, 0);
+    return scratch->out;
+}
+
+static void
+dump_json_string (GString *out, const char *str)
+{
+    const char *p, *run;
+
+    g_string_append_c (out, '"');
+    for (run = p = str; *p; ++p) {
+        if (*p != '"' && *p != '\\' && (guchar)*p >= 0x20)
+            continue;
+
+        g_string_append_len (out, run, p - run);
+        switch (*p) {
+        case '"':
+            g_string_append (out, "\\\"");
+            break;
+        case '\\':
+            g_string_append (out, "\\\\");
+            break;
+        case '\b':
+            g_string_append (out, "\\b");
+            break;
+        case '\f':
+            g_string_append (out, "\\f");
+            break;
+        case '\n':
+            g_string_append (out, "\\n");
+            break;
+        case '\r':
+            g_string_append (out, "\\r");
+            break;
+        case '\t':
+            g_string_append (out, "\\t");
+            break;
+        default:
+            g_string_append_printf (out, "\\u%04X", (guchar)*p);
+            break;
+        }
+        run = p + 1;
+    }
+    g_string_append_len (out, run, p - run);
+    g_string_append_c (out, '"');
+}
+
+static void
+dump_json_key (GString *out, gboolean *first, const char *key)
+{
+    if (!*first)
+        g_string_append (out, ", ");
+    *first = FALSE;
+    g_string_append_printf (out, "\"%s\": ", key);
+}
+
+static void
+dump_string_member (GString *out, gboolean *first,
+                    const char *key, const char *value)
+{
+    if (!value || !g_utf8_validate (value, -1, NULL))
+        return;
+    dump_json_key (out, first, key);
+    dump_json_string (out, value);
+}
+
+static void
+dump_int_member (GString *out, gboolean *first, const char *key, gint64 value)
+{
+    dump_json_key (out, first, key);
+    g_string_append_printf (out, "%" G_GINT64_FORMAT, value);
+}
+
+/* @blk_ids are raw block ids, 20 bytes each. */
+static void
+dump_seafile_json (GString *out, int version, guint64 file_size,
+                   const guint8 *blk_ids, int n_blocks)
+{
     char block_id[41];
-    for (i = 0; i < cdc->block_nr; ++i) {
-        rawdata_to_hex (ptr, block_id, 20);
-        json_array_append_new (block_id_array, json_string(block_id));
-        ptr += 20;
+    int i;
+
+    g_string_append (out, "{\"block_ids\": [");
+    for (i = 0; i < n_blocks; ++i) {
+        if (i > 0)
+            g_string_append (out, ", ");
+        rawdata_to_hex (blk_ids + i * 20, block_id, 20);
+        g_string_append_c (out, '"');
+        g_string_append_len (out, block_id, 40);
+        g_string_append_c (out, '"');
     }
-    json_object_set_new (object, "block_ids", block_id_array);
+    g_string_append_printf (out, "], \"size\": %" G_GINT64_FORMAT
+                            ", \"type\": %d, \"version\": %d}",
+                            (gint64)file_size, SEAF_METADATA_TYPE_FILE, version);
+}
 
-    char *data = json_dumps (object, JSON_SORT_KEYS);
-    *ondisk_size = strlen(data);
+static void
+dump_dir_json (GString *out, SeafDir *dir)
+{
+    GList *ptr;
+    SeafDirent *dirent;
+    gboolean first;
 
-    /* The seafile object id is sha1 hash of the json object. */
+    g_string_append (out, "{\"dirents\": [");
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dirent = ptr->data;
+        if (ptr != dir->entries)
+            g_string_append (out, ", ");
+
+        g_string_append_c (out, '{');
+        first = TRUE;
+        dump_string_member (out, &first, "id", dirent->id);
+        dump_int_member (out, &first, "mode", dirent->mode);
+        if (S_ISREG(dirent->mode))
+            dump_string_member (out, &first, "modifier", dirent->modifier);
+        dump_int_member (out, &first, "mtime", dirent->mtime);
+        dump_string_member (out, &first, "name", dirent->name);
+        if (S_ISREG(dirent->mode))
+            dump_int_member (out, &first, "size", dirent->size);
+        g_string_append_c (out, '}');
+    }
+    g_string_append_printf (out, "], \"type\": %d, \"version\": %d}",
+                            SEAF_METADATA_TYPE_DIR, dir->version);
+}
+
+/* The returned buffer is only valid until the next object is dumped. */
+static GString *
+create_seafile_json (int repo_version,
+                     CDCFileDescriptor *cdc,
+                     char *seafile_id)
+{
+    GString *out = get_json_out ();
     unsigned char sha1[20];
-    calculate_sha1 (sha1, data, *ondisk_size);
+
+    dump_seafile_json (out, seafile_version_from_repo_version(repo_version),
+                       cdc->file_size, cdc->blk_sha1s, cdc->block_nr);
+
+    /* The seafile object id is sha1 hash of the json object. */
+    calculate_sha1 (sha1, out->str, out->len);
     rawdata_to_hex (sha1, seafile_id, 20);
 
-    json_decref (object);
-    return data;
+    return out;
 }
 
 void
@@ -496,35 +973,24 @@ seaf_fs_manager_calculate_seafile_id_json (int repo_version,
                                            CDCFileDescriptor *cdc,
                                            guint8 *file_id_sha1)
 {
-    json_t *object, *block_id_array;
-
-    object = json_object ();
-
-    json_object_set_int_member (object, "type", SEAF_METADATA_TYPE_FILE);
-    json_object_set_int_member (object, "version",
-                                seafile_version_from_repo_version(repo_version));
+    GString *out = get_json_out ();
 
-    json_object_set_int_member (object, "size", cdc->file_size);
+    dump_seafile_json (out, seafile_version_from_repo_version(repo_version),
+                       cdc->file_size, cdc->blk_sha1s, cdc->block_nr);
 
-    block_id_array = json_array ();
-    int i;
-    uint8_t *ptr = cdc->blk_sha1s;
-    char block_id[41];
-    for (i = 0; i < cdc->block_nr; ++i) {
-        rawdata_to_hex (ptr, block_id, 20);
-        json_array_append_new (block_id_array, json_string(block_id));
-        ptr += 20;
-    }
-    json_object_set_new (object, "block_ids", block_id_array);
+    /* The seafile object id is sha1 hash of the json object. */
+    calculate_sha1 (file_id_sha1, out->str, out->len);
+}
 
-    char *data = json_dumps (object, JSON_SORT_KEYS);
-    int ondisk_size = strlen(data);
+char *
+seaf_fs_manager_dump_seafile_json (int repo_version, CDCFileDescriptor *cdc)
+{
+    GString *out = get_json_out ();
 
-    /* The seafile object id is sha1 hash of the json object. */
-    calculate_sha1 (file_id_sha1, data, ondisk_size);
+    dump_seafile_json (out, seafile_version_from_repo_version(repo_version),
+                       cdc->file_size, cdc->blk_sha1s, cdc->block_nr);
 
-    json_decref (object);
-    free (data);
+    return g_strndup (out->str, out->len);
 }
 
 static int
@@ -540,16 +1006,15 @@ write_seafile (SeafFSManager *fs_mgr,
     int ondisk_size;
 
     if (version > 0) {
-        ondisk = create_seafile_json (version, cdc, &ondisk_size, seafile_id);
+        GString *json = create_seafile_json (version, cdc, seafile_id);
 
         guint8 *compressed;
         int outlen;
 
-        if (seaf_compress (ondisk, ondisk_size, &compressed, &outlen) < 0) {
+        if (seaf_compress ((guint8 *)json->str, json->len, &compressed, &outlen) < 0) {
             seaf_warning ("Failed to compress seafile obj %s:%s.\n",
                           repo_id, seafile_id);
             ret = -1;
-            free (ondisk);
             goto out;
         }
 
@@ -557,7 +1022,6 @@ write_seafile (SeafFSManager *fs_mgr,
                                       compressed, outlen, FALSE) < 0)
             ret = -1;
         g_free (compressed);
-        free (ondisk);
     } else {
         ondisk = create_seafile_v0 (cdc, &ondisk_size, seafile_id);
 
@@ -587,6 +1051,53 @@ calculate_chunk_size (uint64_t total_size)
     return 1 * MiB;
 }
 
+typedef struct BlockSink {
+    SeafBlockSinkFunc func;
+    void *user_data;
+} BlockSink;
+
+void
+seaf_fs_manager_set_block_sink (SeafFSManager *mgr,
+                                const char *repo_id,
+                                SeafBlockSinkFunc func,
+                                void *user_data)
+{
+    SeafFSManagerPriv *priv = mgr->priv;
+    BlockSink *sink;
+
+    pthread_mutex_lock (&priv->sink_lock);
+    if (func) {
+        sink = g_new0 (BlockSink, 1);
+        sink->func = func;
+        sink->user_data = user_data;
+        g_hash_table_replace (priv->block_sinks, g_strdup (repo_id), sink);
+    } else {
+        g_hash_table_remove (priv->block_sinks, repo_id);
+    }
+    pthread_mutex_unlock (&priv->sink_lock);
+}
+
+static void
+write_to_block_sink (const char *repo_id, int version,
+                     const char *block_id, const char *buf, int len)
+{
+    SeafFSManagerPriv *priv = seaf->fs_mgr->priv;
+    BlockSink *sink;
+    SeafBlockSinkFunc func = NULL;
+    void *user_data = NULL;
+
+    pthread_mutex_lock (&priv->sink_lock);
+    sink = g_hash_table_lookup (priv->block_sinks, repo_id);
+    if (sink) {
+        func = sink->func;
+        user_data = sink->user_data;
+    }
+    pthread_mutex_unlock (&priv->sink_lock);
+
+    if (func)
+        func (repo_id, version, block_id, buf, len, user_data);
+}
+
 static int
 do_write_chunk (const char *repo_id, int version,
                 uint8_t *checksum, const char *buf, int len)
@@ -594,6 +1105,7 @@ do_write_chunk (const char *repo_id, int version,
     SeafBlockManager *blk_mgr = seaf->block_mgr;
     char chksum_str[41];
     BlockHandle *handle;
+    gint64 start;
     int n;
 
     rawdata_to_hex (checksum, chksum_str, 20);
@@ -604,6 +1116,10 @@ do_write_chunk (const char *repo_id, int version,
                                          chksum_str))
         return 0;
 
+    write_to_block_sink (repo_id, version, chksum_str, buf, len);
+
+    start = seaf_trace_begin ();
+
     handle = seaf_block_manager_open_block (blk_mgr,
                                             repo_id, version,
                                             chksum_str, BLOCK_WRITE);
@@ -633,9 +1149,38 @@ do_write_chunk (const char *repo_id, int version,
     }
 
     seaf_block_manager_block_handle_free (blk_mgr, handle);
+
+    seaf_trace_end ("fs", "write_block", start, chksum_str);
     return 0;
 }
 
+/* Computes the id of a chunk of zeros, and frees @ctx. */
+static void
+hash_zero_chunk (CDCDescriptor *chunk, SeafileSHA1Ctx *ctx, uint8_t *checksum)
+{
+    SeafFSManagerPriv *priv = seaf->fs_mgr->priv;
+    gpointer key = GUINT_TO_POINTER (chunk->len);
+    guint8 *id;
+
+    pthread_mutex_lock (&priv->zero_lock);
+    id = g_hash_table_lookup (priv->zero_block_ids, key);
+    if (id)
+        memcpy (checksum, id, 20);
+    pthread_mutex_unlock (&priv->zero_lock);
+
+    if (id) {
+        seafile_sha1_free (ctx);
+        return;
+    }
+
+    seafile_sha1_update (ctx, chunk->block_buf, chunk->len);
+    seafile_sha1_final (ctx, checksum);
+
+    pthread_mutex_lock (&priv->zero_lock);
+    g_hash_table_replace (priv->zero_block_ids, key, g_memdup (checksum, 20));
+    pthread_mutex_unlock (&priv->zero_lock);
+}
+
 /* write the chunk and store its checksum */
 int
 seafile_write_chunk (const char *repo_id,
@@ -645,8 +1190,8 @@ seafile_write_chunk (const char *repo_id,
                      uint8_t *checksum,
                      gboolean write_data)
 {
-    GChecksum *ctx = g_checksum_new (G_CHECKSUM_SHA1);
-    gsize len = 20;
+    SeafileSHA1Ctx *ctx = seafile_sha1_new ();
+    gint64 start;
     int ret = 0;
 
     /* Encrypt before write to disk if needed, and we don't encrypt
@@ -655,47 +1200,67 @@ seafile_write_chunk (const char *repo_id,
         char *encrypted_buf = NULL;         /* encrypted output */
         int enc_len = -1;                /* encrypted length */
 
-        ret = seafile_encrypt (&encrypted_buf, /* output */
-                               &enc_len,      /* output len */
-                               chunk->block_buf, /* input */
-                               chunk->len,       /* input len */
-                               crypt);
+        start = seaf_trace_begin ();
+        if (chunk->buf_cap >= SEAFILE_ENCRYPTED_SIZE (chunk->len)) {
+            /* The buffer belongs to the caller and has room for padding. */
+            ret = seafile_encrypt_buf (chunk->block_buf, &enc_len,
+                                       chunk->block_buf, chunk->len,
+                                       crypt);
+            if (ret == 0)
+                encrypted_buf = chunk->block_buf;
+        } else {
+            ret = seafile_encrypt (&encrypted_buf, /* output */
+                                   &enc_len,      /* output len */
+                                   chunk->block_buf, /* input */
+                                   chunk->len,       /* input len */
+                                   crypt);
+        }
         if (ret != 0) {
             seaf_warning ("Error: failed to encrypt block\n");
-            g_checksum_free (ctx);
+            seafile_sha1_free (ctx);
             return -1;
         }
+        seaf_trace_end ("fs", "encrypt", start, NULL);
 
+        start = seaf_trace_begin ();
         if (seaf->disable_block_hash) {
             char *uuid = gen_uuid();
-            g_checksum_update (ctx, (unsigned char *)uuid, strlen(uuid));
+            seafile_sha1_update (ctx, uuid, strlen(uuid));
             g_free(uuid);
         } else {
-            g_checksum_update (ctx, (unsigned char *)encrypted_buf, enc_len);
+            seafile_sha1_update (ctx, encrypted_buf, enc_len);
         }
-        g_checksum_get_digest (ctx, checksum, &len);
+        seafile_sha1_final (ctx, checksum);
+        seaf_trace_end ("fs", "hash", start, NULL);
 
         if (write_data)
             ret = do_write_chunk (repo_id, version, checksum, encrypted_buf, enc_len);
-        g_free (encrypted_buf);
+        if (encrypted_buf != chunk->block_buf)
+            g_free (encrypted_buf);
     } else {
         /* not a encrypted repo, go ahead */
+        start = seaf_trace_begin ();
         if (seaf->disable_block_hash) {
             char *uuid = gen_uuid();
-            g_checksum_update (ctx, (unsigned char *)uuid, strlen(uuid));
+            seafile_sha1_update (ctx, uuid, strlen(uuid));
             g_free(uuid);
+            seafile_sha1_final (ctx, checksum);
+        }
+        else if (chunk->len > 0 && is_zero_buf (chunk->block_buf, chunk->len)) {
+            /* Preallocated files and disk images have long runs of zeros,
+             * which make a few distinct blocks. Hash each of them once. */
+            hash_zero_chunk (chunk, ctx, checksum);
         }
         else {
-            g_checksum_update (ctx, (unsigned char *)chunk->block_buf, chunk->len);
+            seafile_sha1_update (ctx, chunk->block_buf, chunk->len);
+            seafile_sha1_final (ctx, checksum);
         }
-        g_checksum_get_digest (ctx, checksum, &len);
+        seaf_trace_end ("fs", "hash", start, NULL);
 
         if (write_data)
             ret = do_write_chunk (repo_id, version, checksum, chunk->block_buf, chunk->len);
     }
 
-    g_checksum_free (ctx);
-
     return ret;
 }
 
@@ -709,8 +1274,8 @@ typedef struct ChunkingData {
     const char *repo_id;
     int version;
     uint32_t blk_size;
-    const char *file_path;
     SeafileCrypt *crypt;
+    gboolean write_data;
     guint8 *blk_sha1s;
     GAsyncQueue *finished_tasks;
 } ChunkingData;
@@ -720,54 +1285,47 @@ chunking_worker (gpointer vdata, gpointer user_data)
 {
     ChunkingData *data = user_data;
     CDCDescriptor *chunk = vdata;
-    int fd = -1;
-    ssize_t n;
+    gint64 start = seaf_trace_begin ();
+    char block_id[41];
     int idx;
 
-    chunk->block_buf = g_new0 (char, chunk->len);
-    if (!chunk->block_buf) {
-        seaf_warning ("Failed to allow chunk buffer\n");
-        goto out;
+    chunk->result = seafile_write_chunk (data->repo_id, data->version,
+                                         chunk, data->crypt,
+                                         chunk->checksum, data->write_data);
+    if (chunk->result == 0) {
+        idx = chunk->offset / data->blk_size;
+        memcpy (data->blk_sha1s + idx * CHECKSUM_LENGTH,
+                chunk->checksum, CHECKSUM_LENGTH);
     }
 
-    fd = seaf_util_open (data->file_path, O_RDONLY | O_BINARY);
-    if (fd < 0) {
-        seaf_warning ("Failed to open %s: %s\n", data->file_path, strerror(errno));
-        chunk->result = -1;
-        goto out;
+    if (start != 0) {
+        rawdata_to_hex (chunk->checksum, block_id, 20);
+        seaf_trace_end ("fs", "chunk", start, block_id);
     }
 
-    if (seaf_util_lseek (fd, chunk->offset, SEEK_SET) == (gint64)-1) {
-        seaf_warning ("Failed to lseek %s: %s\n", data->file_path, strerror(errno));
-        chunk->result = -1;
-        goto out;
-    }
+    g_async_queue_push (data->finished_tasks, chunk);
+}
 
-    n = readn (fd, chunk->block_buf, chunk->len);
-    if (n < 0) {
-        seaf_warning ("Failed to read chunk from %s: %s\n",
-                      data->file_path, strerror(errno));
-        chunk->result = -1;
-        goto out;
-    }
+static void
+free_chunk (gpointer vchunk)
+{
+    CDCDescriptor *chunk = vchunk;
 
-    chunk->result = seafile_write_chunk (data->repo_id, data->version,
-                                         chunk, data->crypt,
-                                         chunk->checksum, 1);
-    if (chunk->result < 0)
-        goto out;
-
-    idx = chunk->offset / data->blk_size;
-    memcpy (data->blk_sha1s + idx * CHECKSUM_LENGTH, chunk->checksum, CHECKSUM_LENGTH);
-
-out:
     g_free (chunk->block_buf);
-    close (fd);
-    g_async_queue_push (data->finished_tasks, chunk);
+    g_free (chunk);
 }
 
-#define DEFAULT_SPLIT_FILE_TO_BLOCK_THREADS 3
+#define MAX_SPLIT_FILE_TO_BLOCK_THREADS 32
+/* Number of chunks that can be read ahead per worker thread. */
+#define SPLIT_FILE_TO_BLOCK_QUEUE_DEPTH 2
 
+/*
+ * The calling thread reads the file sequentially and hands fixed-size
+ * chunks to a pool that hashes, encrypts and writes them. At most
+ * SPLIT_FILE_TO_BLOCK_QUEUE_DEPTH chunks per worker are in flight and their
+ * buffers are recycled, so memory use is bounded no matter how large the
+ * file is.
+ */
 static int
 split_file_to_block (const char *repo_id,
                      int version,
@@ -779,11 +1337,13 @@ split_file_to_block (const char *repo_id,
 {
     int n_blocks;
     uint8_t *block_sha1s = NULL;
-    GThreadPool *tpool = NULL;
+    WorkerTaskGroup *group = NULL;
     GAsyncQueue *finished_tasks = NULL;
-    GList *pending_tasks = NULL;
+    GList *free_chunks = NULL;
+    int n_threads, max_pending;
     int n_pending = 0;
     CDCDescriptor *chunk;
+    int fd = -1;
     int ret = 0;
 
     n_blocks = (file_size + cdc->block_sz - 1) / cdc->block_sz;
@@ -794,65 +1354,98 @@ split_file_to_block (const char *repo_id,
         goto out;
     }
 
+    fd = seaf_util_open (file_path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        seaf_warning ("Failed to open %s: %s\n", file_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
     finished_tasks = g_async_queue_new ();
 
     ChunkingData data;
     memset (&data, 0, sizeof(data));
     data.repo_id = repo_id;
     data.version = version;
-    data.file_path = file_path;
     data.crypt = crypt;
+    data.write_data = write_data;
     data.blk_sha1s = block_sha1s;
     data.finished_tasks = finished_tasks;
     data.blk_size = cdc->block_sz;
-    
-    tpool = g_thread_pool_new (chunking_worker, &data,
-                               DEFAULT_SPLIT_FILE_TO_BLOCK_THREADS, FALSE, NULL);
-    if (!tpool) {
-        seaf_warning ("Failed to allocate thread pool\n");
-        ret = -1;
-        goto out;
-    }
+
+    n_threads = CLAMP (g_get_num_processors (), 1, MAX_SPLIT_FILE_TO_BLOCK_THREADS);
+    max_pending = n_threads * SPLIT_FILE_TO_BLOCK_QUEUE_DEPTH;
+
+    /* Chunks of files being indexed go before new files. */
+    group = worker_task_group_new (chunking_worker, &data,
+                                   WORKER_PRIORITY_HIGH);
 
     guint64 offset = 0;
     guint64 len;
     guint64 left = (guint64)file_size;
-    while (left > 0) {
-        len = ((left >= cdc->block_sz) ? cdc->block_sz : left);
-
-        chunk = g_new0 (CDCDescriptor, 1);
-        chunk->offset = offset;
-        chunk->len = (guint32)len;
+    ssize_t n;
+    while (left > 0 || n_pending > 0) {
+        /* Stop reading once a chunk failed, but wait for the pending ones
+         * since the workers still use their buffers.
+         */
+        if (left > 0 && ret == 0 && n_pending < max_pending) {
+            len = ((left >= cdc->block_sz) ? cdc->block_sz : left);
+
+            if (free_chunks) {
+                chunk = free_chunks->data;
+                free_chunks = g_list_delete_link (free_chunks, free_chunks);
+            } else {
+                chunk = g_new0 (CDCDescriptor, 1);
+                /* Leave room for the padding so that the block can be
+                 * encrypted in place. */
+                chunk->buf_cap = cdc->block_sz + ENCRYPT_BLK_SIZE;
+                chunk->block_buf = g_new (char, chunk->buf_cap);
+            }
+            chunk->offset = offset;
+            chunk->len = (guint32)len;
+            chunk->result = 0;
+
+            n = readn (fd, chunk->block_buf, chunk->len);
+            if (n < 0 || (guint64)n != len) {
+                seaf_warning ("Failed to read chunk from %s: %s\n", file_path,
+                              (n < 0) ? strerror(errno) : "file size changed");
+                free_chunks = g_list_prepend (free_chunks, chunk);
+                ret = -1;
+                continue;
+            }
 
-        g_thread_pool_push (tpool, chunk, NULL);
-        pending_tasks = g_list_prepend (pending_tasks, chunk);
-        n_pending++;
+            worker_task_group_push (group, chunk);
+            n_pending++;
 
-        left -= len;
-        offset += len;
-    }
-
-    while ((chunk = g_async_queue_pop (finished_tasks)) != NULL) {
-        if (chunk->result < 0) {
-            ret = -1;
-            goto out;
+            left -= len;
+            offset += len;
+            continue;
         }
 
-        if ((--n_pending) <= 0) {
+        if (n_pending == 0)
             break;
-        }
-    }
 
-    cdc->block_nr = n_blocks;
-    cdc->blk_sha1s = block_sha1s;
+        /* Chunk in this thread too, instead of only waiting. */
+        while ((chunk = g_async_queue_try_pop (finished_tasks)) == NULL)
+            worker_task_group_help (group);
+        n_pending--;
+        if (chunk->result < 0)
+            ret = -1;
+        free_chunks = g_list_prepend (free_chunks, chunk);
+    }
 
+    if (ret == 0) {
+        cdc->block_nr = n_blocks;
+        cdc->blk_sha1s = block_sha1s;
+    }
 
 out:
-    if (tpool)
-        g_thread_pool_free (tpool, TRUE, TRUE);
+    worker_task_group_free (group);
     if (finished_tasks)
         g_async_queue_unref (finished_tasks);
-    g_list_free_full (pending_tasks, g_free);
+    g_list_free_full (free_chunks, free_chunk);
+    if (fd >= 0)
+        close (fd);
     if (ret < 0)
         g_free (block_sha1s);
 
@@ -860,6 +1453,160 @@ out:
 }
 
 
+static void
+set_cdc_block_sizes (CDCFileDescriptor *cdc)
+{
+    if (seaf->cdc_average_block_size == 0) {
+        cdc->block_sz = CDC_AVERAGE_BLOCK_SIZE;
+        cdc->block_min_sz = CDC_MIN_BLOCK_SIZE;
+        cdc->block_max_sz = CDC_MAX_BLOCK_SIZE;
+    } else {
+        cdc->block_sz = seaf->cdc_average_block_size;
+        cdc->block_min_sz = seaf->cdc_average_block_size >> 1;
+        cdc->block_max_sz = seaf->cdc_average_block_size << 1;
+    }
+}
+
+/*
+ * Chunk maps are kept for files at least this large, so that a later
+ * version can be chunked from the old boundaries.
+ */
+#define CHUNK_MAP_MIN_FILE_SIZE (64 << 20)
+
+#define CHUNK_MAP_MAGIC 0x53434d31
+
+/*
+ * On disk, a chunk map is the magic, the average block size it was chunked
+ * with and the number of chunks, followed by the length and content SHA1
+ * of each chunk. Integers are in network byte order.
+ */
+#define CHUNK_MAP_HEADER_SIZE 12
+#define CHUNK_MAP_ENTRY_SIZE (4 + CHECKSUM_LENGTH)
+
+static gboolean
+chunk_map_wanted (SeafFSManager *mgr, gint64 size, gboolean use_cdc)
+{
+    /* Random block ids can't be reused. */
+    return mgr->priv->chunk_map_store != NULL && use_cdc &&
+        !seaf->disable_block_hash && size >= CHUNK_MAP_MIN_FILE_SIZE;
+}
+
+static int
+save_chunk_map (SeafFSManager *mgr,
+                const char *repo_id,
+                int version,
+                const unsigned char *file_sha1,
+                uint32_t block_sz,
+                const CDCChunkMap *map)
+{
+    char file_id[41];
+    guint8 *data, *p;
+    int len, ret;
+    uint32_t i, v;
+
+    len = CHUNK_MAP_HEADER_SIZE + map->n_chunks * CHUNK_MAP_ENTRY_SIZE;
+    p = data = g_malloc (len);
+
+    v = htonl (CHUNK_MAP_MAGIC);
+    memcpy (p, &v, 4);
+    v = htonl (block_sz);
+    memcpy (p + 4, &v, 4);
+    v = htonl (map->n_chunks);
+    memcpy (p + 8, &v, 4);
+    p += CHUNK_MAP_HEADER_SIZE;
+
+    for (i = 0; i < map->n_chunks; ++i) {
+        v = htonl (map->lens[i]);
+        memcpy (p, &v, 4);
+        memcpy (p + 4, map->sums + i * CHECKSUM_LENGTH, CHECKSUM_LENGTH);
+        p += CHUNK_MAP_ENTRY_SIZE;
+    }
+
+    rawdata_to_hex (file_sha1, file_id, 20);
+    ret = seaf_obj_store_write_obj (mgr->priv->chunk_map_store, repo_id,
+                                    version, file_id, data, len, FALSE);
+    g_free (data);
+    return ret;
+}
+
+static int
+load_chunk_map (SeafFSManager *mgr,
+                const char *repo_id,
+                int version,
+                const char *file_id,
+                uint32_t block_sz,
+                CDCChunkMap *map)
+{
+    void *data;
+    guint8 *p;
+    int len;
+    uint32_t i, v, n;
+
+    if (seaf_obj_store_read_obj (mgr->priv->chunk_map_store, repo_id, version,
+                                 file_id, &data, &len) < 0)
+        return -1;
+
+    p = data;
+    if (len < CHUNK_MAP_HEADER_SIZE)
+        goto bad;
+    memcpy (&v, p, 4);
+    if (ntohl (v) != CHUNK_MAP_MAGIC)
+        goto bad;
+    /* Chunked with other block sizes, the boundaries don't line up. */
+    memcpy (&v, p + 4, 4);
+    if (ntohl (v) != block_sz)
+        goto bad;
+    memcpy (&v, p + 8, 4);
+    n = ntohl (v);
+    if (n == 0 || (len - CHUNK_MAP_HEADER_SIZE) / CHUNK_MAP_ENTRY_SIZE != n ||
+        (len - CHUNK_MAP_HEADER_SIZE) % CHUNK_MAP_ENTRY_SIZE != 0)
+        goto bad;
+    p += CHUNK_MAP_HEADER_SIZE;
+
+    map->n_chunks = n;
+    map->lens = g_new (uint32_t, n);
+    map->sums = g_new (uint8_t, n * CHECKSUM_LENGTH);
+    for (i = 0; i < n; ++i) {
+        memcpy (&v, p, 4);
+        map->lens[i] = ntohl (v);
+        memcpy (map->sums + i * CHECKSUM_LENGTH, p + 4, CHECKSUM_LENGTH);
+        p += CHUNK_MAP_ENTRY_SIZE;
+    }
+
+    g_free (data);
+    return 0;
+
+bad:
+    g_free (data);
+    return -1;
+}
+
+/* Builds the chunk map of a file while it's chunked by file_chunk_cdc(). */
+typedef struct ChunkMapBuilder {
+    GArray *lens;
+    GByteArray *sums;
+} ChunkMapBuilder;
+
+static int
+record_chunk (const char *repo_id,
+              int version,
+              CDCDescriptor *chunk,
+              SeafileCrypt *crypt,
+              uint8_t *checksum,
+              gboolean write_data)
+{
+    ChunkMapBuilder *builder = chunk->user_data;
+    unsigned char sum[CHECKSUM_LENGTH];
+
+    /* Before writing, the chunk may be encrypted in place. */
+    calculate_sha1 (sum, chunk->block_buf, chunk->len);
+    g_array_append_val (builder->lens, chunk->len);
+    g_byte_array_append (builder->sums, sum, CHECKSUM_LENGTH);
+
+    return seafile_write_chunk (repo_id, version, chunk, crypt,
+                                checksum, write_data);
+}
+
 int
 seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               const char *repo_id,
@@ -873,6 +1620,8 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
 {
     SeafStat sb;
     CDCFileDescriptor cdc;
+    ChunkMapBuilder builder = { NULL, NULL };
+    CDCChunkMap map;
 
     if (seaf_stat (file_path, &sb) < 0) {
         seaf_warning ("Bad file %s: %s.\n", file_path, strerror(errno));
@@ -887,24 +1636,21 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
         create_cdc_for_empty_file (&cdc);
     } else {
         memset (&cdc, 0, sizeof(cdc));
+        set_cdc_block_sizes (&cdc);
 
-        if (seaf->cdc_average_block_size == 0) {
-            cdc.block_sz = CDC_AVERAGE_BLOCK_SIZE;
-            cdc.block_min_sz = CDC_MIN_BLOCK_SIZE;
-            cdc.block_max_sz = CDC_MAX_BLOCK_SIZE;
-        } else {
-            cdc.block_sz = seaf->cdc_average_block_size;
-            cdc.block_min_sz = seaf->cdc_average_block_size >> 1;
-            cdc.block_max_sz = seaf->cdc_average_block_size << 1;
-        }
-        
         if (use_cdc) {
             cdc.write_block = seafile_write_chunk;
+            if (write_data && chunk_map_wanted (mgr, sb.st_size, use_cdc)) {
+                builder.lens = g_array_new (FALSE, FALSE, sizeof(uint32_t));
+                builder.sums = g_byte_array_new ();
+                cdc.write_block = record_chunk;
+                cdc.user_data = &builder;
+            }
             memcpy (cdc.repo_id, repo_id, 36);
             cdc.version = version;
             if (filename_chunk_cdc (file_path, &cdc, crypt, write_data) < 0) {
                 seaf_warning ("Failed to chunk file with CDC.\n");
-                return -1;
+                goto error;
             }
         } else {
             memcpy (cdc.repo_id, repo_id, 36);
@@ -919,7 +1665,17 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
         if (write_data && write_seafile (mgr, repo_id, version, &cdc, sha1) < 0) {
             g_free (cdc.blk_sha1s);
             seaf_warning ("Failed to write seafile for %s.\n", file_path);
-            return -1;
+            goto error;
+        }
+
+        if (builder.lens) {
+            map.n_chunks = builder.lens->len;
+            map.lens = (uint32_t *)builder.lens->data;
+            map.sums = builder.sums->data;
+            /* Without the map, the next version is chunked from scratch. */
+            if (save_chunk_map (mgr, repo_id, version, sha1,
+                                cdc.block_sz, &map) < 0)
+                seaf_warning ("Failed to save chunk map for %s.\n", file_path);
         }
     }
 
@@ -927,28 +1683,208 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
 
     if (cdc.blk_sha1s)
         free (cdc.blk_sha1s);
+    if (builder.lens) {
+        g_array_free (builder.lens, TRUE);
+        g_byte_array_free (builder.sums, TRUE);
+    }
+
+    return 0;
+
+error:
+    if (builder.lens) {
+        g_array_free (builder.lens, TRUE);
+        g_byte_array_free (builder.sums, TRUE);
+    }
+    return -1;
+}
+
+int
+seaf_fs_manager_reindex_blocks (SeafFSManager *mgr,
+                                const char *repo_id,
+                                int version,
+                                const char *file_path,
+                                const char *old_file_id,
+                                unsigned char sha1[],
+                                gint64 *size,
+                                SeafileCrypt *crypt)
+{
+    SeafStat sb;
+    CDCFileDescriptor cdc;
+    CDCChunkMap old_map, new_map;
+    Seafile *old_file = NULL;
+    int fd = -1;
+    int ret = 0;
+
+    memset (&old_map, 0, sizeof(old_map));
+    memset (&new_map, 0, sizeof(new_map));
+    memset (&cdc, 0, sizeof(cdc));
+    set_cdc_block_sizes (&cdc);
+
+    if (seaf_stat (file_path, &sb) < 0) {
+        seaf_warning ("Bad file %s: %s.\n", file_path, strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISREG(sb.st_mode) || !chunk_map_wanted (mgr, sb.st_size, TRUE))
+        goto fallback;
+
+    if (load_chunk_map (mgr, repo_id, version, old_file_id,
+                        cdc.block_sz, &old_map) < 0)
+        goto fallback;
+
+    old_file = seaf_fs_manager_get_seafile (mgr, repo_id, version, old_file_id);
+    if (!old_file || old_file->n_blocks != old_map.n_chunks)
+        goto fallback;
+
+    fd = seaf_util_open (file_path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        seaf_warning ("Failed to open %s: %s.\n", file_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    cdc.write_block = seafile_write_chunk;
+    memcpy (cdc.repo_id, repo_id, 36);
+    cdc.version = version;
+    if (file_rechunk_cdc (fd, &cdc, crypt, &old_map,
+                          old_file->blk_ids, &new_map) < 0) {
+        seaf_warning ("Failed to chunk file %s from its old version.\n",
+                      file_path);
+        ret = -1;
+        goto out;
+    }
+
+    if (write_seafile (mgr, repo_id, version, &cdc, sha1) < 0) {
+        seaf_warning ("Failed to write seafile for %s.\n", file_path);
+        ret = -1;
+        goto out;
+    }
+
+    if (save_chunk_map (mgr, repo_id, version, sha1,
+                        cdc.block_sz, &new_map) < 0)
+        seaf_warning ("Failed to save chunk map for %s.\n", file_path);
+
+    *size = (gint64)cdc.file_size;
+
+out:
+    if (fd >= 0)
+        close (fd);
+    if (cdc.blk_sha1s)
+        free (cdc.blk_sha1s);
+    cdc_chunk_map_clear (&old_map);
+    cdc_chunk_map_clear (&new_map);
+    if (old_file)
+        seafile_unref (old_file);
+    return ret;
+
+fallback:
+    cdc_chunk_map_clear (&old_map);
+    if (old_file)
+        seafile_unref (old_file);
+    return seaf_fs_manager_index_blocks (mgr, repo_id, version, file_path,
+                                         sha1, size, crypt, TRUE, TRUE);
+}
+
+typedef struct WantedBlocks {
+    GHashTable *wanted;
+    int n_written;
+} WantedBlocks;
+
+static int
+write_wanted_chunk (const char *repo_id,
+                    int version,
+                    CDCDescriptor *chunk,
+                    SeafileCrypt *crypt,
+                    uint8_t *checksum,
+                    gboolean write_data)
+{
+    WantedBlocks *data = chunk->user_data;
+    char block_id[41];
+
+    /* Get the id first, only wanted blocks are encrypted again and written. */
+    if (seafile_write_chunk (repo_id, version, chunk, crypt, checksum, FALSE) < 0)
+        return -1;
+
+    rawdata_to_hex (checksum, block_id, 20);
+    if (!g_hash_table_contains (data->wanted, block_id))
+        return 0;
+
+    if (seafile_write_chunk (repo_id, version, chunk, crypt, checksum, TRUE) < 0)
+        return -1;
+
+    g_hash_table_remove (data->wanted, block_id);
+    data->n_written++;
 
     return 0;
 }
 
+int
+seaf_fs_manager_write_blocks_from_file (SeafFSManager *mgr,
+                                        const char *repo_id,
+                                        int version,
+                                        const char *file_path,
+                                        SeafileCrypt *crypt,
+                                        GHashTable *wanted)
+{
+    CDCFileDescriptor cdc;
+    WantedBlocks data;
+    int ret;
+
+    /* Block ids are random then, they can't be found in other files. */
+    if (seaf->disable_block_hash)
+        return 0;
+
+    memset (&data, 0, sizeof(data));
+    data.wanted = wanted;
+
+    memset (&cdc, 0, sizeof(cdc));
+    set_cdc_block_sizes (&cdc);
+    cdc.write_block = write_wanted_chunk;
+    cdc.user_data = &data;
+    memcpy (cdc.repo_id, repo_id, 36);
+    cdc.version = version;
+
+    ret = filename_chunk_cdc (file_path, &cdc, crypt, FALSE);
+    if (cdc.blk_sha1s)
+        free (cdc.blk_sha1s);
+    if (ret < 0)
+        return -1;
+
+    return data.n_written;
+}
+
 void
 seafile_ref (Seafile *seafile)
 {
-    ++seafile->ref_count;
+    g_atomic_int_inc (&seafile->ref_count);
 }
 
 static void
 seafile_free (Seafile *seafile)
 {
+    /* blk_sha1s and blk_ids are one allocation. */
+    g_free (seafile->blk_sha1s);
+
+    g_free (seafile);
+}
+
+/*
+ * Allocate the block id array of @seafile in one chunk: the string
+ * pointers, followed by the raw ids, followed by the hex strings.
+ */
+static void
+seafile_alloc_block_ids (Seafile *seafile, int n_blocks)
+{
+    char *hex;
     int i;
 
-    if (seafile->blk_sha1s) {
-        for (i = 0; i < seafile->n_blocks; ++i)
-            g_free (seafile->blk_sha1s[i]);
-        g_free (seafile->blk_sha1s);
-    }
+    seafile->n_blocks = n_blocks;
+    seafile->blk_sha1s = g_malloc0 (n_blocks * (sizeof(char *) + 20 + 41));
+    seafile->blk_ids = (guint8 *)(seafile->blk_sha1s + n_blocks);
 
-    g_free (seafile);
+    hex = (char *)(seafile->blk_ids + n_blocks * 20);
+    for (i = 0; i < n_blocks; ++i)
+        seafile->blk_sha1s[i] = hex + i * 41;
 }
 
 void
@@ -957,7 +1893,7 @@ seafile_unref (Seafile *seafile)
     if (!seafile)
         return;
 
-    if (--seafile->ref_count <= 0)
+    if (g_atomic_int_dec_and_test (&seafile->ref_count))
         seafile_free (seafile);
 }
 
@@ -991,52 +1927,198 @@ seafile_from_v0_data (const char *id, const void *data, int len)
     seafile->version = 0;
     memcpy (seafile->file_id, id, 41);
     seafile->file_size = ntoh64 (ondisk->file_size);
-    seafile->n_blocks = n_blocks;
 
-    seafile->blk_sha1s = g_new0 (char*, seafile->n_blocks);
-    const unsigned char *blk_sha1_ptr = ondisk->block_ids;
+    seafile_alloc_block_ids (seafile, n_blocks);
+    memcpy (seafile->blk_ids, ondisk->block_ids, n_blocks * 20);
     int i;
-    for (i = 0; i < seafile->n_blocks; ++i) {
-        char *blk_sha1 = g_new0 (char, 41);
-        seafile->blk_sha1s[i] = blk_sha1;
-        rawdata_to_hex (blk_sha1_ptr, blk_sha1, 20);
-        blk_sha1_ptr += 20;
-    }
+    for (i = 0; i < seafile->n_blocks; ++i)
+        rawdata_to_hex (seafile->blk_ids + i * 20, seafile->blk_sha1s[i], 20);
 
     seafile->ref_count = 1;
     return seafile;
 }
 
-static Seafile *
-seafile_from_json_object (const char *id, json_t *object)
+/*
+ * Json fs objects are parsed with a JsonScanner rather than json_loadb().
+ * No json tree is built: besides the object itself, only the dirent names
+ * and modifiers are allocated. Strings with escapes and block ids are
+ * collected in the scratch buffers of the thread.
+ */
+
+#define KEY_IS(name) json_scan_key_is (key, key_len, name)
+
+/* Like json_object_get_string_member(), a value that isn't a string gives NULL. */
+static int
+scan_string_member (JsonScanner *sc, char **value)
 {
-    json_t *block_id_array = NULL;
-    int type;
-    int version;
-    guint64 file_size;
-    Seafile *seafile = NULL;
+    const char *str;
+    gsize len;
 
-    /* Sanity checks. */
-    type = json_object_get_int_member (object, "type");
-    if (type != SEAF_METADATA_TYPE_FILE) {
-        seaf_debug ("Object %s is not a file.\n", id);
-        return NULL;
+    g_free (*value);
+    *value = NULL;
+
+    if (json_scan_peek (sc) != '"')
+        return json_scan_skip (sc);
+
+    if (json_scan_string (sc, &str, &len) < 0)
+        return -1;
+    *value = g_strndup (str, len);
+    return 0;
+}
+
+/*
+ * Returns -1 on syntax errors. A dirent without a valid id, a name or,
+ * for files, a modifier is returned as NULL.
+ */
+static int
+scan_dirent (const char *dir_id, JsonScanner *sc, SeafDirent **dent_out)
+{
+    const char *key;
+    gsize key_len;
+    gint64 mode = 0, mtime = 0, size = 0;
+    char *id = NULL, *name = NULL, *modifier = NULL;
+    SeafDirent *dirent;
+    int rc;
+
+    *dent_out = NULL;
+
+    if (json_scan_object_begin (sc) < 0)
+        return -1;
+
+    while ((rc = json_scan_next_member (sc, &key, &key_len)) > 0) {
+        if (KEY_IS ("mode"))
+            rc = json_scan_int (sc, &mode);
+        else if (KEY_IS ("mtime"))
+            rc = json_scan_int (sc, &mtime);
+        else if (KEY_IS ("size"))
+            rc = json_scan_int (sc, &size);
+        else if (KEY_IS ("id"))
+            rc = scan_string_member (sc, &id);
+        else if (KEY_IS ("name"))
+            rc = scan_string_member (sc, &name);
+        else if (KEY_IS ("modifier"))
+            rc = scan_string_member (sc, &modifier);
+        else
+            rc = json_scan_skip (sc);
+        if (rc < 0)
+            break;
     }
+    if (rc < 0)
+        goto out;
 
-    version = (int) json_object_get_int_member (object, "version");
-    if (version < 1) {
-        seaf_debug ("Seafile object %s version should be > 0, version is %d.\n",
-                    id, version);
-        return NULL;
+    if (!id) {
+        seaf_debug ("Dirent id not set for dir object %s.\n", dir_id);
+        goto out;
+    }
+    if (!is_object_id_valid (id)) {
+        seaf_debug ("Dirent id is invalid for dir object %s.\n", dir_id);
+        goto out;
+    }
+    if (!name) {
+        seaf_debug ("Dirent name not set for dir object %s.\n", dir_id);
+        goto out;
+    }
+    if (S_ISREG((guint32)mode) && !modifier) {
+        seaf_debug ("Dirent modifier not set for dir object %s.\n", dir_id);
+        goto out;
+    }
+
+    dirent = g_new0 (SeafDirent, 1);
+    dirent->mode = (guint32)mode;
+    memcpy (dirent->id, id, 40);
+    dirent->name_len = strlen(name);
+    dirent->name = name;
+    name = NULL;
+    dirent->mtime = mtime;
+    if (S_ISREG(dirent->mode)) {
+        dirent->modifier = modifier;
+        modifier = NULL;
+        dirent->size = size;
     }
+    *dent_out = dirent;
 
-    file_size = (guint64) json_object_get_int_member (object, "size");
+out:
+    g_free (id);
+    g_free (name);
+    g_free (modifier);
+    return rc < 0 ? -1 : 0;
+}
 
-    block_id_array = json_object_get (object, "block_ids");
-    if (!block_id_array) {
-        seaf_debug ("No block id array in seafile object %s.\n", id);
-        return NULL;
+static void
+free_dirent_list (GList *dirents)
+{
+    g_list_free_full (dirents, (GDestroyNotify)seaf_dirent_free);
+}
+
+static int
+scan_dirents (const char *dir_id, JsonScanner *sc,
+              GList **dirents, gboolean *bad_entry)
+{
+    SeafDirent *dirent;
+    int rc;
+
+    free_dirent_list (*dirents);
+    *dirents = NULL;
+
+    if (json_scan_peek (sc) != '[')
+        return json_scan_skip (sc);
+
+    if (json_scan_array_begin (sc) < 0)
+        return -1;
+    while ((rc = json_scan_next_element (sc)) > 0) {
+        if (scan_dirent (dir_id, sc, &dirent) < 0)
+            return -1;
+        if (!dirent) {
+            *bad_entry = TRUE;
+            continue;
+        }
+        *dirents = g_list_prepend (*dirents, dirent);
     }
+    *dirents = g_list_reverse (*dirents);
+
+    return rc;
+}
+
+static int
+scan_block_ids (JsonScanner *sc, GByteArray *ids, gboolean *bad_entry)
+{
+    const char *str;
+    gsize len;
+    int rc;
+
+    g_byte_array_set_size (ids, 0);
+
+    if (json_scan_peek (sc) != '[')
+        return json_scan_skip (sc);
+
+    if (json_scan_array_begin (sc) < 0)
+        return -1;
+    while ((rc = json_scan_next_element (sc)) > 0) {
+        if (json_scan_peek (sc) != '"') {
+            *bad_entry = TRUE;
+            if (json_scan_skip (sc) < 0)
+                return -1;
+            continue;
+        }
+        if (json_scan_string (sc, &str, &len) < 0)
+            return -1;
+        if (len != 40) {
+            *bad_entry = TRUE;
+            continue;
+        }
+        g_byte_array_append (ids, (const guint8 *)str, 40);
+    }
+
+    return rc;
+}
+
+static Seafile *
+seafile_from_scanned (const char *id, int version, guint64 file_size,
+                      GByteArray *ids)
+{
+    Seafile *seafile;
+    char *block_id;
+    int i;
 
     seafile = g_new0 (Seafile, 1);
 
@@ -1045,20 +2127,16 @@ seafile_from_json_object (const char *id, json_t *object)
     memcpy (seafile->file_id, id, 40);
     seafile->version = version;
     seafile->file_size = file_size;
-    seafile->n_blocks = json_array_size (block_id_array);
-    seafile->blk_sha1s = g_new0 (char *, seafile->n_blocks);
+    seafile_alloc_block_ids (seafile, ids->len / 40);
 
-    int i;
-    json_t *block_id_obj;
-    const char *block_id;
     for (i = 0; i < seafile->n_blocks; ++i) {
-        block_id_obj = json_array_get (block_id_array, i);
-        block_id = json_string_value (block_id_obj);
-        if (!block_id || !is_object_id_valid(block_id)) {
+        block_id = seafile->blk_sha1s[i];
+        memcpy (block_id, ids->data + i * 40, 40);
+        if (!is_object_id_valid (block_id)) {
             seafile_free (seafile);
             return NULL;
         }
-        seafile->blk_sha1s[i] = g_strdup(block_id);
+        hex_to_rawdata (block_id, seafile->blk_ids + i * 20, 20);
     }
 
     seafile->ref_count = 1;
@@ -1066,13 +2144,109 @@ seafile_from_json_object (const char *id, json_t *object)
     return seafile;
 }
 
+/*
+ * Parse a decompressed json fs object. If @expected_type is not
+ * SEAF_METADATA_TYPE_INVALID, objects of other types are rejected.
+ */
+static SeafFSObject *
+fs_object_from_json_data (const char *obj_id, const char *data, int len,
+                          int expected_type)
+{
+    FSJsonScratch *scratch = get_fs_json_scratch ();
+    JsonScanner sc;
+    const char *key;
+    gsize key_len;
+    gint64 type = 0, version = 0, size = 0;
+    gboolean has_block_ids = FALSE, has_dirents = FALSE, bad_entry = FALSE;
+    GList *dirents = NULL, *ptr;
+    SeafDir *dir;
+    SeafFSObject *obj = NULL;
+    int rc;
+
+    json_scanner_init (&sc, data, len, scratch->buf);
+
+    rc = json_scan_object_begin (&sc);
+    while (rc == 0 && (rc = json_scan_next_member (&sc, &key, &key_len)) > 0) {
+        if (KEY_IS ("type")) {
+            rc = json_scan_int (&sc, &type);
+        } else if (KEY_IS ("version")) {
+            rc = json_scan_int (&sc, &version);
+        } else if (KEY_IS ("size")) {
+            rc = json_scan_int (&sc, &size);
+        } else if (KEY_IS ("block_ids")) {
+            has_block_ids = TRUE;
+            rc = scan_block_ids (&sc, scratch->ids, &bad_entry);
+        } else if (KEY_IS ("dirents")) {
+            has_dirents = TRUE;
+            rc = scan_dirents (obj_id, &sc, &dirents, &bad_entry);
+        } else {
+            rc = json_scan_skip (&sc);
+        }
+        if (rc >= 0)
+            rc = 0;
+    }
+    if (rc < 0 || json_scan_finish (&sc) < 0) {
+        seaf_warning ("Failed to parse json fs object %s.\n", obj_id);
+        goto out;
+    }
+
+    if (expected_type != SEAF_METADATA_TYPE_INVALID && type != expected_type) {
+        seaf_debug ("Object %s is not a %s.\n", obj_id,
+                    expected_type == SEAF_METADATA_TYPE_FILE ? "file" : "dir");
+        goto out;
+    }
+
+    if (type == SEAF_METADATA_TYPE_FILE) {
+        if (version < 1) {
+            seaf_debug ("Seafile object %s version should be > 0, version is %d.\n",
+                        obj_id, (int)version);
+            goto out;
+        }
+        if (!has_block_ids) {
+            seaf_debug ("No block id array in seafile object %s.\n", obj_id);
+            goto out;
+        }
+        if (bad_entry)
+            goto out;
+        obj = (SeafFSObject *)seafile_from_scanned (obj_id, (int)version,
+                                                    (guint64)size, scratch->ids);
+    } else if (type == SEAF_METADATA_TYPE_DIR) {
+        if (version < 1) {
+            seaf_debug ("Dir object %s version should be > 0, version is %d.\n",
+                        obj_id, (int)version);
+            goto out;
+        }
+        if (!has_dirents) {
+            seaf_debug ("No dirents in dir object %s.\n", obj_id);
+            goto out;
+        }
+        if (bad_entry)
+            goto out;
+
+        dir = g_new0 (SeafDir, 1);
+        dir->object.type = SEAF_METADATA_TYPE_DIR;
+        memcpy (dir->dir_id, obj_id, 40);
+        dir->version = (int)version;
+        /* "version" may come after "dirents". */
+        for (ptr = dirents; ptr; ptr = ptr->next)
+            ((SeafDirent *)ptr->data)->version = dir->version;
+        dir->entries = dirents;
+        dirents = NULL;
+        obj = (SeafFSObject *)dir;
+    } else {
+        seaf_warning ("Invalid fs type %d.\n", (int)type);
+    }
+
+out:
+    free_dirent_list (dirents);
+    return obj;
+}
+
 static Seafile *
 seafile_from_json (const char *id, void *data, int len)
 {
     guint8 *decompressed;
     int outlen;
-    json_t *object = NULL;
-    json_error_t error;
     Seafile *seafile;
 
     if (seaf_decompress (data, len, &decompressed, &outlen) < 0) {
@@ -1080,16 +2254,10 @@ seafile_from_json (const char *id, void *data, int len)
         return NULL;
     }
 
-    object = json_loadb ((const char *)decompressed, outlen, 0, &error);
-    g_free (decompressed);
-    if (!object) {
-        seaf_warning ("Failed to load seafile json object: %s.\n", error.text);
-        return NULL;
-    }
+    seafile = (Seafile *)fs_object_from_json_data (id, (const char *)decompressed,
+                                                   outlen, SEAF_METADATA_TYPE_FILE);
 
-    seafile = seafile_from_json_object (id, object);
-
-    json_decref (object);
+    g_free (decompressed);
     return seafile;
 }
 
@@ -1112,14 +2280,6 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
     int len;
     Seafile *seafile;
 
-#if 0
-    seafile = g_hash_table_lookup (mgr->priv->seafile_cache, file_id);
-    if (seafile) {
-        seafile_ref (seafile);
-        return seafile;
-    }
-#endif
-
     if (memcmp (file_id, EMPTY_SHA1, 40) == 0) {
         seafile = g_new0 (Seafile, 1);
         memset (seafile->file_id, '0', 40);
@@ -1127,6 +2287,10 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
         return seafile;
     }
 
+    seafile = fs_cache_lookup (mgr, repo_id, file_id, SEAF_METADATA_TYPE_FILE);
+    if (seafile)
+        return seafile;
+
     if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
                                  file_id, &data, &len) < 0) {
         seaf_warning ("[fs mgr] Failed to read file %s.\n", file_id);
@@ -1136,13 +2300,10 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr,
     seafile = seafile_from_data (file_id, data, len, (version > 0));
     g_free (data);
 
-#if 0
-    /*
-     * Add to cache. Also increase ref count.
-     */
-    seafile_ref (seafile);
-    g_hash_table_insert (mgr->priv->seafile_cache, g_strdup(file_id), seafile);
-#endif
+    if (seafile && mgr->priv->cache_max_size > 0) {
+        seafile_ref (seafile);
+        fs_cache_insert (mgr, repo_id, file_id, SEAF_METADATA_TYPE_FILE, seafile);
+    }
 
     return seafile;
 }
@@ -1158,64 +2319,40 @@ seafile_to_v0_data (Seafile *file, int *len)
     ondisk->type = htonl(SEAF_METADATA_TYPE_FILE);
     ondisk->file_size = hton64 (file->file_size);
 
-    guint8 *ptr = ondisk->block_ids;
-    int i;
-    for (i = 0; i < file->n_blocks; ++i) {
-        hex_to_rawdata (file->blk_sha1s[i], ptr, 20);
-        ptr += 20;
-    }
+    memcpy (ondisk->block_ids, file->blk_ids, file->n_blocks * 20);
 
     return (guint8 *)ondisk;
 }
 
-static guint8 *
-seafile_to_json (Seafile *file, int *len)
+/* The returned buffer is only valid until the next object is dumped. */
+static GString *
+seafile_to_json (Seafile *file)
 {
-    json_t *object, *block_id_array;
-
-    object = json_object ();
-
-    json_object_set_int_member (object, "type", SEAF_METADATA_TYPE_FILE);
-    json_object_set_int_member (object, "version", file->version);
-
-    json_object_set_int_member (object, "size", file->file_size);
-
-    block_id_array = json_array ();
-    int i;
-    for (i = 0; i < file->n_blocks; ++i) {
-        json_array_append_new (block_id_array, json_string(file->blk_sha1s[i]));
-    }
-    json_object_set_new (object, "block_ids", block_id_array);
+    GString *out = get_json_out ();
+    unsigned char sha1[20];
 
-    char *data = json_dumps (object, JSON_SORT_KEYS);
-    *len = strlen(data);
+    dump_seafile_json (out, file->version, file->file_size,
+                       file->blk_ids, file->n_blocks);
 
-    unsigned char sha1[20];
-    calculate_sha1 (sha1, data, *len);
+    calculate_sha1 (sha1, out->str, out->len);
     rawdata_to_hex (sha1, file->file_id, 20);
 
-    json_decref (object);
-    return (guint8 *)data;
+    return out;
 }
 
 static guint8 *
 seafile_to_data (Seafile *file, int *len)
 {
     if (file->version > 0) {
-        guint8 *data;
-        int orig_len;
+        GString *json;
         guint8 *compressed;
 
-        data = seafile_to_json (file, &orig_len);
-        if (!data)
-            return NULL;
+        json = seafile_to_json (file);
 
-        if (seaf_compress (data, orig_len, &compressed, len) < 0) {
+        if (seaf_compress ((guint8 *)json->str, json->len, &compressed, len) < 0) {
             seaf_warning ("Failed to compress file object %s.\n", file->file_id);
-            g_free (data);
             return NULL;
         }
-        g_free (data);
         return compressed;
     } else
         return seafile_to_v0_data (file, len);
@@ -1418,159 +2555,215 @@ seaf_dir_from_v0_data (const char *dir_id, const uint8_t *data, int len)
             goto bad;
         }
 
-        root->entries = g_list_prepend (root->entries, dent);
-    }
+        root->entries = g_list_prepend (root->entries, dent);
+    }
+
+    root->entries = g_list_reverse (root->entries);
+
+    return root;
+
+bad:
+    seaf_dir_free (root);
+    return NULL;
+}
+
+static SeafDir *
+seaf_dir_from_json (const char *dir_id, uint8_t *data, int len)
+{
+    guint8 *decompressed;
+    int outlen;
+    SeafDir *dir;
+
+    if (seaf_decompress (data, len, &decompressed, &outlen) < 0) {
+        seaf_warning ("Failed to decompress dir object %s.\n", dir_id);
+        return NULL;
+    }
+
+    dir = (SeafDir *)fs_object_from_json_data (dir_id, (const char *)decompressed,
+                                               outlen, SEAF_METADATA_TYPE_DIR);
+
+    g_free (decompressed);
+    return dir;
+}
+
+SeafDir *
+seaf_dir_from_data (const char *dir_id, uint8_t *data, int len,
+                    gboolean is_json)
+{
+    if (is_json)
+        return seaf_dir_from_json (dir_id, data, len);
+    else
+        return seaf_dir_from_v0_data (dir_id, data, len);
+}
+
+/*
+ * Binary copies of version 1 dir objects.
+ *
+ * Parsing a dir object means inflating it and building a JSON DOM before
+ * the dirents can be created. The client keeps an uncompressed binary
+ * copy of each dir it has parsed in the "fs-bin" store, under the same id,
+ * and reads that one first. The copies are only a cache, the canonical
+ * objects are never changed.
+ *
+ * Layout, integers in network byte order:
+ *
+ *   header   magic(4) version(4) n_dirents(4)
+ *   dirent   mode(4) id(40) mtime(8) size(8) name_len(4) modifier_len(4)
+ *            name modifier
+ *   trailer  crc32 of everything before it(4)
+ *
+ * A modifier_len of BIN_NO_MODIFIER means no modifier.
+ */
 
-    root->entries = g_list_reverse (root->entries);
+#define SEAF_DIR_BIN_MAGIC 0x53444231       /* "SDB1" */
+#define BIN_NO_MODIFIER G_MAXUINT32
+#define BIN_HEADER_SIZE 12
+#define BIN_DIRENT_SIZE 68
 
-    return root;
+static inline guint8 *
+put_be32 (guint8 *p, guint32 v)
+{
+    v = htonl (v);
+    memcpy (p, &v, 4);
+    return p + 4;
+}
 
-bad:
-    seaf_dir_free (root);
-    return NULL;
+static inline guint8 *
+put_be64 (guint8 *p, guint64 v)
+{
+    v = hton64 (v);
+    memcpy (p, &v, 8);
+    return p + 8;
 }
 
-static SeafDirent *
-parse_dirent (const char *dir_id, int version, json_t *object)
+static inline guint32
+get_be32 (const guint8 *p)
 {
-    guint32 mode;
-    const char *id;
-    const char *name;
-    gint64 mtime;
-    const char *modifier;
-    gint64 size;
+    guint32 v;
+    memcpy (&v, p, 4);
+    return ntohl (v);
+}
 
-    mode = (guint32) json_object_get_int_member (object, "mode");
+static inline guint64
+get_be64 (const guint8 *p)
+{
+    guint64 v;
+    memcpy (&v, p, 8);
+    return ntoh64 (v);
+}
 
-    id = json_object_get_string_member (object, "id");
-    if (!id) {
-        seaf_debug ("Dirent id not set for dir object %s.\n", dir_id);
-        return NULL;
-    }
-    if (!is_object_id_valid (id)) {
-        seaf_debug ("Dirent id is invalid for dir object %s.\n", dir_id);
-        return NULL;
-    }
+static guint8 *
+seaf_dir_to_bin_data (SeafDir *dir, int *len)
+{
+    GList *ptr;
+    SeafDirent *dent;
+    gsize size = BIN_HEADER_SIZE + 4;
+    guint8 *data, *p;
+    guint32 n = 0, crc;
 
-    name = json_object_get_string_member (object, "name");
-    if (!name) {
-        seaf_debug ("Dirent name not set for dir object %s.\n", dir_id);
-        return NULL;
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        size += BIN_DIRENT_SIZE + dent->name_len;
+        if (dent->modifier)
+            size += strlen(dent->modifier);
+        ++n;
     }
 
-    mtime = json_object_get_int_member (object, "mtime");
-    if (S_ISREG(mode)) {
-        modifier = json_object_get_string_member (object, "modifier");
-        if (!modifier) {
-            seaf_debug ("Dirent modifier not set for dir object %s.\n", dir_id);
-            return NULL;
+    data = g_new (guint8, size);
+    p = put_be32 (data, SEAF_DIR_BIN_MAGIC);
+    p = put_be32 (p, (guint32)dir->version);
+    p = put_be32 (p, n);
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        guint32 modifier_len = dent->modifier ? strlen(dent->modifier) : BIN_NO_MODIFIER;
+
+        p = put_be32 (p, dent->mode);
+        memcpy (p, dent->id, 40);
+        p += 40;
+        p = put_be64 (p, (guint64)dent->mtime);
+        p = put_be64 (p, (guint64)dent->size);
+        p = put_be32 (p, dent->name_len);
+        p = put_be32 (p, modifier_len);
+        memcpy (p, dent->name, dent->name_len);
+        p += dent->name_len;
+        if (dent->modifier) {
+            memcpy (p, dent->modifier, modifier_len);
+            p += modifier_len;
         }
-        size = json_object_get_int_member (object, "size");
     }
 
-    SeafDirent *dirent = g_new0 (SeafDirent, 1);
-    dirent->version = version;
-    dirent->mode = mode;
-    memcpy (dirent->id, id, 40);
-    dirent->name_len = strlen(name);
-    dirent->name = g_strdup(name);
-    dirent->mtime = mtime;
-    if (S_ISREG(mode)) {
-        dirent->modifier = g_strdup(modifier);
-        dirent->size = size;
-    }
+    crc = crc32 (0L, data, (uInt)(p - data));
+    p = put_be32 (p, crc);
 
-    return dirent;
+    *len = (int)size;
+    return data;
 }
 
 static SeafDir *
-seaf_dir_from_json_object (const char *dir_id, json_t *object)
+seaf_dir_from_bin_data (const char *dir_id, const guint8 *data, int len)
 {
-    json_t *dirent_array = NULL;
-    int type;
+    const guint8 *p = data, *end;
+    guint32 n, i, name_len, modifier_len;
     int version;
-    SeafDir *dir = NULL;
+    SeafDir *dir;
+    SeafDirent *dent;
 
-    /* Sanity checks. */
-    type = json_object_get_int_member (object, "type");
-    if (type != SEAF_METADATA_TYPE_DIR) {
-        seaf_debug ("Object %s is not a dir.\n", dir_id);
+    if (len < BIN_HEADER_SIZE + 4 || get_be32 (p) != SEAF_DIR_BIN_MAGIC)
         return NULL;
-    }
 
-    version = (int) json_object_get_int_member (object, "version");
-    if (version < 1) {
-        seaf_debug ("Dir object %s version should be > 0, version is %d.\n",
-                    dir_id, version);
+    end = data + len - 4;
+    if (crc32 (0L, data, (uInt)(end - data)) != get_be32 (end))
         return NULL;
-    }
 
-    dirent_array = json_object_get (object, "dirents");
-    if (!dirent_array) {
-        seaf_debug ("No dirents in dir object %s.\n", dir_id);
-        return NULL;
-    }
+    version = (int)get_be32 (p + 4);
+    n = get_be32 (p + 8);
+    p += BIN_HEADER_SIZE;
 
     dir = g_new0 (SeafDir, 1);
-
     dir->object.type = SEAF_METADATA_TYPE_DIR;
-
     memcpy (dir->dir_id, dir_id, 40);
     dir->version = version;
 
-    size_t n_dirents = json_array_size (dirent_array);
-    int i;
-    json_t *dirent_obj;
-    SeafDirent *dirent;
-    for (i = 0; i < n_dirents; ++i) {
-        dirent_obj = json_array_get (dirent_array, i);
-        dirent = parse_dirent (dir_id, version, dirent_obj);
-        if (!dirent) {
-            seaf_dir_free (dir);
-            return NULL;
+    for (i = 0; i < n; ++i) {
+        if (end - p < BIN_DIRENT_SIZE)
+            goto error;
+
+        name_len = get_be32 (p + 60);
+        modifier_len = get_be32 (p + 64);
+        if (name_len > (guint32)(end - p - BIN_DIRENT_SIZE) ||
+            (modifier_len != BIN_NO_MODIFIER &&
+             modifier_len > (guint32)(end - p - BIN_DIRENT_SIZE - name_len)))
+            goto error;
+
+        dent = g_new0 (SeafDirent, 1);
+        dent->version = version;
+        dent->mode = get_be32 (p);
+        memcpy (dent->id, p + 4, 40);
+        dent->mtime = (gint64)get_be64 (p + 44);
+        dent->size = (gint64)get_be64 (p + 52);
+        dent->name_len = name_len;
+        p += BIN_DIRENT_SIZE;
+
+        dent->name = g_strndup ((const char *)p, name_len);
+        p += name_len;
+        if (modifier_len != BIN_NO_MODIFIER) {
+            dent->modifier = g_strndup ((const char *)p, modifier_len);
+            p += modifier_len;
         }
-        dir->entries = g_list_prepend (dir->entries, dirent);
-    }
-    dir->entries = g_list_reverse (dir->entries);
-
-    return dir;
-}
-
-static SeafDir *
-seaf_dir_from_json (const char *dir_id, uint8_t *data, int len)
-{
-    guint8 *decompressed;
-    int outlen;
-    json_t *object = NULL;
-    json_error_t error;
-    SeafDir *dir;
-
-    if (seaf_decompress (data, len, &decompressed, &outlen) < 0) {
-        seaf_warning ("Failed to decompress dir object %s.\n", dir_id);
-        return NULL;
-    }
 
-    object = json_loadb ((const char *)decompressed, outlen, 0, &error);
-    g_free (decompressed);
-    if (!object) {
-        seaf_warning ("Failed to load seafdir json object: %s.\n", error.text);
-        return NULL;
+        dir->entries = g_list_prepend (dir->entries, dent);
     }
 
-    dir = seaf_dir_from_json_object (dir_id, object);
+    if (p != end)
+        goto error;
 
-    json_decref (object);
+    dir->entries = g_list_reverse (dir->entries);
     return dir;
-}
 
-SeafDir *
-seaf_dir_from_data (const char *dir_id, uint8_t *data, int len,
-                    gboolean is_json)
-{
-    if (is_json)
-        return seaf_dir_from_json (dir_id, data, len);
-    else
-        return seaf_dir_from_v0_data (dir_id, data, len);
+error:
+    seaf_dir_free (dir);
+    return NULL;
 }
 
 inline static int
@@ -1615,74 +2808,36 @@ seaf_dir_to_v0_data (SeafDir *dir, int *len)
     return (void *)ondisk;
 }
 
-static void
-add_to_dirent_array (json_t *array, SeafDirent *dirent)
-{
-    json_t *object;
-
-    object = json_object ();
-    json_object_set_int_member (object, "mode", dirent->mode);
-    json_object_set_string_member (object, "id", dirent->id);
-    json_object_set_string_member (object, "name", dirent->name);
-    json_object_set_int_member (object, "mtime", dirent->mtime);
-    if (S_ISREG(dirent->mode)) {
-        json_object_set_string_member (object, "modifier", dirent->modifier);
-        json_object_set_int_member (object, "size", dirent->size);
-    }
-
-    json_array_append_new (array, object);
-}
-
-static void *
-seaf_dir_to_json (SeafDir *dir, int *len)
+/* The returned buffer is only valid until the next object is dumped. */
+static GString *
+seaf_dir_to_json (SeafDir *dir)
 {
-    json_t *object, *dirent_array;
-    GList *ptr;
-    SeafDirent *dirent;
-
-    object = json_object ();
-
-    json_object_set_int_member (object, "type", SEAF_METADATA_TYPE_DIR);
-    json_object_set_int_member (object, "version", dir->version);
-
-    dirent_array = json_array ();
-    for (ptr = dir->entries; ptr; ptr = ptr->next) {
-        dirent = ptr->data;
-        add_to_dirent_array (dirent_array, dirent);
-    }
-    json_object_set_new (object, "dirents", dirent_array);
+    GString *out = get_json_out ();
+    unsigned char sha1[20];
 
-    char *data = json_dumps (object, JSON_SORT_KEYS);
-    *len = strlen(data);
+    dump_dir_json (out, dir);
 
     /* The dir object id is sha1 hash of the json object. */
-    unsigned char sha1[20];
-    calculate_sha1 (sha1, data, *len);
+    calculate_sha1 (sha1, out->str, out->len);
     rawdata_to_hex (sha1, dir->dir_id, 20);
 
-    json_decref (object);
-    return data;
+    return out;
 }
 
 void *
 seaf_dir_to_data (SeafDir *dir, int *len)
 {
     if (dir->version > 0) {
-        guint8 *data;
-        int orig_len;
+        GString *json;
         guint8 *compressed;
 
-        data = seaf_dir_to_json (dir, &orig_len);
-        if (!data)
-            return NULL;
+        json = seaf_dir_to_json (dir);
 
-        if (seaf_compress (data, orig_len, &compressed, len) < 0) {
+        if (seaf_compress ((guint8 *)json->str, json->len, &compressed, len) < 0) {
             seaf_warning ("Failed to compress dir object %s.\n", dir->dir_id);
-            g_free (data);
             return NULL;
         }
 
-        g_free (data);
         return compressed;
     } else
         return seaf_dir_to_v0_data (dir, len);
@@ -1717,8 +2872,6 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
     int len;
     SeafDir *dir;
 
-    /* TODO: add hash cache */
-
     if (memcmp (dir_id, EMPTY_SHA1, 40) == 0) {
         dir = g_new0 (SeafDir, 1);
         dir->version = version;
@@ -1726,6 +2879,21 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
         return dir;
     }
 
+    dir = fs_cache_lookup (mgr, repo_id, dir_id, SEAF_METADATA_TYPE_DIR);
+    if (dir)
+        return dir;
+
+    if (version > 0 && mgr->priv->bin_store &&
+        seaf_obj_store_read_obj (mgr->priv->bin_store, repo_id, version,
+                                 dir_id, &data, &len) == 0) {
+        dir = seaf_dir_from_bin_data (dir_id, data, len);
+        g_free (data);
+        if (dir)
+            goto cache;
+        seaf_warning ("[fs mgr] Binary copy of dir %s is corrupt.\n", dir_id);
+        seaf_obj_store_delete_obj (mgr->priv->bin_store, repo_id, version, dir_id);
+    }
+
     if (seaf_obj_store_read_obj (mgr->obj_store, repo_id, version,
                                  dir_id, &data, &len) < 0) {
         seaf_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
@@ -1735,6 +2903,19 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr,
     dir = seaf_dir_from_data (dir_id, data, len, (version > 0));
     g_free (data);
 
+    if (dir && version > 0 && mgr->priv->bin_store) {
+        data = seaf_dir_to_bin_data (dir, &len);
+        /* It's only a cache, don't sync. */
+        seaf_obj_store_write_obj (mgr->priv->bin_store, repo_id, version,
+                                  dir_id, data, len, FALSE);
+        g_free (data);
+    }
+
+cache:
+    if (dir && mgr->priv->cache_max_size > 0)
+        fs_cache_insert (mgr, repo_id, dir_id, SEAF_METADATA_TYPE_DIR,
+                         seaf_dir_dup (dir));
+
     return dir;
 }
 
@@ -1830,26 +3011,38 @@ parse_metadata_type_json (const char *obj_id, uint8_t *data, int len)
 {
     guint8 *decompressed;
     int outlen;
-    json_t *object;
-    json_error_t error;
-    int type;
+    JsonScanner sc;
+    const char *key;
+    gsize key_len;
+    gint64 type = SEAF_METADATA_TYPE_INVALID;
+    int rc;
 
     if (seaf_decompress (data, len, &decompressed, &outlen) < 0) {
         seaf_warning ("Failed to decompress fs object %s.\n", obj_id);
         return SEAF_METADATA_TYPE_INVALID;
     }
 
-    object = json_loadb ((const char *)decompressed, outlen, 0, &error);
+    json_scanner_init (&sc, (const char *)decompressed, outlen,
+                       get_fs_json_scratch()->buf);
+    rc = json_scan_object_begin (&sc);
+    while (rc == 0 && (rc = json_scan_next_member (&sc, &key, &key_len)) > 0) {
+        if (KEY_IS ("type"))
+            rc = json_scan_int (&sc, &type);
+        else
+            rc = json_scan_skip (&sc);
+        if (rc >= 0)
+            rc = 0;
+    }
+    if (rc == 0)
+        rc = json_scan_finish (&sc);
+
     g_free (decompressed);
-    if (!object) {
-        seaf_warning ("Failed to load fs json object: %s.\n", error.text);
+    if (rc < 0) {
+        seaf_warning ("Failed to parse json fs object %s.\n", obj_id);
         return SEAF_METADATA_TYPE_INVALID;
     }
 
-    type = json_object_get_int_member (object, "type");
-
-    json_decref (object);
-    return type;
+    return (int)type;
 }
 
 int
@@ -1882,9 +3075,6 @@ fs_object_from_json (const char *obj_id, uint8_t *data, int len)
 {
     guint8 *decompressed;
     int outlen;
-    json_t *object;
-    json_error_t error;
-    int type;
     SeafFSObject *fs_obj;
 
     if (seaf_decompress (data, len, &decompressed, &outlen) < 0) {
@@ -1892,27 +3082,10 @@ fs_object_from_json (const char *obj_id, uint8_t *data, int len)
         return NULL;
     }
 
-    object = json_loadb ((const char *)decompressed, outlen, 0, &error);
-    g_free (decompressed);
-    if (!object) {
-        seaf_warning ("Failed to load fs json object: %s.\n", error.text);
-        return NULL;
-    }
-
-    type = json_object_get_int_member (object, "type");
-
-    if (type == SEAF_METADATA_TYPE_FILE)
-        fs_obj = (SeafFSObject *)seafile_from_json_object (obj_id, object);
-    else if (type == SEAF_METADATA_TYPE_DIR)
-        fs_obj = (SeafFSObject *)seaf_dir_from_json_object (obj_id, object);
-    else {
-        seaf_warning ("Invalid fs type %d.\n", type);
-        json_decref (object);
-        return NULL;
-    }
-
-    json_decref (object);
+    fs_obj = fs_object_from_json_data (obj_id, (const char *)decompressed, outlen,
+                                       SEAF_METADATA_TYPE_INVALID);
 
+    g_free (decompressed);
     return fs_obj;
 }
 
@@ -1939,13 +3112,17 @@ seaf_fs_object_free (SeafFSObject *obj)
         seaf_dir_free ((SeafDir *)obj);
 }
 
+#define BLOCK_LIST_INIT_SIZE 64
+
 BlockList *
 block_list_new ()
 {
     BlockList *bl = g_new0 (BlockList, 1);
 
-    bl->block_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-    bl->block_ids = g_ptr_array_new_with_free_func (g_free);
+    bl->capacity = BLOCK_LIST_INIT_SIZE;
+    bl->ids = g_new (guint8, bl->capacity * 20);
+    bl->table_size = BLOCK_LIST_INIT_SIZE * 2;
+    bl->table = g_new0 (uint32_t, bl->table_size);
 
     return bl;
 }
@@ -1953,42 +3130,113 @@ block_list_new ()
 void
 block_list_free (BlockList *bl)
 {
-    if (bl->block_hash)
-        g_hash_table_destroy (bl->block_hash);
-    g_ptr_array_free (bl->block_ids, TRUE);
+    g_free (bl->ids);
+    g_free (bl->table);
     g_free (bl);
 }
 
+/* The ids are sha1's, so their first bytes are good enough as hash. */
+static inline uint32_t
+block_id_hash (const guint8 *id)
+{
+    uint32_t h;
+
+    memcpy (&h, id, sizeof(h));
+    return h;
+}
+
+/* Returns the table slot of @id, or of the empty slot where it belongs. */
+static uint32_t
+block_list_find_slot (BlockList *bl, const guint8 *id)
+{
+    uint32_t mask = bl->table_size - 1;
+    uint32_t slot = block_id_hash (id) & mask;
+    uint32_t pos;
+
+    while ((pos = bl->table[slot]) != 0) {
+        if (memcmp (bl->ids + (pos - 1) * 20, id, 20) == 0)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void
+block_list_grow_table (BlockList *bl)
+{
+    uint32_t i;
+
+    g_free (bl->table);
+    bl->table_size *= 2;
+    bl->table = g_new0 (uint32_t, bl->table_size);
+
+    for (i = 0; i < bl->n_blocks; ++i)
+        bl->table[block_list_find_slot (bl, bl->ids + i * 20)] = i + 1;
+}
+
 void
-block_list_insert (BlockList *bl, const char *block_id)
+block_list_insert_id (BlockList *bl, const guint8 *id)
 {
-    if (g_hash_table_lookup (bl->block_hash, block_id))
+    uint32_t slot;
+
+    slot = block_list_find_slot (bl, id);
+    if (bl->table[slot] != 0)
         return;
 
-    char *key = g_strdup(block_id);
-    g_hash_table_replace (bl->block_hash, key, key);
-    g_ptr_array_add (bl->block_ids, g_strdup(block_id));
+    if (bl->n_blocks == bl->capacity) {
+        bl->capacity *= 2;
+        bl->ids = g_renew (guint8, bl->ids, bl->capacity * 20);
+    }
+    memcpy (bl->ids + bl->n_blocks * 20, id, 20);
     ++bl->n_blocks;
+    bl->table[slot] = bl->n_blocks;
+
+    /* Keep the table at most half full. */
+    if (bl->n_blocks * 2 > bl->table_size)
+        block_list_grow_table (bl);
+}
+
+void
+block_list_insert (BlockList *bl, const char *block_id)
+{
+    guint8 id[20];
+
+    if (hex_to_sha1 (block_id, id) < 0) {
+        seaf_warning ("Invalid block id %s.\n", block_id);
+        return;
+    }
+    block_list_insert_id (bl, id);
+}
+
+gboolean
+block_list_contains (BlockList *bl, const char *block_id)
+{
+    guint8 id[20];
+
+    if (hex_to_sha1 (block_id, id) < 0)
+        return FALSE;
+    return (bl->table[block_list_find_slot (bl, id)] != 0);
+}
+
+void
+block_list_get_id (BlockList *bl, int i, char *block_id)
+{
+    rawdata_to_hex (bl->ids + i * 20, block_id, 20);
 }
 
 BlockList *
 block_list_difference (BlockList *bl1, BlockList *bl2)
 {
     BlockList *bl;
-    int i;
-    char *block_id;
-    char *key;
+    const guint8 *id;
+    uint32_t i;
 
     bl = block_list_new ();
 
-    for (i = 0; i < bl1->block_ids->len; ++i) {
-        block_id = g_ptr_array_index (bl1->block_ids, i);
-        if (g_hash_table_lookup (bl2->block_hash, block_id) == NULL) {
-            key = g_strdup(block_id);
-            g_hash_table_replace (bl->block_hash, key, key);
-            g_ptr_array_add (bl->block_ids, g_strdup(block_id));
-            ++bl->n_blocks;
-        }
+    for (i = 0; i < bl1->n_blocks; ++i) {
+        id = bl1->ids + i * 20;
+        if (bl2->table[block_list_find_slot (bl2, id)] == 0)
+            block_list_insert_id (bl, id);
     }
 
     return bl;
@@ -2182,7 +3430,7 @@ fill_blocklist (SeafFSManager *mgr,
         }
 
         for (i = 0; i < seafile->n_blocks; ++i)
-            block_list_insert (bl, seafile->blk_sha1s[i]);
+            block_list_insert_id (bl, seafile->blk_ids + i * 20);
 
         seafile_unref (seafile);
     }
@@ -2289,14 +3537,138 @@ get_dir_size (SeafFSManager *mgr, const char *repo_id, int version, const char *
     return size;
 }
 
+/*
+ * Dir objects are immutable, so the total size and file count under a dir
+ * never change for its id. They're saved in the "dir-stats" store when
+ * first computed, and only the dirs created since are walked afterwards.
+ *
+ * Version 0 dirs have no file sizes in their entries; they're walked the
+ * old way.
+ */
+
+#define DIR_STATS_MAGIC 0x44495253 /* "DIRS" */
+#define DIR_STATS_LEN 20
+
+typedef struct DirStats {
+    gint64 size;
+    gint64 n_files;
+} DirStats;
+
+static int
+load_dir_stats (SeafFSManager *mgr, const char *repo_id, int version,
+                const char *dir_id, DirStats *stats)
+{
+    void *data;
+    int len;
+    guint32 magic;
+    guint64 v;
+
+    if (seaf_obj_store_read_obj (mgr->priv->dir_stats_store, repo_id, version,
+                                 dir_id, &data, &len) < 0)
+        return -1;
+
+    if (len != DIR_STATS_LEN)
+        goto bad;
+    memcpy (&magic, data, 4);
+    if (ntohl (magic) != DIR_STATS_MAGIC)
+        goto bad;
+    memcpy (&v, (char *)data + 4, 8);
+    stats->size = (gint64)GUINT64_FROM_BE (v);
+    memcpy (&v, (char *)data + 12, 8);
+    stats->n_files = (gint64)GUINT64_FROM_BE (v);
+
+    g_free (data);
+    return 0;
+
+bad:
+    seaf_warning ("[fs mgr] Stats of dir %s are corrupt.\n", dir_id);
+    g_free (data);
+    seaf_obj_store_delete_obj (mgr->priv->dir_stats_store, repo_id, version,
+                               dir_id);
+    return -1;
+}
+
+static void
+save_dir_stats (SeafFSManager *mgr, const char *repo_id, int version,
+                const char *dir_id, const DirStats *stats)
+{
+    char data[DIR_STATS_LEN];
+    guint32 magic = htonl (DIR_STATS_MAGIC);
+    guint64 v;
+
+    memcpy (data, &magic, 4);
+    v = GUINT64_TO_BE ((guint64)stats->size);
+    memcpy (data + 4, &v, 8);
+    v = GUINT64_TO_BE ((guint64)stats->n_files);
+    memcpy (data + 12, &v, 8);
+
+    /* It's only a cache, don't sync. */
+    seaf_obj_store_write_obj (mgr->priv->dir_stats_store, repo_id, version,
+                              dir_id, data, DIR_STATS_LEN, FALSE);
+}
+
+static int
+get_dir_stats (SeafFSManager *mgr, const char *repo_id, int version,
+               const char *dir_id, DirStats *stats)
+{
+    SeafDir *dir;
+    SeafDirent *dent;
+    DirStats sub;
+    GList *p;
+
+    if (load_dir_stats (mgr, repo_id, version, dir_id, stats) == 0)
+        return 0;
+
+    dir = seaf_fs_manager_get_seafdir (mgr, repo_id, version, dir_id);
+    if (!dir)
+        return -1;
+
+    memset (stats, 0, sizeof(DirStats));
+    for (p = dir->entries; p; p = p->next) {
+        dent = p->data;
+
+        if (S_ISREG(dent->mode)) {
+            stats->size += dent->size;
+            ++(stats->n_files);
+        } else if (S_ISDIR(dent->mode)) {
+            if (get_dir_stats (mgr, repo_id, version, dent->id, &sub) < 0) {
+                seaf_dir_free (dir);
+                return -1;
+            }
+            stats->size += sub.size;
+            stats->n_files += sub.n_files;
+        }
+    }
+
+    seaf_dir_free (dir);
+
+    save_dir_stats (mgr, repo_id, version, dir_id, stats);
+    return 0;
+}
+
+static gboolean
+dir_stats_wanted (SeafFSManager *mgr, int version)
+{
+    return mgr->priv->dir_stats_store != NULL && version > 0;
+}
+
 gint64
 seaf_fs_manager_get_fs_size (SeafFSManager *mgr,
                              const char *repo_id,
                              int version,
                              const char *root_id)
 {
+     DirStats stats;
+
      if (strcmp (root_id, EMPTY_SHA1) == 0)
         return 0;
+
+     if (dir_stats_wanted (mgr, version)) {
+         if (get_dir_stats (mgr, repo_id, version, root_id, &stats) < 0)
+             return -1;
+         return stats.size;
+     }
+
      return get_dir_size (mgr, repo_id, version, root_id);
 }
 
@@ -2338,8 +3710,17 @@ seaf_fs_manager_count_fs_files (SeafFSManager *mgr,
                                 int version,
                                 const char *root_id)
 {
+     DirStats stats;
+
      if (strcmp (root_id, EMPTY_SHA1) == 0)
         return 0;
+
+     if (dir_stats_wanted (mgr, version)) {
+         if (get_dir_stats (mgr, repo_id, version, root_id, &stats) < 0)
+             return -1;
+         return (int)stats.n_files;
+     }
+
      return count_dir_files (mgr, repo_id, version, root_id);
 }
 
@@ -2675,7 +4056,7 @@ verify_fs_object_json (const char *obj_id, uint8_t *data, int len)
         return FALSE;
     }
 
-    calculate_sha1 (sha1, (const char *)decompressed, outlen);
+    seafile_sha1 (decompressed, outlen, sha1);
     rawdata_to_hex (sha1, hex, 20);
 
     g_free (decompressed);
@@ -2724,9 +4105,7 @@ static gboolean
 verify_seafile_v0 (const char *id, const void *data, int len, gboolean verify_id)
 {
     const SeafileOndisk *ondisk = data;
-    GChecksum *ctx;
     uint8_t sha1[20];
-    gsize cs_len = 20;
     char check_id[41];
 
     if (len < sizeof(SeafileOndisk)) {
@@ -2748,10 +4127,7 @@ verify_seafile_v0 (const char *id, const void *data, int len, gboolean verify_id
     if (!verify_id)
         return TRUE;
 
-    ctx = g_checksum_new (G_CHECKSUM_SHA1);
-    g_checksum_update (ctx, ondisk->block_ids, len - sizeof(SeafileOndisk));
-    g_checksum_get_digest (ctx, sha1, &cs_len);
-    g_checksum_free (ctx);
+    seafile_sha1 (ondisk->block_ids, len - sizeof(SeafileOndisk), sha1);
 
     rawdata_to_hex (sha1, check_id, 20);
 
@@ -2877,5 +4253,7 @@ int
 seaf_fs_manager_remove_store (SeafFSManager *mgr,
                               const char *store_id)
 {
+    if (mgr->priv->dir_stats_store)
+        seaf_obj_store_remove_store (mgr->priv->dir_stats_store, store_id);
     return seaf_obj_store_remove_store (mgr->obj_store, store_id);
 }
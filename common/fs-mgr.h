@@ -43,7 +43,10 @@ struct _Seafile {
     char        file_id[41];
     guint64     file_size;
     guint32     n_blocks;
+    /* Block ids in hex. The strings are allocated with the array. */
     char        **blk_sha1s;
+    /* The same block ids in raw form, 20 bytes each. */
+    guint8      *blk_ids;
     int         ref_count;
 };
 
@@ -127,12 +130,20 @@ seaf_fs_object_from_data (const char *obj_id,
 void
 seaf_fs_object_free (SeafFSObject *obj);
 
+/*
+ * Set of block ids, in insertion order. Ids are stored as raw 20-byte
+ * sha1s, indexed by an open-addressing hash table of positions, so that
+ * large lists take about 30 bytes per block.
+ */
 typedef struct {
-    /* TODO: GHashTable may be inefficient when we have large number of IDs. */
-    GHashTable  *block_hash;
-    GPtrArray   *block_ids;
+    /* Raw ids, 20 bytes each. */
+    guint8      *ids;
     uint32_t     n_blocks;
     uint32_t     n_valid_blocks;
+    uint32_t     capacity;
+    /* Positions in ids plus 1, 0 for empty slots. */
+    uint32_t    *table;
+    uint32_t     table_size;
 } BlockList;
 
 BlockList *
@@ -144,6 +155,19 @@ block_list_free (BlockList *bl);
 void
 block_list_insert (BlockList *bl, const char *block_id);
 
+/* Insert a raw 20-byte block id. */
+void
+block_list_insert_id (BlockList *bl, const guint8 *id);
+
+gboolean
+block_list_contains (BlockList *bl, const char *block_id);
+
+/* Write the hex id of the @i-th block to @block_id, which must be at least
+ * 41 bytes long.
+ */
+void
+block_list_get_id (BlockList *bl, int i, char *block_id);
+
 /* Return a blocklist containing block ids which are in @bl1 but
  * not in @bl2.
  */
@@ -169,6 +193,21 @@ seaf_fs_manager_new (struct _SeafileSession *seaf,
 int
 seaf_fs_manager_init (SeafFSManager *mgr);
 
+typedef struct SeafFSCacheStats {
+    guint64 hits;
+    guint64 misses;
+    int     n_objects;
+    gint64  size;
+    gint64  max_size;
+} SeafFSCacheStats;
+
+void
+seaf_fs_manager_get_cache_stats (SeafFSManager *mgr, SeafFSCacheStats *stats);
+
+/* Drop the cached objects of a repo whose store is being removed. */
+void
+seaf_fs_manager_drop_cached_objects (SeafFSManager *mgr, const char *repo_id);
+
 #ifndef SEAFILE_SERVER
 
 int 
@@ -186,6 +225,41 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
                                gboolean *conflicted,
                                const char *email);
 
+/*
+ * Writes the content of a file being checked out to @fd, an empty tmp
+ * file. Returns 0 on success, -1 on error.
+ */
+typedef int (*CheckoutWriteFunc) (int fd, void *write_data);
+
+/*
+ * Like seaf_fs_manager_checkout_file(), but the content is written by
+ * @write_func instead of being read from the block store, if it's set.
+ */
+int
+seaf_fs_manager_checkout_file_with_writer (SeafFSManager *mgr,
+                                           const char *repo_id,
+                                           int version,
+                                           const char *file_id,
+                                           const char *file_path,
+                                           guint32 mode,
+                                           guint64 mtime,
+                                           struct SeafileCrypt *crypt,
+                                           const char *in_repo_path,
+                                           const char *conflict_head_id,
+                                           gboolean force_conflict,
+                                           gboolean *conflicted,
+                                           const char *email,
+                                           CheckoutWriteFunc write_func,
+                                           void *write_data);
+
+/* Append the decrypted content of a block in the block store to @wfd. */
+int
+seaf_fs_manager_checkout_block (const char *repo_id,
+                                int version,
+                                const char *block_id,
+                                int wfd,
+                                struct SeafileCrypt *crypt);
+
 #endif  /* not SEAFILE_SERVER */
 
 /**
@@ -226,6 +300,36 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               gboolean write_data,
                               gboolean use_cdc);
 
+/*
+ * Like seaf_fs_manager_index_blocks() with CDC and write_data set, for a
+ * file whose previous version is @old_file_id. If a chunk map was saved
+ * for the old version, only the changed regions are chunked and written
+ * again; otherwise the whole file is indexed.
+ */
+int
+seaf_fs_manager_reindex_blocks (SeafFSManager *mgr,
+                                const char *repo_id,
+                                int version,
+                                const char *file_path,
+                                const char *old_file_id,
+                                unsigned char sha1[],
+                                gint64 *size,
+                                SeafileCrypt *crypt);
+
+/*
+ * Split @file_path into blocks the way seaf_fs_manager_index_blocks() does
+ * with CDC, and only write the blocks whose ids are in @wanted to the block
+ * store. Written ids are removed from @wanted.
+ * Returns the number of blocks written, or -1 on error.
+ */
+int
+seaf_fs_manager_write_blocks_from_file (SeafFSManager *mgr,
+                                        const char *repo_id,
+                                        int version,
+                                        const char *file_path,
+                                        SeafileCrypt *crypt,
+                                        GHashTable *wanted);
+
 Seafile *
 seaf_fs_manager_get_seafile (SeafFSManager *mgr,
                              const char *repo_id,
@@ -319,6 +423,27 @@ seaf_fs_manager_get_fs_size (SeafFSManager *mgr,
                              int version,
                              const char *root_id);
 
+/* Returns 0 if the block has been sent, -1 otherwise. */
+typedef int (*SeafBlockSinkFunc) (const char *repo_id,
+                                  int version,
+                                  const char *block_id,
+                                  const char *buf,
+                                  int len,
+                                  void *user_data);
+
+/*
+ * Hand the new blocks of @repo_id written by seafile_write_chunk() to @func
+ * too. They are still written to the block store, so that they're there
+ * until the commit referencing them has been uploaded. Pass NULL to remove
+ * the sink; the caller must make sure no chunk of the repo is being
+ * written at that point.
+ */
+void
+seaf_fs_manager_set_block_sink (SeafFSManager *mgr,
+                                const char *repo_id,
+                                SeafBlockSinkFunc func,
+                                void *user_data);
+
 #ifndef SEAFILE_SERVER
 int
 seafile_write_chunk (const char *repo_id,
@@ -420,6 +545,12 @@ seaf_fs_manager_calculate_seafile_id_json (int repo_version,
                                            struct _CDCFileDescriptor *cdc,
                                            guint8 *file_id_sha1);
 
+/* The json of the file object that seaf_fs_manager_calculate_seafile_id_json()
+ * hashes. Returns a newly allocated string. */
+char *
+seaf_fs_manager_dump_seafile_json (int repo_version,
+                                   struct _CDCFileDescriptor *cdc);
+
 int
 seaf_fs_manager_remove_store (SeafFSManager *mgr,
                               const char *store_id);
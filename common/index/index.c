@@ -98,7 +98,8 @@ static int verify_hdr(struct cache_header *hdr, unsigned long size)
     return 0;
 }
 
-static int convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_entry **ce)
+static int convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_entry **ce,
+                             char **arena)
 {
     size_t len;
     const char *name;
@@ -128,7 +129,12 @@ static int convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_ent
     if (len == CE_NAMEMASK)
         len = strlen(name);
 
-    ret = calloc(1, cache_entry_size(len));
+    if (arena) {
+        ret = (struct cache_entry *)*arena;
+        *arena += cache_entry_size(len);
+    } else {
+        ret = calloc(1, cache_entry_size(len));
+    }
 
     ret->ce_ctime.sec = ntohl(ondisk->ctime.sec);
     ret->ce_mtime.sec = ntohl(ondisk->mtime.sec);
@@ -140,6 +146,8 @@ static int convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_ent
     ret->ce_size  = ntoh64(ondisk->size);
     /* On-disk flags are just 16 bits */
     ret->ce_flags = flags;
+    if (arena)
+        ret->ce_flags |= CE_IN_ARENA;
 
     hashcpy(ret->sha1, ondisk->sha1);
 
@@ -154,7 +162,8 @@ static int convert_from_disk(struct ondisk_cache_entry *ondisk, struct cache_ent
     return 0;
 }
 
-static int convert_from_disk2(struct ondisk_cache_entry2 *ondisk, struct cache_entry **ce)
+static int convert_from_disk2(struct ondisk_cache_entry2 *ondisk, struct cache_entry **ce,
+                              char **arena)
 {
     size_t len;
     const char *name;
@@ -170,7 +179,12 @@ static int convert_from_disk2(struct ondisk_cache_entry2 *ondisk, struct cache_e
     if (len == CE_NAMEMASK)
         len = strlen(name);
 
-    ret = calloc(1, cache_entry_size(len));
+    if (arena) {
+        ret = (struct cache_entry *)*arena;
+        *arena += cache_entry_size(len);
+    } else {
+        ret = calloc(1, cache_entry_size(len));
+    }
 
     ret->ce_ctime.sec = ntoh64(ondisk->ctime.sec);
     ret->ce_mtime.sec = ntoh64(ondisk->mtime.sec);
@@ -182,6 +196,8 @@ static int convert_from_disk2(struct ondisk_cache_entry2 *ondisk, struct cache_e
     ret->ce_size  = ntoh64(ondisk->size);
     /* On-disk flags are just 16 bits */
     ret->ce_flags = flags;
+    if (arena)
+        ret->ce_flags |= CE_IN_ARENA;
 
     hashcpy(ret->sha1, ondisk->sha1);
 
@@ -198,10 +214,15 @@ static int convert_from_disk2(struct ondisk_cache_entry2 *ondisk, struct cache_e
 
 static int read_modifiers (struct index_state *istate, void *data, unsigned int size)
 {
-    char *p = data, *sep = data, *modifier;
+    char *p, *sep;
     unsigned int i;
     unsigned int idx = 0;
 
+    /* Modifiers are kept in one block, instead of a string for each entry. */
+    istate->alloc_modifiers = g_malloc (size);
+    memcpy (istate->alloc_modifiers, data, size);
+    p = sep = istate->alloc_modifiers;
+
     for (i = 0; i < size; ++i) {
         if (*sep == '\n') {
             while (idx < istate->cache_nr &&
@@ -212,8 +233,9 @@ static int read_modifiers (struct index_state *istate, void *data, unsigned int
                 return -1;
             }
 
-            modifier = g_strndup(p, sep - p);
-            istate->cache[idx]->modifier = modifier;
+            *sep = '\0';
+            istate->cache[idx]->modifier = p;
+            istate->cache[idx]->ce_flags |= CE_MODIFIER_IN_ARENA;
             idx++;
             p = sep + 1;
         }
@@ -251,16 +273,252 @@ static void alloc_index (struct index_state *istate)
 {
     istate->cache_alloc = alloc_nr(istate->cache_nr);
     istate->cache = calloc(istate->cache_alloc, sizeof(struct cache_entry *));
-    istate->name_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                               g_free, NULL);
+    /* Keys are the names of the entries themselves. */
+    istate->name_hash = g_hash_table_new (g_str_hash, g_str_equal);
 #if defined WIN32 || defined __APPLE__
-    istate->i_name_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                 g_free, NULL);
+    /* Same keys, folded on the fly by the hash and compare functions. */
+    istate->i_name_hash = g_hash_table_new (utf8_case_hash, utf8_case_equal);
 #endif
     istate->initialized = 1;
     istate->name_hash_initialized = 1;
 }
 
+/*
+ * Entries created while the index is in memory are allocated in chunks
+ * owned by the index, so that they're laid out next to each other and are
+ * all freed at once in discard_index(). Freeing one of them with
+ * cache_entry_free() only frees its modifier.
+ */
+#define ENTRY_CHUNK_SIZE (64 << 10)
+
+struct cache_entry *index_new_cache_entry(struct index_state *istate,
+                                          const char *name, size_t namelen)
+{
+    size_t size = cache_entry_size(namelen);
+    struct cache_entry *ce;
+
+    if (size > ENTRY_CHUNK_SIZE / 8) {
+        ce = calloc(1, size);
+        ce->ce_flags = namelen;
+    } else {
+        if (size > istate->chunk_left) {
+            istate->chunk_next = calloc(1, ENTRY_CHUNK_SIZE);
+            istate->chunk_left = ENTRY_CHUNK_SIZE;
+            istate->entry_chunks = g_list_prepend(istate->entry_chunks,
+                                                  istate->chunk_next);
+        }
+        ce = (struct cache_entry *)istate->chunk_next;
+        istate->chunk_next += size;
+        istate->chunk_left -= size;
+        ce->ce_flags = namelen | CE_IN_ARENA;
+    }
+
+    if (namelen >= CE_NAMEMASK)
+        ce->ce_flags = (ce->ce_flags & ~CE_NAMEMASK) | CE_NAMEMASK;
+    memcpy(ce->name, name, namelen);
+
+    return ce;
+}
+
+/* Size of the in-memory entries of the index file mapped at @mm. */
+static size_t index_arena_size(struct index_state *istate, void *mm)
+{
+    size_t offset = sizeof(struct cache_header);
+    size_t size = 0, len;
+    unsigned int i, flags;
+    const char *name;
+
+    for (i = 0; i < istate->cache_nr; i++) {
+        if (istate->version < 4) {
+            struct ondisk_cache_entry *ondisk = (struct ondisk_cache_entry *)((char *)mm + offset);
+            flags = ntohs(ondisk->flags);
+            name = ondisk->name;
+        } else {
+            struct ondisk_cache_entry2 *ondisk = (struct ondisk_cache_entry2 *)((char *)mm + offset);
+            flags = ntohs(ondisk->flags);
+            name = ondisk->name;
+        }
+
+        len = flags & CE_NAMEMASK;
+        if (len == CE_NAMEMASK)
+            len = strlen(name);
+
+        size += cache_entry_size(len);
+        if (istate->version < 4)
+            offset += ondisk_cache_entry_size(len);
+        else
+            offset += ondisk_cache_entry_size2(len);
+    }
+
+    return size;
+}
+
+/*
+ * Merge the index journal at @path into @istate, if it belongs to the base
+ * index with checksum @base_sha1. See update_index_journal().
+ */
+static int read_index_journal(struct index_state *istate, const char *path,
+                              const unsigned char *base_sha1)
+{
+    char *data = NULL;
+    gsize size;
+    struct journal_header *hdr;
+    struct cache_entry **changed = NULL, **cache = NULL;
+    const char **removed = NULL;
+    unsigned int n_changed = 0, n_removed = 0;
+    unsigned int i, j, k, nr;
+    size_t offset, end;
+    GChecksum *c;
+    unsigned char sha1[20];
+    gsize len = 20;
+    SeafStat st;
+    int ret = -1;
+
+    if (seaf_stat(path, &st) < 0)
+        return 0;
+
+    if (!g_file_get_contents(path, &data, &size, NULL)) {
+        g_critical("failed to read index journal\n");
+        return -1;
+    }
+
+    if (size < sizeof(*hdr) + 20)
+        goto out;
+    hdr = (struct journal_header *)data;
+    if (hdr->hdr_signature != htonl(JOURNAL_SIGNATURE) ||
+        hdr->hdr_version != htonl(JOURNAL_VERSION))
+        goto out;
+
+    c = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(c, (unsigned char *)data, size - 20);
+    g_checksum_get_digest(c, sha1, &len);
+    g_checksum_free(c);
+    if (hashcmp(sha1, (unsigned char *)data + size - 20))
+        goto out;
+
+    /* Left over from before the index was last written in full. */
+    if (hashcmp(hdr->base_sha1, base_sha1)) {
+        ret = 0;
+        goto out;
+    }
+
+    end = size - 20;
+    offset = sizeof(*hdr);
+
+    n_changed = ntohl(hdr->hdr_entries);
+    changed = g_new0(struct cache_entry *, n_changed + 1);
+    for (i = 0; i < n_changed; i++) {
+        if (offset + sizeof(struct ondisk_cache_entry2) > end)
+            goto out;
+        convert_from_disk2((struct ondisk_cache_entry2 *)(data + offset), &changed[i],
+                           NULL);
+        offset += ondisk_ce_size2(changed[i]);
+        if (offset > end)
+            goto out;
+    }
+
+    n_removed = ntohl(hdr->hdr_removed);
+    removed = g_new0(const char *, n_removed + 1);
+    for (i = 0; i < n_removed; i++) {
+        const char *name = data + offset;
+        size_t name_len = strnlen(name, end - offset);
+        if (offset + name_len >= end)
+            goto out;
+        removed[i] = name;
+        offset += name_len + 1;
+    }
+
+    if (istate->has_modifier) {
+        struct cache_ext_hdr *exthdr;
+        char *p, *sep;
+
+        if (offset + sizeof(*exthdr) > end)
+            goto out;
+        exthdr = (struct cache_ext_hdr *)(data + offset);
+        offset += sizeof(*exthdr);
+        if (ntohl(exthdr->ext_name) != CACHE_EXT_MODIFIER ||
+            offset + ntohl(exthdr->ext_size) > end)
+            goto out;
+
+        p = data + offset;
+        for (i = 0; i < n_changed; i++) {
+            if (S_ISDIR(changed[i]->ce_mode))
+                continue;
+            sep = memchr(p, '\n', data + offset + ntohl(exthdr->ext_size) - p);
+            if (!sep)
+                goto out;
+            changed[i]->modifier = g_strndup(p, sep - p);
+            p = sep + 1;
+        }
+    }
+
+    /* Both the journal and the base are sorted, merge them. */
+    cache = calloc(istate->cache_nr + n_changed + 16, sizeof(struct cache_entry *));
+    nr = 0;
+    i = j = k = 0;
+    while (i < istate->cache_nr || j < n_changed) {
+        struct cache_entry *ce = (i < istate->cache_nr) ? istate->cache[i] : NULL;
+        int cmp;
+
+        if (ce) {
+            while (k < n_removed &&
+                   cache_name_compare(removed[k], create_ce_flags(strlen(removed[k]), 0),
+                                      ce->name, ce->ce_flags) < 0)
+                k++;
+            if (k < n_removed && strcmp(removed[k], ce->name) == 0) {
+                remove_name_hash(istate, ce);
+                cache_entry_free(ce);
+                i++;
+                continue;
+            }
+        }
+
+        if (!ce)
+            cmp = -1;
+        else if (j >= n_changed)
+            cmp = 1;
+        else
+            cmp = cache_name_compare(changed[j]->name, changed[j]->ce_flags,
+                                     ce->name, ce->ce_flags);
+
+        if (cmp <= 0) {
+            if (cmp == 0) {
+                remove_name_hash(istate, ce);
+                cache_entry_free(ce);
+                i++;
+            }
+            cache[nr++] = changed[j];
+            add_name_hash(istate, changed[j]);
+            changed[j++] = NULL;
+        } else {
+            cache[nr++] = ce;
+            i++;
+        }
+    }
+
+    free(istate->cache);
+    istate->cache = cache;
+    istate->cache_nr = nr;
+    istate->cache_alloc = istate->cache_nr + n_changed + 16;
+    istate->timestamp.sec = st.st_mtime;
+    cache = NULL;
+    ret = 0;
+
+out:
+    if (ret < 0)
+        g_critical("index journal corrupt\n");
+    if (changed) {
+        for (i = 0; i < n_changed; i++)
+            if (changed[i])
+                cache_entry_free(changed[i]);
+        g_free(changed);
+    }
+    g_free(removed);
+    free(cache);
+    g_free(data);
+    return ret;
+}
+
 /* remember to discard_cache() before reading a different cache! */
 int read_index_from(struct index_state *istate, const char *path, int repo_version)
 {
@@ -270,6 +528,7 @@ int read_index_from(struct index_state *istate, const char *path, int repo_versi
     struct cache_header *hdr;
     void *mm;
     size_t mmap_size;
+    char *arena;
 
     if (istate->initialized)
         return istate->cache_nr;
@@ -324,11 +583,11 @@ int read_index_from(struct index_state *istate, const char *path, int repo_versi
     alloc_index (istate);
 
     /*
-     * The disk format is actually larger than the in-memory format,
-     * due to space for nsec etc, so even though the in-memory one
-     * has room for a few  more flags, we can allocate using the same
-     * index size
+     * All the entries are allocated in one block, which saves an
+     * allocation for each entry. Entries added later by add_index_entry()
+     * are allocated separately, see cache_entry_free().
      */
+    arena = istate->alloc = calloc(1, index_arena_size(istate, mm));
 
     src_offset = sizeof(*hdr);
     for (i = 0; i < istate->cache_nr; i++) {
@@ -339,20 +598,14 @@ int read_index_from(struct index_state *istate, const char *path, int repo_versi
         if (istate->version < 4) {
             disk_ce = (struct ondisk_cache_entry *)((char *)mm + src_offset);
 
-            /* allocate each ce separately so that we can free new
-             * entries added by add_index_entry() later.
-             */
-            if (convert_from_disk(disk_ce, &ce) < 0)
+            if (convert_from_disk(disk_ce, &ce, &arena) < 0)
                 return -1;
 
             src_offset += ondisk_ce_size(ce);
         } else {
             disk_ce2 = (struct ondisk_cache_entry2 *)((char *)mm + src_offset);
 
-            /* allocate each ce separately so that we can free new
-             * entries added by add_index_entry() later.
-             */
-            if (convert_from_disk2(disk_ce2, &ce) < 0)
+            if (convert_from_disk2(disk_ce2, &ce, &arena) < 0)
                 return -1;
 
             src_offset += ondisk_ce_size2(ce);
@@ -382,6 +635,22 @@ int read_index_from(struct index_state *istate, const char *path, int repo_versi
         src_offset += size;
     }
 
+    if (istate->version >= 4) {
+        unsigned char base_sha1[20];
+        char *journal_path;
+        int rc;
+
+        hashcpy(base_sha1, (unsigned char *)mm + mmap_size - 20);
+        munmap(mm, mmap_size);
+
+        journal_path = g_strconcat(path, INDEX_JOURNAL_SUFFIX, NULL);
+        rc = read_index_journal(istate, journal_path, base_sha1);
+        g_free(journal_path);
+        if (rc < 0)
+            return -1;
+        return istate->cache_nr;
+    }
+
     munmap(mm, mmap_size);
     return istate->cache_nr;
 
@@ -640,6 +909,88 @@ int ie_match_stat(struct cache_entry *ce, SeafStat *st,
     return changed;
 }
 
+/*
+ * Parallel preload of the stat info, like git's preload-index.
+ *
+ * Each thread stats a contiguous range of the entries and marks the ones
+ * that still match the worktree with CE_UPTODATE. Stat calls are mostly
+ * waiting for the file system, so the number of threads doesn't depend on
+ * the number of processors.
+ */
+
+#define PRELOAD_MAX_THREADS 16
+#define PRELOAD_ENTRIES_PER_THREAD 500
+
+typedef struct PreloadRange {
+    struct index_state *istate;
+    const char *worktree;
+    int offset;
+    int nr;
+} PreloadRange;
+
+static gpointer
+preload_range (gpointer data)
+{
+    PreloadRange *range = data;
+    struct cache_entry **cache = range->istate->cache + range->offset;
+    struct cache_entry *ce;
+    char *path;
+    SeafStat st;
+    int i;
+
+    for (i = 0; i < range->nr; ++i) {
+        ce = cache[i];
+        if (!S_ISREG(ce->ce_mode) || ce_stage(ce) != 0 ||
+            (ce->ce_flags & CE_REMOVE))
+            continue;
+
+        path = g_build_filename (range->worktree, ce->name, NULL);
+        if (seaf_stat (path, &st) == 0 && S_ISREG(st.st_mode) &&
+            ie_match_stat (ce, &st, CE_MATCH_IGNORE_VALID|
+                           CE_MATCH_IGNORE_SKIP_WORKTREE) == 0)
+            ce_mark_uptodate (ce);
+        g_free (path);
+    }
+
+    return NULL;
+}
+
+void preload_index(struct index_state *istate, const char *worktree)
+{
+    PreloadRange ranges[PRELOAD_MAX_THREADS];
+    GThread *threads[PRELOAD_MAX_THREADS];
+    int n_threads, per_thread, offset, i;
+
+    /* CE_UPTODATE is also set on entries updated in this session, which
+     * haven't necessarily been checked against the worktree. */
+    for (i = 0; i < istate->cache_nr; ++i)
+        istate->cache[i]->ce_flags &= ~CE_UPTODATE;
+
+    n_threads = (istate->cache_nr + PRELOAD_ENTRIES_PER_THREAD - 1) /
+        PRELOAD_ENTRIES_PER_THREAD;
+    n_threads = CLAMP (n_threads, 1, PRELOAD_MAX_THREADS);
+    per_thread = (istate->cache_nr + n_threads - 1) / n_threads;
+
+    offset = 0;
+    for (i = 0; i < n_threads; ++i) {
+        ranges[i].istate = istate;
+        ranges[i].worktree = worktree;
+        ranges[i].offset = offset;
+        ranges[i].nr = MIN (per_thread, istate->cache_nr - offset);
+        offset += ranges[i].nr;
+    }
+
+    if (n_threads == 1) {
+        preload_range (&ranges[0]);
+        return;
+    }
+
+    for (i = 0; i < n_threads; ++i)
+        threads[i] = g_thread_new ("preload-index", preload_range, &ranges[i]);
+    for (i = 0; i < n_threads; ++i)
+        g_thread_join (threads[i]);
+}
+
 /*
  * df_name_compare() is identical to base_name_compare(), except it
  * compares conflicting directory/file entries as equal. Note that
@@ -963,7 +1314,7 @@ int add_to_index(const char *repo_id,
                  const char *modifier,
                  gboolean *added)
 {
-    int size, namelen;
+    int namelen;
     mode_t st_mode = st->st_mode;
     struct cache_entry *ce, *alias;
     unsigned char sha1[20];
@@ -982,10 +1333,7 @@ int add_to_index(const char *repo_id,
     /*     while (namelen && path[namelen-1] == '/') */
     /*         namelen--; */
     /* } */
-    size = cache_entry_size(namelen);
-    ce = calloc(1, size);
-    memcpy(ce->name, path, namelen);
-    ce->ce_flags = namelen;
+    ce = index_new_cache_entry(istate, path, namelen);
     fill_stat_cache_info(ce, st);
 
     ce->ce_mode = create_ce_mode(st_mode);
@@ -993,7 +1341,7 @@ int add_to_index(const char *repo_id,
     alias = index_name_exists(istate, ce->name, ce_namelen(ce), 0);
     if (alias) {
         if (!ce_stage(alias) && !ie_match_stat(alias, st, ce_option)) {
-            free(ce);
+            cache_entry_free(ce);
             return 0;
         }
     } else {
@@ -1028,8 +1376,8 @@ int add_to_index(const char *repo_id,
     if (alias && !ce_stage(alias) &&
         (ABS(alias->ce_mtime.sec - st->st_mtime) == 3600 ||
          ABS(alias->ce_ctime.sec - st->st_ctime) == 3600)) {
-        if (index_cb (repo_id, version, full_path, sha1, crypt, FALSE) < 0) {
-            free (ce);
+        if (index_cb (repo_id, version, full_path, NULL, sha1, crypt, FALSE) < 0) {
+            cache_entry_free (ce);
             return 0;
         }
         if (memcmp (alias->sha1, sha1, 20) == 0)
@@ -1038,8 +1386,11 @@ int add_to_index(const char *repo_id,
 #endif
 #endif  /* 0 */
 
-    if (index_cb (repo_id, version, full_path, sha1, crypt, TRUE) < 0) {
-        free (ce);
+    if (index_cb (repo_id, version, full_path,
+                  (alias && !ce_stage(alias) && S_ISREG(alias->ce_mode)) ?
+                  alias->sha1 : NULL,
+                  sha1, crypt, TRUE) < 0) {
+        cache_entry_free (ce);
         return -1;
     }
 
@@ -1097,16 +1448,12 @@ static int is_garbage_empty_dir (struct index_state *istate, struct cache_entry
 }
 
 static struct cache_entry *
-create_empty_dir_index_entry (const char *path, SeafStat *st)
+create_empty_dir_index_entry (struct index_state *istate,
+                              const char *path, SeafStat *st)
 {
-    int namelen, size;
     struct cache_entry *ce;
 
-    namelen = strlen(path);
-    size = cache_entry_size(namelen);
-    ce = calloc(1, size);
-    memcpy(ce->name, path, namelen);
-    ce->ce_flags = namelen;
+    ce = index_new_cache_entry (istate, path, strlen(path));
 
     ce->ce_mtime.sec = st->st_mtime;
     ce->ce_ctime.sec = st->st_ctime;
@@ -1123,16 +1470,16 @@ add_empty_dir_to_index (struct index_state *istate, const char *path, SeafStat *
     struct cache_entry *ce, *alias;
     int add_option = (ADD_CACHE_OK_TO_ADD|ADD_CACHE_OK_TO_REPLACE);
 
-    ce = create_empty_dir_index_entry (path, st);
+    ce = create_empty_dir_index_entry (istate, path, st);
 
     if (is_garbage_empty_dir (istate, ce)) {
-        free (ce);
+        cache_entry_free (ce);
         return 0;
     }
 
     alias = index_name_exists(istate, ce->name, ce_namelen(ce), 0);
     if (alias) {
-        free (ce);
+        cache_entry_free (ce);
         return 0;
     } else {
 #if defined WIN32 || defined __APPLE__
@@ -1151,7 +1498,7 @@ add_empty_dir_to_index (struct index_state *istate, const char *path, SeafStat *
 
     if (add_index_entry(istate, ce, add_option)) {
         seaf_warning("unable to add %s to index\n",path);
-        free (ce);
+        cache_entry_free (ce);
         return -1;
     }
 
@@ -1234,24 +1581,23 @@ remove_from_index_with_prefix (struct index_state *istate, const char *path_pref
 }
 
 static struct cache_entry *
-create_renamed_cache_entry (struct cache_entry *ce,
+create_renamed_cache_entry (struct index_state *istate,
+                            struct cache_entry *ce,
                             const char *src_path, const char *dst_path)
 {
     struct cache_entry *new_ce;
     char *new_ce_name;
+    unsigned int flags;
     int src_pathlen = strlen(src_path);
 
     new_ce_name = g_strconcat (dst_path, &ce->name[src_pathlen], NULL);
 
-    int namelen = strlen(new_ce_name);
-    int size = cache_entry_size (namelen);
-    new_ce = calloc (size, 1);
-    memcpy (new_ce, ce, sizeof(struct cache_entry));
-    new_ce->ce_flags = namelen;
+    new_ce = index_new_cache_entry (istate, new_ce_name, strlen(new_ce_name));
+    flags = new_ce->ce_flags;
+    memcpy (new_ce, ce, offsetof(struct cache_entry, modifier));
+    new_ce->ce_flags = flags;
     new_ce->current_mtime = 0;
     new_ce->modifier = g_strdup(ce->modifier);
-    new_ce->next = NULL;
-    memcpy (new_ce->name, new_ce_name, namelen);
     g_free (new_ce_name);
 
     return new_ce;
@@ -1273,7 +1619,7 @@ create_renamed_cache_entries (struct index_state *istate,
     if (pos >= 0) {
         ce = istate->cache[pos];
         ret = calloc (1, sizeof(struct cache_entry *));
-        *ret = create_renamed_cache_entry (ce, src_path, dst_path);
+        *ret = create_renamed_cache_entry (istate, ce, src_path, dst_path);
         *n_entries = 1;
 
         remove_index_entry_at (istate, pos);
@@ -1330,7 +1676,7 @@ create_renamed_cache_entries (struct index_state *istate,
     for (i = pos; i < pos + *n_entries; ++i) {
         ce = istate->cache[i];
 
-        ret[i - pos] = create_renamed_cache_entry (ce, src_path, dst_path);
+        ret[i - pos] = create_renamed_cache_entry (istate, ce, src_path, dst_path);
 
         if (cb_after_rename)
             cb_after_rename (ret[i-pos], user_data);
@@ -1471,7 +1817,7 @@ add_empty_dir_to_index_with_check (struct index_state *istate,
     g_free (full_path);
 
     if (is_empty) {
-        ce = create_empty_dir_index_entry (path, st);
+        ce = create_empty_dir_index_entry (istate, path, st);
 
         /* Make sure the array is big enough .. */
         if (istate->cache_nr == istate->cache_alloc) {
@@ -1920,13 +2266,9 @@ static void ce_smudge_racily_clean_entry(struct cache_entry *ce)
 }
 #endif
 
-static int ce_write_entry2(WriteIndexInfo *info, int fd, struct cache_entry *ce)
+/* @ondisk must be zeroed and ondisk_ce_size2(ce) bytes long. */
+static void ce_to_ondisk2(struct cache_entry *ce, struct ondisk_cache_entry2 *ondisk)
 {
-    int size = ondisk_ce_size2(ce);
-    struct ondisk_cache_entry2 *ondisk = calloc(1, size);
-    char *name;
-    int result;
-
     ondisk->ctime.sec = hton64(ce->ce_ctime.sec);
     ondisk->mtime.sec = hton64(ce->ce_mtime.sec);
     ondisk->dev  = htonl(ce->ce_dev);
@@ -1937,8 +2279,16 @@ static int ce_write_entry2(WriteIndexInfo *info, int fd, struct cache_entry *ce)
     ondisk->size = hton64(ce->ce_size);
     hashcpy(ondisk->sha1, ce->sha1);
     ondisk->flags = htons(ce->ce_flags);
-    name = ondisk->name;
-    memcpy(name, ce->name, ce_namelen(ce));
+    memcpy(ondisk->name, ce->name, ce_namelen(ce));
+}
+
+static int ce_write_entry2(WriteIndexInfo *info, int fd, struct cache_entry *ce)
+{
+    int size = ondisk_ce_size2(ce);
+    struct ondisk_cache_entry2 *ondisk = calloc(1, size);
+    int result;
+
+    ce_to_ondisk2(ce, ondisk);
 
     result = ce_write(info, fd, ondisk, size);
     free(ondisk);
@@ -2052,6 +2402,398 @@ out:
     return ret;
 }
 
+/*
+ * Index journal.
+ *
+ * Writing the whole index and checksumming it on every commit is costly
+ * for libraries with many files, while usually only a few entries change.
+ * Like git's split index, the entries that differ from the last fully
+ * written index file (the base) are written to a small journal next to it
+ * instead, and read_index_from() merges the journal into the base.
+ *
+ * The journal always holds all the changes since the base was written. Once
+ * it grows too big compared to the base, the whole index is written again
+ * and the journal is removed. The journal records the checksum of its base,
+ * so a journal that was left over from before a full write is ignored.
+ */
+
+/* Smaller indexes are always written in full. */
+#define JOURNAL_MIN_BASE_ENTRIES 4096
+/* Write the full index when more than 1/8 of the entries changed. */
+#define JOURNAL_MAX_CHANGE_RATIO 8
+
+typedef struct {
+    char *mm;
+    size_t size;
+    unsigned int nr;
+    unsigned int i;
+    size_t offset;
+    size_t end;
+    /* Modifiers of the base entries, one line for each non-dir entry. */
+    const char *modifiers;
+    const char *modifiers_end;
+    /* Current base entry */
+    struct ondisk_cache_entry2 *ondisk;
+    unsigned int flags;
+    size_t ondisk_size;
+    const char *modifier;
+    size_t modifier_len;
+} BaseIndex;
+
+static int base_index_next(BaseIndex *base)
+{
+    struct ondisk_cache_entry2 *ondisk;
+    size_t len;
+    const char *p;
+
+    base->ondisk = NULL;
+    if (base->i >= base->nr)
+        return 0;
+    if (base->offset + sizeof(*ondisk) > base->end)
+        return -1;
+
+    ondisk = (struct ondisk_cache_entry2 *)(base->mm + base->offset);
+    base->flags = ntohs(ondisk->flags);
+    len = base->flags & CE_NAMEMASK;
+    if (len == CE_NAMEMASK)
+        len = strnlen(ondisk->name, base->end - base->offset - sizeof(*ondisk));
+    base->ondisk_size = ondisk_cache_entry_size2(len);
+    if (base->offset + base->ondisk_size > base->end)
+        return -1;
+
+    base->modifier = NULL;
+    if (base->modifiers && !S_ISDIR(ntohl(ondisk->mode))) {
+        p = memchr(base->modifiers, '\n', base->modifiers_end - base->modifiers);
+        if (!p)
+            return -1;
+        base->modifier = base->modifiers;
+        base->modifier_len = p - base->modifiers;
+        base->modifiers = p + 1;
+    }
+
+    base->ondisk = ondisk;
+    base->offset += base->ondisk_size;
+    base->i++;
+    return 0;
+}
+
+/* Map the base index at @path. Returns 1 if it can't have a journal. */
+static int base_index_open(BaseIndex *base, const char *path)
+{
+    struct cache_header *hdr;
+    struct cache_ext_hdr *exthdr;
+    SeafStat st;
+    int fd;
+    unsigned int i;
+    size_t offset;
+
+    memset(base, 0, sizeof(*base));
+
+    fd = seaf_util_open(path, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return 1;
+    if (seaf_fstat(fd, &st) < 0 ||
+        st.st_size < sizeof(struct cache_header) + 20) {
+        close(fd);
+        return 1;
+    }
+
+    base->size = (size_t)st.st_size;
+    base->mm = mmap(NULL, base->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base->mm == MAP_FAILED) {
+        base->mm = NULL;
+        return 1;
+    }
+
+    hdr = (struct cache_header *)base->mm;
+    if (hdr->hdr_signature != htonl(CACHE_SIGNATURE) ||
+        hdr->hdr_version != htonl(4))
+        return 1;
+    base->nr = ntohl(hdr->hdr_entries);
+    base->end = base->size - 20;
+
+    /* Skip to the extensions to find the modifiers. */
+    offset = sizeof(*hdr);
+    for (i = 0; i < base->nr; i++) {
+        struct ondisk_cache_entry2 *ondisk;
+        size_t len;
+
+        if (offset + sizeof(*ondisk) > base->end)
+            return 1;
+        ondisk = (struct ondisk_cache_entry2 *)(base->mm + offset);
+        len = ntohs(ondisk->flags) & CE_NAMEMASK;
+        if (len == CE_NAMEMASK)
+            len = strnlen(ondisk->name, base->end - offset - sizeof(*ondisk));
+        offset += ondisk_cache_entry_size2(len);
+    }
+
+    while (offset + sizeof(*exthdr) <= base->end) {
+        exthdr = (struct cache_ext_hdr *)(base->mm + offset);
+        offset += sizeof(*exthdr);
+        if (offset + ntohl(exthdr->ext_size) > base->end)
+            return 1;
+        if (ntohl(exthdr->ext_name) == CACHE_EXT_MODIFIER) {
+            base->modifiers = base->mm + offset;
+            base->modifiers_end = base->modifiers + ntohl(exthdr->ext_size);
+        }
+        offset += ntohl(exthdr->ext_size);
+    }
+
+    base->offset = sizeof(*hdr);
+    return 0;
+}
+
+static void base_index_close(BaseIndex *base)
+{
+    if (base->mm)
+        munmap(base->mm, base->size);
+}
+
+static gboolean ce_same_as_base(struct cache_entry *ce, BaseIndex *base,
+                                struct ondisk_cache_entry2 *buf)
+{
+    size_t size = ondisk_ce_size2(ce);
+
+    if (size != base->ondisk_size)
+        return FALSE;
+
+    memset(buf, 0, size);
+    ce_to_ondisk2(ce, buf);
+    if (memcmp(buf, base->ondisk, size) != 0)
+        return FALSE;
+
+    if (base->modifier) {
+        if (!ce->modifier || strlen(ce->modifier) != base->modifier_len ||
+            memcmp(ce->modifier, base->modifier, base->modifier_len) != 0)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Collect the entries of @istate that are added or changed since @base in
+ * @changed, and the names of the removed entries in @removed.
+ */
+static int diff_index_with_base(struct index_state *istate, BaseIndex *base,
+                                GPtrArray *changed, GPtrArray *removed)
+{
+    struct ondisk_cache_entry2 *buf;
+    size_t buf_size = ondisk_cache_entry_size2(CE_NAMEMASK);
+    const char *prev_name = NULL;
+    unsigned int i = 0;
+    struct cache_entry *ce;
+    int cmp;
+
+    buf = g_malloc(buf_size);
+
+    if (base_index_next(base) < 0)
+        goto error;
+
+    while (1) {
+        /* Skip the entries that write_index() wouldn't write. */
+        ce = NULL;
+        while (i < istate->cache_nr) {
+            ce = istate->cache[i];
+            if (!(ce->ce_flags & CE_REMOVE) &&
+                !(prev_name && g_strcmp0(ce->name, prev_name) == 0))
+                break;
+            ce = NULL;
+            i++;
+        }
+
+        if (!ce && !base->ondisk)
+            break;
+
+        if (!ce)
+            cmp = 1;
+        else if (!base->ondisk)
+            cmp = -1;
+        else
+            cmp = cache_name_compare(ce->name, ce->ce_flags,
+                                     base->ondisk->name, base->flags);
+
+        if (cmp > 0) {
+            g_ptr_array_add(removed, base->ondisk->name);
+        } else {
+            if (ondisk_ce_size2(ce) > buf_size) {
+                buf_size = ondisk_ce_size2(ce);
+                buf = g_realloc(buf, buf_size);
+            }
+            if (cmp < 0 || !ce_same_as_base(ce, base, buf))
+                g_ptr_array_add(changed, ce);
+            prev_name = ce->name;
+            i++;
+        }
+
+        if (cmp >= 0 && base_index_next(base) < 0)
+            goto error;
+    }
+
+    g_free(buf);
+    return 0;
+
+error:
+    seaf_warning("Base index file is corrupt.\n");
+    g_free(buf);
+    return -1;
+}
+
+static int write_index_journal(struct index_state *istate, int newfd,
+                               BaseIndex *base,
+                               GPtrArray *changed, GPtrArray *removed)
+{
+    WriteIndexInfo info;
+    struct journal_header hdr;
+    SeafStat st;
+    unsigned int i;
+    int ret = 0;
+
+    memset(&info, 0, sizeof(info));
+
+    hdr.hdr_signature = htonl(JOURNAL_SIGNATURE);
+    hdr.hdr_version = htonl(JOURNAL_VERSION);
+    memcpy(hdr.base_sha1, base->mm + base->end, 20);
+    hdr.hdr_entries = htonl(changed->len);
+    hdr.hdr_removed = htonl(removed->len);
+
+    info.context = g_checksum_new(G_CHECKSUM_SHA1);
+    if (ce_write(&info, newfd, &hdr, sizeof(hdr)) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < changed->len; i++) {
+        if (ce_write_entry2(&info, newfd, g_ptr_array_index(changed, i)) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < removed->len; i++) {
+        char *name = g_ptr_array_index(removed, i);
+        if (ce_write(&info, newfd, name, strlen(name) + 1) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (istate->has_modifier) {
+        GString *buf = g_string_new("");
+        struct cache_entry *ce;
+        int err;
+
+        for (i = 0; i < changed->len; i++) {
+            ce = g_ptr_array_index(changed, i);
+            if (S_ISDIR(ce->ce_mode))
+                continue;
+            if (!ce->modifier) {
+                seaf_warning("BUG: index entry %s doesn't have modifier info.\n",
+                             ce->name);
+                g_string_free(buf, TRUE);
+                ret = -1;
+                goto out;
+            }
+            g_string_append_printf(buf, "%s\n", ce->modifier);
+        }
+
+        err = write_index_ext_header(&info, newfd, CACHE_EXT_MODIFIER, buf->len) < 0
+            || ce_write(&info, newfd, buf->str, buf->len) < 0;
+        g_string_free(buf, TRUE);
+        if (err) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (ce_flush(&info, newfd) || seaf_fstat(newfd, &st)) {
+        ret = -1;
+        goto out;
+    }
+
+    istate->timestamp.sec = (unsigned int)st.st_mtime;
+    istate->timestamp.nsec = 0;
+
+out:
+    g_checksum_free(info.context);
+    return ret;
+}
+
+/*
+ * Write the changes of @istate since the index file at @path was last
+ * written in full to its journal.
+ *
+ * Returns 1 if the whole index should be written with write_index()
+ * instead, because there is no usable base or too much has changed.
+ */
+int update_index_journal(struct index_state *istate, const char *path)
+{
+    BaseIndex base;
+    GPtrArray *changed = NULL, *removed = NULL;
+    char *journal_path = NULL, *shadow_path = NULL;
+    int fd;
+    int ret = 0;
+
+    if (base_index_open(&base, path) != 0) {
+        ret = 1;
+        goto out;
+    }
+
+    if (base.nr < JOURNAL_MIN_BASE_ENTRIES ||
+        !istate->has_modifier != !base.modifiers) {
+        ret = 1;
+        goto out;
+    }
+
+    changed = g_ptr_array_new();
+    removed = g_ptr_array_new();
+    if (diff_index_with_base(istate, &base, changed, removed) < 0) {
+        ret = 1;
+        goto out;
+    }
+
+    if ((changed->len + removed->len) * JOURNAL_MAX_CHANGE_RATIO > base.nr) {
+        ret = 1;
+        goto out;
+    }
+
+    journal_path = g_strconcat(path, INDEX_JOURNAL_SUFFIX, NULL);
+    shadow_path = g_strconcat(journal_path, ".shadow", NULL);
+
+    fd = seaf_util_create(shadow_path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        seaf_warning("Failed to open shadow index journal: %s.\n", strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    if (write_index_journal(istate, fd, &base, changed, removed) < 0) {
+        seaf_warning("Failed to write shadow index journal: %s.\n", strerror(errno));
+        close(fd);
+        seaf_util_unlink(shadow_path);
+        ret = -1;
+        goto out;
+    }
+    close(fd);
+
+    if (seaf_util_rename(shadow_path, journal_path) < 0) {
+        seaf_warning("Failed to update index journal: %s.\n", strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+out:
+    if (changed)
+        g_ptr_array_free(changed, TRUE);
+    if (removed)
+        g_ptr_array_free(removed, TRUE);
+    base_index_close(&base);
+    g_free(journal_path);
+    g_free(shadow_path);
+    return ret;
+}
+
 int discard_index(struct index_state *istate)
 {
     int i;
@@ -2068,9 +2810,15 @@ int discard_index(struct index_state *istate)
     g_hash_table_destroy (istate->i_name_hash);
 #endif
     /* cache_tree_free(&(istate->cache_tree)); */
-    /* free(istate->alloc); */
+    free(istate->alloc);
+    g_free(istate->alloc_modifiers);
+    g_list_free_full(istate->entry_chunks, free);
     free(istate->cache);
     istate->alloc = NULL;
+    istate->alloc_modifiers = NULL;
+    istate->entry_chunks = NULL;
+    istate->chunk_next = NULL;
+    istate->chunk_left = 0;
     istate->initialized = 0;
 
     /* no need to throw away allocated active_cache */
@@ -2079,8 +2827,19 @@ int discard_index(struct index_state *istate)
 
 void cache_entry_free (struct cache_entry *ce)
 {
-    g_free (ce->modifier);
-    free (ce);
+    if (!(ce->ce_flags & CE_MODIFIER_IN_ARENA))
+        g_free (ce->modifier);
+    /* Entries in the blocks of the index are freed in discard_index(). */
+    if (!(ce->ce_flags & CE_IN_ARENA))
+        free (ce);
+}
+
+void cache_entry_set_modifier (struct cache_entry *ce, const char *modifier)
+{
+    if (!(ce->ce_flags & CE_MODIFIER_IN_ARENA))
+        g_free (ce->modifier);
+    ce->modifier = g_strdup (modifier);
+    ce->ce_flags &= ~CE_MODIFIER_IN_ARENA;
 }
 
 void remove_name_hash(struct index_state *istate, struct cache_entry *ce)
@@ -2088,17 +2847,20 @@ void remove_name_hash(struct index_state *istate, struct cache_entry *ce)
     g_hash_table_remove (istate->name_hash, ce->name);
 
 #if defined WIN32 || defined __APPLE__
-    char *i_name = g_utf8_strdown (ce->name, -1);
-    g_hash_table_remove (istate->i_name_hash, i_name);
-    g_free (i_name);
+    /* Another entry that differs only in case may own the slot now, and
+     * the key is its name. Leave it alone.
+     */
+    if (g_hash_table_lookup (istate->i_name_hash, ce->name) == ce)
+        g_hash_table_remove (istate->i_name_hash, ce->name);
 #endif
 }
 
 void add_name_hash(struct index_state *istate, struct cache_entry *ce)
 {
-    g_hash_table_insert (istate->name_hash, g_strdup(ce->name), ce);
+    g_hash_table_replace (istate->name_hash, ce->name, ce);
 #if defined WIN32 || defined __APPLE__
-    g_hash_table_insert (istate->i_name_hash, g_utf8_strdown(ce->name, -1), ce);
+    /* Replace the key too, it must stay the name of a live entry. */
+    g_hash_table_replace (istate->i_name_hash, ce->name, ce);
 #endif
 }
 
@@ -2109,13 +2871,8 @@ struct cache_entry *index_name_exists(struct index_state *istate,
 #if defined WIN32 || defined __APPLE__
     if (!igncase)
         return g_hash_table_lookup (istate->name_hash, name);
-    else {
-        struct cache_entry *ce;
-        char *i_name = g_utf8_strdown (name, -1);
-        ce = g_hash_table_lookup (istate->i_name_hash, i_name);
-        g_free (i_name);
-        return ce;
-    }
+    else
+        return g_hash_table_lookup (istate->i_name_hash, name);
 #else
     return g_hash_table_lookup (istate->name_hash, name);
 #endif
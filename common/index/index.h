@@ -101,6 +101,21 @@ struct cache_header {
     unsigned int hdr_entries;
 };
 
+/*
+ * The index journal holds the entries that changed since the index file
+ * (the base) was last written in full. See update_index_journal().
+ */
+#define JOURNAL_SIGNATURE 0x534a4e4c    /* "SJNL" */
+#define JOURNAL_VERSION 1
+#define INDEX_JOURNAL_SUFFIX ".journal"
+struct journal_header {
+    unsigned int hdr_signature;
+    unsigned int hdr_version;
+    unsigned char base_sha1[20]; /* checksum of the base index file */
+    unsigned int hdr_entries;    /* added or changed entries */
+    unsigned int hdr_removed;    /* names of removed entries */
+};
+
 /*
  * The "cache_time" is just the low 32 bits of the
  * time. It doesn't matter if it overflows - we only
@@ -282,6 +297,10 @@ struct cache_entry {
 #define CE_UNPACKED          (1 << 24)
 #define CE_NEW_SKIP_WORKTREE (1 << 25)
 
+/* Allocated in the blocks of index_state, not separately. */
+#define CE_IN_ARENA          (1 << 26)
+#define CE_MODIFIER_IN_ARENA (1 << 27)
+
 /*
  * Extended on-disk flags
  */
@@ -306,7 +325,7 @@ struct cache_entry {
  * Copy the sha1 and stat state of a cache entry from one to
  * another. But we never change the name, or the hash state!
  */
-#define CE_STATE_MASK (CE_HASHED | CE_UNHASHED)
+#define CE_STATE_MASK (CE_HASHED | CE_UNHASHED | CE_IN_ARENA | CE_MODIFIER_IN_ARENA)
 
 static inline void copy_cache_entry(struct cache_entry *dst, struct cache_entry *src)
 {
@@ -315,7 +334,7 @@ static inline void copy_cache_entry(struct cache_entry *dst, struct cache_entry
     /* Don't copy modifier, hash chain and name */
     memcpy(dst, src, offsetof(struct cache_entry, modifier));
 
-    /* Restore the hash state */
+    /* Restore the hash and allocation state */
     dst->ce_flags = (dst->ce_flags & ~CE_STATE_MASK) | state;
 }
 
@@ -390,7 +409,11 @@ struct index_state {
     unsigned int cache_nr, cache_alloc, cache_changed;
     /* struct cache_tree *cache_tree; */
     struct cache_time timestamp;
-    void *alloc;
+    void *alloc;                /* entries read from the index file */
+    char *alloc_modifiers;      /* modifiers of these entries */
+    GList *entry_chunks;        /* entries created later */
+    char *chunk_next;
+    size_t chunk_left;
     unsigned name_hash_initialized : 1,
          initialized : 1;
     GHashTable *name_hash;
@@ -448,11 +471,11 @@ static inline enum object_type object_type(unsigned int mode)
 
 /* Initialize and use the cache information */
 extern int read_index(struct index_state *);
-extern int read_index_preload(struct index_state *, const char **pathspec);
 extern int read_index_from(struct index_state *, const char *path, int repo_version);
 extern int is_index_unborn(struct index_state *);
 extern int read_index_unmerged(struct index_state *);
 extern int write_index(struct index_state *, int newfd);
+extern int update_index_journal(struct index_state *, const char *path);
 extern int discard_index(struct index_state *);
 extern int unmerged_index(const struct index_state *);
 extern int verify_path(const char *path);
@@ -474,9 +497,14 @@ extern int remove_file_from_index(struct index_state *, const char *path);
 #define ADD_CACHE_IGNORE_REMOVAL 8
 #define ADD_CACHE_INTENT 16
 
+/*
+ * @old_sha1 is the id of the version of @path in the index, or NULL if the
+ * file is new.
+ */
 typedef int (*IndexCB) (const char *repo_id,
                         int version,
                         const char *path,
+                        const unsigned char *old_sha1,
                         unsigned char sha1[],
                         struct SeafileCrypt *crypt,
                         gboolean write_data);
@@ -536,7 +564,10 @@ extern struct cache_entry *make_cache_entry(unsigned int mode, const unsigned ch
 extern int ce_same_name(struct cache_entry *a, struct cache_entry *b);
 extern int index_name_is_other(const struct index_state *, const char *, int);
 
+struct cache_entry *index_new_cache_entry (struct index_state *istate,
+                                           const char *name, size_t namelen);
 void cache_entry_free (struct cache_entry *ce);
+void cache_entry_set_modifier (struct cache_entry *ce, const char *modifier);
 
 /* do stat comparison even if CE_VALID is true */
 #define CE_MATCH_IGNORE_VALID        01
@@ -546,6 +577,9 @@ void cache_entry_free (struct cache_entry *ce);
 #define CE_MATCH_IGNORE_SKIP_WORKTREE    04
 extern int ie_match_stat(struct cache_entry *, SeafStat *, unsigned int);
 extern int ie_modified(const struct index_state *, struct cache_entry *, SeafStat *, unsigned int);
+/* Stat the entries in parallel and mark the unchanged ones with CE_UPTODATE,
+ * so that full scans don't need to stat them one by one. */
+extern void preload_index(struct index_state *, const char *worktree);
 
 extern int ce_path_match(const struct cache_entry *ce, const char **pathspec);
 extern int index_fd(unsigned char *sha1, int fd, SeafStat *st, enum object_type type, const char *path);
@@ -0,0 +1,391 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "json-scan.h"
+
+#define MAX_SKIP_DEPTH 64
+
+void
+json_scanner_init (JsonScanner *sc, const char *data, gsize len, GString *buf)
+{
+    sc->p = data;
+    sc->end = data + len;
+    sc->buf = buf;
+    sc->first = FALSE;
+}
+
+static inline void
+skip_ws (JsonScanner *sc)
+{
+    while (sc->p < sc->end &&
+           (*sc->p == ' ' || *sc->p == '\t' || *sc->p == '\n' || *sc->p == '\r'))
+        ++sc->p;
+}
+
+static int
+expect_char (JsonScanner *sc, char c)
+{
+    skip_ws (sc);
+    if (sc->p >= sc->end || *sc->p != c)
+        return -1;
+    ++sc->p;
+    return 0;
+}
+
+static int
+parse_hex4 (const char *p, guint32 *out)
+{
+    guint32 v = 0;
+    int i, d;
+
+    for (i = 0; i < 4; ++i) {
+        d = g_ascii_xdigit_value (p[i]);
+        if (d < 0)
+            return -1;
+        v = (v << 4) | d;
+    }
+    *out = v;
+    return 0;
+}
+
+/* Decode an escape sequence starting after the backslash. */
+static int
+decode_escape (JsonScanner *sc, const char **pp)
+{
+    const char *p = *pp;
+    guint32 u, low;
+
+    switch (*p) {
+    case '"':
+    case '\\':
+    case '/':
+        g_string_append_c (sc->buf, *p);
+        break;
+    case 'b':
+        g_string_append_c (sc->buf, '\b');
+        break;
+    case 'f':
+        g_string_append_c (sc->buf, '\f');
+        break;
+    case 'n':
+        g_string_append_c (sc->buf, '\n');
+        break;
+    case 'r':
+        g_string_append_c (sc->buf, '\r');
+        break;
+    case 't':
+        g_string_append_c (sc->buf, '\t');
+        break;
+    case 'u':
+        if (sc->end - p < 5 || parse_hex4 (p + 1, &u) < 0)
+            return -1;
+        p += 4;
+        if (u >= 0xD800 && u <= 0xDBFF) {
+            /* A surrogate pair. */
+            if (sc->end - p < 7 || p[1] != '\\' || p[2] != 'u' ||
+                parse_hex4 (p + 3, &low) < 0 ||
+                low < 0xDC00 || low > 0xDFFF)
+                return -1;
+            u = 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00);
+            p += 6;
+        } else if (u >= 0xDC00 && u <= 0xDFFF) {
+            return -1;
+        }
+        /* Like jansson, don't allow NUL in strings. */
+        if (u == 0)
+            return -1;
+        g_string_append_unichar (sc->buf, u);
+        break;
+    default:
+        return -1;
+    }
+
+    *pp = p + 1;
+    return 0;
+}
+
+/* Scan the string at sc->p, which must point to the opening quote. */
+static int
+scan_string (JsonScanner *sc, const char **str, gsize *len)
+{
+    const char *start, *p;
+
+    p = start = sc->p + 1;
+    while (p < sc->end && *p != '"' && *p != '\\' && (guchar)*p >= 0x20)
+        ++p;
+    if (p >= sc->end || (guchar)*p < 0x20)
+        return -1;
+
+    if (*p == '"') {
+        if (!g_utf8_validate (start, p - start, NULL))
+            return -1;
+        *str = start;
+        *len = p - start;
+        sc->p = p + 1;
+        return 0;
+    }
+
+    g_string_truncate (sc->buf, 0);
+    g_string_append_len (sc->buf, start, p - start);
+    while (1) {
+        if (p >= sc->end || (guchar)*p < 0x20)
+            return -1;
+        if (*p == '"')
+            break;
+        if (*p == '\\') {
+            ++p;
+            if (p >= sc->end || decode_escape (sc, &p) < 0)
+                return -1;
+            continue;
+        }
+        start = p;
+        while (p < sc->end && *p != '"' && *p != '\\' && (guchar)*p >= 0x20)
+            ++p;
+        g_string_append_len (sc->buf, start, p - start);
+    }
+
+    if (!g_utf8_validate (sc->buf->str, sc->buf->len, NULL))
+        return -1;
+    *str = sc->buf->str;
+    *len = sc->buf->len;
+    sc->p = p + 1;
+    return 0;
+}
+
+static int
+scan_digits (const char **pp, const char *end)
+{
+    const char *p = *pp;
+
+    if (p >= end || !g_ascii_isdigit (*p))
+        return -1;
+    while (p < end && g_ascii_isdigit (*p))
+        ++p;
+    *pp = p;
+    return 0;
+}
+
+static int
+scan_number (JsonScanner *sc, gint64 *val)
+{
+    const char *p = sc->p;
+    gboolean neg = FALSE, is_int = TRUE, overflow = FALSE;
+    guint64 v = 0;
+    int d;
+
+    if (p < sc->end && *p == '-') {
+        neg = TRUE;
+        ++p;
+    }
+    if (p >= sc->end || !g_ascii_isdigit (*p))
+        return -1;
+    if (*p == '0') {
+        ++p;
+        if (p < sc->end && g_ascii_isdigit (*p))
+            return -1;
+    } else {
+        while (p < sc->end && g_ascii_isdigit (*p)) {
+            d = *p - '0';
+            if (v > (G_MAXUINT64 - d) / 10)
+                overflow = TRUE;
+            else
+                v = v * 10 + d;
+            ++p;
+        }
+    }
+
+    if (p < sc->end && *p == '.') {
+        is_int = FALSE;
+        ++p;
+        if (scan_digits (&p, sc->end) < 0)
+            return -1;
+    }
+    if (p < sc->end && (*p == 'e' || *p == 'E')) {
+        is_int = FALSE;
+        ++p;
+        if (p < sc->end && (*p == '+' || *p == '-'))
+            ++p;
+        if (scan_digits (&p, sc->end) < 0)
+            return -1;
+    }
+
+    if (is_int) {
+        /* jansson fails on integers that don't fit either. */
+        if (overflow || v > (guint64)G_MAXINT64 + (neg ? 1 : 0))
+            return -1;
+        *val = neg ? (gint64)(0 - v) : (gint64)v;
+    } else {
+        *val = 0;
+    }
+
+    sc->p = p;
+    return 0;
+}
+
+static int
+scan_literal (JsonScanner *sc, const char *lit)
+{
+    gsize len = strlen (lit);
+
+    if ((gsize)(sc->end - sc->p) < len || memcmp (sc->p, lit, len) != 0)
+        return -1;
+    sc->p += len;
+    return 0;
+}
+
+static int
+skip_value (JsonScanner *sc, int depth)
+{
+    const char *str;
+    gsize len;
+    gint64 val;
+    int rc;
+
+    skip_ws (sc);
+    if (sc->p >= sc->end)
+        return -1;
+
+    switch (*sc->p) {
+    case '{':
+        if (depth >= MAX_SKIP_DEPTH || json_scan_object_begin (sc) < 0)
+            return -1;
+        while ((rc = json_scan_next_member (sc, &str, &len)) > 0) {
+            if (skip_value (sc, depth + 1) < 0)
+                return -1;
+        }
+        return rc;
+    case '[':
+        if (depth >= MAX_SKIP_DEPTH || json_scan_array_begin (sc) < 0)
+            return -1;
+        while ((rc = json_scan_next_element (sc)) > 0) {
+            if (skip_value (sc, depth + 1) < 0)
+                return -1;
+        }
+        return rc;
+    case '"':
+        return scan_string (sc, &str, &len);
+    case 't':
+        return scan_literal (sc, "true");
+    case 'f':
+        return scan_literal (sc, "false");
+    case 'n':
+        return scan_literal (sc, "null");
+    default:
+        return scan_number (sc, &val);
+    }
+}
+
+int
+json_scan_object_begin (JsonScanner *sc)
+{
+    if (expect_char (sc, '{') < 0)
+        return -1;
+    sc->first = TRUE;
+    return 0;
+}
+
+/* Move to the next item of a container. Returns 0 if @close is found. */
+static int
+next_item (JsonScanner *sc, char close)
+{
+    skip_ws (sc);
+    if (sc->p >= sc->end)
+        return -1;
+
+    if (sc->first) {
+        sc->first = FALSE;
+        if (*sc->p == close) {
+            ++sc->p;
+            return 0;
+        }
+        return 1;
+    }
+
+    if (*sc->p == close) {
+        ++sc->p;
+        return 0;
+    }
+    if (*sc->p != ',')
+        return -1;
+    ++sc->p;
+    return 1;
+}
+
+int
+json_scan_next_member (JsonScanner *sc, const char **key, gsize *key_len)
+{
+    int rc;
+
+    rc = next_item (sc, '}');
+    if (rc <= 0)
+        return rc;
+
+    skip_ws (sc);
+    if (sc->p >= sc->end || *sc->p != '"')
+        return -1;
+    if (scan_string (sc, key, key_len) < 0)
+        return -1;
+    if (expect_char (sc, ':') < 0)
+        return -1;
+
+    return 1;
+}
+
+int
+json_scan_array_begin (JsonScanner *sc)
+{
+    if (expect_char (sc, '[') < 0)
+        return -1;
+    sc->first = TRUE;
+    return 0;
+}
+
+int
+json_scan_next_element (JsonScanner *sc)
+{
+    return next_item (sc, ']');
+}
+
+char
+json_scan_peek (JsonScanner *sc)
+{
+    skip_ws (sc);
+    return sc->p < sc->end ? *sc->p : 0;
+}
+
+int
+json_scan_string (JsonScanner *sc, const char **str, gsize *len)
+{
+    skip_ws (sc);
+    if (sc->p >= sc->end || *sc->p != '"')
+        return -1;
+    return scan_string (sc, str, len);
+}
+
+int
+json_scan_int (JsonScanner *sc, gint64 *val)
+{
+    skip_ws (sc);
+    if (sc->p >= sc->end)
+        return -1;
+
+    if (*sc->p == '-' || g_ascii_isdigit (*sc->p))
+        return scan_number (sc, val);
+
+    *val = 0;
+    return skip_value (sc, 0);
+}
+
+int
+json_scan_skip (JsonScanner *sc)
+{
+    return skip_value (sc, 0);
+}
+
+int
+json_scan_finish (JsonScanner *sc)
+{
+    skip_ws (sc);
+    return sc->p == sc->end ? 0 : -1;
+}
@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef JSON_SCAN_H
+#define JSON_SCAN_H
+
+#include <string.h>
+#include <glib.h>
+
+/*
+ * A pull scanner over a JSON document in memory.
+ *
+ * Unlike json_loadb(), it doesn't build a tree: the caller walks the
+ * document member by member and only copies the values it keeps. Strings
+ * without escapes point into the input; strings with escapes are decoded
+ * into the scratch buffer given to json_scanner_init(). In both cases they
+ * are not NUL-terminated and stay valid until the next call on the scanner.
+ *
+ * It accepts what json_loadb() accepts with no flags, except that the
+ * depth of skipped values is limited.
+ *
+ * The iteration functions return 1 when an item follows, 0 at the end of
+ * the object or array, and -1 on a syntax error.
+ */
+
+typedef struct _JsonScanner {
+    const char *p;
+    const char *end;
+    GString    *buf;
+    gboolean    first;
+} JsonScanner;
+
+void
+json_scanner_init (JsonScanner *sc, const char *data, gsize len, GString *buf);
+
+int
+json_scan_object_begin (JsonScanner *sc);
+
+int
+json_scan_next_member (JsonScanner *sc, const char **key, gsize *key_len);
+
+int
+json_scan_array_begin (JsonScanner *sc);
+
+int
+json_scan_next_element (JsonScanner *sc);
+
+/* The first character of the next value, or 0 at the end of the input. */
+char
+json_scan_peek (JsonScanner *sc);
+
+/* Returns 0 on success, -1 on error, including if the value isn't a string. */
+int
+json_scan_string (JsonScanner *sc, const char **str, gsize *len);
+
+/*
+ * Like json_integer_value(), *val is set to 0 if the value is valid JSON
+ * but not an integer. Returns -1 on error.
+ */
+int
+json_scan_int (JsonScanner *sc, gint64 *val);
+
+int
+json_scan_skip (JsonScanner *sc);
+
+/* Check that only white space is left. */
+int
+json_scan_finish (JsonScanner *sc);
+
+static inline gboolean
+json_scan_key_is (const char *key, gsize key_len, const char *name)
+{
+    return strlen (name) == key_len && memcmp (key, name, key_len) == 0;
+}
+
+#endif
@@ -21,6 +21,164 @@ static int seafile_log_level;
 static char *logfile;
 static FILE *logfp;
 
+/*
+ * Log messages are appended to an in-memory buffer and written to the file
+ * by a background thread, so threads that log a lot (e.g. with debug flags
+ * set) don't block on file I/O. The writer swaps the buffer with an empty
+ * one and writes it without holding the buffer lock.
+ *
+ * When the buffer is full, new messages are dropped and the number of
+ * dropped messages is logged once there is room again. Errors are written
+ * out before returning, since the process aborts after logging them.
+ */
+#define LOG_BUFFER_SIZE (1 << 20)
+#define LOG_FLUSH_INTERVAL 1    /* seconds */
+
+typedef struct AsyncLog {
+    FILE **pfp;
+    GString *buf;
+    GString *spare;
+    gboolean flushing;
+    guint dropped;
+} AsyncLog;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+/* Held while writing to the files, so they can be reopened. */
+static pthread_mutex_t log_fp_lock = PTHREAD_MUTEX_INITIALIZER;
+static gboolean log_writer_started;
+
+static FILE *eventfp;
+static AsyncLog main_log = { &logfp, NULL, NULL, FALSE, 0 };
+static AsyncLog event_log = { &eventfp, NULL, NULL, FALSE, 0 };
+
+/* Called with log_lock held. */
+static gboolean
+log_append (AsyncLog *log, const char *prefix, const char *message)
+{
+    gsize len = strlen(prefix) + strlen(message);
+
+    if (!log->buf) {
+        log->buf = g_string_sized_new (4096);
+        log->spare = g_string_sized_new (4096);
+    }
+
+    if (log->buf->len + len > LOG_BUFFER_SIZE) {
+        ++(log->dropped);
+        return FALSE;
+    }
+
+    if (log->dropped > 0 && log->buf->len == 0) {
+        g_string_append_printf (log->buf, "%s%u log messages were dropped.\n",
+                                prefix, log->dropped);
+        log->dropped = 0;
+    }
+
+    g_string_append (log->buf, prefix);
+    g_string_append (log->buf, message);
+    return TRUE;
+}
+
+/* Called with log_lock held, which is released while writing. */
+static void
+log_flush_locked (AsyncLog *log)
+{
+    GString *buf;
+    FILE *fp;
+
+    /* Only one thread writes out a buffer at a time. */
+    while (log->flushing)
+        pthread_cond_wait (&log_cond, &log_lock);
+
+    if (!log->buf || log->buf->len == 0)
+        return;
+
+    buf = log->buf;
+    log->buf = log->spare;
+    log->flushing = TRUE;
+    pthread_mutex_unlock (&log_lock);
+
+    pthread_mutex_lock (&log_fp_lock);
+    fp = *(log->pfp);
+    if (fp) {
+        fwrite (buf->str, 1, buf->len, fp);
+        fflush (fp);
+    } else if (log == &main_log) {
+        fputs (buf->str, stdout);
+    }
+    pthread_mutex_unlock (&log_fp_lock);
+
+    g_string_truncate (buf, 0);
+
+    pthread_mutex_lock (&log_lock);
+    log->spare = buf;
+    log->flushing = FALSE;
+    pthread_cond_broadcast (&log_cond);
+}
+
+static void
+log_flush_all ()
+{
+    pthread_mutex_lock (&log_lock);
+    log_flush_locked (&main_log);
+    log_flush_locked (&event_log);
+    pthread_mutex_unlock (&log_lock);
+}
+
+static void *
+log_writer_thread (void *unused)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock (&log_lock);
+    while (1) {
+        ts.tv_sec = time(NULL) + LOG_FLUSH_INTERVAL;
+        ts.tv_nsec = 0;
+        pthread_cond_timedwait (&log_cond, &log_lock, &ts);
+
+        log_flush_locked (&main_log);
+        log_flush_locked (&event_log);
+    }
+
+    return NULL;
+}
+
+static void
+start_log_writer ()
+{
+    pthread_t tid;
+
+    if (log_writer_started)
+        return;
+
+    if (pthread_create (&tid, NULL, log_writer_thread, NULL) != 0) {
+        /* Messages are written synchronously then. */
+        return;
+    }
+    pthread_detach (tid);
+    log_writer_started = TRUE;
+
+    atexit (log_flush_all);
+}
+
+static void
+write_log (AsyncLog *log, GLogLevelFlags log_level,
+           const char *prefix, const char *message)
+{
+    gboolean sync;
+
+    sync = !log_writer_started ||
+        (log_level & (G_LOG_LEVEL_ERROR | G_LOG_FLAG_FATAL)) != 0;
+
+    pthread_mutex_lock (&log_lock);
+    log_append (log, prefix, message);
+    if (sync)
+        log_flush_locked (log);
+    else if (log->buf->len > LOG_BUFFER_SIZE / 2)
+        pthread_cond_broadcast (&log_cond);
+    pthread_mutex_unlock (&log_lock);
+}
+
 #ifndef WIN32
 #ifdef SEAFILE_SERVER
 static gboolean enable_syslog;
@@ -64,13 +222,7 @@ seafile_log (const gchar *log_domain, GLogLevelFlags log_level,
     tm = localtime(&t);
     len = strftime (buf, 1024, "[%x %X] ", tm);
     g_return_if_fail (len < 1024);
-    if (logfp != NULL) {    
-        fputs (buf, logfp);
-        fputs (message, logfp);
-        fflush (logfp);
-    } else { // log file not available
-        printf("%s %s", buf, message);
-    }
+    write_log (&main_log, log_level, buf, message);
 
 #ifndef WIN32
 #ifdef SEAFILE_SERVER
@@ -96,13 +248,7 @@ ccnet_log (const gchar *log_domain, GLogLevelFlags log_level,
     tm = localtime(&t);
     len = strftime (buf, 1024, "[%x %X] ", tm);
     g_return_if_fail (len < 1024);
-    if (logfp != NULL) {
-        fputs (buf, logfp);
-        fputs (message, logfp);
-        fflush (logfp);
-    } else { // log file not available
-        printf("%s %s", buf, message);
-    }
+    write_log (&main_log, log_level, buf, message);
 
 #ifndef WIN32
 #ifdef SEAFILE_SERVER
@@ -149,6 +295,8 @@ seafile_log_init (const char *_logfile, const char *ccnet_debug_level_str,
         }
     }
 
+    start_log_writer ();
+
     return 0;
 }
 
@@ -167,8 +315,10 @@ seafile_log_reopen ()
 
     //TODO: check file's health
 
+    pthread_mutex_lock (&log_fp_lock);
     oldfp = logfp;
     logfp = fp;
+    pthread_mutex_unlock (&log_fp_lock);
     if (fclose(oldfp) < 0) {
         seaf_message ("Failed to close file %s\n", logfile);
         return -1;
@@ -246,8 +396,6 @@ seafile_get_log_fp ()
 
 // seafile event log
 #define MAX_EVENT_LOG_SISE  300 * 1024 * 1024
-static FILE *eventfp;
-static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int
 seafile_event_log_init (const char *_logfile)
@@ -289,11 +437,6 @@ seafile_event_message(const char *message)
     tm = localtime(&t);
     len = strftime (buf, 1024, "[%x %X] ", tm);
     g_return_if_fail (len < 1024);
-    pthread_mutex_lock (&event_lock);
-    if (eventfp != NULL) {    
-        fputs (buf, eventfp);
-        fputs (message, eventfp);
-        fflush (eventfp);
-    }
-    pthread_mutex_unlock (&event_lock);
+    if (eventfp != NULL)
+        write_log (&event_log, 0, buf, message);
 }
@@ -3,6 +3,9 @@
 #include "utils.h"
 #include "mq-mgr.h"
 
+/* Drop the oldest messages when no client reads them. */
+#define MAX_QUEUED_MESSAGES 1000
+
 typedef struct SeafMqManagerPriv {
     // chan <-> async_queue
     GHashTable *chans;
@@ -46,7 +49,11 @@ seaf_mq_manager_publish_notification (SeafMqManager *mgr, const char *type, cons
     json_object_set_new (msg, "type", json_string(type));
     json_object_set_new (msg, "content", json_string(content));
 
-    g_async_queue_push (async_queue, msg);
+    g_async_queue_lock (async_queue);
+    while (g_async_queue_length_unlocked (async_queue) >= MAX_QUEUED_MESSAGES)
+        json_decref (g_async_queue_try_pop_unlocked (async_queue));
+    g_async_queue_push_unlocked (async_queue, msg);
+    g_async_queue_unlock (async_queue);
 }
 
 json_t *
@@ -61,3 +68,18 @@ seaf_mq_manager_pop_message (SeafMqManager *mgr)
 
     return g_async_queue_try_pop (async_queue);
 }
+
+json_t *
+seaf_mq_manager_wait_message (SeafMqManager *mgr, int timeout_ms)
+{
+    const char *chan = SEAFILE_NOTIFY_CHAN;
+    GAsyncQueue *async_queue = g_hash_table_lookup (mgr->priv->chans, chan);
+    if (!async_queue) {
+        seaf_warning ("Unkonwn message channel %s.\n", chan);
+        return NULL;
+    }
+
+    if (timeout_ms <= 0)
+        return g_async_queue_try_pop (async_queue);
+    return g_async_queue_timeout_pop (async_queue, (guint64)timeout_ms * 1000);
+}
@@ -21,4 +21,8 @@ seaf_mq_manager_publish_notification (SeafMqManager *mgr, const char *type, cons
 json_t *
 seaf_mq_manager_pop_message (SeafMqManager *mgr);
 
+/* Wait up to @timeout_ms milliseconds for a message. */
+json_t *
+seaf_mq_manager_wait_message (SeafMqManager *mgr, int timeout_ms);
+
 #endif
@@ -2,6 +2,11 @@
 #define _WIN32_WINNT 0x500
 #endif
 
+#if defined __linux__ && !defined _GNU_SOURCE
+/* For syncfs(). */
+#define _GNU_SOURCE
+#endif
+
 #include "common.h"
 #include "utils.h"
 #include "obj-backend.h"
@@ -502,6 +507,51 @@ obj_backend_fs_remove_store (ObjBackend *bend, const char *store_id)
     return 0;
 }
 
+/*
+ * Objects written with need_sync == FALSE are only flushed here. On Linux
+ * a single syncfs() on the object dir writes back all of them, which is
+ * much cheaper than an fsync() on each object and its parent dir.
+ */
+static int
+obj_backend_fs_sync (ObjBackend *bend, const char *repo_id, int version)
+{
+#ifdef __linux__
+    FsPriv *priv = bend->priv;
+    char *obj_dir;
+    int fd;
+    int ret = 0;
+
+    if (version > 0)
+        obj_dir = g_build_filename (priv->obj_dir, repo_id, NULL);
+    else
+        obj_dir = g_strdup (priv->v0_obj_dir);
+
+    fd = open (obj_dir, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            seaf_warning ("[obj backend] Failed to open dir %s: %s.\n",
+                          obj_dir, strerror(errno));
+            ret = -1;
+        }
+        goto out;
+    }
+
+    if (syncfs (fd) < 0) {
+        seaf_warning ("[obj backend] Failed to sync dir %s: %s.\n",
+                      obj_dir, strerror(errno));
+        ret = -1;
+    }
+
+    close (fd);
+
+out:
+    g_free (obj_dir);
+    return ret;
+#else
+    return 0;
+#endif
+}
+
 ObjBackend *
 obj_backend_fs_new (const char *seaf_dir, const char *obj_type)
 {
@@ -537,6 +587,7 @@ obj_backend_fs_new (const char *seaf_dir, const char *obj_type)
     bend->foreach_obj = obj_backend_fs_foreach_obj;
     bend->copy = obj_backend_fs_copy;
     bend->remove_store = obj_backend_fs_remove_store;
+    bend->sync = obj_backend_fs_sync;
 
     return bend;
 
@@ -548,3 +599,14 @@ onerror:
 
     return NULL;
 }
+
+void
+obj_backend_fs_free (ObjBackend *bend)
+{
+    FsPriv *priv = bend->priv;
+
+    g_free (priv->v0_obj_dir);
+    g_free (priv->obj_dir);
+    g_free (priv);
+    g_free (bend);
+}
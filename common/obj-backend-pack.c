@@ -0,0 +1,772 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x500
+#endif
+
+#include "common.h"
+
+#include "utils.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+
+#ifdef WIN32
+#include <windows.h>
+#include <io.h>
+#endif
+
+#include "obj-backend.h"
+#include "pack-store.h"
+
+#define DEBUG_FLAG SEAFILE_DEBUG_OTHER
+#include "log.h"
+
+/*
+ * Packed object store.
+ *
+ * fs and commit objects are small and numerous, so instead of one file
+ * per object the objects of a repo are appended to pack files under
+ * storage/obj-packs/<obj_type>/<repo_id>/:
+ *
+ *   pack-XXXXXXXX.dat   records of [magic, object id, length, data]
+ *   index               append-only log of (object id -> pack, offset, length)
+ *                       entries, removals are logged as tombstones
+ *
+ * Objects written with need_sync == FALSE are only appended. They are
+ * flushed to disk together with the index by the next sync of the store,
+ * so a batch of objects costs one fsync instead of one per object. Every
+ * read checks the record header, a record lost in a crash is reported as
+ * a missing object rather than returned as garbage.
+ *
+ * In memory the index is a sorted array of fixed size entries that is
+ * binary searched, plus a small hash table of the entries added since the
+ * array was last rebuilt. This keeps the index at 32 bytes per object for
+ * libraries with hundreds of thousands of objects. The files are handled
+ * by pack-store.c.
+ *
+ * Version 0 objects and objects that are still stored one file per object
+ * are served by a wrapped filesystem backend.
+ */
+
+#define OBJ_PACK_DIR "obj-packs"
+#define PACK_MAX_SIZE ((guint32)64 << 20)
+
+#define PACK_RECORD_MAGIC 0x4a424f53    /* "SOBJ" */
+
+/* id(20) pack(4) offset(4) len(4) */
+#define PACK_INDEX_ENTRY_SIZE 32
+
+/* Merge new entries into the sorted array once there are this many. */
+#define RECENT_MERGE_THRESHOLD 4096
+
+extern ObjBackend *
+obj_backend_fs_new (const char *seaf_dir, const char *obj_type);
+
+extern void
+obj_backend_fs_free (ObjBackend *bend);
+
+typedef struct ObjEntry {
+    unsigned char id[20];
+    guint32 pack;
+    /* Offset of the object data, right after the record header. */
+    guint32 offset;
+    guint32 len;
+} ObjEntry;
+
+typedef struct ObjPackStore {
+    PackStore base;
+    GArray *sorted;             /* ObjEntry, sorted by id */
+    GHashTable *recent;         /* ObjEntry set, keyed by id */
+} ObjPackStore;
+
+typedef struct {
+    ObjBackend *loose;
+    PackStoreSet *stores;
+} PackPriv;
+
+static guint
+obj_entry_hash (gconstpointer key)
+{
+    const ObjEntry *e = key;
+    guint h;
+
+    /* Object ids are SHA-1 digests, any 4 bytes are well distributed. */
+    memcpy (&h, e->id, sizeof(h));
+    return h;
+}
+
+static gboolean
+obj_entry_equal (gconstpointer a, gconstpointer b)
+{
+    return memcmp (((const ObjEntry *)a)->id,
+                   ((const ObjEntry *)b)->id, 20) == 0;
+}
+
+static int
+compare_entry_id (const void *a, const void *b)
+{
+    return memcmp (((const ObjEntry *)a)->id, ((const ObjEntry *)b)->id, 20);
+}
+
+static gint
+compare_entry_id_data (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    return compare_entry_id (a, b);
+}
+
+static void
+encode_index_entry (unsigned char *p, const ObjEntry *e)
+{
+    guint32 u32;
+
+    memcpy (p, e->id, 20);
+    u32 = GUINT32_TO_LE (e->pack);
+    memcpy (p + 20, &u32, 4);
+    u32 = GUINT32_TO_LE (e->offset);
+    memcpy (p + 24, &u32, 4);
+    u32 = GUINT32_TO_LE (e->len);
+    memcpy (p + 28, &u32, 4);
+}
+
+static void
+decode_index_entry (const unsigned char *p, ObjEntry *e)
+{
+    guint32 u32;
+
+    memcpy (e->id, p, 20);
+    memcpy (&u32, p + 20, 4);
+    e->pack = GUINT32_FROM_LE (u32);
+    memcpy (&u32, p + 24, 4);
+    e->offset = GUINT32_FROM_LE (u32);
+    memcpy (&u32, p + 28, 4);
+    e->len = GUINT32_FROM_LE (u32);
+}
+
+static int
+append_index_entry (ObjPackStore *store, const ObjEntry *e)
+{
+    unsigned char buf[PACK_INDEX_ENTRY_SIZE];
+
+    encode_index_entry (buf, e);
+    return pack_store_append_index (&store->base, buf);
+}
+
+/*
+ * Merge the recent entries into the sorted array. Entries of the same
+ * object are resolved in favour of the one added last, and tombstones
+ * are dropped. Must be called with store->lock held.
+ */
+static void
+rebuild_sorted (ObjPackStore *store)
+{
+    GHashTableIter iter;
+    gpointer key;
+    ObjEntry *v;
+    guint i, n = 0, len;
+
+    g_hash_table_iter_init (&iter, store->recent);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        g_array_append_vals (store->sorted, key, 1);
+    g_hash_table_remove_all (store->recent);
+
+    /* g_qsort_with_data() is stable, later entries stay after earlier
+     * ones for the same id. */
+    v = (ObjEntry *)store->sorted->data;
+    len = store->sorted->len;
+    g_qsort_with_data (v, len, sizeof(ObjEntry), compare_entry_id_data, NULL);
+
+    for (i = 0; i < len; ++i) {
+        if (i + 1 < len && memcmp (v[i].id, v[i + 1].id, 20) == 0)
+            continue;
+        if (v[i].pack == PACK_TOMBSTONE)
+            continue;
+        v[n++] = v[i];
+    }
+    g_array_set_size (store->sorted, n);
+}
+
+static void
+obj_store_init (PackStore *base)
+{
+    ObjPackStore *store = (ObjPackStore *)base;
+
+    store->sorted = g_array_new (FALSE, FALSE, sizeof(ObjEntry));
+    store->recent = g_hash_table_new_full (obj_entry_hash, obj_entry_equal,
+                                           g_free, NULL);
+}
+
+static void
+obj_store_finalize (PackStore *base)
+{
+    ObjPackStore *store = (ObjPackStore *)base;
+
+    g_array_free (store->sorted, TRUE);
+    g_hash_table_destroy (store->recent);
+}
+
+static gboolean
+obj_store_load (PackStore *base, const unsigned char *entries,
+                guint n_entries, GHashTable *sizes)
+{
+    ObjPackStore *store = (ObjPackStore *)base;
+    gpointer value;
+    ObjEntry e;
+    gboolean bad = FALSE;
+    guint i;
+
+    g_array_set_size (store->sorted, 0);
+    for (i = 0; i < n_entries; ++i) {
+        decode_index_entry (entries + i * PACK_INDEX_ENTRY_SIZE, &e);
+
+        /* After a crash the index may reference data that never made it
+         * into the pack. */
+        if (e.pack != PACK_TOMBSTONE &&
+            (!g_hash_table_lookup_extended (sizes, GUINT_TO_POINTER(e.pack),
+                                            NULL, &value) ||
+             e.offset < PACK_RECORD_HEADER_SIZE ||
+             (guint64)e.offset + e.len > GPOINTER_TO_UINT(value))) {
+            bad = TRUE;
+            continue;
+        }
+        g_array_append_vals (store->sorted, &e, 1);
+    }
+
+    rebuild_sorted (store);
+
+    /* Drop tombstones and superseded entries from the log too. */
+    return bad || store->sorted->len < n_entries;
+}
+
+static void
+obj_store_unload (PackStore *base)
+{
+    ObjPackStore *store = (ObjPackStore *)base;
+
+    g_array_set_size (store->sorted, 0);
+    g_hash_table_remove_all (store->recent);
+}
+
+/* Called with no recent entries, see obj_store_load(). */
+static void
+obj_store_write_index (PackStore *base, PackIndexWriter *writer)
+{
+    ObjPackStore *store = (ObjPackStore *)base;
+    ObjEntry *v = (ObjEntry *)store->sorted->data;
+    guint i;
+
+    for (i = 0; i < store->sorted->len; ++i)
+        encode_index_entry (pack_index_writer_add (writer), &v[i]);
+}
+
+static const PackStoreClass obj_store_class = {
+    PACK_RECORD_MAGIC,
+    PACK_MAX_SIZE,
+    PACK_INDEX_ENTRY_SIZE,
+    sizeof(ObjPackStore),
+    obj_store_init,
+    obj_store_finalize,
+    obj_store_load,
+    obj_store_unload,
+    obj_store_write_index,
+};
+
+static ObjPackStore *
+get_store (ObjBackend *bend, const char *repo_id, gboolean create)
+{
+    PackPriv *priv = bend->priv;
+
+    return (ObjPackStore *)pack_store_set_get (priv->stores, repo_id, create);
+}
+
+/* Returns the store locked and loaded, or NULL with no lock held. */
+static ObjPackStore *
+lock_store (ObjBackend *bend, const char *repo_id, gboolean create)
+{
+    PackPriv *priv = bend->priv;
+
+    return (ObjPackStore *)pack_store_set_lock (priv->stores, repo_id, create);
+}
+
+/* Must be called with store->lock held. */
+static ObjEntry *
+lookup_entry (ObjPackStore *store, const unsigned char *id)
+{
+    ObjEntry key, *e;
+
+    memcpy (key.id, id, 20);
+    e = g_hash_table_lookup (store->recent, &key);
+    if (e)
+        return e;
+
+    e = bsearch (&key, store->sorted->data, store->sorted->len,
+                 sizeof(ObjEntry), compare_entry_id);
+    if (e && e->pack == PACK_TOMBSTONE)
+        return NULL;
+    return e;
+}
+
+/* Look up a packed object. The entry is copied to @out, no lock is held
+ * on return. */
+static gboolean
+find_entry (ObjBackend *bend, const char *repo_id, const char *obj_id,
+            ObjPackStore **pstore, ObjEntry *out)
+{
+    ObjPackStore *store;
+    unsigned char id[20];
+    ObjEntry *e;
+
+    store = lock_store (bend, repo_id, FALSE);
+    if (!store)
+        return FALSE;
+
+    hex_to_rawdata (obj_id, id, 20);
+    e = lookup_entry (store, id);
+    if (e)
+        *out = *e;
+    g_mutex_unlock (&store->base.lock);
+
+    if (!e)
+        return FALSE;
+    *pstore = store;
+    return TRUE;
+}
+
+/* Read the object of @e. Needs no lock, packs are never rewritten. */
+static int
+read_entry (ObjPackStore *store, const ObjEntry *e, void **data, int *len)
+{
+    PackRecord rec;
+
+    memcpy (rec.id, e->id, 20);
+    rec.pack = e->pack;
+    rec.len = e->len;
+    rec.offset = e->offset;
+    if (pack_store_read_record (&store->base, &rec, data) < 0)
+        return -1;
+    *len = (int)e->len;
+    return 0;
+}
+
+/* Append an object and log it in the index. Must be called with
+ * store->lock held. */
+static int
+add_object (ObjPackStore *store, const unsigned char *id,
+            const void *data, guint32 len)
+{
+    ObjEntry e;
+    guint64 offset;
+
+    if (pack_store_append (&store->base, id, data, len, &e.pack, &offset) < 0)
+        return -1;
+
+    memcpy (e.id, id, 20);
+    e.offset = (guint32)offset;
+    e.len = len;
+    if (append_index_entry (store, &e) < 0)
+        return -1;
+
+    g_hash_table_add (store->recent, g_memdup (&e, sizeof(e)));
+    if (g_hash_table_size (store->recent) >= RECENT_MERGE_THRESHOLD)
+        rebuild_sorted (store);
+
+    return 0;
+}
+
+/* Must be called with store->lock held. */
+static gboolean
+remove_entry (ObjPackStore *store, const unsigned char *id)
+{
+    ObjEntry key, *e, tombstone;
+
+    memcpy (key.id, id, 20);
+    e = g_hash_table_lookup (store->recent, &key);
+    if (!e) {
+        e = bsearch (&key, store->sorted->data, store->sorted->len,
+                     sizeof(ObjEntry), compare_entry_id);
+        if (!e || e->pack == PACK_TOMBSTONE)
+            return FALSE;
+    }
+
+    tombstone = *e;
+    tombstone.pack = PACK_TOMBSTONE;
+    if (append_index_entry (store, &tombstone) < 0)
+        return FALSE;
+
+    if (g_hash_table_contains (store->recent, &key))
+        g_hash_table_remove (store->recent, &key);
+    else
+        e->pack = PACK_TOMBSTONE;
+    return TRUE;
+}
+
+static int
+obj_backend_pack_read (ObjBackend *bend,
+                       const char *repo_id,
+                       int version,
+                       const char *obj_id,
+                       void **data,
+                       int *len)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+    ObjEntry e;
+
+    if (version > 0 &&
+        find_entry (bend, repo_id, obj_id, &store, &e) &&
+        read_entry (store, &e, data, len) == 0)
+        return 0;
+
+    return priv->loose->read (priv->loose, repo_id, version, obj_id, data, len);
+}
+
+static int
+obj_backend_pack_write (ObjBackend *bend,
+                        const char *repo_id,
+                        int version,
+                        const char *obj_id,
+                        void *data,
+                        int len,
+                        gboolean need_sync)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+    unsigned char id[20];
+    int ret = 0;
+
+    if (version == 0)
+        return priv->loose->write (priv->loose, repo_id, version, obj_id,
+                                   data, len, need_sync);
+
+    store = lock_store (bend, repo_id, TRUE);
+    if (!store)
+        return -1;
+
+    hex_to_rawdata (obj_id, id, 20);
+
+    /* Object ids are content hashes, an existing copy is identical. */
+    if (!lookup_entry (store, id) && add_object (store, id, data, len) < 0) {
+        seaf_warning ("[obj pack] Failed to write obj %s:%s.\n",
+                      repo_id, obj_id);
+        ret = -1;
+    }
+
+    if (ret == 0 && need_sync)
+        ret = pack_store_sync (&store->base);
+
+    g_mutex_unlock (&store->base.lock);
+    return ret;
+}
+
+static gboolean
+obj_backend_pack_exists (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char *obj_id)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+    ObjEntry e;
+
+    if (version > 0 && find_entry (bend, repo_id, obj_id, &store, &e))
+        return TRUE;
+
+    return priv->loose->exists (priv->loose, repo_id, version, obj_id);
+}
+
+static void
+obj_backend_pack_delete (ObjBackend *bend,
+                         const char *repo_id,
+                         int version,
+                         const char *obj_id)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+    unsigned char id[20];
+
+    if (version > 0) {
+        store = lock_store (bend, repo_id, FALSE);
+        if (store) {
+            hex_to_rawdata (obj_id, id, 20);
+            remove_entry (store, id);
+            g_mutex_unlock (&store->base.lock);
+        }
+    }
+
+    priv->loose->delete (priv->loose, repo_id, version, obj_id);
+}
+
+static int
+obj_backend_pack_foreach_obj (ObjBackend *bend,
+                              const char *repo_id,
+                              int version,
+                              SeafObjFunc process,
+                              void *user_data)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *store;
+    GHashTableIter iter;
+    gpointer key;
+    ObjEntry *v;
+    char *ids = NULL;
+    guint n = 0, i;
+
+    store = version > 0 ? lock_store (bend, repo_id, FALSE) : NULL;
+    if (store) {
+        /* Don't call back with the lock held, process may delete objects. */
+        v = (ObjEntry *)store->sorted->data;
+        ids = g_malloc ((store->sorted->len +
+                         g_hash_table_size (store->recent)) * 41 + 1);
+        for (i = 0; i < store->sorted->len; ++i) {
+            if (v[i].pack == PACK_TOMBSTONE)
+                continue;
+            rawdata_to_hex (v[i].id, ids + n * 41, 20);
+            ++n;
+        }
+        g_hash_table_iter_init (&iter, store->recent);
+        while (g_hash_table_iter_next (&iter, &key, NULL)) {
+            rawdata_to_hex (((ObjEntry *)key)->id, ids + n * 41, 20);
+            ++n;
+        }
+        g_mutex_unlock (&store->base.lock);
+
+        for (i = 0; i < n; ++i) {
+            if (!process (repo_id, version, ids + i * 41, user_data)) {
+                g_free (ids);
+                return 0;
+            }
+        }
+        g_free (ids);
+    }
+
+    return priv->loose->foreach_obj (priv->loose, repo_id, version,
+                                     process, user_data);
+}
+
+static int
+obj_backend_pack_copy (ObjBackend *bend,
+                       const char *src_repo_id,
+                       int src_version,
+                       const char *dst_repo_id,
+                       int dst_version,
+                       const char *obj_id)
+{
+    PackPriv *priv = bend->priv;
+    ObjPackStore *src;
+    ObjEntry e;
+    void *data = NULL;
+    int len;
+    int ret;
+
+    if (obj_backend_pack_exists (bend, dst_repo_id, dst_version, obj_id))
+        return 0;
+
+    /* Not packed in the source repo, let the loose backend link it. */
+    if (src_version == 0 || dst_version == 0 ||
+        !find_entry (bend, src_repo_id, obj_id, &src, &e))
+        return priv->loose->copy (priv->loose, src_repo_id, src_version,
+                                  dst_repo_id, dst_version, obj_id);
+
+    if (read_entry (src, &e, &data, &len) < 0)
+        return -1;
+
+    ret = obj_backend_pack_write (bend, dst_repo_id, dst_version, obj_id,
+                                  data, len, FALSE);
+    g_free (data);
+    return ret;
+}
+
+static int
+obj_backend_pack_remove_store (ObjBackend *bend, const char *store_id)
+{
+    PackPriv *priv = bend->priv;
+
+    pack_store_set_remove_store (priv->stores, store_id);
+
+    return priv->loose->remove_store (priv->loose, store_id);
+}
+
+static int
+obj_backend_pack_sync (ObjBackend *bend,
+                       const char *repo_id,
+                       int version)
+{
+    ObjPackStore *store;
+    int ret = 0;
+
+    if (version == 0)
+        return 0;
+
+    store = get_store (bend, repo_id, FALSE);
+    if (!store)
+        return 0;
+
+    g_mutex_lock (&store->base.lock);
+    if (store->base.loaded)
+        ret = pack_store_sync (&store->base);
+    g_mutex_unlock (&store->base.lock);
+
+    return ret;
+}
+
+static char *
+get_pack_dir (const char *seaf_dir, const char *obj_type)
+{
+    return g_build_filename (seaf_dir, "storage", OBJ_PACK_DIR, obj_type, NULL);
+}
+
+gboolean
+obj_backend_pack_in_use (const char *seaf_dir, const char *obj_type)
+{
+    char *dir = get_pack_dir (seaf_dir, obj_type);
+    gboolean ret = g_file_test (dir, G_FILE_TEST_IS_DIR);
+
+    g_free (dir);
+    return ret;
+}
+
+ObjBackend *
+obj_backend_pack_new (const char *seaf_dir, const char *obj_type)
+{
+    ObjBackend *bend;
+    PackPriv *priv;
+    char *pack_dir;
+
+    bend = g_new0 (ObjBackend, 1);
+    priv = g_new0 (PackPriv, 1);
+    bend->priv = priv;
+
+    pack_dir = get_pack_dir (seaf_dir, obj_type);
+    if (checkdir_with_mkdir (pack_dir) < 0) {
+        seaf_warning ("[Obj Backend] Pack dir %s does not exist and"
+                      " is unable to create\n", pack_dir);
+        goto onerror;
+    }
+
+    priv->loose = obj_backend_fs_new (seaf_dir, obj_type);
+    if (!priv->loose)
+        goto onerror;
+
+    priv->stores = pack_store_set_new (pack_dir, &obj_store_class);
+    g_free (pack_dir);
+
+    bend->read = obj_backend_pack_read;
+    bend->write = obj_backend_pack_write;
+    bend->exists = obj_backend_pack_exists;
+    bend->delete = obj_backend_pack_delete;
+    bend->foreach_obj = obj_backend_pack_foreach_obj;
+    bend->copy = obj_backend_pack_copy;
+    bend->remove_store = obj_backend_pack_remove_store;
+    bend->sync = obj_backend_pack_sync;
+
+    return bend;
+
+onerror:
+    g_free (pack_dir);
+    g_free (priv);
+    g_free (bend);
+
+    return NULL;
+}
+
+static void
+obj_backend_pack_free (ObjBackend *bend)
+{
+    PackPriv *priv = bend->priv;
+
+    pack_store_set_free (priv->stores);
+    obj_backend_fs_free (priv->loose);
+    g_free (priv);
+    g_free (bend);
+}
+
+static gboolean
+collect_obj_id (const char *repo_id, int version,
+                const char *obj_id, void *user_data)
+{
+    GPtrArray *ids = user_data;
+
+    /* Skip temp files left over by interrupted writes. */
+    if (is_object_id_valid (obj_id))
+        g_ptr_array_add (ids, g_strdup (obj_id));
+    return TRUE;
+}
+
+static int
+migrate_store (ObjBackend *bend, const char *repo_id)
+{
+    PackPriv *priv = bend->priv;
+    ObjBackend *loose = priv->loose;
+    GPtrArray *ids = g_ptr_array_new_with_free_func (g_free);
+    const char *obj_id;
+    void *data;
+    int len;
+    guint i;
+    int ret = 0;
+
+    loose->foreach_obj (loose, repo_id, 1, collect_obj_id, ids);
+
+    for (i = 0; i < ids->len; ++i) {
+        obj_id = ids->pdata[i];
+        if (loose->read (loose, repo_id, 1, obj_id, &data, &len) < 0) {
+            seaf_warning ("[obj pack] Failed to read obj %s:%s.\n",
+                          repo_id, obj_id);
+            ret = -1;
+            continue;
+        }
+        if (obj_backend_pack_write (bend, repo_id, 1, obj_id,
+                                    data, len, FALSE) < 0)
+            ret = -1;
+        g_free (data);
+    }
+
+    if (ret == 0 && obj_backend_pack_sync (bend, repo_id, 1) < 0)
+        ret = -1;
+
+    /* Only drop the loose objects once every one of them is safely packed. */
+    if (ret == 0) {
+        loose->remove_store (loose, repo_id);
+        seaf_message ("Packed %u objects of repo %s.\n", ids->len, repo_id);
+    } else {
+        seaf_warning ("Failed to pack objects of repo %s, "
+                      "keeping the loose objects.\n", repo_id);
+    }
+
+    g_ptr_array_free (ids, TRUE);
+    return ret;
+}
+
+/*
+ * Move the loose objects of all repos into packs. Must not be run while
+ * another process uses the object store.
+ */
+int
+obj_backend_pack_migrate (const char *seaf_dir, const char *obj_type)
+{
+    ObjBackend *bend;
+    char *loose_dir;
+    GDir *dir;
+    const char *name;
+    int ret = 0;
+
+    bend = obj_backend_pack_new (seaf_dir, obj_type);
+    if (!bend)
+        return -1;
+
+    loose_dir = g_build_filename (seaf_dir, "storage", obj_type, NULL);
+    dir = g_dir_open (loose_dir, 0, NULL);
+    if (dir) {
+        while ((name = g_dir_read_name (dir)) != NULL) {
+            if (!is_uuid_valid (name))
+                continue;
+            if (migrate_store (bend, name) < 0)
+                ret = -1;
+        }
+        g_dir_close (dir);
+    }
+
+    g_free (loose_dir);
+    obj_backend_pack_free (bend);
+    return ret;
+}
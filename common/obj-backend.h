@@ -48,6 +48,11 @@ struct ObjBackend {
     int        (*remove_store) (ObjBackend *bend,
                                 const char *store_id);
 
+    /* Optional. Flush objects written with need_sync == FALSE to disk. */
+    int        (*sync) (ObjBackend *bend,
+                        const char *repo_id,
+                        int version);
+
     void *priv;
 };
 
@@ -8,24 +8,50 @@
 
 #include "obj-backend.h"
 #include "obj-store.h"
+#include "seafile-config.h"
 
 struct SeafObjStore {
     ObjBackend   *bend;
+
+    /* Updated atomically. */
+    gint          n_reads;
+    gint          n_writes;
+    gint          n_read_errors;
+    gint          n_write_errors;
 };
 typedef struct SeafObjStore SeafObjStore;
 
 extern ObjBackend *
 obj_backend_fs_new (const char *seaf_dir, const char *obj_type);
 
+extern ObjBackend *
+obj_backend_pack_new (const char *seaf_dir, const char *obj_type);
+
+extern gboolean
+obj_backend_pack_in_use (const char *seaf_dir, const char *obj_type);
+
+extern int
+obj_backend_pack_migrate (const char *seaf_dir, const char *obj_type);
+
 struct SeafObjStore *
 seaf_obj_store_new (SeafileSession *seaf, const char *obj_type)
 {
     SeafObjStore *store = g_new0 (SeafObjStore, 1);
+    char *backend;
 
     if (!store)
         return NULL;
 
-    store->bend = obj_backend_fs_new (seaf->seaf_dir, obj_type);
+    /* Same as for blocks, packed objects must stay visible even if the
+     * option is turned off again.
+     */
+    backend = seafile_session_config_get_string (seaf, KEY_OBJ_BACKEND);
+    if (g_strcmp0 (backend, "pack") == 0 ||
+        obj_backend_pack_in_use (seaf->seaf_dir, obj_type))
+        store->bend = obj_backend_pack_new (seaf->seaf_dir, obj_type);
+    else
+        store->bend = obj_backend_fs_new (seaf->seaf_dir, obj_type);
+    g_free (backend);
     if (!store->bend) {
         seaf_warning ("[Object store] Failed to load backend.\n");
         g_free (store);
@@ -52,12 +78,15 @@ seaf_obj_store_read_obj (struct SeafObjStore *obj_store,
                          int *len)
 {
     ObjBackend *bend = obj_store->bend;
+    int ret;
 
     if (!repo_id || !is_uuid_valid(repo_id) ||
         !obj_id || !is_object_id_valid(obj_id))
         return -1;
 
-    return bend->read (bend, repo_id, version, obj_id, data, len);
+    ret = bend->read (bend, repo_id, version, obj_id, data, len);
+    g_atomic_int_inc (ret < 0 ? &obj_store->n_read_errors : &obj_store->n_reads);
+    return ret;
 }
 
 int
@@ -70,12 +99,24 @@ seaf_obj_store_write_obj (struct SeafObjStore *obj_store,
                           gboolean need_sync)
 {
     ObjBackend *bend = obj_store->bend;
+    int ret;
 
     if (!repo_id || !is_uuid_valid(repo_id) ||
         !obj_id || !is_object_id_valid(obj_id))
         return -1;
 
-    return bend->write (bend, repo_id, version, obj_id, data, len, need_sync);
+    ret = bend->write (bend, repo_id, version, obj_id, data, len, need_sync);
+    g_atomic_int_inc (ret < 0 ? &obj_store->n_write_errors : &obj_store->n_writes);
+    return ret;
+}
+
+void
+seaf_obj_store_get_stats (struct SeafObjStore *obj_store, SeafObjStoreStats *stats)
+{
+    stats->reads = (guint)g_atomic_int_get (&obj_store->n_reads);
+    stats->writes = (guint)g_atomic_int_get (&obj_store->n_writes);
+    stats->read_errors = (guint)g_atomic_int_get (&obj_store->n_read_errors);
+    stats->write_errors = (guint)g_atomic_int_get (&obj_store->n_write_errors);
 }
 
 gboolean
@@ -144,3 +185,22 @@ seaf_obj_store_remove_store (struct SeafObjStore *obj_store,
 
     return bend->remove_store (bend, store_id);
 }
+
+int
+seaf_obj_store_sync (struct SeafObjStore *obj_store,
+                     const char *repo_id,
+                     int version)
+{
+    ObjBackend *bend = obj_store->bend;
+
+    if (!bend->sync)
+        return 0;
+
+    return bend->sync (bend, repo_id, version);
+}
+
+int
+seaf_obj_store_pack_loose_objects (const char *seaf_dir, const char *obj_type)
+{
+    return obj_backend_pack_migrate (seaf_dir, obj_type);
+}
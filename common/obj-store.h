@@ -47,6 +47,17 @@ seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
                            int version,
                            const char *obj_id);
 
+/* Number of objects read and written since the store was opened. */
+typedef struct SeafObjStoreStats {
+    guint reads;
+    guint writes;
+    guint read_errors;
+    guint write_errors;
+} SeafObjStoreStats;
+
+void
+seaf_obj_store_get_stats (struct SeafObjStore *obj_store, SeafObjStoreStats *stats);
+
 typedef gboolean (*SeafObjFunc) (const char *repo_id,
                                  int version,
                                  const char *obj_id,
@@ -70,4 +81,21 @@ seaf_obj_store_copy_obj (struct SeafObjStore *obj_store,
 int
 seaf_obj_store_remove_store (struct SeafObjStore *obj_store,
                              const char *store_id);
+
+/*
+ * Make the objects written to @repo_id with need_sync == FALSE durable.
+ * Writing a batch of objects without sync and syncing once afterwards
+ * is much cheaper than syncing every object.
+ */
+int
+seaf_obj_store_sync (struct SeafObjStore *obj_store,
+                     const char *repo_id,
+                     int version);
+
+/*
+ * Move the objects of type @obj_type ("fs" or "commits") that are stored
+ * one file per object into pack files. The object store must not be in use.
+ */
+int
+seaf_obj_store_pack_loose_objects (const char *seaf_dir, const char *obj_type);
 #endif
@@ -0,0 +1,836 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "utils.h"
+
+#include "log.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#ifndef WIN32
+#include <unistd.h>
+#else
+#include <windows.h>
+#include <io.h>
+#endif
+
+#include "pack-store.h"
+
+#define INDEX_WRITE_BATCH 1024
+
+struct PackIndexWriter {
+    int fd;
+    int entry_size;
+    unsigned char *buf;
+    int n;
+    gboolean error;
+};
+
+char *
+pack_store_pack_path (PackStore *store, guint32 pack)
+{
+    return g_strdup_printf ("%s/pack-%08x.dat", store->dir, pack);
+}
+
+/* Packs written by a compaction, renamed to pack-XXXXXXXX.dat once all
+ * the live records are copied. */
+static char *
+compact_path (PackStore *store, guint32 n)
+{
+    return g_strdup_printf ("%s/compact-%08x.tmp", store->dir, n);
+}
+
+static gboolean
+parse_pack_name (const char *name, guint32 *pack)
+{
+    char *end;
+    guint64 n;
+
+    if (!g_str_has_prefix (name, "pack-") || !g_str_has_suffix (name, ".dat"))
+        return FALSE;
+    n = g_ascii_strtoull (name + 5, &end, 16);
+    if (end != name + 13 || strcmp (end, ".dat") != 0 || n >= G_MAXUINT32)
+        return FALSE;
+    *pack = (guint32)n;
+    return TRUE;
+}
+
+/* Flush @fd to the disk. File systems that can't sync are not an error. */
+static int
+sync_fd (int fd)
+{
+#ifdef WIN32
+    HANDLE handle = (HANDLE)_get_osfhandle (fd);
+
+    if (handle == INVALID_HANDLE_VALUE || !FlushFileBuffers (handle)) {
+        seaf_warning ("[pack store] FlushFileBuffers() failed: %lu.\n",
+                      GetLastError());
+        return -1;
+    }
+#elif defined __APPLE__
+    /* fsync() doesn't flush the disk cache on OS X. */
+    if (fcntl (fd, F_FULLFSYNC, NULL) < 0) {
+        seaf_warning ("[pack store] Failed to fsync: %s.\n", strerror(errno));
+        return -1;
+    }
+#else
+    if (fsync (fd) < 0 && errno != EINVAL) {
+        seaf_warning ("[pack store] Failed to fsync: %s.\n", strerror(errno));
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* Make the renames and new files in the store dir durable. Windows has no
+ * way to sync a directory, NTFS journals the metadata instead. */
+static int
+sync_store_dir (PackStore *store)
+{
+#ifndef WIN32
+    int fd, ret = 0;
+
+    fd = open (store->dir, O_RDONLY);
+    if (fd < 0) {
+        seaf_warning ("[pack store] Failed to open dir %s: %s.\n",
+                      store->dir, strerror(errno));
+        return -1;
+    }
+    if (fsync (fd) < 0 && errno != EINVAL) {
+        seaf_warning ("[pack store] Failed to fsync dir %s: %s.\n",
+                      store->dir, strerror(errno));
+        ret = -1;
+    }
+    close (fd);
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+static PackStore *
+pack_store_new (const PackStoreClass *klass, char *dir)
+{
+    PackStore *store = g_malloc0 (klass->instance_size);
+
+    store->klass = klass;
+    store->dir = dir;
+    store->cur_fd = -1;
+    store->index_fd = -1;
+    g_mutex_init (&store->lock);
+    klass->init (store);
+
+    return store;
+}
+
+static void
+pack_store_free (gpointer data)
+{
+    PackStore *store = data;
+
+    if (store->cur_fd >= 0)
+        close (store->cur_fd);
+    if (store->index_fd >= 0)
+        close (store->index_fd);
+    store->klass->finalize (store);
+    g_mutex_clear (&store->lock);
+    g_free (store->dir);
+    g_free (store);
+}
+
+PackStoreSet *
+pack_store_set_new (const char *pack_dir, const PackStoreClass *klass)
+{
+    PackStoreSet *set = g_new0 (PackStoreSet, 1);
+
+    set->pack_dir = g_strdup (pack_dir);
+    set->klass = klass;
+    g_mutex_init (&set->lock);
+    set->stores = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, pack_store_free);
+    return set;
+}
+
+void
+pack_store_set_free (PackStoreSet *set)
+{
+    g_hash_table_destroy (set->stores);
+    g_mutex_clear (&set->lock);
+    g_free (set->pack_dir);
+    g_free (set);
+}
+
+PackStore *
+pack_store_set_get (PackStoreSet *set, const char *store_id, gboolean create)
+{
+    PackStore *store;
+    char *dir;
+
+    g_mutex_lock (&set->lock);
+
+    store = g_hash_table_lookup (set->stores, store_id);
+    if (store)
+        goto out;
+
+    dir = g_build_filename (set->pack_dir, store_id, NULL);
+    if (!create && !g_file_test (dir, G_FILE_TEST_IS_DIR)) {
+        g_free (dir);
+        goto out;
+    }
+
+    store = pack_store_new (set->klass, dir);
+    g_hash_table_insert (set->stores, g_strdup(store_id), store);
+
+out:
+    g_mutex_unlock (&set->lock);
+    return store;
+}
+
+PackStore *
+pack_store_set_lock (PackStoreSet *set, const char *store_id, gboolean create)
+{
+    PackStore *store;
+
+    store = pack_store_set_get (set, store_id, create);
+    if (!store)
+        return NULL;
+
+    g_mutex_lock (&store->lock);
+    if (pack_store_ensure_loaded (store) < 0) {
+        g_mutex_unlock (&store->lock);
+        return NULL;
+    }
+    return store;
+}
+
+void
+pack_store_set_remove_store (PackStoreSet *set, const char *store_id)
+{
+    PackStore *store;
+    char *dir;
+    GDir *d;
+    const char *name;
+    char *path;
+
+    store = pack_store_set_get (set, store_id, FALSE);
+    if (store) {
+        g_mutex_lock (&store->lock);
+        pack_store_unload (store);
+    }
+
+    dir = g_build_filename (set->pack_dir, store_id, NULL);
+    d = g_dir_open (dir, 0, NULL);
+    if (d) {
+        while ((name = g_dir_read_name (d)) != NULL) {
+            path = g_build_filename (dir, name, NULL);
+            g_unlink (path);
+            g_free (path);
+        }
+        g_dir_close (d);
+        g_rmdir (dir);
+    }
+    g_free (dir);
+
+    if (store)
+        g_mutex_unlock (&store->lock);
+}
+
+static int
+open_index_log (PackStore *store)
+{
+    char *path = g_build_filename (store->dir, PACK_INDEX_NAME, NULL);
+    int ret = 0;
+
+    store->index_fd = g_open (path, O_WRONLY | O_CREAT | O_BINARY, 0644);
+    if (store->index_fd < 0) {
+        seaf_warning ("[pack store] Failed to open index %s: %s.\n",
+                      path, strerror(errno));
+        ret = -1;
+    } else if (seaf_util_lseek (store->index_fd, 0, SEEK_END) < 0) {
+        seaf_warning ("[pack store] Failed to seek index %s.\n", path);
+        close (store->index_fd);
+        store->index_fd = -1;
+        ret = -1;
+    }
+
+    g_free (path);
+    return ret;
+}
+
+int
+pack_store_append_index (PackStore *store, const unsigned char *entry)
+{
+    int size = store->klass->index_entry_size;
+
+    if (writen (store->index_fd, entry, size) != size) {
+        seaf_warning ("[pack store] Failed to write index %s: %s.\n",
+                      store->dir, strerror(errno));
+        return -1;
+    }
+    store->dirty = TRUE;
+    return 0;
+}
+
+static void
+flush_index_writer (PackIndexWriter *writer)
+{
+    int size = writer->n * writer->entry_size;
+
+    if (!writer->error && size > 0 && writen (writer->fd, writer->buf, size) != size)
+        writer->error = TRUE;
+    writer->n = 0;
+}
+
+unsigned char *
+pack_index_writer_add (PackIndexWriter *writer)
+{
+    if (writer->n == INDEX_WRITE_BATCH)
+        flush_index_writer (writer);
+    return writer->buf + (writer->n++) * writer->entry_size;
+}
+
+int
+pack_store_rewrite_index (PackStore *store)
+{
+    char *path = g_build_filename (store->dir, PACK_INDEX_NAME, NULL);
+    char *tmp_path = g_strconcat (path, ".tmp", NULL);
+    PackIndexWriter writer;
+    int ret = 0;
+
+    memset (&writer, 0, sizeof(writer));
+    writer.entry_size = store->klass->index_entry_size;
+    writer.buf = g_malloc (INDEX_WRITE_BATCH * writer.entry_size);
+
+    writer.fd = g_open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (writer.fd < 0) {
+        seaf_warning ("[pack store] Failed to create %s: %s.\n",
+                      tmp_path, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    store->klass->write_index (store, &writer);
+    flush_index_writer (&writer);
+    /* The new index must be on disk before it replaces the old one. */
+    if (writer.error || sync_fd (writer.fd) < 0)
+        ret = -1;
+    close (writer.fd);
+
+    if (ret < 0) {
+        seaf_warning ("[pack store] Failed to write %s: %s.\n",
+                      tmp_path, strerror(errno));
+        g_unlink (tmp_path);
+        goto out;
+    }
+
+    if (store->index_fd >= 0) {
+        close (store->index_fd);
+        store->index_fd = -1;
+    }
+    if (g_rename (tmp_path, path) < 0) {
+        seaf_warning ("[pack store] Failed to rename %s: %s.\n",
+                      tmp_path, strerror(errno));
+        g_unlink (tmp_path);
+        ret = -1;
+    } else if (sync_store_dir (store) < 0) {
+        ret = -1;
+    }
+    if (open_index_log (store) < 0)
+        ret = -1;
+
+out:
+    g_free (writer.buf);
+    g_free (tmp_path);
+    g_free (path);
+    return ret;
+}
+
+/*
+ * Returns the sizes of the pack files of a store, keyed by pack number.
+ * The newest pack becomes the one to append to.
+ */
+static GHashTable *
+scan_packs (PackStore *store)
+{
+    GHashTable *sizes;
+    GDir *dir;
+    const char *name;
+    guint32 pack;
+    gboolean found = FALSE;
+    SeafStat st;
+    char *path;
+
+    sizes = g_hash_table_new (g_direct_hash, g_direct_equal);
+    store->cur_pack = 0;
+    store->cur_size = 0;
+
+    dir = g_dir_open (store->dir, 0, NULL);
+    if (!dir)
+        return sizes;
+
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (g_str_has_prefix (name, "compact-")) {
+            /* Left over by an interrupted compaction. */
+            path = g_build_filename (store->dir, name, NULL);
+            g_unlink (path);
+            g_free (path);
+            continue;
+        }
+        if (!parse_pack_name (name, &pack))
+            continue;
+        path = pack_store_pack_path (store, pack);
+        if (seaf_stat (path, &st) == 0 && st.st_size <= G_MAXUINT32) {
+            g_hash_table_insert (sizes, GUINT_TO_POINTER(pack),
+                                 GUINT_TO_POINTER((guint32)st.st_size));
+            if (!found || pack > store->cur_pack) {
+                store->cur_pack = pack;
+                store->cur_size = (guint64)st.st_size;
+            }
+            found = TRUE;
+        }
+        g_free (path);
+    }
+    g_dir_close (dir);
+
+    return sizes;
+}
+
+/* Load the index of a store into memory and open it for appending. */
+static int
+load_store (PackStore *store)
+{
+    char *path = g_build_filename (store->dir, PACK_INDEX_NAME, NULL);
+    int entry_size = store->klass->index_entry_size;
+    char *content = NULL;
+    gsize len = 0;
+    GError *error = NULL;
+    GHashTable *sizes = NULL;
+    gboolean rewrite;
+    int ret = 0;
+
+    if (checkdir_with_mkdir (store->dir) < 0) {
+        seaf_warning ("[pack store] Failed to create %s.\n", store->dir);
+        ret = -1;
+        goto out;
+    }
+
+    if (g_file_test (path, G_FILE_TEST_EXISTS) &&
+        !g_file_get_contents (path, &content, &len, &error)) {
+        seaf_warning ("[pack store] Failed to read index %s: %s.\n",
+                      path, error->message);
+        g_clear_error (&error);
+        ret = -1;
+        goto out;
+    }
+
+    sizes = scan_packs (store);
+
+    rewrite = store->klass->load (store, (unsigned char *)content,
+                                  (guint)(len / entry_size), sizes);
+
+    /* A crash may leave a partial entry at the end. Rewrite the index so
+     * that new entries are not appended after garbage. */
+    if (rewrite || len % entry_size != 0)
+        ret = pack_store_rewrite_index (store);
+    else
+        ret = open_index_log (store);
+
+out:
+    if (sizes)
+        g_hash_table_destroy (sizes);
+    g_free (content);
+    g_free (path);
+    return ret;
+}
+
+void
+pack_store_unload (PackStore *store)
+{
+    if (store->cur_fd >= 0) {
+        close (store->cur_fd);
+        store->cur_fd = -1;
+    }
+    if (store->index_fd >= 0) {
+        close (store->index_fd);
+        store->index_fd = -1;
+    }
+    store->klass->unload (store);
+    store->cur_pack = 0;
+    store->cur_size = 0;
+    store->dirty = FALSE;
+    store->dir_dirty = FALSE;
+    store->loaded = FALSE;
+    ++store->generation;
+}
+
+int
+pack_store_ensure_loaded (PackStore *store)
+{
+    if (store->loaded)
+        return 0;
+    if (load_store (store) < 0) {
+        pack_store_unload (store);
+        return -1;
+    }
+    store->loaded = TRUE;
+    return 0;
+}
+
+int
+pack_store_sync (PackStore *store)
+{
+    if (store->dirty) {
+        if (store->cur_fd >= 0 && sync_fd (store->cur_fd) < 0)
+            return -1;
+        if (store->index_fd >= 0 && sync_fd (store->index_fd) < 0)
+            return -1;
+        store->dirty = FALSE;
+    }
+    if (store->dir_dirty) {
+        if (sync_store_dir (store) < 0)
+            return -1;
+        store->dir_dirty = FALSE;
+    }
+    return 0;
+}
+
+static void
+close_current_pack (PackStore *store)
+{
+    if (store->cur_fd >= 0) {
+        close (store->cur_fd);
+        store->cur_fd = -1;
+    }
+}
+
+void
+pack_store_next_pack (PackStore *store)
+{
+    close_current_pack (store);
+    ++store->cur_pack;
+    store->cur_size = 0;
+}
+
+static int
+open_current_pack (PackStore *store, guint32 record_len)
+{
+    char *path;
+
+    if (store->cur_size > 0 &&
+        store->cur_size + record_len > store->klass->max_pack_size) {
+        /* The next sync only flushes the new pack. */
+        if (store->cur_fd >= 0 && store->dirty && sync_fd (store->cur_fd) < 0)
+            return -1;
+        pack_store_next_pack (store);
+    }
+
+    if (store->cur_fd >= 0)
+        return 0;
+
+    path = pack_store_pack_path (store, store->cur_pack);
+    store->cur_fd = g_open (path, O_WRONLY | O_CREAT | O_BINARY, 0644);
+    if (store->cur_fd < 0) {
+        seaf_warning ("[pack store] Failed to open %s: %s.\n",
+                      path, strerror(errno));
+        g_free (path);
+        return -1;
+    }
+    if (store->cur_size == 0)
+        store->dir_dirty = TRUE;
+    g_free (path);
+    return 0;
+}
+
+/* Write a record at @offset of @fd. */
+static int
+write_record (int fd, guint64 offset, guint32 magic, const unsigned char *id,
+              const void *data, guint32 len)
+{
+    unsigned char header[PACK_RECORD_HEADER_SIZE];
+    guint32 u32;
+
+    u32 = GUINT32_TO_LE (magic);
+    memcpy (header, &u32, 4);
+    memcpy (header + 4, id, 20);
+    u32 = GUINT32_TO_LE (len);
+    memcpy (header + 24, &u32, 4);
+
+    if (seaf_util_lseek (fd, offset, SEEK_SET) < 0 ||
+        writen (fd, header, sizeof(header)) != sizeof(header) ||
+        writen (fd, data, len) != len)
+        return -1;
+    return 0;
+}
+
+int
+pack_store_append (PackStore *store, const unsigned char *id,
+                   const void *data, guint32 len,
+                   guint32 *pack, guint64 *offset)
+{
+    if ((guint64)len + PACK_RECORD_HEADER_SIZE > store->klass->max_pack_size) {
+        seaf_warning ("[pack store] Record of %u bytes is too large.\n", len);
+        return -1;
+    }
+
+    if (open_current_pack (store, len + PACK_RECORD_HEADER_SIZE) < 0)
+        return -1;
+
+    /* Always write at the recorded end, so that a failed append is
+     * overwritten by the next one. */
+    if (write_record (store->cur_fd, store->cur_size, store->klass->record_magic,
+                      id, data, len) < 0) {
+        seaf_warning ("[pack store] Failed to append to pack %u of %s: %s.\n",
+                      store->cur_pack, store->dir, strerror(errno));
+        return -1;
+    }
+    store->dirty = TRUE;
+
+    *pack = store->cur_pack;
+    *offset = store->cur_size + PACK_RECORD_HEADER_SIZE;
+    store->cur_size += len + PACK_RECORD_HEADER_SIZE;
+    return 0;
+}
+
+int
+pack_store_open_record (PackStore *store, guint32 pack, guint64 offset)
+{
+    char *path = pack_store_pack_path (store, pack);
+    int fd;
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        seaf_warning ("[pack store] Failed to open %s: %s.\n",
+                      path, strerror(errno));
+        g_free (path);
+        return -1;
+    }
+    if (seaf_util_lseek (fd, offset, SEEK_SET) < 0) {
+        seaf_warning ("[pack store] Failed to seek in %s.\n", path);
+        close (fd);
+        fd = -1;
+    }
+    g_free (path);
+    return fd;
+}
+
+int
+pack_store_read_record (PackStore *store, const PackRecord *rec, void **data)
+{
+    unsigned char header[PACK_RECORD_HEADER_SIZE];
+    char *buf = NULL;
+    guint32 u32;
+    int fd;
+    int ret = 0;
+
+    if (rec->offset < PACK_RECORD_HEADER_SIZE)
+        return -1;
+
+    fd = pack_store_open_record (store, rec->pack,
+                                 rec->offset - PACK_RECORD_HEADER_SIZE);
+    if (fd < 0)
+        return -1;
+
+    if (readn (fd, header, sizeof(header)) != sizeof(header)) {
+        ret = -1;
+        goto out;
+    }
+
+    memcpy (&u32, header, 4);
+    if (GUINT32_FROM_LE (u32) != store->klass->record_magic ||
+        memcmp (header + 4, rec->id, 20) != 0) {
+        ret = -1;
+        goto out;
+    }
+    memcpy (&u32, header + 24, 4);
+    if (GUINT32_FROM_LE (u32) != rec->len) {
+        ret = -1;
+        goto out;
+    }
+
+    buf = g_malloc (rec->len ? rec->len : 1);
+    if (readn (fd, buf, rec->len) != rec->len) {
+        ret = -1;
+        goto out;
+    }
+
+    *data = buf;
+    buf = NULL;
+
+out:
+    if (ret < 0)
+        seaf_warning ("[pack store] Bad record at %" G_GUINT64_FORMAT
+                      " in pack %u of %s.\n", rec->offset, rec->pack, store->dir);
+    close (fd);
+    g_free (buf);
+    return ret;
+}
+
+int
+pack_store_copy_records (PackStore *store, const PackRecord *recs, guint n_recs,
+                         PackRecord *moved, guint32 *n_packs,
+                         guint64 *last_size, guint64 *copied)
+{
+    const PackRecord *rec;
+    guint32 src_pack = PACK_TOMBSTONE, n = 0;
+    guint64 size = 0;
+    int src_fd = -1, dst_fd = -1;
+    char *buf = NULL, *path;
+    guint32 buf_size = 0, rec_len;
+    guint i;
+    int ret = 0;
+
+    *copied = 0;
+
+    for (i = 0; i < n_recs; ++i) {
+        rec = &recs[i];
+        rec_len = rec->len + PACK_RECORD_HEADER_SIZE;
+
+        if (rec->pack != src_pack) {
+            if (src_fd >= 0)
+                close (src_fd);
+            src_pack = rec->pack;
+            src_fd = pack_store_open_record (store, rec->pack, rec->offset);
+        } else if (src_fd >= 0 &&
+                   seaf_util_lseek (src_fd, rec->offset, SEEK_SET) < 0) {
+            close (src_fd);
+            src_fd = -1;
+        }
+        if (src_fd < 0) {
+            ret = -1;
+            break;
+        }
+
+        if (rec->len > buf_size) {
+            buf_size = rec->len;
+            g_free (buf);
+            buf = g_malloc (buf_size);
+        }
+        if (readn (src_fd, buf, rec->len) != rec->len) {
+            seaf_warning ("[pack store] Failed to read record from pack %u of %s.\n",
+                          rec->pack, store->dir);
+            ret = -1;
+            break;
+        }
+
+        if (dst_fd >= 0 && size + rec_len > store->klass->max_pack_size) {
+            ret = sync_fd (dst_fd);
+            close (dst_fd);
+            dst_fd = -1;
+            if (ret < 0)
+                break;
+            ++n;
+            size = 0;
+        }
+        if (dst_fd < 0) {
+            path = compact_path (store, n);
+            dst_fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+            if (dst_fd < 0) {
+                seaf_warning ("[pack store] Failed to create %s: %s.\n",
+                              path, strerror(errno));
+                g_free (path);
+                ret = -1;
+                break;
+            }
+            g_free (path);
+        }
+
+        if (write_record (dst_fd, size, store->klass->record_magic,
+                          rec->id, buf, rec->len) < 0) {
+            seaf_warning ("[pack store] Failed to write compaction pack %u of %s: %s.\n",
+                          n, store->dir, strerror(errno));
+            ret = -1;
+            break;
+        }
+        moved[i] = *rec;
+        moved[i].pack = n;
+        moved[i].offset = size + PACK_RECORD_HEADER_SIZE;
+        size += rec_len;
+        *copied += rec_len;
+    }
+
+    if (src_fd >= 0)
+        close (src_fd);
+    if (dst_fd >= 0) {
+        if (ret == 0 && sync_fd (dst_fd) < 0)
+            ret = -1;
+        close (dst_fd);
+    }
+    g_free (buf);
+
+    *n_packs = (n_recs > 0) ? n + 1 : 0;
+    *last_size = size;
+    return ret;
+}
+
+int
+pack_store_install_compacted (PackStore *store, guint32 n_packs,
+                              guint64 last_size, guint32 *base)
+{
+    char *src, *dst;
+    guint32 i;
+    int ret = 0;
+
+    *base = store->cur_pack + 1;
+    for (i = 0; i < n_packs; ++i) {
+        src = compact_path (store, i);
+        dst = pack_store_pack_path (store, *base + i);
+        if (g_rename (src, dst) < 0) {
+            seaf_warning ("[pack store] Failed to rename %s: %s.\n",
+                          src, strerror(errno));
+            ret = -1;
+        }
+        g_free (src);
+        g_free (dst);
+        if (ret < 0)
+            return -1;
+    }
+    if (sync_store_dir (store) < 0)
+        return -1;
+
+    if (n_packs > 0) {
+        close_current_pack (store);
+        store->cur_pack = *base + n_packs - 1;
+        store->cur_size = last_size;
+    }
+    return 0;
+}
+
+void
+pack_store_discard_compacted (PackStore *store, guint32 n_packs)
+{
+    char *path;
+    guint32 i;
+
+    /* The pack being written when the copy failed is one past the last
+     * finished one. */
+    for (i = 0; i <= n_packs; ++i) {
+        path = compact_path (store, i);
+        g_unlink (path);
+        g_free (path);
+    }
+}
+
+void
+pack_store_remove_packs (PackStore *store, guint32 max_pack)
+{
+    GDir *dir;
+    const char *name;
+    guint32 pack;
+    char *path;
+
+    dir = g_dir_open (store->dir, 0, NULL);
+    if (!dir)
+        return;
+    while ((name = g_dir_read_name (dir)) != NULL) {
+        if (!parse_pack_name (name, &pack) || pack > max_pack)
+            continue;
+        /* Unlinking fails on Windows for packs still opened by readers,
+         * those are removed when the store is loaded again. */
+        path = pack_store_pack_path (store, pack);
+        g_unlink (path);
+        g_free (path);
+    }
+    g_dir_close (dir);
+}
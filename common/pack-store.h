@@ -0,0 +1,201 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_PACK_STORE_H
+#define SEAF_PACK_STORE_H
+
+#include <glib.h>
+
+/*
+ * Pack files shared by the packed block and object backends.
+ *
+ * A store is a directory holding:
+ *
+ *   pack-XXXXXXXX.dat   records of [magic, id, length, data]
+ *   index               append-only log of fixed size entries that map ids
+ *                       to records, removals are logged as tombstones
+ *
+ * This module owns the files: appending and reading records, the index
+ * log, syncing, loading a store after a crash and copying records during
+ * a compaction. The backends own the format of the index entries and the
+ * in-memory index, through a PackStoreClass.
+ */
+
+#define PACK_INDEX_NAME "index"
+#define PACK_TOMBSTONE G_MAXUINT32
+
+/* magic(4) id(20) len(4) */
+#define PACK_RECORD_HEADER_SIZE 28
+
+typedef struct PackStore PackStore;
+typedef struct PackIndexWriter PackIndexWriter;
+
+/* Location of a record. @offset is that of the data, right after the
+ * record header. */
+typedef struct PackRecord {
+    unsigned char id[20];
+    guint32 pack;
+    guint32 len;
+    guint64 offset;
+} PackRecord;
+
+typedef struct PackStoreClass {
+    guint32 record_magic;
+    guint64 max_pack_size;
+    int index_entry_size;
+    /* Size of the backend's store struct, which starts with a PackStore. */
+    gsize instance_size;
+
+    void (*init) (PackStore *store);
+    void (*finalize) (PackStore *store);
+
+    /*
+     * Build the in-memory index from the @n_entries entries of the index
+     * log. @sizes maps the numbers of the packs on disk to their sizes.
+     * Returns TRUE if the index log has to be rewritten.
+     */
+    gboolean (*load) (PackStore *store, const unsigned char *entries,
+                      guint n_entries, GHashTable *sizes);
+
+    /* Drop the in-memory index. */
+    void (*unload) (PackStore *store);
+
+    /* Add the live entries with pack_index_writer_add(), for
+     * pack_store_rewrite_index(). */
+    void (*write_index) (PackStore *store, PackIndexWriter *writer);
+} PackStoreClass;
+
+struct PackStore {
+    const PackStoreClass *klass;
+    char *dir;
+    GMutex lock;
+    guint32 cur_pack;
+    guint64 cur_size;
+    int cur_fd;
+    int index_fd;
+    /* Data has been appended since the last sync. */
+    gboolean dirty;
+    /* Files have been created since the last sync. */
+    gboolean dir_dirty;
+    gboolean loaded;
+    /* Bumped when the state is dropped, so that work started on the store
+     * before can tell. */
+    guint generation;
+};
+
+/* The stores under one directory, keyed by store id. */
+typedef struct PackStoreSet {
+    char *pack_dir;
+    const PackStoreClass *klass;
+    GMutex lock;
+    GHashTable *stores;
+} PackStoreSet;
+
+PackStoreSet *
+pack_store_set_new (const char *pack_dir, const PackStoreClass *klass);
+
+void
+pack_store_set_free (PackStoreSet *set);
+
+/*
+ * Returns the state of a store. Stores without a directory are only
+ * created when @create is TRUE, so that reading from libraries that have
+ * nothing packed doesn't leave empty directories behind.
+ */
+PackStore *
+pack_store_set_get (PackStoreSet *set, const char *store_id, gboolean create);
+
+/* Returns the store locked and loaded, or NULL with no lock held. */
+PackStore *
+pack_store_set_lock (PackStoreSet *set, const char *store_id, gboolean create);
+
+/*
+ * Remove the files of a store. The state stays in the set, since other
+ * threads may still hold it. It's reloaded if the store is used again.
+ */
+void
+pack_store_set_remove_store (PackStoreSet *set, const char *store_id);
+
+/* The functions below must be called with store->lock held, unless noted
+ * otherwise. */
+
+int
+pack_store_ensure_loaded (PackStore *store);
+
+/* Forget the in-memory state. The store is reloaded from disk by the next
+ * operation on it. */
+void
+pack_store_unload (PackStore *store);
+
+char *
+pack_store_pack_path (PackStore *store, guint32 pack);
+
+/* Append a record to the current pack. The location of the data is
+ * returned in @pack and @offset. */
+int
+pack_store_append (PackStore *store, const unsigned char *id,
+                   const void *data, guint32 len,
+                   guint32 *pack, guint64 *offset);
+
+/* Send the following appends to a new pack. */
+void
+pack_store_next_pack (PackStore *store);
+
+/* Append an encoded entry to the index log. */
+int
+pack_store_append_index (PackStore *store, const unsigned char *entry);
+
+/* Replace the index log with the entries added by klass->write_index(). */
+int
+pack_store_rewrite_index (PackStore *store);
+
+unsigned char *
+pack_index_writer_add (PackIndexWriter *writer);
+
+/* Flush appended records and the index to disk. */
+int
+pack_store_sync (PackStore *store);
+
+/*
+ * Returns an fd positioned at the data of a record. Needs no lock, but the
+ * caller must make sure that the pack is not removed meanwhile.
+ */
+int
+pack_store_open_record (PackStore *store, guint32 pack, guint64 offset);
+
+/*
+ * Read the data of @rec, checking the record header, so that a record
+ * lost in a crash is reported as missing rather than returned as garbage.
+ * Needs no lock, as pack_store_open_record().
+ */
+int
+pack_store_read_record (PackStore *store, const PackRecord *rec, void **data);
+
+/*
+ * Compaction. pack_store_copy_records() copies the records in @recs,
+ * sorted by position, into temporary packs and syncs them. It runs
+ * without the lock, so only one compaction of a store may run at a time.
+ * The new location of @recs[i] is returned in @moved[i], with the pack
+ * numbered from 0.
+ *
+ * pack_store_install_compacted() then renames the temporary packs to the
+ * packs numbered from the returned @base, and appends go on in the last
+ * of them. Otherwise they are removed by pack_store_discard_compacted(),
+ * without the lock.
+ */
+int
+pack_store_copy_records (PackStore *store, const PackRecord *recs, guint n,
+                         PackRecord *moved, guint32 *n_packs,
+                         guint64 *last_size, guint64 *copied);
+
+int
+pack_store_install_compacted (PackStore *store, guint32 n_packs,
+                              guint64 last_size, guint32 *base);
+
+void
+pack_store_discard_compacted (PackStore *store, guint32 n_packs);
+
+/* Remove the packs numbered up to @max_pack. */
+void
+pack_store_remove_packs (PackStore *store, guint32 max_pack);
+
+#endif
@@ -23,6 +23,10 @@
 #include "log.h"
 
 #include "../daemon/vc-utils.h"
+#include "../daemon/startup-profile.h"
+#include "../daemon/latency-stats.h"
+#include "../daemon/metrics.h"
+#include "../daemon/repo-verify.h"
 
 
 /* -------- Utilities -------- */
@@ -424,6 +428,14 @@ seafile_set_repo_property (const char *repo_id,
         return -1;
     }
 
+    if (strcmp (key, REPO_PROP_ON_DEMAND) == 0 &&
+        g_strcmp0 (value, "true") == 0 &&
+        !seaf_repo_manager_has_hydration_provider (seaf->repo_mgr)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "No hydration provider is registered");
+        return -1;
+    }
+
     ret = seaf_repo_manager_set_repo_property (seaf->repo_mgr,
                                                repo->id, key, value);
     if (ret < 0) {
@@ -543,6 +555,83 @@ seafile_get_path_sync_status (const char *repo_id,
     return status;
 }
 
+json_t *
+seafile_get_paths_sync_status (const char *repo_id,
+                               const char *dir,
+                               const char *names,
+                               int seq,
+                               GError **error)
+{
+    json_t *array, *name, *statuses, *ret;
+    json_error_t jerror;
+    const char *dname;
+    char *canon_dir, *path, *status;
+    size_t i, len;
+    gboolean is_dir;
+    int cur_seq;
+
+    if (!repo_id || !dir || !names) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return NULL;
+    }
+
+    array = json_loadb (names, strlen(names), 0, &jerror);
+    if (!array || !json_is_array (array)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid names");
+        json_decref (array);
+        return NULL;
+    }
+
+    /* Read the sequence number first, so that a change made while the
+     * statuses are collected makes the next query collect them again.
+     */
+    cur_seq = seaf_sync_manager_get_status_seq (seaf->sync_mgr);
+
+    ret = json_object ();
+    json_object_set_new (ret, "seq", json_integer (cur_seq));
+    if (seq == cur_seq) {
+        json_decref (array);
+        return ret;
+    }
+
+    if (*dir == '/')
+        ++dir;
+    canon_dir = g_strdup (dir);
+    len = strlen (canon_dir);
+    if (len > 0 && canon_dir[len-1] == '/')
+        canon_dir[len-1] = 0;
+
+    statuses = json_object ();
+    for (i = 0; i < json_array_size (array); i++) {
+        name = json_array_get (array, i);
+        dname = json_string_value (name);
+        if (!dname || *dname == 0)
+            continue;
+
+        /* Names of directories end with '/'. */
+        len = strlen (dname);
+        is_dir = (dname[len-1] == '/');
+        if (canon_dir[0] != 0)
+            path = g_strconcat (canon_dir, "/", dname, NULL);
+        else
+            path = g_strdup (dname);
+        if (is_dir)
+            path[strlen(path)-1] = 0;
+
+        status = seaf_sync_manager_get_path_sync_status (seaf->sync_mgr,
+                                                         repo_id, path, is_dir);
+        if (status)
+            json_object_set_new (statuses, dname, json_string (status));
+        g_free (status);
+        g_free (path);
+    }
+    json_object_set_new (ret, "statuses", statuses);
+
+    g_free (canon_dir);
+    json_decref (array);
+    return ret;
+}
+
 int
 seafile_mark_file_locked (const char *repo_id, const char *path, GError **error)
 {
@@ -607,12 +696,206 @@ seafile_mark_file_unlocked (const char *repo_id, const char *path, GError **erro
     return ret;
 }
 
+int
+seafile_hydrate_file (const char *repo_id, const char *path, GError **error)
+{
+    if (!repo_id || !path) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return -1;
+    }
+
+    if (*path == '/')
+        ++path;
+
+    if (path[0] == 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid path");
+        return -1;
+    }
+
+    return seaf_repo_manager_hydrate_file (seaf->repo_mgr, repo_id, path, error);
+}
+
+int
+seafile_register_hydration_provider (const char *name, GError **error)
+{
+    if (!name || name[0] == 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return -1;
+    }
+
+    if (seaf_repo_manager_register_hydration_provider (seaf->repo_mgr, name) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Another hydration provider is registered");
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+seafile_unregister_hydration_provider (const char *name, GError **error)
+{
+    if (!name) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return -1;
+    }
+
+    seaf_repo_manager_unregister_hydration_provider (seaf->repo_mgr, name);
+    return 0;
+}
+
+int
+seafile_verify_repo (const char *repo_id, int repair, GError **error)
+{
+    if (!repo_id || !is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return -1;
+    }
+
+    return seaf_repo_verify_start (repo_id, (repair != 0), error);
+}
+
+json_t *
+seafile_get_repo_verify_status (const char *repo_id, GError **error)
+{
+    if (!repo_id || !is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return NULL;
+    }
+
+    return seaf_repo_verify_get_status (repo_id);
+}
+
+static gboolean
+commit_parents_missing (SeafRepo *repo, SeafCommit *commit)
+{
+    return ((commit->parent_id &&
+             !seaf_commit_manager_commit_exists (seaf->commit_mgr, repo->id,
+                                                 repo->version,
+                                                 commit->parent_id)) ||
+            (commit->second_parent_id &&
+             !seaf_commit_manager_commit_exists (seaf->commit_mgr, repo->id,
+                                                 repo->version,
+                                                 commit->second_parent_id)));
+}
+
+json_t *
+seafile_get_commit_history (const char *repo_id, int offset, int limit,
+                            GError **error)
+{
+    SeafRepo *repo;
+    GList *commits, *ptr;
+    SeafCommit *commit;
+    json_t *array, *object;
+    gboolean truncated = FALSE;
+
+    if (!repo_id || !is_uuid_valid (repo_id)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid repo id");
+        return NULL;
+    }
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "No such repository");
+        return NULL;
+    }
+
+    commits = seaf_repo_get_commits_page (repo, offset, limit, &truncated, error);
+    if (!commits && error && *error)
+        return NULL;
+
+    array = json_array ();
+    for (ptr = commits; ptr; ptr = ptr->next) {
+        commit = ptr->data;
+        object = json_object ();
+        json_object_set_new (object, "commit_id", json_string (commit->commit_id));
+        json_object_set_new (object, "root_id", json_string (commit->root_id));
+        json_object_set_new (object, "creator_name",
+                             json_string (commit->creator_name ? commit->creator_name : ""));
+        json_object_set_new (object, "desc", json_string (commit->desc));
+        json_object_set_new (object, "ctime", json_integer (commit->ctime));
+        if (commit->parent_id)
+            json_object_set_new (object, "parent_id", json_string (commit->parent_id));
+        if (commit->second_parent_id)
+            json_object_set_new (object, "second_parent_id",
+                                 json_string (commit->second_parent_id));
+        /* The history below this commit is not available locally. */
+        if (truncated && commit_parents_missing (repo, commit))
+            json_object_set_new (object, "truncated", json_true ());
+        json_array_append_new (array, object);
+    }
+    g_list_free_full (commits, (GDestroyNotify)seaf_commit_unref);
+
+    return array;
+}
+
 json_t *
 seafile_get_sync_notification (GError **error)
 {
     return seaf_mq_manager_pop_message (seaf->mq_mgr);
 }
 
+#define MAX_NOTIFICATION_WAIT 60000 /* 60s */
+
+json_t *
+seafile_wait_sync_notification (int timeout, GError **error)
+{
+    return seaf_mq_manager_wait_message (seaf->mq_mgr,
+                                         MIN (timeout, MAX_NOTIFICATION_WAIT));
+}
+
+json_t *
+seafile_get_change_seqs (GError **error)
+{
+    json_t *object;
+
+    object = json_object ();
+    json_object_set_new (object, "repo_list",
+                         json_integer (seaf_repo_manager_get_repo_list_seq (seaf->repo_mgr)));
+    json_object_set_new (object, "file_sync_errors",
+                         json_integer (seaf_repo_manager_get_sync_errors_seq (seaf->repo_mgr)));
+    json_object_set_new (object, "path_status",
+                         json_integer (seaf_sync_manager_get_status_seq (seaf->sync_mgr)));
+
+    return object;
+}
+
+json_t *
+seafile_get_fs_cache_stats (GError **error)
+{
+    SeafFSCacheStats stats;
+    json_t *object;
+
+    seaf_fs_manager_get_cache_stats (seaf->fs_mgr, &stats);
+
+    object = json_object ();
+    json_object_set_new (object, "hits", json_integer (stats.hits));
+    json_object_set_new (object, "misses", json_integer (stats.misses));
+    json_object_set_new (object, "n_objects", json_integer (stats.n_objects));
+    json_object_set_new (object, "size", json_integer (stats.size));
+    json_object_set_new (object, "max_size", json_integer (stats.max_size));
+
+    return object;
+}
+
+json_t *
+seafile_get_startup_profile (GError **error)
+{
+    return startup_profile_to_json ();
+}
+
+json_t *
+seafile_get_sync_latency_stats (GError **error)
+{
+    return latency_stats_to_json ();
+}
+
+char *
+seafile_get_metrics (GError **error)
+{
+    return seaf_metrics_format ();
+}
+
 char *
 seafile_get_server_property (const char *server_url, const char *key, GError **error)
 {
@@ -669,6 +952,126 @@ seafile_get_repo_list (int start, int limit, GError **error)
     return ret;
 }
 
+/*
+ * Serialized snapshot of the repo list, rebuilt only when the repo list
+ * sequence number changes. Repo list queries from the GUI then just copy
+ * a string instead of creating a SeafileRepo object per repo.
+ */
+static pthread_mutex_t repo_list_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *repo_list_cache;
+static int repo_list_cache_seq;
+static gboolean repo_list_cache_allow_invalid;
+
+static void
+set_string_member (json_t *object, const char *key, const char *value)
+{
+    if (value)
+        json_object_set_new (object, key, json_string (value));
+}
+
+/* Same fields and conditions as convert_repo(). */
+static json_t *
+repo_to_json (SeafRepo *r, gboolean allow_invalid)
+{
+    json_t *object;
+
+    if (r->head == NULL)
+        return NULL;
+
+    if (r->worktree_invalid && !allow_invalid)
+        return NULL;
+
+    object = json_object ();
+    set_string_member (object, "id", r->id);
+    set_string_member (object, "name", r->name);
+    set_string_member (object, "desc", r->desc);
+    json_object_set_new (object, "encrypted", json_boolean (r->encrypted));
+    set_string_member (object, "magic", r->magic);
+    json_object_set_new (object, "enc_version", json_integer (r->enc_version));
+    set_string_member (object, "head_cmmt_id", r->head->commit_id);
+    set_string_member (object, "root", r->root_id);
+    json_object_set_new (object, "version", json_integer (r->version));
+    json_object_set_new (object, "last_modify", json_integer (r->last_modify));
+    set_string_member (object, "worktree", r->worktree);
+    set_string_member (object, "relay_id", r->relay_id);
+    json_object_set_new (object, "worktree_invalid",
+                         json_boolean (r->worktree_invalid));
+    json_object_set_new (object, "last_sync_time",
+                         json_integer (r->last_sync_time));
+    json_object_set_new (object, "auto_sync", json_boolean (r->auto_sync));
+
+    return object;
+}
+
+static char *
+build_repo_list_json (int seq, gboolean allow_invalid)
+{
+    GList *repos, *ptr;
+    json_t *object, *array, *repo;
+    char *ret;
+
+    repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1);
+
+    array = json_array ();
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = repo_to_json (ptr->data, allow_invalid);
+        if (repo)
+            json_array_append_new (array, repo);
+    }
+    g_list_free (repos);
+
+    object = json_object ();
+    json_object_set_new (object, "seq", json_integer (seq));
+    json_object_set_new (object, "repos", array);
+
+    ret = json_dumps (object, JSON_COMPACT);
+    json_decref (object);
+    return ret;
+}
+
+char *
+seafile_get_repo_list_json (int seq, GError **error)
+{
+    gboolean allow_invalid;
+    int cur_seq;
+    char *list, *ret;
+
+    /* Read the sequence number before the repos, so that a change made
+     * while the snapshot is built makes the next query build it again.
+     */
+    cur_seq = seaf_repo_manager_get_repo_list_seq (seaf->repo_mgr);
+    if (seq == cur_seq)
+        return g_strdup_printf ("{\"seq\":%d}", cur_seq);
+
+    allow_invalid = seafile_session_config_get_allow_invalid_worktree (seaf);
+
+    pthread_mutex_lock (&repo_list_cache_lock);
+    if (repo_list_cache && repo_list_cache_seq == cur_seq &&
+        repo_list_cache_allow_invalid == allow_invalid) {
+        ret = g_strdup (repo_list_cache);
+        pthread_mutex_unlock (&repo_list_cache_lock);
+        return ret;
+    }
+    pthread_mutex_unlock (&repo_list_cache_lock);
+
+    list = build_repo_list_json (cur_seq, allow_invalid);
+    if (!list) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to serialize repo list");
+        return NULL;
+    }
+    ret = g_strdup (list);
+
+    pthread_mutex_lock (&repo_list_cache_lock);
+    free (repo_list_cache);
+    repo_list_cache = list;
+    repo_list_cache_seq = cur_seq;
+    repo_list_cache_allow_invalid = allow_invalid;
+    pthread_mutex_unlock (&repo_list_cache_lock);
+
+    return ret;
+}
+
 GObject*
 seafile_get_repo (const char *repo_id, GError **error)
 {
@@ -14,6 +14,11 @@
 #include <openssl/aes.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
+#include <openssl/hmac.h>
+#endif
+
+#ifndef WIN32
+#include <sys/mman.h>
 #endif
 
 #include "utils.h"
@@ -46,10 +51,10 @@ seafile_crypt_new (int version, unsigned char *key, unsigned char *iv)
     return crypt;
 }
 
-int
-seafile_derive_key (const char *data_in, int in_len, int version,
-                    const char *repo_salt,
-                    unsigned char *key, unsigned char *iv)
+static int
+derive_key (const char *data_in, int in_len, int version,
+            const char *repo_salt,
+            unsigned char *key, unsigned char *iv)
 {
 #ifdef USE_GPL_CRYPTO
     if (version != 2) {
@@ -115,6 +120,169 @@ seafile_derive_key (const char *data_in, int in_len, int version,
 #endif
 }
 
+/*
+ * Cache of derived keys.
+ *
+ * The same password is derived several times when a library is cloned or
+ * its password is set: once to verify the magic and again to decrypt the
+ * random key. Version 1 libraries run 2^19 iterations each time.
+ *
+ * Entries are looked up by an HMAC of (version, salt, input) under a
+ * random per-process secret, so neither passwords nor plain hashes of
+ * them are kept. The table is a fixed array that is locked into memory
+ * where possible, and evicted entries are wiped.
+ */
+
+#define KDF_CACHE_SIZE 64
+
+typedef struct DerivedKey {
+    gboolean used;
+    guint64 last_use;
+    unsigned char id[32];
+    unsigned char key[32];
+    unsigned char iv[16];
+} DerivedKey;
+
+static struct {
+    GMutex lock;
+    gboolean inited;
+    unsigned char secret[32];
+    guint64 clock;
+    DerivedKey entries[KDF_CACHE_SIZE];
+} kdf_cache;
+
+static void
+wipe (void *p, size_t len)
+{
+    volatile unsigned char *v = p;
+
+    while (len--)
+        *v++ = 0;
+}
+
+/* Called with kdf_cache.lock held. */
+static gboolean
+kdf_cache_init ()
+{
+    int rc;
+
+    if (kdf_cache.inited)
+        return TRUE;
+
+#ifdef USE_GPL_CRYPTO
+    rc = (gnutls_rnd (GNUTLS_RND_KEY, kdf_cache.secret,
+                      sizeof(kdf_cache.secret)) == 0);
+#else
+    rc = (RAND_bytes (kdf_cache.secret, sizeof(kdf_cache.secret)) == 1);
+#endif
+    if (!rc) {
+        seaf_warning ("Failed to generate key cache secret.\n");
+        return FALSE;
+    }
+
+#ifndef WIN32
+    /* Best effort, keep derived keys out of swap. */
+    mlock (&kdf_cache, sizeof(kdf_cache));
+#endif
+
+    kdf_cache.inited = TRUE;
+    return TRUE;
+}
+
+/* Called with kdf_cache.lock held. */
+static gboolean
+kdf_cache_id (const char *data_in, int in_len, int version,
+              const char *repo_salt, unsigned char *id)
+{
+    int salt_len = repo_salt ? strlen(repo_salt) : 0;
+    int msg_len = sizeof(version) + 1 + salt_len + 1 + in_len;
+    unsigned char *msg, *p;
+    gboolean ret;
+
+    msg = p = g_malloc (msg_len);
+    memcpy (p, &version, sizeof(version));
+    p += sizeof(version);
+    *p++ = (repo_salt != NULL);
+    memcpy (p, repo_salt, salt_len);
+    p += salt_len;
+    *p++ = 0;
+    memcpy (p, data_in, in_len);
+
+#ifdef USE_GPL_CRYPTO
+    ret = (gnutls_hmac_fast (GNUTLS_MAC_SHA256,
+                             kdf_cache.secret, sizeof(kdf_cache.secret),
+                             msg, msg_len, id) == 0);
+#else
+    ret = (HMAC (EVP_sha256(), kdf_cache.secret, sizeof(kdf_cache.secret),
+                 msg, msg_len, id, NULL) != NULL);
+#endif
+
+    wipe (msg, msg_len);
+    g_free (msg);
+    return ret;
+}
+
+int
+seafile_derive_key (const char *data_in, int in_len, int version,
+                    const char *repo_salt,
+                    unsigned char *key, unsigned char *iv)
+{
+    unsigned char id[32];
+    int key_len = (version >= 2) ? 32 : 16;
+    gboolean cacheable;
+    DerivedKey *e, *victim = NULL;
+    int i;
+
+    g_mutex_lock (&kdf_cache.lock);
+    cacheable = kdf_cache_init () &&
+        kdf_cache_id (data_in, in_len, version, repo_salt, id);
+    if (cacheable) {
+        for (i = 0; i < KDF_CACHE_SIZE; ++i) {
+            e = &kdf_cache.entries[i];
+            if (e->used && memcmp (e->id, id, sizeof(id)) == 0) {
+                memcpy (key, e->key, key_len);
+                memcpy (iv, e->iv, sizeof(e->iv));
+                e->last_use = ++kdf_cache.clock;
+                g_mutex_unlock (&kdf_cache.lock);
+                return 0;
+            }
+        }
+    }
+    g_mutex_unlock (&kdf_cache.lock);
+
+    /* Derive without holding the lock, so that different keys can be
+     * derived in parallel. */
+    if (derive_key (data_in, in_len, version, repo_salt, key, iv) < 0)
+        return -1;
+
+    if (!cacheable)
+        return 0;
+
+    g_mutex_lock (&kdf_cache.lock);
+    for (i = 0; i < KDF_CACHE_SIZE; ++i) {
+        e = &kdf_cache.entries[i];
+        if (e->used && memcmp (e->id, id, sizeof(id)) == 0) {
+            /* Derived by another thread meanwhile. */
+            victim = NULL;
+            break;
+        }
+        if (!victim || !e->used ||
+            (victim->used && e->last_use < victim->last_use))
+            victim = e;
+    }
+    if (victim) {
+        wipe (victim, sizeof(DerivedKey));
+        memcpy (victim->id, id, sizeof(id));
+        memcpy (victim->key, key, key_len);
+        memcpy (victim->iv, iv, sizeof(victim->iv));
+        victim->last_use = ++kdf_cache.clock;
+        victim->used = TRUE;
+    }
+    g_mutex_unlock (&kdf_cache.lock);
+
+    return 0;
+}
+
 int
 seafile_generate_repo_salt (char *repo_salt)
 {
@@ -320,190 +488,254 @@ seafile_update_random_key (const char *old_passwd, const char *old_random_key,
     return 0;
 }
 
+/*
+ * Cipher contexts are cached per thread. Blocks of the same library are
+ * encrypted with the same key, so when the key matches the previous call
+ * only the IV is reset and the AES key schedule is kept.
+ */
+typedef struct CipherCache {
 #ifdef USE_GPL_CRYPTO
+    gnutls_cipher_hd_t handle;
+#else
+    EVP_CIPHER_CTX *ctx;
+    const EVP_CIPHER *cipher;
+#endif
+    gboolean valid;
+    unsigned char key[32];
+} CipherCache;
 
-int
-seafile_encrypt (char **data_out,
-                 int *out_len,
-                 const char *data_in,
-                 const int in_len,
-                 SeafileCrypt *crypt)
+static void
+cipher_cache_free (gpointer data)
 {
-    char *buf = NULL, *enc_buf = NULL;
-    int buf_size, remain;
-    guint8 padding;
-    gnutls_cipher_hd_t handle;
+    CipherCache *cache = data;
+
+#ifdef USE_GPL_CRYPTO
+    if (cache->valid)
+        gnutls_cipher_deinit (cache->handle);
+#else
+    EVP_CIPHER_CTX_free (cache->ctx);
+#endif
+    memset (cache->key, 0, sizeof(cache->key));
+    g_free (cache);
+}
+
+static GPrivate encrypt_cache = G_PRIVATE_INIT (cipher_cache_free);
+static GPrivate decrypt_cache = G_PRIVATE_INIT (cipher_cache_free);
+
+static CipherCache *
+get_cipher_cache (GPrivate *key)
+{
+    CipherCache *cache = g_private_get (key);
+
+    if (!cache) {
+        cache = g_new0 (CipherCache, 1);
+#ifndef USE_GPL_CRYPTO
+        cache->ctx = EVP_CIPHER_CTX_new ();
+#endif
+        g_private_set (key, cache);
+    }
+    return cache;
+}
+
+#ifdef USE_GPL_CRYPTO
+
+static gnutls_cipher_hd_t
+prepare_cipher (GPrivate *cache_key, SeafileCrypt *crypt)
+{
+    CipherCache *cache = get_cipher_cache (cache_key);
     gnutls_datum_t key, iv;
-    int rc, ret = 0;
+    int rc;
 
-    buf_size = BLK_SIZE * ((in_len / BLK_SIZE) + 1);
-    remain = buf_size - in_len;
-    buf = g_new (char, buf_size);
+    if (cache->valid &&
+        memcmp (cache->key, crypt->key, sizeof(crypt->key)) == 0) {
+        gnutls_cipher_set_iv (cache->handle, crypt->iv, sizeof(crypt->iv));
+        return cache->handle;
+    }
 
-    memcpy (buf, data_in, in_len);
-    padding = (guint8)remain;
-    memset (buf + in_len, padding, remain);
+    if (cache->valid) {
+        gnutls_cipher_deinit (cache->handle);
+        cache->valid = FALSE;
+    }
 
     key.data = crypt->key;
     key.size = sizeof(crypt->key);
     iv.data = crypt->iv;
     iv.size = sizeof(crypt->iv);
-    rc = gnutls_cipher_init (&handle, GNUTLS_CIPHER_AES_256_CBC, &key, &iv);
+    rc = gnutls_cipher_init (&cache->handle, GNUTLS_CIPHER_AES_256_CBC, &key, &iv);
     if (rc < 0) {
         seaf_warning ("Failed to init cipher: %s\n", gnutls_strerror(rc));
-        ret = -1;
-        goto out;
+        return NULL;
     }
 
-    enc_buf = g_new (char, buf_size);
-    rc = gnutls_cipher_encrypt2 (handle, buf, buf_size, enc_buf, buf_size);
-    if (rc < 0) {
-        seaf_warning ("Failed to encrypt: %s\n", gnutls_strerror(rc));
-        ret = -1;
-        gnutls_cipher_deinit (handle);
-        goto out;
+    memcpy (cache->key, crypt->key, sizeof(crypt->key));
+    cache->valid = TRUE;
+    return cache->handle;
+}
+
+static void
+invalidate_cipher (GPrivate *cache_key)
+{
+    CipherCache *cache = get_cipher_cache (cache_key);
+
+    if (cache->valid) {
+        gnutls_cipher_deinit (cache->handle);
+        cache->valid = FALSE;
     }
+}
+
+int
+seafile_encrypt_buf (char *data_out,
+                     int *out_len,
+                     const char *data_in,
+                     const int in_len,
+                     SeafileCrypt *crypt)
+{
+    gnutls_cipher_hd_t handle;
+    int buf_size, remain;
+    guint8 padding;
+    int rc;
 
-    gnutls_cipher_deinit (handle);
+    *out_len = -1;
 
-out:
-    g_free (buf);
-    if (ret < 0) {
-        g_free (enc_buf);
-        *data_out = NULL;
-        *out_len = -1;
-    } else {
-        *data_out = enc_buf;
-        *out_len = buf_size;
+    buf_size = SEAFILE_ENCRYPTED_SIZE (in_len);
+    remain = buf_size - in_len;
+
+    handle = prepare_cipher (&encrypt_cache, crypt);
+    if (!handle)
+        return -1;
+
+    /* gnutls encrypts in place, so pad the plaintext in the output buffer. */
+    if (data_out != data_in)
+        memcpy (data_out, data_in, in_len);
+    padding = (guint8)remain;
+    memset (data_out + in_len, padding, remain);
+
+    rc = gnutls_cipher_encrypt (handle, data_out, buf_size);
+    if (rc < 0) {
+        seaf_warning ("Failed to encrypt: %s\n", gnutls_strerror(rc));
+        invalidate_cipher (&encrypt_cache);
+        return -1;
     }
-    return ret;
+
+    *out_len = buf_size;
+    return 0;
 }
 
 int
-seafile_decrypt (char **data_out,
-                 int *out_len,
-                 const char *data_in,
-                 const int in_len,
-                 SeafileCrypt *crypt)
+seafile_decrypt_buf (char *data_out,
+                     int *out_len,
+                     const char *data_in,
+                     const int in_len,
+                     SeafileCrypt *crypt)
 {
-    char *dec_buf = NULL;
     gnutls_cipher_hd_t handle;
-    gnutls_datum_t key, iv;
-    int rc, ret = 0;
+    int rc;
     guint8 padding;
     int remain;
 
+    *out_len = -1;
+
     if (in_len <= 0 || in_len % BLK_SIZE != 0) {
         seaf_warning ("Invalid encrypted buffer size.\n");
         return -1;
     }
 
-    key.data = crypt->key;
-    key.size = sizeof(crypt->key);
-    iv.data = crypt->iv;
-    iv.size = sizeof(crypt->iv);
-    rc = gnutls_cipher_init (&handle, GNUTLS_CIPHER_AES_256_CBC, &key, &iv);
-    if (rc < 0) {
-        seaf_warning ("Failed to init cipher: %s\n", gnutls_strerror(rc));
-        ret = -1;
-        goto out;
-    }
+    handle = prepare_cipher (&decrypt_cache, crypt);
+    if (!handle)
+        return -1;
 
-    dec_buf = g_new (char, in_len);
-    rc = gnutls_cipher_decrypt2 (handle, data_in, in_len, dec_buf, in_len);
+    rc = gnutls_cipher_decrypt2 (handle, data_in, in_len, data_out, in_len);
     if (rc < 0) {
         seaf_warning ("Failed to decrypt data: %s\n", gnutls_strerror(rc));
-        ret = -1;
-        gnutls_cipher_deinit (handle);
-        goto out;
+        invalidate_cipher (&decrypt_cache);
+        return -1;
     }
 
-    padding = dec_buf[in_len - 1];
+    padding = data_out[in_len - 1];
     remain = padding;
     *out_len = (in_len - remain);
-    *data_out = dec_buf;
 
-    gnutls_cipher_deinit (handle);
-out:
-    if (ret < 0) {
-        g_free (dec_buf);
-        *data_out = NULL;
-        *out_len = -1;
-    }
-    return ret;
+    return 0;
 }
 
 #else
 
-int
-seafile_encrypt (char **data_out,
-                 int *out_len,
-                 const char *data_in,
-                 const int in_len,
-                 SeafileCrypt *crypt)
+static const EVP_CIPHER *
+cipher_for_version (int version)
 {
-    *data_out = NULL;
-    *out_len = -1;
-
-    /* check validation */
-    if ( data_in == NULL || in_len <= 0 || crypt == NULL) {
-        seaf_warning ("Invalid params.\n");
-        return -1;
-    }
+    if (version == 1)
+        return EVP_aes_128_cbc();
+    else if (version == 3)
+        return EVP_aes_128_ecb();
+    else
+        return EVP_aes_256_cbc();
+}
 
-    EVP_CIPHER_CTX *ctx;
+static EVP_CIPHER_CTX *
+prepare_cipher (GPrivate *cache_key, SeafileCrypt *crypt, int enc)
+{
+    CipherCache *cache = get_cipher_cache (cache_key);
+    const EVP_CIPHER *cipher = cipher_for_version (crypt->version);
+    int key_len = EVP_CIPHER_key_length (cipher);
     int ret;
-    int blks;
-
-    /* Prepare CTX for encryption. */
-    ctx = EVP_CIPHER_CTX_new ();
-
-    if (crypt->version == 1)
-        ret = EVP_EncryptInit_ex (ctx,
-                                  EVP_aes_128_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else if (crypt->version == 3)
-        ret = EVP_EncryptInit_ex (ctx,
-                                  EVP_aes_128_ecb(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else
-        ret = EVP_EncryptInit_ex (ctx,
-                                  EVP_aes_256_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
 
-    if (ret == ENC_FAILURE) {
-        EVP_CIPHER_CTX_free (ctx);
-        return -1;
+    if (!cache->ctx)
+        return NULL;
+
+    if (cache->valid && cache->cipher == cipher &&
+        memcmp (cache->key, crypt->key, key_len) == 0) {
+        /* Keep the key schedule, only reset the IV and the buffered state. */
+        ret = EVP_CipherInit_ex (cache->ctx, NULL, NULL, NULL, crypt->iv, enc);
+    } else {
+        cache->valid = FALSE;
+        ret = EVP_CipherInit_ex (cache->ctx,
+                                 cipher, /* cipher mode */
+                                 NULL, /* engine, NULL for default */
+                                 crypt->key,  /* derived key */
+                                 crypt->iv,   /* initial vector */
+                                 enc);
+        if (ret == ENC_SUCCESS) {
+            cache->cipher = cipher;
+            memcpy (cache->key, crypt->key, key_len);
+            cache->valid = TRUE;
+        }
     }
 
-    /* Allocating output buffer. */
-    
-    /*
-      For EVP symmetric encryption, padding is always used __even if__
-      data size is a multiple of block size, in which case the padding
-      length is the block size. so we have the following:
-    */
-    
-    blks = (in_len / BLK_SIZE) + 1;
+    if (ret == ENC_FAILURE) {
+        cache->valid = FALSE;
+        return NULL;
+    }
 
-    *data_out = (char *)g_malloc (blks * BLK_SIZE);
+    return cache->ctx;
+}
 
-    if (*data_out == NULL) {
-        seaf_warning ("failed to allocate the output buffer.\n");
-        goto enc_error;
-    }                
+static void
+invalidate_cipher (GPrivate *cache_key)
+{
+    CipherCache *cache = get_cipher_cache (cache_key);
+    cache->valid = FALSE;
+}
 
+int
+seafile_encrypt_buf (char *data_out,
+                     int *out_len,
+                     const char *data_in,
+                     const int in_len,
+                     SeafileCrypt *crypt)
+{
+    EVP_CIPHER_CTX *ctx;
+    int ret;
     int update_len, final_len;
 
+    *out_len = -1;
+
+    ctx = prepare_cipher (&encrypt_cache, crypt, 1);
+    if (!ctx)
+        return -1;
+
     /* Do the encryption. */
     ret = EVP_EncryptUpdate (ctx,
-                             (unsigned char*)*data_out,
+                             (unsigned char*)data_out,
                              &update_len,
                              (unsigned char*)data_in,
                              in_len);
@@ -511,39 +743,83 @@ seafile_encrypt (char **data_out,
     if (ret == ENC_FAILURE)
         goto enc_error;
 
-
     /* Finish the possible partial block. */
     ret = EVP_EncryptFinal_ex (ctx,
-                               (unsigned char*)*data_out + update_len,
+                               (unsigned char*)data_out + update_len,
                                &final_len);
 
-    *out_len = update_len + final_len;
-
-    /* out_len should be equal to the allocated buffer size. */
-    if (ret == ENC_FAILURE || *out_len != (blks * BLK_SIZE))
+    /*
+      For EVP symmetric encryption, padding is always used __even if__
+      data size is a multiple of block size, so the output must be
+      exactly SEAFILE_ENCRYPTED_SIZE(in_len) bytes.
+    */
+    if (ret == ENC_FAILURE ||
+        update_len + final_len != SEAFILE_ENCRYPTED_SIZE (in_len))
         goto enc_error;
-    
-    EVP_CIPHER_CTX_free (ctx);
 
+    *out_len = update_len + final_len;
     return 0;
 
 enc_error:
+    invalidate_cipher (&encrypt_cache);
+    return -1;
+}
 
-    EVP_CIPHER_CTX_free (ctx);
+int
+seafile_decrypt_buf (char *data_out,
+                     int *out_len,
+                     const char *data_in,
+                     const int in_len,
+                     SeafileCrypt *crypt)
+{
+    EVP_CIPHER_CTX *ctx;
+    int ret;
+    int update_len, final_len;
 
     *out_len = -1;
 
-    if (*data_out != NULL)
-        g_free (*data_out);
+    /* Because padding is always used, in_len must be a multiple of
+     * BLK_SIZE */
+    if (in_len <= 0 || in_len % BLK_SIZE != 0) {
+        seaf_warning ("Invalid param(s).\n");
+        return -1;
+    }
 
-    *data_out = NULL;
+    ctx = prepare_cipher (&decrypt_cache, crypt, 0);
+    if (!ctx)
+        return -1;
+
+    /* Do the decryption. */
+    ret = EVP_DecryptUpdate (ctx,
+                             (unsigned char*)data_out,
+                             &update_len,
+                             (unsigned char*)data_in,
+                             in_len);
+
+    if (ret == DEC_FAILURE)
+        goto dec_error;
+
+    /* Finish the possible partial block. */
+    ret = EVP_DecryptFinal_ex (ctx,
+                               (unsigned char*)data_out + update_len,
+                               &final_len);
+
+    /* out_len should be smaller than in_len. */
+    if (ret == DEC_FAILURE || update_len + final_len > in_len)
+        goto dec_error;
+
+    *out_len = update_len + final_len;
+    return 0;
 
+dec_error:
+    invalidate_cipher (&decrypt_cache);
     return -1;
-    
 }
-                               
+
+#endif  /* USE_GPL_CRYPTO */
+
 int
-seafile_decrypt (char **data_out,
+seafile_encrypt (char **data_out,
                  int *out_len,
                  const char *data_in,
                  const int in_len,
@@ -552,94 +828,134 @@ seafile_decrypt (char **data_out,
     *data_out = NULL;
     *out_len = -1;
 
-    /* Check validation. Because padding is always used, in_len must
-     * be a multiple of BLK_SIZE */
-    if ( data_in == NULL || in_len <= 0 || in_len % BLK_SIZE != 0 ||
-         crypt == NULL) {
+    /* check validation */
+    if ( data_in == NULL || in_len <= 0 || crypt == NULL) {
+        seaf_warning ("Invalid params.\n");
+        return -1;
+    }
+
+    *data_out = g_malloc (SEAFILE_ENCRYPTED_SIZE (in_len));
 
+    if (seafile_encrypt_buf (*data_out, out_len, data_in, in_len, crypt) < 0) {
+        g_free (*data_out);
+        *data_out = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+seafile_decrypt (char **data_out,
+                 int *out_len,
+                 const char *data_in,
+                 const int in_len,
+                 SeafileCrypt *crypt)
+{
+    *data_out = NULL;
+    *out_len = -1;
+
+    if ( data_in == NULL || in_len <= 0 || crypt == NULL) {
         seaf_warning ("Invalid param(s).\n");
         return -1;
     }
 
-    EVP_CIPHER_CTX *ctx;
-    int ret;
+    *data_out = g_malloc (in_len);
 
-    /* Prepare CTX for decryption. */
-    ctx = EVP_CIPHER_CTX_new ();
-
-    if (crypt->version == 1)
-        ret = EVP_DecryptInit_ex (ctx,
-                                  EVP_aes_128_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else if (crypt->version == 3)
-        ret = EVP_DecryptInit_ex (ctx,
-                                  EVP_aes_128_ecb(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-    else
-        ret = EVP_DecryptInit_ex (ctx,
-                                  EVP_aes_256_cbc(), /* cipher mode */
-                                  NULL, /* engine, NULL for default */
-                                  crypt->key,  /* derived key */
-                                  crypt->iv);  /* initial vector */
-
-    if (ret == DEC_FAILURE) {
-        EVP_CIPHER_CTX_free (ctx);
+    if (seafile_decrypt_buf (*data_out, out_len, data_in, in_len, crypt) < 0) {
+        g_free (*data_out);
+        *data_out = NULL;
         return -1;
     }
 
-    /* Allocating output buffer. */
-    
-    *data_out = (char *)g_malloc (in_len);
+    return 0;
+}
 
-    if (*data_out == NULL) {
-        seaf_warning ("failed to allocate the output buffer.\n");
-        goto dec_error;
-    }                
+#ifdef USE_GPL_CRYPTO
 
-    int update_len, final_len;
+struct SeafileSHA1Ctx {
+    gnutls_hash_hd_t handle;
+};
 
-    /* Do the decryption. */
-    ret = EVP_DecryptUpdate (ctx,
-                             (unsigned char*)*data_out,
-                             &update_len,
-                             (unsigned char*)data_in,
-                             in_len);
+SeafileSHA1Ctx *
+seafile_sha1_new ()
+{
+    SeafileSHA1Ctx *ctx = g_new0 (SeafileSHA1Ctx, 1);
 
-    if (ret == DEC_FAILURE)
-        goto dec_error;
+    /* Only fails on allocation failure or under a policy that forbids
+     * SHA-1, in which case no object id can be computed at all. */
+    if (gnutls_hash_init (&ctx->handle, GNUTLS_DIG_SHA1) < 0)
+        g_error ("SHA-1 is not available\n");
+    return ctx;
+}
+
+void
+seafile_sha1_update (SeafileSHA1Ctx *ctx, const void *data, size_t len)
+{
+    gnutls_hash (ctx->handle, data, len);
+}
 
+void
+seafile_sha1_final (SeafileSHA1Ctx *ctx, unsigned char *digest)
+{
+    gnutls_hash_deinit (ctx->handle, digest);
+    g_free (ctx);
+}
 
-    /* Finish the possible partial block. */
-    ret = EVP_DecryptFinal_ex (ctx,
-                               (unsigned char*)*data_out + update_len,
-                               &final_len);
+void
+seafile_sha1_free (SeafileSHA1Ctx *ctx)
+{
+    gnutls_hash_deinit (ctx->handle, NULL);
+    g_free (ctx);
+}
 
-    *out_len = update_len + final_len;
+void
+seafile_sha1 (const void *data, size_t len, unsigned char *digest)
+{
+    gnutls_hash_fast (GNUTLS_DIG_SHA1, data, len, digest);
+}
 
-    /* out_len should be smaller than in_len. */
-    if (ret == DEC_FAILURE || *out_len > in_len)
-        goto dec_error;
+#else
 
-    EVP_CIPHER_CTX_free (ctx);
-    
-    return 0;
+struct SeafileSHA1Ctx {
+    EVP_MD_CTX *md;
+};
 
-dec_error:
+SeafileSHA1Ctx *
+seafile_sha1_new ()
+{
+    SeafileSHA1Ctx *ctx = g_new0 (SeafileSHA1Ctx, 1);
 
-    EVP_CIPHER_CTX_free (ctx);
+    ctx->md = EVP_MD_CTX_new ();
+    if (!ctx->md || !EVP_DigestInit_ex (ctx->md, EVP_sha1(), NULL))
+        g_error ("SHA-1 is not available\n");
+    return ctx;
+}
 
-    *out_len = -1;
-    if (*data_out != NULL)
-        g_free (*data_out);
+void
+seafile_sha1_update (SeafileSHA1Ctx *ctx, const void *data, size_t len)
+{
+    EVP_DigestUpdate (ctx->md, data, len);
+}
 
-    *data_out = NULL;
+void
+seafile_sha1_final (SeafileSHA1Ctx *ctx, unsigned char *digest)
+{
+    EVP_DigestFinal_ex (ctx->md, digest, NULL);
+    seafile_sha1_free (ctx);
+}
 
-    return -1;
-    
+void
+seafile_sha1_free (SeafileSHA1Ctx *ctx)
+{
+    EVP_MD_CTX_free (ctx->md);
+    g_free (ctx);
+}
+
+void
+seafile_sha1 (const void *data, size_t len, unsigned char *digest)
+{
+    EVP_Digest (data, len, digest, NULL, EVP_sha1(), NULL);
 }
 
 #endif  /* USE_GPL_CRYPTO */
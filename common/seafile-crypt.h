@@ -83,6 +83,35 @@ seafile_update_random_key (const char *old_passwd, const char *old_random_key,
                            const char *new_passwd, char *new_random_key,
                            int enc_version, const char *repo_salt);
 
+/*
+ * Size of the ciphertext for @in_len bytes of plaintext. Padding is always
+ * added, even when @in_len is a multiple of BLK_SIZE.
+ */
+#define SEAFILE_ENCRYPTED_SIZE(in_len) ((((in_len) / BLK_SIZE) + 1) * BLK_SIZE)
+
+/*
+ * Same as seafile_encrypt() and seafile_decrypt(), but the output goes to a
+ * buffer supplied by the caller. @data_out must hold at least
+ * SEAFILE_ENCRYPTED_SIZE(in_len) bytes when encrypting and @in_len bytes
+ * when decrypting. It may be the same buffer as @data_in.
+ *
+ * Cipher contexts are kept per thread, and the key schedule is reused as
+ * long as consecutive calls use the same key.
+ */
+int
+seafile_encrypt_buf (char *data_out,
+                     int *out_len,
+                     const char *data_in,
+                     const int in_len,
+                     SeafileCrypt *crypt);
+
+int
+seafile_decrypt_buf (char *data_out,
+                     int *out_len,
+                     const char *data_in,
+                     const int in_len,
+                     SeafileCrypt *crypt);
+
 int
 seafile_encrypt (char **data_out,
                  int *out_len,
@@ -98,4 +127,30 @@ seafile_decrypt (char **data_out,
                  const int in_len,
                  SeafileCrypt *crypt);
 
+/*
+ * SHA-1 through the crypto library instead of GChecksum. OpenSSL and
+ * gnutls/nettle pick the CPU's SHA extensions (x86 SHA-NI, ARMv8 crypto)
+ * at runtime, which is several times faster than glib's portable
+ * implementation on block-sized inputs.
+ *
+ * seafile_sha1_final() writes the 20-byte digest and frees @ctx.
+ */
+typedef struct SeafileSHA1Ctx SeafileSHA1Ctx;
+
+SeafileSHA1Ctx *
+seafile_sha1_new ();
+
+void
+seafile_sha1_update (SeafileSHA1Ctx *ctx, const void *data, size_t len);
+
+void
+seafile_sha1_final (SeafileSHA1Ctx *ctx, unsigned char *digest);
+
+void
+seafile_sha1_free (SeafileSHA1Ctx *ctx);
+
+/* One-shot helper, @digest must be 20 bytes long. */
+void
+seafile_sha1 (const void *data, size_t len, unsigned char *digest);
+
 #endif  /* _SEAFILE_CRYPT_H */
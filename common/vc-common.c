@@ -2,6 +2,7 @@
 
 #include "seafile-session.h"
 #include "vc-common.h"
+#include "commit-graph.h"
 
 #include "log.h"
 #include "seafile-error.h"
@@ -217,6 +218,20 @@ get_merge_base (SeafCommit *head, SeafCommit *remote)
     int n, i;
     SeafCommit *ret = NULL;
 
+    /* In the common fast-forward case, the commit graph answers without
+     * walking the commit objects.
+     */
+    if (commit_graph_is_ancestor (head->repo_id, head->version,
+                                  head->commit_id, remote->commit_id) == 1) {
+        seaf_commit_ref (head);
+        return head;
+    }
+    if (commit_graph_is_ancestor (head->repo_id, head->version,
+                                  remote->commit_id, head->commit_id) == 1) {
+        seaf_commit_ref (remote);
+        return remote;
+    }
+
     one = head;
     twos = (SeafCommit **) calloc (1, sizeof(SeafCommit *));
     twos[0] = remote;
@@ -278,6 +293,18 @@ vc_compare_commits (const char *repo_id, int version,
     if (strcmp (c1, c2) == 0)
         return VC_UP_TO_DATE;
 
+    /* Use the commit graph if the history of both commits is available. */
+    int res = commit_graph_is_ancestor (repo_id, version, c1, c2);
+    if (res == 1)
+        return VC_UP_TO_DATE;
+    if (res == 0) {
+        res = commit_graph_is_ancestor (repo_id, version, c2, c1);
+        if (res == 1)
+            return VC_FAST_FORWARD;
+        if (res == 0)
+            return VC_INDEPENDENT;
+    }
+
     commit1 = seaf_commit_manager_get_commit (seaf->commit_mgr, repo_id, version, c1);
     if (!commit1)
         return VC_INDEPENDENT;
@@ -0,0 +1,188 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "worker-pool.h"
+#include "log.h"
+
+struct _WorkerTaskGroup {
+    GFunc func;
+    gpointer user_data;
+    int priority;
+
+    /* Protected by pool.lock. */
+    GQueue tasks;
+    int n_running;
+    guint64 n_finished;
+    GCond finished_cond;
+};
+
+typedef struct WorkerPool {
+    GMutex lock;
+    GCond work_cond;
+    /* Groups that have queued tasks, one queue per priority. */
+    GQueue ready[N_WORKER_PRIORITIES];
+} WorkerPool;
+
+static WorkerPool pool;
+
+/* Called with pool.lock held. Takes the next task of @group. */
+static gpointer
+take_task (WorkerTaskGroup *group)
+{
+    GQueue *ready = &pool.ready[group->priority];
+    gpointer data;
+
+    data = g_queue_pop_head (&group->tasks);
+
+    /* Move the group to the tail, so groups of the same priority take
+     * turns. */
+    g_queue_remove (ready, group);
+    if (!g_queue_is_empty (&group->tasks))
+        g_queue_push_tail (ready, group);
+
+    ++(group->n_running);
+    return data;
+}
+
+/* Called with pool.lock held. The lock is released while the task runs. */
+static void
+run_task (WorkerTaskGroup *group, gpointer data)
+{
+    g_mutex_unlock (&pool.lock);
+    group->func (data, group->user_data);
+    g_mutex_lock (&pool.lock);
+
+    --(group->n_running);
+    ++(group->n_finished);
+    g_cond_broadcast (&group->finished_cond);
+}
+
+static WorkerTaskGroup *
+next_ready_group ()
+{
+    int i;
+
+    for (i = 0; i < N_WORKER_PRIORITIES; ++i) {
+        if (!g_queue_is_empty (&pool.ready[i]))
+            return g_queue_peek_head (&pool.ready[i]);
+    }
+    return NULL;
+}
+
+static gpointer
+worker_thread (gpointer unused)
+{
+    WorkerTaskGroup *group;
+    gpointer data;
+
+    g_mutex_lock (&pool.lock);
+    while (1) {
+        group = next_ready_group ();
+        if (!group) {
+            g_cond_wait (&pool.work_cond, &pool.lock);
+            continue;
+        }
+        data = take_task (group);
+        run_task (group, data);
+    }
+
+    return NULL;
+}
+
+static gpointer
+start_pool (gpointer unused)
+{
+    int n_threads, i;
+    GThread *thread;
+
+    g_mutex_init (&pool.lock);
+    g_cond_init (&pool.work_cond);
+    for (i = 0; i < N_WORKER_PRIORITIES; ++i)
+        g_queue_init (&pool.ready[i]);
+
+    n_threads = MAX (g_get_num_processors (), 1);
+    for (i = 0; i < n_threads; ++i) {
+        thread = g_thread_try_new ("worker", worker_thread, NULL, NULL);
+        if (!thread) {
+            seaf_warning ("Failed to start worker thread.\n");
+            break;
+        }
+        g_thread_unref (thread);
+    }
+
+    return NULL;
+}
+
+WorkerTaskGroup *
+worker_task_group_new (GFunc func, gpointer user_data, int priority)
+{
+    static GOnce once = G_ONCE_INIT;
+    WorkerTaskGroup *group;
+
+    g_once (&once, start_pool, NULL);
+
+    group = g_new0 (WorkerTaskGroup, 1);
+    group->func = func;
+    group->user_data = user_data;
+    group->priority = CLAMP (priority, 0, N_WORKER_PRIORITIES - 1);
+    g_queue_init (&group->tasks);
+    g_cond_init (&group->finished_cond);
+
+    return group;
+}
+
+void
+worker_task_group_push (WorkerTaskGroup *group, gpointer data)
+{
+    g_mutex_lock (&pool.lock);
+
+    if (g_queue_is_empty (&group->tasks))
+        g_queue_push_tail (&pool.ready[group->priority], group);
+    g_queue_push_tail (&group->tasks, data);
+
+    g_cond_signal (&pool.work_cond);
+
+    g_mutex_unlock (&pool.lock);
+}
+
+/* Called with pool.lock held. */
+static void
+help_locked (WorkerTaskGroup *group)
+{
+    guint64 n_finished;
+    gpointer data;
+
+    if (!g_queue_is_empty (&group->tasks)) {
+        data = take_task (group);
+        run_task (group, data);
+        return;
+    }
+
+    n_finished = group->n_finished;
+    while (group->n_running > 0 && group->n_finished == n_finished)
+        g_cond_wait (&group->finished_cond, &pool.lock);
+}
+
+void
+worker_task_group_help (WorkerTaskGroup *group)
+{
+    g_mutex_lock (&pool.lock);
+    help_locked (group);
+    g_mutex_unlock (&pool.lock);
+}
+
+void
+worker_task_group_free (WorkerTaskGroup *group)
+{
+    if (!group)
+        return;
+
+    g_mutex_lock (&pool.lock);
+    while (!g_queue_is_empty (&group->tasks) || group->n_running > 0)
+        help_locked (group);
+    g_mutex_unlock (&pool.lock);
+
+    g_cond_clear (&group->finished_cond);
+    g_free (group);
+}
@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_WORKER_POOL_H
+#define SEAF_WORKER_POOL_H
+
+#include <glib.h>
+
+/*
+ * Process-wide pool of worker threads for CPU-bound tasks, such as chunking
+ * and hashing files. It has one thread per core, so stages that run at the
+ * same time share the cores instead of each starting its own threads.
+ *
+ * Tasks are pushed to a group. Groups with higher priority are served
+ * first, groups with the same priority take turns. A thread that waits for
+ * a group runs the group's queued tasks itself, so tasks may wait for
+ * groups of their own without starving the pool.
+ *
+ * Tasks that block on the network should not be run in this pool.
+ */
+
+enum {
+    WORKER_PRIORITY_HIGH = 0,
+    WORKER_PRIORITY_NORMAL,
+    WORKER_PRIORITY_LOW,
+    N_WORKER_PRIORITIES,
+};
+
+typedef struct _WorkerTaskGroup WorkerTaskGroup;
+
+/* @func is called as func (data, user_data) for each pushed task. */
+WorkerTaskGroup *
+worker_task_group_new (GFunc func, gpointer user_data, int priority);
+
+void
+worker_task_group_push (WorkerTaskGroup *group, gpointer data);
+
+/*
+ * Run one queued task of @group in the current thread. If no task is
+ * queued, wait until a running task of @group finishes.
+ */
+void
+worker_task_group_help (WorkerTaskGroup *group);
+
+/* Wait for all tasks of @group to finish, then free it. */
+void
+worker_task_group_free (WorkerTaskGroup *group);
+
+#endif
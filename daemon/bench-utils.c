@@ -0,0 +1,179 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <glib/gstdio.h>
+
+#ifdef WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+
+#include "utils.h"
+#include "bench-utils.h"
+
+#ifdef WIN32
+
+static gint64
+filetime_to_usec (const FILETIME *ft)
+{
+    ULARGE_INTEGER t;
+
+    t.LowPart = ft->dwLowDateTime;
+    t.HighPart = ft->dwHighDateTime;
+    return (gint64)(t.QuadPart / 10);
+}
+
+void
+bench_get_proc_stats (BenchProcStats *stats)
+{
+    HANDLE proc = GetCurrentProcess ();
+    FILETIME creation, exit, kernel, user;
+    PROCESS_MEMORY_COUNTERS mem;
+    IO_COUNTERS io;
+
+    memset (stats, 0, sizeof(*stats));
+    stats->wall = g_get_monotonic_time ();
+
+    if (GetProcessTimes (proc, &creation, &exit, &kernel, &user))
+        stats->cpu = filetime_to_usec (&kernel) + filetime_to_usec (&user);
+
+    if (GetProcessMemoryInfo (proc, &mem, sizeof(mem))) {
+        stats->rss = (gint64)mem.WorkingSetSize;
+        stats->peak_rss = (gint64)mem.PeakWorkingSetSize;
+    }
+
+    if (GetProcessIoCounters (proc, &io))
+        stats->io_calls = (gint64)(io.ReadOperationCount + io.WriteOperationCount +
+                                   io.OtherOperationCount);
+    else
+        stats->io_calls = -1;
+}
+
+#else
+
+static gint64
+timeval_to_usec (const struct timeval *tv)
+{
+    return (gint64)tv->tv_sec * G_USEC_PER_SEC + tv->tv_usec;
+}
+
+#ifdef __APPLE__
+
+static gint64
+get_rss ()
+{
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+
+    if (task_info (mach_task_self (), MACH_TASK_BASIC_INFO,
+                   (task_info_t)&info, &count) != KERN_SUCCESS)
+        return 0;
+    return (gint64)info.resident_size;
+}
+
+#else
+
+static gint64
+get_rss ()
+{
+    FILE *fp;
+    long size, resident;
+    gint64 rss = 0;
+
+    fp = fopen ("/proc/self/statm", "r");
+    if (!fp)
+        return 0;
+    if (fscanf (fp, "%ld %ld", &size, &resident) == 2)
+        rss = (gint64)resident * sysconf (_SC_PAGESIZE);
+    fclose (fp);
+    return rss;
+}
+
+static gint64
+get_io_calls ()
+{
+    FILE *fp;
+    char line[128];
+    long long v;
+    gint64 calls = 0;
+    int found = 0;
+
+    fp = fopen ("/proc/self/io", "r");
+    if (!fp)
+        return -1;
+    while (fgets (line, sizeof(line), fp)) {
+        if (sscanf (line, "syscr: %lld", &v) == 1 ||
+            sscanf (line, "syscw: %lld", &v) == 1) {
+            calls += v;
+            ++found;
+        }
+    }
+    fclose (fp);
+    return found == 2 ? calls : -1;
+}
+
+#endif  /* __APPLE__ */
+
+void
+bench_get_proc_stats (BenchProcStats *stats)
+{
+    struct rusage usage;
+
+    memset (stats, 0, sizeof(*stats));
+    stats->wall = g_get_monotonic_time ();
+    stats->io_calls = -1;
+
+    if (getrusage (RUSAGE_SELF, &usage) == 0) {
+        stats->cpu = timeval_to_usec (&usage.ru_utime) +
+            timeval_to_usec (&usage.ru_stime);
+#ifdef __APPLE__
+        /* In bytes on macOS, in KB elsewhere. */
+        stats->peak_rss = usage.ru_maxrss;
+        stats->io_calls = usage.ru_inblock + usage.ru_oublock;
+#else
+        stats->peak_rss = (gint64)usage.ru_maxrss * 1024;
+#endif
+    }
+
+    stats->rss = get_rss ();
+#ifndef __APPLE__
+    stats->io_calls = get_io_calls ();
+#endif
+}
+
+#endif  /* WIN32 */
+
+void
+bench_remove_dir (const char *path)
+{
+    GDir *dir;
+    const char *dname;
+    char *sub;
+
+    dir = g_dir_open (path, 0, NULL);
+    if (!dir) {
+        seaf_util_unlink (path);
+        return;
+    }
+
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        sub = g_build_filename (path, dname, NULL);
+        if (g_file_test (sub, G_FILE_TEST_IS_DIR))
+            bench_remove_dir (sub);
+        else
+            seaf_util_unlink (sub);
+        g_free (sub);
+    }
+    g_dir_close (dir);
+
+    seaf_util_rmdir (path);
+}
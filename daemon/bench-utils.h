@@ -0,0 +1,33 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_BENCH_UTILS_H
+#define SEAF_BENCH_UTILS_H
+
+#include <glib.h>
+
+/* Helpers shared by the benchmark programs. */
+
+typedef struct BenchProcStats {
+    gint64 wall;                /* monotonic time, in microseconds */
+    gint64 cpu;                 /* user + system time, in microseconds */
+    gint64 rss;                 /* resident set size, in bytes */
+    gint64 peak_rss;            /* in bytes */
+    /*
+     * I/O calls made by the process, -1 if unknown:
+     * - Linux: read and write syscalls, from /proc/self/io;
+     * - Windows: read, write and other I/O operations, which include
+     *   stat-like calls;
+     * - macOS: block input and output operations.
+     * Run the program under strace -c, or dtruss, for all syscalls.
+     */
+    gint64 io_calls;
+} BenchProcStats;
+
+void
+bench_get_proc_stats (BenchProcStats *stats);
+
+/* Remove @path and everything below it. */
+void
+bench_remove_dir (const char *path);
+
+#endif
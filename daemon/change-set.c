@@ -2,6 +2,8 @@
 
 #include "common.h"
 
+#include <pthread.h>
+
 #include "seafile-session.h"
 
 #include "utils.h"
@@ -12,13 +14,36 @@
 #include "diff-simple.h"
 #include "change-set.h"
 
+/*
+ * A ChangeSetDir is an overlay on the dir object it was loaded from.
+ *
+ * The entries of that object stay in @base and are looked up by binary
+ * search. Only the dirents that are changed, added, or lead to a loaded
+ * subdir are copied into @dents, where they hide the base entry of the
+ * same name. Base entries that are removed are recorded in @removed. So
+ * the memory and time spent on a large dir follow the number of changes
+ * in it rather than its size, until it's written out on commit.
+ */
 struct _ChangeSetDir {
     int version;
     char dir_id[41];
-    /* A hash table of dirents for fast lookup and insertion. */
+    /* Whether the dir or any dir below it has been changed. Unchanged dirs
+     * keep their dir_id and are not saved again on commit.
+     */
+    gboolean changed;
+    /* The dir object this dir was loaded from, or NULL for new dirs. */
+    SeafDir *base;
+    /* Entries of @base, sorted by name in descending order. */
+    SeafDirent **base_dents;
+    guint n_base_dents;
+    /* Changed and added dirents, by name. */
     GHashTable *dents;
+    /* Names of the base entries that have been removed. */
+    GHashTable *removed;
+    /* Number of entries in the dir. */
+    guint n_dents;
 #if defined WIN32 || defined __APPLE__
-    /* Case-insensitive hash table. */
+    /* Names of all entries, compared ignoring case. Built on first use. */
     GHashTable *dents_i;
 #endif
 
@@ -90,58 +115,208 @@ changeset_dirent_free (ChangeSetDirent *dent)
 
 /* Change set dir. */
 
+static gint
+compare_dents (gconstpointer a, gconstpointer b)
+{
+    const SeafDirent *denta = a, *dentb = b;
+
+    return strcmp(dentb->name, denta->name);
+}
+
+static gint
+compare_dent_ptrs (const void *a, const void *b)
+{
+    return compare_dents (*(SeafDirent * const *)a, *(SeafDirent * const *)b);
+}
+
+static SeafDirent *
+lookup_base_dent (ChangeSetDir *dir, const char *dname)
+{
+    guint lo = 0, hi = dir->n_base_dents, mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strcmp (dir->base_dents[mid]->name, dname);
+        if (cmp == 0)
+            return dir->base_dents[mid];
+        /* Names are in descending order. */
+        if (cmp > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+/* Whether a base entry is neither changed nor removed. */
+static gboolean
+base_dent_visible (ChangeSetDir *dir, SeafDirent *seaf_dent)
+{
+    return !g_hash_table_contains (dir->dents, seaf_dent->name) &&
+           !g_hash_table_contains (dir->removed, seaf_dent->name);
+}
+
+/*
+ * Find a dirent to change it. An unchanged base entry is copied into
+ * dir->dents first.
+ */
+static ChangeSetDirent *
+lookup_dent (ChangeSetDir *dir, const char *dname)
+{
+    ChangeSetDirent *dent;
+    SeafDirent *seaf_dent;
+
+    dent = g_hash_table_lookup (dir->dents, dname);
+    if (dent || g_hash_table_contains (dir->removed, dname))
+        return dent;
+
+    seaf_dent = lookup_base_dent (dir, dname);
+    if (!seaf_dent)
+        return NULL;
+
+    dent = seaf_dirent_to_changeset_dirent (seaf_dent);
+    g_hash_table_insert (dir->dents, g_strdup(dent->name), dent);
+
+    return dent;
+}
+
+/*
+ * Find a dirent without copying it. Base entries are returned in @tmp,
+ * with strings that belong to the base dir.
+ */
+static ChangeSetDirent *
+peek_dent (ChangeSetDir *dir, const char *dname, ChangeSetDirent *tmp)
+{
+    ChangeSetDirent *dent;
+    SeafDirent *seaf_dent;
+
+    dent = g_hash_table_lookup (dir->dents, dname);
+    if (dent || g_hash_table_contains (dir->removed, dname))
+        return dent;
+
+    seaf_dent = lookup_base_dent (dir, dname);
+    if (!seaf_dent)
+        return NULL;
+
+    memset (tmp, 0, sizeof(*tmp));
+    tmp->mode = seaf_dent->mode;
+    memcpy (tmp->id, seaf_dent->id, 41);
+    tmp->name = seaf_dent->name;
+    tmp->mtime = seaf_dent->mtime;
+    tmp->modifier = seaf_dent->modifier;
+    tmp->size = seaf_dent->size;
+
+    return tmp;
+}
+
+#if defined WIN32 || defined __APPLE__
+static void
+add_case_index (GHashTable *dents_i, const char *name)
+{
+    char *dup = g_strdup (name);
+
+    g_hash_table_replace (dents_i, dup, dup);
+}
+
+static GHashTable *
+get_case_index (ChangeSetDir *dir)
+{
+    GHashTableIter iter;
+    gpointer key;
+    SeafDirent *seaf_dent;
+    guint i;
+
+    if (dir->dents_i)
+        return dir->dents_i;
+
+    /* Each name is both the key and the value, compared ignoring case. */
+    dir->dents_i = g_hash_table_new_full (utf8_case_hash, utf8_case_equal,
+                                          g_free, NULL);
+    for (i = 0; i < dir->n_base_dents; ++i) {
+        seaf_dent = dir->base_dents[i];
+        if (base_dent_visible (dir, seaf_dent))
+            add_case_index (dir->dents_i, seaf_dent->name);
+    }
+    g_hash_table_iter_init (&iter, dir->dents);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        add_case_index (dir->dents_i, key);
+
+    return dir->dents_i;
+}
+#endif
+
+/* Add a dirent whose name is not in @dir yet. */
 static void
 add_dent_to_dir (ChangeSetDir *dir, ChangeSetDirent *dent)
 {
     g_hash_table_insert (dir->dents,
                          g_strdup(dent->name),
                          dent);
+    dir->n_dents++;
 #if defined WIN32 || defined __APPLE__
-    g_hash_table_insert (dir->dents_i,
-                         g_utf8_strdown(dent->name, -1),
-                         dent);
+    if (dir->dents_i)
+        add_case_index (dir->dents_i, dent->name);
 #endif
 }
 
+/* Remove a dirent returned by lookup_dent(), without freeing it. */
 static void
 remove_dent_from_dir (ChangeSetDir *dir, const char *dname)
 {
     char *key;
 
-    if (g_hash_table_lookup_extended (dir->dents, dname,
-                                      (gpointer*)&key, NULL)) {
-        g_hash_table_steal (dir->dents, dname);
-        g_free (key);
-    }
+    if (!g_hash_table_lookup_extended (dir->dents, dname,
+                                       (gpointer*)&key, NULL))
+        return;
+
+    g_hash_table_steal (dir->dents, dname);
+    g_free (key);
+    if (lookup_base_dent (dir, dname))
+        g_hash_table_add (dir->removed, g_strdup(dname));
+    dir->n_dents--;
 #if defined WIN32 || defined __APPLE__
-    char *dname_i = g_utf8_strdown (dname, -1);
-    g_hash_table_remove (dir->dents_i, dname_i);
-    g_free (dname_i);
+    if (dir->dents_i)
+        g_hash_table_remove (dir->dents_i, dname);
 #endif
 }
 
+/* Takes ownership of @base. */
 static ChangeSetDir *
-changeset_dir_new (int version, const char *id, GList *dirents)
+changeset_dir_new (int version, const char *id, SeafDir *base)
 {
     ChangeSetDir *dir = g_new0 (ChangeSetDir, 1);
     GList *ptr;
-    SeafDirent *dent;
-    ChangeSetDirent *changeset_dent;
+    gboolean sorted = TRUE;
+    guint i = 0;
 
     dir->version = version;
     if (id)
         memcpy (dir->dir_id, id, 40);
     dir->dents = g_hash_table_new_full (g_str_hash, g_str_equal,
                                         g_free, (GDestroyNotify)changeset_dirent_free);
-#if defined WIN32 || defined __APPLE__
-    dir->dents_i = g_hash_table_new_full (g_str_hash, g_str_equal,
+    dir->removed = g_hash_table_new_full (g_str_hash, g_str_equal,
                                           g_free, NULL);
-#endif
-    for (ptr = dirents; ptr; ptr = ptr->next) {
-        dent = ptr->data;
-        changeset_dent = seaf_dirent_to_changeset_dirent(dent);
-        add_dent_to_dir (dir, changeset_dent);
+
+    if (!base)
+        return dir;
+
+    dir->base = base;
+    dir->n_base_dents = g_list_length (base->entries);
+    dir->base_dents = g_new (SeafDirent *, dir->n_base_dents);
+    for (ptr = base->entries; ptr; ptr = ptr->next) {
+        dir->base_dents[i] = ptr->data;
+        if (i > 0 &&
+            strcmp (dir->base_dents[i-1]->name, dir->base_dents[i]->name) < 0)
+            sorted = FALSE;
+        ++i;
     }
+    /* Only some very old dir objects are not sorted. */
+    if (!sorted)
+        qsort (dir->base_dents, dir->n_base_dents, sizeof(SeafDirent *),
+               compare_dent_ptrs);
+    dir->n_dents = dir->n_base_dents;
 
     return dir;
 } 
@@ -152,51 +327,108 @@ changeset_dir_free (ChangeSetDir *dir)
     if (!dir)
         return;
     g_hash_table_destroy (dir->dents);
+    g_hash_table_destroy (dir->removed);
+    g_free (dir->base_dents);
+    seaf_dir_free (dir->base);
 #if defined WIN32 || defined __APPLE__
-    g_hash_table_destroy (dir->dents_i);
+    if (dir->dents_i)
+        g_hash_table_destroy (dir->dents_i);
 #endif
     g_free (dir);
 }
 
+/* Takes ownership of @seaf_dir. */
 static ChangeSetDir *
 seaf_dir_to_changeset_dir (SeafDir *seaf_dir)
 {
-    return changeset_dir_new (seaf_dir->version, seaf_dir->dir_id, seaf_dir->entries);
-}
-
-static gint
-compare_dents (gconstpointer a, gconstpointer b)
-{
-    const SeafDirent *denta = a, *dentb = b;
-
-    return strcmp(dentb->name, denta->name);
+    return changeset_dir_new (seaf_dir->version, seaf_dir->dir_id, seaf_dir);
 }
 
 static SeafDir *
 changeset_dir_to_seaf_dir (ChangeSetDir *dir)
 {
-    GList *dents = NULL, *seaf_dents = NULL;
+    GList *values, *changed = NULL, *seaf_dents = NULL;
     GList *ptr;
-    ChangeSetDirent *dent;
-    SeafDirent *seaf_dent;
+    SeafDirent *base_dent;
     SeafDir *seaf_dir;
-
-    dents = g_hash_table_get_values (dir->dents);
-    for (ptr = dents; ptr; ptr = ptr->next) {
-        dent = ptr->data;
-        seaf_dent = changeset_dirent_to_seaf_dirent (dir->version, dent);
-        seaf_dents = g_list_prepend (seaf_dents, seaf_dent);
+    guint i = 0;
+
+    values = g_hash_table_get_values (dir->dents);
+    for (ptr = values; ptr; ptr = ptr->next)
+        changed = g_list_prepend (changed,
+                                  changeset_dirent_to_seaf_dirent (dir->version,
+                                                                   ptr->data));
+    g_list_free (values);
+    changed = g_list_sort (changed, compare_dents);
+
+    /* Merge the changed dirents into the remaining base entries, in
+     * descending order. */
+    ptr = changed;
+    while (ptr || i < dir->n_base_dents) {
+        base_dent = i < dir->n_base_dents ? dir->base_dents[i] : NULL;
+        if (base_dent && !base_dent_visible (dir, base_dent)) {
+            ++i;
+            continue;
+        }
+        if (base_dent &&
+            (!ptr || compare_dents (base_dent, ptr->data) < 0)) {
+            seaf_dents = g_list_prepend (seaf_dents, base_dent);
+            ++i;
+        } else {
+            seaf_dents = g_list_prepend (seaf_dents, ptr->data);
+            ptr = ptr->next;
+        }
     }
-    /* Sort it in descending order. */
-    seaf_dents = g_list_sort (seaf_dents, compare_dents);
+    seaf_dents = g_list_reverse (seaf_dents);
 
-    /* seaf_dir_new() computes the dir id. */
+    /* seaf_dir_new() computes the dir id and the on-disk data. */
     seaf_dir = seaf_dir_new (NULL, seaf_dents, dir->version);
 
-    g_list_free (dents);
+    /* The base entries are only borrowed, and nothing needs the entries
+     * once the data is built. */
+    seaf_dir->entries = NULL;
+    g_list_free (seaf_dents);
+    g_list_free_full (changed, (GDestroyNotify)seaf_dirent_free);
+
     return seaf_dir;
 }
 
+/* Trees of the last commit of each repo, kept for the next commit. */
+
+/* Don't keep trees with more than this many dirs loaded. */
+#define MAX_CACHED_TREE_DIRS 1000
+
+typedef struct CachedTree {
+    ChangeSetDir *root;
+    int n_dirs;
+} CachedTree;
+
+static GHashTable *cached_trees;
+static pthread_mutex_t cached_trees_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+cached_tree_free (CachedTree *tree)
+{
+    changeset_dir_free (tree->root);
+    g_free (tree);
+}
+
+static CachedTree *
+steal_cached_tree (const char *repo_id)
+{
+    CachedTree *tree = NULL;
+
+    pthread_mutex_lock (&cached_trees_lock);
+    if (cached_trees) {
+        tree = g_hash_table_lookup (cached_trees, repo_id);
+        if (tree)
+            g_hash_table_steal (cached_trees, repo_id);
+    }
+    pthread_mutex_unlock (&cached_trees_lock);
+
+    return tree;
+}
+
 /* Change set. */
 
 #define CASE_CONFLICT_PATTERN " \\(case conflict \\d+\\)"
@@ -209,6 +441,8 @@ changeset_new (const char *repo_id)
     SeafDir *seaf_dir = NULL;
     ChangeSetDir *changeset_dir = NULL;
     ChangeSet *changeset = NULL;
+    CachedTree *cached;
+    int n_dirs = 1;
 
     repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
     if (!repo) {
@@ -226,19 +460,29 @@ changeset_new (const char *repo_id)
         return NULL;
     }
 
-    seaf_dir = seaf_fs_manager_get_seafdir_sorted (seaf->fs_mgr,
-                                                   repo_id,
-                                                   repo->version,
-                                                   commit->root_id);
-    if (!seaf_dir) {
-        seaf_warning ("Failed to find root dir %s in repo %s\n",
-                      repo->root_id, repo_id);
-        goto out;
-    }
+    /* Reuse the dirs loaded by the last commit if head hasn't moved since. */
+    cached = steal_cached_tree (repo_id);
+    if (cached && strcmp (cached->root->dir_id, commit->root_id) == 0) {
+        changeset_dir = cached->root;
+        n_dirs = cached->n_dirs;
+        g_free (cached);
+    } else {
+        if (cached)
+            cached_tree_free (cached);
+
+        seaf_dir = seaf_fs_manager_get_seafdir_sorted (seaf->fs_mgr,
+                                                       repo_id,
+                                                       repo->version,
+                                                       commit->root_id);
+        if (!seaf_dir) {
+            seaf_warning ("Failed to find root dir %s in repo %s\n",
+                          repo->root_id, repo_id);
+            goto out;
+        }
 
-    changeset_dir = seaf_dir_to_changeset_dir (seaf_dir);
-    if (!changeset_dir)
-        goto out;
+        changeset_dir = seaf_dir_to_changeset_dir (seaf_dir);
+        seaf_dir = NULL;
+    }
 
     GError *error = NULL;
     GRegex *case_conflict_pattern = g_regex_new(CASE_CONFLICT_PATTERN,
@@ -246,6 +490,7 @@ changeset_new (const char *repo_id)
     if (error) {
         seaf_warning ("Failed to create regex '%s': %s\n",
                       CASE_CONFLICT_PATTERN, error->message);
+        changeset_dir_free (changeset_dir);
         goto out;
     }
 
@@ -253,6 +498,7 @@ changeset_new (const char *repo_id)
     memcpy (changeset->repo_id, repo_id, 36);
     changeset->tree_root = changeset_dir;
     changeset->case_conflict_pattern = case_conflict_pattern;
+    changeset->n_dirs = n_dirs;
 
 out:
     seaf_commit_unref (commit);
@@ -271,6 +517,47 @@ changeset_free (ChangeSet *changeset)
     g_free (changeset);
 }
 
+void
+changeset_cache_tree (ChangeSet *changeset)
+{
+    CachedTree *tree;
+
+    if (changeset->tree_root->changed ||
+        changeset->n_dirs > MAX_CACHED_TREE_DIRS)
+        return;
+
+    tree = g_new0 (CachedTree, 1);
+    tree->root = changeset->tree_root;
+    tree->n_dirs = changeset->n_dirs;
+    changeset->tree_root = NULL;
+
+    pthread_mutex_lock (&cached_trees_lock);
+    if (!cached_trees)
+        cached_trees = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify)cached_tree_free);
+    g_hash_table_replace (cached_trees, g_strdup(changeset->repo_id), tree);
+    pthread_mutex_unlock (&cached_trees_lock);
+}
+
+void
+changeset_drop_cached_tree (const char *repo_id)
+{
+    CachedTree *tree = steal_cached_tree (repo_id);
+
+    if (tree)
+        cached_tree_free (tree);
+}
+
+/* Mark the dirs on a path as changed, from the root down. */
+static void
+mark_dirs_changed (GPtrArray *dirs)
+{
+    guint i;
+
+    for (i = 0; i < dirs->len; ++i)
+        ((ChangeSetDir *)g_ptr_array_index (dirs, i))->changed = TRUE;
+}
+
 static gboolean
 update_file (ChangeSetDirent *dent,
              unsigned char *sha1,
@@ -351,7 +638,7 @@ handle_case_conflict (ChangeSet *changeset,
             return;
         }
 
-        dent = g_hash_table_lookup (dir->dents, conflict_dname);
+        dent = lookup_dent (dir, conflict_dname);
         if (dent) {
             remove_dent_from_dir (dir, conflict_dname);
             changeset_dirent_free (dent);
@@ -377,17 +664,19 @@ add_to_tree (ChangeSet *changeset,
     ChangeSetDirent *dent;
     ChangeSetDirent *parent_dent = NULL;
     SeafDir *seaf_dir;
-    gboolean changed;
+    gboolean changed = FALSE;
+    GPtrArray *path_dirs = g_ptr_array_new ();
 
     parts = g_strsplit (path, "/", 0);
     n = g_strv_length(parts);
     dir = root;
+    g_ptr_array_add (path_dirs, dir);
     for (i = 0; i < n; i++) {
 #if defined WIN32 || defined __APPLE__
     try_again:
 #endif
         dname = parts[i];
-        dent = g_hash_table_lookup (dir->dents, dname);
+        dent = lookup_dent (dir, dname);
 
         if (dent) {
             if (S_ISDIR(dent->mode)) {
@@ -406,14 +695,15 @@ add_to_tree (ChangeSet *changeset,
                         break;
                     }
                     dent->subdir = seaf_dir_to_changeset_dir (seaf_dir);
-                    seaf_dir_free (seaf_dir);
+                    changeset->n_dirs++;
                 }
                 dir = dent->subdir;
                 parent_dent = dent;
+                g_ptr_array_add (path_dirs, dir);
             } else if (S_ISREG(dent->mode)) {
                 if (i == (n-1)) {
                     /* File exists, update it. */
-                    changed = update_file (dent, sha1, st, modifier);
+                    changed |= update_file (dent, sha1, st, modifier);
                     // update parent dir mtime when modify files locally.
                     if (parent_dent && changed) {
                         parent_dent->mtime = st->st_mtime;
@@ -425,15 +715,16 @@ add_to_tree (ChangeSet *changeset,
 #if defined WIN32 || defined __APPLE__
             /* Only effective for add operation, not applicable to rename. */
             if (!new_dent) {
-                char *search_key = g_utf8_strdown (dname, -1);
-                dent = g_hash_table_lookup (dir->dents_i, search_key);
-                g_free (search_key);
+                const char *name_i = g_hash_table_lookup (get_case_index (dir),
+                                                          dname);
+                dent = name_i ? lookup_dent (dir, name_i) : NULL;
                 if (dent) {
                     remove_dent_from_dir (dir, dent->name);
 
                     g_free (dent->name);
                     dent->name = g_strdup(dname);
                     add_dent_to_dir (dir, dent);
+                    changed = TRUE;
 
                     goto try_again;
                 }
@@ -442,6 +733,7 @@ add_to_tree (ChangeSet *changeset,
             }
 #endif
 
+            changed = TRUE;
             if (i == (n-1)) {
                 if (parent_dent && new_dent) {
                     // update parent dir mtime when rename files locally.
@@ -453,10 +745,16 @@ add_to_tree (ChangeSet *changeset,
                 create_new_dent (dir, dname, sha1, st, modifier, new_dent);
             } else {
                 dir = create_intermediate_dir (dir, dname, st);
+                changeset->n_dirs++;
+                g_ptr_array_add (path_dirs, dir);
             }
         }
     }
 
+    if (changed)
+        mark_dirs_changed (path_dirs);
+
+    g_ptr_array_free (path_dirs, TRUE);
     g_strfreev (parts);
 }
 
@@ -473,16 +771,18 @@ delete_from_tree (ChangeSet *changeset,
     ChangeSetDirent *dent, *ret = NULL;
     ChangeSetDirent *parent_dent = NULL;
     SeafDir *seaf_dir;
+    GPtrArray *path_dirs = g_ptr_array_new ();
 
     *parent_empty = FALSE;
 
     parts = g_strsplit (path, "/", 0);
     n = g_strv_length(parts);
     dir = root;
+    g_ptr_array_add (path_dirs, dir);
     for (i = 0; i < n; i++) {
         dname = parts[i];
 
-        dent = g_hash_table_lookup (dir->dents, dname);
+        dent = lookup_dent (dir, dname);
         if (!dent)
             break;
 
@@ -490,7 +790,7 @@ delete_from_tree (ChangeSet *changeset,
             if (i == (n-1)) {
                 /* Remove from hash table without freeing dent. */
                 remove_dent_from_dir (dir, dname);
-                if (g_hash_table_size (dir->dents) == 0)
+                if (dir->n_dents == 0)
                     *parent_empty = TRUE;
                 ret = dent;
                 // update parent dir mtime when delete dirs locally.
@@ -511,15 +811,16 @@ delete_from_tree (ChangeSet *changeset,
                     break;
                 }
                 dent->subdir = seaf_dir_to_changeset_dir (seaf_dir);
-                seaf_dir_free (seaf_dir);
+                changeset->n_dirs++;
             }
             dir = dent->subdir;
             parent_dent = dent;
+            g_ptr_array_add (path_dirs, dir);
         } else if (S_ISREG(dent->mode)) {
             if (i == (n-1)) {
                 /* Remove from hash table without freeing dent. */
                 remove_dent_from_dir (dir, dname);
-                if (g_hash_table_size (dir->dents) == 0)
+                if (dir->n_dents == 0)
                     *parent_empty = TRUE;
                 ret = dent;
                 // update parent dir mtime when delete files locally.
@@ -531,6 +832,10 @@ delete_from_tree (ChangeSet *changeset,
         }
     }
 
+    if (ret)
+        mark_dirs_changed (path_dirs);
+
+    g_ptr_array_free (path_dirs, TRUE);
     g_strfreev (parts);
     return ret;
 }
@@ -628,10 +933,13 @@ commit_tree_recursive (const char *repo_id, ChangeSetDir *dir)
     SeafDir *seaf_dir;
     char *ret = NULL;
 
+    if (!dir->changed)
+        return g_strdup (dir->dir_id);
+
     g_hash_table_iter_init (&iter, dir->dents);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         dent = value;
-        if (dent->subdir) {
+        if (dent->subdir && dent->subdir->changed) {
             new_id = commit_tree_recursive (repo_id, dent->subdir);
             if (!new_id)
                 return NULL;
@@ -656,6 +964,7 @@ commit_tree_recursive (const char *repo_id, ChangeSetDir *dir)
     }
 
     ret = g_strdup(seaf_dir->dir_id);
+    dir->changed = FALSE;
 
 out:
     seaf_dir_free (seaf_dir);
@@ -666,6 +975,7 @@ out:
  * This function does two things:
  * - calculate dir id from bottom up;
  * - create and save seaf dir objects.
+ * Only the changed dirs are visited, the others keep their ids.
  * It returns root dir id of the new commit.
  */
 char *
@@ -688,7 +998,7 @@ changeset_check_path (ChangeSet *changeset,
     char **parts, *dname;
     int n, i;
     ChangeSetDir *dir;
-    ChangeSetDirent *dent;
+    ChangeSetDirent *dent, tmp;
     gboolean ret = FALSE;
     char id[41];
 
@@ -700,7 +1010,7 @@ changeset_check_path (ChangeSet *changeset,
     for (i = 0; i < n; i++) {
         dname = parts[i];
 
-        dent = g_hash_table_lookup (dir->dents, dname);
+        dent = peek_dent (dir, dname, &tmp);
         if (!dent) {
             seaf_message ("Changeset mismatch: path component %s of %s not found\n",
                           dname, path);
@@ -14,6 +14,8 @@ struct _ChangeSet {
     struct _ChangeSetDir *tree_root;
     /* Used to match case conflict paths. */
     GRegex *case_conflict_pattern;
+    /* Number of dirs loaded into tree_root. */
+    int n_dirs;
 };
 typedef struct _ChangeSet ChangeSet;
 
@@ -45,6 +47,17 @@ remove_from_changeset (ChangeSet *changeset,
 char *
 commit_tree_from_changeset (ChangeSet *changeset);
 
+/*
+ * Keep the committed tree of @changeset, so that the next changeset_new()
+ * for the repo doesn't have to load the same dirs again, as long as head
+ * still points to that tree. The changeset must still be freed.
+ */
+void
+changeset_cache_tree (ChangeSet *changeset);
+
+void
+changeset_drop_cached_tree (const char *repo_id);
+
 gboolean
 changeset_check_path (ChangeSet *changeset,
                       const char *path,
@@ -96,6 +96,20 @@ mark_clone_done_v2 (SeafRepo *repo, CloneTask *task)
                                              "true");
     }
 
+    if (task->on_demand) {
+        seaf_repo_manager_set_repo_property (seaf->repo_mgr,
+                                             repo->id,
+                                             REPO_PROP_ON_DEMAND,
+                                             "true");
+    }
+
+    if (task->sync_filter) {
+        seaf_repo_manager_set_repo_property (seaf->repo_mgr,
+                                             repo->id,
+                                             REPO_PROP_SYNC_FILTER,
+                                             task->sync_filter);
+    }
+
     if (task->server_url)
         repo->server_url = g_strdup(task->server_url);
 
@@ -159,6 +173,86 @@ start_clone_v2 (CloneTask *task)
         transition_to_error (task, SYNC_ERROR_ID_NOT_ENOUGH_MEMORY);
 }
 
+/*
+ * Only a few clones download at the same time, at most as many as the
+ * sync tasks that can run at once. The others wait with their head commit
+ * checked, and the smallest libraries are started first, so that most of
+ * the libraries of a new account are ready soon.
+ */
+static int
+max_clone_transfers ()
+{
+    if (!seaf->sync_mgr || seaf->sync_mgr->max_running_tasks <= 0)
+        return DEFAULT_MAX_RUNNING_SYNC_TASKS;
+    return seaf->sync_mgr->max_running_tasks;
+}
+
+/* TRUE if @a should be started before @b. Unknown sizes go last. */
+static gboolean
+clone_task_before (CloneTask *a, CloneTask *b)
+{
+    if (a->size >= 0 && b->size >= 0 && a->size != b->size)
+        return a->size < b->size;
+    if ((a->size >= 0) != (b->size >= 0))
+        return a->size >= 0;
+    return a->ready_seq < b->ready_seq;
+}
+
+static void
+start_ready_transfers (SeafCloneManager *mgr)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    CloneTask *task, *next;
+    int n_running = 0;
+
+    g_hash_table_iter_init (&iter, mgr->tasks);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        task = value;
+        if (task->state == CLONE_STATE_FETCH)
+            ++n_running;
+    }
+
+    while (n_running < max_clone_transfers ()) {
+        next = NULL;
+        g_hash_table_iter_init (&iter, mgr->tasks);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            task = value;
+            if (!task->head_ready)
+                continue;
+            if (task->state == CLONE_STATE_CANCEL_PENDING) {
+                task->head_ready = FALSE;
+                transition_state (task, CLONE_STATE_CANCELED);
+                continue;
+            }
+            if (task->state != CLONE_STATE_CHECK_SERVER) {
+                task->head_ready = FALSE;
+                continue;
+            }
+            if (!next || clone_task_before (task, next))
+                next = task;
+        }
+        if (!next)
+            break;
+
+        next->head_ready = FALSE;
+        start_clone_v2 (next);
+        if (next->state == CLONE_STATE_FETCH)
+            ++n_running;
+    }
+}
+
+static void
+task_head_ready (CloneTask *task, const char *head_id)
+{
+    static guint ready_seq = 0;
+
+    memcpy (task->server_head_id, head_id, 40);
+    task->head_ready = TRUE;
+    task->ready_seq = ++ready_seq;
+    start_ready_transfers (task->manager);
+}
+
 static void
 check_head_commit_done (HttpHeadCommit *result, void *user_data)
 {
@@ -170,8 +264,7 @@ check_head_commit_done (HttpHeadCommit *result, void *user_data)
     }
 
     if (result->check_success && !result->is_corrupt && !result->is_deleted) {
-        memcpy (task->server_head_id, result->head_commit, 40);
-        start_clone_v2 (task);
+        task_head_ready (task, result->head_commit);
     } else {
         transition_to_error (task, result->error_code);
     }
@@ -219,69 +312,316 @@ http_fileserver_url (const char *url)
     return ret;
 }
 
+/*
+ * The clone tasks of a server are checked in batches: the tasks added
+ * while a check is running wait for it, then are checked together with
+ * one protocol version request and one head-commits-multi request.
+ * Repos whose head isn't in the multi response are checked one by one,
+ * to get the exact error.
+ */
+typedef struct ServerCheck {
+    SeafCloneManager *mgr;
+    char *server_url;
+    /* Repo ids of the tasks waiting for the next check. */
+    GList *waiting;
+    /* Repo ids of the tasks being checked. */
+    GList *batch;
+    gboolean running;
+
+    int http_protocol_version;
+    char *effective_url;
+    gboolean use_fileserver_port;
+} ServerCheck;
+
 static void
-check_http_fileserver_protocol_done (HttpProtocolVersion *result, void *user_data)
+server_check_free (ServerCheck *check)
 {
-    CloneTask *task = user_data;
+    g_free (check->server_url);
+    g_list_free_full (check->waiting, g_free);
+    g_list_free_full (check->batch, g_free);
+    g_free (check->effective_url);
+    g_free (check);
+}
+
+static void
+start_server_check (ServerCheck *check);
+
+/* Returns the task of @repo_id if it's still waiting for the check. */
+static CloneTask *
+get_batch_task (ServerCheck *check, const char *repo_id)
+{
+    CloneTask *task = g_hash_table_lookup (check->mgr->tasks, repo_id);
+
+    if (!task)
+        return NULL;
 
     if (task->state == CLONE_STATE_CANCEL_PENDING) {
         transition_state (task, CLONE_STATE_CANCELED);
-        return;
+        return NULL;
     }
+    if (task->state != CLONE_STATE_CHECK_SERVER || task->head_ready)
+        return NULL;
 
-    if (result->check_success && !result->not_supported) {
-        task->http_protocol_version = result->version;
-        task->effective_url = http_fileserver_url (task->server_url);
-        task->use_fileserver_port = TRUE;
-        http_check_head_commit (task);
-    } else {
+    return task;
+}
+
+static void
+finish_server_check (ServerCheck *check)
+{
+    g_list_free_full (check->batch, g_free);
+    check->batch = NULL;
+    check->running = FALSE;
+
+    if (check->waiting)
+        start_server_check (check);
+}
+
+static void
+fail_server_check (ServerCheck *check, int error)
+{
+    GList *ptr;
+    CloneTask *task;
+
+    for (ptr = check->batch; ptr; ptr = ptr->next) {
+        task = get_batch_task (check, ptr->data);
         /* Wait for periodic retry. */
-        transition_to_error (task, result->error_code);
+        if (task)
+            transition_to_error (task, error);
     }
+
+    finish_server_check (check);
 }
 
 static void
-check_http_protocol_done (HttpProtocolVersion *result, void *user_data)
+check_heads_one_by_one (ServerCheck *check)
 {
-    CloneTask *task = user_data;
+    GList *ptr;
+    CloneTask *task;
 
-    if (task->state == CLONE_STATE_CANCEL_PENDING) {
-        transition_state (task, CLONE_STATE_CANCELED);
+    for (ptr = check->batch; ptr; ptr = ptr->next) {
+        task = get_batch_task (check, ptr->data);
+        if (task)
+            http_check_head_commit (task);
+    }
+
+    finish_server_check (check);
+}
+
+typedef struct HeadCommitsData {
+    ServerCheck *check;
+    char *host;
+    gboolean use_fileserver_port;
+    GList *repo_ids;
+    GHashTable *map;
+} HeadCommitsData;
+
+static void *
+get_head_commits_thread (void *vdata)
+{
+    HeadCommitsData *data = vdata;
+    int status = 0;
+
+    data->map = http_tx_manager_get_head_commit_ids (seaf->http_tx_mgr,
+                                                     data->host,
+                                                     data->use_fileserver_port,
+                                                     data->repo_ids,
+                                                     &status);
+    return vdata;
+}
+
+static void
+get_head_commits_done (void *vdata)
+{
+    HeadCommitsData *data = vdata;
+    ServerCheck *check = data->check;
+    GList *ptr;
+    CloneTask *task;
+    const char *head;
+
+    if (!data->map) {
+        check_heads_one_by_one (check);
+        goto out;
+    }
+
+    for (ptr = check->batch; ptr; ptr = ptr->next) {
+        task = get_batch_task (check, ptr->data);
+        if (!task)
+            continue;
+
+        head = g_hash_table_lookup (data->map, task->repo_id);
+        if (head && strlen (head) == 40)
+            task_head_ready (task, head);
+        else
+            http_check_head_commit (task);
+    }
+
+    finish_server_check (check);
+
+out:
+    if (data->map)
+        g_hash_table_destroy (data->map);
+    g_free (data->host);
+    g_list_free_full (data->repo_ids, g_free);
+    g_free (data);
+}
+
+static void
+check_heads (ServerCheck *check)
+{
+    HeadCommitsData *data;
+    GList *ptr;
+    CloneTask *task;
+
+    /* Same condition as the head commit polling of the sync manager. */
+    if (check->http_protocol_version < 2 ||
+        !check->batch || !check->batch->next) {
+        check_heads_one_by_one (check);
+        return;
+    }
+
+    data = g_new0 (HeadCommitsData, 1);
+    data->check = check;
+    data->host = g_strdup (check->effective_url);
+    data->use_fileserver_port = check->use_fileserver_port;
+
+    for (ptr = check->batch; ptr; ptr = ptr->next) {
+        task = get_batch_task (check, ptr->data);
+        if (!task)
+            continue;
+        task->http_protocol_version = check->http_protocol_version;
+        g_free (task->effective_url);
+        task->effective_url = g_strdup (check->effective_url);
+        task->use_fileserver_port = check->use_fileserver_port;
+        data->repo_ids = g_list_prepend (data->repo_ids,
+                                         g_strdup (task->repo_id));
+    }
+
+    if (!data->repo_ids) {
+        g_free (data->host);
+        g_free (data);
+        finish_server_check (check);
         return;
     }
 
+    if (seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                     JOB_PRIORITY_INTERACTIVE,
+                                                     get_head_commits_thread,
+                                                     get_head_commits_done,
+                                                     data) < 0) {
+        g_free (data->host);
+        g_list_free_full (data->repo_ids, g_free);
+        g_free (data);
+        check_heads_one_by_one (check);
+    }
+}
+
+static void
+set_batch_protocol (ServerCheck *check, int version,
+                    char *effective_url, gboolean use_fileserver_port)
+{
+    GList *ptr;
+    CloneTask *task;
+
+    check->http_protocol_version = version;
+    g_free (check->effective_url);
+    check->effective_url = effective_url;
+    check->use_fileserver_port = use_fileserver_port;
+
+    for (ptr = check->batch; ptr; ptr = ptr->next) {
+        task = get_batch_task (check, ptr->data);
+        if (!task)
+            continue;
+        task->http_protocol_version = version;
+        g_free (task->effective_url);
+        task->effective_url = g_strdup (effective_url);
+        task->use_fileserver_port = use_fileserver_port;
+    }
+}
+
+static void
+check_http_fileserver_protocol_done (HttpProtocolVersion *result, void *user_data)
+{
+    ServerCheck *check = user_data;
+
+    if (result->check_success && !result->not_supported) {
+        set_batch_protocol (check, result->version,
+                            http_fileserver_url (check->server_url), TRUE);
+        check_heads (check);
+    } else {
+        fail_server_check (check, result->error_code);
+    }
+}
+
+static void
+check_http_protocol_done (HttpProtocolVersion *result, void *user_data)
+{
+    ServerCheck *check = user_data;
+
     if (result->check_success && !result->not_supported) {
-        task->http_protocol_version = result->version;
-        task->effective_url = g_strdup(task->server_url);
-        http_check_head_commit (task);
-    } else if (strncmp(task->server_url, "https", 5) != 0) {
-        char *host_fileserver = http_fileserver_url(task->server_url);
+        set_batch_protocol (check, result->version,
+                            g_strdup (check->server_url), FALSE);
+        check_heads (check);
+    } else if (strncmp(check->server_url, "https", 5) != 0) {
+        char *host_fileserver = http_fileserver_url(check->server_url);
         if (http_tx_manager_check_protocol_version (seaf->http_tx_mgr,
                                                     host_fileserver,
                                                     TRUE,
                                                     check_http_fileserver_protocol_done,
-                                                    task) < 0)
-            transition_to_error (task, SYNC_ERROR_ID_NOT_ENOUGH_MEMORY);
+                                                    check) < 0)
+            fail_server_check (check, SYNC_ERROR_ID_NOT_ENOUGH_MEMORY);
         g_free (host_fileserver);
     } else {
-        /* Wait for periodic retry. */
-        transition_to_error (task, result->error_code);
+        fail_server_check (check, result->error_code);
     }
 }
 
 static void
-check_http_protocol (CloneTask *task)
+start_server_check (ServerCheck *check)
 {
+    check->batch = check->waiting;
+    check->waiting = NULL;
+    check->running = TRUE;
+
+    seaf_debug ("Checking server %s for %u clone tasks.\n",
+                check->server_url, g_list_length (check->batch));
+
     if (http_tx_manager_check_protocol_version (seaf->http_tx_mgr,
-                                                task->server_url,
+                                                check->server_url,
                                                 FALSE,
                                                 check_http_protocol_done,
-                                                task) < 0) {
-        transition_to_error (task, SYNC_ERROR_ID_NOT_ENOUGH_MEMORY);
+                                                check) < 0)
+        fail_server_check (check, SYNC_ERROR_ID_NOT_ENOUGH_MEMORY);
+}
+
+static void
+check_http_protocol (CloneTask *task)
+{
+    SeafCloneManager *mgr = task->manager;
+    ServerCheck *check;
+
+    if (!task->server_url) {
+        transition_to_error (task, SYNC_ERROR_ID_GENERAL_ERROR);
         return;
     }
 
+    check = g_hash_table_lookup (mgr->server_checks, task->server_url);
+    if (!check) {
+        check = g_new0 (ServerCheck, 1);
+        check->mgr = mgr;
+        check->server_url = g_strdup (task->server_url);
+        g_hash_table_insert (mgr->server_checks, check->server_url, check);
+    }
+
+    task->head_ready = FALSE;
     transition_state (task, CLONE_STATE_CHECK_SERVER);
+
+    if (!g_list_find_custom (check->waiting, task->repo_id,
+                             (GCompareFunc)strcmp))
+        check->waiting = g_list_append (check->waiting,
+                                        g_strdup (task->repo_id));
+
+    if (!check->running)
+        start_server_check (check);
 }
 
 static CloneTask *
@@ -303,6 +643,7 @@ clone_task_new (const char *repo_id,
     if (passwd)
         task->passwd = g_strdup (passwd);
     task->error = SYNC_ERROR_ID_NO_ERROR;
+    task->size = -1;
 
     return task;
 }
@@ -321,6 +662,7 @@ clone_task_free (CloneTask *task)
     g_free (task->random_key);
     g_free (task->server_url);
     g_free (task->effective_url);
+    g_free (task->sync_filter);
 
     g_free (task);
 }
@@ -349,6 +691,9 @@ seaf_clone_manager_new (SeafileSession *session)
     mgr->seaf = session;
     mgr->tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
                                         g_free, (GDestroyNotify)clone_task_free);
+    mgr->server_checks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                NULL,
+                                                (GDestroyNotify)server_check_free);
     return mgr;
 }
 
@@ -410,6 +755,19 @@ load_clone_repo_version_info (CloneTask *task)
                                  load_version_info_cb, task);
 }
 
+/* "sync_filter" may be given as a JSON object or as a string. */
+static char *
+load_sync_filter (json_t *object)
+{
+    json_t *filter = json_object_get (object, "sync_filter");
+
+    if (json_is_string (filter))
+        return g_strdup (json_string_value (filter));
+    if (json_is_object (filter))
+        return json_dumps (filter, 0);
+    return NULL;
+}
+
 static gboolean
 load_more_info_cb (sqlite3_stmt *stmt, void *data)
 {
@@ -427,12 +785,18 @@ load_more_info_cb (sqlite3_stmt *stmt, void *data)
         
     json_t *integer = json_object_get (object, "is_readonly");
     task->is_readonly = json_integer_value (integer);
+    integer = json_object_get (object, "on_demand");
+    task->on_demand = json_integer_value (integer);
+    task->sync_filter = load_sync_filter (object);
     json_t *string = json_object_get (object, "server_url");
     if (string)
         task->server_url = g_strdup (json_string_value (string));
     json_t *repo_salt = json_object_get (object, "repo_salt");
     if (repo_salt)
         task->repo_salt = g_strdup (json_string_value (repo_salt));
+    integer = json_object_get (object, "size");
+    if (json_is_integer (integer))
+        task->size = json_integer_value (integer);
     json_decref (object);
 
     return FALSE;
@@ -558,6 +922,8 @@ static int check_connect_pulse (void *vmanager)
         }
     }
 
+    start_ready_transfers (mgr);
+
     return TRUE;
 }
 
@@ -622,15 +988,22 @@ save_task_to_db (SeafCloneManager *mgr, CloneTask *task)
     }
     sqlite3_free (sql);
 
-    if (task->is_readonly || task->server_url || task->repo_salt) {
+    if (task->is_readonly || task->on_demand || task->sync_filter ||
+        task->server_url || task->repo_salt || task->size >= 0) {
         /* need to store more info */
         json_t *object = NULL;
         gchar *info = NULL;
 
         object = json_object ();
         json_object_set_new (object, "is_readonly", json_integer (task->is_readonly));
+        json_object_set_new (object, "on_demand", json_integer (task->on_demand));
+        if (task->sync_filter)
+            json_object_set_new (object, "sync_filter",
+                                 json_string (task->sync_filter));
         if (task->server_url)
             json_object_set_new (object, "server_url", json_string(task->server_url));
+        if (task->size >= 0)
+            json_object_set_new (object, "size", json_integer (task->size));
     
         info = json_dumps (object, 0);
         json_decref (object);
@@ -683,6 +1056,8 @@ remove_task_from_db (SeafCloneManager *mgr, const char *repo_id)
 static void
 transition_state (CloneTask *task, int new_state)
 {
+    int old_state = task->state;
+
     seaf_message ("Transition clone state for %.8s from [%s] to [%s].\n",
                   task->repo_id,
                   state_str[task->state], state_str[new_state]);
@@ -694,11 +1069,17 @@ transition_state (CloneTask *task, int new_state)
     }
 
     task->state = new_state;
+
+    /* A transfer slot is free. */
+    if (old_state == CLONE_STATE_FETCH)
+        start_ready_transfers (task->manager);
 }
 
 static void
 transition_to_error (CloneTask *task, int error)
 {
+    int old_state = task->state;
+
     seaf_message ("Transition clone state for %.8s from [%s] to [error]: %s.\n",
                   task->repo_id,
                   state_str[task->state], 
@@ -706,6 +1087,9 @@ transition_to_error (CloneTask *task, int error)
 
     task->state = CLONE_STATE_ERROR;
     task->error = error;
+
+    if (old_state == CLONE_STATE_FETCH)
+        start_ready_transfers (task->manager);
 }
 
 static int
@@ -1022,6 +1406,9 @@ add_task_common (SeafCloneManager *mgr,
         
         json_t *integer = json_object_get (object, "is_readonly");
         task->is_readonly = json_integer_value (integer);
+        integer = json_object_get (object, "on_demand");
+        task->on_demand = json_integer_value (integer);
+        task->sync_filter = load_sync_filter (object);
         json_t *string = json_object_get (object, "server_url");
         if (string)
             task->server_url = canonical_server_url (json_string_value (string));
@@ -1030,9 +1417,21 @@ add_task_common (SeafCloneManager *mgr,
             task->repo_salt = g_strdup (json_string_value (repo_salt));
         integer = json_object_get (object, "resync_enc_repo");
         task->resync_enc_repo = json_integer_value (integer);
+        integer = json_object_get (object, "size");
+        if (json_is_integer (integer))
+            task->size = json_integer_value (integer);
         json_decref (object);
     }
 
+    /* Placeholders would never be filled in. */
+    if (task->on_demand &&
+        !seaf_repo_manager_has_hydration_provider (seaf->repo_mgr)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "No hydration provider is registered");
+        clone_task_free (task);
+        return NULL;
+    }
+
     if (save_task_to_db (mgr, task) < 0) {
         seaf_warning ("[Clone mgr] failed to save task.\n");
         clone_task_free (task);
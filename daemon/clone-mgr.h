@@ -53,6 +53,13 @@ struct _CloneTask {
      * Worktree folder name will be kept in sync with library name if this is true.
      */
     gboolean             sync_wt_name;
+    /* Check out files as placeholders, see REPO_PROP_ON_DEMAND. */
+    gboolean             on_demand;
+    /* REPO_PROP_SYNC_FILTER to clone with, NULL to sync everything. */
+    char                *sync_filter;
+    /* Size of the library if known, -1 otherwise. Smaller libraries are
+     * downloaded first. */
+    gint64               size;
 
     /* Http sync fields */
     char                *server_url;
@@ -60,6 +67,9 @@ struct _CloneTask {
     gboolean             use_fileserver_port;
     int                  http_protocol_version;
     char                 server_head_id[41];
+    /* The head commit is known, the task waits for a transfer slot. */
+    gboolean             head_ready;
+    guint                ready_seq;
 };
 
 const char *
@@ -70,6 +80,8 @@ struct _SeafCloneManager {
     sqlite3                 *db;
     GHashTable              *tasks;
     struct SeafTimer       *check_timer;
+    /* Batched server checks, server url -> ServerCheck. */
+    GHashTable              *server_checks;
 };
 
 SeafCloneManager *
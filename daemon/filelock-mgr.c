@@ -11,9 +11,17 @@
 
 #include "db.h"
 
+/*
+ * Locked files are looked up for every path during checkout and index, so
+ * the tables are guarded by read-write locks. Each repo has its own lock,
+ * the global lock only guards adding and removing repos. Lookups and updates
+ * hold the global lock for reading while they use a repo, so the repo can't
+ * be removed under them.
+ */
 struct _FilelockMgrPriv {
+    /* repo_id -> RepoLocks */
     GHashTable *repo_locked_files;
-    pthread_mutex_t hash_lock;
+    pthread_rwlock_t hash_lock;
     sqlite3 *db;
     pthread_mutex_t db_lock;
 };
@@ -23,11 +31,89 @@ typedef struct _LockInfo {
     int locked_by_me;
 } LockInfo;
 
+typedef struct _RepoLocks {
+    pthread_rwlock_t lock;
+    /* path -> LockInfo */
+    GHashTable *files;
+} RepoLocks;
+
 /* When a file is locked by me, it can have two reasons:
  * - Locked by the user manually
  * - Auto-Locked by Seafile when it detects Office opens the file.
  */
 
+static void
+lock_info_free (LockInfo *info)
+{
+    g_free (info);
+}
+
+static RepoLocks *
+repo_locks_new ()
+{
+    RepoLocks *locks = g_new0 (RepoLocks, 1);
+
+    pthread_rwlock_init (&locks->lock, NULL);
+    locks->files = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, (GDestroyNotify)lock_info_free);
+    return locks;
+}
+
+static void
+repo_locks_free (RepoLocks *locks)
+{
+    g_hash_table_destroy (locks->files);
+    pthread_rwlock_destroy (&locks->lock);
+    g_free (locks);
+}
+
+/*
+ * Look up the locks of @repo_id and lock them for reading or writing.
+ * If @create is TRUE, an empty table is added for a new repo.
+ * Returns NULL if the repo has no locks. Release with unlock_repo().
+ */
+static RepoLocks *
+lock_repo (FilelockMgrPriv *priv, const char *repo_id,
+           gboolean write, gboolean create)
+{
+    RepoLocks *locks;
+
+    pthread_rwlock_rdlock (&priv->hash_lock);
+
+    locks = g_hash_table_lookup (priv->repo_locked_files, repo_id);
+    while (!locks && create) {
+        pthread_rwlock_unlock (&priv->hash_lock);
+
+        pthread_rwlock_wrlock (&priv->hash_lock);
+        if (!g_hash_table_lookup (priv->repo_locked_files, repo_id))
+            g_hash_table_insert (priv->repo_locked_files,
+                                 g_strdup(repo_id), repo_locks_new ());
+        pthread_rwlock_unlock (&priv->hash_lock);
+
+        pthread_rwlock_rdlock (&priv->hash_lock);
+        locks = g_hash_table_lookup (priv->repo_locked_files, repo_id);
+    }
+
+    if (!locks) {
+        pthread_rwlock_unlock (&priv->hash_lock);
+        return NULL;
+    }
+
+    if (write)
+        pthread_rwlock_wrlock (&locks->lock);
+    else
+        pthread_rwlock_rdlock (&locks->lock);
+
+    return locks;
+}
+
+static void
+unlock_repo (FilelockMgrPriv *priv, RepoLocks *locks)
+{
+    pthread_rwlock_unlock (&locks->lock);
+    pthread_rwlock_unlock (&priv->hash_lock);
+}
+
 struct _SeafFilelockManager *
 seaf_filelock_manager_new (struct _SeafileSession *session)
 {
@@ -39,24 +125,19 @@ seaf_filelock_manager_new (struct _SeafileSession *session)
 
     priv->repo_locked_files = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                      g_free,
-                                                     (GDestroyNotify)g_hash_table_destroy);
+                                                     (GDestroyNotify)repo_locks_free);
 
-    pthread_mutex_init (&priv->hash_lock, NULL);
+    pthread_rwlock_init (&priv->hash_lock, NULL);
     pthread_mutex_init (&priv->db_lock, NULL);
 
     return mgr;
 }
 
-static void
-lock_info_free (LockInfo *info)
-{
-    g_free (info);
-}
-
 static gboolean
 load_locked_files (sqlite3_stmt *stmt, void *data)
 {
-    GHashTable *repo_locked_files = data, *files;
+    GHashTable *repo_locked_files = data;
+    RepoLocks *locks;
     const char *repo_id, *path;
     int locked_by_me;
 
@@ -64,16 +145,16 @@ load_locked_files (sqlite3_stmt *stmt, void *data)
     path = (const char *)sqlite3_column_text (stmt, 1);
     locked_by_me = sqlite3_column_int (stmt, 2);
 
-    files = g_hash_table_lookup (repo_locked_files, repo_id);
-    if (!files) {
-        files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)lock_info_free);
-        g_hash_table_insert (repo_locked_files, g_strdup(repo_id), files);
+    locks = g_hash_table_lookup (repo_locked_files, repo_id);
+    if (!locks) {
+        locks = repo_locks_new ();
+        g_hash_table_insert (repo_locked_files, g_strdup(repo_id), locks);
     }
 
     char *key = g_strdup(path);
     LockInfo *info = g_new0 (LockInfo, 1);
     info->locked_by_me = locked_by_me;
-    g_hash_table_replace (files, key, info);
+    g_hash_table_replace (locks->files, key, info);
 
     return TRUE;
 }
@@ -106,23 +187,60 @@ seaf_filelock_manager_init (SeafFilelockManager *mgr)
     sql = "SELECT repo_id, path, locked_by_me FROM ServerLockedFiles";
 
     pthread_mutex_lock (&mgr->priv->db_lock);
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+    pthread_rwlock_wrlock (&mgr->priv->hash_lock);
 
     if (sqlite_foreach_selected_row (mgr->priv->db, sql,
                                      load_locked_files,
                                      mgr->priv->repo_locked_files) < 0) {
         pthread_mutex_unlock (&mgr->priv->db_lock);
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
+        pthread_rwlock_unlock (&mgr->priv->hash_lock);
         g_hash_table_destroy (mgr->priv->repo_locked_files);
         return -1;
     }
 
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
+    pthread_rwlock_unlock (&mgr->priv->hash_lock);
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
     return 0;
 }
 
+#ifdef WIN32
+/* Called on the background thread of set-perm.c. */
+static void
+refresh_wt_file (const char *fullpath)
+{
+    seaf_sync_manager_add_refresh_path (seaf->sync_mgr, fullpath);
+}
+#endif
+
+/*
+ * Lock or unlock a worktree file on the background thread of set-perm.c.
+ * Used when many files change at once, so that the caller doesn't wait
+ * for an ACL update of each of them. On Windows, the file is refreshed in
+ * the Explorer once its ACL has been changed.
+ */
+static void
+queue_wt_file_perm (const char *repo_id, const char *path, gboolean lock)
+{
+    SeafRepo *repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    char *fullpath;
+
+    if (!repo || !repo->worktree)
+        return;
+
+    fullpath = g_build_filename (repo->worktree, path, NULL);
+#ifdef WIN32
+    seaf_queue_path_permission (fullpath,
+                                lock ? SEAF_PATH_PERM_RO : SEAF_PATH_PERM_UNKNOWN,
+                                FALSE, refresh_wt_file);
+#else
+    seaf_queue_path_permission (fullpath,
+                                lock ? SEAF_PATH_PERM_RO : SEAF_PATH_PERM_RW,
+                                FALSE, NULL);
+#endif
+    g_free (fullpath);
+}
+
 static void
 init_locks (gpointer key, gpointer value, gpointer user_data)
 {
@@ -130,11 +248,8 @@ init_locks (gpointer key, gpointer value, gpointer user_data)
     char *path = key;
     LockInfo *info = value;
 
-    if (!info->locked_by_me) {
-        seaf_filelock_manager_lock_wt_file (seaf->filelock_mgr,
-                                            repo_id,
-                                            path);
-    }
+    if (!info->locked_by_me)
+        queue_wt_file_perm (repo_id, path, TRUE);
 }
 
 int
@@ -143,104 +258,69 @@ seaf_filelock_manager_start (SeafFilelockManager *mgr)
     GHashTableIter iter;
     gpointer key, value;
     char *repo_id;
-    GHashTable *locks;
+    RepoLocks *locks;
 
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+    pthread_rwlock_rdlock (&mgr->priv->hash_lock);
 
     g_hash_table_iter_init (&iter, mgr->priv->repo_locked_files);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         repo_id = key;
         locks = value;
-        g_hash_table_foreach (locks, init_locks, repo_id);
+        pthread_rwlock_rdlock (&locks->lock);
+        g_hash_table_foreach (locks->files, init_locks, repo_id);
+        pthread_rwlock_unlock (&locks->lock);
     }
 
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
+    pthread_rwlock_unlock (&mgr->priv->hash_lock);
 
     return 0;
 }
 
-gboolean
-seaf_filelock_manager_is_file_locked (SeafFilelockManager *mgr,
-                                      const char *repo_id,
-                                      const char *path)
+int
+seaf_filelock_manager_get_lock_status (SeafFilelockManager *mgr,
+                                       const char *repo_id,
+                                       const char *path)
 {
-    gboolean ret;
-
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+    RepoLocks *locks;
+    LockInfo *info;
+    int ret = FILE_NOT_LOCKED;
 
-    GHashTable *locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
-    if (!locks) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
-        return FALSE;
-    }
+    locks = lock_repo (mgr->priv, repo_id, FALSE, FALSE);
+    if (!locks)
+        return FILE_NOT_LOCKED;
 
-    LockInfo *info = g_hash_table_lookup (locks, path);
-    if (!info) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
-        return FALSE;
+    info = g_hash_table_lookup (locks->files, path);
+    if (info) {
+        if (info->locked_by_me == LOCKED_MANUAL)
+            ret = FILE_LOCKED_BY_ME_MANUAL;
+        else if (info->locked_by_me == LOCKED_AUTO)
+            ret = FILE_LOCKED_BY_ME_AUTO;
+        else
+            ret = FILE_LOCKED_BY_OTHERS;
     }
-    ret = !info->locked_by_me;
 
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
+    unlock_repo (mgr->priv, locks);
     return ret;
 }
 
+gboolean
+seaf_filelock_manager_is_file_locked (SeafFilelockManager *mgr,
+                                      const char *repo_id,
+                                      const char *path)
+{
+    return (seaf_filelock_manager_get_lock_status (mgr, repo_id, path) ==
+            FILE_LOCKED_BY_OTHERS);
+}
+
 gboolean
 seaf_filelock_manager_is_file_locked_by_me (SeafFilelockManager *mgr,
                                             const char *repo_id,
                                             const char *path)
 {
-    gboolean ret;
+    int status = seaf_filelock_manager_get_lock_status (mgr, repo_id, path);
 
-    pthread_mutex_lock (&mgr->priv->hash_lock);
-
-    GHashTable *locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
-    if (!locks) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
-        return FALSE;
-    }
-
-    LockInfo *info = g_hash_table_lookup (locks, path);
-    if (!info) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
-        return FALSE;
-    }
-    ret = (info->locked_by_me > 0);
-
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
-    return ret;
-}
-
-int
-seaf_filelock_manager_get_lock_status (SeafFilelockManager *mgr,
-                                       const char *repo_id,
-                                       const char *path)
-{
-    int ret;
-
-    pthread_mutex_lock (&mgr->priv->hash_lock);
-
-    GHashTable *locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
-    if (!locks) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
-        return FILE_NOT_LOCKED;
-    }
-
-    LockInfo *info = g_hash_table_lookup (locks, path);
-    if (!info) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
-        return FILE_NOT_LOCKED;
-    }
-
-    if (info->locked_by_me == LOCKED_MANUAL)
-        ret = FILE_LOCKED_BY_ME_MANUAL;
-    else if (info->locked_by_me == LOCKED_AUTO)
-        ret = FILE_LOCKED_BY_ME_AUTO;
-    else
-        ret = FILE_LOCKED_BY_OTHERS;
-
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
-    return ret;
+    return (status == FILE_LOCKED_BY_ME_MANUAL ||
+            status == FILE_LOCKED_BY_ME_AUTO);
 }
 
 void
@@ -279,75 +359,55 @@ seaf_filelock_manager_unlock_wt_file (SeafFilelockManager *mgr,
     g_free (fullpath);
 }
 
+/* Removed locks are recorded in @changes as -1, added or changed ones as
+ * their new locked_by_me value.
+ */
+#define LOCK_REMOVED -1
+
+/* Worktree files are locked and unlocked by the caller after the table lock
+ * is released, paths are added to @to_lock and @to_unlock for that.
+ */
 static void
-update_in_memory (SeafFilelockManager *mgr, const char *repo_id, GHashTable *new_locks)
+update_in_memory (SeafFilelockManager *mgr, const char *repo_id, GHashTable *new_locks,
+                  GHashTable *changes, GList **to_lock, GList **to_unlock)
 {
-    GHashTable *repo_hash = mgr->priv->repo_locked_files;
-
-    pthread_mutex_lock (&mgr->priv->hash_lock);
-
-    GHashTable *locks = g_hash_table_lookup (repo_hash, repo_id);
-
-    if (!locks) {
-        if (g_hash_table_size (new_locks) == 0) {
-            pthread_mutex_unlock (&mgr->priv->hash_lock);
-            return;
-        }
-        locks = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                       g_free, (GDestroyNotify)lock_info_free);
-        g_hash_table_insert (repo_hash, g_strdup(repo_id), locks);
-    }
-
+    RepoLocks *locks;
     GHashTableIter iter;
     gpointer key, value;
     gpointer new_key, new_val;
     char *path;
-#ifdef WIN32
-    char *fullpath;
-#endif
     LockInfo *info;
     gboolean exists;
     int locked_by_me;
-    SeafRepo *repo;
 
-    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-    if (!repo) {
-        seaf_warning ("Failed to find repo %s\n", repo_id);
+    locks = lock_repo (mgr->priv, repo_id, TRUE,
+                       g_hash_table_size (new_locks) > 0);
+    if (!locks)
         return;
-    }
 
-    g_hash_table_iter_init (&iter, locks);
+    g_hash_table_iter_init (&iter, locks->files);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         path = key;
         info = value;
 
         exists = g_hash_table_lookup_extended (new_locks, path, &new_key, &new_val);
         if (!exists) {
-#ifdef WIN32
-            fullpath = g_build_path ("/", repo->worktree, path, NULL);
-            seaf_sync_manager_add_refresh_path (seaf->sync_mgr, fullpath);
-            g_free (fullpath);
-#endif
-            seaf_filelock_manager_unlock_wt_file (mgr, repo_id, path);
+            *to_unlock = g_list_prepend (*to_unlock, g_strdup(path));
+            g_hash_table_insert (changes, g_strdup(path),
+                                 GINT_TO_POINTER(LOCK_REMOVED));
             g_hash_table_iter_remove (&iter);
         } else {
             locked_by_me = (int)(long)new_val;
             if (!info->locked_by_me && locked_by_me) {
-#ifdef WIN32
-                fullpath = g_build_path ("/", repo->worktree, path, NULL);
-                seaf_sync_manager_add_refresh_path (seaf->sync_mgr, fullpath);
-                g_free (fullpath);
-#endif
-                seaf_filelock_manager_unlock_wt_file (mgr, repo_id, path);
+                *to_unlock = g_list_prepend (*to_unlock, g_strdup(path));
                 info->locked_by_me = locked_by_me;
+                g_hash_table_insert (changes, g_strdup(path),
+                                     GINT_TO_POINTER(locked_by_me));
             } else if (info->locked_by_me && !locked_by_me) {
-#ifdef WIN32
-                fullpath = g_build_path ("/", repo->worktree, path, NULL);
-                seaf_sync_manager_add_refresh_path (seaf->sync_mgr, fullpath);
-                g_free (fullpath);
-#endif
-                seaf_filelock_manager_lock_wt_file (mgr, repo_id, path);
+                *to_lock = g_list_prepend (*to_lock, g_strdup(path));
                 info->locked_by_me = locked_by_me;
+                g_hash_table_insert (changes, g_strdup(path),
+                                     GINT_TO_POINTER(locked_by_me));
             }
         }
     }
@@ -356,22 +416,61 @@ update_in_memory (SeafFilelockManager *mgr, const char *repo_id, GHashTable *new
     while (g_hash_table_iter_next (&iter, &new_key, &new_val)) {
         path = new_key;
         locked_by_me = (int)(long)new_val;
-        if (!g_hash_table_lookup (locks, path)) {
+        if (!g_hash_table_lookup (locks->files, path)) {
             info = g_new0 (LockInfo, 1);
             info->locked_by_me = locked_by_me;
-            g_hash_table_insert (locks, g_strdup(path), info);
-#ifdef WIN32
-            fullpath = g_build_path ("/", repo->worktree, path, NULL);
-            seaf_sync_manager_add_refresh_path (seaf->sync_mgr, fullpath);
-            g_free (fullpath);
-#endif
-            if (!locked_by_me) {
-                seaf_filelock_manager_lock_wt_file (mgr, repo_id, path);
-            }
+            g_hash_table_insert (locks->files, g_strdup(path), info);
+            g_hash_table_insert (changes, g_strdup(path),
+                                 GINT_TO_POINTER(locked_by_me));
+            if (!locked_by_me)
+                *to_lock = g_list_prepend (*to_lock, g_strdup(path));
         }
     }
 
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
+    unlock_repo (mgr->priv, locks);
+}
+
+static void
+update_wt_files (SeafFilelockManager *mgr, const char *repo_id,
+                 GHashTable *changes, GList *to_lock, GList *to_unlock)
+{
+    GList *ptr;
+
+    for (ptr = to_unlock; ptr; ptr = ptr->next)
+        queue_wt_file_perm (repo_id, ptr->data, FALSE);
+    for (ptr = to_lock; ptr; ptr = ptr->next)
+        queue_wt_file_perm (repo_id, ptr->data, TRUE);
+
+#ifdef WIN32
+    SeafRepo *repo;
+    GHashTable *queued;
+    GHashTableIter iter;
+    gpointer key, value;
+    char *fullpath;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo)
+        return;
+
+    /* Files whose ACL changes are refreshed by queue_wt_file_perm(), once
+     * the change is applied. */
+    queued = g_hash_table_new (g_str_hash, g_str_equal);
+    for (ptr = to_unlock; ptr; ptr = ptr->next)
+        g_hash_table_add (queued, ptr->data);
+    for (ptr = to_lock; ptr; ptr = ptr->next)
+        g_hash_table_add (queued, ptr->data);
+
+    g_hash_table_iter_init (&iter, changes);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (g_hash_table_contains (queued, key))
+            continue;
+        fullpath = g_build_path ("/", repo->worktree, (char *)key, NULL);
+        seaf_sync_manager_add_refresh_path (seaf->sync_mgr, fullpath);
+        g_free (fullpath);
+    }
+
+    g_hash_table_destroy (queued);
+#endif
 }
 
 static gint
@@ -382,68 +481,82 @@ compare_paths (gconstpointer a, gconstpointer b)
     return strcmp (patha, pathb);
 }
 
+/* Only write the rows in @changes, in one transaction. */
 static int
-update_db (SeafFilelockManager *mgr, const char *repo_id)
+update_db (SeafFilelockManager *mgr, const char *repo_id, GHashTable *changes)
 {
     char *sql;
-    sqlite3_stmt *stmt;
-    GHashTable *locks;
+    sqlite3_stmt *del_stmt = NULL, *ins_stmt = NULL;
     GList *paths, *ptr;
     char *path;
-    LockInfo *info;
+    int locked_by_me;
+    int ret = 0;
 
-    pthread_mutex_lock (&mgr->priv->db_lock);
+    if (g_hash_table_size (changes) == 0)
+        return 0;
 
-    sql = "DELETE FROM ServerLockedFiles WHERE repo_id = ?";
-    stmt = sqlite_query_prepare (mgr->priv->db, sql);
-    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
-    if (sqlite3_step (stmt) != SQLITE_DONE) {
-        seaf_warning ("Failed to remove server locked files for %.8s: %s.\n",
-                      repo_id, sqlite3_errmsg (mgr->priv->db));
-        sqlite3_finalize (stmt);
-        pthread_mutex_unlock (&mgr->priv->db_lock);
-        return -1;
-    }
-    sqlite3_finalize (stmt);
+    pthread_mutex_lock (&mgr->priv->db_lock);
 
-    locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
-    if (!locks || g_hash_table_size (locks) == 0) {
-        pthread_mutex_unlock (&mgr->priv->db_lock);
-        return 0;
+    sql = "DELETE FROM ServerLockedFiles WHERE repo_id = ? AND path = ?";
+    del_stmt = sqlite_query_prepare (mgr->priv->db, sql);
+    sql = "INSERT INTO ServerLockedFiles (repo_id, path, locked_by_me) VALUES (?, ?, ?)";
+    ins_stmt = sqlite_query_prepare (mgr->priv->db, sql);
+    if (!del_stmt || !ins_stmt) {
+        ret = -1;
+        goto out;
     }
 
-    paths = g_hash_table_get_keys (locks);
+    paths = g_hash_table_get_keys (changes);
     paths = g_list_sort (paths, compare_paths);
 
-    sql = "INSERT INTO ServerLockedFiles (repo_id, path, locked_by_me) VALUES (?, ?, ?)";
-    stmt = sqlite_query_prepare (mgr->priv->db, sql);
+    sqlite_begin_transaction (mgr->priv->db);
 
     for (ptr = paths; ptr; ptr = ptr->next) {
         path = ptr->data;
-        info = g_hash_table_lookup (locks, path);
+        locked_by_me = GPOINTER_TO_INT (g_hash_table_lookup (changes, path));
+
+        sqlite3_bind_text (del_stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (del_stmt, 2, path, -1, SQLITE_TRANSIENT);
+        if (sqlite3_step (del_stmt) != SQLITE_DONE) {
+            seaf_warning ("Failed to remove server file lock for %.8s: %s.\n",
+                          repo_id, sqlite3_errmsg (mgr->priv->db));
+            ret = -1;
+            break;
+        }
+        sqlite3_reset (del_stmt);
+        sqlite3_clear_bindings (del_stmt);
 
-        sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text (stmt, 2, path, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int (stmt, 3, info->locked_by_me);
+        if (locked_by_me == LOCK_REMOVED)
+            continue;
 
-        if (sqlite3_step (stmt) != SQLITE_DONE) {
+        sqlite3_bind_text (ins_stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (ins_stmt, 2, path, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int (ins_stmt, 3, locked_by_me);
+        if (sqlite3_step (ins_stmt) != SQLITE_DONE) {
             seaf_warning ("Failed to insert server file lock for %.8s: %s.\n",
                           repo_id, sqlite3_errmsg (mgr->priv->db));
-            sqlite3_finalize (stmt);
-            pthread_mutex_unlock (&mgr->priv->db_lock);
-            return -1;
+            ret = -1;
+            break;
         }
-
-        sqlite3_reset (stmt);
-        sqlite3_clear_bindings (stmt);
+        sqlite3_reset (ins_stmt);
+        sqlite3_clear_bindings (ins_stmt);
     }
 
-    sqlite3_finalize (stmt);
+    if (ret < 0)
+        sqlite_query_exec (mgr->priv->db, "ROLLBACK TRANSACTION;");
+    else
+        sqlite_end_transaction (mgr->priv->db);
+
     g_list_free (paths);
 
+out:
+    if (del_stmt)
+        sqlite3_finalize (del_stmt);
+    if (ins_stmt)
+        sqlite3_finalize (ins_stmt);
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
-    return 0;
+    return ret;
 }
 
 int
@@ -451,10 +564,24 @@ seaf_filelock_manager_update (SeafFilelockManager *mgr,
                               const char *repo_id,
                               GHashTable *new_locked_files)
 {
-    update_in_memory (mgr, repo_id, new_locked_files);
+    GHashTable *changes;
+    GList *to_lock = NULL, *to_unlock = NULL;
+    int ret;
+
+    changes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    update_in_memory (mgr, repo_id, new_locked_files, changes,
+                      &to_lock, &to_unlock);
+    if (g_hash_table_size (changes) > 0) {
+        seaf_sync_manager_bump_status_seq (seaf->sync_mgr);
+        update_wt_files (mgr, repo_id, changes, to_lock, to_unlock);
+    }
 
-    int ret = update_db (mgr, repo_id);
+    ret = update_db (mgr, repo_id, changes);
 
+    string_list_free (to_lock);
+    string_list_free (to_unlock);
+    g_hash_table_destroy (changes);
     return ret;
 }
 
@@ -534,9 +661,9 @@ seaf_filelock_manager_remove (SeafFilelockManager *mgr,
 
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+    pthread_rwlock_wrlock (&mgr->priv->hash_lock);
     g_hash_table_remove (mgr->priv->repo_locked_files, repo_id);
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
+    pthread_rwlock_unlock (&mgr->priv->hash_lock);
 
     return 0;
 }
@@ -593,34 +720,28 @@ seaf_filelock_manager_mark_file_locked (SeafFilelockManager *mgr,
                                         const char *path,
                                         FileLockType type)
 {
-    GHashTable *locks;
+    RepoLocks *locks;
     LockInfo *info;
 
-    pthread_mutex_lock (&mgr->priv->hash_lock);
-
-    locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
-    if (!locks) {
-        locks = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                       g_free, (GDestroyNotify)lock_info_free);
-        g_hash_table_insert (mgr->priv->repo_locked_files,
-                             g_strdup(repo_id), locks);
-    }
+    locks = lock_repo (mgr->priv, repo_id, TRUE, TRUE);
 
-    info = g_hash_table_lookup (locks, path);
+    info = g_hash_table_lookup (locks->files, path);
     if (!info) {
         info = g_new0 (LockInfo, 1);
-        g_hash_table_insert (locks, g_strdup(path), info);
+        g_hash_table_insert (locks->files, g_strdup(path), info);
     }
 
     info->locked_by_me = type;
 
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
+    unlock_repo (mgr->priv, locks);
+
+    seaf_sync_manager_bump_status_seq (seaf->sync_mgr);
 
 #ifdef WIN32
     refresh_locked_path_status (repo_id, path);
 #endif
 
-    return mark_file_locked_in_db (mgr, repo_id, path, info->locked_by_me);
+    return mark_file_locked_in_db (mgr, repo_id, path, type);
 }
 
 static int
@@ -656,19 +777,17 @@ seaf_filelock_manager_mark_file_unlocked (SeafFilelockManager *mgr,
                                           const char *repo_id,
                                           const char *path)
 {
-    GHashTable *locks;
-
-    pthread_mutex_lock (&mgr->priv->hash_lock);
+    RepoLocks *locks;
 
-    locks = g_hash_table_lookup (mgr->priv->repo_locked_files, repo_id);
-    if (!locks) {
-        pthread_mutex_unlock (&mgr->priv->hash_lock);
+    locks = lock_repo (mgr->priv, repo_id, TRUE, FALSE);
+    if (!locks)
         return 0;
-    }
 
-    g_hash_table_remove (locks, path);
+    g_hash_table_remove (locks->files, path);
+
+    unlock_repo (mgr->priv, locks);
 
-    pthread_mutex_unlock (&mgr->priv->hash_lock);
+    seaf_sync_manager_bump_status_seq (seaf->sync_mgr);
 
 #ifdef WIN32
     refresh_locked_path_status (repo_id, path);
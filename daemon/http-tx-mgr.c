@@ -9,6 +9,10 @@
 #include <jansson.h>
 #include <event2/buffer.h>
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #ifdef WIN32
 #include <windows.h>
 #include <wincrypt.h>
@@ -30,17 +34,25 @@
 #include "seafile-error-impl.h"
 #include "utils.h"
 #include "diff-simple.h"
+#include "sync-filter.h"
 
 #define DEBUG_FLAG SEAFILE_DEBUG_TRANSFER
 #include "log.h"
 
 #include "timer.h"
+#include "rate-limiter.h"
+#include "mem-budget.h"
+#include "tx-checkpoint.h"
+#include "startup-profile.h"
+#include "latency-stats.h"
+#include "trace.h"
 
 #define HTTP_OK 200
 #define HTTP_BAD_REQUEST 400
 #define HTTP_REQUEST_TIME_OUT 408
 #define HTTP_FORBIDDEN 403
 #define HTTP_NOT_FOUND 404
+#define HTTP_UNSUPPORTED_MEDIA_TYPE 415
 #define HTTP_NO_QUOTA 443
 #define HTTP_REPO_DELETED 444
 #define HTTP_REPO_TOO_LARGE 447
@@ -52,6 +64,25 @@
 
 #define CLEAR_POOL_ERR_CNT 3
 
+/* Connections opened to one host before requests wait for an idle one.
+ * A request waits at most CONNECTION_WAIT_SEC, so that long running tasks
+ * holding connections can't block the periodic checks. */
+#define MAX_HOST_CONNECTIONS 16
+#define CONNECTION_WAIT_SEC 10
+
+/* Idle connections are closed after this time. Servers usually close
+ * keep-alive connections after a minute or so, reusing them would fail. */
+#define CONNECTION_IDLE_TIMEOUT_SEC 50
+#define CLEAN_CONNECTIONS_INTERVAL_MSEC 30000
+
+/* HTTP/3 support in libcurl, and Alt-Svc with h3 entries. */
+#if LIBCURL_VERSION_NUM >= 0x074400
+#define HAVE_CURL_HTTP3 1
+#endif
+
+/* After HTTP/3 fails with a server, transfers use TCP for this long. */
+#define HTTP3_RETRY_INTERVAL_SEC 600
+
 #ifndef SEAFILE_CLIENT_VERSION
 #define SEAFILE_CLIENT_VERSION PACKAGE_VERSION
 #endif
@@ -74,7 +105,8 @@
 
 struct _Connection {
     CURL *curl;
-    gint64 ctime;               /* Used to clean up unused connection. */
+    gint64 ctime;               /* Time the connection was last returned to the pool.
+                                 * Used to clean up unused connection. */
     gboolean release;           /* If TRUE, the connection will be released. */
 };
 typedef struct _Connection Connection;
@@ -82,8 +114,28 @@ typedef struct _Connection Connection;
 struct _ConnectionPool {
     char *host;
     GQueue *queue;
+    GQueue *multi_queue;        /* Idle curl multi handles for block transfers. */
+    gint64 multi_atime;         /* Time a multi handle was last returned. */
     pthread_mutex_t lock;
+    pthread_cond_t cond;        /* Signaled when a connection is returned. */
+    int n_conns;                /* Connections in use or idle. */
     int err_cnt;
+    guint64 n_errors;           /* Failed connections since the pool was created. */
+    /* Set if the server accepts small blocks packed in one request,
+     * as reported by the protocol-version API. */
+    gboolean block_pack_supported;
+    /* Set if the server can check id lists in the compact format. */
+    gboolean compact_id_check_supported;
+    /* Content encoding used to compress blocks on the wire, chosen from
+     * the ones the server supports. NULL if blocks are sent as is. */
+    const char *block_encoding;
+    /* Rate limiters of all transfers with this server. */
+    RateLimiter *upload_limiter;
+    RateLimiter *download_limiter;
+    /* Set once a transfer with the server went over HTTP/3. */
+    gboolean http3_used;
+    /* HTTP/3 is not used with the server before this time. */
+    gint64 http3_disabled_until;
 };
 typedef struct _ConnectionPool ConnectionPool;
 
@@ -94,10 +146,36 @@ struct _HttpTxPriv {
     GHashTable *connection_pools; /* host -> connection pool */
     pthread_mutex_t pools_lock;
 
+    /* DNS cache and TLS sessions shared by all curl handles, so that new
+     * connections don't need a full TLS handshake. */
+    CURLSH *curl_share;
+    pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
     SeafTimer *reset_bytes_timer;
+    SeafTimer *clean_conns_timer;
+
+    /* Global rate limiters, limited by the sync manager's upload_limit and
+     * download_limit. */
+    RateLimiter *upload_limiter;
+    RateLimiter *download_limiter;
+    /* Limits of the transfers with each server, 0 if not limited. */
+    gint server_upload_limit;
+    gint server_download_limit;
+    /* Number of bulk and interactive tasks transferring blocks,
+     * indexed by upload. */
+    gint n_bulk_tx[2];
+    gint n_interactive_tx[2];
+
+    /* Progress of interrupted tasks, so that they can resume. */
+    TxCheckpointStore *checkpoints;
 
     char *ca_bundle_path;
 
+    /* Alt-Svc cache shared by the transfer requests through this file, so
+     * that the HTTP/3 endpoint advertised by a server is used by the next
+     * requests. NULL if libcurl can't do HTTP/3. */
+    char *altsvc_path;
+
     /* Regex to parse error message returned by update-branch. */
     GRegex *locked_error_regex;
     GRegex *folder_perm_error_regex;
@@ -107,6 +185,12 @@ typedef struct _HttpTxPriv HttpTxPriv;
 
 /* Http Tx Task */
 
+static struct _TxConcurrency *
+tx_concurrency_new ();
+
+static void
+tx_concurrency_free (struct _TxConcurrency *c);
+
 static HttpTxTask *
 http_tx_task_new (HttpTxManager *mgr,
                   const char *repo_id,
@@ -136,9 +220,31 @@ http_tx_task_new (HttpTxManager *mgr,
 
     task->error = SYNC_ERROR_ID_NO_ERROR;
 
+    task->concurrency = tx_concurrency_new ();
+
+    char *limit = seaf_repo_manager_get_repo_property (seaf->repo_mgr, repo_id,
+                                                       type == HTTP_TASK_TYPE_DOWNLOAD ?
+                                                       REPO_PROP_DOWNLOAD_LIMIT :
+                                                       REPO_PROP_UPLOAD_LIMIT);
+    if (limit) {
+        task->rate_limit = MAX (atoi (limit), 0);
+        g_free (limit);
+    }
+    task->limiter = rate_limiter_new ();
+
     return task;
 }
 
+/* Blocks still referenced when the task ends are kept. */
+static void
+unpin_task_block (gpointer key, gpointer value, gpointer user_data)
+{
+    HttpTxTask *task = user_data;
+
+    seaf_block_manager_unpin_block (seaf->block_mgr, task->repo_id,
+                                    (const char *)key, FALSE);
+}
+
 static void
 http_tx_task_free (HttpTxTask *task)
 {
@@ -149,8 +255,13 @@ http_tx_task_free (HttpTxTask *task)
     g_free (task->email);
     g_free (task->repo_name);
     if (task->type == HTTP_TASK_TYPE_DOWNLOAD) {
+        g_hash_table_foreach (task->blk_ref_cnts, unpin_task_block, task);
         g_hash_table_destroy (task->blk_ref_cnts);
+        string_list_free (task->shared_block_stores);
     }
+    tx_concurrency_free (task->concurrency);
+    rate_limiter_free (task->limiter);
+    string_list_free (task->sent_blocks);
     g_free (task);
 }
 
@@ -197,7 +308,11 @@ connection_pool_new (const char *host)
     ConnectionPool *pool = g_new0 (ConnectionPool, 1);
     pool->host = g_strdup(host);
     pool->queue = g_queue_new ();
+    pool->multi_queue = g_queue_new ();
     pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->cond, NULL);
+    pool->upload_limiter = rate_limiter_new ();
+    pool->download_limiter = rate_limiter_new ();
     return pool;
 }
 
@@ -217,16 +332,63 @@ find_connection_pool (HttpTxPriv *priv, const char *host)
     return pool;
 }
 
+/* Close the connections that have been idle for too long. Must be called
+ * with pool->lock held. */
+static void
+connection_pool_evict_idle (ConnectionPool *pool)
+{
+    gint64 now = (gint64)time(NULL);
+    Connection *conn;
+    CURLM *multi;
+
+    /* Idle connections are queued in the order they were returned. */
+    while ((conn = g_queue_peek_head (pool->queue)) != NULL &&
+           now - conn->ctime >= CONNECTION_IDLE_TIMEOUT_SEC) {
+        g_queue_pop_head (pool->queue);
+        connection_free (conn);
+        --pool->n_conns;
+    }
+
+    if (now - pool->multi_atime >= CONNECTION_IDLE_TIMEOUT_SEC) {
+        while ((multi = g_queue_pop_head (pool->multi_queue)) != NULL)
+            curl_multi_cleanup (multi);
+    }
+
+    pthread_cond_broadcast (&pool->cond);
+}
+
 static Connection *
 connection_pool_get_connection (ConnectionPool *pool)
 {
     Connection *conn = NULL;
+    struct timespec deadline;
+    gboolean timed_out = FALSE;
+
+    deadline.tv_sec = time(NULL) + CONNECTION_WAIT_SEC;
+    deadline.tv_nsec = 0;
 
     pthread_mutex_lock (&pool->lock);
-    conn = g_queue_pop_head (pool->queue);
-    if (!conn) {
-        conn = connection_new ();
+
+    connection_pool_evict_idle (pool);
+
+    while (1) {
+        /* The most recently used connection is the most likely to be alive. */
+        conn = g_queue_pop_tail (pool->queue);
+        if (conn)
+            break;
+
+        if (pool->n_conns < MAX_HOST_CONNECTIONS || timed_out) {
+            conn = connection_new ();
+            ++pool->n_conns;
+            break;
+        }
+
+        if (pthread_cond_timedwait (&pool->cond, &pool->lock, &deadline) == ETIMEDOUT) {
+            seaf_debug ("Timed out waiting for a connection to %s.\n", pool->host);
+            timed_out = TRUE;
+        }
     }
+
     pthread_mutex_unlock (&pool->lock);
 
     return conn;
@@ -236,13 +398,20 @@ static void
 connection_pool_clear (ConnectionPool *pool)
 {
     Connection *conn = NULL;
+    CURLM *multi;
 
     while (1) {
         conn = g_queue_pop_head (pool->queue);
         if (!conn)
             break;
         connection_free (conn);
+        --pool->n_conns;
     }
+
+    while ((multi = g_queue_pop_head (pool->multi_queue)) != NULL)
+        curl_multi_cleanup (multi);
+
+    pthread_cond_broadcast (&pool->cond);
 }
 
 static void
@@ -255,23 +424,156 @@ connection_pool_return_connection (ConnectionPool *pool, Connection *conn)
         connection_free (conn);
 
         pthread_mutex_lock (&pool->lock);
+        --pool->n_conns;
+        ++pool->n_errors;
         if (++pool->err_cnt >= CLEAR_POOL_ERR_CNT) {
             connection_pool_clear (pool);
         }
+        pthread_cond_signal (&pool->cond);
         pthread_mutex_unlock (&pool->lock);
 
         return;
     }
 
     curl_easy_reset (conn->curl);
+    conn->ctime = (gint64)time(NULL);
 
     /* Reset error count when one connection succeeded. */
     pthread_mutex_lock (&pool->lock);
     pool->err_cnt = 0;
     g_queue_push_tail (pool->queue, conn);
+    pthread_cond_signal (&pool->cond);
+    pthread_mutex_unlock (&pool->lock);
+}
+
+/* Connections a multi handle may open to one host. With HTTP/2 all block
+ * requests are multiplexed on one of them, with HTTP/1.1 the requests beyond
+ * this limit are queued by libcurl.
+ */
+#define MULTI_MAX_HOST_CONNECTIONS 6
+
+static CURLM *
+connection_pool_get_multi (ConnectionPool *pool)
+{
+    CURLM *multi;
+
+    pthread_mutex_lock (&pool->lock);
+    multi = g_queue_pop_head (pool->multi_queue);
+    pthread_mutex_unlock (&pool->lock);
+
+    if (multi)
+        return multi;
+
+    multi = curl_multi_init ();
+    if (!multi)
+        return NULL;
+
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    curl_multi_setopt (multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x071e00
+    curl_multi_setopt (multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                       (long)MULTI_MAX_HOST_CONNECTIONS);
+#endif
+
+    return multi;
+}
+
+/* The multi handle keeps its connections open, so that the next batch of
+ * block requests can reuse them. */
+static void
+connection_pool_return_multi (ConnectionPool *pool, CURLM *multi, gboolean release)
+{
+    if (!multi)
+        return;
+
+    if (release) {
+        curl_multi_cleanup (multi);
+
+        pthread_mutex_lock (&pool->lock);
+        ++pool->n_errors;
+        if (++pool->err_cnt >= CLEAR_POOL_ERR_CNT) {
+            connection_pool_clear (pool);
+        }
+        pthread_mutex_unlock (&pool->lock);
+
+        return;
+    }
+
+    pthread_mutex_lock (&pool->lock);
+    pool->err_cnt = 0;
+    pool->multi_atime = (gint64)time(NULL);
+    g_queue_push_tail (pool->multi_queue, multi);
     pthread_mutex_unlock (&pool->lock);
 }
 
+static void
+share_lock_cb (CURL *handle, curl_lock_data data, curl_lock_access access,
+               void *userptr)
+{
+    HttpTxPriv *priv = userptr;
+    pthread_mutex_lock (&priv->share_locks[data]);
+}
+
+static void
+share_unlock_cb (CURL *handle, curl_lock_data data, void *userptr)
+{
+    HttpTxPriv *priv = userptr;
+    pthread_mutex_unlock (&priv->share_locks[data]);
+}
+
+static void
+init_curl_share (HttpTxPriv *priv)
+{
+    int i;
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+        pthread_mutex_init (&priv->share_locks[i], NULL);
+
+    priv->curl_share = curl_share_init ();
+    if (!priv->curl_share) {
+        seaf_warning ("Failed to init curl share handle.\n");
+        return;
+    }
+
+    curl_share_setopt (priv->curl_share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+    curl_share_setopt (priv->curl_share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+    curl_share_setopt (priv->curl_share, CURLSHOPT_USERDATA, priv);
+    curl_share_setopt (priv->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt (priv->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+static void
+set_curl_share (CURL *curl)
+{
+    CURLSH *share = seaf->http_tx_mgr->priv->curl_share;
+
+    if (share)
+        curl_easy_setopt (curl, CURLOPT_SHARE, share);
+}
+
+static int
+clean_idle_connections (void *vdata)
+{
+    HttpTxManager *mgr = vdata;
+    HttpTxPriv *priv = mgr->priv;
+    GHashTableIter iter;
+    gpointer key, value;
+    ConnectionPool *pool;
+
+    pthread_mutex_lock (&priv->pools_lock);
+    g_hash_table_iter_init (&iter, priv->connection_pools);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        pool = value;
+        pthread_mutex_lock (&pool->lock);
+        connection_pool_evict_idle (pool);
+        pthread_mutex_unlock (&pool->lock);
+    }
+    pthread_mutex_unlock (&priv->pools_lock);
+
+    return 1;
+}
+
 #define LOCKED_ERROR_PATTERN "File (.+) is locked"
 #define FOLDER_PERM_ERROR_PATTERN "Update to path (.+) is not allowed by folder permission settings"
 #define TOO_MANY_FILES_ERROR_PATTERN "Too many files in library"
@@ -294,8 +596,24 @@ http_tx_manager_new (struct _SeafileSession *seaf)
     priv->connection_pools = g_hash_table_new (g_str_hash, g_str_equal);
     pthread_mutex_init (&priv->pools_lock, NULL);
 
+    init_curl_share (priv);
+
+    priv->upload_limiter = rate_limiter_new ();
+    priv->download_limiter = rate_limiter_new ();
+
+    char *db_path = g_build_filename (seaf->seaf_dir, "transfer.db", NULL);
+    priv->checkpoints = tx_checkpoint_store_new (db_path);
+    if (!priv->checkpoints)
+        seaf_warning ("Failed to open transfer checkpoint db %s.\n", db_path);
+    g_free (db_path);
+
     priv->ca_bundle_path = g_build_filename (seaf->seaf_dir, "ca-bundle.pem", NULL);
 
+#ifdef HAVE_CURL_HTTP3
+    if (curl_version_info (CURLVERSION_NOW)->features & CURL_VERSION_HTTP3)
+        priv->altsvc_path = g_build_filename (seaf->seaf_dir, "alt-svc.txt", NULL);
+#endif
+
     GError *error = NULL;
     priv->locked_error_regex = g_regex_new (LOCKED_ERROR_PATTERN, 0, 0, &error);
     if (error) {
@@ -354,7 +672,19 @@ http_tx_manager_start (HttpTxManager *mgr)
     g_unlink (mgr->priv->ca_bundle_path);
 #endif
 
-    /* TODO: add a timer to clean up unused Http connections. */
+    mgr->priv->clean_conns_timer = seaf_timer_new (clean_idle_connections,
+                                                   mgr,
+                                                   CLEAN_CONNECTIONS_INTERVAL_MSEC);
+
+    gboolean exists;
+    int limit = seafile_session_config_get_int (seaf, KEY_SERVER_UPLOAD_LIMIT,
+                                                &exists);
+    if (exists)
+        mgr->priv->server_upload_limit = MAX (limit, 0);
+    limit = seafile_session_config_get_int (seaf, KEY_SERVER_DOWNLOAD_LIMIT,
+                                            &exists);
+    if (exists)
+        mgr->priv->server_download_limit = MAX (limit, 0);
 
     mgr->priv->reset_bytes_timer = seaf_timer_new (reset_bytes,
                                                    mgr,
@@ -500,8 +830,12 @@ load_ca_bundle (CURL *curl)
     /* On MacOS the certs are loaded by seafile applet instead of seaf-daemon  */
     if (!seaf_util_exists (ca_bundle_path)) {
 #ifdef WIN32
+        StartupTimer timer;
+
+        startup_timer_start (&timer, TRUE);
         if (create_ca_bundle (ca_bundle_path) < 0)
             return;
+        startup_profile_add_phase ("create ca bundle", &timer);
 #else
         return;
 #endif
@@ -566,6 +900,15 @@ load_certs_from_db (X509_STORE *store)
     sqlite3 *db = NULL;
     char *sql;
     int ret = 0;
+    static gint first_load = 1;
+    gboolean first;
+    StartupTimer timer;
+
+    /* Certs are loaded for each connection, only the first load is
+     * recorded in the startup profile. */
+    first = g_atomic_int_compare_and_exchange (&first_load, 1, 0);
+    if (first)
+        startup_timer_start (&timer, TRUE);
 
     cert_db_path = g_build_filename (seaf->seaf_dir, "certs.db", NULL);
     if (sqlite_open_db (cert_db_path, &db) < 0) {
@@ -586,6 +929,9 @@ out:
     if (db)
         sqlite_close_db (db);
 
+    if (first)
+        startup_profile_add_phase ("load certs from db", &timer);
+
     return ret;
 }
 
@@ -608,12 +954,21 @@ ssl_callback (CURL *curl, void *ssl_ctx, void *userptr)
 
 #endif  /* USE_GPL_CRYPTO */
 
-CURLcode curl_perform(CURL *curl, const char *url)
+/*
+ * Set the URL of a request. When SNI is configured, the host name in @url is
+ * replaced by the SNI host name and the connection is redirected to the real
+ * host. The list returned in @pconnect_to must be freed with
+ * curl_slist_free_all() after the request is done.
+ */
+static CURLcode
+set_request_url (CURL *curl, const char *url, struct curl_slist **pconnect_to)
 {
+    *pconnect_to = NULL;
+
     if (!seaf->use_sni && (seaf->sni_hostname == NULL || strcmp(seaf->sni_hostname, "") == 0))
     {
         curl_easy_setopt(curl, CURLOPT_URL, url);
-        return curl_easy_perform(curl);
+        return CURLE_OK;
     }
 
     char *sni = seaf->sni_hostname;
@@ -639,7 +994,9 @@ CURLcode curl_perform(CURL *curl, const char *url)
     strcat(new_url, sni);
     strcat(new_url, host_port_end);
 
+    /* libcurl copies the URL string. */
     curl_easy_setopt(curl, CURLOPT_URL, new_url);
+    free(new_url);
 
     // Set TLS certificate
     struct curl_blob cert_blob;
@@ -661,26 +1018,40 @@ CURLcode curl_perform(CURL *curl, const char *url)
     size_t connect_to_str_len = strlen(sni) + (host_port_end - host_port_start) + 6;
     char *connect_to_str = malloc(connect_to_str_len);
     if (!connect_to_str) {
-        free(new_url);
         return CURLE_OUT_OF_MEMORY;
     }
     snprintf(connect_to_str, connect_to_str_len, "%s:443:%.*s", sni,
              (int)(host_port_end - host_port_start), host_port_start);
 
     struct curl_slist *connect_to = curl_slist_append(NULL, connect_to_str);
+    free(connect_to_str);
     if (!connect_to) {
-        free(connect_to_str);
-        free(new_url);
         return CURLE_FAILED_INIT;
     }
     curl_easy_setopt(curl, CURLOPT_CONNECT_TO, connect_to);
 
+    *pconnect_to = connect_to;
+    return CURLE_OK;
+}
+
+CURLcode curl_perform(CURL *curl, const char *url)
+{
+    struct curl_slist *connect_to = NULL;
+    CURLcode res;
+    gint64 start;
+
+    res = set_request_url (curl, url, &connect_to);
+    if (res != CURLE_OK)
+        return res;
+
+    set_curl_share (curl);
+
     // Perform the request
-    CURLcode res = curl_easy_perform(curl);
+    start = g_get_monotonic_time ();
+    res = curl_easy_perform(curl);
+    if (res == CURLE_OK)
+        latency_stats_record_http (url, start);
 
-    // Cleanup
-    free(connect_to_str);
-    free(new_url);
     curl_slist_free_all(connect_to);
 
     return res;
@@ -785,6 +1156,192 @@ recv_response (void *contents, size_t size, size_t nmemb, void *userp)
     return realsize;
 }
 
+/*
+ * Incremental parser of the JSON arrays of object ids returned by
+ * fs-id-list and check-fs/check-blocks, e.g. ["<40 hex>", ...].
+ *
+ * The ids are converted to their 20 raw bytes and appended to a flat
+ * array as the response is received, instead of building the whole
+ * response, a JSON document and a list of strings. Nothing else than an
+ * array of hex ids is accepted.
+ */
+
+enum {
+    ID_LIST_START,
+    ID_LIST_FIRST,              /* after '[' */
+    ID_LIST_VALUE,              /* after ',' */
+    ID_LIST_IN_ID,
+    ID_LIST_NEXT,               /* after an id */
+    ID_LIST_END,
+    ID_LIST_ERROR,
+};
+
+/* Approximate size of an id in the response: quotes, comma and space. */
+#define ID_LIST_ENTRY_SIZE 43
+/* Don't trust Content-Length for reserving more than this. */
+#define ID_LIST_MAX_RESERVE (64 << 20)
+
+typedef struct IdListParser {
+    int state;
+    char hex[40];
+    int n_hex;
+    /* Raw ids, 20 bytes each, in response order. */
+    GByteArray *ids;
+    /* Set when receiving with recv_id_list(). */
+    CURL *curl;
+} IdListParser;
+
+static void
+id_list_parser_init (IdListParser *parser, CURL *curl)
+{
+    memset (parser, 0, sizeof(*parser));
+    parser->ids = g_byte_array_new ();
+    parser->curl = curl;
+}
+
+static void
+id_list_parser_destroy (IdListParser *parser)
+{
+    g_byte_array_free (parser->ids, TRUE);
+}
+
+static guint
+id_list_parser_n_ids (IdListParser *parser)
+{
+    return parser->ids->len / 20;
+}
+
+static const unsigned char *
+id_list_parser_get_id (IdListParser *parser, guint i)
+{
+    return parser->ids->data + (gsize)i * 20;
+}
+
+static int
+id_list_parser_feed (IdListParser *parser, const char *data, size_t len)
+{
+    const char *p, *end = data + len;
+    unsigned char raw[20];
+    size_t n;
+
+    for (p = data; p < end && parser->state != ID_LIST_ERROR; ++p) {
+        if (parser->state == ID_LIST_IN_ID) {
+            /* Copy the hex digits of the id in one go. */
+            n = 0;
+            while (p + n < end && parser->n_hex + n < 40 &&
+                   g_ascii_isxdigit (p[n]))
+                ++n;
+            memcpy (parser->hex + parser->n_hex, p, n);
+            parser->n_hex += n;
+            p += n;
+            if (p == end)
+                break;
+            if (*p != '"' || parser->n_hex != 40 ||
+                hex_to_rawdata (parser->hex, raw, 20) < 0) {
+                parser->state = ID_LIST_ERROR;
+                break;
+            }
+            g_byte_array_append (parser->ids, raw, 20);
+            parser->state = ID_LIST_NEXT;
+            continue;
+        }
+
+        if (g_ascii_isspace (*p))
+            continue;
+
+        switch (parser->state) {
+        case ID_LIST_START:
+            parser->state = (*p == '[') ? ID_LIST_FIRST : ID_LIST_ERROR;
+            break;
+        case ID_LIST_FIRST:
+        case ID_LIST_VALUE:
+            if (*p == '"') {
+                parser->n_hex = 0;
+                parser->state = ID_LIST_IN_ID;
+            } else if (*p == ']' && parser->state == ID_LIST_FIRST) {
+                parser->state = ID_LIST_END;
+            } else {
+                parser->state = ID_LIST_ERROR;
+            }
+            break;
+        case ID_LIST_NEXT:
+            if (*p == ',')
+                parser->state = ID_LIST_VALUE;
+            else if (*p == ']')
+                parser->state = ID_LIST_END;
+            else
+                parser->state = ID_LIST_ERROR;
+            break;
+        default:
+            parser->state = ID_LIST_ERROR;
+            break;
+        }
+    }
+
+    return (parser->state == ID_LIST_ERROR) ? -1 : 0;
+}
+
+/* Returns 0 if a complete array was parsed. */
+static int
+id_list_parser_finish (IdListParser *parser)
+{
+    return (parser->state == ID_LIST_END) ? 0 : -1;
+}
+
+/* Reserve room for the ids from the Content-Length of the response. */
+static void
+id_list_parser_reserve (IdListParser *parser)
+{
+    gint64 content_len = -1;
+    guint len;
+
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t cl;
+    if (curl_easy_getinfo (parser->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                           &cl) == CURLE_OK)
+        content_len = (gint64)cl;
+#else
+    double cl;
+    if (curl_easy_getinfo (parser->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD,
+                           &cl) == CURLE_OK)
+        content_len = (gint64)cl;
+#endif
+    if (content_len <= 0)
+        return;
+
+    content_len = MIN (content_len / ID_LIST_ENTRY_SIZE * 20,
+                       ID_LIST_MAX_RESERVE);
+    /* Shrinking the array keeps the allocation. */
+    len = parser->ids->len;
+    g_byte_array_set_size (parser->ids, (guint)content_len);
+    g_byte_array_set_size (parser->ids, len);
+}
+
+/* Write callback feeding the response into an IdListParser. The body of
+ * an error response is dropped, the status is checked by the caller. */
+static size_t
+recv_id_list (void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    IdListParser *parser = userp;
+    long status = 0;
+
+    curl_easy_getinfo (parser->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (status != HTTP_OK)
+        return realsize;
+
+    if (parser->state == ID_LIST_START && parser->ids->len == 0)
+        id_list_parser_reserve (parser);
+
+    if (id_list_parser_feed (parser, contents, realsize) < 0) {
+        seaf_warning ("Invalid id list in response from the server.\n");
+        /* Abort the transfer. */
+        return 0;
+    }
+
+    return realsize;
+}
+
 extern FILE *seafile_get_log_fp ();
 
 #define HTTP_TIMEOUT_SEC 300
@@ -1245,6 +1802,38 @@ emit_transfer_done_signal (HttpTxTask *task)
         g_signal_emit_by_name (seaf, "repo-http-uploaded", task);
 }
 
+/*
+ * Record how long the current runtime state of @task took, when it's left
+ * for @rt_state. Stages that end with an error or cancellation are not
+ * recorded, so the histograms only show the latency of completed stages.
+ */
+static void
+record_rt_state_latency (HttpTxTask *task, int state, int rt_state)
+{
+    const char *type = (task->type == HTTP_TASK_TYPE_DOWNLOAD) ? "download" : "upload";
+    gint64 now = g_get_monotonic_time ();
+    char *name;
+
+    if (task->runtime_state == HTTP_TASK_RT_STATE_INIT)
+        task->start_time = now;
+
+    if (task->rt_state_start != 0 &&
+        state != HTTP_TASK_STATE_ERROR && state != HTTP_TASK_STATE_CANCELED) {
+        name = g_strconcat (type, ".",
+                            http_task_rt_state_to_str (task->runtime_state), NULL);
+        latency_stats_record (name, now - task->rt_state_start);
+        g_free (name);
+
+        if (rt_state == HTTP_TASK_RT_STATE_FINISHED && task->start_time != 0) {
+            name = g_strconcat (type, ".total", NULL);
+            latency_stats_record (name, now - task->start_time);
+            g_free (name);
+        }
+    }
+
+    task->rt_state_start = now;
+}
+
 static void
 transition_state (HttpTxTask *task, int state, int rt_state)
 {
@@ -1255,6 +1844,9 @@ transition_state (HttpTxTask *task, int state, int rt_state)
                   http_task_state_to_str(state),
                   http_task_rt_state_to_str(rt_state));
 
+    if (rt_state != task->runtime_state)
+        record_rt_state_latency (task, state, rt_state);
+
     if (state != task->state)
         task->state = state;
     task->runtime_state = rt_state;
@@ -1281,9 +1873,15 @@ typedef struct {
     gboolean success;
     gboolean not_supported;
     int version;
+    gboolean block_pack;
+    gboolean compact_id_check;
+    const char *block_encoding;
     int error_code;
 } CheckProtocolData;
 
+static const char *
+choose_block_encoding (json_t *encodings);
+
 static int
 parse_protocol_version (const char *rsp_content, int rsp_size, CheckProtocolData *data)
 {
@@ -1306,6 +1904,11 @@ parse_protocol_version (const char *rsp_content, int rsp_size, CheckProtocolData
         return -1;
     }
 
+    data->block_pack = json_is_true (json_object_get (object, "block_pack"));
+    data->compact_id_check = json_is_true (json_object_get (object, "compact_id_check"));
+    data->block_encoding = choose_block_encoding (json_object_get (object,
+                                                                   "block_compression"));
+
     json_decref (object);
     return 0;
 }
@@ -1356,6 +1959,9 @@ check_protocol_version_thread (void *vdata)
             data->not_supported = TRUE;
         else if (parse_protocol_version (rsp_content, rsp_size, data) < 0)
             data->not_supported = TRUE;
+        pool->block_pack_supported = data->block_pack;
+        pool->compact_id_check_supported = data->compact_id_check;
+        pool->block_encoding = data->block_encoding;
     } else {
         seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
         data->not_supported = TRUE;
@@ -1667,10 +2273,11 @@ http_tx_manager_check_head_commit (HttpTxManager *manager,
     data->user_data = user_data;
     data->use_fileserver_port = use_fileserver_port;
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                       check_head_commit_thread,
-                                       check_head_commit_done,
-                                       data) < 0) {
+    if (seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                     JOB_PRIORITY_INTERACTIVE,
+                                                     check_head_commit_thread,
+                                                     check_head_commit_done,
+                                                     data) < 0) {
         g_free (data->host);
         g_free (data->token);
         g_free (data);
@@ -2021,10 +2628,11 @@ http_tx_manager_get_folder_perms (HttpTxManager *manager,
     data->user_data = user_data;
     data->use_fileserver_port = use_fileserver_port;
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                       get_folder_perms_thread,
-                                       get_folder_perms_done,
-                                       data) < 0) {
+    if (seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                     JOB_PRIORITY_INTERACTIVE,
+                                                     get_folder_perms_thread,
+                                                     get_folder_perms_done,
+                                                     data) < 0) {
         g_free (data->host);
         g_free (data);
         return -1;
@@ -2297,10 +2905,11 @@ http_tx_manager_get_locked_files (HttpTxManager *manager,
     data->user_data = user_data;
     data->use_fileserver_port = use_fileserver_port;
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                       get_locked_files_thread,
-                                       get_locked_files_done,
-                                       data) < 0) {
+    if (seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                     JOB_PRIORITY_INTERACTIVE,
+                                                     get_locked_files_thread,
+                                                     get_locked_files_done,
+                                                     data) < 0) {
         g_free (data->host);
         g_free (data);
         return -1;
@@ -2367,12 +2976,14 @@ out:
 }
 
 int
-http_tx_manager_unlock_file (HttpTxManager *manager,
-                             const char *host,
-                             gboolean use_fileserver_port,
-                             const char *token,
-                             const char *repo_id,
-                             const char *path)
+http_tx_manager_put_block (HttpTxManager *manager,
+                           const char *host,
+                           gboolean use_fileserver_port,
+                           const char *token,
+                           const char *repo_id,
+                           const char *block_id,
+                           const char *buf,
+                           int len)
 {
     HttpTxPriv *priv = seaf->http_tx_mgr->priv;
     ConnectionPool *pool;
@@ -2396,14 +3007,12 @@ http_tx_manager_unlock_file (HttpTxManager *manager,
 
     curl = conn->curl;
 
-    char *esc_path = g_uri_escape_string(path, NULL, FALSE);
     if (!use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/unlock-file?p=%s", host, repo_id, esc_path);
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/block/%s", host, repo_id, block_id);
     else
-        url = g_strdup_printf ("%s/repo/%s/unlock-file?p=%s", host, repo_id, esc_path);
-    g_free (esc_path);
+        url = g_strdup_printf ("%s/repo/%s/block/%s", host, repo_id, block_id);
 
-    if (http_put (curl, url, token, NULL, 0, NULL, NULL,
+    if (http_put (curl, url, token, buf, len, NULL, NULL,
                   &status, NULL, NULL, TRUE, NULL) < 0) {
         conn->release = TRUE;
         ret = -1;
@@ -2413,25 +3022,149 @@ http_tx_manager_unlock_file (HttpTxManager *manager,
     if (status != HTTP_OK) {
         seaf_warning ("Bad response code for PUT %s: %d.\n", url, status);
         ret = -1;
+        goto out;
     }
 
+    g_atomic_int_add (&(seaf->sync_mgr->sent_bytes), len);
+
 out:
     g_free (url);
+    curl_easy_reset (curl);
     connection_pool_return_connection (pool, conn);
     return ret;
 }
 
-typedef struct {
-    char *host;
-    char *url;
-    char *api_token;
-    HttpAPIGetCallback callback;
-    void *user_data;
-
-    gboolean success;
-    char *rsp_content;
-    int rsp_size;
-    int error_code;
+int
+http_tx_manager_get_block (HttpTxManager *manager,
+                           const char *host,
+                           gboolean use_fileserver_port,
+                           const char *token,
+                           const char *repo_id,
+                           const char *block_id,
+                           char **buf,
+                           gint64 *len)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *pool;
+    Connection *conn;
+    CURL *curl;
+    char *url;
+    int status;
+    char *rsp_content = NULL;
+    gint64 rsp_size = 0;
+    int ret = 0;
+
+    pool = find_connection_pool (priv, host);
+    if (!pool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", host);
+        return -1;
+    }
+
+    conn = connection_pool_get_connection (pool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", host);
+        return -1;
+    }
+
+    curl = conn->curl;
+
+    if (!use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/block/%s", host, repo_id, block_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/block/%s", host, repo_id, block_id);
+
+    if (http_get (curl, url, token, &status, &rsp_content, &rsp_size,
+                  NULL, NULL, TRUE, NULL) < 0) {
+        conn->release = TRUE;
+        ret = -1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
+        g_free (rsp_content);
+        ret = -1;
+        goto out;
+    }
+
+    g_atomic_int_add (&(seaf->sync_mgr->recv_bytes), (gint)rsp_size);
+
+    *buf = rsp_content;
+    *len = rsp_size;
+
+out:
+    g_free (url);
+    curl_easy_reset (curl);
+    connection_pool_return_connection (pool, conn);
+    return ret;
+}
+
+int
+http_tx_manager_unlock_file (HttpTxManager *manager,
+                             const char *host,
+                             gboolean use_fileserver_port,
+                             const char *token,
+                             const char *repo_id,
+                             const char *path)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *pool;
+    Connection *conn;
+    CURL *curl;
+    char *url;
+    int status;
+    int ret = 0;
+
+    pool = find_connection_pool (priv, host);
+    if (!pool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", host);
+        return -1;
+    }
+
+    conn = connection_pool_get_connection (pool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", host);
+        return -1;
+    }
+
+    curl = conn->curl;
+
+    char *esc_path = g_uri_escape_string(path, NULL, FALSE);
+    if (!use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/unlock-file?p=%s", host, repo_id, esc_path);
+    else
+        url = g_strdup_printf ("%s/repo/%s/unlock-file?p=%s", host, repo_id, esc_path);
+    g_free (esc_path);
+
+    if (http_put (curl, url, token, NULL, 0, NULL, NULL,
+                  &status, NULL, NULL, TRUE, NULL) < 0) {
+        conn->release = TRUE;
+        ret = -1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for PUT %s: %d.\n", url, status);
+        ret = -1;
+    }
+
+out:
+    g_free (url);
+    connection_pool_return_connection (pool, conn);
+    return ret;
+}
+
+typedef struct {
+    char *host;
+    char *url;
+    char *api_token;
+    HttpAPIGetCallback callback;
+    void *user_data;
+
+    gboolean success;
+    char *rsp_content;
+    int rsp_size;
+    int error_code;
     int http_status;
 } APIGetData;
 
@@ -2525,10 +3258,11 @@ http_tx_manager_fileserver_api_get  (HttpTxManager *manager,
     data->callback = callback;
     data->user_data = user_data;
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                       fileserver_api_get_request,
-                                       fileserver_api_get_request_done,
-                                       data) < 0) {
+    if (seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                     JOB_PRIORITY_INTERACTIVE,
+                                                     fileserver_api_get_request,
+                                                     fileserver_api_get_request_done,
+                                                     data) < 0) {
         g_free (data->rsp_content);
         g_free (data->host);
         g_free (data->url);
@@ -2799,6 +3533,7 @@ http_tx_manager_add_upload (HttpTxManager *manager,
 {
     HttpTxTask *task;
     SeafRepo *repo;
+    SeafBranch *local;
 
     if (!repo_id) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(repo_id)");
@@ -2835,14 +3570,25 @@ http_tx_manager_add_upload (HttpTxManager *manager,
 
     task->repo_name = g_strdup(repo->name);
 
+    /* Upload the head of the local branch at this point. The sync manager
+     * may commit again while the upload is queued or running, see
+     * pipelined partial commits in sync-mgr.c.
+     */
+    local = seaf_branch_manager_get_branch (seaf->branch_mgr, repo_id, "local");
+    if (local) {
+        memcpy (task->head, local->commit_id, 40);
+        seaf_branch_unref (local);
+    }
+
     g_hash_table_insert (manager->priv->upload_tasks,
                          g_strdup(repo_id),
                          task);
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                       http_upload_thread,
-                                       http_upload_done,
-                                       task) < 0) {
+    if (seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                     JOB_PRIORITY_BULK,
+                                                     http_upload_thread,
+                                                     http_upload_done,
+                                                     task) < 0) {
         g_hash_table_remove (manager->priv->upload_tasks, repo_id);
         return -1;
     }
@@ -2915,81 +3661,6 @@ check_quota_and_active_paths_diff_dirs (int n, const char *basedir,
     return 0;
 }
 
-static int
-calculate_upload_size_delta_and_active_paths (HttpTxTask *task,
-                                              gint64 *delta,
-                                              GHashTable *active_paths)
-{
-    int ret = 0;
-    SeafBranch *local = NULL, *master = NULL;
-    SeafCommit *local_head = NULL, *master_head = NULL;
-
-    local = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "local");
-    if (!local) {
-        seaf_warning ("Branch local not found for repo %.8s.\n", task->repo_id);
-        ret = -1;
-        goto out;
-    }
-    master = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "master");
-    if (!master) {
-        seaf_warning ("Branch master not found for repo %.8s.\n", task->repo_id);
-        ret = -1;
-        goto out;
-    }
-
-    local_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                 task->repo_id, task->repo_version,
-                                                 local->commit_id);
-    if (!local_head) {
-        seaf_warning ("Local head commit not found for repo %.8s.\n",
-                      task->repo_id);
-        ret = -1;
-        goto out;
-    }
-    master_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                 task->repo_id, task->repo_version,
-                                                 master->commit_id);
-    if (!master_head) {
-        seaf_warning ("Master head commit not found for repo %.8s.\n",
-                      task->repo_id);
-        ret = -1;
-        goto out;
-    }
-
-    CalcQuotaDeltaData data;
-    memset (&data, 0, sizeof(data));
-    data.task = task;
-    data.active_paths = active_paths;
-
-    DiffOptions opts;
-    memset (&opts, 0, sizeof(opts));
-    memcpy (opts.store_id, task->repo_id, 36);
-    opts.version = task->repo_version;
-    opts.file_cb = check_quota_and_active_paths_diff_files;
-    opts.dir_cb = check_quota_and_active_paths_diff_dirs;
-    opts.data = &data;
-
-    const char *trees[2];
-    trees[0] = local_head->root_id;
-    trees[1] = master_head->root_id;
-    if (diff_trees (2, trees, &opts) < 0) {
-        seaf_warning ("Failed to diff local and master head for repo %.8s.\n",
-                      task->repo_id);
-        ret = -1;
-        goto out;
-    }
-
-    *delta = data.delta;
-
-out:
-    seaf_branch_unref (local);
-    seaf_branch_unref (master);
-    seaf_commit_unref (local_head);
-    seaf_commit_unref (master_head);
-
-    return ret;
-}
-
 static int
 check_quota (HttpTxTask *task, Connection *conn, gint64 delta)
 {
@@ -3132,91 +3803,17 @@ collect_dir_ids (int n, const char *basedir, SeafDirent *dirs[], void *vdata,
     return 0;
 }
 
-static GList *
-calculate_send_fs_object_list (HttpTxTask *task)
-{
-    GList *ret = NULL;
-    SeafBranch *local = NULL, *master = NULL;
-    SeafCommit *local_head = NULL, *master_head = NULL;
-    GList *ptr;
-
-    local = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "local");
-    if (!local) {
-        seaf_warning ("Branch local not found for repo %.8s.\n", task->repo_id);
-        goto out;
-    }
-    master = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "master");
-    if (!master) {
-        seaf_warning ("Branch master not found for repo %.8s.\n", task->repo_id);
-        goto out;
-    }
-
-    local_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                 task->repo_id, task->repo_version,
-                                                 local->commit_id);
-    if (!local_head) {
-        seaf_warning ("Local head commit not found for repo %.8s.\n",
-                      task->repo_id);
-        goto out;
-    }
-    master_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                  task->repo_id, task->repo_version,
-                                                  master->commit_id);
-    if (!master_head) {
-        seaf_warning ("Master head commit not found for repo %.8s.\n",
-                      task->repo_id);
-        goto out;
-    }
-
-    /* Diff won't traverse the root object itself. */
-    if (strcmp (local_head->root_id, master_head->root_id) != 0)
-        ret = g_list_prepend (ret, g_strdup(local_head->root_id));
-
-    CalcFsListData *data = g_new0(CalcFsListData, 1);
-    data->pret = &ret;
-    data->checked_objs = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                g_free, NULL);
-
-    DiffOptions opts;
-    memset (&opts, 0, sizeof(opts));
-    memcpy (opts.store_id, task->repo_id, 36);
-    opts.version = task->repo_version;
-    opts.file_cb = collect_file_ids;
-    opts.dir_cb = collect_dir_ids;
-    opts.data = data;
-
-    const char *trees[2];
-    trees[0] = local_head->root_id;
-    trees[1] = master_head->root_id;
-    if (diff_trees (2, trees, &opts) < 0) {
-        seaf_warning ("Failed to diff local and master head for repo %.8s.\n",
-                      task->repo_id);
-        for (ptr = ret; ptr; ptr = ptr->next)
-            g_free (ptr->data);
-        ret = NULL;
-    }
-
-    g_hash_table_destroy (data->checked_objs);
-    g_free (data);
-
-out:
-    seaf_branch_unref (local);
-    seaf_branch_unref (master);
-    seaf_commit_unref (local_head);
-    seaf_commit_unref (master_head);
-    return ret;
-}
-
 #define ID_LIST_SEGMENT_N 1000
 
 static int
-upload_check_id_list_segment (HttpTxTask *task, Connection *conn, const char *url,
-                              GList **send_id_list, GList **recv_id_list)
+check_id_list_segment_json (HttpTxTask *task, Connection *conn, const char *url,
+                            GList **send_id_list, GList **recv_id_list)
 {
     json_t *array;
-    json_error_t jerror;
     char *obj_id;
     int n_sent = 0;
+    IdListParser parser = { 0 };
+    char hex[41];
     char *data = NULL;
     int len;
     CURL *curl;
@@ -3270,36 +3867,28 @@ upload_check_id_list_segment (HttpTxTask *task, Connection *conn, const char *ur
 
     /* Process needed object id list. */
 
-    array = json_loadb (rsp_content, rsp_size, 0, &jerror);
-    if (!array) {
-        seaf_warning ("Invalid JSON response from the server: %s.\n", jerror.text);
+    id_list_parser_init (&parser, NULL);
+    if (id_list_parser_feed (&parser, rsp_content, rsp_size) < 0 ||
+        id_list_parser_finish (&parser) < 0) {
+        seaf_warning ("Invalid id list in response from the server.\n");
         task->error = SYNC_ERROR_ID_SERVER;
         ret = -1;
         goto out;
     }
 
-    int i;
-    size_t n = json_array_size (array);
-    json_t *str;
+    guint i, n = id_list_parser_n_ids (&parser);
 
-    seaf_debug ("%lu objects or blocks are needed for %s:%s.\n",
+    seaf_debug ("%u objects or blocks are needed for %s:%s.\n",
                 n, task->host, task->repo_id);
 
     for (i = 0; i < n; ++i) {
-        str = json_array_get (array, i);
-        if (!str) {
-            seaf_warning ("Invalid JSON response from the server.\n");
-            json_decref (array);
-            ret = -1;
-            goto out;
-        }
-
-        *recv_id_list = g_list_prepend (*recv_id_list, g_strdup(json_string_value(str)));
+        rawdata_to_hex (id_list_parser_get_id (&parser, i), hex, 20);
+        *recv_id_list = g_list_prepend (*recv_id_list, g_strdup(hex));
     }
 
-    json_decref (array);
-
 out:
+    if (parser.ids)
+        id_list_parser_destroy (&parser);
     curl_easy_reset (curl);
     g_free (data);
     g_free (rsp_content);
@@ -3307,12 +3896,181 @@ out:
     return ret;
 }
 
-#define MAX_OBJECT_PACK_SIZE (1 << 20) /* 1MB */
+/*
+ * Compact id check.
+ *
+ * Instead of a JSON list of hex ids, the first ID_PREFIX_BYTES bytes of
+ * each id are posted in binary. The server answers with two bits per id,
+ * in request order (least significant bits first):
+ *
+ * - ID_CHECK_PRESENT: exactly one object on the server has the prefix.
+ * - ID_CHECK_NEEDED: no object on the server has the prefix.
+ * - ID_CHECK_AMBIGUOUS: several objects have the prefix. Those ids are
+ *   checked again with their full value in the JSON format.
+ *
+ * With 96-bit prefixes of SHA-1 ids, a single object on the server
+ * matching the prefix of a different id is practically impossible. The
+ * request is about a quarter of the JSON size, the response is tiny.
+ */
 
-#ifdef WIN32
-__pragma(pack(push, 1))
-typedef struct {
-    char obj_id[40];
+#define ID_PREFIX_BYTES 12
+#define COMPACT_ID_LIST_SEGMENT_N 20000
+
+enum {
+    ID_CHECK_PRESENT = 0,
+    ID_CHECK_NEEDED = 1,
+    ID_CHECK_AMBIGUOUS = 2,
+};
+
+/* Returns 1 if the server doesn't support the compact format; then the
+ * ids are left in @send_id_list. */
+static int
+check_id_list_segment_compact (HttpTxTask *task, Connection *conn,
+                               ConnectionPool *pool, const char *url,
+                               GList **send_id_list, GList **recv_id_list)
+{
+    GPtrArray *ids;
+    GList *ambiguous = NULL;
+    unsigned char *req;
+    char *compact_url = NULL;
+    char *obj_id;
+    int status;
+    char *rsp_content = NULL;
+    gint64 rsp_size;
+    int state;
+    guint i;
+    int ret = 0;
+
+    ids = g_ptr_array_new_with_free_func (g_free);
+    while (*send_id_list != NULL && ids->len < COMPACT_ID_LIST_SEGMENT_N) {
+        g_ptr_array_add (ids, (*send_id_list)->data);
+        *send_id_list = g_list_delete_link (*send_id_list, *send_id_list);
+    }
+
+    req = g_malloc (ids->len * ID_PREFIX_BYTES);
+    for (i = 0; i < ids->len; ++i) {
+        if (hex_to_rawdata (g_ptr_array_index (ids, i),
+                            req + i * ID_PREFIX_BYTES, ID_PREFIX_BYTES) < 0) {
+            seaf_warning ("Invalid object id %s in repo %.8s.\n",
+                          (char *)g_ptr_array_index (ids, i), task->repo_id);
+            task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+            ret = -1;
+            goto out;
+        }
+    }
+
+    seaf_debug ("Check %u ids in compact format for %s:%s.\n",
+                ids->len, task->host, task->repo_id);
+
+    compact_url = g_strconcat (url, "?format=compact", NULL);
+
+    int curl_error;
+    if (http_post (conn->curl, compact_url, task->token,
+                   (char *)req, ids->len * ID_PREFIX_BYTES,
+                   &status, &rsp_content, &rsp_size, TRUE, &curl_error) < 0) {
+        conn->release = TRUE;
+        handle_curl_errors (task, curl_error);
+        ret = -1;
+        goto out;
+    }
+
+    if (status == HTTP_NOT_FOUND || status == HTTP_BAD_REQUEST) {
+        seaf_message ("Server %s doesn't support compact id checks.\n", task->host);
+        pool->compact_id_check_supported = FALSE;
+        /* Give the ids back for the JSON check. */
+        for (i = ids->len; i > 0; --i)
+            *send_id_list = g_list_prepend (*send_id_list,
+                                            g_strdup (g_ptr_array_index (ids, i - 1)));
+        ret = 1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for POST %s: %d.\n", compact_url, status);
+        handle_http_errors (task, status);
+        ret = -1;
+        goto out;
+    }
+
+    if (rsp_size != (ids->len + 3) / 4) {
+        seaf_warning ("Invalid compact id check response size %"G_GINT64_FORMAT
+                      " for %u ids.\n", rsp_size, ids->len);
+        task->error = SYNC_ERROR_ID_SERVER;
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < ids->len; ++i) {
+        state = ((unsigned char)rsp_content[i / 4] >> ((i % 4) * 2)) & 3;
+        obj_id = g_ptr_array_index (ids, i);
+        switch (state) {
+        case ID_CHECK_PRESENT:
+            break;
+        case ID_CHECK_NEEDED:
+            *recv_id_list = g_list_prepend (*recv_id_list, g_strdup(obj_id));
+            break;
+        case ID_CHECK_AMBIGUOUS:
+            ambiguous = g_list_prepend (ambiguous, g_strdup(obj_id));
+            break;
+        default:
+            seaf_warning ("Invalid state %d in compact id check response.\n", state);
+            task->error = SYNC_ERROR_ID_SERVER;
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (ambiguous)
+        seaf_debug ("%d ids are ambiguous for %s:%s.\n",
+                    g_list_length (ambiguous), task->host, task->repo_id);
+
+    curl_easy_reset (conn->curl);
+    while (ambiguous != NULL) {
+        if (check_id_list_segment_json (task, conn, url, &ambiguous, recv_id_list) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+out:
+    g_free (compact_url);
+    string_list_free (ambiguous);
+    curl_easy_reset (conn->curl);
+    g_free (rsp_content);
+    g_free (req);
+    g_ptr_array_free (ids, TRUE);
+
+    return ret;
+}
+
+/* Check which ids in @send_id_list the server needs, a segment at a time.
+ * The needed ids are added to @recv_id_list. */
+static int
+upload_check_id_list_segment (HttpTxTask *task, Connection *conn, const char *url,
+                              GList **send_id_list, GList **recv_id_list)
+{
+    ConnectionPool *pool = find_connection_pool (seaf->http_tx_mgr->priv,
+                                                 task->host);
+    int rc;
+
+    if (pool && pool->compact_id_check_supported) {
+        rc = check_id_list_segment_compact (task, conn, pool, url,
+                                            send_id_list, recv_id_list);
+        if (rc <= 0)
+            return rc;
+    }
+
+    return check_id_list_segment_json (task, conn, url, send_id_list, recv_id_list);
+}
+
+#define MAX_OBJECT_PACK_SIZE (1 << 20) /* 1MB */
+/* Packs shrink down to this when the memory budget runs low. */
+#define MIN_OBJECT_PACK_SIZE (64 << 10) /* 64KB */
+
+#ifdef WIN32
+__pragma(pack(push, 1))
+typedef struct {
+    char obj_id[40];
     guint32 obj_size;
     guint8 object[0];
 } ObjectHeader;
@@ -3325,6 +4083,107 @@ typedef struct {
 } __attribute__((__packed__)) ObjectHeader;
 #endif
 
+int
+http_tx_manager_get_fs_objects (HttpTxManager *manager,
+                                const char *host,
+                                gboolean use_fileserver_port,
+                                const char *token,
+                                const char *repo_id,
+                                int repo_version,
+                                GList *obj_ids)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *pool;
+    Connection *conn;
+    CURL *curl;
+    char *url;
+    json_t *array;
+    GList *ptr;
+    char *req = NULL;
+    int status;
+    char *rsp_content = NULL;
+    gint64 rsp_size = 0;
+    ObjectHeader *hdr;
+    char obj_id[41];
+    guint32 obj_size;
+    char *p, *end;
+    int n_written = 0;
+
+    pool = find_connection_pool (priv, host);
+    if (!pool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", host);
+        return -1;
+    }
+
+    conn = connection_pool_get_connection (pool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", host);
+        return -1;
+    }
+
+    curl = conn->curl;
+
+    array = json_array ();
+    for (ptr = obj_ids; ptr; ptr = ptr->next)
+        json_array_append_new (array, json_string (ptr->data));
+    req = json_dumps (array, 0);
+    json_decref (array);
+
+    if (!use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/pack-fs/", host, repo_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/pack-fs/", host, repo_id);
+
+    if (http_post (curl, url, token, req, strlen(req),
+                   &status, &rsp_content, &rsp_size, TRUE, NULL) < 0) {
+        conn->release = TRUE;
+        n_written = -1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for POST %s: %d.\n", url, status);
+        n_written = -1;
+        goto out;
+    }
+
+    g_atomic_int_add (&(seaf->sync_mgr->recv_bytes), (gint)rsp_size);
+
+    p = rsp_content;
+    end = rsp_content + rsp_size;
+    while (end - p >= (gint64)sizeof(ObjectHeader)) {
+        hdr = (ObjectHeader *)p;
+        memcpy (obj_id, hdr->obj_id, 40);
+        obj_id[40] = 0;
+        obj_size = ntohl (hdr->obj_size);
+        p += sizeof(ObjectHeader);
+        if (end - p < (gint64)obj_size) {
+            seaf_warning ("Incomplete fs object %s in response of %s.\n",
+                          obj_id, url);
+            break;
+        }
+
+        if (seaf_obj_store_write_obj (seaf->fs_mgr->obj_store,
+                                      repo_id, repo_version,
+                                      obj_id, p, (int)obj_size, FALSE) < 0) {
+            seaf_warning ("Failed to write fs object %s in repo %.8s.\n",
+                          obj_id, repo_id);
+            n_written = -1;
+            goto out;
+        }
+        ++n_written;
+        p += obj_size;
+    }
+
+out:
+    g_free (url);
+    free (req);
+    g_free (rsp_content);
+    curl_easy_reset (curl);
+    connection_pool_return_connection (pool, conn);
+    return n_written;
+}
+
 static int
 send_fs_objects (HttpTxTask *task, Connection *conn, GList **send_fs_list)
 {
@@ -3340,10 +4199,14 @@ send_fs_objects (HttpTxTask *task, Connection *conn, GList **send_fs_list)
     int status;
     int ret = 0;
     int n_sent = 0;
+    gint64 max_pack_size, reserved = 0;
 
     buf = evbuffer_new ();
     curl = conn->curl;
 
+    max_pack_size = mem_budget_batch_size (MAX_OBJECT_PACK_SIZE,
+                                           MIN_OBJECT_PACK_SIZE);
+
     while (*send_fs_list != NULL) {
         obj_id = (*send_fs_list)->data;
 
@@ -3370,10 +4233,13 @@ send_fs_objects (HttpTxTask *task, Connection *conn, GList **send_fs_list)
         g_free (obj_id);
 
         total_size = evbuffer_get_length (buf);
-        if (total_size >= MAX_OBJECT_PACK_SIZE)
+        if (total_size >= max_pack_size)
             break;
     }
 
+    reserved = evbuffer_get_length (buf);
+    mem_budget_reserve (reserved);
+
     seaf_debug ("Sending %d fs objects for %s:%s.\n",
                 n_sent, task->host, task->repo_id);
 
@@ -3403,6 +4269,7 @@ send_fs_objects (HttpTxTask *task, Connection *conn, GList **send_fs_list)
     }
 
 out:
+    mem_budget_release (reserved);
     g_free (url);
     evbuffer_free (buf);
     curl_easy_reset (curl);
@@ -3411,23 +4278,11 @@ out:
 }
 
 typedef struct {
-    GList *block_list;
-    GHashTable *added_blocks;
+    /* Raw ids of the blocks to upload. */
+    BlockList *blocks;
     HttpTxTask *task;
 } CalcBlockListData;
 
-static void
-add_to_block_list (GList **block_list, GHashTable *added_blocks, const char *block_id)
-{
-    int dummy;
-
-    if (g_hash_table_lookup (added_blocks, block_id))
-        return;
-
-    *block_list = g_list_prepend (*block_list, g_strdup(block_id));
-    g_hash_table_insert (added_blocks, g_strdup(block_id), &dummy);
-}
-
 static int
 block_list_diff_files (int n, const char *basedir, SeafDirent *files[], void *vdata)
 {
@@ -3449,8 +4304,7 @@ block_list_diff_files (int n, const char *basedir, SeafDirent *files[], void *vd
                 return -1;
             }
             for (i = 0; i < f1->n_blocks; ++i)
-                add_to_block_list (&data->block_list, data->added_blocks,
-                                   f1->blk_sha1s[i]);
+                block_list_insert_id (data->blocks, f1->blk_ids + i * 20);
             seafile_unref (f1);
         } else if (strcmp (file1->id, file2->id) != 0) {
             f1 = seaf_fs_manager_get_seafile (seaf->fs_mgr,
@@ -3471,15 +4325,13 @@ block_list_diff_files (int n, const char *basedir, SeafDirent *files[], void *vd
                 return -1;
             }
 
-            GHashTable *h = g_hash_table_new (g_str_hash, g_str_equal);
-            int dummy;
+            GHashTable *h = g_hash_table_new (ccnet_sha1_hash, ccnet_sha1_equal);
             for (i = 0; i < f2->n_blocks; ++i)
-                g_hash_table_insert (h, f2->blk_sha1s[i], &dummy);
+                g_hash_table_add (h, f2->blk_ids + i * 20);
 
             for (i = 0; i < f1->n_blocks; ++i)
-                if (!g_hash_table_lookup (h, f1->blk_sha1s[i]))
-                    add_to_block_list (&data->block_list, data->added_blocks,
-                                       f1->blk_sha1s[i]);
+                if (!g_hash_table_contains (h, f1->blk_ids + i * 20))
+                    block_list_insert_id (data->blocks, f1->blk_ids + i * 20);
 
             seafile_unref (f1);
             seafile_unref (f2);
@@ -3490,27 +4342,84 @@ block_list_diff_files (int n, const char *basedir, SeafDirent *files[], void *vd
     return 0;
 }
 
+/*
+ * Upload planning.
+ *
+ * The quota delta, the active paths, the fs objects and the blocks to
+ * upload all come from the diff between the local head and master. They
+ * are collected in one diff_trees() pass, so that the dir objects are only
+ * loaded once.
+ */
+typedef struct {
+    CalcQuotaDeltaData quota;
+    CalcFsListData *fs;         /* NULL if the fs list isn't needed */
+    CalcBlockListData *blocks;  /* NULL if the block list isn't needed */
+} UploadPlanData;
+
+static int
+plan_upload_diff_files (int n, const char *basedir, SeafDirent *files[],
+                        void *vdata)
+{
+    UploadPlanData *data = vdata;
+
+    check_quota_and_active_paths_diff_files (n, basedir, files, &data->quota);
+    if (data->fs)
+        collect_file_ids (n, basedir, files, data->fs);
+    if (data->blocks)
+        return block_list_diff_files (n, basedir, files, data->blocks);
+    return 0;
+}
+
 static int
-block_list_diff_dirs (int n, const char *basedir, SeafDirent *dirs[], void *data,
-                      gboolean *recurse)
+plan_upload_diff_dirs (int n, const char *basedir, SeafDirent *dirs[],
+                       void *vdata, gboolean *recurse)
 {
-    /* Do nothing */
+    UploadPlanData *data = vdata;
+
+    check_quota_and_active_paths_diff_dirs (n, basedir, dirs, &data->quota,
+                                            recurse);
+    if (data->fs)
+        collect_dir_ids (n, basedir, dirs, data->fs, recurse);
     return 0;
 }
 
+static GList *
+block_list_to_hex_list (BlockList *blocks)
+{
+    /* Hex ids are only needed for the requests to the server. */
+    GList *list = NULL;
+    char block_id[41];
+    int i;
+
+    for (i = blocks->n_blocks - 1; i >= 0; --i) {
+        block_list_get_id (blocks, i, block_id);
+        list = g_list_prepend (list, g_strdup(block_id));
+    }
+    return list;
+}
+
+/*
+ * Calculate the upload size delta and the active paths, and if @fs_list
+ * or @block_list is not NULL, the fs objects and blocks to upload.
+ */
 static int
-calculate_block_list (HttpTxTask *task, GList **plist)
+calculate_upload_plan (HttpTxTask *task,
+                       gint64 *delta,
+                       GHashTable *active_paths,
+                       GList **fs_list,
+                       GList **block_list)
 {
     int ret = 0;
-    SeafBranch *local = NULL, *master = NULL;
+    SeafBranch *master = NULL;
     SeafCommit *local_head = NULL, *master_head = NULL;
+    UploadPlanData data;
+    CalcFsListData fs_data;
+    CalcBlockListData block_data;
+    GList *fs_ids = NULL;
+
+    memset (&data, 0, sizeof(data));
+    memset (&block_data, 0, sizeof(block_data));
 
-    local = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "local");
-    if (!local) {
-        seaf_warning ("Branch local not found for repo %.8s.\n", task->repo_id);
-        ret = -1;
-        goto out;
-    }
     master = seaf_branch_manager_get_branch (seaf->branch_mgr, task->repo_id, "master");
     if (!master) {
         seaf_warning ("Branch master not found for repo %.8s.\n", task->repo_id);
@@ -3520,7 +4429,7 @@ calculate_block_list (HttpTxTask *task, GList **plist)
 
     local_head = seaf_commit_manager_get_commit (seaf->commit_mgr,
                                                  task->repo_id, task->repo_version,
-                                                 local->commit_id);
+                                                 task->head);
     if (!local_head) {
         seaf_warning ("Local head commit not found for repo %.8s.\n",
                       task->repo_id);
@@ -3537,17 +4446,32 @@ calculate_block_list (HttpTxTask *task, GList **plist)
         goto out;
     }
 
-    CalcBlockListData data;
-    memset (&data, 0, sizeof(data));
-    data.added_blocks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-    data.task = task;
+    data.quota.task = task;
+    data.quota.active_paths = active_paths;
+
+    if (fs_list) {
+        /* Diff won't traverse the root object itself. */
+        if (strcmp (local_head->root_id, master_head->root_id) != 0)
+            fs_ids = g_list_prepend (fs_ids, g_strdup(local_head->root_id));
+
+        fs_data.pret = &fs_ids;
+        fs_data.checked_objs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                      g_free, NULL);
+        data.fs = &fs_data;
+    }
+
+    if (block_list) {
+        block_data.blocks = block_list_new ();
+        block_data.task = task;
+        data.blocks = &block_data;
+    }
 
     DiffOptions opts;
     memset (&opts, 0, sizeof(opts));
     memcpy (opts.store_id, task->repo_id, 36);
     opts.version = task->repo_version;
-    opts.file_cb = block_list_diff_files;
-    opts.dir_cb = block_list_diff_dirs;
+    opts.file_cb = plan_upload_diff_files;
+    opts.dir_cb = plan_upload_diff_dirs;
     opts.data = &data;
 
     const char *trees[2];
@@ -3556,962 +4480,1496 @@ calculate_block_list (HttpTxTask *task, GList **plist)
     if (diff_trees (2, trees, &opts) < 0) {
         seaf_warning ("Failed to diff local and master head for repo %.8s.\n",
                       task->repo_id);
-        g_hash_table_destroy (data.added_blocks);
-
-        GList *ptr;
-        for (ptr = data.block_list; ptr; ptr = ptr->next)
-            g_free (ptr->data);
-
         ret = -1;
         goto out;
     }
 
-    g_hash_table_destroy (data.added_blocks);
-    *plist = data.block_list;
+    *delta = data.quota.delta;
+    if (fs_list) {
+        *fs_list = fs_ids;
+        fs_ids = NULL;
+    }
+    if (block_list)
+        *block_list = block_list_to_hex_list (block_data.blocks);
 
 out:
-    seaf_branch_unref (local);
+    string_list_free (fs_ids);
+    if (data.fs)
+        g_hash_table_destroy (fs_data.checked_objs);
+    if (block_data.blocks)
+        block_list_free (block_data.blocks);
     seaf_branch_unref (master);
     seaf_commit_unref (local_head);
     seaf_commit_unref (master_head);
     return ret;
 }
 
-typedef struct {
-    char block_id[41];
-    BlockHandle *block;
-    HttpTxTask *task;
-} SendBlockData;
+/*
+ * Compression of blocks on the wire.
+ *
+ * The server lists the content encodings it accepts for block requests in
+ * "block_compression" of the protocol-version API. Uploaded blocks may then
+ * be sent with one of them, with a Content-Encoding header, and downloaded
+ * blocks are accepted compressed; libcurl decodes them. zstd is preferred
+ * when the client is built with it, otherwise deflate (the zlib format, as
+ * in HTTP) is used. Block ids are always computed on the plain content,
+ * which is what the block stores keep.
+ *
+ * Compressed or encrypted data is sent as is. It's recognized from a
+ * sample of the block: if nearly all byte values are needed to make up
+ * 90% of the sample, its entropy is too high. A compressed block must
+ * also save at least 1/8 of the size to be sent.
+ */
 
-static size_t
-send_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
+#define BLOCK_COMPRESS_MIN_SIZE 4096
+#define ENTROPY_SAMPLE_SLICES 16
+#define ENTROPY_SAMPLE_SLICE_SIZE 256
+/* Byte values needed to cover 90% of the sample, above which the data is
+ * considered incompressible. */
+#define ENTROPY_MAX_CORE_SET 200
+#define BLOCK_ZSTD_LEVEL 3
+
+static const char *
+choose_block_encoding (json_t *encodings)
 {
-    size_t realsize = size *nmemb;
-    SendBlockData *data = userp;
-    HttpTxTask *task = data->task;
-    int n;
+    const char *deflate = NULL;
+    json_t *item;
+    size_t i;
 
-    if (task->state == HTTP_TASK_STATE_CANCELED || task->all_stop)
-        return CURL_READFUNC_ABORT;
+    if (!encodings || !json_is_array (encodings))
+        return NULL;
 
-    n = seaf_block_manager_read_block (seaf->block_mgr,
-                                       data->block,
-                                       ptr, realsize);
-    if (n < 0) {
-        seaf_warning ("Failed to read block %s in repo %.8s.\n",
-                      data->block_id, task->repo_id);
-        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
-        return CURL_READFUNC_ABORT;
+    for (i = 0; i < json_array_size (encodings); ++i) {
+        item = json_array_get (encodings, i);
+        if (!json_is_string (item))
+            continue;
+#ifdef HAVE_ZSTD
+        if (strcmp (json_string_value (item), "zstd") == 0)
+            return "zstd";
+#endif
+        if (strcmp (json_string_value (item), "deflate") == 0)
+            deflate = "deflate";
     }
 
-    /* Update global transferred bytes. */
-    g_atomic_int_add (&(seaf->sync_mgr->sent_bytes), n);
-
-    /* Update transferred bytes for this task */
-    g_atomic_int_add (&task->tx_bytes, n);
+    return deflate;
+}
 
-    /* If uploaded bytes exceeds the limit, wait until the counter
-     * is reset. We check the counter every 100 milliseconds, so we
-     * can waste up to 100 milliseconds without sending data after
-     * the counter is reset.
-     */
-    while (1) {
-        gint sent = g_atomic_int_get(&(seaf->sync_mgr->sent_bytes));
-        if (seaf->sync_mgr->upload_limit > 0 &&
-            sent > seaf->sync_mgr->upload_limit)
-            /* 100 milliseconds */
-            g_usleep (100000);
-        else
-            break;
-    }
+static int
+compare_counts_desc (const void *a, const void *b)
+{
+    guint32 x = *(const guint32 *)a, y = *(const guint32 *)b;
 
-    return n;
+    return (x < y) - (x > y);
 }
 
-static int
-send_block (HttpTxTask *task, Connection *conn, const char *block_id, guint32 *psize)
+static gboolean
+block_is_compressible (const guint8 *data, guint32 len)
 {
-    CURL *curl;
-    char *url;
-    int status;
-    BlockMetadata *bmd;
-    BlockHandle *block;
-    int ret = 0;
+    guint32 counts[256];
+    guint32 step, total = 0, covered = 0;
+    const guint8 *p;
+    int i, j, core;
 
-    bmd = seaf_block_manager_stat_block (seaf->block_mgr,
-                                         task->repo_id, task->repo_version,
-                                         block_id);
-    if (!bmd) {
-        seaf_warning ("Failed to stat block %s in repo %s.\n",
-                      block_id, task->repo_id);
-        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
-        return -1;
-    }
+    memset (counts, 0, sizeof(counts));
 
-    block = seaf_block_manager_open_block (seaf->block_mgr,
-                                           task->repo_id, task->repo_version,
-                                           block_id, BLOCK_READ);
-    if (!block) {
-        seaf_warning ("Failed to open block %s in repo %s.\n",
-                      block_id, task->repo_id);
-        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
-        g_free (bmd);
-        return -1;
+    /* len >= BLOCK_COMPRESS_MIN_SIZE, so the slices don't overlap. */
+    step = len / ENTROPY_SAMPLE_SLICES;
+    for (i = 0; i < ENTROPY_SAMPLE_SLICES; ++i) {
+        p = data + (gsize)i * step;
+        for (j = 0; j < ENTROPY_SAMPLE_SLICE_SIZE; ++j)
+            ++counts[p[j]];
+        total += ENTROPY_SAMPLE_SLICE_SIZE;
     }
 
-    SendBlockData data;
-    memset (&data, 0, sizeof(data));
-    memcpy (data.block_id, block_id, 40);
-    data.block = block;
-    data.task = task;
+    qsort (counts, 256, sizeof(guint32), compare_counts_desc);
+    for (core = 0; core < 256 && covered < total / 10 * 9; ++core)
+        covered += counts[core];
 
-    curl = conn->curl;
+    return core <= ENTROPY_MAX_CORE_SET;
+}
 
-    if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/block/%s",
-                               task->host, task->repo_id, block_id);
-    else
-        url = g_strdup_printf ("%s/repo/%s/block/%s",
-                               task->host, task->repo_id, block_id);
+#ifdef HAVE_ZSTD
 
-    int curl_error;
-    if (http_put (curl, url, task->token,
-                  NULL, bmd->size,
-                  send_block_callback, &data,
-                  &status, NULL, NULL, TRUE, &curl_error) < 0) {
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto out;
+static void
+zstd_cctx_free (gpointer cctx)
+{
+    ZSTD_freeCCtx (cctx);
+}
 
-        if (task->error == SYNC_ERROR_ID_NO_ERROR) {
-            /* Only release connection when it's a network error */
-            conn->release = TRUE;
-            handle_curl_errors (task, curl_error);
-        }
-        ret = -1;
-        goto out;
+/* Compression contexts are reused by each transfer thread. */
+static GPrivate zstd_cctx_key = G_PRIVATE_INIT (zstd_cctx_free);
+
+static int
+zstd_compress_block (const guint8 *data, guint32 len,
+                     guint8 **out, guint32 *out_len)
+{
+    ZSTD_CCtx *cctx = g_private_get (&zstd_cctx_key);
+    size_t bound, n;
+
+    if (!cctx) {
+        cctx = ZSTD_createCCtx ();
+        if (!cctx)
+            return -1;
+        g_private_set (&zstd_cctx_key, cctx);
     }
 
-    if (status != HTTP_OK) {
-        seaf_warning ("Bad response code for PUT %s: %d.\n", url, status);
-        handle_http_errors (task, status);
-        ret = -1;
-        goto out;
+    bound = ZSTD_compressBound (len);
+    *out = g_malloc (bound);
+    n = ZSTD_compressCCtx (cctx, *out, bound, data, len, BLOCK_ZSTD_LEVEL);
+    if (ZSTD_isError (n)) {
+        seaf_warning ("Failed to compress block: %s.\n", ZSTD_getErrorName (n));
+        g_free (*out);
+        *out = NULL;
+        return -1;
     }
+    *out_len = (guint32)n;
 
-    if (psize)
-        *psize = bmd->size;
+    return 0;
+}
 
-out:
-    g_free (url);
-    curl_easy_reset (curl);
-    g_free (bmd);
-    seaf_block_manager_close_block (seaf->block_mgr, block);
-    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+#endif  /* HAVE_ZSTD */
 
-    return ret;
-}
+/* Returns 0 and sets @out if the block is worth sending compressed. */
+static int
+compress_block (const char *encoding, const guint8 *data, guint32 len,
+                guint8 **out, guint32 *out_len)
+{
+    int n;
+
+    *out = NULL;
+
+    if (len < BLOCK_COMPRESS_MIN_SIZE || !block_is_compressible (data, len))
+        return -1;
+
+#ifdef HAVE_ZSTD
+    if (strcmp (encoding, "zstd") == 0) {
+        if (zstd_compress_block (data, len, out, out_len) < 0)
+            return -1;
+    } else
+#endif
+    {
+        if (seaf_compress ((guint8 *)data, (int)len, out, &n) < 0)
+            return -1;
+        *out_len = (guint32)n;
+    }
+
+    if (*out_len > len - len / 8) {
+        g_free (*out);
+        *out = NULL;
+        return -1;
+    }
 
-typedef struct BlockUploadData {
-    HttpTxTask *http_task;
-    ConnectionPool *cpool;
-    GAsyncQueue *finished_tasks;
-} BlockUploadData;
+    return 0;
+}
 
-typedef struct BlockUploadTask {
+typedef struct {
     char block_id[41];
-    int result;
-    guint32 block_size;
-} BlockUploadTask;
+    BlockHandle *block;
+    /* If set, a downloaded block is received here instead of in @block. */
+    GByteArray *buf;
+    HttpTxTask *task;
+    ConnectionPool *pool;
+    /* Monotonic time when a request paused by rate limiting is resumed,
+     * 0 if it isn't paused. */
+    gint64 paused_until;
+    /* If set, an uploaded block is sent from here, from @buf_off on,
+     * instead of read from @block. It points into @send_buf or into a
+     * mapping of the block. */
+    const guint8 *send_data;
+    guint32 send_len;
+    GByteArray *send_buf;
+    guint32 buf_off;
+} SendBlockData;
+
+/*
+ * Rate limiting of block transfers.
+ *
+ * Block transfers are limited globally, per server and per repo, each
+ * limit by a token bucket. When one of the buckets is in debt, the curl
+ * callbacks pause the request instead of sleeping, and transfer_blocks()
+ * resumes it once the debt is paid off. So the thread keeps driving the
+ * other requests and notices cancellation, and data flows at the limit
+ * instead of in bursts once a second.
+ */
+
+/* Weight of an interactive task when the global limit is shared. */
+#define INTERACTIVE_TX_WEIGHT 4
 
 static void
-block_upload_task_free (BlockUploadTask *task)
+tx_share_enter (HttpTxTask *task, gboolean upload)
 {
-    g_free (task);
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+
+    if (g_atomic_int_add (&task->n_tx_threads, 1) != 0)
+        return;
+    if (task->bulk)
+        g_atomic_int_inc (&priv->n_bulk_tx[upload]);
+    else
+        g_atomic_int_inc (&priv->n_interactive_tx[upload]);
 }
 
 static void
-upload_block_thread_func (gpointer data, gpointer user_data)
+tx_share_leave (HttpTxTask *task, gboolean upload)
 {
-    BlockUploadTask *task = data;
-    BlockUploadData *tx_data = user_data;
-    HttpTxTask *http_task = tx_data->http_task;
-    Connection *conn;
-    int ret = 0;
-
-    conn = connection_pool_get_connection (tx_data->cpool);
-    if (!conn) {
-        seaf_warning ("Failed to get connection to host %s.\n", http_task->host);
-        http_task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
-        ret = -1;
-        goto out;
-    }
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
 
-    ret = send_block (http_task, conn, task->block_id, &task->block_size);
+    if (!g_atomic_int_dec_and_test (&task->n_tx_threads))
+        return;
+    if (task->bulk)
+        g_atomic_int_add (&priv->n_bulk_tx[upload], -1);
+    else
+        g_atomic_int_add (&priv->n_interactive_tx[upload], -1);
+}
 
-    connection_pool_return_connection (tx_data->cpool, conn);
+/* Returns TRUE if a bulk task should yield to interactive tasks. */
+static gboolean
+tx_should_yield (HttpTxTask *task, gboolean upload)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
 
-out:
-    task->result = ret;
-    g_async_queue_push (tx_data->finished_tasks, task);
+    return task->bulk && g_atomic_int_get (&priv->n_interactive_tx[upload]) > 0;
 }
 
-#define DEFAULT_UPLOAD_BLOCK_THREADS 3
-
-static int
-multi_threaded_send_blocks (HttpTxTask *http_task, GList *block_list)
+/*
+ * The limit of @task. While interactive tasks are running, a bulk task
+ * gets one share of the global limit and an interactive task gets
+ * INTERACTIVE_TX_WEIGHT shares, so that bulk tasks can't use up the
+ * bandwidth.
+ */
+static gint64
+task_rate_limit (HttpTxTask *task, gboolean upload)
 {
     HttpTxPriv *priv = seaf->http_tx_mgr->priv;
-    GThreadPool *tpool;
-    GAsyncQueue *finished_tasks;
-    GHashTable *pending_tasks;
-    ConnectionPool *cpool;
-    GList *ptr;
-    char *block_id;
-    BlockUploadTask *task;
-    SyncInfo *info;
-    int ret = 0;
+    gint64 limit, share;
+    int n_bulk;
 
-    if (block_list == NULL)
-        return 0;
+    limit = upload ? seaf->sync_mgr->upload_limit : seaf->sync_mgr->download_limit;
+    if (limit <= 0 || !tx_should_yield (task, upload))
+        return task->rate_limit;
 
-    cpool = find_connection_pool (priv, http_task->host);
-    if (!cpool) {
-        seaf_warning ("Failed to create connection pool for host %s.\n", http_task->host);
-        http_task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
-        return -1;
+    n_bulk = MAX (g_atomic_int_get (&priv->n_bulk_tx[upload]), 1);
+    share = limit / (n_bulk + INTERACTIVE_TX_WEIGHT *
+                     g_atomic_int_get (&priv->n_interactive_tx[upload]));
+    share = MAX (share, 1);
+
+    return task->rate_limit > 0 ? MIN (task->rate_limit, share) : share;
+}
+
+/* Returns the microseconds to wait before transferring more data. */
+static gint64
+block_tx_throttle_delay (SendBlockData *data, gboolean upload)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    HttpTxTask *task = data->task;
+    gint64 delay, d;
+
+    if (upload) {
+        delay = rate_limiter_delay (priv->upload_limiter,
+                                    seaf->sync_mgr->upload_limit);
+        d = rate_limiter_delay (data->pool->upload_limiter,
+                                priv->server_upload_limit);
+    } else {
+        delay = rate_limiter_delay (priv->download_limiter,
+                                    seaf->sync_mgr->download_limit);
+        d = rate_limiter_delay (data->pool->download_limiter,
+                                priv->server_download_limit);
     }
+    delay = MAX (delay, d);
 
-    finished_tasks = g_async_queue_new ();
+    d = rate_limiter_delay (task->limiter, task_rate_limit (task, upload));
 
-    BlockUploadData data;
-    data.http_task = http_task;
-    data.finished_tasks = finished_tasks;
-    data.cpool = cpool;
+    return MAX (delay, d);
+}
 
-    tpool = g_thread_pool_new (upload_block_thread_func, &data,
-                               DEFAULT_UPLOAD_BLOCK_THREADS, FALSE, NULL);
+static void
+block_tx_throttle_consume (SendBlockData *data, gboolean upload, gint64 bytes)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    HttpTxTask *task = data->task;
 
-    pending_tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                           g_free,
-                                           (GDestroyNotify)block_upload_task_free);
+    if (upload) {
+        rate_limiter_consume (priv->upload_limiter,
+                              seaf->sync_mgr->upload_limit, bytes);
+        rate_limiter_consume (data->pool->upload_limiter,
+                              priv->server_upload_limit, bytes);
+    } else {
+        rate_limiter_consume (priv->download_limiter,
+                              seaf->sync_mgr->download_limit, bytes);
+        rate_limiter_consume (data->pool->download_limiter,
+                              priv->server_download_limit, bytes);
+    }
+    rate_limiter_consume (task->limiter, task_rate_limit (task, upload), bytes);
+}
 
-    info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, http_task->repo_id);
+/* Returns TRUE if the request should be paused. */
+static gboolean
+block_tx_throttle (SendBlockData *data, gboolean upload)
+{
+    gint64 delay = block_tx_throttle_delay (data, upload);
 
-    for (ptr = block_list; ptr; ptr = ptr->next) {
-        block_id = ptr->data;
+    if (delay <= 0)
+        return FALSE;
 
-        task = g_new0 (BlockUploadTask, 1);
-        memcpy (task->block_id, block_id, 40);
+    data->paused_until = g_get_monotonic_time () + delay;
+    return TRUE;
+}
 
-        if (!g_hash_table_lookup (pending_tasks, block_id)) {
-            g_hash_table_insert (pending_tasks, g_strdup(block_id), task);
-            g_thread_pool_push (tpool, task, NULL);
-        } else {
-            g_free (task);
-        }
-    }
+static size_t
+send_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size *nmemb;
+    SendBlockData *data = userp;
+    HttpTxTask *task = data->task;
+    int n;
 
-    while ((task = g_async_queue_pop (finished_tasks)) != NULL) {
-        if (task->result < 0 || http_task->state == HTTP_TASK_STATE_CANCELED) {
-            ret = task->result;
-            http_task->all_stop = TRUE;
-            break;
-        }
+    if (task->state == HTTP_TASK_STATE_CANCELED || task->all_stop)
+        return CURL_READFUNC_ABORT;
 
-        ++(http_task->done_blocks);
+    if (block_tx_throttle (data, TRUE))
+        return CURL_READFUNC_PAUSE;
 
-        if (info && info->multipart_upload) {
-            info->uploaded_bytes += (gint64)task->block_size;
+    if (data->send_data) {
+        n = (int)MIN (realsize, data->send_len - data->buf_off);
+        memcpy (ptr, data->send_data + data->buf_off, n);
+        data->buf_off += n;
+    } else {
+        n = seaf_block_manager_read_block (seaf->block_mgr,
+                                           data->block,
+                                           ptr, realsize);
+        if (n < 0) {
+            seaf_warning ("Failed to read block %s in repo %.8s.\n",
+                          data->block_id, task->repo_id);
+            task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+            return CURL_READFUNC_ABORT;
         }
-
-        g_hash_table_remove (pending_tasks, task->block_id);
-        if (g_hash_table_size(pending_tasks) == 0)
-            break;
     }
 
-    g_thread_pool_free (tpool, TRUE, TRUE);
+    /* Update global transferred bytes. */
+    g_atomic_int_add (&(seaf->sync_mgr->sent_bytes), n);
 
-    g_hash_table_destroy (pending_tasks);
+    /* Update transferred bytes for this task */
+    g_atomic_int_add (&task->tx_bytes, n);
 
-    g_async_queue_unref (finished_tasks);
+    block_tx_throttle_consume (data, TRUE, n);
 
-    return ret;
+    return n;
 }
 
-static void
-notify_permission_error (HttpTxTask *task, const char *error_str)
-{
-    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
-    GMatchInfo *match_info;
-    char *path;
+/*
+ * Block transfers driven by a curl multi handle.
+ *
+ * Instead of running one blocking request per worker thread, the block
+ * requests of a batch are added to a multi handle and driven from the calling
+ * thread. Over HTTP/2 they are multiplexed on a single connection, so many
+ * requests can be in flight even on high latency links. Idle multi handles
+ * stay in the connection pool of the host, so later batches reuse their
+ * connections.
+ */
 
-    if (g_regex_match (priv->locked_error_regex, error_str, 0, &match_info)) {
-        path = g_match_info_fetch (match_info, 1);
-        send_file_sync_error_notification (task->repo_id, task->repo_name, path,
-                                           SYNC_ERROR_ID_FILE_LOCKED);
-        g_free (path);
+/*
+ * Adaptive concurrency.
+ *
+ * The number of block requests in flight for a task is limited by a window
+ * that is adjusted once per epoch, similar to TCP congestion control. An
+ * epoch ends when at least one request finished and RESET_BYTES_INTERVAL_MSEC
+ * has passed, so that the task rate behind http_tx_task_get_rate() covers
+ * a full interval.
+ *
+ * - In slow start the window doubles as long as the rate grows.
+ * - Afterwards the window grows by one request per epoch, unless the
+ *   network looks congested: the rate didn't grow and requests took much
+ *   longer per byte than in the best epoch so far. Then the window shrinks
+ *   by a quarter. More requests would only wait in queues and risk server
+ *   timeouts.
+ * - A failed request halves the window.
+ *
+ * The window is shared by all threads transferring blocks for the task.
+ */
 
-        /* Set more accurate error. */
-        task->error = SYNC_ERROR_ID_FILE_LOCKED;
-    } else if (g_regex_match (priv->folder_perm_error_regex, error_str, 0, &match_info)) {
-        path = g_match_info_fetch (match_info, 1);
-        /* The path returned by server begins with '/'. */
-        send_file_sync_error_notification (task->repo_id, task->repo_name,
-                                           (path[0] == '/') ? (path + 1) : path,
-                                           SYNC_ERROR_ID_FOLDER_PERM_DENIED);
-        g_free (path);
+#define MIN_BLOCKS_IN_FLIGHT 2
+#define INITIAL_BLOCKS_IN_FLIGHT 4
+#define MAX_BLOCKS_IN_FLIGHT 64
+/* Rate growth, in percent, that counts as an improvement. */
+#define RATE_GROWTH_SLOW_START 10
+#define RATE_GROWTH_CONGESTED 5
+/* Latency per byte, relative to the best epoch, that counts as congestion. */
+#define CONGESTED_LATENCY_FACTOR 1.5
 
-        task->error = SYNC_ERROR_ID_FOLDER_PERM_DENIED;
-    } else if (g_regex_match (priv->too_many_files_error_regex, error_str, 0, &match_info)) {
-        task->error = SYNC_ERROR_ID_TOO_MANY_FILES;
-    }
+struct _TxConcurrency {
+    pthread_mutex_t lock;
+    double window;
+    double ssthresh;
+    int in_flight;
+    /* Current epoch. */
+    gint64 epoch_start;
+    int epoch_done;
+    gint64 epoch_bytes;
+    double epoch_time;          /* sum of request durations, in seconds */
+    gboolean epoch_failed;
+    /* Previous epochs. */
+    gint last_rate;
+    double min_latency;         /* seconds per byte, 0 if not known yet */
+};
+typedef struct _TxConcurrency TxConcurrency;
 
-    g_match_info_free (match_info);
+static TxConcurrency *
+tx_concurrency_new ()
+{
+    TxConcurrency *c = g_new0 (TxConcurrency, 1);
+
+    pthread_mutex_init (&c->lock, NULL);
+    c->window = INITIAL_BLOCKS_IN_FLIGHT;
+    c->ssthresh = MAX_BLOCKS_IN_FLIGHT;
+    c->epoch_start = g_get_monotonic_time ();
+
+    return c;
 }
 
-static int
-update_branch (HttpTxTask *task, Connection *conn)
+static void
+tx_concurrency_free (TxConcurrency *c)
 {
-    CURL *curl;
-    char *url;
-    int status;
-    char *rsp_content = NULL;
-    char *rsp_content_str = NULL;
-    gint64 rsp_size;
-    int ret = 0;
+    pthread_mutex_destroy (&c->lock);
+    g_free (c);
+}
 
-    curl = conn->curl;
+/* Must be called with c->lock held. */
+static void
+tx_concurrency_end_epoch (TxConcurrency *c, HttpTxTask *task)
+{
+    gint rate = http_tx_task_get_rate (task);
+    gboolean grew, congested;
+    double latency = 0;
+
+    if (c->epoch_bytes > 0)
+        latency = c->epoch_time / c->epoch_bytes;
+
+    if (c->epoch_failed) {
+        c->window = c->window / 2;
+        c->ssthresh = c->window;
+    } else if (c->window < c->ssthresh) {
+        grew = (gint64)rate * 100 >= (gint64)c->last_rate * (100 + RATE_GROWTH_SLOW_START);
+        if (grew)
+            c->window = c->window * 2;
+        else
+            c->ssthresh = c->window;
+    } else {
+        grew = (gint64)rate * 100 >= (gint64)c->last_rate * (100 + RATE_GROWTH_CONGESTED);
+        congested = !grew && c->min_latency > 0 &&
+            latency > c->min_latency * CONGESTED_LATENCY_FACTOR;
+        if (congested) {
+            c->window = c->window * 3 / 4;
+            c->ssthresh = c->window;
+        } else {
+            c->window += 1;
+        }
+    }
 
-    if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/commit/HEAD/?head=%s",
-                               task->host, task->repo_id, task->head);
-    else
-        url = g_strdup_printf ("%s/repo/%s/commit/HEAD/?head=%s",
-                               task->host, task->repo_id, task->head);
+    c->window = CLAMP (c->window, MIN_BLOCKS_IN_FLIGHT, MAX_BLOCKS_IN_FLIGHT);
 
-    int curl_error;
-    if (http_put (curl, url, task->token,
-                  NULL, 0,
-                  NULL, NULL,
-                  &status, &rsp_content, &rsp_size, TRUE, &curl_error) < 0) {
-        conn->release = TRUE;
-        handle_curl_errors (task, curl_error);
-        ret = -1;
-        goto out;
-    }
+    if (latency > 0 && (c->min_latency == 0 || latency < c->min_latency))
+        c->min_latency = latency;
+    c->last_rate = rate;
 
-    if (status != HTTP_OK) {
-        seaf_warning ("Bad response code for PUT %s: %d.\n", url, status);
-        handle_http_errors (task, status);
+    seaf_debug ("Repo %.8s: %d bytes/s, %.1f us/KB, %d blocks in flight.\n",
+                task->repo_id, rate, latency * 1024 * 1000000, (int)c->window);
 
-        if (status == HTTP_FORBIDDEN || status == HTTP_BLOCK_MISSING) {
-            rsp_content_str = g_new0 (gchar, rsp_size + 1);
-            memcpy (rsp_content_str, rsp_content, rsp_size);
-            if (status == HTTP_FORBIDDEN) {
-                seaf_warning ("%s\n", rsp_content_str);
-                notify_permission_error (task, rsp_content_str);
-            } else if (status == HTTP_BLOCK_MISSING) {
-                seaf_warning ("Failed to upload files: %s\n", rsp_content_str);
-                task->error = SYNC_ERROR_ID_BLOCK_MISSING;
-            }
-            g_free (rsp_content_str);
-        }
+    c->epoch_start = g_get_monotonic_time ();
+    c->epoch_done = 0;
+    c->epoch_bytes = 0;
+    c->epoch_time = 0;
+    c->epoch_failed = FALSE;
+}
 
-        ret = -1;
-    }
+/*
+ * Reserve a slot for a new request. With @force the slot is reserved even
+ * if the window is full, so that every thread can make progress.
+ */
+static gboolean
+tx_concurrency_acquire (HttpTxTask *task, gboolean force)
+{
+    TxConcurrency *c = task->concurrency;
+    gboolean ret = FALSE;
 
-out:
-    g_free (url);
-    g_free (rsp_content);
-    curl_easy_reset (curl);
+    pthread_mutex_lock (&c->lock);
+    if (force || c->in_flight < (int)c->window) {
+        ++c->in_flight;
+        ret = TRUE;
+    }
+    pthread_mutex_unlock (&c->lock);
 
     return ret;
 }
 
+/*
+ * Release the slot of a finished request. @duration and @bytes describe a
+ * successful request, @failed is set for requests that failed on a network
+ * error. Aborted requests pass neither.
+ */
 static void
-update_master_branch (HttpTxTask *task)
+tx_concurrency_release (HttpTxTask *task, double duration, guint32 bytes,
+                        gboolean failed)
 {
-    SeafBranch *branch;
-    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
-                                             task->repo_id,
-                                             "master");
-    if (!branch) {
-        branch = seaf_branch_new ("master", task->repo_id, task->head);
-        seaf_branch_manager_add_branch (seaf->branch_mgr, branch);
-        seaf_branch_unref (branch);
-    } else {
-        seaf_branch_set_commit (branch, task->head);
-        seaf_branch_manager_update_branch (seaf->branch_mgr, branch);
-        seaf_branch_unref (branch);
+    TxConcurrency *c = task->concurrency;
+
+    pthread_mutex_lock (&c->lock);
+
+    --c->in_flight;
+
+    if (failed) {
+        c->epoch_failed = TRUE;
+    } else if (bytes > 0) {
+        ++c->epoch_done;
+        c->epoch_bytes += bytes;
+        c->epoch_time += duration;
     }
+
+    if ((c->epoch_done > 0 || c->epoch_failed) &&
+        g_get_monotonic_time () - c->epoch_start >= RESET_BYTES_INTERVAL_MSEC * 1000)
+        tx_concurrency_end_epoch (c, task);
+
+    pthread_mutex_unlock (&c->lock);
 }
 
-static void
-set_path_status_syncing (gpointer key, gpointer value, gpointer user_data)
-{
-    HttpTxTask *task = user_data;
-    char *path = key;
-    int mode = (int)(long)value;
-    seaf_sync_manager_update_active_path (seaf->sync_mgr,
-                                          task->repo_id,
-                                          path,
-                                          mode,
-                                          SYNC_STATUS_SYNCING,
-                                          TRUE);
-}
+#define MULTI_WAIT_MSEC 1000
+
+static size_t
+get_block_callback (void *ptr, size_t size, size_t nmemb, void *userp);
+
+static int
+commit_downloaded_block (HttpTxTask *task, const char *block_id,
+                         BlockHandle *block, guint32 *psize);
+
+typedef struct BlockTx {
+    HttpTxTask *task;
+    gboolean upload;
+    char block_id[41];
+    char *url;
+    CURL *curl;
+    struct curl_slist *headers;
+    struct curl_slist *connect_to;
+    BlockHandle *block;
+    gboolean block_closed;
+    /* Download into cb_data.buf, bypassing the block store. */
+    gboolean to_memory;
+    guint32 size;
+    /* Content encoding of an uploaded block, NULL if sent as is. */
+    const char *encoding;
+    /* Set if the request may go over HTTP/3. */
+    gboolean http3;
+    /* Passed to send_block_callback() or get_block_callback(). */
+    SendBlockData cb_data;
+    gint64 trace_start;
+} BlockTx;
 
 static void
-set_path_status_synced (gpointer key, gpointer value, gpointer user_data)
+block_tx_free (BlockTx *bt)
 {
-    HttpTxTask *task = user_data;
-    char *path = key;
-    int mode = (int)(long)value;
-    seaf_sync_manager_update_active_path (seaf->sync_mgr,
-                                          task->repo_id,
-                                          path,
-                                          mode,
-                                          SYNC_STATUS_SYNCED,
-                                          TRUE);
+    if (bt->curl)
+        curl_easy_cleanup (bt->curl);
+    curl_slist_free_all (bt->headers);
+    curl_slist_free_all (bt->connect_to);
+    if (bt->block) {
+        if (!bt->block_closed)
+            seaf_block_manager_close_block (seaf->block_mgr, bt->block);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, bt->block);
+    }
+    if (bt->cb_data.buf)
+        g_byte_array_free (bt->cb_data.buf, TRUE);
+    if (bt->cb_data.send_buf)
+        g_byte_array_free (bt->cb_data.send_buf, TRUE);
+    g_free (bt->url);
+    g_free (bt);
 }
 
-static void *
-http_upload_thread (void *vdata)
+static int
+block_tx_open_block (BlockTx *bt)
 {
-    HttpTxTask *task = vdata;
-    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
-    ConnectionPool *pool;
-    Connection *conn = NULL;
-    char *url = NULL;
-    GList *send_fs_list = NULL, *needed_fs_list = NULL;
-    GList *block_list = NULL, *needed_block_list = NULL;
-    GHashTable *active_paths = NULL;
-
-    SeafBranch *local = seaf_branch_manager_get_branch (seaf->branch_mgr,
-                                                        task->repo_id, "local");
-    if (!local) {
-        seaf_warning ("Failed to get branch local of repo %.8s.\n", task->repo_id);
-        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
-        return NULL;
-    }
-    memcpy (task->head, local->commit_id, 40);
-    seaf_branch_unref (local);
+    HttpTxTask *task = bt->task;
+    BlockMetadata *bmd;
 
-    pool = find_connection_pool (priv, task->host);
-    if (!pool) {
-        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
-        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
-        goto out;
+    if (bt->to_memory) {
+        bt->cb_data.buf = g_byte_array_new ();
+        return 0;
     }
 
-    conn = connection_pool_get_connection (pool);
-    if (!conn) {
-        seaf_warning ("Failed to get connection to host %s.\n", task->host);
-        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
-        goto out;
+    if (!bt->upload) {
+        bt->block = seaf_block_manager_open_block (seaf->block_mgr,
+                                                   task->repo_id, task->repo_version,
+                                                   bt->block_id, BLOCK_WRITE);
+        if (!bt->block) {
+            seaf_warning ("Failed to open block %s in repo %.8s.\n",
+                          bt->block_id, task->repo_id);
+            return -1;
+        }
+        return 0;
     }
 
-    /* seaf_message ("Upload with HTTP sync protocol version %d.\n", */
-    /*               task->protocol_version); */
-
-    transition_state (task, task->state, HTTP_TASK_RT_STATE_CHECK);
-
-    gint64 delta = 0;
-    active_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-
-    if (calculate_upload_size_delta_and_active_paths (task, &delta, active_paths) < 0) {
-        seaf_warning ("Failed to calculate upload size delta for repo %s.\n",
-                      task->repo_id);
+    bmd = seaf_block_manager_stat_block (seaf->block_mgr,
+                                         task->repo_id, task->repo_version,
+                                         bt->block_id);
+    if (!bmd) {
+        seaf_warning ("Failed to stat block %s in repo %s.\n",
+                      bt->block_id, task->repo_id);
         task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
-        goto out;
-    }
-
-    g_hash_table_foreach (active_paths, set_path_status_syncing, task);
-
-    if (check_permission (task, conn) < 0) {
-        seaf_warning ("Upload permission denied for repo %.8s on server %s.\n",
-                      task->repo_id, task->host);
-        goto out;
+        return -1;
     }
+    bt->size = bmd->size;
+    g_free (bmd);
 
-    if (check_quota (task, conn, delta) < 0) {
-        seaf_warning ("Not enough quota for repo %.8s on server %s.\n",
-                      task->repo_id, task->host);
-        goto out;
+    bt->block = seaf_block_manager_open_block (seaf->block_mgr,
+                                               task->repo_id, task->repo_version,
+                                               bt->block_id, BLOCK_READ);
+    if (!bt->block) {
+        seaf_warning ("Failed to open block %s in repo %s.\n",
+                      bt->block_id, task->repo_id);
+        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+        return -1;
     }
+    return 0;
+}
 
-    if (task->state == HTTP_TASK_STATE_CANCELED)
-        goto out;
-
-    transition_state (task, task->state, HTTP_TASK_RT_STATE_COMMIT);
+/* Send an uploaded block straight from a mapping of the block, instead of
+ * reading it in pieces. Blocks that can't be mapped are read as before. */
+static void
+block_tx_map_block (BlockTx *bt)
+{
+    const void *map;
+    guint32 len;
 
-    if (send_commit_object (task, conn) < 0) {
-        seaf_warning ("Failed to send head commit for repo %.8s.\n", task->repo_id);
-        goto out;
-    }
+    map = seaf_block_manager_map_block (seaf->block_mgr, bt->block, &len);
+    if (!map || len != bt->size)
+        return;
 
-    if (task->state == HTTP_TASK_STATE_CANCELED)
-        goto out;
+    bt->cb_data.send_data = map;
+    bt->cb_data.send_len = len;
+}
 
-    transition_state (task, task->state, HTTP_TASK_RT_STATE_FS);
+static void
+block_tx_set_send_buf (BlockTx *bt, GByteArray *buf)
+{
+    bt->cb_data.send_buf = buf;
+    bt->cb_data.send_data = buf->data;
+    bt->cb_data.send_len = buf->len;
+}
 
-    send_fs_list = calculate_send_fs_object_list (task);
-    if (!send_fs_list) {
-        seaf_warning ("Failed to calculate fs object list for repo %.8s.\n",
-                      task->repo_id);
-        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
-        goto out;
-    }
+/* Compress an uploaded block with @encoding if that pays off, it's then
+ * sent from memory. A block that isn't mapped is loaded in memory first. */
+static int
+block_tx_encode (BlockTx *bt, const char *encoding)
+{
+    HttpTxTask *task = bt->task;
+    GByteArray *plain;
+    guint8 *out;
+    guint32 out_len, off = 0;
+    int n;
 
-    if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/check-fs/",
-                               task->host, task->repo_id);
-    else
-        url = g_strdup_printf ("%s/repo/%s/check-fs/",
-                               task->host, task->repo_id);
+    if (bt->size < BLOCK_COMPRESS_MIN_SIZE)
+        return 0;
 
-    while (send_fs_list != NULL) {
-        if (upload_check_id_list_segment (task, conn, url,
-                                          &send_fs_list, &needed_fs_list) < 0) {
-            seaf_warning ("Failed to check fs list for repo %.8s.\n", task->repo_id);
-            goto out;
+    if (bt->cb_data.send_data) {
+        if (compress_block (encoding, bt->cb_data.send_data,
+                            bt->cb_data.send_len, &out, &out_len) == 0) {
+            block_tx_set_send_buf (bt, g_byte_array_new_take (out, out_len));
+            bt->encoding = encoding;
         }
-
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto out;
+        return 0;
     }
-    g_free (url);
-    url = NULL;
 
-    while (needed_fs_list != NULL) {
-        if (send_fs_objects (task, conn, &needed_fs_list) < 0) {
-            seaf_warning ("Failed to send fs objects for repo %.8s.\n", task->repo_id);
-            goto out;
+    plain = g_byte_array_sized_new (bt->size);
+    g_byte_array_set_size (plain, bt->size);
+    while (off < bt->size) {
+        n = seaf_block_manager_read_block (seaf->block_mgr, bt->block,
+                                           plain->data + off, bt->size - off);
+        if (n <= 0) {
+            seaf_warning ("Failed to read block %s in repo %.8s.\n",
+                          bt->block_id, task->repo_id);
+            task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+            g_byte_array_free (plain, TRUE);
+            return -1;
         }
+        off += n;
+    }
 
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto out;
+    if (compress_block (encoding, plain->data, plain->len, &out, &out_len) == 0) {
+        g_byte_array_free (plain, TRUE);
+        block_tx_set_send_buf (bt, g_byte_array_new_take (out, out_len));
+        bt->encoding = encoding;
+    } else {
+        block_tx_set_send_buf (bt, plain);
     }
 
-    transition_state (task, task->state, HTTP_TASK_RT_STATE_BLOCK);
+    return 0;
+}
 
-    if (calculate_block_list (task, &block_list) < 0) {
-        seaf_warning ("Failed to calculate block list for repo %.8s.\n",
-                      task->repo_id);
-        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
-        goto out;
-    }
+/*
+ * HTTP/3.
+ *
+ * With "enable_http3", the requests driven by multi handles (block and fs
+ * object transfers) accept the HTTP/3 endpoint a server advertises with
+ * Alt-Svc. The first requests go over TCP, later ones over QUIC once the
+ * Alt-Svc header was seen. QUIC avoids the head-of-line blocking of TCP
+ * on lossy links and survives address changes of mobile clients.
+ *
+ * If a request over HTTP/3 fails at the connection level, it is retried
+ * over TCP and the server is only used over TCP for
+ * HTTP3_RETRY_INTERVAL_SEC, since UDP may be blocked on the network.
+ */
 
-    if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/check-blocks/",
-                               task->host, task->repo_id);
-    else
-        url = g_strdup_printf ("%s/repo/%s/check-blocks/",
-                               task->host, task->repo_id);
+/* Returns TRUE if the request was set up to use HTTP/3. */
+static gboolean
+set_http3_options (CURL *curl, ConnectionPool *pool)
+{
+#ifdef HAVE_CURL_HTTP3
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    gboolean disabled;
 
-    while (block_list != NULL) {
-        if (upload_check_id_list_segment (task, conn, url,
-                                          &block_list, &needed_block_list) < 0) {
-            seaf_warning ("Failed to check block list for repo %.8s.\n",
-                          task->repo_id);
-            goto out;
-        }
+    if (!seaf->enable_http3 || !priv->altsvc_path || !pool)
+        return FALSE;
 
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto out;
-    }
-    g_free (url);
-    url = NULL;
+    pthread_mutex_lock (&pool->lock);
+    disabled = (pool->http3_disabled_until > (gint64)time(NULL));
+    pthread_mutex_unlock (&pool->lock);
+    if (disabled)
+        return FALSE;
 
-    task->n_blocks = g_list_length (needed_block_list);
+    curl_easy_setopt (curl, CURLOPT_ALTSVC_CTRL,
+                      (long)(CURLALTSVC_H1 | CURLALTSVC_H2 | CURLALTSVC_H3));
+    curl_easy_setopt (curl, CURLOPT_ALTSVC, priv->altsvc_path);
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
 
-    seaf_debug ("%d blocks to send for %s:%s.\n",
-                task->n_blocks, task->host, task->repo_id);
+/*
+ * Called when a request set up by set_http3_options() is finished.
+ * Returns TRUE if it failed over HTTP/3 and should be retried over TCP.
+ */
+static gboolean
+http3_request_done (ConnectionPool *pool, CURL *curl, CURLcode result)
+{
+#ifdef HAVE_CURL_HTTP3
+    long version = 0;
+    gboolean fallback = FALSE;
 
-    if (multi_threaded_send_blocks(task, needed_block_list) < 0 ||
-        task->state == HTTP_TASK_STATE_CANCELED)
-        goto out;
+    curl_easy_getinfo (curl, CURLINFO_HTTP_VERSION, &version);
 
-    transition_state (task, task->state, HTTP_TASK_RT_STATE_UPDATE_BRANCH);
+    pthread_mutex_lock (&pool->lock);
 
-    if (update_branch (task, conn) < 0) {
-        seaf_warning ("Failed to update branch of repo %.8s.\n", task->repo_id);
+    if (result == CURLE_OK) {
+        if (version == CURL_HTTP_VERSION_3 && !pool->http3_used) {
+            pool->http3_used = TRUE;
+            seaf_message ("Using HTTP/3 with %s.\n", pool->host);
+        }
         goto out;
     }
 
-    /* After successful upload, the cached 'master' branch should be updated to
-     * the head commit of 'local' branch.
-     */
-    update_master_branch (task);
+    switch (result) {
+    case CURLE_HTTP3:
+#if LIBCURL_VERSION_NUM >= 0x074500
+    case CURLE_QUIC_CONNECT_ERROR:
+#endif
+        fallback = TRUE;
+        break;
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+        /* The Alt-Svc endpoint is only tried once it was seen. */
+        fallback = (version == CURL_HTTP_VERSION_3 || pool->http3_used);
+        break;
+    default:
+        break;
+    }
 
-    if (active_paths != NULL)
-        g_hash_table_foreach (active_paths, set_path_status_synced, task);
+    if (fallback) {
+        seaf_warning ("HTTP/3 with %s failed: %s. Using TCP for %d minutes.\n",
+                      pool->host, curl_easy_strerror (result),
+                      HTTP3_RETRY_INTERVAL_SEC / 60);
+        pool->http3_used = FALSE;
+        pool->http3_disabled_until = (gint64)time(NULL) + HTTP3_RETRY_INTERVAL_SEC;
+    }
 
 out:
-    string_list_free (send_fs_list);
-    string_list_free (needed_fs_list);
-    string_list_free (block_list);
-    string_list_free (needed_block_list);
-
-    if (active_paths)
-        g_hash_table_destroy (active_paths);
-
-    g_free (url);
-
-    connection_pool_return_connection (pool, conn);
-
-    return vdata;
+    pthread_mutex_unlock (&pool->lock);
+    return fallback;
+#else
+    return FALSE;
+#endif
 }
 
-static void
-http_upload_done (void *vdata)
+/* Set the options shared by all requests driven by a multi handle. @url
+ * must stay valid until the request is finished. */
+static CURLcode
+set_multi_request_options (CURL *curl, const char *url,
+                           struct curl_slist **pconnect_to)
 {
-    HttpTxTask *task = vdata;
-
-    if (task->error != SYNC_ERROR_ID_NO_ERROR)
-        transition_state (task, HTTP_TASK_STATE_ERROR, HTTP_TASK_RT_STATE_FINISHED);
-    else if (task->state == HTTP_TASK_STATE_CANCELED)
-        transition_state (task, task->state, HTTP_TASK_RT_STATE_FINISHED);
-    else
-        transition_state (task, HTTP_TASK_STATE_FINISHED, HTTP_TASK_RT_STATE_FINISHED);
-}
+    if (seafile_debug_flag_is_set (SEAFILE_DEBUG_CURL)) {
+        curl_easy_setopt (curl, CURLOPT_VERBOSE, 1);
+        curl_easy_setopt (curl, CURLOPT_STDERR, seafile_get_log_fp());
+    }
 
-/* Download */
+    curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
 
-static void *http_download_thread (void *vdata);
-static void http_download_done (void *vdata);
+    /* Set low speed limit to 1 bytes. This effectively means no data. */
+    curl_easy_setopt (curl, CURLOPT_LOW_SPEED_LIMIT, 1);
+    curl_easy_setopt (curl, CURLOPT_LOW_SPEED_TIME, HTTP_TIMEOUT_SEC);
 
-int
-http_tx_manager_add_download (HttpTxManager *manager,
-                              const char *repo_id,
-                              int repo_version,
-                              const char *host,
-                              const char *token,
-                              const char *server_head_id,
-                              gboolean is_clone,
-                              const char *passwd,
-                              const char *worktree,
-                              int protocol_version,
-                              const char *email,
-                              gboolean use_fileserver_port,
-                              const char *repo_name,
-                              GError **error)
-{
-    HttpTxTask *task;
-    SeafRepo *repo;
-
-    if (!repo_id) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(repo_id)");
-        return -1;
-    }
-
-    if (!token) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(token)");
-        return -1;
+    if (seaf->disable_verify_certificate) {
+        curl_easy_setopt (curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt (curl, CURLOPT_SSL_VERIFYHOST, 0L);
     }
 
-    if (!host) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(host)");
-        return -1;
-    }
+    gboolean is_https = (strncasecmp(url, "https", strlen("https")) == 0);
+    set_proxy (curl, is_https);
 
-    if (!server_head_id) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(server_head_id)");
-        return -1;
-    }
+    curl_easy_setopt (curl, CURLOPT_FOLLOWLOCATION, 1L);
 
-    if (!email) {
-        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(email)");
-        return -1;
-    }
+#ifndef USE_GPL_CRYPTO
+#if defined WIN32 || defined __APPLE__
+    load_ca_bundle (curl);
+#endif
+#endif
 
-    if (!is_clone) {
-        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-        if (!repo) {
-            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Repo not found");
-            return -1;
-        }
+#ifndef USE_GPL_CRYPTO
+    if (!seaf->disable_verify_certificate) {
+        curl_easy_setopt (curl, CURLOPT_SSL_CTX_FUNCTION, ssl_callback);
+        curl_easy_setopt (curl, CURLOPT_SSL_CTX_DATA, url);
     }
+#endif
 
-    clean_tasks_for_repo (manager, repo_id);
-
-    task = http_tx_task_new (manager, repo_id, repo_version,
-                             HTTP_TASK_TYPE_DOWNLOAD, is_clone,
-                             host, token, passwd, worktree);
-
-    memcpy (task->head, server_head_id, 40);
-    task->protocol_version = protocol_version;
-    task->email = g_strdup(email);
+#ifdef WIN32
+    curl_easy_setopt (curl, CURLOPT_SOCKOPTFUNCTION, sockopt_callback);
+#endif
 
-    task->state = HTTP_TASK_STATE_NORMAL;
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    curl_easy_setopt (curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    /* Wait for an existing connection to be multiplexable rather than
+     * opening a new one for every request. */
+    curl_easy_setopt (curl, CURLOPT_PIPEWAIT, 1L);
+#endif
 
-    task->use_fileserver_port = use_fileserver_port;
+    set_curl_share (curl);
 
-    task->blk_ref_cnts = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                g_free, g_free);
-    pthread_mutex_init (&task->ref_cnt_lock, NULL);
+    return set_request_url (curl, url, pconnect_to);
+}
 
-    g_hash_table_insert (manager->priv->download_tasks,
-                         g_strdup(repo_id),
-                         task);
+/* Prepare the PUT or GET request of a block. The options are the same as
+ * set by http_put() and http_get() for a single block. */
+static BlockTx *
+block_tx_new (HttpTxTask *task, ConnectionPool *pool,
+              const char *block_id, gboolean upload, gboolean to_memory)
+{
+    BlockTx *bt = g_new0 (BlockTx, 1);
+    CURL *curl;
+    char *token_header;
+    char *encoding_header;
 
-    task->repo_name = g_strdup(repo_name);
+    bt->task = task;
+    bt->upload = upload;
+    bt->to_memory = to_memory;
+    memcpy (bt->block_id, block_id, 40);
 
-    if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                       http_download_thread,
-                                       http_download_done,
-                                       task) < 0) {
-        g_hash_table_remove (manager->priv->download_tasks, repo_id);
-        return -1;
-    }
+    if (block_tx_open_block (bt) < 0)
+        goto error;
 
-    return 0;
-}
+    memcpy (bt->cb_data.block_id, block_id, 40);
+    bt->cb_data.block = bt->block;
+    bt->cb_data.task = task;
+    bt->cb_data.pool = pool;
 
-static int
-get_commit_object (HttpTxTask *task, Connection *conn)
-{
-    CURL *curl;
-    char *url;
-    int status;
-    char *rsp_content = NULL;
-    gint64 rsp_size;
-    int ret = 0;
+    if (upload && !to_memory)
+        block_tx_map_block (bt);
 
-    curl = conn->curl;
+    if (upload && pool->block_encoding &&
+        block_tx_encode (bt, pool->block_encoding) < 0)
+        goto error;
 
     if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/commit/%s",
-                               task->host, task->repo_id, task->head);
+        bt->url = g_strdup_printf ("%s/seafhttp/repo/%s/block/%s",
+                                   task->host, task->repo_id, block_id);
     else
-        url = g_strdup_printf ("%s/repo/%s/commit/%s",
-                               task->host, task->repo_id, task->head);
+        bt->url = g_strdup_printf ("%s/repo/%s/block/%s",
+                                   task->host, task->repo_id, block_id);
 
-    int curl_error;
-    if (http_get (curl, url, task->token, &status,
-                  &rsp_content, &rsp_size,
-                  NULL, NULL, TRUE, &curl_error) < 0) {
-        conn->release = TRUE;
-        handle_curl_errors (task, curl_error);
-        ret = -1;
-        goto out;
+    curl = bt->curl = curl_easy_init ();
+    if (!curl) {
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        goto error;
     }
 
-    if (status != HTTP_OK) {
-        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
-        handle_http_errors (task, status);
-        ret = -1;
-        goto out;
+    bt->headers = curl_slist_append (bt->headers, "User-Agent: Seafile/"SEAFILE_CLIENT_VERSION" ("USER_AGENT_OS")");
+    if (upload)
+        /* Disable the default "Expect: 100-continue" header */
+        bt->headers = curl_slist_append (bt->headers, "Expect:");
+    if (bt->encoding) {
+        encoding_header = g_strdup_printf ("Content-Encoding: %s", bt->encoding);
+        bt->headers = curl_slist_append (bt->headers, encoding_header);
+        g_free (encoding_header);
+    }
+    token_header = g_strdup_printf ("Seafile-Repo-Token: %s", task->token);
+    bt->headers = curl_slist_append (bt->headers, token_header);
+    g_free (token_header);
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, bt->headers);
+
+    if (upload) {
+        curl_easy_setopt (curl, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt (curl, CURLOPT_READFUNCTION, send_block_callback);
+        curl_easy_setopt (curl, CURLOPT_READDATA, &bt->cb_data);
+        curl_easy_setopt (curl, CURLOPT_INFILESIZE_LARGE,
+                          (curl_off_t)(bt->cb_data.send_data ?
+                                       bt->cb_data.send_len : bt->size));
+    } else {
+        curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, get_block_callback);
+        curl_easy_setopt (curl, CURLOPT_WRITEDATA, &bt->cb_data);
+#if LIBCURL_VERSION_NUM >= 0x071506
+        /* An empty string accepts all the encodings libcurl can decode. */
+        if (pool->block_encoding)
+            curl_easy_setopt (curl, CURLOPT_ACCEPT_ENCODING, "");
+#endif
     }
 
-    int rc = seaf_obj_store_write_obj (seaf->commit_mgr->obj_store,
-                                       task->repo_id, task->repo_version,
-                                       task->head,
-                                       rsp_content,
-                                       rsp_size,
-                                       FALSE);
-    if (rc < 0) {
-        seaf_warning ("Failed to save commit %s in repo %.8s.\n",
-                      task->head, task->repo_id);
-        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
-        ret = -1;
+    curl_easy_setopt (curl, CURLOPT_PRIVATE, bt);
+
+    if (set_multi_request_options (curl, bt->url, &bt->connect_to) != CURLE_OK) {
+        seaf_warning ("Failed to set url %s.\n", bt->url);
+        goto error;
     }
+    bt->http3 = set_http3_options (curl, pool);
 
-out:
-    g_free (url);
-    g_free (rsp_content);
-    curl_easy_reset (curl);
+    bt->trace_start = seaf_trace_begin ();
 
-    return ret;
+    return bt;
+
+error:
+    block_tx_free (bt);
+    return NULL;
 }
 
+/* Check the result of a finished request. @release is set when the
+ * connections of the multi handle should not be reused. Returns 1 if the
+ * request should be sent again over TCP. */
 static int
-get_needed_fs_id_list (HttpTxTask *task, Connection *conn, GList **fs_id_list)
+block_tx_finish (BlockTx *bt, CURLcode result, gboolean *release)
 {
-    SeafBranch *master;
-    CURL *curl;
-    char *url = NULL;
-    int status;
-    char *rsp_content = NULL;
-    gint64 rsp_size;
-    int ret = 0;
-    json_t *array;
-    json_error_t jerror;
-    const char *obj_id;
-
-    const char *url_prefix = (task->use_fileserver_port) ? "" : "seafhttp/";
+    HttpTxTask *task = bt->task;
+    long status;
 
-    if (!task->is_clone) {
-        master = seaf_branch_manager_get_branch (seaf->branch_mgr,
-                                                 task->repo_id,
-                                                 "master");
-        if (!master) {
-            seaf_warning ("Failed to get branch master for repo %.8s.\n",
-                          task->repo_id);
-            return -1;
-        }
+    if (bt->http3 &&
+        http3_request_done (bt->cb_data.pool, bt->curl, result) &&
+        task->state != HTTP_TASK_STATE_CANCELED) {
+        *release = TRUE;
+        return 1;
+    }
 
-        url = g_strdup_printf ("%s/%srepo/%s/fs-id-list/"
-                               "?server-head=%s&client-head=%s",
-                               task->host, url_prefix, task->repo_id,
-                               task->head, master->commit_id);
+    if (result != CURLE_OK) {
+        if (task->state == HTTP_TASK_STATE_CANCELED)
+            return 0;
 
-        seaf_branch_unref (master);
-    } else {
-        url = g_strdup_printf ("%s/%srepo/%s/fs-id-list/?server-head=%s",
-                               task->host, url_prefix, task->repo_id, task->head);
+        seaf_warning ("libcurl failed to %s %s: %s.\n",
+                      bt->upload ? "PUT" : "GET",
+                      bt->url, curl_easy_strerror(result));
+        if (task->error == SYNC_ERROR_ID_NO_ERROR) {
+            /* Only release connections when it's a network error. */
+            *release = TRUE;
+            handle_curl_errors (task, result);
+        }
+        return -1;
     }
 
-    curl = conn->curl;
-
-    int curl_error;
-    if (http_get (curl, url, task->token, &status,
-                  &rsp_content, &rsp_size,
-                  NULL, NULL, (!task->is_clone), &curl_error) < 0) {
-        conn->release = TRUE;
-        handle_curl_errors (task, curl_error);
-        ret = -1;
-        goto out;
+    if (curl_easy_getinfo (bt->curl, CURLINFO_RESPONSE_CODE, &status) != CURLE_OK) {
+        seaf_warning ("Failed to get status code for %s %s.\n",
+                      bt->upload ? "PUT" : "GET", bt->url);
+        return -1;
     }
 
     if (status != HTTP_OK) {
-        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
+        seaf_warning ("Bad response code for %s %s: %ld.\n",
+                      bt->upload ? "PUT" : "GET", bt->url, status);
+        if (status == HTTP_UNSUPPORTED_MEDIA_TYPE && bt->encoding) {
+            seaf_message ("Server %s doesn't accept %s encoded blocks.\n",
+                          task->host, bt->encoding);
+            bt->cb_data.pool->block_encoding = NULL;
+        }
         handle_http_errors (task, status);
-        ret = -1;
-        goto out;
-    }
-
-    array = json_loadb (rsp_content, rsp_size, 0, &jerror);
-    if (!array) {
-        seaf_warning ("Invalid JSON response from the server: %s.\n", jerror.text);
-        task->error = SYNC_ERROR_ID_SERVER;
-        ret = -1;
-        goto out;
+        return -1;
     }
 
-    int i;
-    size_t n = json_array_size (array);
-    json_t *str;
-
-    seaf_debug ("Received fs object list size %lu from %s:%s.\n",
-                n, task->host, task->repo_id);
-
-    task->n_fs_objs = (int)n;
+    if (bt->upload)
+        return 0;
 
-    GHashTable *checked_objs = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                      g_free, NULL);
+    if (bt->to_memory) {
+        bt->size = bt->cb_data.buf->len;
+        pthread_mutex_lock (&task->ref_cnt_lock);
+        task->done_download += bt->size;
+        pthread_mutex_unlock (&task->ref_cnt_lock);
+        return 0;
+    }
 
-    for (i = 0; i < n; ++i) {
-        str = json_array_get (array, i);
-        if (!str) {
-            seaf_warning ("Invalid JSON response from the server.\n");
-            json_decref (array);
-            string_list_free (*fs_id_list);
-            ret = -1;
-            goto out;
-        }
+    bt->block_closed = TRUE;
+    return commit_downloaded_block (task, bt->block_id, bt->block, &bt->size);
+}
 
-        obj_id = json_string_value(str);
+typedef void (*BlockTxDoneFunc) (HttpTxTask *task, BlockTx *bt, void *user_data);
 
-        if (g_hash_table_lookup (checked_objs, obj_id)) {
-            ++(task->done_fs_objs);
+/* Resume the requests paused by rate limiting whose delay is over. Returns
+ * the milliseconds until the next paused request is due, at most
+ * MULTI_WAIT_MSEC. */
+static long
+resume_paused_requests (GList *active)
+{
+    GList *ptr;
+    BlockTx *bt;
+    gint64 now = g_get_monotonic_time ();
+    gint64 next = 0;
+    long timeout;
+
+    for (ptr = active; ptr; ptr = ptr->next) {
+        bt = ptr->data;
+        if (bt->cb_data.paused_until == 0)
             continue;
-        }
-        char *key = g_strdup(obj_id);
-        g_hash_table_replace (checked_objs, key, key);
 
-        if (!seaf_obj_store_obj_exists (seaf->fs_mgr->obj_store,
-                                        task->repo_id, task->repo_version,
-                                        obj_id)) {
-            *fs_id_list = g_list_prepend (*fs_id_list, g_strdup(obj_id));
-        } else if (task->is_clone) {
-            gboolean io_error = FALSE;
-            gboolean sound;
-            sound = seaf_fs_manager_verify_object (seaf->fs_mgr,
-                                                   task->repo_id, task->repo_version,
-                                                   obj_id, FALSE, &io_error);
-            if (!sound && !io_error) {
-                *fs_id_list = g_list_prepend (*fs_id_list, g_strdup(obj_id));
-            } else {
-                ++(task->done_fs_objs);
-            }
-        } else {
-            ++(task->done_fs_objs);
+        if (bt->cb_data.paused_until <= now) {
+            bt->cb_data.paused_until = 0;
+            /* The callbacks may be called, and pause the request again,
+             * from here. */
+            curl_easy_pause (bt->curl, CURLPAUSE_CONT);
         }
-    }
 
-    json_decref (array);
-    g_hash_table_destroy (checked_objs);
+        if (bt->cb_data.paused_until > 0 &&
+            (next == 0 || bt->cb_data.paused_until < next))
+            next = bt->cb_data.paused_until;
+    }
 
-out:
-    g_free (url);
-    g_free (rsp_content);
-    curl_easy_reset (curl);
+    if (next == 0)
+        return MULTI_WAIT_MSEC;
 
-    return ret;
+    timeout = (long)((next - now + 999) / 1000);
+    return CLAMP (timeout, 1, MULTI_WAIT_MSEC);
 }
 
-#define GET_FS_OBJECT_N 100
-
+/*
+ * Upload or download the blocks in @block_ids, keeping as many requests
+ * running at once as the concurrency window of the task allows. @done is
+ * called for every block that was transferred. Stops at the first error or
+ * when the task is canceled. If @to_memory is set, downloaded blocks are
+ * not written to the block store, @done has to take them from the buffer.
+ */
 static int
-get_fs_objects (HttpTxTask *task, Connection *conn, GList **fs_list)
+transfer_blocks (HttpTxTask *task, GList *block_ids, gboolean upload,
+                 gboolean to_memory, BlockTxDoneFunc done, void *user_data)
 {
-    json_t *array;
-    char *obj_id;
-    int n_sent = 0;
-    char *data = NULL;
-    int len;
-    CURL *curl;
-    char *url = NULL;
-    int status;
-    char *rsp_content = NULL;
-    gint64 rsp_size;
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *pool;
+    CURLM *multi;
+    GList *next = block_ids;
+    /* Blocks to send again over TCP after HTTP/3 failed. */
+    GList *retry = NULL;
+    char *retry_id;
+    GList *active = NULL, *ptr;
+    int n_active = 0;
+    BlockTx *bt;
+    CURLMsg *msg;
+    CURL *easy;
+    CURLcode result;
+    int running, n_msgs;
+    gboolean release = FALSE;
+    gboolean stop = FALSE;
+    gboolean failed;
+    int rc;
+    double duration;
+    long timeout;
     int ret = 0;
-    GHashTable *requested;
 
-    /* Convert object id list to JSON format. */
+    if (!block_ids)
+        return 0;
 
-    requested = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    pool = find_connection_pool (priv, task->host);
+    if (!pool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        return -1;
+    }
 
-    array = json_array ();
+    multi = connection_pool_get_multi (pool);
+    if (!multi) {
+        seaf_warning ("Failed to get connection to host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        return -1;
+    }
 
-    while (*fs_list != NULL) {
-        obj_id = (*fs_list)->data;
-        json_array_append_new (array, json_string(obj_id));
+    tx_share_enter (task, upload);
 
-        *fs_list = g_list_delete_link (*fs_list, *fs_list);
+    while (!stop) {
+        /* Bulk tasks yield at block boundaries, keeping only one block in
+         * flight while interactive tasks transfer. */
+        while ((retry || next) &&
+               (n_active == 0 || !tx_should_yield (task, upload)) &&
+               tx_concurrency_acquire (task, n_active == 0)) {
+            if (retry) {
+                retry_id = retry->data;
+                retry = g_list_delete_link (retry, retry);
+                bt = block_tx_new (task, pool, retry_id, upload, to_memory);
+                g_free (retry_id);
+            } else {
+                bt = block_tx_new (task, pool, next->data, upload, to_memory);
+                next = next->next;
+            }
+            if (!bt) {
+                tx_concurrency_release (task, 0, 0, FALSE);
+                ret = -1;
+                stop = TRUE;
+                break;
+            }
+            curl_multi_add_handle (multi, bt->curl);
+            active = g_list_prepend (active, bt);
+            ++n_active;
+        }
+        if (stop || n_active == 0)
+            break;
 
-        g_hash_table_replace (requested, obj_id, obj_id);
+        curl_multi_perform (multi, &running);
 
-        if (++n_sent >= GET_FS_OBJECT_N)
-            break;
+        while ((msg = curl_multi_info_read (multi, &n_msgs)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            /* msg is invalid once the handle is removed. */
+            easy = msg->easy_handle;
+            result = msg->data.result;
+            curl_easy_getinfo (easy, CURLINFO_PRIVATE, (char **)&bt);
+            curl_multi_remove_handle (multi, easy);
+            active = g_list_remove (active, bt);
+            --n_active;
+
+            /* Requests of the multi handle overlap, they can't be nested
+             * spans of this thread. */
+            seaf_trace_end_async ("http", bt->upload ? "put_block" : "get_block",
+                                  bt->trace_start, bt->block_id);
+
+            failed = FALSE;
+            rc = block_tx_finish (bt, result, &release);
+            if (rc > 0) {
+                retry = g_list_prepend (retry, g_strdup (bt->block_id));
+                failed = TRUE;
+            } else if (rc < 0) {
+                failed = (result != CURLE_OK);
+                ret = -1;
+                stop = TRUE;
+            } else if (done && task->state != HTTP_TASK_STATE_CANCELED) {
+                done (task, bt, user_data);
+            }
+
+            duration = 0;
+            if (result == CURLE_OK)
+                curl_easy_getinfo (easy, CURLINFO_TOTAL_TIME, &duration);
+            tx_concurrency_release (task, duration,
+                                    result == CURLE_OK ? bt->size : 0, failed);
+
+            block_tx_free (bt);
+        }
+
+        if (task->state == HTTP_TASK_STATE_CANCELED || task->all_stop)
+            stop = TRUE;
+
+        if (!stop && n_active > 0) {
+            timeout = resume_paused_requests (active);
+            curl_multi_wait (multi, NULL, 0, timeout, NULL);
+        }
     }
 
-    seaf_debug ("Requesting %d fs objects from %s:%s.\n",
-                n_sent, task->host, task->repo_id);
+    /* Abort the requests still running after an error or cancel. */
+    for (ptr = active; ptr; ptr = ptr->next) {
+        bt = ptr->data;
+        curl_multi_remove_handle (multi, bt->curl);
+        block_tx_free (bt);
+        tx_concurrency_release (task, 0, 0, FALSE);
+    }
+    g_list_free (active);
+    g_list_free_full (retry, g_free);
 
-    data = json_dumps (array, 0);
-    len = strlen(data);
-    json_decref (array);
+    tx_share_leave (task, upload);
 
-    /* Send fs object id list. */
+    connection_pool_return_multi (pool, multi, release);
 
-    curl = conn->curl;
+    return ret;
+}
+
+/*
+ * Pre-warming of block transfer connections.
+ *
+ * Before a task starts, a cheap request is sent through an idle multi
+ * handle of the server, so that the connection (and TLS session) used by
+ * the first block transfers is already set up when they start.
+ */
+
+typedef struct {
+    char *host;
+    char *url;
+} PrewarmData;
+
+static void *
+prewarm_thread (void *vdata)
+{
+    PrewarmData *data = vdata;
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *pool;
+    gboolean warm;
+    CURLM *multi;
+    CURL *curl;
+    struct curl_slist *headers = NULL, *connect_to = NULL;
+    CURLMsg *msg;
+    int running, n_msgs;
+    gboolean release = FALSE;
+
+    pool = find_connection_pool (priv, data->host);
+
+    pthread_mutex_lock (&pool->lock);
+    warm = !g_queue_is_empty (pool->multi_queue);
+    pthread_mutex_unlock (&pool->lock);
+    if (warm)
+        return vdata;
+
+    multi = connection_pool_get_multi (pool);
+    if (!multi)
+        return vdata;
+
+    curl = curl_easy_init ();
+    if (!curl)
+        goto out;
+
+    headers = curl_slist_append (headers, "User-Agent: Seafile/"SEAFILE_CLIENT_VERSION" ("USER_AGENT_OS")");
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt (curl, CURLOPT_TIMEOUT, (long)HTTP_TIMEOUT_SEC);
+
+    if (set_multi_request_options (curl, data->url, &connect_to) != CURLE_OK)
+        goto out;
+    /* Also picks up the Alt-Svc header of the server early. */
+    set_http3_options (curl, pool);
+
+    curl_multi_add_handle (multi, curl);
+    do {
+        curl_multi_perform (multi, &running);
+        if (running)
+            curl_multi_wait (multi, NULL, 0, MULTI_WAIT_MSEC, NULL);
+    } while (running);
+
+    msg = curl_multi_info_read (multi, &n_msgs);
+    if (msg && msg->msg == CURLMSG_DONE && msg->data.result != CURLE_OK) {
+        seaf_debug ("Failed to pre-warm connection to %s: %s.\n",
+                    data->host, curl_easy_strerror (msg->data.result));
+        release = TRUE;
+    }
+    curl_multi_remove_handle (multi, curl);
+
+out:
+    if (curl)
+        curl_easy_cleanup (curl);
+    curl_slist_free_all (headers);
+    curl_slist_free_all (connect_to);
+    connection_pool_return_multi (pool, multi, release);
+    return vdata;
+}
+
+static void
+prewarm_done (void *vdata)
+{
+    PrewarmData *data = vdata;
+
+    g_free (data->host);
+    g_free (data->url);
+    g_free (data);
+}
+
+static void
+prewarm_block_connections (HttpTxTask *task)
+{
+    PrewarmData *data = g_new0 (PrewarmData, 1);
+
+    data->host = g_strdup (task->host);
+    if (!task->use_fileserver_port)
+        data->url = g_strdup_printf ("%s/seafhttp/protocol-version", task->host);
+    else
+        data->url = g_strdup_printf ("%s/protocol-version", task->host);
+
+    if (seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                     JOB_PRIORITY_BULK,
+                                                     prewarm_thread,
+                                                     prewarm_done,
+                                                     data) < 0)
+        prewarm_done (data);
+}
+
+/* Sent blocks are marked as done in the checkpoint in batches, so that an
+ * interrupted upload doesn't send them again. */
+#define CHECKPOINT_BLOCKS_BATCH 256
+
+static void
+flush_sent_blocks (HttpTxTask *task)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+
+    tx_checkpoint_mark_ids_done (priv->checkpoints, task->repo_id,
+                                 task->type, task->sent_blocks);
+    string_list_free (task->sent_blocks);
+    task->sent_blocks = NULL;
+    task->n_sent_blocks = 0;
+}
+
+static void
+checkpoint_block_sent (HttpTxTask *task, const char *block_id)
+{
+    task->sent_blocks = g_list_prepend (task->sent_blocks, g_strdup(block_id));
+    if (++task->n_sent_blocks >= CHECKPOINT_BLOCKS_BATCH)
+        flush_sent_blocks (task);
+}
+
+static void
+block_sent (HttpTxTask *http_task, BlockTx *bt, void *user_data)
+{
+    SyncInfo *info = user_data;
+
+    ++(http_task->done_blocks);
+    checkpoint_block_sent (http_task, bt->block_id);
+
+    if (info && info->multipart_upload) {
+        info->uploaded_bytes += (gint64)bt->size;
+    }
+}
+
+/*
+ * Small blocks are packed into one POST to recv-blocks, if the server
+ * supports it, in the same format as fs objects are sent to recv-fs. This
+ * saves the per-request overhead of libraries full of tiny files.
+ */
+
+#define MAX_PACKED_BLOCK_SIZE (64 << 10) /* 64KB */
+#define MAX_BLOCK_PACK_SIZE MAX_OBJECT_PACK_SIZE
+
+static int
+read_whole_block (HttpTxTask *task, const char *block_id, guint32 size,
+                  struct evbuffer *buf)
+{
+    BlockHandle *handle;
+    char *data;
+    guint32 done = 0;
+    int n, ret = 0;
+
+    handle = seaf_block_manager_open_block (seaf->block_mgr,
+                                            task->repo_id, task->repo_version,
+                                            block_id, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("Failed to open block %s in repo %s.\n",
+                      block_id, task->repo_id);
+        return -1;
+    }
+
+    data = g_malloc (size);
+    while (done < size) {
+        n = seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                           data + done, size - done);
+        if (n <= 0) {
+            seaf_warning ("Failed to read block %s in repo %s.\n",
+                          block_id, task->repo_id);
+            ret = -1;
+            goto out;
+        }
+        done += n;
+    }
+
+    evbuffer_add (buf, data, size);
+
+out:
+    g_free (data);
+    seaf_block_manager_close_block (seaf->block_mgr, handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return ret;
+}
+
+/* Send the blocks in @pack, a list of block ids, in one request. Returns 1
+ * if the server doesn't support block packs after all. */
+static int
+send_block_pack (HttpTxTask *task, Connection *conn, ConnectionPool *pool,
+                 GList *pack, GHashTable *sizes, SyncInfo *info)
+{
+    struct evbuffer *buf;
+    ObjectHeader hdr;
+    GList *ptr;
+    const char *block_id;
+    guint32 size;
+    SendBlockData throttle;
+    gint64 delay;
+    char *url = NULL;
+    int status;
+    int n_blocks = 0;
+    gint64 reserved = 0;
+    int ret = 0;
+
+    buf = evbuffer_new ();
+
+    for (ptr = pack; ptr; ptr = ptr->next) {
+        block_id = ptr->data;
+        size = GPOINTER_TO_UINT (g_hash_table_lookup (sizes, block_id));
+
+        memcpy (hdr.obj_id, block_id, 40);
+        hdr.obj_size = htonl (size);
+        evbuffer_add (buf, &hdr, sizeof(hdr));
+
+        if (read_whole_block (task, block_id, size, buf) < 0) {
+            task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+            ret = -1;
+            goto out;
+        }
+        ++n_blocks;
+    }
+
+    reserved = evbuffer_get_length (buf);
+    mem_budget_reserve (reserved);
+
+    /* The request isn't driven by the multi loop, so wait here for the
+     * rate limits, before sending the next pack. */
+    memset (&throttle, 0, sizeof(throttle));
+    throttle.task = task;
+    throttle.pool = pool;
+    delay = block_tx_throttle_delay (&throttle, TRUE);
+    if (delay > 0)
+        g_usleep (delay);
+
+    seaf_debug ("Sending %d packed blocks for %s:%s.\n",
+                n_blocks, task->host, task->repo_id);
 
     if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/pack-fs/", task->host, task->repo_id);
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/recv-blocks/",
+                               task->host, task->repo_id);
     else
-        url = g_strdup_printf ("%s/repo/%s/pack-fs/", task->host, task->repo_id);
+        url = g_strdup_printf ("%s/repo/%s/recv-blocks/",
+                               task->host, task->repo_id);
 
     int curl_error;
-    if (http_post (curl, url, task->token,
-                   data, len,
-                   &status, &rsp_content, &rsp_size, TRUE, &curl_error) < 0) {
+    gint64 start = seaf_trace_begin ();
+    int rc = http_post (conn->curl, url, task->token,
+                        (char *)evbuffer_pullup (buf, -1), evbuffer_get_length(buf),
+                        &status, NULL, NULL, TRUE, &curl_error);
+    seaf_trace_end ("http", "send_block_pack", start, NULL);
+    if (rc < 0) {
         conn->release = TRUE;
         handle_curl_errors (task, curl_error);
         ret = -1;
         goto out;
     }
 
+    if (status == HTTP_NOT_FOUND) {
+        seaf_message ("Server %s doesn't support block packs, "
+                      "sending blocks one by one.\n", task->host);
+        pool->block_pack_supported = FALSE;
+        ret = 1;
+        goto out;
+    }
+
     if (status != HTTP_OK) {
         seaf_warning ("Bad response code for POST %s: %d.\n", url, status);
         handle_http_errors (task, status);
@@ -4519,308 +5977,2262 @@ get_fs_objects (HttpTxTask *task, Connection *conn, GList **fs_list)
         goto out;
     }
 
-    /* Save received fs objects. */
+    size = evbuffer_get_length (buf);
+    g_atomic_int_add (&(seaf->sync_mgr->sent_bytes), size);
+    g_atomic_int_add (&task->tx_bytes, size);
+    block_tx_throttle_consume (&throttle, TRUE, size);
+
+    task->done_blocks += n_blocks;
+    for (ptr = pack; ptr; ptr = ptr->next)
+        checkpoint_block_sent (task, ptr->data);
+    if (info && info->multipart_upload) {
+        for (ptr = pack; ptr; ptr = ptr->next)
+            info->uploaded_bytes += GPOINTER_TO_UINT (g_hash_table_lookup (sizes, ptr->data));
+    }
+
+out:
+    mem_budget_release (reserved);
+    g_free (url);
+    evbuffer_free (buf);
+    curl_easy_reset (conn->curl);
+    return ret;
+}
 
-    int n_recv = 0;
-    char *p = rsp_content;
-    ObjectHeader *hdr = (ObjectHeader *)p;
-    char recv_obj_id[41];
-    int n = 0;
-    int size;
+/* Send the blocks collected in @pack and free the list. If the server
+ * doesn't support block packs, they're moved to @remain. */
+static int
+flush_block_pack (HttpTxTask *task, Connection *conn, ConnectionPool *pool,
+                  GList **pack, GHashTable *sizes, SyncInfo *info,
+                  GList **remain)
+{
     int rc;
-    while (n < rsp_size) {
-        memcpy (recv_obj_id, hdr->obj_id, 40);
-        recv_obj_id[40] = 0;
-        size = ntohl (hdr->obj_size);
-        if (n + sizeof(ObjectHeader) + size > rsp_size) {
-            seaf_warning ("Incomplete object package received for repo %.8s.\n",
-                          task->repo_id);
-            task->error = SYNC_ERROR_ID_SERVER;
+
+    *pack = g_list_reverse (*pack);
+    rc = send_block_pack (task, conn, pool, *pack, sizes, info);
+    if (rc > 0) {
+        *remain = g_list_concat (*pack, *remain);
+        *pack = NULL;
+        return 0;
+    }
+
+    g_list_free (*pack);
+    *pack = NULL;
+
+    if (rc < 0 || task->state == HTTP_TASK_STATE_CANCELED)
+        return -1;
+    return 0;
+}
+
+/* Send the small blocks in @block_list in packs. The blocks that are not
+ * sent are returned in @remain. */
+static int
+send_block_packs (HttpTxTask *task, Connection *conn, GList *block_list,
+                  SyncInfo *info, GList **remain)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *pool;
+    GHashTable *sizes;
+    GList *pack = NULL, *ptr;
+    BlockMetadata *bmd;
+    gint64 pack_size = 0, max_pack_size;
+    int ret = 0;
+
+    *remain = NULL;
+    max_pack_size = mem_budget_batch_size (MAX_BLOCK_PACK_SIZE,
+                                           MIN_OBJECT_PACK_SIZE);
+
+    pool = find_connection_pool (priv, task->host);
+    if (!pool || !pool->block_pack_supported) {
+        *remain = g_list_copy (block_list);
+        return 0;
+    }
+
+    sizes = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (ptr = block_list; ptr; ptr = ptr->next) {
+        if (!pool->block_pack_supported) {
+            *remain = g_list_prepend (*remain, ptr->data);
+            continue;
+        }
+
+        bmd = seaf_block_manager_stat_block (seaf->block_mgr,
+                                             task->repo_id, task->repo_version,
+                                             ptr->data);
+        if (!bmd) {
+            seaf_warning ("Failed to stat block %s in repo %s.\n",
+                          (char *)ptr->data, task->repo_id);
+            task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
             ret = -1;
             goto out;
         }
 
-        ++n_recv;
+        if (bmd->size > MAX_PACKED_BLOCK_SIZE) {
+            *remain = g_list_prepend (*remain, ptr->data);
+            g_free (bmd);
+            continue;
+        }
 
-        rc = seaf_obj_store_write_obj (seaf->fs_mgr->obj_store,
-                                       task->repo_id, task->repo_version,
-                                       recv_obj_id,
-                                       hdr->object,
-                                       size, FALSE);
-        if (rc < 0) {
-            seaf_warning ("Failed to write fs object %s in repo %.8s.\n",
-                          recv_obj_id, task->repo_id);
-            task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
-            ret = -1;
-            goto out;
+        g_hash_table_insert (sizes, ptr->data, GUINT_TO_POINTER(bmd->size));
+        pack = g_list_prepend (pack, ptr->data);
+        pack_size += bmd->size;
+        g_free (bmd);
+
+        if (pack_size >= max_pack_size) {
+            if (flush_block_pack (task, conn, pool, &pack, sizes, info, remain) < 0) {
+                ret = -1;
+                goto out;
+            }
+            pack_size = 0;
         }
+    }
 
-        g_hash_table_remove (requested, recv_obj_id);
+    if (pack && flush_block_pack (task, conn, pool, &pack, sizes, info, remain) < 0)
+        ret = -1;
 
-        ++(task->done_fs_objs);
+out:
+    g_list_free (pack);
+    g_hash_table_destroy (sizes);
+    return ret;
+}
 
-        p += (sizeof(ObjectHeader) + size);
-        n += (sizeof(ObjectHeader) + size);
-        hdr = (ObjectHeader *)p;
+static int
+send_blocks (HttpTxTask *http_task, Connection *conn, GList *block_list)
+{
+    GHashTable *added;
+    GList *unique = NULL, *ptr;
+    GList *remain = NULL;
+    SyncInfo *info;
+    int ret;
+
+    if (block_list == NULL)
+        return 0;
+
+    added = g_hash_table_new (g_str_hash, g_str_equal);
+    for (ptr = block_list; ptr; ptr = ptr->next) {
+        if (g_hash_table_contains (added, ptr->data))
+            continue;
+        g_hash_table_add (added, ptr->data);
+        unique = g_list_prepend (unique, ptr->data);
     }
+    g_hash_table_destroy (added);
+    unique = g_list_reverse (unique);
 
-    seaf_debug ("Received %d fs objects from %s:%s.\n",
-                n_recv, task->host, task->repo_id);
+    info = seaf_sync_manager_get_sync_info (seaf->sync_mgr, http_task->repo_id);
 
-    /* The server may not return all the objects we requested.
-     * So we need to add back the remaining object ids into fs_list.
-     */
-    GHashTableIter iter;
-    gpointer key, value;
-    g_hash_table_iter_init (&iter, requested);
-    while (g_hash_table_iter_next (&iter, &key, &value)) {
-        obj_id = key;
-        *fs_list = g_list_prepend (*fs_list, g_strdup(obj_id));
+    /* Uploads split into several commits are bulk even if one part is
+     * small. */
+    if ((info && info->multipart_upload) ||
+        (gint64)g_list_length (unique) * seaf->cdc_average_block_size >= BULK_TRANSFER_SIZE)
+        http_task->bulk = TRUE;
+
+    tx_share_enter (http_task, TRUE);
+    ret = send_block_packs (http_task, conn, unique, info, &remain);
+    if (ret == 0)
+        ret = transfer_blocks (http_task, remain, TRUE, FALSE, block_sent, info);
+    tx_share_leave (http_task, TRUE);
+
+    flush_sent_blocks (http_task);
+
+    g_list_free (remain);
+    g_list_free (unique);
+
+    return ret;
+}
+
+static void
+notify_permission_error (HttpTxTask *task, const char *error_str)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    GMatchInfo *match_info;
+    char *path;
+
+    if (g_regex_match (priv->locked_error_regex, error_str, 0, &match_info)) {
+        path = g_match_info_fetch (match_info, 1);
+        send_file_sync_error_notification (task->repo_id, task->repo_name, path,
+                                           SYNC_ERROR_ID_FILE_LOCKED);
+        g_free (path);
+
+        /* Set more accurate error. */
+        task->error = SYNC_ERROR_ID_FILE_LOCKED;
+    } else if (g_regex_match (priv->folder_perm_error_regex, error_str, 0, &match_info)) {
+        path = g_match_info_fetch (match_info, 1);
+        /* The path returned by server begins with '/'. */
+        send_file_sync_error_notification (task->repo_id, task->repo_name,
+                                           (path[0] == '/') ? (path + 1) : path,
+                                           SYNC_ERROR_ID_FOLDER_PERM_DENIED);
+        g_free (path);
+
+        task->error = SYNC_ERROR_ID_FOLDER_PERM_DENIED;
+    } else if (g_regex_match (priv->too_many_files_error_regex, error_str, 0, &match_info)) {
+        task->error = SYNC_ERROR_ID_TOO_MANY_FILES;
+    }
+
+    g_match_info_free (match_info);
+}
+
+static int
+update_branch (HttpTxTask *task, Connection *conn)
+{
+    CURL *curl;
+    char *url;
+    int status;
+    char *rsp_content = NULL;
+    char *rsp_content_str = NULL;
+    gint64 rsp_size;
+    int ret = 0;
+
+    curl = conn->curl;
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/commit/HEAD/?head=%s",
+                               task->host, task->repo_id, task->head);
+    else
+        url = g_strdup_printf ("%s/repo/%s/commit/HEAD/?head=%s",
+                               task->host, task->repo_id, task->head);
+
+    int curl_error;
+    if (http_put (curl, url, task->token,
+                  NULL, 0,
+                  NULL, NULL,
+                  &status, &rsp_content, &rsp_size, TRUE, &curl_error) < 0) {
+        conn->release = TRUE;
+        handle_curl_errors (task, curl_error);
+        ret = -1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for PUT %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+
+        if (status == HTTP_FORBIDDEN || status == HTTP_BLOCK_MISSING) {
+            rsp_content_str = g_new0 (gchar, rsp_size + 1);
+            memcpy (rsp_content_str, rsp_content, rsp_size);
+            if (status == HTTP_FORBIDDEN) {
+                seaf_warning ("%s\n", rsp_content_str);
+                notify_permission_error (task, rsp_content_str);
+            } else if (status == HTTP_BLOCK_MISSING) {
+                seaf_warning ("Failed to upload files: %s\n", rsp_content_str);
+                task->error = SYNC_ERROR_ID_BLOCK_MISSING;
+            }
+            g_free (rsp_content_str);
+        }
+
+        ret = -1;
+    }
+
+out:
+    g_free (url);
+    g_free (rsp_content);
+    curl_easy_reset (curl);
+
+    return ret;
+}
+
+static void
+update_master_branch (HttpTxTask *task)
+{
+    SeafBranch *branch;
+    branch = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             task->repo_id,
+                                             "master");
+    if (!branch) {
+        branch = seaf_branch_new ("master", task->repo_id, task->head);
+        seaf_branch_manager_add_branch (seaf->branch_mgr, branch);
+        seaf_branch_unref (branch);
+    } else {
+        seaf_branch_set_commit (branch, task->head);
+        seaf_branch_manager_update_branch (seaf->branch_mgr, branch);
+        seaf_branch_unref (branch);
+    }
+}
+
+static void
+set_path_status_syncing (gpointer key, gpointer value, gpointer user_data)
+{
+    HttpTxTask *task = user_data;
+    char *path = key;
+    int mode = (int)(long)value;
+    seaf_sync_manager_update_active_path (seaf->sync_mgr,
+                                          task->repo_id,
+                                          path,
+                                          mode,
+                                          SYNC_STATUS_SYNCING,
+                                          TRUE);
+}
+
+static void
+set_path_status_synced (gpointer key, gpointer value, gpointer user_data)
+{
+    HttpTxTask *task = user_data;
+    char *path = key;
+    int mode = (int)(long)value;
+    seaf_sync_manager_update_active_path (seaf->sync_mgr,
+                                          task->repo_id,
+                                          path,
+                                          mode,
+                                          SYNC_STATUS_SYNCED,
+                                          TRUE);
+}
+
+static void *
+http_upload_thread (void *vdata)
+{
+    HttpTxTask *task = vdata;
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *pool;
+    Connection *conn = NULL;
+    char *url = NULL;
+    GList *send_fs_list = NULL, *needed_fs_list = NULL;
+    GList *block_list = NULL, *needed_block_list = NULL;
+    GHashTable *active_paths = NULL;
+    int stage;
+    gint64 start;
+
+    if (task->head[0] == 0) {
+        seaf_warning ("Failed to get branch local of repo %.8s.\n", task->repo_id);
+        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+        return NULL;
+    }
+
+    pool = find_connection_pool (priv, task->host);
+    if (!pool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        goto out;
+    }
+
+    prewarm_block_connections (task);
+
+    conn = connection_pool_get_connection (pool);
+    if (!conn) {
+        seaf_warning ("Failed to get connection to host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        goto out;
+    }
+
+    /* seaf_message ("Upload with HTTP sync protocol version %d.\n", */
+    /*               task->protocol_version); */
+
+    transition_state (task, task->state, HTTP_TASK_RT_STATE_CHECK);
+
+    /* Skip the stages that were done by an interrupted upload of the
+     * same head commit. */
+    stage = tx_checkpoint_get_stage (priv->checkpoints, task->repo_id,
+                                     task->type, task->head);
+
+    gint64 delta = 0;
+    active_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    start = g_get_monotonic_time ();
+    if (calculate_upload_plan (task, &delta, active_paths,
+                               stage < TX_CHECKPOINT_FS_SENT ? &send_fs_list : NULL,
+                               stage < TX_CHECKPOINT_BLOCKS_LISTED ? &block_list : NULL) < 0) {
+        seaf_warning ("Failed to calculate upload plan for repo %s.\n",
+                      task->repo_id);
+        task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+        goto out;
+    }
+    latency_stats_record_since ("upload.plan", start);
+
+    g_hash_table_foreach (active_paths, set_path_status_syncing, task);
+
+    if (check_permission (task, conn) < 0) {
+        seaf_warning ("Upload permission denied for repo %.8s on server %s.\n",
+                      task->repo_id, task->host);
+        goto out;
+    }
+
+    if (check_quota (task, conn, delta) < 0) {
+        seaf_warning ("Not enough quota for repo %.8s on server %s.\n",
+                      task->repo_id, task->host);
+        goto out;
+    }
+
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    transition_state (task, task->state, HTTP_TASK_RT_STATE_COMMIT);
+
+    if (send_commit_object (task, conn) < 0) {
+        seaf_warning ("Failed to send head commit for repo %.8s.\n", task->repo_id);
+        goto out;
+    }
+
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    if (stage == TX_CHECKPOINT_NONE)
+        tx_checkpoint_clear (priv->checkpoints, task->repo_id, task->type);
+    else
+        seaf_message ("Resuming upload of repo %.8s from checkpoint.\n",
+                      task->repo_id);
+
+    if (stage >= TX_CHECKPOINT_FS_SENT)
+        goto fs_sent;
+
+    transition_state (task, task->state, HTTP_TASK_RT_STATE_FS);
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/check-fs/",
+                               task->host, task->repo_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/check-fs/",
+                               task->host, task->repo_id);
+
+    start = g_get_monotonic_time ();
+    while (send_fs_list != NULL) {
+        if (upload_check_id_list_segment (task, conn, url,
+                                          &send_fs_list, &needed_fs_list) < 0) {
+            seaf_warning ("Failed to check fs list for repo %.8s.\n", task->repo_id);
+            goto out;
+        }
+
+        if (task->state == HTTP_TASK_STATE_CANCELED)
+            goto out;
+    }
+    g_free (url);
+    url = NULL;
+    latency_stats_record_since ("upload.check_fs", start);
+
+    start = g_get_monotonic_time ();
+    while (needed_fs_list != NULL) {
+        if (send_fs_objects (task, conn, &needed_fs_list) < 0) {
+            seaf_warning ("Failed to send fs objects for repo %.8s.\n", task->repo_id);
+            goto out;
+        }
+
+        if (task->state == HTTP_TASK_STATE_CANCELED)
+            goto out;
+    }
+    latency_stats_record_since ("upload.send_fs", start);
+
+    tx_checkpoint_set_stage (priv->checkpoints, task->repo_id, task->type,
+                             task->head, TX_CHECKPOINT_FS_SENT);
+
+fs_sent:
+    transition_state (task, task->state, HTTP_TASK_RT_STATE_BLOCK);
+
+    if (stage == TX_CHECKPOINT_BLOCKS_LISTED) {
+        if (tx_checkpoint_load_pending_ids (priv->checkpoints, task->repo_id,
+                                            task->type,
+                                            &needed_block_list) < 0) {
+            /* The next upload starts over instead of assuming that no
+             * block is left to send. */
+            tx_checkpoint_clear (priv->checkpoints, task->repo_id, task->type);
+            task->error = SYNC_ERROR_ID_GENERAL_ERROR;
+            goto out;
+        }
+        goto blocks_listed;
+    }
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/check-blocks/",
+                               task->host, task->repo_id);
+    else
+        url = g_strdup_printf ("%s/repo/%s/check-blocks/",
+                               task->host, task->repo_id);
+
+    while (block_list != NULL) {
+        if (upload_check_id_list_segment (task, conn, url,
+                                          &block_list, &needed_block_list) < 0) {
+            seaf_warning ("Failed to check block list for repo %.8s.\n",
+                          task->repo_id);
+            goto out;
+        }
+
+        if (task->state == HTTP_TASK_STATE_CANCELED)
+            goto out;
+    }
+    g_free (url);
+    url = NULL;
+
+    if (tx_checkpoint_save_ids (priv->checkpoints, task->repo_id, task->type,
+                                needed_block_list) == 0)
+        tx_checkpoint_set_stage (priv->checkpoints, task->repo_id, task->type,
+                                 task->head, TX_CHECKPOINT_BLOCKS_LISTED);
+
+blocks_listed:
+    task->n_blocks = g_list_length (needed_block_list);
+
+    seaf_debug ("%d blocks to send for %s:%s.\n",
+                task->n_blocks, task->host, task->repo_id);
+
+    if (send_blocks (task, conn, needed_block_list) < 0 ||
+        task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    transition_state (task, task->state, HTTP_TASK_RT_STATE_UPDATE_BRANCH);
+
+    if (update_branch (task, conn) < 0) {
+        seaf_warning ("Failed to update branch of repo %.8s.\n", task->repo_id);
+        goto out;
+    }
+
+    tx_checkpoint_clear (priv->checkpoints, task->repo_id, task->type);
+
+    /* After successful upload, the cached 'master' branch should be updated to
+     * the head commit of 'local' branch.
+     */
+    update_master_branch (task);
+
+    if (active_paths != NULL)
+        g_hash_table_foreach (active_paths, set_path_status_synced, task);
+
+out:
+    string_list_free (send_fs_list);
+    string_list_free (needed_fs_list);
+    string_list_free (block_list);
+    string_list_free (needed_block_list);
+
+    if (active_paths)
+        g_hash_table_destroy (active_paths);
+
+    g_free (url);
+
+    connection_pool_return_connection (pool, conn);
+
+    return vdata;
+}
+
+static void
+http_upload_done (void *vdata)
+{
+    HttpTxTask *task = vdata;
+
+    if (task->error != SYNC_ERROR_ID_NO_ERROR)
+        transition_state (task, HTTP_TASK_STATE_ERROR, HTTP_TASK_RT_STATE_FINISHED);
+    else if (task->state == HTTP_TASK_STATE_CANCELED)
+        transition_state (task, task->state, HTTP_TASK_RT_STATE_FINISHED);
+    else
+        transition_state (task, HTTP_TASK_STATE_FINISHED, HTTP_TASK_RT_STATE_FINISHED);
+}
+
+/* Download */
+
+static void *http_download_thread (void *vdata);
+static void http_download_done (void *vdata);
+
+int
+http_tx_manager_add_download (HttpTxManager *manager,
+                              const char *repo_id,
+                              int repo_version,
+                              const char *host,
+                              const char *token,
+                              const char *server_head_id,
+                              gboolean is_clone,
+                              const char *passwd,
+                              const char *worktree,
+                              int protocol_version,
+                              const char *email,
+                              gboolean use_fileserver_port,
+                              const char *repo_name,
+                              GError **error)
+{
+    HttpTxTask *task;
+    SeafRepo *repo;
+
+    if (!repo_id) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(repo_id)");
+        return -1;
+    }
+
+    if (!token) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(token)");
+        return -1;
+    }
+
+    if (!host) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(host)");
+        return -1;
+    }
+
+    if (!server_head_id) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(server_head_id)");
+        return -1;
+    }
+
+    if (!email) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Empty argument(email)");
+        return -1;
+    }
+
+    if (!is_clone) {
+        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+        if (!repo) {
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Repo not found");
+            return -1;
+        }
+    }
+
+    clean_tasks_for_repo (manager, repo_id);
+
+    task = http_tx_task_new (manager, repo_id, repo_version,
+                             HTTP_TASK_TYPE_DOWNLOAD, is_clone,
+                             host, token, passwd, worktree);
+
+    memcpy (task->head, server_head_id, 40);
+    task->protocol_version = protocol_version;
+    task->email = g_strdup(email);
+
+    task->state = HTTP_TASK_STATE_NORMAL;
+
+    task->use_fileserver_port = use_fileserver_port;
+
+    task->blk_ref_cnts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_free);
+    pthread_mutex_init (&task->ref_cnt_lock, NULL);
+
+    /* The blocks of an encrypted repo are encrypted with its own key, so
+     * other repos never have them. */
+    if (!passwd && (is_clone || !repo->encrypted) &&
+        seafile_session_config_get_bool (seaf, KEY_SHARE_BLOCKS_ACROSS_REPOS))
+        task->shared_block_stores =
+            seaf_repo_manager_get_block_share_repos (seaf->repo_mgr, repo_id,
+                                                     repo_version, host);
+
+    g_hash_table_insert (manager->priv->download_tasks,
+                         g_strdup(repo_id),
+                         task);
+
+    task->repo_name = g_strdup(repo_name);
+
+    if (seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                     JOB_PRIORITY_BULK,
+                                                     http_download_thread,
+                                                     http_download_done,
+                                                     task) < 0) {
+        g_hash_table_remove (manager->priv->download_tasks, repo_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+get_commit_object (HttpTxTask *task, Connection *conn)
+{
+    CURL *curl;
+    char *url;
+    int status;
+    char *rsp_content = NULL;
+    gint64 rsp_size;
+    int ret = 0;
+
+    curl = conn->curl;
+
+    if (!task->use_fileserver_port)
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/commit/%s",
+                               task->host, task->repo_id, task->head);
+    else
+        url = g_strdup_printf ("%s/repo/%s/commit/%s",
+                               task->host, task->repo_id, task->head);
+
+    int curl_error;
+    if (http_get (curl, url, task->token, &status,
+                  &rsp_content, &rsp_size,
+                  NULL, NULL, TRUE, &curl_error) < 0) {
+        conn->release = TRUE;
+        handle_curl_errors (task, curl_error);
+        ret = -1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+        ret = -1;
+        goto out;
+    }
+
+    int rc = seaf_obj_store_write_obj (seaf->commit_mgr->obj_store,
+                                       task->repo_id, task->repo_version,
+                                       task->head,
+                                       rsp_content,
+                                       rsp_size,
+                                       FALSE);
+    if (rc < 0) {
+        seaf_warning ("Failed to save commit %s in repo %.8s.\n",
+                      task->head, task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        ret = -1;
+    }
+
+out:
+    g_free (url);
+    g_free (rsp_content);
+    curl_easy_reset (curl);
+
+    return ret;
+}
+
+static int
+get_needed_fs_id_list (HttpTxTask *task, Connection *conn, GList **fs_id_list)
+{
+    SeafBranch *master;
+    CURL *curl;
+    char *url = NULL;
+    int status;
+    int ret = 0;
+    IdListParser parser;
+    GHashTable *checked_objs = NULL;
+    const unsigned char *raw;
+    char obj_id[41];
+    guint i, n;
+
+    const char *url_prefix = (task->use_fileserver_port) ? "" : "seafhttp/";
+
+    if (!task->is_clone) {
+        master = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                                 task->repo_id,
+                                                 "master");
+        if (!master) {
+            seaf_warning ("Failed to get branch master for repo %.8s.\n",
+                          task->repo_id);
+            return -1;
+        }
+
+        url = g_strdup_printf ("%s/%srepo/%s/fs-id-list/"
+                               "?server-head=%s&client-head=%s",
+                               task->host, url_prefix, task->repo_id,
+                               task->head, master->commit_id);
+
+        seaf_branch_unref (master);
+    } else {
+        url = g_strdup_printf ("%s/%srepo/%s/fs-id-list/?server-head=%s",
+                               task->host, url_prefix, task->repo_id, task->head);
+    }
+
+    curl = conn->curl;
+    id_list_parser_init (&parser, curl);
+
+    int curl_error;
+    if (http_get (curl, url, task->token, &status,
+                  NULL, NULL,
+                  recv_id_list, &parser, (!task->is_clone), &curl_error) < 0) {
+        if (parser.state == ID_LIST_ERROR) {
+            task->error = SYNC_ERROR_ID_SERVER;
+        } else {
+            conn->release = TRUE;
+            handle_curl_errors (task, curl_error);
+        }
+        ret = -1;
+        goto out;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
+        handle_http_errors (task, status);
+        ret = -1;
+        goto out;
+    }
+
+    if (id_list_parser_finish (&parser) < 0) {
+        seaf_warning ("Incomplete id list in response from the server.\n");
+        task->error = SYNC_ERROR_ID_SERVER;
+        ret = -1;
+        goto out;
+    }
+
+    n = id_list_parser_n_ids (&parser);
+
+    seaf_debug ("Received fs object list size %u from %s:%s.\n",
+                n, task->host, task->repo_id);
+
+    task->n_fs_objs = (int)n;
+
+    /* Keys point to the raw ids in the parser. */
+    checked_objs = g_hash_table_new (ccnet_sha1_hash, ccnet_sha1_equal);
+
+    for (i = 0; i < n; ++i) {
+        raw = id_list_parser_get_id (&parser, i);
+
+        if (g_hash_table_contains (checked_objs, raw)) {
+            ++(task->done_fs_objs);
+            continue;
+        }
+        g_hash_table_add (checked_objs, (gpointer)raw);
+
+        rawdata_to_hex (raw, obj_id, 20);
+
+        if (!seaf_obj_store_obj_exists (seaf->fs_mgr->obj_store,
+                                        task->repo_id, task->repo_version,
+                                        obj_id)) {
+            *fs_id_list = g_list_prepend (*fs_id_list, g_strdup(obj_id));
+        } else if (task->is_clone) {
+            gboolean io_error = FALSE;
+            gboolean sound;
+            sound = seaf_fs_manager_verify_object (seaf->fs_mgr,
+                                                   task->repo_id, task->repo_version,
+                                                   obj_id, FALSE, &io_error);
+            if (!sound && !io_error) {
+                *fs_id_list = g_list_prepend (*fs_id_list, g_strdup(obj_id));
+            } else {
+                ++(task->done_fs_objs);
+            }
+        } else {
+            ++(task->done_fs_objs);
+        }
+    }
+
+out:
+    if (checked_objs)
+        g_hash_table_destroy (checked_objs);
+    id_list_parser_destroy (&parser);
+    g_free (url);
+    curl_easy_reset (curl);
+
+    return ret;
+}
+
+/*
+ * Fs objects are fetched in batches posted to pack-fs/. Several batches are
+ * kept in flight on a multi handle, and the batch size grows while the
+ * server answers quickly. Responses are parsed as they are received, and
+ * the objects are written to the object store by writer threads, so disk
+ * writes overlap with the network.
+ *
+ * At most MAX_PENDING_FS_WRITE_BYTES of received objects wait for the
+ * writers, less when the memory budget runs low. Beyond that the receiving
+ * thread waits, so memory use doesn't grow with the size of the library
+ * when the disk is slower than the network.
+ */
+
+#define GET_FS_OBJECT_N 100
+#define MAX_GET_FS_OBJECT_N 2000
+#define FS_BATCHES_IN_FLIGHT 4
+#define FS_WRITE_THREADS 2
+/* Batches answered faster than this grow, slower ones shrink. */
+#define FS_BATCH_FAST_MSEC 1000
+#define FS_BATCH_SLOW_MSEC 4000
+#define MAX_PENDING_FS_WRITE_BYTES (16 << 20) /* 16MB */
+#define MIN_PENDING_FS_WRITE_BYTES (1 << 20) /* 1MB */
+
+typedef struct {
+    HttpTxTask *task;
+    ConnectionPool *pool;
+    GThreadPool *writers;
+    gint write_error;
+    int batch_size;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* Signaled when pending_bytes drops. */
+    gint64 pending_bytes;
+} FsFetch;
+
+typedef struct {
+    char obj_id[41];
+    char *data;
+    guint32 len;
+} FsObjWrite;
+
+typedef struct {
+    FsFetch *fetch;
+    CURL *curl;
+    char *url;
+    char *req;
+    struct curl_slist *headers;
+    struct curl_slist *connect_to;
+    GHashTable *requested;
+    int n_requested;
+    gint64 start;
+    /* Set if the request may go over HTTP/3. */
+    gboolean http3;
+    /* Object being received. */
+    ObjectHeader hdr;
+    guint32 hdr_len;
+    char *obj;
+    guint32 obj_size;
+    guint32 obj_len;
+    gboolean error;
+} FsBatch;
+
+static void
+fs_obj_write_func (gpointer data, gpointer user_data)
+{
+    FsObjWrite *w = data;
+    FsFetch *fetch = user_data;
+    HttpTxTask *task = fetch->task;
+
+    if (!g_atomic_int_get (&fetch->write_error) &&
+        seaf_obj_store_write_obj (seaf->fs_mgr->obj_store,
+                                  task->repo_id, task->repo_version,
+                                  w->obj_id, w->data, w->len, FALSE) < 0) {
+        seaf_warning ("Failed to write fs object %s in repo %.8s.\n",
+                      w->obj_id, task->repo_id);
+        g_atomic_int_set (&fetch->write_error, 1);
+    }
+
+    pthread_mutex_lock (&fetch->lock);
+    fetch->pending_bytes -= w->len;
+    pthread_cond_signal (&fetch->cond);
+    pthread_mutex_unlock (&fetch->lock);
+
+    mem_budget_release (w->len);
+
+    g_free (w->data);
+    g_free (w);
+}
+
+static void
+fs_fetch_queue_write (FsFetch *fetch, FsObjWrite *w)
+{
+    gint64 max_pending = mem_budget_batch_size (MAX_PENDING_FS_WRITE_BYTES,
+                                                MIN_PENDING_FS_WRITE_BYTES);
+
+    pthread_mutex_lock (&fetch->lock);
+    while (fetch->pending_bytes > max_pending &&
+           !g_atomic_int_get (&fetch->write_error))
+        pthread_cond_wait (&fetch->cond, &fetch->lock);
+    fetch->pending_bytes += w->len;
+    pthread_mutex_unlock (&fetch->lock);
+
+    mem_budget_reserve (w->len);
+
+    g_thread_pool_push (fetch->writers, w, NULL);
+}
+
+static size_t
+recv_fs_objects_callback (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    FsBatch *batch = userp;
+    FsFetch *fetch = batch->fetch;
+    HttpTxTask *task = fetch->task;
+    char *p = ptr, *end = p + realsize;
+    FsObjWrite *w;
+    long status;
+    size_t n;
+
+    if (task->state == HTTP_TASK_STATE_CANCELED || task->all_stop)
+        return 0;
+
+    /* Error responses are not object packages. */
+    if (curl_easy_getinfo (batch->curl, CURLINFO_RESPONSE_CODE, &status) != CURLE_OK ||
+        status != HTTP_OK)
+        return realsize;
+
+    while (p < end) {
+        if (!batch->obj) {
+            n = MIN (end - p, sizeof(batch->hdr) - batch->hdr_len);
+            memcpy ((char *)&batch->hdr + batch->hdr_len, p, n);
+            batch->hdr_len += n;
+            p += n;
+            if (batch->hdr_len < sizeof(batch->hdr))
+                break;
+
+            batch->hdr_len = 0;
+            batch->obj_size = ntohl (batch->hdr.obj_size);
+            batch->obj_len = 0;
+            /* Allocate one more byte so that empty objects are not NULL. */
+            batch->obj = g_malloc (batch->obj_size + 1);
+        }
+
+        n = MIN (end - p, batch->obj_size - batch->obj_len);
+        memcpy (batch->obj + batch->obj_len, p, n);
+        batch->obj_len += n;
+        p += n;
+
+        if (batch->obj_len < batch->obj_size)
+            break;
+
+        w = g_new0 (FsObjWrite, 1);
+        memcpy (w->obj_id, batch->hdr.obj_id, 40);
+        w->data = batch->obj;
+        w->len = batch->obj_size;
+        batch->obj = NULL;
+
+        g_hash_table_remove (batch->requested, w->obj_id);
+        ++(task->done_fs_objs);
+
+        fs_fetch_queue_write (fetch, w);
+    }
+
+    return realsize;
+}
+
+static void
+fs_batch_free (FsBatch *batch)
+{
+    if (batch->curl)
+        curl_easy_cleanup (batch->curl);
+    curl_slist_free_all (batch->headers);
+    curl_slist_free_all (batch->connect_to);
+    if (batch->requested)
+        g_hash_table_destroy (batch->requested);
+    g_free (batch->obj);
+    g_free (batch->url);
+    free (batch->req);
+    g_free (batch);
+}
+
+/* Take the next batch of ids off @fs_list and prepare the request. */
+static FsBatch *
+fs_batch_new (FsFetch *fetch, GList **fs_list)
+{
+    HttpTxTask *task = fetch->task;
+    FsBatch *batch = g_new0 (FsBatch, 1);
+    json_t *array;
+    char *obj_id;
+    char *token_header;
+    CURL *curl;
+
+    batch->fetch = fetch;
+    batch->requested = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    /* Convert object id list to JSON format. */
+    array = json_array ();
+    while (*fs_list != NULL && batch->n_requested < fetch->batch_size) {
+        obj_id = (*fs_list)->data;
+        json_array_append_new (array, json_string(obj_id));
+        *fs_list = g_list_delete_link (*fs_list, *fs_list);
+        g_hash_table_replace (batch->requested, obj_id, obj_id);
+        ++batch->n_requested;
+    }
+    batch->req = json_dumps (array, 0);
+    json_decref (array);
+
+    seaf_debug ("Requesting %d fs objects from %s:%s.\n",
+                batch->n_requested, task->host, task->repo_id);
+
+    if (!task->use_fileserver_port)
+        batch->url = g_strdup_printf ("%s/seafhttp/repo/%s/pack-fs/", task->host, task->repo_id);
+    else
+        batch->url = g_strdup_printf ("%s/repo/%s/pack-fs/", task->host, task->repo_id);
+
+    curl = batch->curl = curl_easy_init ();
+    if (!curl) {
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        goto error;
+    }
+
+    batch->headers = curl_slist_append (batch->headers, "User-Agent: Seafile/"SEAFILE_CLIENT_VERSION" ("USER_AGENT_OS")");
+    /* Disable the default "Expect: 100-continue" header */
+    batch->headers = curl_slist_append (batch->headers, "Expect:");
+    token_header = g_strdup_printf ("Seafile-Repo-Token: %s", task->token);
+    batch->headers = curl_slist_append (batch->headers, token_header);
+    g_free (token_header);
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, batch->headers);
+
+    curl_easy_setopt (curl, CURLOPT_POST, 1L);
+    curl_easy_setopt (curl, CURLOPT_POSTFIELDS, batch->req);
+    curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)strlen(batch->req));
+    /* All POST requests should remain POST after redirect. */
+    curl_easy_setopt (curl, CURLOPT_POSTREDIR, CURL_REDIR_POST_ALL);
+
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, recv_fs_objects_callback);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, batch);
+    curl_easy_setopt (curl, CURLOPT_PRIVATE, batch);
+
+    if (set_multi_request_options (curl, batch->url, &batch->connect_to) != CURLE_OK) {
+        seaf_warning ("Failed to set url %s.\n", batch->url);
+        goto error;
+    }
+    batch->http3 = set_http3_options (curl, fetch->pool);
+
+    batch->start = g_get_monotonic_time ();
+
+    return batch;
+
+error:
+    fs_batch_free (batch);
+    return NULL;
+}
+
+/* Check a finished batch. The ids the server didn't return are added back
+ * to @fs_list. */
+static int
+fs_batch_finish (FsBatch *batch, CURLcode result, GList **fs_list,
+                 gboolean *release)
+{
+    FsFetch *fetch = batch->fetch;
+    HttpTxTask *task = fetch->task;
+    GHashTableIter iter;
+    gpointer key, value;
+    gint64 elapsed;
+    long status;
+
+    if (batch->http3 &&
+        http3_request_done (fetch->pool, batch->curl, result) &&
+        task->state != HTTP_TASK_STATE_CANCELED) {
+        /* Request the missing objects again, over TCP. */
+        *release = TRUE;
+        g_hash_table_iter_init (&iter, batch->requested);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            *fs_list = g_list_prepend (*fs_list, g_strdup((char *)key));
+        return 0;
+    }
+
+    if (result != CURLE_OK) {
+        if (task->state == HTTP_TASK_STATE_CANCELED)
+            return 0;
+
+        seaf_warning ("libcurl failed to POST %s: %s.\n",
+                      batch->url, curl_easy_strerror(result));
+        *release = TRUE;
+        handle_curl_errors (task, result);
+        return -1;
+    }
+
+    if (curl_easy_getinfo (batch->curl, CURLINFO_RESPONSE_CODE, &status) != CURLE_OK) {
+        seaf_warning ("Failed to get status code for POST %s.\n", batch->url);
+        return -1;
+    }
+
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for POST %s: %ld.\n", batch->url, status);
+        handle_http_errors (task, status);
+        return -1;
+    }
+
+    if (batch->obj || batch->hdr_len > 0) {
+        seaf_warning ("Incomplete object package received for repo %.8s.\n",
+                      task->repo_id);
+        task->error = SYNC_ERROR_ID_SERVER;
+        return -1;
+    }
+
+    seaf_debug ("Received %d fs objects from %s:%s.\n",
+                batch->n_requested - g_hash_table_size (batch->requested),
+                task->host, task->repo_id);
+
+    /* The server may not return all the objects we requested.
+     * So we need to add back the remaining object ids into fs_list.
+     */
+    g_hash_table_iter_init (&iter, batch->requested);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        *fs_list = g_list_prepend (*fs_list, g_strdup((char *)key));
+
+    /* Adapt the batch size to how fast the server answers. */
+    elapsed = (g_get_monotonic_time () - batch->start) / 1000;
+    if (elapsed < FS_BATCH_FAST_MSEC && batch->n_requested >= fetch->batch_size)
+        fetch->batch_size = MIN (fetch->batch_size * 2, MAX_GET_FS_OBJECT_N);
+    else if (elapsed > FS_BATCH_SLOW_MSEC)
+        fetch->batch_size = MAX (fetch->batch_size / 2, GET_FS_OBJECT_N);
+
+    return 0;
+}
+
+static int
+get_fs_objects (HttpTxTask *task, GList **fs_list)
+{
+    HttpTxPriv *priv = seaf->http_tx_mgr->priv;
+    ConnectionPool *pool;
+    CURLM *multi;
+    FsFetch fetch;
+    FsBatch *batch;
+    GList *active = NULL, *ptr;
+    int n_active = 0;
+    CURLMsg *msg;
+    CURL *easy;
+    CURLcode result;
+    int running, n_msgs;
+    gboolean release = FALSE;
+    gboolean stop = FALSE;
+    int ret = 0;
+
+    pool = find_connection_pool (priv, task->host);
+    if (!pool) {
+        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        return -1;
+    }
+
+    multi = connection_pool_get_multi (pool);
+    if (!multi) {
+        seaf_warning ("Failed to get connection to host %s.\n", task->host);
+        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+        return -1;
+    }
+
+    memset (&fetch, 0, sizeof(fetch));
+    fetch.task = task;
+    fetch.pool = pool;
+    fetch.batch_size = GET_FS_OBJECT_N;
+    pthread_mutex_init (&fetch.lock, NULL);
+    pthread_cond_init (&fetch.cond, NULL);
+    fetch.writers = g_thread_pool_new (fs_obj_write_func, &fetch,
+                                       FS_WRITE_THREADS, FALSE, NULL);
+
+    while (!stop) {
+        while (*fs_list && n_active < FS_BATCHES_IN_FLIGHT) {
+            batch = fs_batch_new (&fetch, fs_list);
+            if (!batch) {
+                ret = -1;
+                stop = TRUE;
+                break;
+            }
+            curl_multi_add_handle (multi, batch->curl);
+            active = g_list_prepend (active, batch);
+            ++n_active;
+        }
+        if (stop || n_active == 0)
+            break;
+
+        curl_multi_perform (multi, &running);
+
+        while ((msg = curl_multi_info_read (multi, &n_msgs)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            /* msg is invalid once the handle is removed. */
+            easy = msg->easy_handle;
+            result = msg->data.result;
+            curl_easy_getinfo (easy, CURLINFO_PRIVATE, (char **)&batch);
+            curl_multi_remove_handle (multi, easy);
+            active = g_list_remove (active, batch);
+            --n_active;
+
+            if (fs_batch_finish (batch, result, fs_list, &release) < 0) {
+                ret = -1;
+                stop = TRUE;
+            }
+            fs_batch_free (batch);
+        }
+
+        if (task->state == HTTP_TASK_STATE_CANCELED || task->all_stop ||
+            g_atomic_int_get (&fetch.write_error))
+            stop = TRUE;
+
+        if (!stop && n_active > 0)
+            curl_multi_wait (multi, NULL, 0, MULTI_WAIT_MSEC, NULL);
+    }
+
+    /* Abort the requests still running after an error or cancel. */
+    for (ptr = active; ptr; ptr = ptr->next) {
+        batch = ptr->data;
+        curl_multi_remove_handle (multi, batch->curl);
+        fs_batch_free (batch);
+    }
+    g_list_free (active);
+
+    connection_pool_return_multi (pool, multi, release);
+
+    /* Wait for the queued objects to be written. */
+    g_thread_pool_free (fetch.writers, FALSE, TRUE);
+    pthread_mutex_destroy (&fetch.lock);
+    pthread_cond_destroy (&fetch.cond);
+
+    if (g_atomic_int_get (&fetch.write_error)) {
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        return -1;
+    }
+
+    if (ret < 0 || task->state == HTTP_TASK_STATE_CANCELED)
+        return ret;
+
+    /* Objects are written without sync, flush them all at once. */
+    if (seaf_obj_store_sync (seaf->fs_mgr->obj_store,
+                             task->repo_id, task->repo_version) < 0) {
+        seaf_warning ("Failed to sync fs objects in repo %.8s.\n",
+                      task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Fetching the fs objects of a repo with a sync filter.
+ *
+ * The fs id list of the server covers the whole library and can't be
+ * limited to some paths. Instead the tree of the new head is walked one
+ * level at a time, from the root. The missing dirs and files of a level
+ * are fetched in one go, and only the dirs the filter syncs are
+ * descended into.
+ *
+ * A dir with the same id at the same path in master was fetched by the
+ * last download, with the same filter, so its subtree is skipped. When the
+ * filter has changed, nothing can be skipped.
+ */
+
+typedef struct FsWalkDir {
+    char id[41];
+    /* The dir at the same path in master, "" if none. */
+    char master_id[41];
+    char *path;
+} FsWalkDir;
+
+static void
+fs_walk_dir_free (FsWalkDir *wd)
+{
+    g_free (wd->path);
+    g_free (wd);
+}
+
+static FsWalkDir *
+fs_walk_dir_new (const char *id, const char *master_id, const char *path)
+{
+    FsWalkDir *wd = g_new0 (FsWalkDir, 1);
+
+    memcpy (wd->id, id, 40);
+    if (master_id)
+        memcpy (wd->master_id, master_id, 40);
+    wd->path = g_strdup (path);
+
+    return wd;
+}
+
+static void
+add_missing_fs_object (HttpTxTask *task, GHashTable *seen,
+                       GList **fs_list, const char *obj_id)
+{
+    if (g_hash_table_contains (seen, obj_id))
+        return;
+    g_hash_table_add (seen, g_strdup(obj_id));
+
+    if (!seaf_obj_store_obj_exists (seaf->fs_mgr->obj_store,
+                                    task->repo_id, task->repo_version,
+                                    obj_id)) {
+        *fs_list = g_list_prepend (*fs_list, g_strdup(obj_id));
+        ++(task->n_fs_objs);
+    }
+}
+
+/* Returns name -> id of the sub-dirs of @dir_id in master. */
+static GHashTable *
+load_master_sub_dirs (HttpTxTask *task, const char *dir_id)
+{
+    GHashTable *sub_dirs;
+    SeafDir *dir;
+    SeafDirent *dent;
+    GList *ptr;
+
+    if (dir_id[0] == '\0')
+        return NULL;
+
+    /* May not be present if it's not synced by the last filter. */
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                       task->repo_id, task->repo_version,
+                                       dir_id);
+    if (!dir)
+        return NULL;
+
+    sub_dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        if (S_ISDIR(dent->mode))
+            g_hash_table_insert (sub_dirs, g_strdup(dent->name),
+                                 g_strdup(dent->id));
+    }
+    seaf_dir_free (dir);
+
+    return sub_dirs;
+}
+
+static char *
+get_master_root (HttpTxTask *task)
+{
+    SeafBranch *master;
+    SeafCommit *commit;
+    char *root_id = NULL;
+
+    master = seaf_branch_manager_get_branch (seaf->branch_mgr,
+                                             task->repo_id, "master");
+    if (!master)
+        return NULL;
+
+    commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                             task->repo_id, task->repo_version,
+                                             master->commit_id);
+    if (commit) {
+        root_id = g_strdup (commit->root_id);
+        seaf_commit_unref (commit);
+    }
+    seaf_branch_unref (master);
+
+    return root_id;
+}
+
+static int
+walk_level (HttpTxTask *task, SyncFilter *filter, FsWalkDir *wd,
+            GHashTable *seen, GList **next_level, GList **fs_list)
+{
+    SeafDir *dir;
+    SeafDirent *dent;
+    GHashTable *master_dirs;
+    const char *master_id;
+    GList *ptr;
+    char *path;
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                       task->repo_id, task->repo_version,
+                                       wd->id);
+    if (!dir) {
+        seaf_warning ("Failed to load dir %s in repo %.8s.\n",
+                      wd->id, task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        return -1;
+    }
+
+    master_dirs = load_master_sub_dirs (task, wd->master_id);
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        if (strcmp (dent->id, EMPTY_SHA1) == 0)
+            continue;
+
+        if (wd->path[0] == '\0')
+            path = g_strdup (dent->name);
+        else
+            path = g_strconcat (wd->path, "/", dent->name, NULL);
+
+        if (!sync_filter_is_synced (filter, path, S_ISDIR(dent->mode))) {
+            g_free (path);
+            continue;
+        }
+
+        if (S_ISDIR(dent->mode)) {
+            master_id = master_dirs ?
+                g_hash_table_lookup (master_dirs, dent->name) : NULL;
+            if (!master_id || strcmp (master_id, dent->id) != 0) {
+                add_missing_fs_object (task, seen, fs_list, dent->id);
+                *next_level = g_list_prepend (*next_level,
+                                              fs_walk_dir_new (dent->id,
+                                                               master_id,
+                                                               path));
+            }
+        } else {
+            add_missing_fs_object (task, seen, fs_list, dent->id);
+        }
+        g_free (path);
+    }
+
+    if (master_dirs)
+        g_hash_table_destroy (master_dirs);
+    seaf_dir_free (dir);
+    return 0;
+}
+
+static int
+get_filtered_fs_objects (HttpTxTask *task, SyncFilter *filter,
+                         gboolean full_walk)
+{
+    SeafCommit *head;
+    char *master_root = NULL;
+    GHashTable *seen;
+    GList *level = NULL, *next_level, *fs_list = NULL, *ptr;
+    int ret = 0;
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           task->repo_id, task->repo_version,
+                                           task->head);
+    if (!head) {
+        seaf_warning ("Failed to get commit %s of repo %.8s.\n",
+                      task->head, task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        return -1;
+    }
+
+    if (!task->is_clone && !full_walk)
+        master_root = get_master_root (task);
+
+    seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    task->n_fs_objs = 0;
+    task->done_fs_objs = 0;
+
+    if (!master_root || strcmp (master_root, head->root_id) != 0) {
+        add_missing_fs_object (task, seen, &fs_list, head->root_id);
+        level = g_list_prepend (NULL, fs_walk_dir_new (head->root_id,
+                                                       master_root, ""));
+    }
+
+    while (level) {
+        if (fs_list) {
+            ret = get_fs_objects (task, &fs_list);
+            string_list_free (fs_list);
+            fs_list = NULL;
+            if (ret < 0)
+                break;
+        }
+
+        if (task->state == HTTP_TASK_STATE_CANCELED) {
+            ret = -1;
+            break;
+        }
+
+        next_level = NULL;
+        for (ptr = level; ptr; ptr = ptr->next) {
+            if (walk_level (task, filter, ptr->data, seen,
+                            &next_level, &fs_list) < 0) {
+                ret = -1;
+                break;
+            }
+        }
+        g_list_free_full (level, (GDestroyNotify)fs_walk_dir_free);
+        level = next_level;
+
+        if (ret < 0)
+            break;
+    }
+
+    /* Files of the last level. */
+    if (ret == 0 && fs_list)
+        ret = get_fs_objects (task, &fs_list);
+
+    string_list_free (fs_list);
+    g_list_free_full (level, (GDestroyNotify)fs_walk_dir_free);
+    g_hash_table_destroy (seen);
+    g_free (master_root);
+    seaf_commit_unref (head);
+
+    return ret;
+}
+
+static size_t
+get_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size *nmemb;
+    SendBlockData *data = userp;
+    HttpTxTask *task = data->task;
+    size_t n;
+
+    if (task->state == HTTP_TASK_STATE_CANCELED || task->all_stop)
+        return 0;
+
+    if (block_tx_throttle (data, FALSE))
+        return CURL_WRITEFUNC_PAUSE;
+
+    if (data->buf) {
+        g_byte_array_append (data->buf, ptr, realsize);
+        n = realsize;
+    } else
+        n = seaf_block_manager_write_block (seaf->block_mgr,
+                                            data->block,
+                                            ptr, realsize);
+    if (n < realsize) {
+        seaf_warning ("Failed to write block %s in repo %.8s.\n",
+                      data->block_id, task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        return n;
+    }
+
+    /* Update global transferred bytes. */
+    g_atomic_int_add (&(seaf->sync_mgr->recv_bytes), n);
+
+    /* Update transferred bytes for this task */
+    g_atomic_int_add (&task->tx_bytes, n);
+
+    block_tx_throttle_consume (data, FALSE, n);
+
+    return n;
+}
+
+/*
+ * Commit a downloaded block and count its reference. The block handle is
+ * closed, but not freed. The size of the block is returned in @psize.
+ */
+static int
+commit_downloaded_block (HttpTxTask *task, const char *block_id,
+                         BlockHandle *block, guint32 *psize)
+{
+    int ret = 0;
+    int *pcnt;
+
+    BlockMetadata *bmd = seaf_block_manager_stat_block_by_handle(seaf->block_mgr, block);
+    if (bmd == NULL) {
+        seaf_warning ("Failed to get block %s meta data in repo %.8s.\n", block_id, task->repo_id);
+        seaf_block_manager_close_block (seaf->block_mgr, block);
+        return -1;
+    }
+    
+    seaf_block_manager_close_block (seaf->block_mgr, block);
+
+    pthread_mutex_lock (&task->ref_cnt_lock);
+
+    task->done_download += bmd->size;
+    *psize = bmd->size;
+    g_free (bmd);    
+
+    /* Don't overwrite the block if other thread already downloaded it.
+     * Since we've locked ref_cnt_lock, we can be sure the block won't be removed.
+     */
+    if (!seaf_block_manager_block_exists (seaf->block_mgr,
+                                          task->repo_id, task->repo_version,
+                                          block_id) &&
+        seaf_block_manager_commit_block (seaf->block_mgr, block) < 0)
+    {
+        seaf_warning ("Failed to commit block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        seaf_block_manager_cache_add (seaf->block_mgr,
+                                      task->repo_id, task->repo_version,
+                                      block_id, *psize);
+        pcnt = g_hash_table_lookup (task->blk_ref_cnts, block_id);
+        if (!pcnt) {
+            pcnt = g_new0(int, 1);
+            g_hash_table_insert (task->blk_ref_cnts, g_strdup(block_id), pcnt);
+            seaf_block_manager_pin_block (seaf->block_mgr, task->repo_id,
+                                          task->repo_version, block_id);
+        }
+        *pcnt += 1;
+    }
+
+    pthread_mutex_unlock (&task->ref_cnt_lock);
+
+    return ret;
+}
+
+/* Write a block received from a LAN peer to the store of the task. */
+static int
+store_peer_block (const char *block_id, const void *buf, int len,
+                  void *user_data)
+{
+    HttpTxTask *task = user_data;
+    BlockHandle *block;
+    guint32 size;
+    int ret;
+
+    block = seaf_block_manager_open_block (seaf->block_mgr,
+                                           task->repo_id, task->repo_version,
+                                           block_id, BLOCK_WRITE);
+    if (!block)
+        return -1;
+
+    if (seaf_block_manager_write_block (seaf->block_mgr, block, buf, len) != len) {
+        seaf_warning ("Failed to write block %s in repo %.8s.\n",
+                      block_id, task->repo_id);
+        seaf_block_manager_close_block (seaf->block_mgr, block);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+        return -1;
+    }
+
+    ret = commit_downloaded_block (task, block_id, block, &size);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+
+    return ret;
+}
+
+/*
+ * Link @block_id into the store of the task from the first other repo that
+ * has it. Block ids are hashes of the stored content, so any copy can be
+ * used. With the fs backend, the stores share the block file through a
+ * hard link, and each repo holds its own reference to it.
+ */
+static gboolean
+link_shared_block (HttpTxTask *task, const char *block_id)
+{
+    GList *ptr;
+    const char *store_id;
+    BlockMetadata *bmd;
+
+    for (ptr = task->shared_block_stores; ptr; ptr = ptr->next) {
+        store_id = ptr->data;
+        if (!seaf_block_manager_block_exists (seaf->block_mgr, store_id,
+                                              task->repo_version, block_id))
+            continue;
+        if (seaf_block_manager_copy_block (seaf->block_mgr,
+                                           store_id, task->repo_version,
+                                           task->repo_id, task->repo_version,
+                                           block_id) < 0)
+            continue;
+
+        /* The block is on the server, it can be evicted like downloaded
+         * blocks. */
+        if (seaf->block_mgr->cache) {
+            bmd = seaf_block_manager_stat_block (seaf->block_mgr, task->repo_id,
+                                                 task->repo_version, block_id);
+            if (bmd) {
+                seaf_block_manager_cache_add (seaf->block_mgr, task->repo_id,
+                                              task->repo_version, block_id,
+                                              bmd->size);
+                g_free (bmd);
+            }
+        }
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+int
+http_tx_task_download_file_blocks (HttpTxTask *task, const char *file_id)
+{
+    Seafile *file;
+    GList *needed = NULL;
+    int ret = 0;
+
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                        task->repo_id,
+                                        task->repo_version,
+                                        file_id);
+    if (!file) {
+        seaf_warning ("Failed to find seafile object %s in repo %.8s.\n",
+                      file_id, task->repo_id);
+        return -1;
+    }
+
+    int i;
+    char *block_id;
+    int *pcnt;
+    for (i = 0; i < file->n_blocks; ++i) {
+        block_id = file->blk_sha1s[i];
+        pthread_mutex_lock (&task->ref_cnt_lock);
+        if (seaf_block_manager_block_exists (seaf->block_mgr,
+                                             task->repo_id, task->repo_version,
+                                             block_id) ||
+            link_shared_block (task, block_id)) {
+            BlockMetadata *bmd;
+            bmd = seaf_block_manager_stat_block (seaf->block_mgr,
+                                                 task->repo_id, task->repo_version,
+                                                 block_id);
+            if (bmd) {
+                pcnt = g_hash_table_lookup (task->blk_ref_cnts, block_id);
+                if (!pcnt) {
+                    pcnt = g_new0(int, 1);
+                    g_hash_table_insert (task->blk_ref_cnts, g_strdup(block_id), pcnt);
+                    seaf_block_manager_pin_block (seaf->block_mgr, task->repo_id,
+                                                  task->repo_version, block_id);
+                }
+                *pcnt += 1;
+                pthread_mutex_unlock (&task->ref_cnt_lock);
+                task->done_download += bmd->size;
+                g_free (bmd);
+                continue;
+            }
+        }
+        pthread_mutex_unlock (&task->ref_cnt_lock);
+
+        needed = g_list_prepend (needed, block_id);
+    }
+
+    /* The blocks of a file are independent of each other, so download
+     * them concurrently. */
+    needed = g_list_reverse (needed);
+    needed = seaf_peer_block_manager_fetch_blocks (seaf->peer_block_mgr,
+                                                   task->repo_id, task->head,
+                                                   needed,
+                                                   store_peer_block, task);
+    ret = transfer_blocks (task, needed, FALSE, FALSE, NULL, NULL);
+    g_list_free (needed);
+
+    seafile_unref (file);
+
+    return ret;
+}
+
+/*
+ * Direct checkout.
+ *
+ * The missing blocks of a file are downloaded into memory and written
+ * straight to the file being checked out, instead of being written to the
+ * block store and read back. Blocks are written in file order, so they are
+ * downloaded in windows of DIRECT_CHECKOUT_WINDOW consecutive blocks, which
+ * bounds the memory used for the blocks received out of order.
+ */
+
+#define DIRECT_CHECKOUT_WINDOW 8
+
+static void
+direct_block_received (HttpTxTask *task, BlockTx *bt, void *user_data)
+{
+    GHashTable *received = user_data;
+
+    g_hash_table_replace (received, g_strdup (bt->block_id), bt->cb_data.buf);
+    bt->cb_data.buf = NULL;
+}
+
+typedef struct DirectPeerData {
+    HttpTxTask *task;
+    GHashTable *received;
+} DirectPeerData;
+
+static int
+direct_peer_block_received (const char *block_id, const void *buf, int len,
+                            void *user_data)
+{
+    DirectPeerData *data = user_data;
+    GByteArray *copy = g_byte_array_sized_new (len);
+
+    g_byte_array_append (copy, buf, len);
+    g_hash_table_replace (data->received, g_strdup (block_id), copy);
+
+    pthread_mutex_lock (&data->task->ref_cnt_lock);
+    data->task->done_download += len;
+    pthread_mutex_unlock (&data->task->ref_cnt_lock);
+
+    return 0;
+}
+
+static int
+write_received_block (HttpTxTask *task, const char *block_id,
+                      GByteArray *buf, int fd, SeafileCrypt *crypt)
+{
+    char *out = (char *)buf->data;
+    int out_len = buf->len;
+
+    if (crypt) {
+        if (buf->len % ENCRYPT_BLK_SIZE != 0) {
+            seaf_warning ("Invalid encrypted block %s in repo %.8s.\n",
+                          block_id, task->repo_id);
+            task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+            return -1;
+        }
+        /* Decrypt in place, the plaintext is never longer. */
+        if (seafile_decrypt_buf (out, &out_len, out, buf->len, crypt) != 0) {
+            seaf_warning ("Failed to decrypt block %s in repo %.8s.\n",
+                          block_id, task->repo_id);
+            task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+            return -1;
+        }
+    }
+
+    if (out_len > 0 && writen_sparse (fd, out, out_len) != out_len) {
+        seaf_warning ("Failed to write block %s of repo %.8s: %s.\n",
+                      block_id, task->repo_id, strerror(errno));
+        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Count a reference to a block in the block store, like
+ * http_tx_task_download_file_blocks() does. Returns FALSE if the block
+ * isn't in the store. */
+static gboolean
+ref_local_block (HttpTxTask *task, const char *block_id)
+{
+    int *pcnt;
+    gboolean exists;
+
+    pthread_mutex_lock (&task->ref_cnt_lock);
+    exists = seaf_block_manager_block_exists (seaf->block_mgr,
+                                              task->repo_id, task->repo_version,
+                                              block_id) ||
+        link_shared_block (task, block_id);
+    if (exists) {
+        pcnt = g_hash_table_lookup (task->blk_ref_cnts, block_id);
+        if (!pcnt) {
+            pcnt = g_new0(int, 1);
+            g_hash_table_insert (task->blk_ref_cnts, g_strdup(block_id), pcnt);
+            seaf_block_manager_pin_block (seaf->block_mgr, task->repo_id,
+                                          task->repo_version, block_id);
+        }
+        *pcnt += 1;
+    }
+    pthread_mutex_unlock (&task->ref_cnt_lock);
+
+    return exists;
+}
+
+int
+http_tx_task_download_file_to_fd (HttpTxTask *task, const char *file_id,
+                                  int fd, SeafileCrypt *crypt, GList **refs)
+{
+    Seafile *file;
+    GHashTable *local, *received, *last_use;
+    DirectPeerData peer_data;
+    GList *needed;
+    GByteArray *buf;
+    char *block_id;
+    gboolean again;
+    int start, end, i;
+    int ret = 0;
+
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                        task->repo_id,
+                                        task->repo_version,
+                                        file_id);
+    if (!file) {
+        seaf_warning ("Failed to find seafile object %s in repo %.8s.\n",
+                      file_id, task->repo_id);
+        return -1;
+    }
+
+    /* Block id -> index of its last occurrence in the file. */
+    last_use = g_hash_table_new (g_str_hash, g_str_equal);
+    for (i = 0; i < file->n_blocks; ++i)
+        g_hash_table_replace (last_use, file->blk_sha1s[i], GINT_TO_POINTER(i));
+
+    local = g_hash_table_new (g_str_hash, g_str_equal);
+    received = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                      (GDestroyNotify)g_byte_array_unref);
+
+    for (start = 0; start < file->n_blocks && ret == 0; start = end) {
+        end = MIN (start + DIRECT_CHECKOUT_WINDOW, file->n_blocks);
+
+        needed = NULL;
+        for (i = start; i < end; ++i) {
+            block_id = file->blk_sha1s[i];
+            if (g_hash_table_contains (local, block_id) ||
+                g_hash_table_contains (received, block_id))
+                continue;
+            if (ref_local_block (task, block_id)) {
+                g_hash_table_add (local, block_id);
+                *refs = g_list_prepend (*refs, g_strdup (block_id));
+                continue;
+            }
+            if (!g_list_find_custom (needed, block_id, (GCompareFunc)strcmp))
+                needed = g_list_prepend (needed, block_id);
+        }
+
+        needed = g_list_reverse (needed);
+        peer_data.task = task;
+        peer_data.received = received;
+        needed = seaf_peer_block_manager_fetch_blocks (seaf->peer_block_mgr,
+                                                       task->repo_id, task->head,
+                                                       needed,
+                                                       direct_peer_block_received,
+                                                       &peer_data);
+        ret = transfer_blocks (task, needed, FALSE, TRUE,
+                               direct_block_received, received);
+        g_list_free (needed);
+        if (ret < 0 || task->state == HTTP_TASK_STATE_CANCELED) {
+            ret = -1;
+            break;
+        }
+
+        for (i = start; i < end; ++i) {
+            block_id = file->blk_sha1s[i];
+            buf = g_hash_table_lookup (received, block_id);
+            if (buf) {
+                again = (GPOINTER_TO_INT(g_hash_table_lookup (last_use,
+                                                              block_id)) > i);
+                /* Decrypting in place destroys the buffer, so decrypt a
+                 * copy if the block is needed again later in the file. */
+                if (again && crypt) {
+                    GByteArray *copy = g_byte_array_sized_new (buf->len);
+                    g_byte_array_append (copy, buf->data, buf->len);
+                    ret = write_received_block (task, block_id, copy, fd, crypt);
+                    g_byte_array_free (copy, TRUE);
+                } else {
+                    ret = write_received_block (task, block_id, buf, fd, crypt);
+                    if (!again)
+                        g_hash_table_remove (received, block_id);
+                }
+            } else if (seaf_fs_manager_checkout_block (task->repo_id,
+                                                       task->repo_version,
+                                                       block_id, fd,
+                                                       crypt) < 0) {
+                task->error = SYNC_ERROR_ID_LOCAL_DATA_CORRUPT;
+                ret = -1;
+            }
+            if (ret < 0)
+                break;
+        }
+    }
+
+    g_hash_table_destroy (received);
+    g_hash_table_destroy (local);
+    g_hash_table_destroy (last_use);
+    seafile_unref (file);
+
+    return ret;
+}
+
+/*
+ * Batched block download.
+ *
+ * The ids of up to MAX_BLOCK_PACK_IDS blocks are posted to pack-blocks/,
+ * and the server responds with the blocks in the format used by
+ * recv-fs/. The response is demultiplexed into block handles as it's
+ * received.
+ */
+
+#define MAX_BLOCK_PACK_IDS 256
+
+gboolean
+http_tx_task_block_packs_supported (HttpTxTask *task)
+{
+    ConnectionPool *pool = find_connection_pool (seaf->http_tx_mgr->priv,
+                                                 task->host);
+
+    return pool && pool->block_pack_supported;
+}
+
+typedef struct {
+    HttpTxTask *task;
+    ConnectionPool *pool;
+    CURL *curl;
+    GHashTable *wanted;
+    /* Header of the current block, filled as it's received. */
+    ObjectHeader hdr;
+    guint32 hdr_len;
+    char block_id[41];
+    guint32 remain;
+    BlockHandle *block;
+    int n_blocks;
+    gboolean error;
+} RecvBlockPackData;
+
+static int
+recv_block_pack_finish_block (RecvBlockPackData *data)
+{
+    HttpTxTask *task = data->task;
+    int ret = 0;
+
+    seaf_block_manager_close_block (seaf->block_mgr, data->block);
+
+    /* The same lock as for downloads of single blocks. The references
+     * are counted when the files are checked out. */
+    pthread_mutex_lock (&task->ref_cnt_lock);
+    if (!seaf_block_manager_block_exists (seaf->block_mgr,
+                                          task->repo_id, task->repo_version,
+                                          data->block_id) &&
+        seaf_block_manager_commit_block (seaf->block_mgr, data->block) < 0) {
+        seaf_warning ("Failed to commit block %s in repo %.8s.\n",
+                      data->block_id, task->repo_id);
+        ret = -1;
     }
-    g_hash_table_destroy (requested);
+    pthread_mutex_unlock (&task->ref_cnt_lock);
 
-out:
-    g_free (url);
-    g_free (data);
-    g_free (rsp_content);
-    curl_easy_reset (curl);
+    if (ret == 0)
+        seaf_block_manager_cache_add (seaf->block_mgr,
+                                      task->repo_id, task->repo_version,
+                                      data->block_id,
+                                      ntohl (data->hdr.obj_size));
+
+    seaf_block_manager_block_handle_free (seaf->block_mgr, data->block);
+    data->block = NULL;
+    ++data->n_blocks;
 
     return ret;
 }
 
-typedef struct {
-    char block_id[41];
-    BlockHandle *block;
-    HttpTxTask *task;
-} GetBlockData;
-
 static size_t
-get_block_callback (void *ptr, size_t size, size_t nmemb, void *userp)
+recv_block_pack_callback (void *ptr, size_t size, size_t nmemb, void *userp)
 {
-    size_t realsize = size *nmemb;
-    SendBlockData *data = userp;
+    size_t realsize = size * nmemb;
+    RecvBlockPackData *data = userp;
     HttpTxTask *task = data->task;
+    char *p = ptr, *end = p + realsize;
+    SendBlockData throttle;
+    gint64 delay;
+    long status;
     size_t n;
 
     if (task->state == HTTP_TASK_STATE_CANCELED || task->all_stop)
         return 0;
 
-    n = seaf_block_manager_write_block (seaf->block_mgr,
-                                        data->block,
-                                        ptr, realsize);
-    if (n < realsize) {
-        seaf_warning ("Failed to write block %s in repo %.8s.\n",
-                      data->block_id, task->repo_id);
-        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
-        return n;
-    }
+    /* Error responses are not block packs. */
+    if (curl_easy_getinfo (data->curl, CURLINFO_RESPONSE_CODE, &status) != CURLE_OK ||
+        status != HTTP_OK)
+        return realsize;
+
+    while (p < end) {
+        if (!data->block) {
+            n = MIN (end - p, sizeof(data->hdr) - data->hdr_len);
+            memcpy ((char *)&data->hdr + data->hdr_len, p, n);
+            data->hdr_len += n;
+            p += n;
+            if (data->hdr_len < sizeof(data->hdr))
+                break;
+
+            memcpy (data->block_id, data->hdr.obj_id, 40);
+            data->block_id[40] = 0;
+            data->remain = ntohl (data->hdr.obj_size);
+            data->hdr_len = 0;
+
+            if (!g_hash_table_lookup (data->wanted, data->block_id)) {
+                seaf_warning ("Unexpected block %s in block pack.\n", data->block_id);
+                goto error;
+            }
 
-    /* Update global transferred bytes. */
-    g_atomic_int_add (&(seaf->sync_mgr->recv_bytes), n);
+            data->block = seaf_block_manager_open_block (seaf->block_mgr,
+                                                         task->repo_id,
+                                                         task->repo_version,
+                                                         data->block_id,
+                                                         BLOCK_WRITE);
+            if (!data->block) {
+                seaf_warning ("Failed to open block %s in repo %.8s.\n",
+                              data->block_id, task->repo_id);
+                goto error;
+            }
+        }
 
-    /* Update transferred bytes for this task */
-    g_atomic_int_add (&task->tx_bytes, n);
+        n = MIN (end - p, data->remain);
+        if (n > 0 &&
+            seaf_block_manager_write_block (seaf->block_mgr, data->block,
+                                            p, n) < (int)n) {
+            seaf_warning ("Failed to write block %s in repo %.8s.\n",
+                          data->block_id, task->repo_id);
+            goto error;
+        }
+        p += n;
+        data->remain -= n;
 
-    /* If uploaded bytes exceeds the limit, wait until the counter
-     * is reset. We check the counter every 100 milliseconds, so we
-     * can waste up to 100 milliseconds without sending data after
-     * the counter is reset.
-     */
-    while (1) {
-        gint sent = g_atomic_int_get(&(seaf->sync_mgr->recv_bytes));
-        if (seaf->sync_mgr->download_limit > 0 &&
-            sent > seaf->sync_mgr->download_limit)
-            /* 100 milliseconds */
-            g_usleep (100000);
-        else
-            break;
+        if (data->remain == 0 && recv_block_pack_finish_block (data) < 0)
+            goto error;
     }
 
-    return n;
+    g_atomic_int_add (&(seaf->sync_mgr->recv_bytes), realsize);
+    g_atomic_int_add (&task->tx_bytes, realsize);
+
+    /* This request isn't driven by a multi handle and can't be paused,
+     * so wait here for the rate limits. */
+    memset (&throttle, 0, sizeof(throttle));
+    throttle.task = task;
+    throttle.pool = data->pool;
+    block_tx_throttle_consume (&throttle, FALSE, realsize);
+    delay = block_tx_throttle_delay (&throttle, FALSE);
+    if (delay > 0)
+        g_usleep (delay);
+
+    return realsize;
+
+error:
+    data->error = TRUE;
+    return 0;
 }
 
-int
-get_block (HttpTxTask *task, Connection *conn, const char *block_id)
+/* Returns 1 if the server doesn't support block packs. */
+static int
+recv_block_pack (HttpTxTask *task, Connection *conn, ConnectionPool *pool,
+                 GList *block_ids)
 {
-    CURL *curl;
-    char *url;
+    RecvBlockPackData data;
+    json_t *array;
+    char *req = NULL, *url = NULL;
+    GList *ptr;
     int status;
-    BlockHandle *block;
-    int ret = 0;
-    int *pcnt;
-
-    block = seaf_block_manager_open_block (seaf->block_mgr,
-                                           task->repo_id, task->repo_version,
-                                           block_id, BLOCK_WRITE);
-    if (!block) {
-        seaf_warning ("Failed to open block %s in repo %.8s.\n",
-                      block_id, task->repo_id);
-        return -1;
-    }
+    int curl_error;
+    gint64 start;
+    int rc, ret = 0;
 
-    GetBlockData data;
-    memcpy (data.block_id, block_id, 40);
-    data.block = block;
+    memset (&data, 0, sizeof(data));
     data.task = task;
+    data.pool = pool;
+    data.curl = conn->curl;
+    data.wanted = g_hash_table_new (g_str_hash, g_str_equal);
 
-    curl = conn->curl;
+    array = json_array ();
+    for (ptr = block_ids; ptr; ptr = ptr->next) {
+        json_array_append_new (array, json_string (ptr->data));
+        g_hash_table_insert (data.wanted, ptr->data, ptr->data);
+    }
+    req = json_dumps (array, 0);
+    json_decref (array);
 
     if (!task->use_fileserver_port)
-        url = g_strdup_printf ("%s/seafhttp/repo/%s/block/%s",
-                               task->host, task->repo_id, block_id);
+        url = g_strdup_printf ("%s/seafhttp/repo/%s/pack-blocks/",
+                               task->host, task->repo_id);
     else
-        url = g_strdup_printf ("%s/repo/%s/block/%s",
-                               task->host, task->repo_id, block_id);
+        url = g_strdup_printf ("%s/repo/%s/pack-blocks/",
+                               task->host, task->repo_id);
 
-    int curl_error;
-    if (http_get (curl, url, task->token, &status, NULL, NULL,
-                  get_block_callback, &data, TRUE, &curl_error) < 0) {
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto error;
+    /* http_post() keeps the write callback when no response is wanted. */
+    curl_easy_setopt (conn->curl, CURLOPT_WRITEFUNCTION, recv_block_pack_callback);
+    curl_easy_setopt (conn->curl, CURLOPT_WRITEDATA, &data);
 
-        if (task->error == SYNC_ERROR_ID_NO_ERROR) {
-            /* Only release the connection when it's a network error. */
+    seaf_debug ("Fetching %d blocks in a pack for %s:%s.\n",
+                g_list_length (block_ids), task->host, task->repo_id);
+
+    start = seaf_trace_begin ();
+    rc = http_post (conn->curl, url, task->token, req, strlen(req),
+                    &status, NULL, NULL, TRUE, &curl_error);
+    seaf_trace_end ("http", "recv_block_pack", start, NULL);
+    if (rc < 0) {
+        if (!data.error)
             conn->release = TRUE;
-            handle_curl_errors (task, curl_error);
-        }
         ret = -1;
-        goto error;
+        goto out;
     }
 
-    if (status != HTTP_OK) {
-        seaf_warning ("Bad response code for GET %s: %d.\n", url, status);
-        handle_http_errors (task, status);
-        ret = -1;
-        goto error;
+    if (status == HTTP_NOT_FOUND) {
+        seaf_message ("Server %s doesn't support block packs, "
+                      "downloading blocks one by one.\n", task->host);
+        pool->block_pack_supported = FALSE;
+        ret = 1;
+        goto out;
     }
 
-    BlockMetadata *bmd = seaf_block_manager_stat_block_by_handle(seaf->block_mgr, block);
-    if (bmd == NULL) {
-        seaf_warning ("Failed to get block %s meta data in repo %.8s.\n", block_id, task->repo_id);
+    if (status != HTTP_OK) {
+        seaf_warning ("Bad response code for POST %s: %d.\n", url, status);
         ret = -1;
-        goto error;
+        goto out;
     }
-    
-    seaf_block_manager_close_block (seaf->block_mgr, block);
 
-    pthread_mutex_lock (&task->ref_cnt_lock);
-
-    task->done_download += bmd->size;
-    g_free (bmd);    
-
-    /* Don't overwrite the block if other thread already downloaded it.
-     * Since we've locked ref_cnt_lock, we can be sure the block won't be removed.
-     */
-    if (!seaf_block_manager_block_exists (seaf->block_mgr,
-                                          task->repo_id, task->repo_version,
-                                          block_id) &&
-        seaf_block_manager_commit_block (seaf->block_mgr, block) < 0)
-    {
-        seaf_warning ("Failed to commit block %s in repo %.8s.\n",
-                      block_id, task->repo_id);
-        task->error = SYNC_ERROR_ID_WRITE_LOCAL_DATA;
-        ret = -1;
-    }
+    if (data.block || data.hdr_len > 0)
+        seaf_warning ("Block pack from %s was truncated.\n", url);
 
-    if (ret == 0) {
-        pcnt = g_hash_table_lookup (task->blk_ref_cnts, block_id);
-        if (!pcnt) {
-            pcnt = g_new0(int, 1);
-            g_hash_table_insert (task->blk_ref_cnts, g_strdup(block_id), pcnt);
-        }
-        *pcnt += 1;
+out:
+    if (data.block) {
+        seaf_block_manager_close_block (seaf->block_mgr, data.block);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, data.block);
     }
-
-    pthread_mutex_unlock (&task->ref_cnt_lock);
-
-    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
-
-    g_free (url);
-
-    return ret;
-
-error:
+    g_hash_table_destroy (data.wanted);
     g_free (url);
-
-    seaf_block_manager_close_block (seaf->block_mgr, block);
-    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
-
+    free (req);
+    curl_easy_reset (conn->curl);
     return ret;
 }
 
-int
-http_tx_task_download_file_blocks (HttpTxTask *task, const char *file_id)
+void
+http_tx_task_prefetch_file_blocks (HttpTxTask *task, GList *file_ids)
 {
-    Seafile *file;
     HttpTxPriv *priv = seaf->http_tx_mgr->priv;
     ConnectionPool *pool;
     Connection *conn;
-    int ret = 0;
-
-    file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
-                                        task->repo_id,
-                                        task->repo_version,
-                                        file_id);
-    if (!file) {
-        seaf_warning ("Failed to find seafile object %s in repo %.8s.\n",
-                      file_id, task->repo_id);
-        return -1;
-    }
+    GHashTable *added;
+    GList *needed = NULL, *batch, *ptr;
+    Seafile *file;
+    char *block_id;
+    int i, n, rc;
 
     pool = find_connection_pool (priv, task->host);
-    if (!pool) {
-        seaf_warning ("Failed to create connection pool for host %s.\n", task->host);
-        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
+    if (!pool || !pool->block_pack_supported)
+        return;
+
+    added = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (ptr = file_ids; ptr; ptr = ptr->next) {
+        file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                            task->repo_id,
+                                            task->repo_version,
+                                            ptr->data);
+        if (!file)
+            continue;
+
+        for (i = 0; i < file->n_blocks; ++i) {
+            block_id = file->blk_sha1s[i];
+            if (g_hash_table_lookup (added, block_id) ||
+                seaf_block_manager_block_exists (seaf->block_mgr,
+                                                 task->repo_id, task->repo_version,
+                                                 block_id))
+                continue;
+            block_id = g_strdup (block_id);
+            g_hash_table_insert (added, block_id, block_id);
+            needed = g_list_prepend (needed, block_id);
+        }
+
         seafile_unref (file);
-        return -1;
     }
 
+    if (!needed)
+        goto out;
+
     conn = connection_pool_get_connection (pool);
     if (!conn) {
         seaf_warning ("Failed to get connection to host %s.\n", task->host);
-        task->error = SYNC_ERROR_ID_NOT_ENOUGH_MEMORY;
-        seafile_unref (file);
-        return -1;
+        goto out;
     }
 
-    int i;
-    char *block_id;
-    int *pcnt;
-    for (i = 0; i < file->n_blocks; ++i) {
-        block_id = file->blk_sha1s[i];
-        pthread_mutex_lock (&task->ref_cnt_lock);
-        if (seaf_block_manager_block_exists (seaf->block_mgr,
-                                             task->repo_id, task->repo_version,
-                                             block_id)) {
-            BlockMetadata *bmd;
-            bmd = seaf_block_manager_stat_block (seaf->block_mgr,
-                                                 task->repo_id, task->repo_version,
-                                                 block_id);
-            if (bmd) {
-                pcnt = g_hash_table_lookup (task->blk_ref_cnts, block_id);
-                if (!pcnt) {
-                    pcnt = g_new0(int, 1);
-                    g_hash_table_insert (task->blk_ref_cnts, g_strdup(block_id), pcnt);
-                }
-                *pcnt += 1;
-                pthread_mutex_unlock (&task->ref_cnt_lock);
-                task->done_download += bmd->size;
-                g_free (bmd);
-                continue;
-            }
-        }
-        pthread_mutex_unlock (&task->ref_cnt_lock);
+    needed = g_list_reverse (needed);
+    ptr = needed;
+    while (ptr && task->state != HTTP_TASK_STATE_CANCELED && !task->all_stop) {
+        batch = NULL;
+        for (n = 0; ptr && n < MAX_BLOCK_PACK_IDS; ++n, ptr = ptr->next)
+            batch = g_list_prepend (batch, ptr->data);
+
+        rc = recv_block_pack (task, conn, pool, batch);
+        g_list_free (batch);
 
-        ret = get_block (task, conn, block_id);
-        if (ret < 0 || task->state == HTTP_TASK_STATE_CANCELED)
+        /* The remaining blocks are downloaded one by one later. */
+        if (rc != 0)
             break;
     }
 
     connection_pool_return_connection (pool, conn);
 
-    seafile_unref (file);
-
-    return ret;
+out:
+    g_list_free (needed);
+    g_hash_table_destroy (added);
 }
 
 static int
@@ -4910,6 +8322,9 @@ http_download_thread (void *vdata)
     ConnectionPool *pool;
     Connection *conn = NULL;
     GList *fs_id_list = NULL;
+    SyncFilter *filter = NULL;
+    gboolean filter_changed = FALSE;
+    gint64 start;
 
     pool = find_connection_pool (priv, task->host);
     if (!pool) {
@@ -4918,6 +8333,8 @@ http_download_thread (void *vdata)
         goto out;
     }
 
+    prewarm_block_connections (task);
+
     conn = connection_pool_get_connection (pool);
     if (!conn) {
         seaf_warning ("Failed to get connection to host %s.\n", task->host);
@@ -4950,28 +8367,60 @@ http_download_thread (void *vdata)
     if (task->state == HTTP_TASK_STATE_CANCELED)
         goto out;
 
+    filter = seaf_repo_manager_get_download_filter (seaf->repo_mgr,
+                                                    task->repo_id,
+                                                    task->is_clone,
+                                                    &filter_changed);
+
+    /* The fs objects of this head were all fetched by an interrupted
+     * download, no need to ask the server for the list again. The
+     * filter may have changed since then, so a filtered walk is always
+     * done; it only fetches what's missing. */
+    if (!filter && !filter_changed &&
+        tx_checkpoint_get_stage (priv->checkpoints, task->repo_id, task->type,
+                                 task->head) == TX_CHECKPOINT_FS_FETCHED)
+        goto fs_fetched;
+
     transition_state (task, task->state, HTTP_TASK_RT_STATE_FS);
 
+    if (filter || filter_changed) {
+        start = g_get_monotonic_time ();
+        if (get_filtered_fs_objects (task, filter, filter_changed) < 0) {
+            seaf_warning ("Failed to get fs objects for repo %.8s on server %s.\n",
+                          task->repo_id, task->host);
+            goto out;
+        }
+        latency_stats_record_since ("download.get_fs", start);
+        goto fs_done;
+    }
+
+    start = g_get_monotonic_time ();
     if (get_needed_fs_id_list (task, conn, &fs_id_list) < 0) {
         seaf_warning ("Failed to get fs id list for repo %.8s on server %s.\n",
                       task->repo_id, task->host);
         goto out;
     }
+    latency_stats_record_since ("download.fs_ids", start);
 
     if (task->state == HTTP_TASK_STATE_CANCELED)
         goto out;
 
-    while (fs_id_list != NULL) {
-        if (get_fs_objects (task, conn, &fs_id_list) < 0) {
-            seaf_warning ("Failed to get fs objects for repo %.8s on server %s.\n",
-                          task->repo_id, task->host);
-            goto out;
-        }
-
-        if (task->state == HTTP_TASK_STATE_CANCELED)
-            goto out;
+    start = g_get_monotonic_time ();
+    if (fs_id_list != NULL && get_fs_objects (task, &fs_id_list) < 0) {
+        seaf_warning ("Failed to get fs objects for repo %.8s on server %s.\n",
+                      task->repo_id, task->host);
+        goto out;
     }
+    latency_stats_record_since ("download.get_fs", start);
+
+fs_done:
+    if (task->state == HTTP_TASK_STATE_CANCELED)
+        goto out;
+
+    tx_checkpoint_set_stage (priv->checkpoints, task->repo_id, task->type,
+                             task->head, TX_CHECKPOINT_FS_FETCHED);
 
+fs_fetched:
     transition_state (task, task->state, HTTP_TASK_RT_STATE_BLOCK);
 
     /* Record download head commit id, so that we can resume download
@@ -5000,9 +8449,12 @@ http_download_thread (void *vdata)
 
     update_local_repo (task);
 
+    tx_checkpoint_clear (priv->checkpoints, task->repo_id, task->type);
+
 out:
     connection_pool_return_connection (pool, conn);
     string_list_free (fs_id_list);
+    sync_filter_unref (filter);
     return vdata;
 }
 
@@ -5031,6 +8483,48 @@ http_tx_manager_get_download_tasks (HttpTxManager *manager)
     return g_hash_table_get_values (manager->priv->download_tasks);
 }
 
+GList *
+http_tx_manager_get_pool_stats (HttpTxManager *manager)
+{
+    HttpTxPriv *priv = manager->priv;
+    GHashTableIter iter;
+    gpointer key, value;
+    ConnectionPool *pool;
+    HttpConnPoolStats *stats;
+    GList *ret = NULL;
+
+    pthread_mutex_lock (&priv->pools_lock);
+
+    g_hash_table_iter_init (&iter, priv->connection_pools);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        pool = value;
+        stats = g_new0 (HttpConnPoolStats, 1);
+        stats->host = g_strdup (pool->host);
+
+        pthread_mutex_lock (&pool->lock);
+        stats->n_conns = pool->n_conns;
+        stats->n_idle = g_queue_get_length (pool->queue);
+        stats->err_cnt = pool->err_cnt;
+        stats->n_errors = pool->n_errors;
+        pthread_mutex_unlock (&pool->lock);
+
+        ret = g_list_prepend (ret, stats);
+    }
+
+    pthread_mutex_unlock (&priv->pools_lock);
+
+    return ret;
+}
+
+void
+http_conn_pool_stats_free (HttpConnPoolStats *stats)
+{
+    if (!stats)
+        return;
+    g_free (stats->host);
+    g_free (stats);
+}
+
 HttpTxTask *
 http_tx_manager_find_task (HttpTxManager *manager, const char *repo_id)
 {
@@ -5073,6 +8567,13 @@ http_tx_manager_cancel_task (HttpTxManager *manager,
     transition_state (task, HTTP_TASK_STATE_CANCELED, task->runtime_state);
 }
 
+void
+http_tx_manager_remove_checkpoints (HttpTxManager *manager,
+                                    const char *repo_id)
+{
+    tx_checkpoint_remove_repo (manager->priv->checkpoints, repo_id);
+}
+
 int
 http_tx_task_get_rate (HttpTxTask *task)
 {
@@ -78,6 +78,10 @@ struct _HttpTxTask {
     GHashTable *blk_ref_cnts;
     pthread_mutex_t ref_cnt_lock;
 
+    /* Repos whose blocks can be linked instead of downloaded, see
+     * KEY_SHARE_BLOCKS_ACROSS_REPOS. */
+    GList *shared_block_stores;
+
     /* For clone fs object progress */
     int n_fs_objs;
     int done_fs_objs;
@@ -91,9 +95,37 @@ struct _HttpTxTask {
 
     gint tx_bytes;              /* bytes transferred in this second. */
     gint last_tx_bytes;         /* bytes transferred in the last second. */
+
+    /* Limit of block requests in flight, adapted to the network. */
+    struct _TxConcurrency *concurrency;
+
+    /* Rate limit of this repo in bytes per second, 0 if not limited. */
+    gint rate_limit;
+    struct _RateLimiter *limiter;
+
+    /* Set for large transfers. While interactive (non-bulk) tasks are
+     * transferring blocks, bulk tasks keep only one block in flight and get
+     * a smaller share of the global rate limit.
+     */
+    gboolean bulk;
+    /* Number of threads of this task transferring blocks. */
+    gint n_tx_threads;
+
+    /* Blocks sent since they were last marked as done in the upload
+     * checkpoint. */
+    GList *sent_blocks;
+    int n_sent_blocks;
+
+    /* Monotonic times the task and its current runtime state started,
+     * recorded in the latency stats. */
+    gint64 start_time;
+    gint64 rt_state_start;
 };
 typedef struct _HttpTxTask HttpTxTask;
 
+/* Tasks transferring more than this are bulk tasks. */
+#define BULK_TRANSFER_SIZE ((gint64)1 << 30) /* 1GB */
+
 HttpTxManager *
 http_tx_manager_new (struct _SeafileSession *seaf);
 
@@ -271,6 +303,49 @@ http_tx_manager_unlock_file (HttpTxManager *manager,
                              const char *repo_id,
                              const char *path);
 
+/*
+ * Synchronously upload one block, outside of an upload task. Used to
+ * stream new blocks to the server while a commit is being created.
+ */
+int
+http_tx_manager_put_block (HttpTxManager *manager,
+                           const char *host,
+                           gboolean use_fileserver_port,
+                           const char *token,
+                           const char *repo_id,
+                           const char *block_id,
+                           const char *buf,
+                           int len);
+
+/*
+ * Synchronously download one block, outside of a download task. Used to
+ * fill placeholder files when they are opened. The content is returned
+ * in @buf and should be freed by the caller.
+ */
+int
+http_tx_manager_get_block (HttpTxManager *manager,
+                           const char *host,
+                           gboolean use_fileserver_port,
+                           const char *token,
+                           const char *repo_id,
+                           const char *block_id,
+                           char **buf,
+                           gint64 *len);
+
+/*
+ * Synchronously download the fs objects @obj_ids, outside of a download
+ * task, and write them to the fs object store. Used to repair objects that
+ * are found corrupt. Returns the number of objects written.
+ */
+int
+http_tx_manager_get_fs_objects (HttpTxManager *manager,
+                                const char *host,
+                                gboolean use_fileserver_port,
+                                const char *token,
+                                const char *repo_id,
+                                int repo_version,
+                                GList *obj_ids);
+
 struct _HttpAPIGetResult {
     gboolean success;
     char *rsp_content;
@@ -301,12 +376,52 @@ http_tx_manager_get_head_commit_ids (HttpTxManager *manager,
 int
 http_tx_task_download_file_blocks (HttpTxTask *task, const char *file_id);
 
+/*
+ * Download the content of a file and append it to @fd, decrypted with
+ * @crypt if it's set. Blocks that aren't in the block store are written
+ * straight to @fd without being stored. The ids of the blocks read from
+ * the store are added to @refs, once each. They are referenced in
+ * blk_ref_cnts and have to be released after checkout, also on error.
+ */
+int
+http_tx_task_download_file_to_fd (HttpTxTask *task, const char *file_id,
+                                  int fd, struct SeafileCrypt *crypt,
+                                  GList **refs);
+
+/* Returns TRUE if the server of @task can send many blocks in one response. */
+gboolean
+http_tx_task_block_packs_supported (HttpTxTask *task);
+
+/*
+ * Download the missing blocks of the files in @file_ids (a list of file
+ * ids) in batched requests, before the files are checked out. This is
+ * just an optimization for many small files: blocks that aren't fetched
+ * here are downloaded by http_tx_task_download_file_blocks().
+ */
+void
+http_tx_task_prefetch_file_blocks (HttpTxTask *task, GList *file_ids);
+
 GList*
 http_tx_manager_get_upload_tasks (HttpTxManager *manager);
 
 GList*
 http_tx_manager_get_download_tasks (HttpTxManager *manager);
 
+typedef struct HttpConnPoolStats {
+    char *host;
+    int n_conns;                /* Connections in use or idle. */
+    int n_idle;
+    int err_cnt;                /* Failures since the last success. */
+    guint64 n_errors;           /* Failures since the pool was created. */
+} HttpConnPoolStats;
+
+/* Returns a list of HttpConnPoolStats, one for each server. */
+GList *
+http_tx_manager_get_pool_stats (HttpTxManager *manager);
+
+void
+http_conn_pool_stats_free (HttpConnPoolStats *stats);
+
 HttpTxTask *
 http_tx_manager_find_task (HttpTxManager *manager, const char *repo_id);
 
@@ -315,6 +430,11 @@ http_tx_manager_cancel_task (HttpTxManager *manager,
                              const char *repo_id,
                              int task_type);
 
+/* Forget the transfer checkpoints of a repo that is removed. */
+void
+http_tx_manager_remove_checkpoints (HttpTxManager *manager,
+                                    const char *repo_id);
+
 int
 http_tx_task_get_rate (HttpTxTask *task);
 
@@ -26,13 +26,22 @@ struct _SeafJobManager {
     SeafileSession  *session;
     GThreadPool     *thread_pool;
     int              next_job_id;
+
+    /* Finished jobs, handed from the worker threads to the main loop. One
+     * pipe for all jobs wakes up the main loop; it's only written when the
+     * main loop hasn't been woken up since the last drain.
+     */
+    GAsyncQueue     *done_jobs;
+    seaf_pipe_t      pipefd[2];
+    struct event    *done_event;
+    gint             wakeup_pending;
 };
 
 struct _SeafJob {
     SeafJobManager *manager;
 
     int             id;
-    seaf_pipe_t    pipefd[2];
+    int             priority;
 
     JobThreadFunc   thread_func;
     JobDoneCallback done_func;  /* called when the thread is done */
@@ -62,9 +71,13 @@ static void
 job_thread_wrapper (void *vdata, void *unused)
 {
     SeafJob *job = vdata;
+    SeafJobManager *mgr = job->manager;
    
     job->result = job->thread_func (job->data);
-    if (seaf_pipe_writen (job->pipefd[1], "a", 1) != 1) {
+
+    g_async_queue_push (mgr->done_jobs, job);
+    if (g_atomic_int_compare_and_exchange (&mgr->wakeup_pending, 0, 1) &&
+        seaf_pipe_writen (mgr->pipefd[1], "a", 1) != 1) {
         seaf_warning ("[Job Manager] write to pipe error: %s\n", strerror(errno));
     }
 }
@@ -72,34 +85,65 @@ job_thread_wrapper (void *vdata, void *unused)
 static void
 job_done_cb (evutil_socket_t fd, short event, void *vdata)
 {
-    SeafJob *job = vdata;
+    SeafJobManager *mgr = vdata;
+    SeafJob *job;
     char buf[1];
 
-    if (seaf_pipe_readn (job->pipefd[0], buf, 1) != 1) {
+    if (seaf_pipe_readn (mgr->pipefd[0], buf, 1) != 1) {
         seaf_warning ("[Job Manager] read pipe error: %s\n", strerror(errno));
     }
-    seaf_pipe_close (job->pipefd[0]);
-    seaf_pipe_close (job->pipefd[1]);
-    if (job->done_func) {
-        job->done_func (job->result);
-    }
 
-    seaf_job_free (job);
+    /* Clear the flag before draining, so that a job finished after the
+     * drain writes to the pipe again.
+     */
+    g_atomic_int_set (&mgr->wakeup_pending, 0);
+
+    while ((job = g_async_queue_try_pop (mgr->done_jobs)) != NULL) {
+        if (job->done_func) {
+            job->done_func (job->result);
+        }
+        seaf_job_free (job);
+    }
 }
 
-int
-job_thread_create (SeafJob *job)
+/* Higher priority first, then in the order the jobs were scheduled. */
+static gint
+compare_jobs (gconstpointer a, gconstpointer b, gpointer unused)
 {
-    SeafileSession *session = job->manager->session;
+    const SeafJob *job_a = a, *job_b = b;
 
-    if (seaf_pipe (job->pipefd) < 0) {
+    if (job_a->priority != job_b->priority)
+        return job_a->priority - job_b->priority;
+    return job_a->id - job_b->id;
+}
+
+static int
+start_done_event (SeafJobManager *mgr)
+{
+    if (seaf_pipe (mgr->pipefd) < 0) {
         seaf_warning ("[Job Manager] pipe error: %s\n", strerror(errno));
         return -1;
     }
 
-    g_thread_pool_push (job->manager->thread_pool, job, NULL);
+    mgr->done_event = event_new (mgr->session->ev_base, mgr->pipefd[0],
+                                 EV_READ | EV_PERSIST, job_done_cb, mgr);
+    event_add (mgr->done_event, NULL);
+
+    return 0;
+}
 
-    event_base_once (session->ev_base, job->pipefd[0], EV_READ, job_done_cb, job, NULL);
+int
+job_thread_create (SeafJob *job)
+{
+    SeafJobManager *mgr = job->manager;
+
+    /* The pipe is created on the first job, since seaf_pipe() has to be
+     * called in the main loop.
+     */
+    if (!mgr->done_event && start_done_event (mgr) < 0)
+        return -1;
+
+    g_thread_pool_push (mgr->thread_pool, job, NULL);
 
     return 0;
 }
@@ -116,6 +160,8 @@ seaf_job_manager_new (SeafileSession *session, int max_threads)
                                           max_threads,
                                           FALSE,
                                           NULL);
+    g_thread_pool_set_sort_function (mgr->thread_pool, compare_jobs, NULL);
+    mgr->done_jobs = g_async_queue_new ();
 
     return mgr;
 }
@@ -124,17 +170,25 @@ void
 seaf_job_manager_free (SeafJobManager *mgr)
 {
     g_thread_pool_free (mgr->thread_pool, TRUE, FALSE);
+    if (mgr->done_event) {
+        event_free (mgr->done_event);
+        seaf_pipe_close (mgr->pipefd[0]);
+        seaf_pipe_close (mgr->pipefd[1]);
+    }
+    g_async_queue_unref (mgr->done_jobs);
     g_free (mgr);
 }
 
 int
-seaf_job_manager_schedule_job (SeafJobManager *mgr,
-                               JobThreadFunc func,
-                               JobDoneCallback done_func,
-                               void *data)
+seaf_job_manager_schedule_job_with_priority (SeafJobManager *mgr,
+                                             int priority,
+                                             JobThreadFunc func,
+                                             JobDoneCallback done_func,
+                                             void *data)
 {
     SeafJob *job = seaf_job_new ();
     job->id = mgr->next_job_id++;
+    job->priority = priority;
     job->manager = mgr;
     job->thread_func = func;
     job->done_func = done_func;
@@ -147,3 +201,22 @@ seaf_job_manager_schedule_job (SeafJobManager *mgr,
 
     return 0;
 }
+
+int
+seaf_job_manager_schedule_job (SeafJobManager *mgr,
+                               JobThreadFunc func,
+                               JobDoneCallback done_func,
+                               void *data)
+{
+    return seaf_job_manager_schedule_job_with_priority (mgr, JOB_PRIORITY_NORMAL,
+                                                        func, done_func, data);
+}
+
+void
+seaf_job_manager_get_stats (SeafJobManager *mgr,
+                            int *n_queued, int *n_threads, int *n_done)
+{
+    *n_queued = (int)g_thread_pool_unprocessed (mgr->thread_pool);
+    *n_threads = (int)g_thread_pool_get_num_threads (mgr->thread_pool);
+    *n_done = MAX (g_async_queue_length (mgr->done_jobs), 0);
+}
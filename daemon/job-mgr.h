@@ -21,6 +21,17 @@ struct _SeafileSession;
 typedef void* (*JobThreadFunc)(void *data);
 typedef void (*JobDoneCallback)(void *result);
 
+/*
+  When all threads are busy, queued jobs are started in priority order.
+  Interactive jobs are short and someone waits for them, e.g. checks
+  with the server; bulk jobs are long transfers and cleanups.
+ */
+enum {
+    JOB_PRIORITY_INTERACTIVE = 0,
+    JOB_PRIORITY_NORMAL,
+    JOB_PRIORITY_BULK,
+};
+
 SeafJobManager *
 seaf_job_manager_new (struct _SeafileSession *session, int max_threads);
 
@@ -33,4 +44,20 @@ seaf_job_manager_schedule_job (struct _SeafJobManager *mgr,
                                JobDoneCallback done_func,
                                void *data);
 
+int
+seaf_job_manager_schedule_job_with_priority (struct _SeafJobManager *mgr,
+                                             int priority,
+                                             JobThreadFunc func,
+                                             JobDoneCallback done_func,
+                                             void *data);
+
+/*
+ * @n_queued: jobs waiting for a thread.
+ * @n_threads: threads running jobs.
+ * @n_done: finished jobs whose done callback hasn't been called yet.
+ */
+void
+seaf_job_manager_get_stats (struct _SeafJobManager *mgr,
+                            int *n_queued, int *n_threads, int *n_done);
+
 #endif
@@ -0,0 +1,257 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "latency-stats.h"
+#include "utils.h"
+#include "log.h"
+
+/* Values below 1 << SUB_BUCKET_BITS have a bucket each. Larger values
+ * have SUB_BUCKETS buckets per power of two. */
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+/* Up to 2^40 microseconds, about 12 days. */
+#define MAX_VALUE_BITS 40
+#define N_BUCKETS (SUB_BUCKETS + (MAX_VALUE_BITS - SUB_BUCKET_BITS) * SUB_BUCKETS)
+
+/* Requests to endpoints beyond this number are recorded as "http.other",
+ * so that unexpected urls don't create histograms without bound. */
+#define MAX_HTTP_HISTOGRAMS 64
+
+typedef struct Histogram {
+    guint32 buckets[N_BUCKETS];
+    guint64 count;
+    gint64 sum;
+    gint64 min;
+    gint64 max;
+} Histogram;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+/* name -> Histogram. Protected by stats_lock. */
+static GHashTable *histograms;
+static int n_http_histograms;
+
+static int
+bit_length (guint64 v)
+{
+    int n = 0;
+
+    while (v) {
+        ++n;
+        v >>= 1;
+    }
+    return n;
+}
+
+static int
+value_to_bucket (gint64 value)
+{
+    int shift;
+
+    if (value < SUB_BUCKETS)
+        return (int)MAX (value, 0);
+
+    shift = bit_length ((guint64)value) - 1 - SUB_BUCKET_BITS;
+    if (shift >= MAX_VALUE_BITS - SUB_BUCKET_BITS)
+        return N_BUCKETS - 1;
+
+    return SUB_BUCKETS + shift * SUB_BUCKETS +
+        (int)((value >> shift) - SUB_BUCKETS);
+}
+
+/* The largest value that falls into @bucket. */
+static gint64
+bucket_to_value (int bucket)
+{
+    int shift, sub;
+
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+    sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+
+    return ((gint64)(SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/* Called with stats_lock held. */
+static Histogram *
+get_histogram (const char *name, gboolean is_http)
+{
+    Histogram *h;
+
+    if (!histograms)
+        histograms = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, g_free);
+
+    h = g_hash_table_lookup (histograms, name);
+    if (h)
+        return h;
+
+    if (is_http) {
+        if (n_http_histograms >= MAX_HTTP_HISTOGRAMS)
+            return get_histogram ("http.other", FALSE);
+        ++n_http_histograms;
+    }
+
+    h = g_new0 (Histogram, 1);
+    h->min = G_MAXINT64;
+    g_hash_table_insert (histograms, g_strdup (name), h);
+
+    return h;
+}
+
+static void
+record (const char *name, gboolean is_http, gint64 usec)
+{
+    Histogram *h;
+
+    if (usec < 0)
+        usec = 0;
+
+    pthread_mutex_lock (&stats_lock);
+
+    h = get_histogram (name, is_http);
+    ++(h->buckets[value_to_bucket (usec)]);
+    ++(h->count);
+    h->sum += usec;
+    if (usec < h->min)
+        h->min = usec;
+    if (usec > h->max)
+        h->max = usec;
+
+    pthread_mutex_unlock (&stats_lock);
+}
+
+void
+latency_stats_record (const char *name, gint64 usec)
+{
+    record (name, FALSE, usec);
+}
+
+void
+latency_stats_record_since (const char *name, gint64 start)
+{
+    record (name, FALSE, g_get_monotonic_time () - start);
+}
+
+static gboolean
+is_id_segment (const char *seg, int len)
+{
+    char buf[41];
+
+    if (len == 36) {
+        memcpy (buf, seg, 36);
+        buf[36] = 0;
+        return is_uuid_valid (buf);
+    }
+
+    if (len == 40) {
+        memcpy (buf, seg, 40);
+        buf[40] = 0;
+        return is_object_id_valid (buf);
+    }
+
+    return FALSE;
+}
+
+/* "https://host/seafhttp/repo/<repo_id>/block/<block_id>?x=1" ->
+ * "http./seafhttp/repo/:id/block/:id" */
+static char *
+http_histogram_name (const char *url)
+{
+    GString *name = g_string_new ("http.");
+    const char *p, *end, *seg;
+
+    p = strstr (url, "://");
+    p = p ? p + 3 : url;
+    p = strchr (p, '/');
+    if (!p)
+        return g_string_free (name, FALSE);
+
+    end = p + strcspn (p, "?#");
+
+    while (p < end) {
+        /* p points to a '/'. */
+        seg = p + 1;
+        p = seg;
+        while (p < end && *p != '/')
+            ++p;
+
+        g_string_append_c (name, '/');
+        if (is_id_segment (seg, p - seg))
+            g_string_append (name, ":id");
+        else
+            g_string_append_len (name, seg, p - seg);
+    }
+
+    return g_string_free (name, FALSE);
+}
+
+void
+latency_stats_record_http (const char *url, gint64 start)
+{
+    gint64 usec = g_get_monotonic_time () - start;
+    char *name = http_histogram_name (url);
+
+    record (name, TRUE, usec);
+    g_free (name);
+}
+
+static gint64
+get_percentile (Histogram *h, double percentile)
+{
+    guint64 rank, seen = 0;
+    int i;
+
+    rank = (guint64)(percentile * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    for (i = 0; i < N_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            return MIN (bucket_to_value (i), h->max);
+    }
+
+    return h->max;
+}
+
+json_t *
+latency_stats_to_json ()
+{
+    json_t *object = json_object ();
+    json_t *stats;
+    GHashTableIter iter;
+    gpointer key, value;
+    Histogram *h;
+
+    pthread_mutex_lock (&stats_lock);
+
+    if (!histograms)
+        goto out;
+
+    g_hash_table_iter_init (&iter, histograms);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        h = value;
+        if (h->count == 0)
+            continue;
+
+        stats = json_object ();
+        json_object_set_new (stats, "count", json_integer (h->count));
+        json_object_set_new (stats, "min", json_integer (h->min));
+        json_object_set_new (stats, "max", json_integer (h->max));
+        json_object_set_new (stats, "mean", json_integer (h->sum / h->count));
+        json_object_set_new (stats, "p50", json_integer (get_percentile (h, 0.5)));
+        json_object_set_new (stats, "p90", json_integer (get_percentile (h, 0.9)));
+        json_object_set_new (stats, "p99", json_integer (get_percentile (h, 0.99)));
+        json_object_set_new (stats, "p999", json_integer (get_percentile (h, 0.999)));
+        json_object_set_new (object, (const char *)key, stats);
+    }
+
+out:
+    pthread_mutex_unlock (&stats_lock);
+    return object;
+}
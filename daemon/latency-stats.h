@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_LATENCY_STATS_H
+#define SEAF_LATENCY_STATS_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Latency histograms of the sync stages and of the http requests to the
+ * server, kept since the daemon started.
+ *
+ * Each histogram has 16 buckets per power of two, so a percentile is off
+ * by at most 1/16 of its value. Histograms are created by name when the
+ * first value is recorded. Names are like "sync.commit", "upload.fs" or
+ * "http./repo/:id/commit/HEAD".
+ */
+
+/* Record @usec microseconds for the histogram @name. */
+void
+latency_stats_record (const char *name, gint64 usec);
+
+/* Record the time since @start, as returned by g_get_monotonic_time(). */
+void
+latency_stats_record_since (const char *name, gint64 start);
+
+/*
+ * Record an http request to @url. Repo and object ids in the path are
+ * replaced by ":id", and the query string is removed, so requests to the
+ * same endpoint share a histogram.
+ */
+void
+latency_stats_record_http (const char *url, gint64 start);
+
+/*
+ * Returns an object that maps histogram names to their count, min, max,
+ * mean and percentiles, in microseconds.
+ */
+json_t *
+latency_stats_to_json ();
+
+#endif
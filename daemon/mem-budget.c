@@ -0,0 +1,80 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "mem-budget.h"
+#include "log.h"
+
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static MemBudgetStats budget;
+
+void
+mem_budget_set_limit (gint64 limit)
+{
+    pthread_mutex_lock (&budget_lock);
+    budget.limit = (limit > 0) ? limit : 0;
+    pthread_mutex_unlock (&budget_lock);
+
+    if (limit > 0)
+        seaf_message ("Memory budget of sync tasks is %" G_GINT64_FORMAT " MB.\n",
+                      limit >> 20);
+}
+
+gboolean
+mem_budget_reserve (gint64 bytes)
+{
+    gboolean ret = TRUE;
+
+    pthread_mutex_lock (&budget_lock);
+    budget.used += bytes;
+    if (budget.used > budget.peak)
+        budget.peak = budget.used;
+    if (budget.limit > 0 && budget.used > budget.limit) {
+        ++budget.n_over;
+        ret = FALSE;
+    }
+    pthread_mutex_unlock (&budget_lock);
+
+    return ret;
+}
+
+void
+mem_budget_release (gint64 bytes)
+{
+    pthread_mutex_lock (&budget_lock);
+    budget.used -= bytes;
+    if (budget.used < 0) {
+        seaf_warning ("Released more memory than reserved.\n");
+        budget.used = 0;
+    }
+    pthread_mutex_unlock (&budget_lock);
+}
+
+gint64
+mem_budget_batch_size (gint64 max, gint64 min)
+{
+    gint64 limit, used, size;
+
+    pthread_mutex_lock (&budget_lock);
+    limit = budget.limit;
+    used = budget.used;
+    pthread_mutex_unlock (&budget_lock);
+
+    if (limit <= 0 || used <= limit / 2)
+        return max;
+    if (used >= limit)
+        return min;
+
+    size = (gint64)((double)max * (limit - used) / (limit - limit / 2));
+    return CLAMP (size, min, max);
+}
+
+void
+mem_budget_get_stats (MemBudgetStats *stats)
+{
+    pthread_mutex_lock (&budget_lock);
+    *stats = budget;
+    pthread_mutex_unlock (&budget_lock);
+}
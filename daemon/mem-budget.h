@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_MEM_BUDGET_H
+#define SEAF_MEM_BUDGET_H
+
+#include <glib.h>
+
+/*
+ * Process-wide memory budget of the sync tasks.
+ *
+ * The large buffers of syncing (diff results, fs objects waiting to be
+ * written, object and block packs) are reserved from one budget, set
+ * with "memory_budget" in MB. As the budget runs out, the tasks use
+ * smaller batches instead of growing the daemon's memory with the number
+ * of tasks running at once.
+ *
+ * Reservations are accounting only. They never fail or wait, since a
+ * task has to make progress with whatever it holds. With no budget set,
+ * usage is still tracked for the metrics.
+ */
+
+typedef struct MemBudgetStats {
+    gint64 limit;               /* 0 if unlimited */
+    gint64 used;
+    gint64 peak;
+    /* Reservations that took the usage over the limit. */
+    gint64 n_over;
+} MemBudgetStats;
+
+/* @limit in bytes, 0 or less for unlimited. */
+void
+mem_budget_set_limit (gint64 limit);
+
+/* Returns FALSE if the usage is over the limit after reserving @bytes. */
+gboolean
+mem_budget_reserve (gint64 bytes);
+
+void
+mem_budget_release (gint64 bytes);
+
+/*
+ * Size for a batch of at most @max bytes. It's @max while at most half of
+ * the budget is used, then shrinks linearly down to @min when it's all
+ * used.
+ */
+gint64
+mem_budget_batch_size (gint64 max, gint64 min);
+
+void
+mem_budget_get_stats (MemBudgetStats *stats);
+
+#endif
@@ -0,0 +1,265 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <stdarg.h>
+
+#include "seafile-session.h"
+#include "obj-store.h"
+#include "job-mgr.h"
+#include "wt-monitor.h"
+#include "mem-budget.h"
+#include "metrics.h"
+
+static void
+write_family (GString *buf, const char *name, const char *type, const char *help)
+{
+    g_string_append_printf (buf, "# TYPE %s %s\n", name, type);
+    g_string_append_printf (buf, "# HELP %s %s\n", name, help);
+}
+
+/* Label values may contain '\', '"' and newlines, which must be escaped. */
+static void
+append_label_value (GString *buf, const char *value)
+{
+    const char *p;
+
+    for (p = value; *p; ++p) {
+        if (*p == '\\' || *p == '"')
+            g_string_append_c (buf, '\\');
+        if (*p == '\n') {
+            g_string_append (buf, "\\n");
+            continue;
+        }
+        g_string_append_c (buf, *p);
+    }
+}
+
+/*
+ * @value is followed by a NULL-terminated list of label names and values,
+ * e.g. "repo_id", id, "type", "upload", NULL.
+ */
+static void
+write_sample (GString *buf, const char *name, gint64 value, ...)
+{
+    va_list args;
+    const char *label, *label_value;
+    gboolean first = TRUE;
+
+    g_string_append (buf, name);
+
+    va_start (args, value);
+    while ((label = va_arg (args, const char *)) != NULL) {
+        label_value = va_arg (args, const char *);
+        g_string_append_printf (buf, "%s%s=\"", first ? "{" : ",", label);
+        append_label_value (buf, label_value ? label_value : "");
+        g_string_append_c (buf, '"');
+        first = FALSE;
+    }
+    va_end (args);
+
+    if (!first)
+        g_string_append_c (buf, '}');
+    g_string_append_printf (buf, " %" G_GINT64_FORMAT "\n", value);
+}
+
+static void
+write_transfer_metrics (GString *buf)
+{
+    SeafSyncManager *sync_mgr = seaf->sync_mgr;
+    GList *tasks, *ptr;
+    HttpTxTask *task;
+    const char *type;
+
+    write_family (buf, "seafile_sent_bytes", "counter",
+                  "Bytes uploaded to servers.");
+    write_sample (buf, "seafile_sent_bytes_total", sync_mgr->total_sent_bytes, NULL);
+    write_family (buf, "seafile_recv_bytes", "counter",
+                  "Bytes downloaded from servers.");
+    write_sample (buf, "seafile_recv_bytes_total", sync_mgr->total_recv_bytes, NULL);
+
+    write_family (buf, "seafile_upload_rate_bytes", "gauge",
+                  "Bytes uploaded in the last second.");
+    write_sample (buf, "seafile_upload_rate_bytes", sync_mgr->last_sent_bytes, NULL);
+    write_family (buf, "seafile_download_rate_bytes", "gauge",
+                  "Bytes downloaded in the last second.");
+    write_sample (buf, "seafile_download_rate_bytes", sync_mgr->last_recv_bytes, NULL);
+
+    write_family (buf, "seafile_task_rate_bytes", "gauge",
+                  "Bytes transferred by a task in the last second.");
+    tasks = g_list_concat (http_tx_manager_get_upload_tasks (seaf->http_tx_mgr),
+                           http_tx_manager_get_download_tasks (seaf->http_tx_mgr));
+    for (ptr = tasks; ptr; ptr = ptr->next) {
+        task = ptr->data;
+        if (task->state != HTTP_TASK_STATE_NORMAL)
+            continue;
+        type = (task->type == HTTP_TASK_TYPE_UPLOAD) ? "upload" : "download";
+        write_sample (buf, "seafile_task_rate_bytes", task->last_tx_bytes,
+                      "repo_id", task->repo_id, "type", type, NULL);
+    }
+    g_list_free (tasks);
+}
+
+static void
+write_connection_metrics (GString *buf)
+{
+    GList *pools, *ptr;
+    HttpConnPoolStats *stats;
+
+    pools = http_tx_manager_get_pool_stats (seaf->http_tx_mgr);
+
+    write_family (buf, "seafile_http_connections", "gauge",
+                  "Http connections to a server, in use or idle.");
+    for (ptr = pools; ptr; ptr = ptr->next) {
+        stats = ptr->data;
+        write_sample (buf, "seafile_http_connections", stats->n_conns,
+                      "host", stats->host, NULL);
+    }
+
+    write_family (buf, "seafile_http_idle_connections", "gauge",
+                  "Idle http connections to a server.");
+    for (ptr = pools; ptr; ptr = ptr->next) {
+        stats = ptr->data;
+        write_sample (buf, "seafile_http_idle_connections", stats->n_idle,
+                      "host", stats->host, NULL);
+    }
+
+    write_family (buf, "seafile_http_connection_errors", "counter",
+                  "Failed http connections to a server.");
+    for (ptr = pools; ptr; ptr = ptr->next) {
+        stats = ptr->data;
+        write_sample (buf, "seafile_http_connection_errors_total",
+                      (gint64)stats->n_errors, "host", stats->host, NULL);
+    }
+
+    write_family (buf, "seafile_http_consecutive_errors", "gauge",
+                  "Failed http connections to a server since the last success.");
+    for (ptr = pools; ptr; ptr = ptr->next) {
+        stats = ptr->data;
+        write_sample (buf, "seafile_http_consecutive_errors", stats->err_cnt,
+                      "host", stats->host, NULL);
+    }
+
+    g_list_free_full (pools, (GDestroyNotify)http_conn_pool_stats_free);
+}
+
+static void
+write_job_metrics (GString *buf)
+{
+    int n_queued, n_threads, n_done;
+
+    seaf_job_manager_get_stats (seaf->job_mgr, &n_queued, &n_threads, &n_done);
+
+    write_family (buf, "seafile_jobs_queued", "gauge",
+                  "Jobs waiting for a thread.");
+    write_sample (buf, "seafile_jobs_queued", n_queued, NULL);
+    write_family (buf, "seafile_job_threads", "gauge",
+                  "Threads running jobs.");
+    write_sample (buf, "seafile_job_threads", n_threads, NULL);
+    write_family (buf, "seafile_jobs_done_pending", "gauge",
+                  "Finished jobs waiting for the main loop.");
+    write_sample (buf, "seafile_jobs_done_pending", n_done, NULL);
+}
+
+static void
+write_worktree_metrics (GString *buf)
+{
+    GList *repos, *ptr;
+    SeafRepo *repo;
+    WTStatus *status;
+    GString *active = g_string_new (NULL);
+    int n_events, n_active_paths;
+
+    write_family (buf, "seafile_worktree_events", "gauge",
+                  "Worktree events of a repo waiting to be committed.");
+    write_family (active, "seafile_worktree_active_paths", "gauge",
+                  "Updated paths of a repo waiting to be committed.");
+
+    repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1);
+    for (ptr = repos; ptr; ptr = ptr->next) {
+        repo = ptr->data;
+        status = seaf_wt_monitor_get_worktree_status (seaf->wt_monitor, repo->id);
+        if (!status)
+            continue;
+
+        wt_status_get_queue_lengths (status, &n_events, &n_active_paths);
+        write_sample (buf, "seafile_worktree_events", n_events,
+                      "repo_id", repo->id, NULL);
+        write_sample (active, "seafile_worktree_active_paths", n_active_paths,
+                      "repo_id", repo->id, NULL);
+
+        wt_status_unref (status);
+    }
+    g_list_free (repos);
+
+    /* Samples of one family must be written together. */
+    g_string_append (buf, active->str);
+    g_string_free (active, TRUE);
+}
+
+static void
+write_obj_store_metrics (GString *buf)
+{
+    SeafObjStoreStats commits, fs;
+
+    seaf_obj_store_get_stats (seaf->commit_mgr->obj_store, &commits);
+    seaf_obj_store_get_stats (seaf->fs_mgr->obj_store, &fs);
+
+    write_family (buf, "seafile_obj_reads", "counter",
+                  "Objects read from the object store.");
+    write_sample (buf, "seafile_obj_reads_total", commits.reads, "type", "commits", NULL);
+    write_sample (buf, "seafile_obj_reads_total", fs.reads, "type", "fs", NULL);
+
+    write_family (buf, "seafile_obj_writes", "counter",
+                  "Objects written to the object store.");
+    write_sample (buf, "seafile_obj_writes_total", commits.writes, "type", "commits", NULL);
+    write_sample (buf, "seafile_obj_writes_total", fs.writes, "type", "fs", NULL);
+
+    write_family (buf, "seafile_obj_read_errors", "counter",
+                  "Failed object reads.");
+    write_sample (buf, "seafile_obj_read_errors_total", commits.read_errors, "type", "commits", NULL);
+    write_sample (buf, "seafile_obj_read_errors_total", fs.read_errors, "type", "fs", NULL);
+
+    write_family (buf, "seafile_obj_write_errors", "counter",
+                  "Failed object writes.");
+    write_sample (buf, "seafile_obj_write_errors_total", commits.write_errors, "type", "commits", NULL);
+    write_sample (buf, "seafile_obj_write_errors_total", fs.write_errors, "type", "fs", NULL);
+}
+
+static void
+write_mem_budget_metrics (GString *buf)
+{
+    MemBudgetStats stats;
+
+    mem_budget_get_stats (&stats);
+
+    write_family (buf, "seafile_memory_budget_bytes", "gauge",
+                  "Memory budget of the sync tasks, 0 if unlimited.");
+    write_sample (buf, "seafile_memory_budget_bytes", stats.limit, NULL);
+    write_family (buf, "seafile_memory_reserved_bytes", "gauge",
+                  "Memory reserved by the sync tasks.");
+    write_sample (buf, "seafile_memory_reserved_bytes", stats.used, NULL);
+    write_family (buf, "seafile_memory_reserved_peak_bytes", "gauge",
+                  "Most memory reserved by the sync tasks at once.");
+    write_sample (buf, "seafile_memory_reserved_peak_bytes", stats.peak, NULL);
+    write_family (buf, "seafile_memory_over_budget", "counter",
+                  "Reservations that went over the memory budget.");
+    write_sample (buf, "seafile_memory_over_budget_total", stats.n_over, NULL);
+}
+
+char *
+seaf_metrics_format ()
+{
+    GString *buf = g_string_new (NULL);
+
+    write_transfer_metrics (buf);
+    write_connection_metrics (buf);
+    write_job_metrics (buf);
+    write_worktree_metrics (buf);
+    write_obj_store_metrics (buf);
+    write_mem_budget_metrics (buf);
+
+    g_string_append (buf, "# EOF\n");
+
+    return g_string_free (buf, FALSE);
+}
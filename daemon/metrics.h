@@ -0,0 +1,14 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_METRICS_H
+#define SEAF_METRICS_H
+
+/*
+ * Counters and gauges of the daemon, formatted in the OpenMetrics text
+ * format, so that they can be scraped by Prometheus compatible monitoring.
+ * The text ends with "# EOF".
+ */
+char *
+seaf_metrics_format ();
+
+#endif
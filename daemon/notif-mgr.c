@@ -14,26 +14,46 @@
 
 #define NOTIF_PORT 8083
 
-#define RECONNECT_INTERVAL 60 /* 60s */
+/* Max number of servers connected at the same time. */
+#define MAX_NOTIF_SERVERS 32
+
+/* Max number of repos in one subscribe or unsubscribe message. */
+#define SUBSCRIBE_BATCH_SIZE 200
 
 #define STATUS_DISCONNECTED 0
 #define STATUS_CONNECTED    1
 #define STATUS_ERROR        2
-#define STATUS_CANCELLED    3
 
+/*
+ * All the notification servers share one lws context, served by one
+ * thread. Connecting and reconnecting are scheduled with lws timers on
+ * that thread; see schedule_reconnect().
+ */
 typedef struct NotifServer {
-    struct lws_context *context;
     struct lws_client_connect_info i;
     struct lws		*wsi;
 
     // status of the notification server.
     int      status;
-    // whether to close the connection to the server.
-    gboolean close;
+
+    /* Timer of the next connection attempt, and the number of failed
+     * attempts since the last successful connection. Only used by the
+     * service thread. */
+    lws_sorted_usec_list_t sul;
+    uint16_t retry_count;
 
     GHashTable *subscriptions;
+    /* Subscribe and unsubscribe requests that haven't been sent yet,
+     * repo_id -> jwt token (or NULL). They're sent in batches when the
+     * connection becomes writeable. Protected by sub_lock.
+     */
+    GHashTable *pending_subs;
+    GHashTable *pending_unsubs;
+    /* Subscribed repos whose subscribe request has been written to the
+     * server. Protected by sub_lock.
+     */
+    GHashTable *sent_subs;
     pthread_mutex_t sub_lock;
-    GAsyncQueue *messages;
 
     gboolean use_ssl;
     char    *server_url;
@@ -47,6 +67,17 @@ typedef struct NotifServer {
 struct _SeafNotifManagerPriv {
     pthread_mutex_t server_lock;
     GHashTable *servers;
+    /* Servers added but not connected yet, taken by the service thread.
+     * Protected by server_lock. */
+    GList *new_servers;
+
+    struct lws_context *context;
+
+    /* Latest head commit notified for each repo, repo_id -> commit_id.
+     * Filled by the notification threads and taken by the sync manager.
+     */
+    pthread_mutex_t update_lock;
+    GHashTable *repo_updates;
 };
 
 // The Message structure is used to send messages to the server.
@@ -54,6 +85,8 @@ typedef struct Message {
     void    *payload;
     size_t  len;
     int     type;
+    /* Repos carried by a subscribe message. */
+    GList   *sub_ids;
 } Message;
 
 static Message*
@@ -83,6 +116,7 @@ notif_message_free (Message *msg)
     if (!msg)
         return;
     g_free (msg->payload);
+    g_list_free_full (msg->sub_ids, g_free);
     g_free (msg);
 }
 
@@ -96,6 +130,9 @@ seaf_notif_manager_new (SeafileSession *seaf)
     pthread_mutex_init (&mgr->priv->server_lock, NULL);
     mgr->priv->servers = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                 g_free, NULL);
+    pthread_mutex_init (&mgr->priv->update_lock, NULL);
+    mgr->priv->repo_updates = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, g_free);
 
     return mgr;
 }
@@ -157,14 +194,10 @@ parse_notification_url (const char *url)
 static void
 notif_server_ref (NotifServer *server);
 
-static struct lws_context *
-lws_context_new (int port);
-
 static NotifServer*
 notif_new_server (const char *server_url, gboolean use_notif_server_port)
 {
     NotifServer *server = NULL;
-    static struct lws_context *context;
     URI *uri = NULL;
     int port = NOTIF_PORT;
     gboolean use_ssl = FALSE;
@@ -184,22 +217,9 @@ notif_new_server (const char *server_url, gboolean use_notif_server_port)
     if (strncmp(server_url, "https", 5) == 0) {
         use_ssl = TRUE;
     }
-    
-
-    context = lws_context_new (use_ssl);
-    if (!context) {
-        g_free (uri->scheme);
-        g_free (uri->host);
-        g_free (uri);
-        seaf_warning ("failed to create libwebsockets context\n");
-        return NULL;
-    }
 
     server = g_new0 (NotifServer, 1);
 
-    server->messages = g_async_queue_new ();
-
-    server->context = context;
     server->server_url = g_strdup (server_url);
     server->addr = g_strdup (uri->host);
     server->use_ssl = use_ssl;
@@ -212,6 +232,12 @@ notif_new_server (const char *server_url, gboolean use_notif_server_port)
     pthread_mutex_init (&server->sub_lock, NULL);
     server->subscriptions = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                    g_free, NULL);
+    server->pending_subs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+    server->pending_unsubs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, g_free);
+    server->sent_subs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
     notif_server_ref (server);
 
     g_free (uri->scheme);
@@ -240,24 +266,22 @@ get_notif_server (SeafNotifManager *mgr, const char *url)
 static void
 delete_subscribed_repos (NotifServer *server);
 
-static void
-delete_unsent_messages (NotifServer *server);
-
 static void
 notif_server_free (NotifServer *server)
 {
     if (!server)
         return;
-    if (server->context)
-        lws_context_destroy(server->context);
     g_free (server->server_url);
     g_free (server->addr);
     g_free (server->path);
     if (server->subscriptions)
         g_hash_table_destroy (server->subscriptions);
-
-    delete_unsent_messages (server);
-    g_async_queue_unref (server->messages);
+    if (server->pending_subs)
+        g_hash_table_destroy (server->pending_subs);
+    if (server->sent_subs)
+        g_hash_table_destroy (server->sent_subs);
+    if (server->pending_unsubs)
+        g_hash_table_destroy (server->pending_unsubs);
 
     g_free (server);
 }
@@ -278,10 +302,10 @@ notif_server_unref (NotifServer *server)
 }
 
 static void
-init_client_connect_info (NotifServer *server);
+init_client_connect_info (NotifServer *server, struct lws_context *context);
 
-static void *
-notification_worker (void *vdata);
+static int
+start_service_thread (SeafNotifManager *mgr);
 
 // This function will check whether the notification server has been created,
 // if not, it will create a new one, otherwise it will return directly.
@@ -289,62 +313,76 @@ notification_worker (void *vdata);
 void
 seaf_notif_manager_connect_server (SeafNotifManager *mgr, const char *host, gboolean use_notif_server_port)
 {
-    pthread_t tid;
-    int rc;
-    NotifServer *existing_server = NULL;
     NotifServer *server = NULL;
 
+    pthread_mutex_lock (&mgr->priv->server_lock);
+
     // Don't connect a connected server.
-    existing_server = get_notif_server (mgr, host);
-    if (existing_server) {
-        notif_server_unref (existing_server);
+    if (g_hash_table_lookup (mgr->priv->servers, host)) {
+        pthread_mutex_unlock (&mgr->priv->server_lock);
         return;
     }
 
-    server = notif_new_server (host, use_notif_server_port);
-    if (!server) {
+    if (g_hash_table_size (mgr->priv->servers) >= MAX_NOTIF_SERVERS) {
+        pthread_mutex_unlock (&mgr->priv->server_lock);
+        seaf_warning ("Too many notification servers, not connecting to %s.\n",
+                      host);
         return;
     }
 
-    init_client_connect_info (server);
+    if (!mgr->priv->context && start_service_thread (mgr) < 0) {
+        pthread_mutex_unlock (&mgr->priv->server_lock);
+        return;
+    }
 
-    rc = pthread_create (&tid, NULL, notification_worker, server);
-    if (rc != 0) {
-        seaf_warning ("Failed to create event notification new thread: %s.\n", strerror(rc));
-        notif_server_unref (server);
+    server = notif_new_server (host, use_notif_server_port);
+    if (!server) {
+        pthread_mutex_unlock (&mgr->priv->server_lock);
         return;
     }
 
-    pthread_mutex_lock (&mgr->priv->server_lock);
+    init_client_connect_info (server, mgr->priv->context);
+
     g_hash_table_insert (mgr->priv->servers, g_strdup (host), server);
-    pthread_mutex_unlock (&mgr->priv->server_lock);
+    notif_server_ref (server);
+    mgr->priv->new_servers = g_list_prepend (mgr->priv->new_servers, server);
 
-    return;
-}
+    pthread_mutex_unlock (&mgr->priv->server_lock);
 
-static void
-disconnect_server (NotifServer *server)
-{
-    // lws_cancel_service will produce a cancel event to break out of lws_service loop.
-    lws_cancel_service (server->context);
-    server->close = TRUE;
+    /* Wake up the service thread to connect the new server. */
+    lws_cancel_service (mgr->priv->context);
 }
 
 // This policy will send a ping packet to the server per second.
 // If we don't receive pong messages within 5 seconds, it is considered that the connection is unavailable.
-// We will exit the event loop, and reconnect to the notification server.
+// The connection is closed then, and we reconnect to the notification server.
 static const lws_retry_bo_t ping_policy = {
 	.secs_since_valid_ping		= 1,
 	.secs_since_valid_hangup	= 5,
 };
 
+/* Delays between reconnection attempts, in ms. The last one is repeated.
+ * The delays are randomized, so that the clients of a server that
+ * restarted don't all reconnect at the same moment.
+ */
+static const uint32_t reconnect_delays[] = {
+    5000, 15000, 30000, 60000, 120000, 300000
+};
+
+static const lws_retry_bo_t reconnect_policy = {
+    .retry_ms_table = reconnect_delays,
+    .retry_ms_table_count = LWS_ARRAY_SIZE(reconnect_delays),
+    .conceal_count = LWS_RETRY_CONCEAL_ALWAYS,
+    .jitter_percent = 20,
+};
+
 static void
-init_client_connect_info (NotifServer *server)
+init_client_connect_info (NotifServer *server, struct lws_context *context)
 {
     struct lws_client_connect_info *i = &server->i;
     memset(i, 0, sizeof(server->i));
 
-    i->context = server->context;
+    i->context = context;
     i->port = server->port;
     i->address = server->addr;
     i->path = server->path;
@@ -363,6 +401,59 @@ init_client_connect_info (NotifServer *server)
 static void
 handle_messages (const char *msg, size_t len);
 
+static Message *
+take_pending_message (NotifServer *server);
+
+static void
+mark_subscriptions_sent (NotifServer *server, GList *sub_ids);
+
+static void
+connect_server_cb (lws_sorted_usec_list_t *sul)
+{
+    NotifServer *server = lws_container_of (sul, NotifServer, sul);
+
+    seaf_debug ("Connecting to notification server %s.\n", server->server_url);
+
+    server->status = STATUS_DISCONNECTED;
+    // Failures are reported by LWS_CALLBACK_CLIENT_CONNECTION_ERROR, which
+    // schedules the next attempt.
+    lws_client_connect_via_info (&server->i);
+}
+
+/* Called in the service thread when the connection is lost or fails. */
+static void
+schedule_reconnect (NotifServer *server)
+{
+    server->wsi = NULL;
+    delete_subscribed_repos (server);
+
+    lws_retry_sul_schedule (server->i.context, 0, &server->sul,
+                            &reconnect_policy, connect_server_cb,
+                            &server->retry_count);
+}
+
+/* Start connecting the servers added since the last call. */
+static void
+connect_new_servers ()
+{
+    SeafNotifManagerPriv *priv = seaf->notif_mgr->priv;
+    GList *servers, *ptr;
+    NotifServer *server;
+
+    pthread_mutex_lock (&priv->server_lock);
+    servers = priv->new_servers;
+    priv->new_servers = NULL;
+    pthread_mutex_unlock (&priv->server_lock);
+
+    for (ptr = servers; ptr; ptr = ptr->next) {
+        server = ptr->data;
+        lws_sul_schedule (priv->context, 0, &server->sul, connect_server_cb, 1);
+    }
+
+    /* The servers stay referenced by the servers table. */
+    g_list_free_full (servers, (GDestroyNotify)notif_server_unref);
+}
+
 // success:0
 static int
 event_callback (struct lws *wsi, enum lws_callback_reasons reason,
@@ -372,6 +463,13 @@ event_callback (struct lws *wsi, enum lws_callback_reasons reason,
     Message *msg = NULL;
     int m;
     int ret = 0;
+
+    /* Not bound to a connection, see seaf_notif_manager_connect_server(). */
+    if (reason == LWS_CALLBACK_EVENT_WAIT_CANCELLED) {
+        connect_new_servers ();
+        return 0;
+    }
+
     if (!server) {
         return ret;
     }
@@ -383,13 +481,14 @@ event_callback (struct lws *wsi, enum lws_callback_reasons reason,
         server->status = STATUS_ERROR;
         seaf_debug ("websocket connection error: %s\n",
             in ? (char *)in : "(null)");
+        schedule_reconnect (server);
         ret = -1;
         break;
     case LWS_CALLBACK_CLIENT_RECEIVE:
         handle_messages (in, len);
         break;
     case LWS_CALLBACK_CLIENT_WRITEABLE:
-        msg = g_async_queue_try_pop (server->messages);
+        msg = take_pending_message (server);
         if (!msg) {
             break;
         }
@@ -404,20 +503,24 @@ event_callback (struct lws *wsi, enum lws_callback_reasons reason,
             return -1;
         }
 
+        mark_subscriptions_sent (server, msg->sub_ids);
         notif_message_free (msg);
+
+        /* Send the remaining batches right away instead of waiting for the
+         * next ping.
+         */
+        lws_callback_on_writable (wsi);
         break;
     case LWS_CALLBACK_CLIENT_ESTABLISHED:
         seaf_sync_manager_check_locks_and_folder_perms (seaf->sync_mgr, server->server_url);
         server->status = STATUS_CONNECTED;
+        server->retry_count = 0;
         seaf_debug ("Successfully connected to the server: %s\n", server->server_url);
         break;
     case LWS_CALLBACK_CLIENT_CLOSED:
         ret = -1;
         server->status = STATUS_ERROR;
-        break;
-    case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
-        ret = -1;
-        server->status = STATUS_CANCELLED;
+        schedule_reconnect (server);
         break;
     default:
         break;
@@ -426,13 +529,16 @@ event_callback (struct lws *wsi, enum lws_callback_reasons reason,
     return ret;
 }
 
+/* Only the latest head of a repo matters, so the updates are merged here
+ * and applied by the sync manager in its next pulse.
+ */
 static int
 handle_repo_update (json_t *content)
 {
+    SeafNotifManagerPriv *priv = seaf->notif_mgr->priv;
     json_t *member;
     const char *repo_id;
     const char *commit_id;
-    SeafRepo *repo = NULL;
 
     member = json_object_get (content, "repo_id");
     if (!member) {
@@ -440,13 +546,8 @@ handle_repo_update (json_t *content)
         return -1;
     }
     repo_id = json_string_value (member);
-
-    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-    if (!repo) {
-        return -1;
-    }
-
-    if (!seaf_notif_manager_is_repo_subscribed (seaf->notif_mgr, repo)) {
+    if (!repo_id) {
+        seaf_warning ("Invalid repo update notification: repo_id is null.\n");
         return -1;
     }
 
@@ -461,11 +562,48 @@ handle_repo_update (json_t *content)
         return -1;
     }
 
-    seaf_sync_manager_update_repo (seaf->sync_mgr, repo, commit_id);
+    pthread_mutex_lock (&priv->update_lock);
+    g_hash_table_replace (priv->repo_updates,
+                          g_strdup (repo_id), g_strdup (commit_id));
+    pthread_mutex_unlock (&priv->update_lock);
 
     return 0;
 }
 
+void
+seaf_notif_manager_apply_repo_updates (SeafNotifManager *mgr)
+{
+    SeafNotifManagerPriv *priv = mgr->priv;
+    GHashTable *updates;
+    GHashTableIter iter;
+    gpointer key, value;
+    SeafRepo *repo;
+
+    pthread_mutex_lock (&priv->update_lock);
+    if (g_hash_table_size (priv->repo_updates) == 0) {
+        pthread_mutex_unlock (&priv->update_lock);
+        return;
+    }
+    updates = priv->repo_updates;
+    priv->repo_updates = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_free);
+    pthread_mutex_unlock (&priv->update_lock);
+
+    g_hash_table_iter_init (&iter, updates);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, key);
+        if (!repo)
+            continue;
+
+        if (!seaf_notif_manager_is_repo_subscribed (mgr, repo))
+            continue;
+
+        seaf_sync_manager_update_repo (seaf->sync_mgr, repo, value);
+    }
+
+    g_hash_table_destroy (updates);
+}
+
 static int
 handle_file_lock (json_t *content)
 {
@@ -666,6 +804,7 @@ handle_jwt_expired (json_t *content)
 
     pthread_mutex_lock (&server->sub_lock);
     g_hash_table_remove (server->subscriptions, repo->id);
+    g_hash_table_remove (server->sent_subs, repo->id);
     pthread_mutex_unlock (&server->sub_lock);
 
     // Set last_check_jwt_token to 0 to allow the repo to re-acquire a jwt token.
@@ -734,7 +873,7 @@ static const struct lws_protocols protocols[] = {
 };
 
 static struct lws_context *
-lws_context_new (gboolean use_ssl)
+lws_context_new ()
 {
     struct lws_context_creation_info info;
     struct lws_context *context = NULL;
@@ -742,16 +881,15 @@ lws_context_new (gboolean use_ssl)
     memset(&info, 0, sizeof info);
     info.port = CONTEXT_PORT_NO_LISTEN;
     info.protocols = protocols;
-    // Since we know this lws context is only ever going to be used with
-    // one client wsis / fds / sockets at a time, let lws know it doesn't
-    // have to use the default allocations for fd tables up to ulimit -n.
-    // It will just allocate for 1 internal and 1 (+ 1 http2 nwsi) that we will use.
-    info.fd_limit_per_thread = 1 + 1 + 1;
+    // The context is only used for the client connections to the
+    // notification servers, so let lws know it doesn't have to use the
+    // default allocations for fd tables up to ulimit -n. It allocates for
+    // 1 internal fd and 2 (connection + http2 nwsi) per server.
+    info.fd_limit_per_thread = 1 + 2 * MAX_NOTIF_SERVERS;
     char *ca_path = g_build_filename (seaf->seaf_dir, "ca-bundle.pem", NULL);
-    if (use_ssl) {
-         info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
-         info.client_ssl_ca_filepath = ca_path;
-    }
+    // Some servers may use ssl, so always initialize it.
+    info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+    info.client_ssl_ca_filepath = ca_path;
 
     context = lws_create_context(&info);
     if (!context) {
@@ -778,123 +916,169 @@ delete_subscribed_repos (NotifServer *server)
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         g_hash_table_iter_remove (&iter);
     }
+    g_hash_table_remove_all (server->pending_subs);
+    g_hash_table_remove_all (server->pending_unsubs);
+    g_hash_table_remove_all (server->sent_subs);
     pthread_mutex_unlock (&server->sub_lock);
 }
 
-static void
-delete_unsent_messages (NotifServer *server)
+static void *
+notification_worker (void *vdata)
 {
-    Message *msg = NULL;
+    struct lws_context *context = vdata;
+    int n = 0;
 
-    if (!server->messages)
-        return;
+    // The timers of the connections and of the reconnection attempts
+    // decide how long lws_service() waits.
+    while (n >= 0)
+        n = lws_service (context, 0);
 
-    while (1) {
-        msg = g_async_queue_try_pop (server->messages);
-        if (!msg) {
-            break;
-        }
-        notif_message_free (msg);
-    }
+    seaf_warning ("Notification service thread exiting.\n");
 
-    return;
+    return NULL;
 }
 
-static void *
-notification_worker (void *vdata)
+/* Called with server_lock held. */
+static int
+start_service_thread (SeafNotifManager *mgr)
 {
-    NotifServer *server = (NotifServer *)vdata;
+    struct lws_context *context;
+    pthread_t tid;
+    int rc;
 
-    if (!server) {
-        return 0;
+    context = lws_context_new ();
+    if (!context)
+        return -1;
+
+    rc = pthread_create (&tid, NULL, notification_worker, context);
+    if (rc != 0) {
+        seaf_warning ("Failed to create event notification thread: %s.\n", strerror(rc));
+        lws_context_destroy (context);
+        return -1;
     }
+    pthread_detach (tid);
 
-    struct lws_client_connect_info *i = &server->i;
+    mgr->priv->context = context;
+    return 0;
+}
+
+/* Build a subscribe or unsubscribe message from up to SUBSCRIBE_BATCH_SIZE
+ * repos in @pending, removing them from it. The repos of a subscribe message
+ * are kept in msg->sub_ids, to be marked as sent once it's written.
+ */
+static Message *
+build_batch_message (GHashTable *pending, const char *type)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    json_t *json_msg, *content, *array, *obj;
+    char *str;
+    Message *msg = NULL;
+    GList *sub_ids = NULL;
+    gboolean subscribe = (strcmp (type, "subscribe") == 0);
     int n = 0;
 
-    while (!server->close) {
-        // We don't need to check the return value of this function, the connection will be processed in the event loop.
-        lws_client_connect_via_info(i);
+    array = json_array ();
 
-        while (n >= 0 && !server->close &&
-               server->status != STATUS_ERROR &&
-               server->status != STATUS_CANCELLED) {
-            n = lws_service(server->context, 0);
-        }
+    g_hash_table_iter_init (&iter, pending);
+    while (n < SUBSCRIBE_BATCH_SIZE && g_hash_table_iter_next (&iter, &key, &value)) {
+        obj = json_object ();
+        json_object_set_new (obj, "id", json_string(key));
+        if (value)
+            json_object_set_new (obj, "jwt_token", json_string(value));
+        json_array_append_new (array, obj);
+        if (subscribe)
+            sub_ids = g_list_prepend (sub_ids, g_strdup (key));
+        g_hash_table_iter_remove (&iter);
+        ++n;
+    }
 
-        delete_subscribed_repos (server);
-        delete_unsent_messages (server);
+    json_msg = json_object ();
+    json_object_set_new (json_msg, "type", json_string(type));
+    content = json_object ();
+    json_object_set_new (content, "repos", array);
+    json_object_set_new (json_msg, "content", content);
 
-        if (server->status == STATUS_CANCELLED)
-            break;
+    str = json_dumps (json_msg, JSON_COMPACT);
+    if (str)
+        msg = notif_message_new (str, LWS_WRITE_TEXT);
+    if (msg)
+        msg->sub_ids = sub_ids;
+    else
+        g_list_free_full (sub_ids, g_free);
 
-        // Wait a minute to reconnect to the notification server.
-        g_usleep (RECONNECT_INTERVAL * G_USEC_PER_SEC);
-        n = 0;
-        server->status = STATUS_DISCONNECTED;
-    }
+    seaf_debug ("Send %s message for %d repos.\n", type, n);
 
-    seaf_message ("Notification worker for server %s exiting.\n", server->server_url);
-    pthread_mutex_lock (&seaf->notif_mgr->priv->server_lock);
-    g_hash_table_remove (seaf->notif_mgr->priv->servers, server->server_url);
-    pthread_mutex_unlock (&seaf->notif_mgr->priv->server_lock);
-    notif_server_unref (server);
+    g_free (str);
+    json_decref (json_msg);
+    return msg;
+}
 
-    return 0;
+static Message *
+take_pending_message (NotifServer *server)
+{
+    Message *msg = NULL;
+
+    pthread_mutex_lock (&server->sub_lock);
+    if (g_hash_table_size (server->pending_unsubs) > 0)
+        msg = build_batch_message (server->pending_unsubs, "unsubscribe");
+    else if (g_hash_table_size (server->pending_subs) > 0)
+        msg = build_batch_message (server->pending_subs, "subscribe");
+    pthread_mutex_unlock (&server->sub_lock);
+
+    return msg;
 }
 
+/* Called after a subscribe message is written. Repos unsubscribed or
+ * subscribed again in the meantime are left alone, their latest request
+ * is still pending.
+ */
+static void
+mark_subscriptions_sent (NotifServer *server, GList *sub_ids)
+{
+    GList *ptr;
+    char *repo_id;
+
+    if (!sub_ids)
+        return;
+
+    pthread_mutex_lock (&server->sub_lock);
+    for (ptr = sub_ids; ptr; ptr = ptr->next) {
+        repo_id = ptr->data;
+        if (g_hash_table_lookup (server->subscriptions, repo_id) &&
+            !g_hash_table_lookup (server->pending_subs, repo_id))
+            g_hash_table_add (server->sent_subs, g_strdup (repo_id));
+    }
+    pthread_mutex_unlock (&server->sub_lock);
+}
+
+/* The repo is recorded as subscribed immediately. The request itself is
+ * sent together with the other pending ones by the notification thread.
+ */
 void
 seaf_notif_manager_subscribe_repo (SeafNotifManager *mgr, SeafRepo *repo)
 {
     NotifServer *server = NULL;
-    json_t *json_msg = NULL;
-    json_t *content = NULL;
-    char *str = NULL;
     char *sub_id = NULL;
-    json_t *array, *obj;
     char *repo_id = repo->id;
 
     server = get_notif_server (mgr, repo->server_url);
     if (!server || server->status != STATUS_CONNECTED)
         goto out;
 
-    json_msg = json_object ();
-    json_object_set_new (json_msg, "type", json_string("subscribe"));
-
-    content = json_object ();
-
-    array = json_array ();
-
-    obj = json_object ();
-    json_object_set_new (obj, "id", json_string(repo_id));
-    json_object_set_new (obj, "jwt_token", json_string(repo->jwt_token));
-    json_array_append_new (array, obj);
-
-    json_object_set_new (content, "repos", array);
-
-    json_object_set_new (json_msg, "content", content);
-
-    str = json_dumps (json_msg, JSON_COMPACT);
-    if (!str)
-        goto out;
-
-    Message *msg = notif_message_new (str, LWS_WRITE_TEXT);
-    if (!msg)
-        goto out;
-
-    g_async_queue_push (server->messages, msg);
-
     sub_id = g_strdup (repo_id);
 
     pthread_mutex_lock (&server->sub_lock);
+    g_hash_table_remove (server->pending_unsubs, repo_id);
+    g_hash_table_remove (server->sent_subs, repo_id);
+    g_hash_table_replace (server->pending_subs, g_strdup (repo_id),
+                          g_strdup (repo->jwt_token));
     g_hash_table_insert (server->subscriptions, sub_id, sub_id);
     pthread_mutex_unlock (&server->sub_lock);
 
     seaf_debug ("Successfully subscribe repo %s\n", repo_id);
 
 out:
-    g_free (str);
-    json_decref (json_msg);
     notif_server_unref (server);
 }
 
@@ -902,10 +1086,6 @@ void
 seaf_notif_manager_unsubscribe_repo (SeafNotifManager *mgr, SeafRepo *repo)
 {
     NotifServer *server = NULL;
-    json_t *json_msg = NULL;
-    json_t *content = NULL;
-    char *str = NULL;
-    json_t *array, *obj;
     char *repo_id = repo->id;
 
     server = get_notif_server (mgr, repo->server_url);
@@ -913,40 +1093,16 @@ seaf_notif_manager_unsubscribe_repo (SeafNotifManager *mgr, SeafRepo *repo)
         goto out;
     }
 
-    json_msg = json_object ();
-    json_object_set_new (json_msg, "type", json_string("unsubscribe"));
-
-    content = json_object ();
-
-    array = json_array ();
-
-    obj = json_object ();
-    json_object_set_new (obj, "id", json_string(repo_id));
-    json_array_append_new (array, obj);
-
-    json_object_set_new (content, "repos", array);
-
-    json_object_set_new (json_msg, "content", content);
-
-    str = json_dumps (json_msg, JSON_COMPACT);
-    if (!str)
-        goto out;
-
-    Message *msg = notif_message_new (str, LWS_WRITE_TEXT);
-    if (!msg)
-        goto out;
-
-    g_async_queue_push (server->messages, msg);
-
     pthread_mutex_lock (&server->sub_lock);
+    g_hash_table_remove (server->pending_subs, repo_id);
+    g_hash_table_remove (server->sent_subs, repo_id);
+    g_hash_table_replace (server->pending_unsubs, g_strdup (repo_id), NULL);
     g_hash_table_remove (server->subscriptions, repo_id);
     pthread_mutex_unlock (&server->sub_lock);
 
     seaf_debug ("Successfully unsubscribe repo %s\n", repo_id);
 
 out:
-    g_free (str);
-    json_decref (json_msg);
     notif_server_unref (server);
 }
 
@@ -977,3 +1133,27 @@ out:
     notif_server_unref (server);
     return subscribed;
 }
+
+gboolean
+seaf_notif_manager_is_subscription_sent (SeafNotifManager *mgr, SeafRepo *repo)
+{
+    NotifServer *server = NULL;
+    gboolean sent = FALSE;
+
+    if (!repo->server_url) {
+        goto out;
+    }
+
+    server = get_notif_server (mgr, repo->server_url);
+    if (!server || server->status != STATUS_CONNECTED) {
+        goto out;
+    }
+
+    pthread_mutex_lock (&server->sub_lock);
+    sent = g_hash_table_contains (server->sent_subs, repo->id);
+    pthread_mutex_unlock (&server->sub_lock);
+
+out:
+    notif_server_unref (server);
+    return sent;
+}
@@ -29,4 +29,17 @@ seaf_notif_manager_unsubscribe_repo (SeafNotifManager *mgr, SeafRepo *repo);
 gboolean
 seaf_notif_manager_is_repo_subscribed (SeafNotifManager *mgr, SeafRepo *repo);
 
+/* Whether the subscribe request of @repo has been written to the server, so
+ * that changes made after now will be pushed.
+ */
+gboolean
+seaf_notif_manager_is_subscription_sent (SeafNotifManager *mgr, SeafRepo *repo);
+
+/* Apply the repo updates received since the last call. Called in the main
+ * thread, so that repos and sync state are not touched by the notification
+ * threads.
+ */
+void
+seaf_notif_manager_apply_repo_updates (SeafNotifManager *mgr);
+
 #endif
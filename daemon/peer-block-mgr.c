@@ -0,0 +1,987 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <curl/curl.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/buffer.h>
+#include <event2/keyvalq_struct.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#endif
+
+#include "seafile-session.h"
+#include "seafile-config.h"
+#include "peer-block-mgr.h"
+#include "seafile-crypt.h"
+#include "job-mgr.h"
+#include "utils.h"
+#include "log.h"
+
+#define DEFAULT_PEER_BLOCK_PORT 8089
+
+#define PEER_AUTH_HEADER "Seafile-Peer-Auth"
+#define PEER_COMMIT_HEADER "Seafile-Peer-Commit"
+
+/* A peer that can't be reached is not tried again for this long. */
+#define PEER_RETRY_INTERVAL 60
+/* A peer that answered a ping is not pinged again for this long. */
+#define PEER_ALIVE_INTERVAL 60
+
+/* Peers are on the LAN, so they answer quickly or not at all. */
+#define PEER_PROBE_TIMEOUT 2L
+#define PEER_CONNECT_TIMEOUT 2L
+#define PEER_TIMEOUT 10L
+
+/* Requests signed longer ago than this, or replayed, are refused. */
+#define PEER_AUTH_MAX_AGE 300
+
+/* Larger than any block written by the chunker. */
+#define MAX_PEER_BLOCK_SIZE (16 << 20)
+
+/* Block ids asked for in one has-blocks request, one per line. */
+#define HAS_BLOCKS_BATCH_SIZE 1024
+#define MAX_HAS_BLOCKS_BODY_SIZE (HAS_BLOCKS_BATCH_SIZE * 41)
+
+typedef struct PeerInfo {
+    /* "http://host:port" */
+    char *url;
+    gint64 retry_after;
+    gint64 alive_until;
+} PeerInfo;
+
+typedef struct SeenNonce {
+    char nonce[37];
+    gint64 expire;
+} SeenNonce;
+
+struct _PeerBlockMgrPriv {
+    char *secret;
+    int port;
+    struct evhttp *http;
+
+    /* Nonces of the requests accepted in the last 2 * PEER_AUTH_MAX_AGE
+     * seconds, oldest first in the queue. Only used in the main loop. */
+    GHashTable *seen_nonces;
+    GQueue nonce_queue;
+
+    GPtrArray *peers;
+    pthread_mutex_t lock;
+};
+
+static void
+peer_info_free (PeerInfo *peer)
+{
+    g_free (peer->url);
+    g_free (peer);
+}
+
+SeafPeerBlockManager *
+seaf_peer_block_manager_new (SeafileSession *session)
+{
+    SeafPeerBlockManager *mgr = g_new0 (SeafPeerBlockManager, 1);
+    struct _PeerBlockMgrPriv *priv = g_new0 (struct _PeerBlockMgrPriv, 1);
+    char *peers;
+    char **addrs, **p;
+    PeerInfo *peer;
+    gboolean exists;
+
+    mgr->session = session;
+    mgr->priv = priv;
+
+    pthread_mutex_init (&priv->lock, NULL);
+    priv->peers = g_ptr_array_new_with_free_func ((GDestroyNotify)peer_info_free);
+    priv->seen_nonces = g_hash_table_new (g_str_hash, g_str_equal);
+    g_queue_init (&priv->nonce_queue);
+
+    priv->secret = seafile_session_config_get_string (session,
+                                                      KEY_PEER_BLOCK_SECRET);
+    if (priv->secret && priv->secret[0] == '\0') {
+        g_free (priv->secret);
+        priv->secret = NULL;
+    }
+    if (!priv->secret)
+        return mgr;
+
+    priv->port = seafile_session_config_get_int (session, KEY_PEER_BLOCK_PORT,
+                                                 &exists);
+    if (!exists || priv->port <= 0 || priv->port > 65535)
+        priv->port = DEFAULT_PEER_BLOCK_PORT;
+
+    peers = seafile_session_config_get_string (session, KEY_PEER_BLOCK_PEERS);
+    if (peers) {
+        addrs = g_strsplit (peers, ",", -1);
+        for (p = addrs; *p; ++p) {
+            g_strstrip (*p);
+            if (**p == '\0')
+                continue;
+            peer = g_new0 (PeerInfo, 1);
+            peer->url = g_strdup_printf ("http://%s", *p);
+            g_ptr_array_add (priv->peers, peer);
+        }
+        g_strfreev (addrs);
+        g_free (peers);
+    }
+
+    return mgr;
+}
+
+/*
+ * A request carries "<time>:<nonce>:<hmac>" in PEER_AUTH_HEADER, where
+ * hmac is the SHA256 HMAC of "<time>:<nonce>:<commit>:<path>" keyed with
+ * the secret. The time and the nonce keep a captured request from being
+ * replayed.
+ *
+ * The secret is shared by the whole fleet, so it only proves that the
+ * request comes from one of its clients. Requests for a repo also carry
+ * the id of one of its commits in PEER_COMMIT_HEADER, and are only served
+ * if the commit is in the local store. Commit ids can only be learned
+ * from the server with read access to the repo.
+ */
+static char *
+compute_auth (const char *secret, gint64 ts, const char *nonce,
+              const char *commit_id, const char *path)
+{
+    char *msg, *mac;
+
+    msg = g_strdup_printf ("%"G_GINT64_FORMAT":%s:%s:%s", ts, nonce,
+                           commit_id ? commit_id : "", path);
+    mac = g_compute_hmac_for_string (G_CHECKSUM_SHA256,
+                                     (const guchar *)secret, strlen(secret),
+                                     msg, -1);
+    g_free (msg);
+    return mac;
+}
+
+static struct curl_slist *
+make_auth_headers (const char *secret, const char *commit_id, const char *path)
+{
+    struct curl_slist *headers;
+    gint64 ts = (gint64)time(NULL);
+    char nonce[37];
+    char *mac, *header;
+
+    gen_uuid_inplace (nonce);
+    mac = compute_auth (secret, ts, nonce, commit_id, path);
+    header = g_strdup_printf (PEER_AUTH_HEADER ": %"G_GINT64_FORMAT":%s:%s",
+                              ts, nonce, mac);
+    headers = curl_slist_append (NULL, header);
+    g_free (header);
+    g_free (mac);
+
+    if (commit_id) {
+        header = g_strdup_printf (PEER_COMMIT_HEADER ": %s", commit_id);
+        headers = curl_slist_append (headers, header);
+        g_free (header);
+    }
+
+    return headers;
+}
+
+static gboolean
+auth_matches (const char *expected, const char *auth)
+{
+    size_t len = strlen (expected), i;
+    unsigned char diff = 0;
+
+    if (!auth || strlen (auth) != len)
+        return FALSE;
+    for (i = 0; i < len; ++i)
+        diff |= expected[i] ^ auth[i];
+    return diff == 0;
+}
+
+static gboolean
+check_nonce (struct _PeerBlockMgrPriv *priv, const char *nonce, gint64 now)
+{
+    SeenNonce *seen;
+
+    while ((seen = g_queue_peek_head (&priv->nonce_queue)) &&
+           seen->expire < now) {
+        g_queue_pop_head (&priv->nonce_queue);
+        g_hash_table_remove (priv->seen_nonces, seen->nonce);
+        g_free (seen);
+    }
+
+    if (g_hash_table_contains (priv->seen_nonces, nonce))
+        return FALSE;
+
+    /* A nonce is accepted with a time up to PEER_AUTH_MAX_AGE ahead or
+     * behind, so it's kept for twice that long. */
+    seen = g_new0 (SeenNonce, 1);
+    g_strlcpy (seen->nonce, nonce, sizeof(seen->nonce));
+    seen->expire = now + 2 * PEER_AUTH_MAX_AGE;
+    g_queue_push_tail (&priv->nonce_queue, seen);
+    g_hash_table_add (priv->seen_nonces, seen->nonce);
+
+    return TRUE;
+}
+
+static gboolean
+check_auth (struct _PeerBlockMgrPriv *priv, const char *auth,
+            const char *commit_id, const char *path)
+{
+    gint64 ts, now = (gint64)time(NULL);
+    char nonce[37];
+    const char *p, *mac;
+    char *end, *expected;
+    gboolean ret;
+
+    if (!auth)
+        return FALSE;
+
+    ts = g_ascii_strtoll (auth, &end, 10);
+    if (end == auth || *end != ':' || ABS (now - ts) > PEER_AUTH_MAX_AGE)
+        return FALSE;
+
+    p = end + 1;
+    mac = strchr (p, ':');
+    if (!mac || mac - p != 36)
+        return FALSE;
+    memcpy (nonce, p, 36);
+    nonce[36] = '\0';
+    ++mac;
+
+    expected = compute_auth (priv->secret, ts, nonce, commit_id, path);
+    ret = auth_matches (expected, mac);
+    g_free (expected);
+
+    return ret && check_nonce (priv, nonce, now);
+}
+
+static GByteArray *
+read_local_block (const char *repo_id, int version, const char *block_id)
+{
+    BlockHandle *handle;
+    BlockMetadata *bmd;
+    GByteArray *data = NULL;
+
+    handle = seaf_block_manager_open_block (seaf->block_mgr, repo_id, version,
+                                            block_id, BLOCK_READ);
+    if (!handle)
+        return NULL;
+
+    bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, handle);
+    if (!bmd || bmd->size > MAX_PEER_BLOCK_SIZE)
+        goto out;
+
+    data = g_byte_array_sized_new (bmd->size);
+    g_byte_array_set_size (data, bmd->size);
+    if (seaf_block_manager_read_block (seaf->block_mgr, handle,
+                                       data->data, bmd->size) != bmd->size) {
+        g_byte_array_free (data, TRUE);
+        data = NULL;
+    }
+
+out:
+    g_free (bmd);
+    seaf_block_manager_close_block (seaf->block_mgr, handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+    return data;
+}
+
+typedef struct BlockRequest {
+    struct evhttp_request *req;
+    char repo_id[37];
+    int version;
+    char commit_id[41];
+    /* Empty for a has-blocks request. */
+    char block_id[41];
+    gboolean has_blocks;
+    /* The ids asked for by a has-blocks request. */
+    char *query;
+    int status;
+    GByteArray *data;
+} BlockRequest;
+
+/* The ids in @query, one per line, that are in the local store. */
+static GByteArray *
+find_local_blocks (const char *repo_id, int version, const char *query)
+{
+    GByteArray *reply = g_byte_array_new ();
+    char **ids, **p;
+
+    ids = g_strsplit (query, "\n", HAS_BLOCKS_BATCH_SIZE + 1);
+    for (p = ids; *p && p - ids < HAS_BLOCKS_BATCH_SIZE; ++p) {
+        if (!is_object_id_valid (*p))
+            continue;
+        if (seaf_block_manager_block_exists (seaf->block_mgr, repo_id,
+                                             version, *p)) {
+            g_byte_array_append (reply, (guint8 *)*p, 40);
+            g_byte_array_append (reply, (guint8 *)"\n", 1);
+        }
+    }
+    g_strfreev (ids);
+
+    return reply;
+}
+
+static void *
+read_block_job (void *vdata)
+{
+    BlockRequest *breq = vdata;
+
+    if (!seaf_commit_manager_commit_exists (seaf->commit_mgr, breq->repo_id,
+                                            breq->version, breq->commit_id)) {
+        breq->status = 403;
+        return breq;
+    }
+
+    if (breq->has_blocks) {
+        breq->data = find_local_blocks (breq->repo_id, breq->version,
+                                        breq->query);
+    } else {
+        breq->data = read_local_block (breq->repo_id, breq->version,
+                                       breq->block_id);
+        if (!breq->data)
+            breq->status = HTTP_NOTFOUND;
+    }
+    if (breq->data)
+        breq->status = HTTP_OK;
+    return breq;
+}
+
+static void
+block_request_free (BlockRequest *breq)
+{
+    if (breq->data)
+        g_byte_array_free (breq->data, TRUE);
+    g_free (breq->query);
+    g_free (breq);
+}
+
+/* Called in the main loop. If the peer has gone away, libevent frees the
+ * request when the reply is sent. */
+static void
+read_block_done (void *vresult)
+{
+    BlockRequest *breq = vresult;
+    struct evbuffer *buf;
+
+    if (breq->status != HTTP_OK) {
+        evhttp_send_error (breq->req, breq->status, NULL);
+        block_request_free (breq);
+        return;
+    }
+
+    buf = evbuffer_new ();
+    evbuffer_add (buf, breq->data->data, breq->data->len);
+    evhttp_add_header (evhttp_request_get_output_headers (breq->req),
+                       "Content-Type",
+                       breq->has_blocks ? "text/plain" : "application/octet-stream");
+    evhttp_send_reply (breq->req, HTTP_OK, "OK", buf);
+    evbuffer_free (buf);
+    block_request_free (breq);
+}
+
+static gboolean
+parse_repo_path (const char *path, BlockRequest *breq)
+{
+    size_t len = strlen (path);
+
+    if (len < 6 + 36 || strncmp (path, "/repo/", 6) != 0)
+        return FALSE;
+    memcpy (breq->repo_id, path + 6, 36);
+    if (!is_uuid_valid (breq->repo_id))
+        return FALSE;
+    path += 6 + 36;
+
+    if (strcmp (path, "/has-blocks") == 0) {
+        breq->has_blocks = TRUE;
+        return TRUE;
+    }
+    if (strlen (path) != 7 + 40 || strncmp (path, "/block/", 7) != 0)
+        return FALSE;
+    memcpy (breq->block_id, path + 7, 40);
+    return is_object_id_valid (breq->block_id);
+}
+
+/*
+ * GET /ping
+ * GET /repo/<repo_id>/block/<block_id>
+ * POST /repo/<repo_id>/has-blocks, with block ids in the body, one per
+ * line. The reply lists the ones that are in the local store.
+ *
+ * Blocks are read in a worker thread, so a slow disk doesn't hold up the
+ * main loop.
+ */
+static void
+handle_block_request (struct evhttp_request *req, void *arg)
+{
+    SeafPeerBlockManager *mgr = arg;
+    const char *path = evhttp_request_get_uri (req);
+    enum evhttp_cmd_type cmd = evhttp_request_get_command (req);
+    struct evkeyvalq *headers = evhttp_request_get_input_headers (req);
+    struct evbuffer *body;
+    const char *auth, *commit_id;
+    SeafRepo *repo;
+    BlockRequest *breq;
+    size_t len;
+
+    if (strcmp (path, "/ping") == 0) {
+        auth = evhttp_find_header (headers, PEER_AUTH_HEADER);
+        if (cmd != EVHTTP_REQ_GET)
+            evhttp_send_error (req, HTTP_BADREQUEST, NULL);
+        else if (!check_auth (mgr->priv, auth, NULL, path))
+            evhttp_send_error (req, 403, NULL);
+        else
+            evhttp_send_reply (req, HTTP_OK, "OK", NULL);
+        return;
+    }
+
+    breq = g_new0 (BlockRequest, 1);
+    breq->req = req;
+    if (!parse_repo_path (path, breq) ||
+        cmd != (breq->has_blocks ? EVHTTP_REQ_POST : EVHTTP_REQ_GET)) {
+        evhttp_send_error (req, HTTP_BADREQUEST, NULL);
+        block_request_free (breq);
+        return;
+    }
+
+    auth = evhttp_find_header (headers, PEER_AUTH_HEADER);
+    commit_id = evhttp_find_header (headers, PEER_COMMIT_HEADER);
+    if (!commit_id || !is_object_id_valid (commit_id) ||
+        !check_auth (mgr->priv, auth, commit_id, path)) {
+        evhttp_send_error (req, 403, NULL);
+        block_request_free (breq);
+        return;
+    }
+    memcpy (breq->commit_id, commit_id, 40);
+
+    if (breq->has_blocks) {
+        body = evhttp_request_get_input_buffer (req);
+        len = evbuffer_get_length (body);
+        if (len > MAX_HAS_BLOCKS_BODY_SIZE) {
+            evhttp_send_error (req, HTTP_BADREQUEST, NULL);
+            block_request_free (breq);
+            return;
+        }
+        breq->query = g_malloc (len + 1);
+        evbuffer_copyout (body, breq->query, len);
+        breq->query[len] = '\0';
+    }
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, breq->repo_id);
+    if (!repo) {
+        evhttp_send_error (req, HTTP_NOTFOUND, NULL);
+        block_request_free (breq);
+        return;
+    }
+    breq->version = repo->version;
+
+    if (seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                     JOB_PRIORITY_INTERACTIVE,
+                                                     read_block_job,
+                                                     read_block_done,
+                                                     breq) < 0) {
+        evhttp_send_error (req, HTTP_SERVUNAVAIL, NULL);
+        block_request_free (breq);
+    }
+}
+
+static gboolean
+is_lan_address (const struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET) {
+        const unsigned char *a = (const unsigned char *)
+            &((const struct sockaddr_in *)sa)->sin_addr;
+        return (a[0] == 10 ||
+                (a[0] == 172 && (a[1] & 0xf0) == 16) ||
+                (a[0] == 192 && a[1] == 168) ||
+                (a[0] == 169 && a[1] == 254));
+    } else if (sa->sa_family == AF_INET6) {
+        /* Unique local addresses. Link-local ones need a scope to bind. */
+        const unsigned char *a = (const unsigned char *)
+            &((const struct sockaddr_in6 *)sa)->sin6_addr;
+        return (a[0] & 0xfe) == 0xfc;
+    }
+    return FALSE;
+}
+
+static void
+add_lan_address (GList **addrs, const struct sockaddr *sa, socklen_t len)
+{
+    char host[NI_MAXHOST];
+
+    if (!is_lan_address (sa))
+        return;
+    if (getnameinfo (sa, len, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0)
+        return;
+    if (!g_list_find_custom (*addrs, host, (GCompareFunc)g_strcmp0))
+        *addrs = g_list_append (*addrs, g_strdup (host));
+}
+
+/* The private addresses of the interfaces that are up. */
+static GList *
+get_lan_addresses ()
+{
+    GList *addrs = NULL;
+
+#ifdef WIN32
+    IP_ADAPTER_ADDRESSES *adapters, *ad;
+    IP_ADAPTER_UNICAST_ADDRESS *ua;
+    ULONG size = 16 * 1024;
+    ULONG flags = GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST |
+        GAA_FLAG_SKIP_DNS_SERVER;
+    ULONG rc;
+
+    adapters = g_malloc (size);
+    rc = GetAdaptersAddresses (AF_UNSPEC, flags, NULL, adapters, &size);
+    if (rc == ERROR_BUFFER_OVERFLOW) {
+        adapters = g_realloc (adapters, size);
+        rc = GetAdaptersAddresses (AF_UNSPEC, flags, NULL, adapters, &size);
+    }
+    if (rc == NO_ERROR) {
+        for (ad = adapters; ad; ad = ad->Next) {
+            if (ad->OperStatus != IfOperStatusUp)
+                continue;
+            for (ua = ad->FirstUnicastAddress; ua; ua = ua->Next)
+                add_lan_address (&addrs, ua->Address.lpSockaddr,
+                                 ua->Address.iSockaddrLength);
+        }
+    }
+    g_free (adapters);
+#else
+    struct ifaddrs *ifaddrs, *ifa;
+
+    if (getifaddrs (&ifaddrs) < 0) {
+        seaf_warning ("Failed to get interface addresses: %s.\n",
+                      strerror(errno));
+        return NULL;
+    }
+    for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || !(ifa->ifa_flags & IFF_UP))
+            continue;
+        add_lan_address (&addrs, ifa->ifa_addr,
+                         ifa->ifa_addr->sa_family == AF_INET6 ?
+                         sizeof(struct sockaddr_in6) :
+                         sizeof(struct sockaddr_in));
+    }
+    freeifaddrs (ifaddrs);
+#endif
+
+    return addrs;
+}
+
+int
+seaf_peer_block_manager_start (SeafPeerBlockManager *mgr)
+{
+    struct _PeerBlockMgrPriv *priv = mgr->priv;
+    GList *addrs, *ptr;
+    int n_bound = 0;
+
+    if (!priv->secret)
+        return 0;
+
+    priv->http = evhttp_new (mgr->session->ev_base);
+    if (!priv->http)
+        return -1;
+    evhttp_set_allowed_methods (priv->http, EVHTTP_REQ_GET | EVHTTP_REQ_POST);
+    evhttp_set_gencb (priv->http, handle_block_request, mgr);
+
+    /* Only listen on the LAN. Peer sharing is optional, don't stop the
+     * daemon for it. */
+    addrs = get_lan_addresses ();
+    for (ptr = addrs; ptr; ptr = ptr->next) {
+        if (evhttp_bind_socket (priv->http, ptr->data, priv->port) < 0) {
+            seaf_warning ("Failed to listen on %s:%d for peer block requests.\n",
+                          (char *)ptr->data, priv->port);
+            continue;
+        }
+        seaf_message ("Serving blocks to peers on %s:%d.\n",
+                      (char *)ptr->data, priv->port);
+        ++n_bound;
+    }
+    g_list_free_full (addrs, g_free);
+
+    if (n_bound == 0) {
+        seaf_warning ("No LAN address to serve peer block requests on.\n");
+        evhttp_free (priv->http);
+        priv->http = NULL;
+    }
+    return 0;
+}
+
+gboolean
+seaf_peer_block_manager_has_peers (SeafPeerBlockManager *mgr)
+{
+    return mgr->priv->secret != NULL && mgr->priv->peers->len > 0;
+}
+
+typedef struct RecvData {
+    GByteArray *buf;
+    guint max_size;
+} RecvData;
+
+static size_t
+recv_data_cb (void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    RecvData *data = userp;
+    size_t n = size * nmemb;
+
+    if (data->buf->len + n > data->max_size)
+        return 0;
+    g_byte_array_append (data->buf, ptr, n);
+    return n;
+}
+
+static gboolean
+block_id_matches (const GByteArray *buf, const char *block_id)
+{
+    unsigned char sha1[20];
+    char id[41];
+
+    calculate_sha1 (sha1, (const char *)buf->data, buf->len);
+    rawdata_to_hex (sha1, id, 20);
+    return strcmp (id, block_id) == 0;
+}
+
+/* Returns 0 if the block was received, -1 if the peer doesn't have it, and
+ * -2 if the peer can't be reached. */
+static int
+get_block_from_peer (SeafPeerBlockManager *mgr, CURL *curl,
+                     const char *peer_url, const char *repo_id,
+                     const char *commit_id, const char *block_id,
+                     GByteArray *buf)
+{
+    struct curl_slist *headers;
+    char *path, *url;
+    RecvData data;
+    long status = 0;
+    CURLcode rc;
+
+    path = g_strdup_printf ("/repo/%s/block/%s", repo_id, block_id);
+    url = g_strconcat (peer_url, path, NULL);
+    headers = make_auth_headers (mgr->priv->secret, commit_id, path);
+
+    g_byte_array_set_size (buf, 0);
+    data.buf = buf;
+    data.max_size = MAX_PEER_BLOCK_SIZE;
+
+    curl_easy_setopt (curl, CURLOPT_URL, url);
+    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, recv_data_cb);
+    curl_easy_setopt (curl, CURLOPT_WRITEDATA, &data);
+
+    rc = curl_easy_perform (curl);
+    if (rc == CURLE_OK)
+        curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &status);
+
+    curl_slist_free_all (headers);
+    g_free (url);
+    g_free (path);
+
+    if (rc == CURLE_COULDNT_CONNECT || rc == CURLE_OPERATION_TIMEDOUT ||
+        rc == CURLE_COULDNT_RESOLVE_HOST)
+        return -2;
+    if (rc != CURLE_OK || status != 200)
+        return -1;
+
+    if (!block_id_matches (buf, block_id)) {
+        seaf_warning ("Block %s from peer %s doesn't match its id.\n",
+                      block_id, peer_url);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * The urls of the peers that can be tried now. Those that answered a ping
+ * recently are put in @alive, the others in @unknown.
+ */
+static void
+get_available_peers (SeafPeerBlockManager *mgr, GList **alive, GList **unknown)
+{
+    struct _PeerBlockMgrPriv *priv = mgr->priv;
+    gint64 now = (gint64)time(NULL);
+    PeerInfo *peer;
+    guint i;
+
+    pthread_mutex_lock (&priv->lock);
+    for (i = 0; i < priv->peers->len; ++i) {
+        peer = g_ptr_array_index (priv->peers, i);
+        if (peer->retry_after > now)
+            continue;
+        if (peer->alive_until > now)
+            *alive = g_list_prepend (*alive, g_strdup (peer->url));
+        else
+            *unknown = g_list_prepend (*unknown, g_strdup (peer->url));
+    }
+    pthread_mutex_unlock (&priv->lock);
+}
+
+static void
+mark_peer (SeafPeerBlockManager *mgr, const char *url, gboolean reachable)
+{
+    struct _PeerBlockMgrPriv *priv = mgr->priv;
+    gint64 now = (gint64)time(NULL);
+    PeerInfo *peer;
+    guint i;
+
+    pthread_mutex_lock (&priv->lock);
+    for (i = 0; i < priv->peers->len; ++i) {
+        peer = g_ptr_array_index (priv->peers, i);
+        if (strcmp (peer->url, url) != 0)
+            continue;
+        if (reachable) {
+            peer->alive_until = now + PEER_ALIVE_INTERVAL;
+        } else {
+            peer->alive_until = 0;
+            peer->retry_after = now + PEER_RETRY_INTERVAL;
+        }
+    }
+    pthread_mutex_unlock (&priv->lock);
+}
+
+/*
+ * Send one request to each of @peers at once. @path and @body (which may
+ * be NULL for a GET) are the same for all peers. Returns the replies of the
+ * peers that answered with 200, peer url -> GByteArray. The peers that
+ * can't be reached are marked so.
+ */
+static GHashTable *
+request_peers (SeafPeerBlockManager *mgr, GList *peers, const char *commit_id,
+               const char *path, const char *body, long timeout)
+{
+    CURLM *multi;
+    CURL *curl;
+    CURLMsg *msg;
+    GList *ptr;
+    GHashTable *replies;
+    gpointer idx;
+    struct curl_slist **headers;
+    RecvData *recv;
+    char *url;
+    long status;
+    int n_peers = g_list_length (peers), i, running, n_msgs;
+    CURLcode rc;
+
+    replies = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                     (GDestroyNotify)g_byte_array_unref);
+    if (n_peers == 0)
+        return replies;
+
+    multi = curl_multi_init ();
+    headers = g_new0 (struct curl_slist *, n_peers);
+    recv = g_new0 (RecvData, n_peers);
+
+    for (ptr = peers, i = 0; ptr; ptr = ptr->next, ++i) {
+        url = g_strconcat (ptr->data, path, NULL);
+        headers[i] = make_auth_headers (mgr->priv->secret, commit_id, path);
+        recv[i].buf = g_byte_array_new ();
+        recv[i].max_size = MAX_HAS_BLOCKS_BODY_SIZE;
+
+        curl = curl_easy_init ();
+        curl_easy_setopt (curl, CURLOPT_URL, url);
+        curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers[i]);
+        curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT, PEER_PROBE_TIMEOUT);
+        curl_easy_setopt (curl, CURLOPT_TIMEOUT, timeout);
+        curl_easy_setopt (curl, CURLOPT_NOPROXY, "*");
+        curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, recv_data_cb);
+        curl_easy_setopt (curl, CURLOPT_WRITEDATA, &recv[i]);
+        if (body) {
+            curl_easy_setopt (curl, CURLOPT_POSTFIELDS, body);
+            curl_easy_setopt (curl, CURLOPT_POSTFIELDSIZE, (long)strlen(body));
+        }
+        curl_easy_setopt (curl, CURLOPT_PRIVATE, GINT_TO_POINTER(i));
+        curl_multi_add_handle (multi, curl);
+        g_free (url);
+    }
+
+    curl_multi_perform (multi, &running);
+    while (running > 0) {
+        if (curl_multi_wait (multi, NULL, 0, 1000, NULL) != CURLM_OK)
+            break;
+        curl_multi_perform (multi, &running);
+    }
+
+    while ((msg = curl_multi_info_read (multi, &n_msgs)) != NULL) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        curl = msg->easy_handle;
+        curl_easy_getinfo (curl, CURLINFO_PRIVATE, (char **)&idx);
+        i = GPOINTER_TO_INT(idx);
+        ptr = g_list_nth (peers, i);
+        rc = msg->data.result;
+        status = 0;
+        if (rc == CURLE_OK)
+            curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &status);
+
+        if (rc == CURLE_COULDNT_CONNECT || rc == CURLE_OPERATION_TIMEDOUT ||
+            rc == CURLE_COULDNT_RESOLVE_HOST) {
+            seaf_debug ("Peer %s is not reachable.\n", (char *)ptr->data);
+            mark_peer (mgr, ptr->data, FALSE);
+        } else if (rc == CURLE_OK && status == 200) {
+            mark_peer (mgr, ptr->data, TRUE);
+            g_hash_table_replace (replies, g_strdup (ptr->data),
+                                  g_byte_array_ref (recv[i].buf));
+        }
+
+        curl_multi_remove_handle (multi, curl);
+        curl_easy_cleanup (curl);
+    }
+
+    for (i = 0; i < n_peers; ++i) {
+        curl_slist_free_all (headers[i]);
+        g_byte_array_unref (recv[i].buf);
+    }
+    g_free (headers);
+    g_free (recv);
+    curl_multi_cleanup (multi);
+
+    return replies;
+}
+
+/*
+ * Ask @peers which of @block_ids they have, in batches. Returns
+ * block_id -> url of a peer that has it.
+ */
+static GHashTable *
+query_peer_blocks (SeafPeerBlockManager *mgr, GList *peers,
+                   const char *repo_id, const char *commit_id,
+                   GList *block_ids)
+{
+    GHashTable *holders, *replies;
+    GHashTableIter iter;
+    gpointer key, value;
+    GByteArray *reply;
+    GString *body;
+    GList *ptr = block_ids;
+    char *path, **ids, **p;
+    int n;
+
+    holders = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    path = g_strdup_printf ("/repo/%s/has-blocks", repo_id);
+    body = g_string_new (NULL);
+
+    while (ptr && peers) {
+        g_string_truncate (body, 0);
+        for (n = 0; ptr && n < HAS_BLOCKS_BATCH_SIZE; ptr = ptr->next, ++n)
+            g_string_append_printf (body, "%s\n", (char *)ptr->data);
+
+        replies = request_peers (mgr, peers, commit_id, path, body->str,
+                                 PEER_TIMEOUT);
+        g_hash_table_iter_init (&iter, replies);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            reply = value;
+            g_byte_array_append (reply, (guint8 *)"", 1);
+            ids = g_strsplit ((char *)reply->data, "\n", -1);
+            for (p = ids; *p; ++p) {
+                if (is_object_id_valid (*p) &&
+                    !g_hash_table_contains (holders, *p))
+                    g_hash_table_insert (holders, g_strdup (*p), g_strdup (key));
+            }
+            g_strfreev (ids);
+        }
+        g_hash_table_destroy (replies);
+    }
+
+    g_string_free (body, TRUE);
+    g_free (path);
+
+    return holders;
+}
+
+/*
+ * The peers to ask. Peers are pinged at most once per PEER_ALIVE_INTERVAL,
+ * all at once, so that a peer that is down costs one short timeout.
+ */
+static GList *
+get_live_peers (SeafPeerBlockManager *mgr)
+{
+    GList *alive = NULL, *unknown = NULL, *ptr;
+    GHashTable *replies;
+
+    get_available_peers (mgr, &alive, &unknown);
+    if (unknown) {
+        replies = request_peers (mgr, unknown, NULL, "/ping", NULL,
+                                 PEER_PROBE_TIMEOUT);
+        for (ptr = unknown; ptr; ptr = ptr->next) {
+            if (g_hash_table_contains (replies, ptr->data))
+                alive = g_list_prepend (alive, g_strdup (ptr->data));
+        }
+        g_hash_table_destroy (replies);
+        g_list_free_full (unknown, g_free);
+    }
+
+    return alive;
+}
+
+GList *
+seaf_peer_block_manager_fetch_blocks (SeafPeerBlockManager *mgr,
+                                      const char *repo_id,
+                                      const char *commit_id,
+                                      GList *block_ids,
+                                      PeerBlockFunc func,
+                                      void *user_data)
+{
+    GList *peers, *ptr, *remain = NULL;
+    GHashTable *holders, *down;
+    GByteArray *buf;
+    const char *block_id, *peer_url;
+    CURL *curl;
+    int rc;
+
+    if (!seaf_peer_block_manager_has_peers (mgr) || !block_ids ||
+        !commit_id || !is_object_id_valid (commit_id))
+        return block_ids;
+
+    peers = get_live_peers (mgr);
+    if (!peers)
+        return block_ids;
+
+    /* Only blocks that a peer has are asked for, the others are left to
+     * the server right away. */
+    holders = query_peer_blocks (mgr, peers, repo_id, commit_id, block_ids);
+    g_list_free_full (peers, g_free);
+    if (g_hash_table_size (holders) == 0) {
+        g_hash_table_destroy (holders);
+        return block_ids;
+    }
+
+    curl = curl_easy_init ();
+    curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT, PEER_CONNECT_TIMEOUT);
+    curl_easy_setopt (curl, CURLOPT_TIMEOUT, PEER_TIMEOUT);
+    curl_easy_setopt (curl, CURLOPT_NOPROXY, "*");
+    buf = g_byte_array_new ();
+    down = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (ptr = block_ids; ptr; ptr = ptr->next) {
+        block_id = ptr->data;
+        peer_url = g_hash_table_lookup (holders, block_id);
+        if (peer_url && !g_hash_table_contains (down, peer_url)) {
+            rc = get_block_from_peer (mgr, curl, peer_url, repo_id, commit_id,
+                                      block_id, buf);
+            if (rc == -2) {
+                mark_peer (mgr, peer_url, FALSE);
+                g_hash_table_add (down, (gpointer)peer_url);
+            } else if (rc == 0 &&
+                     func (block_id, buf->data, buf->len, user_data) == 0)
+                continue;
+            }
+        }
+        remain = g_list_prepend (remain, ptr->data);
+    }
+
+    g_hash_table_destroy (down);
+    g_byte_array_free (buf, TRUE);
+    curl_easy_cleanup (curl);
+    g_hash_table_destroy (holders);
+    g_list_free (block_ids);
+
+    return g_list_reverse (remain);
+}
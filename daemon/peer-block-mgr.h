@@ -0,0 +1,69 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_PEER_BLOCK_MGR_H
+#define SEAF_PEER_BLOCK_MGR_H
+
+#include <glib.h>
+
+/*
+ * Block sharing between clients on a LAN.
+ *
+ * When "peer_block_secret" is set, the daemon serves the blocks of its
+ * repos over HTTP on "peer_block_port" of its LAN addresses to the clients
+ * that know the secret, and tries the clients listed in "peer_block_peers"
+ * before the server when it downloads blocks. Peers are configured, not
+ * discovered.
+ *
+ * Before blocks are downloaded, all the peers are asked at once which of
+ * them they have, so blocks that no peer has cost a single round trip
+ * before they're got from the server. Peers are pinged in parallel at most
+ * once a minute, so that a peer that is down costs one short timeout.
+ *
+ * Requests are signed with a SHA256 HMAC keyed with the secret, over the
+ * request path, the time and a nonce, so they can't be replayed. Requests
+ * for a repo must also name one of its commits that the peer has, to
+ * prove access to the repo. Blocks received from peers are only used if
+ * they hash to the block id given by the server.
+ */
+
+struct _SeafileSession;
+struct _PeerBlockMgrPriv;
+
+typedef struct _SeafPeerBlockManager {
+    struct _SeafileSession *session;
+
+    struct _PeerBlockMgrPriv *priv;
+} SeafPeerBlockManager;
+
+SeafPeerBlockManager *
+seaf_peer_block_manager_new (struct _SeafileSession *session);
+
+int
+seaf_peer_block_manager_start (SeafPeerBlockManager *mgr);
+
+/* TRUE if peers are configured to download from. */
+gboolean
+seaf_peer_block_manager_has_peers (SeafPeerBlockManager *mgr);
+
+/* Called with a verified block. Returns -1 if it can't be stored. */
+typedef int (*PeerBlockFunc) (const char *block_id,
+                              const void *buf, int len,
+                              void *user_data);
+
+/*
+ * Try to get the blocks in @block_ids of @repo_id from the peers, in the
+ * download thread. @commit_id is a commit of the repo in the local store,
+ * it's shown to the peers as proof of access. @func is called for each
+ * block found.
+ * Returns the ids from @block_ids that are still needed; the list is
+ * consumed.
+ */
+GList *
+seaf_peer_block_manager_fetch_blocks (SeafPeerBlockManager *mgr,
+                                      const char *repo_id,
+                                      const char *commit_id,
+                                      GList *block_ids,
+                                      PeerBlockFunc func,
+                                      void *user_data);
+
+#endif
@@ -0,0 +1,90 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "rate-limiter.h"
+
+/* The bucket holds up to 1/BURST_DIVISOR second of data, but at least
+ * MIN_BURST_BYTES, so that small limits aren't dominated by rounding. */
+#define BURST_DIVISOR 10
+#define MIN_BURST_BYTES 4096
+
+struct _RateLimiter {
+    pthread_mutex_t lock;
+    double tokens;
+    gint64 last_refill;         /* monotonic time in microseconds */
+};
+
+RateLimiter *
+rate_limiter_new ()
+{
+    RateLimiter *limiter = g_new0 (RateLimiter, 1);
+
+    pthread_mutex_init (&limiter->lock, NULL);
+
+    return limiter;
+}
+
+void
+rate_limiter_free (RateLimiter *limiter)
+{
+    if (!limiter)
+        return;
+
+    pthread_mutex_destroy (&limiter->lock);
+    g_free (limiter);
+}
+
+/* Must be called with limiter->lock held. */
+static void
+refill (RateLimiter *limiter, gint64 limit)
+{
+    gint64 now = g_get_monotonic_time ();
+    double burst = MAX (limit / BURST_DIVISOR, MIN_BURST_BYTES);
+
+    if (limiter->last_refill == 0)
+        limiter->tokens = burst;
+    else
+        limiter->tokens += (double)(now - limiter->last_refill) * limit / G_USEC_PER_SEC;
+
+    if (limiter->tokens > burst)
+        limiter->tokens = burst;
+    limiter->last_refill = now;
+}
+
+void
+rate_limiter_consume (RateLimiter *limiter, gint64 limit, gint64 bytes)
+{
+    pthread_mutex_lock (&limiter->lock);
+
+    if (limit <= 0) {
+        /* Start with a full bucket when a limit is set again. */
+        limiter->last_refill = 0;
+    } else {
+        refill (limiter, limit);
+        limiter->tokens -= bytes;
+    }
+
+    pthread_mutex_unlock (&limiter->lock);
+}
+
+gint64
+rate_limiter_delay (RateLimiter *limiter, gint64 limit)
+{
+    gint64 delay = 0;
+
+    if (limit <= 0)
+        return 0;
+
+    pthread_mutex_lock (&limiter->lock);
+
+    refill (limiter, limit);
+    if (limiter->tokens < 0)
+        delay = (gint64)(-limiter->tokens * G_USEC_PER_SEC / limit) + 1;
+
+    pthread_mutex_unlock (&limiter->lock);
+
+    return delay;
+}
@@ -0,0 +1,36 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_RATE_LIMITER_H
+#define SEAF_RATE_LIMITER_H
+
+#include <glib.h>
+
+/*
+ * Token bucket shared by the threads transferring data under one limit.
+ *
+ * The bucket fills at the limit (in bytes per second) and holds at most
+ * a short burst. Transferred bytes are taken out after the fact, so the
+ * bucket may go into debt; callers wait with rate_limiter_delay() until the
+ * debt is paid off before transferring more.
+ *
+ * The limit is passed on every call, so that changes to it take effect
+ * immediately. A limit of 0 or less means unlimited.
+ */
+
+typedef struct _RateLimiter RateLimiter;
+
+RateLimiter *
+rate_limiter_new ();
+
+void
+rate_limiter_free (RateLimiter *limiter);
+
+/* Take @bytes transferred under @limit out of the bucket. */
+void
+rate_limiter_consume (RateLimiter *limiter, gint64 limit, gint64 bytes);
+
+/* Microseconds to wait before transferring more data, 0 if no need to. */
+gint64
+rate_limiter_delay (RateLimiter *limiter, gint64 limit);
+
+#endif
@@ -9,6 +9,10 @@
 #endif
 
 #include <pthread.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#endif
 
 #include "utils.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_SYNC
@@ -28,6 +32,14 @@
 #include "index/cache-tree.h"
 #include "diff-simple.h"
 #include "change-set.h"
+#include "sync-filter.h"
+#include "mem-budget.h"
+#include "timer.h"
+#include "commit-graph.h"
+#include "worker-pool.h"
+#include "startup-profile.h"
+#include "trace.h"
+#include "epoch.h"
 
 #include "db.h"
 
@@ -45,11 +57,17 @@
 #endif
 
 struct _SeafRepoManagerPriv {
+    /* Read without locks, in epoch read sections. A published table is
+     * never changed: writers hold repo_hash_lock and publish a modified
+     * copy. See publish_repo_hash(). */
     GHashTable *repo_hash;
+    pthread_mutex_t repo_hash_lock;
     sqlite3    *db;
     pthread_mutex_t db_lock;
+    /* Idle read-only connections. NULL if the db is not in WAL mode, then
+     * queries go to the writer connection under db_lock. */
+    GAsyncQueue *read_dbs;
     GHashTable *checkout_tasks_hash;
-    pthread_rwlock_t lock;
 
     GHashTable *user_perms;     /* repo_id -> folder user perms */
     GHashTable *group_perms;    /* repo_id -> folder group perms */
@@ -57,11 +75,65 @@ struct _SeafRepoManagerPriv {
 
     GAsyncQueue *lock_office_job_queue;
 
-    // sync_errors is used to record sync errors for which notifications have been sent to avoid repeated notifications of the same error.
-    GList *sync_errors;
+    gint repo_list_seq;
+    gint sync_errors_seq;
+
+    /* File sync errors, see send_file_sync_error_notification().
+     * Protected by errors_lock. */
     pthread_mutex_t errors_lock;
+    /* "repo_id/path" -> error id last notified for the path. */
+    GHashTable *notified_errors;
+    /* SyncErrorGroup by "repo_id/err_id/dir". */
+    GHashTable *error_groups;
+    /* SyncError rows waiting to be written, by "repo_id/path". */
+    GHashTable *pending_errors;
+    gint64 notify_window_start;
+    int n_notified_in_window;
+    SeafTimer *errors_timer;
+
+    /* repo_id -> CommitHistory, see seaf_repo_get_commits_page(). */
+    GHashTable *histories;
+    pthread_mutex_t history_lock;
+
+    /* Recent diff results, see diff_cache_lookup(). */
+    GHashTable *diff_cache;
+    GQueue diff_cache_lru;
+    pthread_mutex_t diff_cache_lock;
+
+    /* The file system integration that hydrates placeholders, see
+     * seaf_repo_manager_register_hydration_provider(). */
+    char *hydration_provider;
+    pthread_mutex_t hydration_lock;
 };
 
+#define READ_DB_POOL_SIZE 4
+
+/*
+ * Queries that only read the repo db use these, so that RPC threads don't
+ * block on db_lock while a long transaction is written. Reads see the last
+ * committed state, so they must not be used to read back uncommitted writes
+ * made under db_lock.
+ */
+static sqlite3 *
+acquire_read_db (SeafRepoManager *mgr)
+{
+    if (!mgr->priv->read_dbs) {
+        pthread_mutex_lock (&mgr->priv->db_lock);
+        return mgr->priv->db;
+    }
+    return g_async_queue_pop (mgr->priv->read_dbs);
+}
+
+static void
+release_read_db (SeafRepoManager *mgr, sqlite3 *db)
+{
+    if (!mgr->priv->read_dbs) {
+        pthread_mutex_unlock (&mgr->priv->db_lock);
+        return;
+    }
+    g_async_queue_push (mgr->priv->read_dbs, db);
+}
+
 static const char *ignore_table[] = {
     /* tmp files under Linux */
     "*~",
@@ -86,9 +158,6 @@ static GPatternSpec* office_temp_ignore_patterns[4];
 static GRegex *conflict_pattern = NULL;
 static GRegex *office_lock_pattern = NULL;
 
-static SeafRepo *
-load_repo (SeafRepoManager *manager, const char *repo_id);
-
 static void load_repos (SeafRepoManager *manager, const char *seaf_dir);
 static void seaf_repo_manager_del_repo_property (SeafRepoManager *manager,
                                                  const char *repo_id);
@@ -137,6 +206,7 @@ seaf_repo_manager_get_locked_file_set (SeafRepoManager *mgr, const char *repo_id
     GHashTable *locked_files = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                       g_free,
                                                       (GDestroyNotify)locked_file_free);
+    sqlite3 *db;
     char sql[256];
 
     sqlite3_snprintf (sizeof(sql), sql,
@@ -144,13 +214,13 @@ seaf_repo_manager_get_locked_file_set (SeafRepoManager *mgr, const char *repo_id
                       "WHERE repo_id = '%q'",
                       repo_id);
 
-    pthread_mutex_lock (&mgr->priv->db_lock);
+    db = acquire_read_db (mgr);
 
     /* Ingore database error. We return an empty set on error. */
-    sqlite_foreach_selected_row (mgr->priv->db, sql,
+    sqlite_foreach_selected_row (db, sql,
                                  load_locked_file, locked_files);
 
-    pthread_mutex_unlock (&mgr->priv->db_lock);
+    release_read_db (mgr, db);
 
     LockedFileSet *ret = g_new0 (LockedFileSet, 1);
     ret->mgr = mgr;
@@ -291,6 +361,157 @@ locked_file_set_lookup (LockedFileSet *fset, const char *path)
     return (LockedFile *) g_hash_table_lookup (fset->locked_files, path);
 }
 
+/*
+ * Placeholders of on-demand repos.
+ *
+ * A placeholder is a sparse file with the size and mtime of the file in
+ * the repo, but no content. Its record keeps the file id until the file
+ * is hydrated. A placeholder whose size or mtime has changed has been
+ * written by the user, and is a normal file from then on.
+ */
+
+typedef struct PlaceholderFile {
+    char file_id[41];
+    gint64 mtime;
+    gint64 size;
+    guint32 mode;
+} PlaceholderFile;
+
+static gboolean
+placeholder_is_untouched (PlaceholderFile *ph, SeafStat *st)
+{
+    return (ph && S_ISREG(st->st_mode) &&
+            st->st_mtime == ph->mtime && st->st_size == ph->size);
+}
+
+static gboolean
+load_placeholder (sqlite3_stmt *stmt, void *data)
+{
+    GHashTable *ret = data;
+    PlaceholderFile *ph;
+    const char *path, *file_id;
+
+    path = (const char *)sqlite3_column_text (stmt, 0);
+    file_id = (const char *)sqlite3_column_text (stmt, 1);
+    if (!path || !file_id)
+        return TRUE;
+
+    ph = g_new0 (PlaceholderFile, 1);
+    g_strlcpy (ph->file_id, file_id, sizeof(ph->file_id));
+    ph->mtime = sqlite3_column_int64 (stmt, 2);
+    ph->size = sqlite3_column_int64 (stmt, 3);
+    ph->mode = (guint32)sqlite3_column_int (stmt, 4);
+
+    g_hash_table_insert (ret, g_strdup(path), ph);
+
+    return TRUE;
+}
+
+/* Returns path -> PlaceholderFile for all placeholders in the repo, or
+ * only for @path if it's not NULL. */
+static GHashTable *
+load_placeholders (SeafRepoManager *mgr, const char *repo_id, const char *path)
+{
+    GHashTable *placeholders = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                      g_free, g_free);
+    sqlite3 *db;
+    char *sql;
+
+    if (path)
+        sql = sqlite3_mprintf ("SELECT path, file_id, mtime, size, mode "
+                               "FROM PlaceholderFiles "
+                               "WHERE repo_id = %Q AND path = %Q",
+                               repo_id, path);
+    else
+        sql = sqlite3_mprintf ("SELECT path, file_id, mtime, size, mode "
+                               "FROM PlaceholderFiles WHERE repo_id = %Q",
+                               repo_id);
+
+    db = acquire_read_db (mgr);
+
+    /* Ignore database error. We return an empty set on error. */
+    sqlite_foreach_selected_row (db, sql, load_placeholder, placeholders);
+
+    release_read_db (mgr, db);
+    sqlite3_free (sql);
+
+    return placeholders;
+}
+
+static int
+save_placeholder (SeafRepoManager *mgr, const char *repo_id,
+                  const char *path, const char *file_id,
+                  gint64 mtime, gint64 size, guint32 mode)
+{
+    sqlite3_stmt *stmt;
+    int ret = 0;
+
+    pthread_mutex_lock (&mgr->priv->db_lock);
+
+    stmt = sqlite_query_prepare (mgr->priv->db,
+                                 "REPLACE INTO PlaceholderFiles "
+                                 "VALUES (?, ?, ?, ?, ?, ?)");
+    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (stmt, 2, path, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (stmt, 3, file_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64 (stmt, 4, mtime);
+    sqlite3_bind_int64 (stmt, 5, size);
+    sqlite3_bind_int (stmt, 6, (int)mode);
+    if (sqlite3_step (stmt) != SQLITE_DONE) {
+        seaf_warning ("Failed to save placeholder %s to db: %s.\n",
+                      path, sqlite3_errmsg (mgr->priv->db));
+        ret = -1;
+    }
+    sqlite3_finalize (stmt);
+
+    pthread_mutex_unlock (&mgr->priv->db_lock);
+
+    return ret;
+}
+
+static void
+remove_placeholder (SeafRepoManager *mgr, const char *repo_id, const char *path)
+{
+    char *sql;
+
+    pthread_mutex_lock (&mgr->priv->db_lock);
+
+    sql = sqlite3_mprintf ("DELETE FROM PlaceholderFiles "
+                           "WHERE repo_id = %Q AND path = %Q",
+                           repo_id, path);
+    sqlite_query_exec (mgr->priv->db, sql);
+    sqlite3_free (sql);
+
+    pthread_mutex_unlock (&mgr->priv->db_lock);
+}
+
+/* Moves the records of @old_path and of the files under it to @new_path,
+ * so that a renamed placeholder can still be hydrated. */
+static void
+rename_placeholders (SeafRepoManager *mgr, const char *repo_id,
+                     const char *old_path, const char *new_path)
+{
+    char *prefix, *sql;
+
+    prefix = g_strconcat (old_path, "/", NULL);
+
+    pthread_mutex_lock (&mgr->priv->db_lock);
+
+    /* substr() and length() count characters, not bytes. */
+    sql = sqlite3_mprintf ("UPDATE PlaceholderFiles "
+                           "SET path = %Q || substr(path, length(%Q) + 1) "
+                           "WHERE repo_id = %Q AND "
+                           "(path = %Q OR substr(path, 1, length(%Q)) = %Q)",
+                           new_path, old_path, repo_id,
+                           old_path, prefix, prefix);
+    sqlite_query_exec (mgr->priv->db, sql);
+    sqlite3_free (sql);
+
+    pthread_mutex_unlock (&mgr->priv->db_lock);
+
+    g_free (prefix);
+}
+
 /* Folder permissions. */
 
 FolderPerm *
@@ -437,6 +658,8 @@ seaf_repo_manager_delete_folder_perm (SeafRepoManager *mgr,
     delete_folder_perm (mgr, repo_id, type, perm);
     pthread_mutex_unlock (&mgr->priv->perm_lock);
 
+    seaf_sync_manager_bump_status_seq (seaf->sync_mgr);
+
     return 0;
 }
 
@@ -547,55 +770,97 @@ seaf_repo_manager_update_folder_perm (SeafRepoManager *mgr,
     }
     pthread_mutex_unlock (&mgr->priv->perm_lock);
 
+    seaf_sync_manager_bump_status_seq (seaf->sync_mgr);
+
     return 0;
 }
 
-int
-seaf_repo_manager_update_folder_perms (SeafRepoManager *mgr,
-                                       const char *repo_id,
-                                       FolderPermType type,
-                                       GList *folder_perms)
+/*
+ * Compare the sorted lists @old and @new. Perms that are only in @old, or
+ * whose permission changed, are put in @removed; perms that are only in
+ * @new, or changed, are put in @added. Returns TRUE if the lists differ.
+ */
+static gboolean
+diff_folder_perms (GList *old, GList *new, GList **removed, GList **added)
+{
+    FolderPerm *o, *n;
+    int cmp;
+
+    while (old || new) {
+        o = old ? old->data : NULL;
+        n = new ? new->data : NULL;
+        cmp = !o ? 1 : (!n ? -1 : comp_folder_perms (o, n));
+
+        if (cmp < 0) {
+            *removed = g_list_prepend (*removed, o);
+            old = old->next;
+        } else if (cmp > 0) {
+            *added = g_list_prepend (*added, n);
+            new = new->next;
+        } else {
+            if (g_strcmp0 (o->permission, n->permission) != 0) {
+                *removed = g_list_prepend (*removed, o);
+                *added = g_list_prepend (*added, n);
+            }
+            old = old->next;
+            new = new->next;
+        }
+    }
+
+    return (*removed != NULL || *added != NULL);
+}
+
+static int
+apply_folder_perm_changes (SeafRepoManager *mgr,
+                           const char *repo_id,
+                           FolderPermType type,
+                           GList *removed,
+                           GList *added)
 {
     char *sql;
     sqlite3_stmt *stmt;
     GList *ptr;
     FolderPerm *perm;
-
-    g_return_val_if_fail ((type == FOLDER_PERM_TYPE_USER ||
-                           type == FOLDER_PERM_TYPE_GROUP),
-                          -1);
-
-    /* Update db. */
-
-    pthread_mutex_lock (&mgr->priv->db_lock);
+    int ret = 0;
 
     if (type == FOLDER_PERM_TYPE_USER)
-        sql = "DELETE FROM FolderUserPerms WHERE repo_id = ?";
+        sql = "DELETE FROM FolderUserPerms WHERE repo_id = ? AND path = ?";
     else
-        sql = "DELETE FROM FolderGroupPerms WHERE repo_id = ?";
+        sql = "DELETE FROM FolderGroupPerms WHERE repo_id = ? AND path = ?";
     stmt = sqlite_query_prepare (mgr->priv->db, sql);
-    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
-    if (sqlite3_step (stmt) != SQLITE_DONE) {
-        seaf_warning ("Failed to remove folder perms for %.8s: %s.\n",
-                      repo_id, sqlite3_errmsg (mgr->priv->db));
-        sqlite3_finalize (stmt);
-        pthread_mutex_unlock (&mgr->priv->db_lock);
+    if (!stmt)
         return -1;
+
+    for (ptr = removed; ptr; ptr = ptr->next) {
+        perm = ptr->data;
+
+        sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 2, perm->path, -1, SQLITE_TRANSIENT);
+
+        if (sqlite3_step (stmt) != SQLITE_DONE) {
+            seaf_warning ("Failed to remove folder perms for %.8s: %s.\n",
+                          repo_id, sqlite3_errmsg (mgr->priv->db));
+            ret = -1;
+            break;
+        }
+
+        sqlite3_reset (stmt);
+        sqlite3_clear_bindings (stmt);
     }
     sqlite3_finalize (stmt);
 
-    if (!folder_perms) {
-        pthread_mutex_unlock (&mgr->priv->db_lock);
-        return 0;
-    }
+    if (ret < 0 || !added)
+        return ret;
 
     if (type == FOLDER_PERM_TYPE_USER)
         sql = "INSERT INTO FolderUserPerms VALUES (?, ?, ?)";
     else
         sql = "INSERT INTO FolderGroupPerms VALUES (?, ?, ?)";
     stmt = sqlite_query_prepare (mgr->priv->db, sql);
+    if (!stmt)
+        return -1;
 
-    for (ptr = folder_perms; ptr; ptr = ptr->next) {
+    for (ptr = added; ptr; ptr = ptr->next) {
         perm = ptr->data;
 
         sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
@@ -605,39 +870,83 @@ seaf_repo_manager_update_folder_perms (SeafRepoManager *mgr,
         if (sqlite3_step (stmt) != SQLITE_DONE) {
             seaf_warning ("Failed to insert folder perms for %.8s: %s.\n",
                           repo_id, sqlite3_errmsg (mgr->priv->db));
-            sqlite3_finalize (stmt);
-            pthread_mutex_unlock (&mgr->priv->db_lock);
-            return -1;
+            ret = -1;
+            break;
         }
 
         sqlite3_reset (stmt);
         sqlite3_clear_bindings (stmt);
     }
-
     sqlite3_finalize (stmt);
 
-    pthread_mutex_unlock (&mgr->priv->db_lock);
+    return ret;
+}
 
-    /* Update in memory */
+/*
+ * The new perms are compared with the cached ones, and only the rows that
+ * changed are written, in one transaction. Usually nothing changed and the
+ * db is not touched at all.
+ */
+int
+seaf_repo_manager_update_folder_perms (SeafRepoManager *mgr,
+                                       const char *repo_id,
+                                       FolderPermType type,
+                                       GList *folder_perms)
+{
+    GHashTable *perms_hash;
     GList *new, *old;
+    GList *removed = NULL, *added = NULL;
+    int ret = 0;
+
+    g_return_val_if_fail ((type == FOLDER_PERM_TYPE_USER ||
+                           type == FOLDER_PERM_TYPE_GROUP),
+                          -1);
+
     new = folder_perm_list_copy (folder_perms);
     new = g_list_sort (new, comp_folder_perms);
 
+    if (type == FOLDER_PERM_TYPE_USER)
+        perms_hash = mgr->priv->user_perms;
+    else
+        perms_hash = mgr->priv->group_perms;
+
+    /* Lock order is db_lock, then perm_lock. Holding db_lock keeps other
+     * writers from changing the cache while the db is updated.
+     */
+    pthread_mutex_lock (&mgr->priv->db_lock);
     pthread_mutex_lock (&mgr->priv->perm_lock);
-    if (type == FOLDER_PERM_TYPE_USER) {
-        old = g_hash_table_lookup (mgr->priv->user_perms, repo_id);
-        if (old)
-            g_list_free_full (old, (GDestroyNotify)folder_perm_free);
-        g_hash_table_insert (mgr->priv->user_perms, g_strdup(repo_id), new);
-    } else if (type == FOLDER_PERM_TYPE_GROUP) {
-        old = g_hash_table_lookup (mgr->priv->group_perms, repo_id);
-        if (old)
-            g_list_free_full (old, (GDestroyNotify)folder_perm_free);
-        g_hash_table_insert (mgr->priv->group_perms, g_strdup(repo_id), new);
+
+    old = g_hash_table_lookup (perms_hash, repo_id);
+    if (!diff_folder_perms (old, new, &removed, &added)) {
+        pthread_mutex_unlock (&mgr->priv->perm_lock);
+        pthread_mutex_unlock (&mgr->priv->db_lock);
+        g_list_free_full (new, (GDestroyNotify)folder_perm_free);
+        return 0;
+    }
+
+    sqlite_begin_transaction (mgr->priv->db);
+    ret = apply_folder_perm_changes (mgr, repo_id, type, removed, added);
+    if (ret < 0) {
+        sqlite_query_exec (mgr->priv->db, "ROLLBACK TRANSACTION;");
+        g_list_free_full (new, (GDestroyNotify)folder_perm_free);
+        goto out;
     }
+    sqlite_end_transaction (mgr->priv->db);
+
+    /* Update in memory */
+    if (old)
+        g_list_free_full (old, (GDestroyNotify)folder_perm_free);
+    g_hash_table_insert (perms_hash, g_strdup(repo_id), new);
+
+    seaf_sync_manager_bump_status_seq (seaf->sync_mgr);
+
+out:
     pthread_mutex_unlock (&mgr->priv->perm_lock);
+    pthread_mutex_unlock (&mgr->priv->db_lock);
+    g_list_free (removed);
+    g_list_free (added);
 
-    return 0;
+    return ret;
 }
 
 static gboolean
@@ -661,6 +970,7 @@ load_folder_perms_for_repo (SeafRepoManager *mgr,
                             FolderPermType type)
 {
     GList *perms = NULL;
+    sqlite3 *db;
     char sql[256];
 
     g_return_val_if_fail ((type == FOLDER_PERM_TYPE_USER ||
@@ -678,11 +988,11 @@ load_folder_perms_for_repo (SeafRepoManager *mgr,
                           "WHERE repo_id = '%q'",
                           repo_id);
 
-    pthread_mutex_lock (&mgr->priv->db_lock);
+    db = acquire_read_db (mgr);
 
-    if (sqlite_foreach_selected_row (mgr->priv->db, sql,
+    if (sqlite_foreach_selected_row (db, sql,
                                      load_folder_perm, &perms) < 0) {
-        pthread_mutex_unlock (&mgr->priv->db_lock);
+        release_read_db (mgr, db);
         GList *ptr;
         for (ptr = perms; ptr; ptr = ptr->next)
             folder_perm_free ((FolderPerm *)ptr->data);
@@ -690,7 +1000,7 @@ load_folder_perms_for_repo (SeafRepoManager *mgr,
         return NULL;
     }
 
-    pthread_mutex_unlock (&mgr->priv->db_lock);
+    release_read_db (mgr, db);
 
     /* Sort list in descending order by perm->path (longer path first). */
     perms = g_list_sort (perms, comp_folder_perms);
@@ -777,6 +1087,7 @@ gint64
 seaf_repo_manager_get_folder_perm_timestamp (SeafRepoManager *mgr,
                                              const char *repo_id)
 {
+    sqlite3 *db;
     char sql[256];
     gint64 ret;
 
@@ -784,11 +1095,11 @@ seaf_repo_manager_get_folder_perm_timestamp (SeafRepoManager *mgr,
                       "SELECT timestamp FROM FolderPermTimestamp WHERE repo_id = '%q'",
                       repo_id);
 
-    pthread_mutex_lock (&mgr->priv->db_lock);
+    db = acquire_read_db (mgr);
 
-    ret = sqlite_get_int64 (mgr->priv->db, sql);
+    ret = sqlite_get_int64 (db, sql);
 
-    pthread_mutex_unlock (&mgr->priv->db_lock);
+    release_read_db (mgr, db);
 
     return ret;
 }
@@ -886,63 +1197,137 @@ is_repo_id_valid (const char *id)
  * But since we have to store the errors in repo database, we have to put the code here.
  */
 
-int
-seaf_repo_manager_record_sync_error (const char *repo_id,
-                                     const char *repo_name,
-                                     const char *path,
-                                     int error_id)
+struct _SyncError {
+    char *repo_id;
+    char *repo_name;
+    char *path;
+    int err_id;
+    gint64 timestamp;
+};
+typedef struct _SyncError SyncError;
+
+static void
+sync_error_free (SyncError *err)
 {
-    char *sql;
-    int ret;
+    g_free (err->repo_id);
+    g_free (err->repo_name);
+    g_free (err->path);
+    g_free (err);
+}
 
-    pthread_mutex_lock (&seaf->repo_mgr->priv->db_lock);
+static int
+write_sync_error (sqlite3 *db, SyncError *err)
+{
+    sqlite3_stmt *stmt;
+    int ret = 0;
 
-    if (path != NULL)
-        sql = sqlite3_mprintf ("DELETE FROM FileSyncError WHERE repo_id='%q' AND path='%q'",
-                               repo_id, path);
+    if (err->path != NULL)
+        stmt = sqlite_query_prepare_cached (db, "DELETE FROM FileSyncError "
+                                            "WHERE repo_id=? AND path=?");
     else
-        sql = sqlite3_mprintf ("DELETE FROM FileSyncError WHERE repo_id='%q' AND path IS NULL",
-                               repo_id);
-    ret = sqlite_query_exec (seaf->repo_mgr->priv->db, sql);
-    sqlite3_free (sql);
+        stmt = sqlite_query_prepare_cached (db, "DELETE FROM FileSyncError "
+                                            "WHERE repo_id=? AND path IS NULL");
+    if (!stmt)
+        return -1;
+    sqlite3_bind_text (stmt, 1, err->repo_id, -1, SQLITE_TRANSIENT);
+    if (err->path != NULL)
+        sqlite3_bind_text (stmt, 2, err->path, -1, SQLITE_TRANSIENT);
+    if (sqlite3_step (stmt) != SQLITE_DONE)
+        ret = -1;
+    sqlite_query_release (stmt);
     if (ret < 0)
-        goto out;
+        return -1;
 
     /* REPLACE INTO will update the primary key id automatically.
      * So new errors are always on top.
      */
-    if (path != NULL)
-        sql = sqlite3_mprintf ("INSERT INTO FileSyncError "
-                               "(repo_id, repo_name, path, err_id, timestamp) "
-                               "VALUES ('%q', '%q', '%q', %d, %lld)",
-                               repo_id, repo_name, path, error_id, (gint64)time(NULL));
+    stmt = sqlite_query_prepare_cached (db, "INSERT INTO FileSyncError "
+                                        "(repo_id, repo_name, path, err_id, timestamp) "
+                                        "VALUES (?, ?, ?, ?, ?)");
+    if (!stmt)
+        return -1;
+    sqlite3_bind_text (stmt, 1, err->repo_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (stmt, 2, err->repo_name, -1, SQLITE_TRANSIENT);
+    if (err->path != NULL)
+        sqlite3_bind_text (stmt, 3, err->path, -1, SQLITE_TRANSIENT);
     else
-        sql = sqlite3_mprintf ("INSERT INTO FileSyncError "
-                               "(repo_id, repo_name, err_id, timestamp) "
-                               "VALUES ('%q', '%q', %d, %lld)",
-                               repo_id, repo_name, error_id, (gint64)time(NULL));
-        
-    ret = sqlite_query_exec (seaf->repo_mgr->priv->db, sql);
-    sqlite3_free (sql);
+        sqlite3_bind_null (stmt, 3);
+    sqlite3_bind_int (stmt, 4, err->err_id);
+    sqlite3_bind_int64 (stmt, 5, err->timestamp);
+    if (sqlite3_step (stmt) != SQLITE_DONE)
+        ret = -1;
+    sqlite_query_release (stmt);
 
-out:
-    pthread_mutex_unlock (&seaf->repo_mgr->priv->db_lock);
     return ret;
 }
 
-static gboolean
-collect_file_sync_errors (sqlite3_stmt *stmt, void *data)
+/* Write @errors in one transaction, i.e. one commit. */
+static int
+write_sync_errors (GList *errors)
 {
-    GList **pret = data;
-    const char *repo_id, *repo_name, *path;
-    int id, err_id;
-    gint64 timestamp;
-    SeafileFileSyncError *error;
+    sqlite3 *db = seaf->repo_mgr->priv->db;
+    GList *ptr;
+    SyncError *err = NULL;
+    int ret = 0;
 
-    id = sqlite3_column_int (stmt, 0);
-    repo_id = (const char *)sqlite3_column_text (stmt, 1);
-    repo_name = (const char *)sqlite3_column_text (stmt, 2);
-    path = (const char *)sqlite3_column_text (stmt, 3);
+    if (!errors)
+        return 0;
+
+    pthread_mutex_lock (&seaf->repo_mgr->priv->db_lock);
+
+    sqlite_begin_transaction (db);
+
+    for (ptr = errors; ptr; ptr = ptr->next) {
+        err = ptr->data;
+        if (write_sync_error (db, err) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret < 0) {
+        seaf_warning ("Failed to record sync error for %.8s: %s.\n",
+                      err->repo_id, sqlite3_errmsg (db));
+        sqlite_query_exec (db, "ROLLBACK TRANSACTION;");
+    } else {
+        sqlite_end_transaction (db);
+        g_atomic_int_inc (&seaf->repo_mgr->priv->sync_errors_seq);
+    }
+    pthread_mutex_unlock (&seaf->repo_mgr->priv->db_lock);
+    return ret;
+}
+
+int
+seaf_repo_manager_record_sync_error (const char *repo_id,
+                                     const char *repo_name,
+                                     const char *path,
+                                     int error_id)
+{
+    SyncError err;
+    GList list = { &err, NULL, NULL };
+
+    err.repo_id = (char *)repo_id;
+    err.repo_name = (char *)repo_name;
+    err.path = (char *)path;
+    err.err_id = error_id;
+    err.timestamp = (gint64)time(NULL);
+
+    return write_sync_errors (&list);
+}
+
+static gboolean
+collect_file_sync_errors (sqlite3_stmt *stmt, void *data)
+{
+    GList **pret = data;
+    const char *repo_id, *repo_name, *path;
+    int id, err_id;
+    gint64 timestamp;
+    SeafileFileSyncError *error;
+
+    id = sqlite3_column_int (stmt, 0);
+    repo_id = (const char *)sqlite3_column_text (stmt, 1);
+    repo_name = (const char *)sqlite3_column_text (stmt, 2);
+    path = (const char *)sqlite3_column_text (stmt, 3);
     err_id = sqlite3_column_int (stmt, 4);
     timestamp = sqlite3_column_int64 (stmt, 5);
 
@@ -974,25 +1359,46 @@ seaf_repo_manager_del_file_sync_error_by_id (SeafRepoManager *mgr, int id)
 
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
+    g_atomic_int_inc (&mgr->priv->sync_errors_seq);
+
     return ret;
 }
 
+void
+seaf_repo_manager_bump_repo_list_seq (SeafRepoManager *mgr)
+{
+    g_atomic_int_inc (&mgr->priv->repo_list_seq);
+}
+
+int
+seaf_repo_manager_get_repo_list_seq (SeafRepoManager *mgr)
+{
+    return g_atomic_int_get (&mgr->priv->repo_list_seq);
+}
+
+int
+seaf_repo_manager_get_sync_errors_seq (SeafRepoManager *mgr)
+{
+    return g_atomic_int_get (&mgr->priv->sync_errors_seq);
+}
+
 GList *
 seaf_repo_manager_get_file_sync_errors (SeafRepoManager *mgr, int offset, int limit)
 {
     GList *ret = NULL;
+    sqlite3 *db;
     char *sql;
 
-    pthread_mutex_lock (&mgr->priv->db_lock);
+    db = acquire_read_db (mgr);
 
     sql = sqlite3_mprintf ("SELECT id, repo_id, repo_name, path, err_id, timestamp FROM "
                            "FileSyncError ORDER BY id DESC LIMIT %d OFFSET %d",
                            limit, offset);
-    sqlite_foreach_selected_row (mgr->priv->db, sql,
+    sqlite_foreach_selected_row (db, sql,
                                  collect_file_sync_errors, &ret);
     sqlite3_free (sql);
 
-    pthread_mutex_unlock (&mgr->priv->db_lock);
+    release_read_db (mgr, db);
 
     ret = g_list_reverse (ret);
 
@@ -1001,22 +1407,60 @@ seaf_repo_manager_get_file_sync_errors (SeafRepoManager *mgr, int offset, int li
 
 /*
  * Record file-level sync errors and send system notification.
+ *
+ * When many files fail for the same reason, e.g. a read-only or locked
+ * folder, the errors are aggregated by repo, error id and parent dir:
+ *
+ * - The first error of a group is notified right away. The others are
+ *   counted and notified together, as one notification for the dir with
+ *   a "count", at most once every SYNC_ERROR_NOTIFY_INTERVAL. At most
+ *   MAX_NOTIFICATIONS_PER_WINDOW notifications are sent per interval in
+ *   total; the others wait for the next one.
+ * - Only the first MAX_RECORDED_ERRORS_PER_GROUP files of a group are
+ *   recorded in the db. The rows are written in batches, one transaction
+ *   every SYNC_ERRORS_FLUSH_INTERVAL or every SYNC_ERRORS_BATCH rows.
+ *
+ * A group is forgotten when it has had no new errors for
+ * SYNC_ERROR_GROUP_TTL seconds.
  */
 
-struct _SyncError {
+#define SYNC_ERRORS_FLUSH_INTERVAL 2000 /* 2 seconds */
+#define SYNC_ERRORS_BATCH 200
+#define SYNC_ERROR_NOTIFY_INTERVAL 10
+#define MAX_NOTIFICATIONS_PER_WINDOW 10
+#define MAX_RECORDED_ERRORS_PER_GROUP 100
+#define SYNC_ERROR_GROUP_TTL 600
+
+typedef struct SyncErrorGroup {
     char *repo_id;
     char *repo_name;
-    char *path;
+    char *dir;                  /* NULL for errors of the repo */
     int err_id;
-    gint64 timestamp;
-};
-typedef struct _SyncError SyncError;
+    /* Paths of the files in the group, each counted once. */
+    GHashTable *files;
+    int n_files;
+    /* Files that failed since the last notification. */
+    int n_unnotified;
+    gint64 last_notify;
+    gint64 last_error;
+} SyncErrorGroup;
 
-void
-send_sync_error_notification (const char *repo_id,
-                              const char *repo_name,
-                              const char *path,
-                              int err_id)
+static void
+sync_error_group_free (SyncErrorGroup *group)
+{
+    g_free (group->repo_id);
+    g_free (group->repo_name);
+    g_free (group->dir);
+    g_hash_table_destroy (group->files);
+    g_free (group);
+}
+
+static void
+send_sync_error_notification_full (const char *repo_id,
+                                   const char *repo_name,
+                                   const char *path,
+                                   int err_id,
+                                   int count)
 {
     json_t *object;
     char *str;
@@ -1026,6 +1470,8 @@ send_sync_error_notification (const char *repo_id,
     json_object_set_new (object, "repo_name", json_string(repo_name));
     json_object_set_new (object, "path", json_string(path));
     json_object_set_new (object, "err_id", json_integer(err_id));
+    if (count > 1)
+        json_object_set_new (object, "count", json_integer(count));
 
     str = json_dumps (object, 0);
 
@@ -1035,49 +1481,170 @@ send_sync_error_notification (const char *repo_id,
 
     free (str);
     json_decref (object);
+}
+
+void
+send_sync_error_notification (const char *repo_id,
+                              const char *repo_name,
+                              const char *path,
+                              int err_id)
+{
+    send_sync_error_notification_full (repo_id, repo_name, path, err_id, 1);
+}
+
+/* Called with errors_lock held. */
+static gboolean
+notification_allowed (SeafRepoManagerPriv *priv, gint64 now)
+{
+    if (now - priv->notify_window_start >= SYNC_ERROR_NOTIFY_INTERVAL) {
+        priv->notify_window_start = now;
+        priv->n_notified_in_window = 0;
+    }
+
+    if (priv->n_notified_in_window >= MAX_NOTIFICATIONS_PER_WINDOW)
+        return FALSE;
+
+    ++priv->n_notified_in_window;
+    return TRUE;
+}
+
+/* Called with errors_lock held. Returns the group of the error. */
+static SyncErrorGroup *
+add_to_error_group (SeafRepoManagerPriv *priv,
+                    const char *repo_id,
+                    const char *repo_name,
+                    const char *path,
+                    int err_id,
+                    gint64 now)
+{
+    SyncErrorGroup *group;
+    char *dir = NULL, *key;
+
+    if (path) {
+        dir = g_path_get_dirname (path);
+        if (strcmp (dir, ".") == 0) {
+            g_free (dir);
+            dir = g_strdup ("");
+        }
+    }
+
+    key = g_strdup_printf ("%s/%d/%s", repo_id, err_id, dir ? dir : "");
+    group = g_hash_table_lookup (priv->error_groups, key);
+    if (!group) {
+        group = g_new0 (SyncErrorGroup, 1);
+        group->repo_id = g_strdup (repo_id);
+        group->repo_name = g_strdup (repo_name);
+        group->dir = dir;
+        group->err_id = err_id;
+        group->files = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, NULL);
+        g_hash_table_insert (priv->error_groups, key, group);
+    } else {
+        g_free (dir);
+        g_free (key);
+    }
+
+    if (!g_hash_table_contains (group->files, path ? path : "")) {
+        g_hash_table_add (group->files, g_strdup (path ? path : ""));
+        ++group->n_files;
+    }
+    group->last_error = now;
+    return group;
+}
+
+/* Called with errors_lock held. Takes the pending rows out. */
+static GList *
+take_pending_errors (SeafRepoManagerPriv *priv)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GList *errors = NULL;
 
+    g_hash_table_iter_init (&iter, priv->pending_errors);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        errors = g_list_prepend (errors, value);
+        g_hash_table_iter_steal (&iter);
+        g_free (key);
+    }
+
+    return errors;
 }
 
 static void
-check_and_send_notification (SeafRepoManager *mgr,
-                             const char *repo_id,
-                             const char *repo_name,
-                             const char *path,
-                             int err_id)
+flush_sync_errors (SeafRepoManager *mgr)
 {
-    GList *errors = mgr->priv->sync_errors, *ptr;
-    SyncError *err, *new_err;
-    gboolean found = FALSE;
+    GList *errors;
 
     pthread_mutex_lock (&mgr->priv->errors_lock);
+    errors = take_pending_errors (mgr->priv);
+    pthread_mutex_unlock (&mgr->priv->errors_lock);
 
-    for (ptr = errors; ptr; ptr = ptr->next) {
-        err = ptr->data;
-        if (g_strcmp0 (err->repo_id, repo_id) == 0 &&
-            g_strcmp0 (err->path, path) == 0) {
-            found = TRUE;
-            if (err->err_id != err_id) {
-                err->err_id = err_id;
-                send_sync_error_notification (repo_id, repo_name, path, err_id);
-            }
-            err->timestamp = (gint64)time(NULL);
-            break;
+    write_sync_errors (errors);
+    g_list_free_full (errors, (GDestroyNotify)sync_error_free);
+}
+
+typedef struct GroupNotification {
+    char *repo_id;
+    char *repo_name;
+    char *dir;
+    int err_id;
+    int count;
+} GroupNotification;
+
+static int
+sync_errors_pulse (void *vmgr)
+{
+    SeafRepoManager *mgr = vmgr;
+    SeafRepoManagerPriv *priv = mgr->priv;
+    GHashTableIter iter;
+    gpointer key, value;
+    SyncErrorGroup *group;
+    GroupNotification *n;
+    GList *notifications = NULL, *ptr;
+    gint64 now = (gint64)time(NULL);
+
+    flush_sync_errors (mgr);
+
+    pthread_mutex_lock (&priv->errors_lock);
+
+    g_hash_table_iter_init (&iter, priv->error_groups);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        group = value;
+
+        if (group->n_unnotified > 0 &&
+            now - group->last_notify >= SYNC_ERROR_NOTIFY_INTERVAL &&
+            notification_allowed (priv, now)) {
+            n = g_new0 (GroupNotification, 1);
+            n->repo_id = g_strdup (group->repo_id);
+            n->repo_name = g_strdup (group->repo_name);
+            n->dir = g_strdup (group->dir);
+            n->err_id = group->err_id;
+            n->count = group->n_unnotified;
+            notifications = g_list_prepend (notifications, n);
+
+            group->n_unnotified = 0;
+            group->last_notify = now;
         }
+
+        if (group->n_unnotified == 0 &&
+            now - group->last_error >= SYNC_ERROR_GROUP_TTL)
+            g_hash_table_iter_remove (&iter);
     }
 
-    if (!found) {
-        new_err = g_new0 (SyncError, 1);
-        new_err->repo_id = g_strdup(repo_id);
-        new_err->repo_name = g_strdup(repo_name);
-        new_err->path = g_strdup(path);
-        new_err->err_id = err_id;
-        new_err->timestamp = (gint64)time(NULL);
-        mgr->priv->sync_errors = g_list_prepend (mgr->priv->sync_errors, new_err);
+    pthread_mutex_unlock (&priv->errors_lock);
 
-        send_sync_error_notification (repo_id, repo_name, path, err_id);
+    for (ptr = notifications; ptr; ptr = ptr->next) {
+        n = ptr->data;
+        send_sync_error_notification_full (n->repo_id, n->repo_name, n->dir,
+                                           n->err_id, n->count);
+        g_free (n->repo_id);
+        g_free (n->repo_name);
+        g_free (n->dir);
+        g_free (n);
     }
+    g_list_free (notifications);
 
-    pthread_mutex_unlock (&mgr->priv->errors_lock);
+    return TRUE;
 }
 
 void
@@ -1086,6 +1653,15 @@ send_file_sync_error_notification (const char *repo_id,
                                    const char *path,
                                    int err_id)
 {
+    SeafRepoManagerPriv *priv = seaf->repo_mgr->priv;
+    SyncErrorGroup *group;
+    SyncError *err;
+    char *key;
+    gpointer notified;
+    gboolean changed, notify_now = FALSE;
+    int n_pending;
+    gint64 now = (gint64)time(NULL);
+
     if (!repo_name) {
         SeafRepo *repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
         if (!repo)
@@ -1093,11 +1669,53 @@ send_file_sync_error_notification (const char *repo_id,
         repo_name = repo->name;
     }
 
-    seaf_repo_manager_record_sync_error (repo_id, repo_name, path, err_id);
-
     seaf_sync_manager_set_task_error_code (seaf->sync_mgr, repo_id, err_id);
 
-    check_and_send_notification (seaf->repo_mgr, repo_id, repo_name, path, err_id);
+    key = g_strdup_printf ("%s/%s", repo_id, path ? path : "");
+
+    pthread_mutex_lock (&priv->errors_lock);
+
+    /* Errors already notified for the path aren't counted again. */
+    notified = g_hash_table_lookup (priv->notified_errors, key);
+    changed = (GPOINTER_TO_INT(notified) != err_id);
+    if (changed)
+        g_hash_table_replace (priv->notified_errors, g_strdup (key),
+                              GINT_TO_POINTER(err_id));
+
+    group = add_to_error_group (priv, repo_id, repo_name, path, err_id, now);
+
+    if (group->n_files <= MAX_RECORDED_ERRORS_PER_GROUP ||
+        g_hash_table_lookup (priv->pending_errors, key)) {
+        err = g_new0 (SyncError, 1);
+        err->repo_id = g_strdup (repo_id);
+        err->repo_name = g_strdup (repo_name);
+        err->path = g_strdup (path);
+        err->err_id = err_id;
+        err->timestamp = now;
+        /* Only the last error of a path is written. */
+        g_hash_table_replace (priv->pending_errors, key, err);
+        key = NULL;
+    }
+    n_pending = g_hash_table_size (priv->pending_errors);
+
+    if (changed) {
+        if (group->n_files == 1 && notification_allowed (priv, now)) {
+            notify_now = TRUE;
+            group->last_notify = now;
+        } else {
+            ++group->n_unnotified;
+        }
+    }
+
+    pthread_mutex_unlock (&priv->errors_lock);
+
+    g_free (key);
+
+    if (notify_now)
+        send_sync_error_notification (repo_id, repo_name, path, err_id);
+
+    if (n_pending >= SYNC_ERRORS_BATCH)
+        flush_sync_errors (seaf->repo_mgr);
 }
 
 SeafRepo*
@@ -1118,6 +1736,7 @@ seaf_repo_new (const char *id, const char *name, const char *desc)
     repo->worktree_invalid = TRUE;
     repo->auto_sync = 1;
     pthread_mutex_init (&repo->lock, NULL);
+    pthread_mutex_init (&repo->worktree_lock, NULL);
 
     return repo;
 }
@@ -1186,6 +1805,7 @@ seaf_repo_free (SeafRepo *repo)
     g_free (repo->relay_id);
     g_free (repo->email);
     g_free (repo->token);
+    sync_filter_unref (repo->sync_filter);
     g_free (repo);
 }
 
@@ -1196,6 +1816,9 @@ set_head_common (SeafRepo *repo, SeafBranch *branch)
         seaf_branch_unref (repo->head);
     repo->head = branch;
     seaf_branch_ref(branch);
+
+    if (repo->manager)
+        seaf_repo_manager_bump_repo_list_seq (repo->manager);
 }
 
 int
@@ -1238,6 +1861,8 @@ seaf_repo_from_commit (SeafRepo *repo, SeafCommit *commit)
     repo->encrypted = commit->encrypted;
     repo->last_modify = commit->ctime;
     memcpy (repo->root_id, commit->root_id, 40);
+    if (repo->manager)
+        seaf_repo_manager_bump_repo_list_seq (repo->manager);
     if (repo->encrypted) {
         repo->enc_version = commit->enc_version;
         if (repo->enc_version == 1)
@@ -1354,6 +1979,8 @@ seaf_repo_set_name (SeafRepo *repo, const char *new_name)
     repo->name = g_strdup(new_name);
     g_free (old_name);
 
+    seaf_repo_manager_bump_repo_list_seq (seaf->repo_mgr);
+
     if (need_to_sync_worktree_name (repo->id))
         update_repo_worktree_name (repo, new_name, TRUE);
 }
@@ -1409,11 +2036,168 @@ out:
     return commits;
 }
 
+/*
+ * Commit ids of the history of a head, in the order of the traversal.
+ * Only the part that was asked for is walked, and it's extended as later
+ * pages are requested. The commits themselves come from the commit cache.
+ */
+typedef struct CommitHistory {
+    char head_id[41];
+    GPtrArray *ids;
+    /* The whole history has been walked. */
+    gboolean complete;
+    /* Parents of some walked commits are not in the local store, e.g.
+     * after a shallow clone. The history stops at those commits. */
+    gboolean truncated;
+} CommitHistory;
+
+#define HISTORY_WALK_MIN 100
+
+static void
+commit_history_free (CommitHistory *history)
+{
+    g_ptr_array_free (history->ids, TRUE);
+    g_free (history);
+}
+
+typedef struct HistoryWalk {
+    SeafRepo *repo;
+    GPtrArray *ids;
+    gboolean truncated;
+} HistoryWalk;
+
+static gboolean
+parent_missing (SeafRepo *repo, const char *parent_id)
+{
+    return parent_id &&
+        !seaf_commit_manager_commit_exists (seaf->commit_mgr, repo->id,
+                                            repo->version, parent_id);
+}
+
+static gboolean
+collect_commit_id (SeafCommit *commit, void *vwalk, gboolean *stop)
+{
+    HistoryWalk *walk = vwalk;
+
+    g_ptr_array_add (walk->ids, g_strdup (commit->commit_id));
+    if (parent_missing (walk->repo, commit->parent_id) ||
+        parent_missing (walk->repo, commit->second_parent_id))
+        walk->truncated = TRUE;
+    return TRUE;
+}
+
+/* Called with history_lock held. */
+static int
+walk_commit_history (SeafRepo *repo, CommitHistory *history, int need)
+{
+    HistoryWalk walk;
+    int limit;
+
+    /* Walk at least twice as far as last time, so that paging through a
+     * long history costs a few walks instead of one walk per page. */
+    limit = MAX (need, (int)history->ids->len * 2);
+    limit = MAX (limit, HISTORY_WALK_MIN);
+
+    walk.repo = repo;
+    walk.ids = g_ptr_array_new_with_free_func (g_free);
+    walk.truncated = FALSE;
+    /* Missing parents are skipped, only a missing head is an error. */
+    if (!seaf_commit_manager_traverse_commit_tree_with_limit (seaf->commit_mgr,
+                                                              repo->id,
+                                                              repo->version,
+                                                              history->head_id,
+                                                              collect_commit_id,
+                                                              limit,
+                                                              &walk, TRUE)) {
+        g_ptr_array_free (walk.ids, TRUE);
+        return -1;
+    }
+
+    g_ptr_array_free (history->ids, TRUE);
+    history->ids = walk.ids;
+    history->complete = (walk.ids->len < (guint)limit);
+    history->truncated = walk.truncated;
+
+    return 0;
+}
+
+GList *
+seaf_repo_get_commits_page (SeafRepo *repo, int offset, int limit,
+                            gboolean *truncated, GError **error)
+{
+    SeafRepoManagerPriv *priv = seaf->repo_mgr->priv;
+    CommitHistory *history;
+    SeafCommit *commit;
+    GList *commits = NULL;
+    guint i, end;
+
+    *truncated = FALSE;
+
+    if (!repo->head) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Repo has no head");
+        return NULL;
+    }
+    if (offset < 0 || limit <= 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid offset or limit");
+        return NULL;
+    }
+
+    pthread_mutex_lock (&priv->history_lock);
+
+    history = g_hash_table_lookup (priv->histories, repo->id);
+    if (!history || strcmp (history->head_id, repo->head->commit_id) != 0) {
+        history = g_new0 (CommitHistory, 1);
+        memcpy (history->head_id, repo->head->commit_id, 40);
+        history->ids = g_ptr_array_new_with_free_func (g_free);
+        g_hash_table_replace (priv->histories, g_strdup (repo->id), history);
+    }
+
+    if (!history->complete && history->ids->len < (guint)offset + limit &&
+        walk_commit_history (repo, history, offset + limit) < 0) {
+        g_hash_table_remove (priv->histories, repo->id);
+        pthread_mutex_unlock (&priv->history_lock);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to load commits");
+        return NULL;
+    }
+
+    end = MIN (history->ids->len, (guint)offset + limit);
+    for (i = offset; i < end; ++i) {
+        commit = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                                 repo->id, repo->version,
+                                                 g_ptr_array_index (history->ids, i));
+        if (!commit) {
+            g_list_free_full (commits, (GDestroyNotify)seaf_commit_unref);
+            commits = NULL;
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                         "Failed to load commits");
+            break;
+        }
+        commits = g_list_prepend (commits, commit);
+    }
+    *truncated = history->truncated;
+
+    pthread_mutex_unlock (&priv->history_lock);
+
+    return g_list_reverse (commits);
+}
+
+static void
+drop_commit_history (SeafRepoManager *mgr, const char *repo_id)
+{
+    pthread_mutex_lock (&mgr->priv->history_lock);
+    g_hash_table_remove (mgr->priv->histories, repo_id);
+    pthread_mutex_unlock (&mgr->priv->history_lock);
+}
+
 void
 seaf_repo_set_readonly (SeafRepo *repo)
 {
     repo->is_readonly = TRUE;
     save_repo_property (repo->manager, repo->id, REPO_PROP_IS_READONLY, "true");
+    seaf_sync_manager_bump_status_seq (seaf->sync_mgr);
 }
 
 void
@@ -1421,6 +2205,30 @@ seaf_repo_unset_readonly (SeafRepo *repo)
 {
     repo->is_readonly = FALSE;
     save_repo_property (repo->manager, repo->id, REPO_PROP_IS_READONLY, "false");
+    seaf_sync_manager_bump_status_seq (seaf->sync_mgr);
+}
+
+SyncFilter *
+seaf_repo_ref_sync_filter (SeafRepo *repo)
+{
+    SyncFilter *filter;
+
+    pthread_mutex_lock (&repo->lock);
+    filter = sync_filter_ref (repo->sync_filter);
+    pthread_mutex_unlock (&repo->lock);
+
+    return filter;
+}
+
+/* An empty filter is the same as no filter. */
+static gboolean
+sync_filter_prop_changed (const char *value, const char *applied)
+{
+    if (value && *value == '\0')
+        value = NULL;
+    if (applied && *applied == '\0')
+        applied = NULL;
+    return (g_strcmp0 (value, applied) != 0);
 }
 
 gboolean
@@ -1441,7 +2249,7 @@ static gboolean
 should_ignore(const char *basepath, const char *filename, void *data)
 {
     GPatternSpec **spec = ignore_patterns;
-    GList *ignore_list = (GList *)data;
+    SeafIgnoreList *ignore_list = (SeafIgnoreList *)data;
 
     if (!g_utf8_validate (filename, -1, NULL)) {
         seaf_warning ("File name %s contains non-UTF8 characters, skip.\n", filename);
@@ -1541,33 +2349,229 @@ out:
 }
 #endif
 
-static int
-index_cb (const char *repo_id,
-          int version,
-          const char *path,
-          unsigned char sha1[],
-          SeafileCrypt *crypt,
-          gboolean write_data)
-{
+/*
+ * Concurrent indexing.
+ *
+ * Before add_file() walks the files of a directory in order, the files that
+ * will need to be indexed are handed to the worker pool, which chunks, hashes
+ * and stores them. add_to_index() then picks up the precomputed file id in
+ * index_cb(), so the index and cache-tree are still updated serially and in
+ * the original order. Files that changed while being indexed, or that
+ * add_file() decides not to add, are simply indexed or skipped as before.
+ */
+
+/* Only small files are worth indexing ahead; large files are not
+ * speculated on since they may not be part of this commit.
+ */
+#define INDEX_PREFETCH_MAX_FILE_SIZE (1 << 22)
+
+typedef struct IndexPrefetchTask {
+    char *full_path;
     gint64 size;
+    gint64 mtime;
+    unsigned char sha1[20];
+    int result;
+    gboolean done;
+    struct IndexPrefetchBatch *batch;
+} IndexPrefetchTask;
 
-    /* Check in blocks and get object ID. */
-    if (seaf_fs_manager_index_blocks (seaf->fs_mgr, repo_id, version,
-                                      path, sha1, &size, crypt, write_data, !seaf->disable_block_hash) < 0) {
-        seaf_warning ("Failed to index file %s.\n", path);
-        return -1;
-    }
-    return 0;
-}
+typedef struct IndexPrefetchBatch {
+    const char *repo_id;
+    int version;
+    SeafileCrypt *crypt;
+    /* full_path -> IndexPrefetchTask */
+    GHashTable *tasks;
+    GMutex lock;
+    WorkerTaskGroup *group;
+} IndexPrefetchBatch;
 
-#define MAX_COMMIT_SIZE 100 * (1 << 20) /* 100MB */
+/* The batch of the directory being added by the current thread. */
+static GPrivate current_prefetch_batch;
 
-typedef struct _AddOptions {
-    LockedFileSet *fset;
-    ChangeSet *changeset;
-    gboolean is_repo_ro;
-    gboolean startup_scan;
-} AddOptions;
+static void
+index_prefetch_task_free (IndexPrefetchTask *task)
+{
+    g_free (task->full_path);
+    g_free (task);
+}
+
+static void
+index_prefetch_worker (gpointer vtask, gpointer user_data)
+{
+    IndexPrefetchTask *task = vtask;
+    IndexPrefetchBatch *batch = task->batch;
+    SeafStat st;
+    gint64 size;
+    int rc;
+
+    rc = seaf_fs_manager_index_blocks (seaf->fs_mgr, batch->repo_id,
+                                       batch->version, task->full_path,
+                                       task->sha1, &size, batch->crypt, TRUE,
+                                       !seaf->disable_block_hash);
+    /* Let the file be indexed again in order if it was changed meanwhile. */
+    if (rc == 0 &&
+        (seaf_stat (task->full_path, &st) < 0 ||
+         st.st_size != task->size || st.st_mtime != task->mtime))
+        rc = -1;
+
+    g_mutex_lock (&batch->lock);
+    task->result = rc;
+    task->done = TRUE;
+    g_mutex_unlock (&batch->lock);
+}
+
+static IndexPrefetchBatch *
+index_prefetch_batch_new (const char *repo_id, int version, SeafileCrypt *crypt)
+{
+    IndexPrefetchBatch *batch = g_new0 (IndexPrefetchBatch, 1);
+
+    batch->repo_id = repo_id;
+    batch->version = version;
+    batch->crypt = crypt;
+    batch->tasks = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                          (GDestroyNotify)index_prefetch_task_free);
+    g_mutex_init (&batch->lock);
+    batch->group = worker_task_group_new (index_prefetch_worker, NULL,
+                                          WORKER_PRIORITY_NORMAL);
+
+    return batch;
+}
+
+static void
+index_prefetch_batch_add (IndexPrefetchBatch *batch,
+                          const char *full_path,
+                          SeafStat *st)
+{
+    IndexPrefetchTask *task = g_new0 (IndexPrefetchTask, 1);
+
+    task->full_path = g_strdup (full_path);
+    task->size = st->st_size;
+    task->mtime = st->st_mtime;
+    task->batch = batch;
+
+    g_mutex_lock (&batch->lock);
+    g_hash_table_replace (batch->tasks, task->full_path, task);
+    g_mutex_unlock (&batch->lock);
+
+    worker_task_group_push (batch->group, task);
+}
+
+/* Wait for the tasks that were not claimed and free the batch. */
+static void
+index_prefetch_batch_free (IndexPrefetchBatch *batch)
+{
+    worker_task_group_free (batch->group);
+
+    g_hash_table_destroy (batch->tasks);
+    g_mutex_clear (&batch->lock);
+    g_free (batch);
+}
+
+static gboolean
+index_prefetch_claim (IndexPrefetchBatch *batch,
+                      const char *full_path,
+                      unsigned char sha1[])
+{
+    IndexPrefetchTask *task;
+    gboolean ret = FALSE;
+
+    g_mutex_lock (&batch->lock);
+
+    task = g_hash_table_lookup (batch->tasks, full_path);
+    if (task) {
+        /* Index queued files here as well, rather than waiting for a
+         * worker to get to this one. */
+        while (!task->done) {
+            g_mutex_unlock (&batch->lock);
+            worker_task_group_help (batch->group);
+            g_mutex_lock (&batch->lock);
+        }
+        if (task->result == 0) {
+            memcpy (sha1, task->sha1, 20);
+            ret = TRUE;
+        }
+        g_hash_table_remove (batch->tasks, full_path);
+    }
+
+    g_mutex_unlock (&batch->lock);
+
+    return ret;
+}
+
+static int
+index_cb (const char *repo_id,
+          int version,
+          const char *path,
+          const unsigned char *old_sha1,
+          unsigned char sha1[],
+          SeafileCrypt *crypt,
+          gboolean write_data)
+{
+    IndexPrefetchBatch *batch;
+    char old_file_id[41];
+    gint64 size;
+    gint64 start;
+
+    if (write_data) {
+        batch = g_private_get (&current_prefetch_batch);
+        if (batch && index_prefetch_claim (batch, path, sha1))
+            return 0;
+    }
+
+    start = seaf_trace_begin ();
+
+    /* A new version of a file can reuse the chunks of the old one. */
+    if (write_data && old_sha1 && !seaf->disable_block_hash) {
+        rawdata_to_hex (old_sha1, old_file_id, 20);
+        if (seaf_fs_manager_reindex_blocks (seaf->fs_mgr, repo_id, version,
+                                            path, old_file_id, sha1,
+                                            &size, crypt) < 0) {
+            seaf_warning ("Failed to index file %s.\n", path);
+            return -1;
+        }
+        seaf_trace_end ("index", "index_file", start, path);
+        return 0;
+    }
+
+    /* Check in blocks and get object ID. */
+    if (seaf_fs_manager_index_blocks (seaf->fs_mgr, repo_id, version,
+                                      path, sha1, &size, crypt, write_data, !seaf->disable_block_hash) < 0) {
+        seaf_warning ("Failed to index file %s.\n", path);
+        return -1;
+    }
+
+    seaf_trace_end ("index", "index_file", start, path);
+    return 0;
+}
+
+#define MAX_COMMIT_SIZE 100 * (1 << 20) /* 100MB */
+#define MIN_COMMIT_SIZE 10 * (1 << 20) /* 10MB */
+
+/* Commit in smaller batches as the memory budget runs out. */
+static gint64
+commit_size_limit ()
+{
+    return mem_budget_batch_size (MAX_COMMIT_SIZE, MIN_COMMIT_SIZE);
+}
+
+typedef struct _AddOptions {
+    LockedFileSet *fset;
+    ChangeSet *changeset;
+    gboolean is_repo_ro;
+    gboolean startup_scan;
+    /* preload_index() has been run, CE_UPTODATE entries needn't be stat'ed. */
+    gboolean preloaded;
+    gboolean on_demand;
+    /* Paths left out by the sync filter are not added. */
+    SyncFilter *filter;
+} AddOptions;
+
+static inline gboolean
+is_path_filtered (AddOptions *options, const char *path, gboolean is_dir)
+{
+    return (options && options->filter &&
+            !sync_filter_is_synced (options->filter, path, is_dir));
+}
 
 static int
 add_file (const char *repo_id,
@@ -1642,6 +2646,26 @@ add_file (const char *repo_id,
     }
 #endif
 
+    /* The zeros of a placeholder must never be committed. Its index entry
+     * may only look changed because the index was rebuilt. */
+    if (options && options->on_demand) {
+        ce = index_name_exists (istate, path, strlen(path), 0);
+        if (ce && ie_match_stat (ce, st, 0) != 0) {
+            GHashTable *placeholders = load_placeholders (seaf->repo_mgr,
+                                                          repo_id, path);
+            gboolean untouched;
+
+            untouched = placeholder_is_untouched (g_hash_table_lookup (placeholders,
+                                                                       path),
+                                                  st);
+            g_hash_table_destroy (placeholders);
+            if (untouched) {
+                fill_stat_cache_info (ce, st);
+                return ret;
+            }
+        }
+    }
+
 #ifndef WIN32
     base_name = g_path_get_basename(full_path);
     if (!seaf->hide_windows_incompatible_path_notification &&
@@ -1688,7 +2712,7 @@ add_file (const char *repo_id,
                             st, 0, crypt, index_cb, modifier, &added);
         if (added) {
             *total_size += (gint64)(st->st_size);
-            if (*total_size >= MAX_COMMIT_SIZE)
+            if (*total_size >= commit_size_limit ())
                 *remain_files = g_queue_new ();
         } else {
             seaf_sync_manager_update_active_path (seaf->sync_mgr,
@@ -1736,29 +2760,111 @@ typedef struct AddParams {
     const char *worktree;
     SeafileCrypt *crypt;
     gboolean ignore_empty_dir;
-    GList *ignore_list;
+    SeafIgnoreList *ignore_list;
     gint64 *total_size;
     GQueue **remain_files;
     AddOptions *options;
 } AddParams;
 
+/*
+ * Guess whether add_file() is going to index @path, using the same checks
+ * it does. A wrong guess only costs some work.
+ */
+static gboolean
+should_prefetch_file (AddParams *params, const char *path, SeafStat *st,
+                      gint64 pending_size)
+{
+    AddOptions *options = params->options;
+    struct cache_entry *ce;
+
+    if (!S_ISREG(st->st_mode) || st->st_size == 0 ||
+        st->st_size > INDEX_PREFETCH_MAX_FILE_SIZE)
+        return FALSE;
+
+    /* Don't index files that will go to the next partial commit. */
+    if (params->remain_files) {
+        if (*(params->remain_files) != NULL)
+            return FALSE;
+        if (*(params->total_size) + pending_size >= commit_size_limit ())
+            return FALSE;
+    }
+
+    if (options && !is_path_writable (params->repo_id,
+                                      options->is_repo_ro, path))
+        return FALSE;
+
+    if (seaf_filelock_manager_is_file_locked (seaf->filelock_mgr,
+                                              params->repo_id, path))
+        return FALSE;
+
+#if defined WIN32 || defined __APPLE__
+    if (options && options->fset &&
+        locked_file_set_lookup (options->fset, path) != NULL)
+        return FALSE;
+#endif
+
+    ce = index_name_exists (params->istate, path, strlen(path), 0);
+    if (ce && !ce_stage(ce) &&
+        !ie_match_stat (ce, st, CE_MATCH_IGNORE_VALID|
+                        CE_MATCH_IGNORE_SKIP_WORKTREE|CE_MATCH_RACY_IS_DIRTY))
+        return FALSE;
+
+    return TRUE;
+}
+
+static void
+maybe_prefetch_file (AddParams *params, IndexPrefetchBatch **batch,
+                     const char *path, const char *full_path, SeafStat *st,
+                     gint64 *pending_size)
+{
+    if (!should_prefetch_file (params, path, st, *pending_size))
+        return;
+
+    if (!*batch)
+        *batch = index_prefetch_batch_new (params->repo_id, params->version,
+                                           params->crypt);
+    index_prefetch_batch_add (*batch, full_path, st);
+    *pending_size += st->st_size;
+}
+
 #ifndef WIN32
 
+typedef struct DirEntryInfo {
+    char *dname;
+    char *subpath;
+    char *full_subpath;
+    struct stat st;
+} DirEntryInfo;
+
+static void
+dir_entry_info_free (DirEntryInfo *info)
+{
+    g_free (info->dname);
+    g_free (info->subpath);
+    g_free (info->full_subpath);
+    g_free (info);
+}
+
 static int
 add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
                    AddParams *params, gboolean ignored)
 {
     AddOptions *options = params->options;
-    GDir *dir;
+    GPtrArray *dents;
+    SeafDirEntry *dent;
     const char *dname;
     char *subpath, *full_subpath;
     int n, total;
     gboolean is_writable = TRUE;
-    struct stat sub_st;
     char *base_name = NULL;
+    GPtrArray *entries;
+    DirEntryInfo *info;
+    guint i;
+    IndexPrefetchBatch *batch = NULL, *prev_batch;
+    gint64 pending_size = 0;
 
-    dir = g_dir_open (full_path, 0, NULL);
-    if (!dir) {
+    dents = seaf_util_read_dir_entries (full_path, TRUE);
+    if (!dents) {
         seaf_warning ("Failed to open dir %s: %s.\n", full_path, strerror(errno));
 
         seaf_sync_manager_update_active_path (seaf->sync_mgr,
@@ -1784,9 +2890,13 @@ add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
     }
     g_free (base_name);
 
+    entries = g_ptr_array_new_with_free_func ((GDestroyNotify)dir_entry_info_free);
+
     n = 0;
     total = 0;
-    while ((dname = g_dir_read_name(dir)) != NULL) {
+    for (i = 0; i < dents->len; ++i) {
+        dent = g_ptr_array_index (dents, i);
+        dname = dent->name;
         ++total;
 
 #ifdef __APPLE__
@@ -1798,17 +2908,36 @@ add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
 #endif
         full_subpath = g_build_filename (params->worktree, subpath, NULL);
 
-        if (stat (full_subpath, &sub_st) < 0) {
-            seaf_warning ("Failed to stat %s: %s.\n", full_subpath, strerror(errno));
-            g_free (subpath);
-            g_free (full_subpath);
-            continue;
-        }
+        info = g_new0 (DirEntryInfo, 1);
+        info->dname = g_strdup (dname);
+        info->subpath = subpath;
+        info->full_subpath = full_subpath;
+        info->st = dent->st;
+        g_ptr_array_add (entries, info);
+    }
+    g_ptr_array_free (dents, TRUE);
+
+    for (i = 0; i < entries->len && !ignored; ++i) {
+        info = g_ptr_array_index (entries, i);
+        if (!should_ignore (full_path, info->dname, params->ignore_list) &&
+            !is_path_filtered (options, info->subpath, S_ISDIR(info->st.st_mode)))
+            maybe_prefetch_file (params, &batch, info->subpath,
+                                 info->full_subpath, &info->st, &pending_size);
+    }
+
+    prev_batch = g_private_get (&current_prefetch_batch);
+    g_private_set (&current_prefetch_batch, batch);
+
+    for (i = 0; i < entries->len; ++i) {
+        info = g_ptr_array_index (entries, i);
+        dname = info->dname;
+        subpath = info->subpath;
+        full_subpath = info->full_subpath;
 
         if (ignored || should_ignore(full_path, dname, params->ignore_list)) {
             if (options && options->startup_scan) {
-                if (S_ISDIR(sub_st.st_mode))
-                    add_dir_recursive (subpath, full_subpath, &sub_st, params, TRUE);
+                if (S_ISDIR(info->st.st_mode))
+                    add_dir_recursive (subpath, full_subpath, &info->st, params, TRUE);
                 else
                     seaf_sync_manager_update_active_path (seaf->sync_mgr,
                                                           params->repo_id,
@@ -1817,32 +2946,35 @@ add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
                                                           SYNC_STATUS_IGNORED,
                                                           TRUE);
             }
-            g_free (subpath);
-            g_free (full_subpath);
             continue;
         }
 
         ++n;
 
-        if (S_ISDIR(sub_st.st_mode))
-            add_dir_recursive (subpath, full_subpath, &sub_st, params, FALSE);
-        else if (S_ISREG(sub_st.st_mode))
+        /* Still counted, the dir is not empty on the server. */
+        if (is_path_filtered (options, subpath, S_ISDIR(info->st.st_mode)))
+            continue;
+
+        if (S_ISDIR(info->st.st_mode))
+            add_dir_recursive (subpath, full_subpath, &info->st, params, FALSE);
+        else if (S_ISREG(info->st.st_mode))
             add_file (params->repo_id,
                       params->version,
                       params->modifier,
                       params->istate,
                       subpath,
                       full_subpath,
-                      &sub_st,
+                      &info->st,
                       params->crypt,
                       params->total_size,
                       params->remain_files,
                       params->options);
-
-        g_free (subpath);
-        g_free (full_subpath);
     }
-    g_dir_close (dir);
+
+    g_private_set (&current_prefetch_batch, prev_batch);
+    if (batch)
+        index_prefetch_batch_free (batch);
+    g_ptr_array_free (entries, TRUE);
 
     if (ignored) {
         seaf_sync_manager_update_active_path (seaf->sync_mgr,
@@ -1898,6 +3030,21 @@ add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
     return 0;
 }
 
+/* Fill in the fields of @st that add_file() uses from an up-to-date entry. */
+static void
+stat_from_cache_entry (struct cache_entry *ce, SeafStat *st)
+{
+    memset (st, 0, sizeof(SeafStat));
+    st->st_mode = ce->ce_mode;
+    st->st_mtime = ce->ce_mtime.sec;
+    st->st_ctime = ce->ce_ctime.sec;
+    st->st_size = ce->ce_size;
+    st->st_dev = ce->ce_dev;
+    st->st_ino = ce->ce_ino;
+    st->st_uid = ce->ce_uid;
+    st->st_gid = ce->ce_gid;
+}
+
 /*
  * @remain_files: returns the files haven't been added under this path.
  *                If it's set to NULL, no partial commit will be created.
@@ -1911,15 +3058,36 @@ add_recursive (const char *repo_id,
                const char *path,
                SeafileCrypt *crypt,
                gboolean ignore_empty_dir,
-               GList *ignore_list,
+               SeafIgnoreList *ignore_list,
                gint64 *total_size,
                GQueue **remain_files,
                AddOptions *options)
 {
     char *full_path;
     SeafStat st;
+    struct cache_entry *ce;
 
     full_path = g_build_path (PATH_SEPERATOR, worktree, path, NULL);
+
+    if (options && options->preloaded &&
+        (ce = index_name_exists (istate, path, strlen(path), 0)) != NULL &&
+        ce_uptodate (ce)) {
+        stat_from_cache_entry (ce, &st);
+        add_file (repo_id,
+                  version,
+                  modifier,
+                  istate,
+                  path,
+                  full_path,
+                  &st,
+                  crypt,
+                  total_size,
+                  remain_files,
+                  options);
+        g_free (full_path);
+        return 0;
+    }
+
     if (seaf_stat (full_path, &st) < 0) {
         /* Ignore broken symlinks on Linux and Mac OS X */
         if (lstat (full_path, &st) == 0 && S_ISLNK(st.st_mode)) {
@@ -1940,6 +3108,11 @@ add_recursive (const char *repo_id,
         return 0;
     }
 
+    if (is_path_filtered (options, path, S_ISDIR(st.st_mode))) {
+        g_free (full_path);
+        return 0;
+    }
+
     if (S_ISREG(st.st_mode)) {
         add_file (repo_id,
                   version,
@@ -1975,7 +3148,7 @@ add_recursive (const char *repo_id,
 }
 
 static gboolean
-is_empty_dir (const char *path, GList *ignore_list)
+is_empty_dir (const char *path, SeafIgnoreList *ignore_list)
 {
     GDir *dir;
     const char *dname;
@@ -2052,6 +3225,13 @@ iter_dir_cb (wchar_t *full_parent_w,
         goto out;
     }
 
+    /* Still counted, the dir is not empty on the server. */
+    if (is_path_filtered (options, path,
+                          (fdata->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)) {
+        ++(data->n);
+        goto out;
+    }
+
     if (fdata->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
         ret = add_dir_recursive (path, full_path, &st, params, FALSE);
     else
@@ -2077,6 +3257,57 @@ out:
     return 0;
 }
 
+static int
+collect_dir_cb (wchar_t *full_parent_w,
+                WIN32_FIND_DATAW *fdata,
+                void *user_data,
+                gboolean *stop)
+{
+    GArray *entries = user_data;
+
+    g_array_append_val (entries, *fdata);
+    return 0;
+}
+
+static IndexPrefetchBatch *
+prefetch_dir_entries (AddParams *params, const char *parent,
+                      const char *full_parent, GArray *entries)
+{
+    IndexPrefetchBatch *batch = NULL;
+    gint64 pending_size = 0;
+    WIN32_FIND_DATAW *fdata;
+    char *dname, *path, *full_path;
+    SeafStat st;
+    guint i;
+
+    for (i = 0; i < entries->len; ++i) {
+        fdata = &g_array_index (entries, WIN32_FIND_DATAW, i);
+        if (fdata->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            continue;
+
+        dname = g_utf16_to_utf8 (fdata->cFileName, -1, NULL, NULL, NULL);
+        if (!dname)
+            continue;
+        if (should_ignore (full_parent, dname, params->ignore_list)) {
+            g_free (dname);
+            continue;
+        }
+
+        path = g_build_path ("/", parent, dname, NULL);
+        full_path = g_build_path ("/", params->worktree, path, NULL);
+        seaf_stat_from_find_data (fdata, &st);
+
+        if (!is_path_filtered (params->options, path, FALSE))
+            maybe_prefetch_file (params, &batch, path, full_path, &st, &pending_size);
+
+        g_free (dname);
+        g_free (path);
+        g_free (full_path);
+    }
+
+    return batch;
+}
+
 static int
 add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
                    AddParams *params, gboolean ignored)
@@ -2086,6 +3317,9 @@ add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
     wchar_t *full_path_w;
     int ret = 0;
     gboolean is_writable = TRUE;
+    GArray *entries;
+    guint i;
+    IndexPrefetchBatch *batch = NULL, *prev_batch;
 
     memset (&data, 0, sizeof(data));
     data.add_params = params;
@@ -2094,7 +3328,25 @@ add_dir_recursive (const char *path, const char *full_path, SeafStat *st,
     data.ignored = ignored;
 
     full_path_w = win32_long_path (full_path);
-    ret = traverse_directory_win32 (full_path_w, iter_dir_cb, &data);
+    entries = g_array_new (FALSE, FALSE, sizeof(WIN32_FIND_DATAW));
+    ret = traverse_directory_win32 (full_path_w, collect_dir_cb, entries);
+
+    if (ret > 0 && !ignored)
+        batch = prefetch_dir_entries (params, path, full_path, entries);
+
+    prev_batch = g_private_get (&current_prefetch_batch);
+    g_private_set (&current_prefetch_batch, batch);
+
+    for (i = 0; ret > 0 && i < entries->len; ++i) {
+        gboolean stop = FALSE;
+        iter_dir_cb (full_path_w, &g_array_index (entries, WIN32_FIND_DATAW, i),
+                     &data, &stop);
+    }
+
+    g_private_set (&current_prefetch_batch, prev_batch);
+    if (batch)
+        index_prefetch_batch_free (batch);
+    g_array_free (entries, TRUE);
     g_free (full_path_w);
 
     /* Ignore traverse dir error. */
@@ -2173,7 +3425,7 @@ add_recursive (const char *repo_id,
                const char *path,
                SeafileCrypt *crypt,
                gboolean ignore_empty_dir,
-               GList *ignore_list,
+               SeafIgnoreList *ignore_list,
                gint64 *total_size,
                GQueue **remain_files,
                AddOptions *options)
@@ -2196,6 +3448,11 @@ add_recursive (const char *repo_id,
         return 0;
     }
 
+    if (is_path_filtered (options, path, S_ISDIR(st.st_mode))) {
+        g_free (full_path);
+        return 0;
+    }
+
     if (S_ISREG(st.st_mode)) {
         ret = add_file (repo_id,
                         version,
@@ -2231,7 +3488,7 @@ add_recursive (const char *repo_id,
 }
 
 static gboolean
-is_empty_dir (const char *path, GList *ignore_list)
+is_empty_dir (const char *path, SeafIgnoreList *ignore_list)
 {
     WIN32_FIND_DATAW fdata;
     HANDLE handle;
@@ -2250,7 +3507,7 @@ is_empty_dir (const char *path, GList *ignore_list)
     wcscpy (pattern, path_w);
     wcscat (pattern, L"\\*");
 
-    handle = FindFirstFileW (pattern, &fdata);
+    handle = seaf_util_find_first_file (pattern, &fdata);
     if (handle == INVALID_HANDLE_VALUE) {
         seaf_warning ("FindFirstFile failed %s: %lu.\n",
                       path, GetLastError());
@@ -2309,44 +3566,227 @@ check_locked_file_before_remove (LockedFileSet *fset, const char *path)
 #endif
 }
 
-static void
-remove_deleted (struct index_state *istate, const char *worktree, const char *prefix,
-                GList *ignore_list, LockedFileSet *fset,
-                const char *repo_id, gboolean is_repo_ro,
-                ChangeSet *changeset)
-{
-    struct cache_entry **ce_array = istate->cache;
-    struct cache_entry *ce;
-    char path[SEAF_PATH_MAX];
-    unsigned int i;
-    SeafStat st;
-    int ret;
-    gboolean not_exist;
+/*
+ * Directory cache of remove_deleted().
+ *
+ * Deleting, renaming or replacing an entry updates the mtime and ctime of
+ * its parent directory. If neither changed since the directory was last
+ * checked, none of the files indexed in it can have been deleted, and they
+ * don't need to be stat'ed again. The times are saved next to the index,
+ * in "<index>" DIR_CACHE_SUFFIX.
+ *
+ * Writing to a file doesn't touch its directory, so add_recursive() still
+ * has to look at every file for modifications.
+ */
 
-    char *full_prefix = g_strconcat (prefix, "/", NULL);
-    int len = strlen(full_prefix);
+#define DIR_CACHE_SUFFIX ".dircache"
+#define DIR_CACHE_SIGNATURE "SDC1"
 
-    for (i = 0; i < istate->cache_nr; ++i) {
-        ce = ce_array[i];
+typedef struct DirCacheEntry {
+    gint64 mtime;
+    gint64 ctime;
+} DirCacheEntry;
 
-        if (!is_path_writable (repo_id, is_repo_ro, ce->name))
-            continue;
+typedef struct DirCache {
+    char *path;
+    /* dir -> DirCacheEntry, when its files were last checked. */
+    GHashTable *dirs;
+    /* dirs seen in this scan -> whether they are unchanged. */
+    GHashTable *checked;
+    gint64 now;
+} DirCache;
+
+static DirCache *
+dir_cache_load (const char *repo_id)
+{
+    DirCache *cache = g_new0 (DirCache, 1);
+    char *contents = NULL, **lines = NULL, *p, *end;
+    DirCacheEntry *e;
+    int i;
 
-        if (seaf_filelock_manager_is_file_locked (seaf->filelock_mgr,
-                                                  repo_id, ce->name)) {
-            seaf_debug ("Remove deleted: %s is locked on server, ignore.\n", ce->name);
-            continue;
+    cache->path = g_strconcat (seaf->repo_mgr->index_dir, "/", repo_id,
+                               DIR_CACHE_SUFFIX, NULL);
+    cache->dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    cache->checked = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    cache->now = (gint64)time(NULL);
+
+    if (!g_file_get_contents (cache->path, &contents, NULL, NULL))
+        return cache;
+
+    lines = g_strsplit (contents, "\n", -1);
+    if (g_strcmp0 (lines[0], DIR_CACHE_SIGNATURE) != 0)
+        goto out;
+
+    /* Each line is "<mtime> <ctime> <dir>". */
+    for (i = 1; lines[i] && lines[i][0] != 0; ++i) {
+        e = g_new0 (DirCacheEntry, 1);
+        e->mtime = g_ascii_strtoll (lines[i], &p, 10);
+        e->ctime = g_ascii_strtoll (p, &end, 10);
+        if (p == lines[i] || end == p || *end != ' ') {
+            seaf_warning ("Bad line in dir cache %s.\n", cache->path);
+            g_free (e);
+            g_hash_table_remove_all (cache->dirs);
+            break;
         }
+        g_hash_table_replace (cache->dirs, g_strdup(end + 1), e);
+    }
 
-        if (prefix[0] != 0 && strcmp (ce->name, prefix) != 0 &&
-            strncmp (ce->name, full_prefix, len) != 0)
-            continue;
+out:
+    g_strfreev (lines);
+    g_free (contents);
+    return cache;
+}
 
-        snprintf (path, SEAF_PATH_MAX, "%s/%s", worktree, ce->name);
-        not_exist = FALSE;
-        ret = seaf_stat (path, &st);
-        if (ret < 0 && errno == ENOENT)
-            not_exist = TRUE;
+/* Save the dirs seen in the scan that just finished. */
+static void
+dir_cache_save (DirCache *cache)
+{
+    GString *buf = g_string_new (DIR_CACHE_SIGNATURE "\n");
+    GHashTableIter iter;
+    gpointer key, value;
+    DirCacheEntry *e;
+    GError *error = NULL;
+
+    g_hash_table_iter_init (&iter, cache->dirs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        e = value;
+        if (!g_hash_table_contains (cache->checked, key) ||
+            strchr ((char *)key, '\n') != NULL)
+            continue;
+        g_string_append_printf (buf, "%"G_GINT64_FORMAT" %"G_GINT64_FORMAT" %s\n",
+                                e->mtime, e->ctime, (char *)key);
+    }
+
+    if (!g_file_set_contents (cache->path, buf->str, buf->len, &error)) {
+        seaf_warning ("Failed to save dir cache %s: %s.\n",
+                      cache->path, error->message);
+        g_clear_error (&error);
+    }
+
+    g_string_free (buf, TRUE);
+}
+
+static void
+dir_cache_free (DirCache *cache)
+{
+    if (!cache)
+        return;
+    g_free (cache->path);
+    g_hash_table_destroy (cache->dirs);
+    g_hash_table_destroy (cache->checked);
+    g_free (cache);
+}
+
+/*
+ * Returns whether the parent dir of @path is unchanged since its files
+ * were last checked. The parent is stat'ed before any of its files are, so
+ * that a deletion during the scan is seen in the next one.
+ */
+static gboolean
+dir_cache_parent_unchanged (DirCache *cache, const char *worktree,
+                            const char *path)
+{
+    char *slash = strrchr (path, '/');
+    char *dir, *full_dir;
+    gpointer value;
+    gboolean unchanged = FALSE;
+    DirCacheEntry *e;
+    SeafStat st;
+
+    dir = slash ? g_strndup (path, slash - path) : g_strdup ("");
+    if (g_hash_table_lookup_extended (cache->checked, dir, NULL, &value)) {
+        g_free (dir);
+        return GPOINTER_TO_INT (value);
+    }
+
+    full_dir = g_build_filename (worktree, dir, NULL);
+    if (seaf_stat (full_dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+        e = g_hash_table_lookup (cache->dirs, dir);
+        if (e && e->mtime == (gint64)st.st_mtime && e->ctime == (gint64)st.st_ctime) {
+            unchanged = TRUE;
+        } else if ((gint64)st.st_mtime < cache->now - 1 &&
+                   (gint64)st.st_ctime < cache->now - 1) {
+            /* Changes within the same second as the stat wouldn't be
+             * visible in the times, so only remember older ones. */
+            e = g_new0 (DirCacheEntry, 1);
+            e->mtime = (gint64)st.st_mtime;
+            e->ctime = (gint64)st.st_ctime;
+            g_hash_table_replace (cache->dirs, g_strdup(dir), e);
+        } else {
+            g_hash_table_remove (cache->dirs, dir);
+        }
+    } else {
+        g_hash_table_remove (cache->dirs, dir);
+    }
+    g_free (full_dir);
+
+    g_hash_table_insert (cache->checked, dir, GINT_TO_POINTER(unchanged));
+    return unchanged;
+}
+
+/* Called when a file is kept in the index without being checked, or when
+ * it's deleted but kept for now, so that its dir is checked again in the
+ * next scan. The dir isn't cached again during this scan either. */
+static void
+dir_cache_invalidate_parent (DirCache *cache, const char *path)
+{
+    char *slash = strrchr (path, '/');
+    char *dir;
+
+    dir = slash ? g_strndup (path, slash - path) : g_strdup ("");
+    g_hash_table_remove (cache->dirs, dir);
+    g_hash_table_replace (cache->checked, dir, GINT_TO_POINTER(FALSE));
+}
+
+static void
+remove_deleted (struct index_state *istate, const char *worktree, const char *prefix,
+                SeafIgnoreList *ignore_list, LockedFileSet *fset,
+                const char *repo_id, gboolean is_repo_ro,
+                ChangeSet *changeset, DirCache *dir_cache)
+{
+    struct cache_entry **ce_array = istate->cache;
+    struct cache_entry *ce;
+    char path[SEAF_PATH_MAX];
+    unsigned int i;
+    SeafStat st;
+    int ret;
+    gboolean not_exist;
+
+    char *full_prefix = g_strconcat (prefix, "/", NULL);
+    int len = strlen(full_prefix);
+
+    for (i = 0; i < istate->cache_nr; ++i) {
+        ce = ce_array[i];
+
+        if (!is_path_writable (repo_id, is_repo_ro, ce->name)) {
+            if (dir_cache && !S_ISDIR (ce->ce_mode))
+                dir_cache_invalidate_parent (dir_cache, ce->name);
+            continue;
+        }
+
+        if (seaf_filelock_manager_is_file_locked (seaf->filelock_mgr,
+                                                  repo_id, ce->name)) {
+            seaf_debug ("Remove deleted: %s is locked on server, ignore.\n", ce->name);
+            if (dir_cache && !S_ISDIR (ce->ce_mode))
+                dir_cache_invalidate_parent (dir_cache, ce->name);
+            continue;
+        }
+
+        if (prefix[0] != 0 && strcmp (ce->name, prefix) != 0 &&
+            strncmp (ce->name, full_prefix, len) != 0)
+            continue;
+
+        /* Full scans, which pass a dir cache, preload the index first. */
+        if (dir_cache && !S_ISDIR (ce->ce_mode) &&
+            (dir_cache_parent_unchanged (dir_cache, worktree, ce->name) ||
+             ce_uptodate (ce)))
+            continue;
+
+        snprintf (path, SEAF_PATH_MAX, "%s/%s", worktree, ce->name);
+        not_exist = FALSE;
+        ret = seaf_stat (path, &st);
+        if (ret < 0 && errno == ENOENT)
+            not_exist = TRUE;
 
         if (S_ISDIR (ce->ce_mode)) {
             if (ce->ce_ctime.sec != 0 || ce_stage(ce) != 0) {
@@ -2384,6 +3824,8 @@ remove_deleted (struct index_state *istate, const char *worktree, const char *pr
                                            ce->name,
                                            TRUE,
                                            prefix);
+            } else if (dir_cache && (not_exist || ret < 0)) {
+                dir_cache_invalidate_parent (dir_cache, ce->name);
             }
         }
     }
@@ -2395,28 +3837,39 @@ remove_deleted (struct index_state *istate, const char *worktree, const char *pr
 
 static int
 scan_worktree_for_changes (struct index_state *istate, SeafRepo *repo,
-                           SeafileCrypt *crypt, GList *ignore_list,
+                           SeafileCrypt *crypt, SeafIgnoreList *ignore_list,
                            LockedFileSet *fset)
 {
+    DirCache *dir_cache = dir_cache_load (repo->id);
+    int ret;
+
+    preload_index (istate, repo->worktree);
+
     remove_deleted (istate, repo->worktree, "", ignore_list, fset,
-                    repo->id, repo->is_readonly, repo->changeset);
+                    repo->id, repo->is_readonly, repo->changeset, dir_cache);
+
+    dir_cache_save (dir_cache);
+    dir_cache_free (dir_cache);
 
     AddOptions options;
     memset (&options, 0, sizeof(options));
     options.fset = fset;
     options.is_repo_ro = repo->is_readonly;
+    options.on_demand = repo->on_demand;
+    options.filter = seaf_repo_ref_sync_filter (repo);
     options.changeset = repo->changeset;
+    options.preloaded = TRUE;
 
-    if (add_recursive (repo->id, repo->version, repo->email,
-                       istate, repo->worktree, "", crypt, FALSE, ignore_list,
-                       NULL, NULL, &options) < 0)
-        return -1;
+    ret = add_recursive (repo->id, repo->version, repo->email,
+                         istate, repo->worktree, "", crypt, FALSE, ignore_list,
+                         NULL, NULL, &options);
+    sync_filter_unref (options.filter);
 
-    return 0;
+    return (ret < 0) ? -1 : 0;
 }
 
 static gboolean
-check_full_path_ignore (const char *worktree, const char *path, GList *ignore_list)
+check_full_path_ignore (const char *worktree, const char *path, SeafIgnoreList *ignore_list)
 {
     char **tokens;
     guint i;
@@ -2445,7 +3898,7 @@ out:
 
 static int
 add_path_to_index (SeafRepo *repo, struct index_state *istate,
-                   SeafileCrypt *crypt, const char *path, GList *ignore_list,
+                   SeafileCrypt *crypt, const char *path, SeafIgnoreList *ignore_list,
                    GList **scanned_dirs, gint64 *total_size, GQueue **remain_files,
                    LockedFileSet *fset)
 {
@@ -2457,19 +3910,30 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
      * for the worktree root "".
      */
     if (path[0] == 0) {
+        DirCache *dir_cache = dir_cache_load (repo->id);
+
+        preload_index (istate, repo->worktree);
+
         remove_deleted (istate, repo->worktree, "", ignore_list, fset,
-                        repo->id, repo->is_readonly, repo->changeset);
+                        repo->id, repo->is_readonly, repo->changeset, dir_cache);
+
+        dir_cache_save (dir_cache);
+        dir_cache_free (dir_cache);
 
         memset (&options, 0, sizeof(options));
         options.fset = fset;
         options.is_repo_ro = repo->is_readonly;
+        options.on_demand = repo->on_demand;
+        options.filter = seaf_repo_ref_sync_filter (repo);
         options.startup_scan = TRUE;
         options.changeset = repo->changeset;
+        options.preloaded = TRUE;
 
         add_recursive (repo->id, repo->version, repo->email, istate,
                        repo->worktree, path,
                        crypt, FALSE, ignore_list,
                        total_size, remain_files, &options);
+        sync_filter_unref (options.filter);
 
         return 0;
     }
@@ -2517,11 +3981,14 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
     memset (&options, 0, sizeof(options));
     options.fset = fset;
     options.is_repo_ro = repo->is_readonly;
+    options.on_demand = repo->on_demand;
+    options.filter = seaf_repo_ref_sync_filter (repo);
     options.changeset = repo->changeset;
 
     /* Add is always recursive */
     add_recursive (repo->id, repo->version, repo->email, istate, repo->worktree, path,
                    crypt, FALSE, ignore_list, total_size, remain_files, &options);
+    sync_filter_unref (options.filter);
 
     g_free (full_path);
     return 0;
@@ -2531,7 +3998,7 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
 
 static int
 add_path_to_index (SeafRepo *repo, struct index_state *istate,
-                   SeafileCrypt *crypt, const char *path, GList *ignore_list,
+                   SeafileCrypt *crypt, const char *path, SeafIgnoreList *ignore_list,
                    GList **scanned_dirs, gint64 *total_size, GQueue **remain_files,
                    LockedFileSet *fset)
 {
@@ -2569,7 +4036,7 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
         return 0;
 
     remove_deleted (istate, repo->worktree, path, ignore_list, NULL,
-                    repo->id, repo->is_readonly, repo->changeset);
+                    repo->id, repo->is_readonly, repo->changeset, NULL);
 
     *scanned_dirs = g_list_prepend (*scanned_dirs, g_strdup(path));
 
@@ -2577,6 +4044,8 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
     memset (&options, 0, sizeof(options));
     options.fset = fset;
     options.is_repo_ro = repo->is_readonly;
+    options.on_demand = repo->on_demand;
+    options.filter = seaf_repo_ref_sync_filter (repo);
     options.changeset = repo->changeset;
     /* When something is changed in the root directory, update active path
      * sync status when scanning the worktree. This is inaccurate. This will
@@ -2588,6 +4057,7 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
     /* Add is always recursive */
     add_recursive (repo->id, repo->version, repo->email, istate, repo->worktree, path,
                    crypt, FALSE, ignore_list, total_size, remain_files, &options);
+    sync_filter_unref (options.filter);
 
     return 0;
 }
@@ -2597,7 +4067,7 @@ add_path_to_index (SeafRepo *repo, struct index_state *istate,
 static int
 add_remain_files (SeafRepo *repo, struct index_state *istate,
                   SeafileCrypt *crypt, GQueue *remain_files,
-                  GList *ignore_list, gint64 *total_size)
+                  SeafIgnoreList *ignore_list, gint64 *total_size)
 {
     char *path;
     char *full_path;
@@ -2640,7 +4110,7 @@ add_remain_files (SeafRepo *repo, struct index_state *istate,
                                   NULL);
 
                 *total_size += (gint64)(st.st_size);
-                if (*total_size >= MAX_COMMIT_SIZE) {
+                if (*total_size >= commit_size_limit ()) {
                     g_free (path);
                     g_free (full_path);
                     break;
@@ -2717,7 +4187,7 @@ out:
 static void
 try_add_empty_parent_dir_entry_from_wt (const char *worktree,
                                         struct index_state *istate,
-                                        GList *ignore_list,
+                                        SeafIgnoreList *ignore_list,
                                         const char *path)
 {
     if (index_name_exists (istate, path, strlen(path), 0) != NULL)
@@ -2821,7 +4291,7 @@ scan_subtree_for_deletion (const char *repo_id,
                            struct index_state *istate,
                            const char *worktree,
                            const char *path,
-                           GList *ignore_list,
+                           SeafIgnoreList *ignore_list,
                            LockedFileSet *fset,
                            gboolean is_readonly,
                            GList **scanned_dirs,
@@ -2898,7 +4368,7 @@ scan_subtree_for_deletion (const char *repo_id,
     *scanned_dirs = g_list_prepend (*scanned_dirs, g_strdup(dir));
 
     remove_deleted (istate, worktree, dir, ignore_list, fset,
-                    repo_id, is_readonly, changeset);
+                    repo_id, is_readonly, changeset, NULL);
 
     /* After remove_deleted(), empty dirs are left not removed in changeset.
      * This can be fixed by removing the accurate deleted path. In most cases,
@@ -2932,7 +4402,7 @@ scan_subtree_for_deletion (const char *repo_id,
                            struct index_state *istate,
                            const char *worktree,
                            const char *path,
-                           GList *ignore_list,
+                           SeafIgnoreList *ignore_list,
                            LockedFileSet *fset,
                            gboolean is_readonly,
                            GList **scanned_dirs,
@@ -2944,7 +4414,7 @@ scan_subtree_for_deletion (const char *repo_id,
 /* Return TRUE if the caller should stop processing next event. */
 static gboolean
 handle_add_files (SeafRepo *repo, struct index_state *istate,
-                  SeafileCrypt *crypt, GList *ignore_list,
+                  SeafileCrypt *crypt, SeafIgnoreList *ignore_list,
                   LockedFileSet *fset,
                   WTStatus *status, WTEvent *event,
                   GList **scanned_dirs, gint64 *total_size)
@@ -2964,7 +4434,7 @@ handle_add_files (SeafRepo *repo, struct index_state *istate,
         add_path_to_index (repo, istate, crypt, event->path,
                            ignore_list, scanned_dirs,
                            total_size, &remain_files, fset);
-        if (*total_size >= MAX_COMMIT_SIZE) {
+        if (*total_size >= commit_size_limit ()) {
             seaf_message ("Creating partial commit after adding %s.\n",
                           event->path);
 
@@ -3015,7 +4485,7 @@ handle_add_files (SeafRepo *repo, struct index_state *istate,
             info->end_multipart_upload = TRUE;
             return TRUE;
         }
-        if (*total_size >= MAX_COMMIT_SIZE)
+        if (*total_size >= commit_size_limit ())
             return TRUE;
     }
 
@@ -3223,7 +4693,7 @@ update_active_file (SeafRepo *repo,
 typedef struct _UpdatePathData {
     SeafRepo *repo;
     struct index_state *istate;
-    GList *ignore_list;
+    SeafIgnoreList *ignore_list;
 
     const char *parent;
     const char *full_parent;
@@ -3234,7 +4704,7 @@ static void
 update_active_path_recursive (SeafRepo *repo,
                               const char *path,
                               struct index_state *istate,
-                              GList *ignore_list,
+                              SeafIgnoreList *ignore_list,
                               gboolean ignored);
 
 static int
@@ -3284,7 +4754,7 @@ static void
 update_active_path_recursive (SeafRepo *repo,
                               const char *path,
                               struct index_state *istate,
-                              GList *ignore_list,
+                              SeafIgnoreList *ignore_list,
                               gboolean ignored)
 {
     char *full_path;
@@ -3349,7 +4819,7 @@ static void
 update_active_path_recursive (SeafRepo *repo,
                               const char *path,
                               struct index_state *istate,
-                              GList *ignore_list,
+                              SeafIgnoreList *ignore_list,
                               gboolean ignored)
 {
     GDir *dir;
@@ -3442,7 +4912,7 @@ update_active_path_recursive (SeafRepo *repo,
 
 static void
 process_active_path (SeafRepo *repo, const char *path,
-                     struct index_state *istate, GList *ignore_list)
+                     struct index_state *istate, SeafIgnoreList *ignore_list)
 {
     SeafStat st;
     gboolean ignored = FALSE;
@@ -3472,7 +4942,7 @@ process_active_path (SeafRepo *repo, const char *path,
 
 /* static void */
 /* process_active_folder (SeafRepo *repo, const char *dir, */
-/*                        struct index_state *istate, GList *ignore_list) */
+/*                        struct index_state *istate, SeafIgnoreList *ignore_list) */
 /* { */
 /*     GList *add = NULL, *mod = NULL, *del = NULL; */
 /*     GList *p; */
@@ -3506,7 +4976,7 @@ process_active_path (SeafRepo *repo, const char *path,
 
 static void
 update_path_sync_status (SeafRepo *repo, WTStatus *status,
-                         struct index_state *istate, GList *ignore_list)
+                         struct index_state *istate, SeafIgnoreList *ignore_list)
 {
     char *path;
 
@@ -3561,7 +5031,7 @@ is_seafile_backup_file (const char *path)
 
 static void
 handle_rename (SeafRepo *repo, struct index_state *istate,
-               SeafileCrypt *crypt, GList *ignore_list,
+               SeafileCrypt *crypt, SeafIgnoreList *ignore_list,
                LockedFileSet *fset,
                WTEvent *event, GList **scanned_del_dirs,
                gint64 *total_size)
@@ -3630,6 +5100,9 @@ handle_rename (SeafRepo *repo, struct index_state *istate,
         not_found = FALSE;
         rename_index_entries (istate, event->path, event->new_path, &not_found,
                               NULL, NULL);
+        if (repo->on_demand)
+            rename_placeholders (seaf->repo_mgr, repo->id,
+                                 event->path, event->new_path);
         if (not_found)
             scan_subtree_for_deletion (repo->id,
                                        istate,
@@ -3658,6 +5131,8 @@ handle_rename (SeafRepo *repo, struct index_state *istate,
     memset (&options, 0, sizeof(options));
     options.fset = fset;
     options.is_repo_ro = repo->is_readonly;
+    options.on_demand = repo->on_demand;
+    options.filter = seaf_repo_ref_sync_filter (repo);
     options.changeset = repo->changeset;
 
     /* We should always scan the destination to compare with the renamed
@@ -3673,6 +5148,7 @@ handle_rename (SeafRepo *repo, struct index_state *istate,
                    istate, repo->worktree, event->new_path,
                    crypt, FALSE, ignore_list,
                    total_size, NULL, &options);
+    sync_filter_unref (options.filter);
 }
 
 #ifdef WIN32
@@ -4037,9 +5513,45 @@ unlock_office_file_on_server (SeafRepo *repo, const char *path)
 
 #endif
 
+static void
+diff_cache_insert (const char *id1, const char *id2, gboolean fold_dir_diff,
+                   GList *results);
+
+/*
+ * Defer the update of a regular file that is being rewritten frequently,
+ * see wt_status_update_is_hot().
+ */
+static gboolean
+defer_hot_file_update (SeafRepo *repo, WTStatus *status, WTEvent *event)
+{
+    gint64 now = (gint64)time(NULL);
+    char *fullpath;
+    SeafStat st;
+    gboolean ret = FALSE;
+
+    /* Remaining files of a partial commit are indexed in any case. */
+    if (event->remain_files)
+        return FALSE;
+
+    if (!wt_status_update_is_hot (status, event->path, now,
+                                  seaf->write_settle_time))
+        return FALSE;
+
+    fullpath = g_build_filename (repo->worktree, event->path, NULL);
+    if (seaf_stat (fullpath, &st) == 0 && S_ISREG(st.st_mode)) {
+        wt_status_defer_update (status, event->path, now);
+        seaf_debug ("%s is written frequently, defer until it settles.\n",
+                    event->path);
+        ret = TRUE;
+    }
+    g_free (fullpath);
+
+    return ret;
+}
+
 static int
 apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
-                                 SeafileCrypt *crypt, GList *ignore_list,
+                                 SeafileCrypt *crypt, SeafIgnoreList *ignore_list,
                                  LockedFileSet *fset, GList **event_list)
 {
     WTStatus *status;
@@ -4060,13 +5572,7 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
 
     GList *scanned_dirs = NULL, *scanned_del_dirs = NULL;
 
-    WTEvent *last_event;
-
-    pthread_mutex_lock (&status->q_lock);
-    last_event = g_queue_peek_tail (status->event_q);
-    pthread_mutex_unlock (&status->q_lock);
-
-    if (!last_event) {
+    if (!wt_status_mark_last_event (status)) {
         seaf_message ("All events are processed for repo %s.\n", repo->id);
         status->partial_commit = FALSE;
         goto out;
@@ -4075,10 +5581,7 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
     gint64 total_size = 0;
 
     while (1) {
-        pthread_mutex_lock (&status->q_lock);
-        event = g_queue_pop_head (status->event_q);
-        next_event = g_queue_peek_head (status->event_q);
-        pthread_mutex_unlock (&status->q_lock);
+        event = wt_status_pop_event (status, &next_event);
         if (!event)
             break;
 
@@ -4095,9 +5598,7 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
             if (next_event->ev_type == WT_EVENT_CREATE_OR_UPDATE && g_strcmp0(event_base_name, next_event_base_name) == 0) {
                 WTEvent *new_event =  wt_event_new (WT_EVENT_RENAME, event->path, next_event->path);
 
-                pthread_mutex_lock (&status->q_lock);
-                next_event = g_queue_pop_head (status->event_q);
-                pthread_mutex_unlock (&status->q_lock);
+                next_event = wt_status_pop_event (status, NULL);
 
                 wt_event_free (event);
                 wt_event_free (next_event);
@@ -4132,6 +5633,9 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
                 strcmp (next_event->path, event->path) == 0)
                 break;
 
+            if (defer_hot_file_update (repo, status, event))
+                break;
+
             /* CREATE_OR_UPDATE event tells us the exact path of changed file/dir.
              * If the event path is not writable, we don't need to check the paths
              * under the event path.
@@ -4256,7 +5760,7 @@ apply_worktree_changes_to_index (SeafRepo *repo, struct index_state *istate,
             break;
         }
 
-        if (event == last_event) {
+        if (wt_status_is_last_event (status, event)) {
             wt_event_free (event);
             seaf_message ("All events are processed for repo %s.\n", repo->id);
             status->partial_commit = FALSE;
@@ -4279,7 +5783,7 @@ index_add (SeafRepo *repo, struct index_state *istate,
 {
     SeafileCrypt *crypt = NULL;
     LockedFileSet *fset = NULL;
-    GList *ignore_list = NULL;
+    SeafIgnoreList *ignore_list = NULL;
     int ret = 0;
 
     if (repo->encrypted) {
@@ -4432,11 +5936,11 @@ print_event_log (const char *repo_name, const char *repo_id,
     g_string_free (msg, TRUE);
 }
 
-char *
-seaf_repo_index_commit (SeafRepo *repo,
-                        gboolean is_force_commit,
-                        gboolean is_initial_commit,
-                        GError **error)
+static char *
+index_commit (SeafRepo *repo,
+              gboolean is_force_commit,
+              gboolean is_initial_commit,
+              GError **error)
 {
     SeafRepoManager *mgr = repo->manager;
     struct index_state istate;
@@ -4449,10 +5953,13 @@ seaf_repo_index_commit (SeafRepo *repo,
     char *desc = NULL;
     char *ret = NULL;
     GList *event_list = NULL;
+    gint64 commit_start, start;
 
     if (!check_worktree_common (repo))
         return NULL;
 
+    commit_start = seaf_trace_begin ();
+
     memset (&istate, 0, sizeof(istate));
     snprintf (index_path, SEAF_PATH_MAX, "%s/%s", mgr->index_dir, repo->id);
     if (read_index_from (&istate, index_path, repo->version) < 0) {
@@ -4469,15 +5976,19 @@ seaf_repo_index_commit (SeafRepo *repo,
 
     repo->changeset = changeset;
 
+    start = seaf_trace_begin ();
     if (index_add (repo, &istate, is_force_commit, &event_list) < 0) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, "Failed to add");
         goto out;
     }
+    seaf_trace_end ("index", "index_add", start, repo->id);
 
     if (!istate.cache_changed)
         goto out;
 
+    start = seaf_trace_begin ();
     new_root_id = commit_tree_from_changeset (changeset);
+    seaf_trace_end ("index", "commit_tree", start, repo->id);
     if (!new_root_id) {
         seaf_warning ("Create commit tree failed for repo %s\n", repo->id);
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
@@ -4504,10 +6015,15 @@ seaf_repo_index_commit (SeafRepo *repo,
             compare_index_changeset (&istate, changeset);
 
         update_index (&istate, index_path);
+        changeset_cache_tree (changeset);
         goto out;
     }
 
-    diff_commit_roots (repo->id, repo->version, head->root_id, new_root_id, &diff_results, TRUE);
+    if (diff_commit_roots_filtered (repo->id, repo->version,
+                                    head->root_id, new_root_id,
+                                    &diff_results, TRUE, NULL, NULL) == 0)
+        /* The GUI asks for the changes of the new commit next. */
+        diff_cache_insert (head->root_id, new_root_id, TRUE, diff_results);
     desc = diff_results_to_description (diff_results);
     if (!desc)
         desc = g_strdup("");
@@ -4530,6 +6046,8 @@ seaf_repo_index_commit (SeafRepo *repo,
 
     g_signal_emit_by_name (seaf, "repo-committed", repo);
 
+    changeset_cache_tree (changeset);
+
     ret = g_strdup(commit_id);
 
 out:
@@ -4542,6 +6060,22 @@ out:
     changeset_free (changeset);
     g_list_free_full (diff_results, (GDestroyNotify)diff_entry_free);
     discard_index (&istate);
+    seaf_trace_end ("index", "index_commit", commit_start, repo->id);
+    return ret;
+}
+
+char *
+seaf_repo_index_commit (SeafRepo *repo,
+                        gboolean is_force_commit,
+                        gboolean is_initial_commit,
+                        GError **error)
+{
+    char *ret;
+
+    pthread_mutex_lock (&repo->worktree_lock);
+    ret = index_commit (repo, is_force_commit, is_initial_commit, error);
+    pthread_mutex_unlock (&repo->worktree_lock);
+
     return ret;
 }
 
@@ -4584,6 +6118,109 @@ print_index (struct index_state *istate)
 }
 #endif  /* DEBUG_UNPACK_TREES */
 
+/*
+ * Cache of recent diff results.
+ *
+ * Commits and trees never change, so the diff of two roots is always the
+ * same. The GUI asks for the changes of the same commits again and again,
+ * and the diff made when a commit is created is what the GUI asks for
+ * next. Entries are keyed by the two root ids, or by the commit id for
+ * merges, and the fold_dir_diff flag. Very large results aren't cached.
+ */
+
+#define DIFF_CACHE_SIZE 64
+#define DIFF_CACHE_MAX_RESULTS 10000
+
+typedef struct DiffCacheEntry {
+    char key[96];
+    GList *results;
+    GList link;
+} DiffCacheEntry;
+
+static void
+diff_cache_make_key (char *key, const char *id1, const char *id2,
+                     gboolean fold_dir_diff)
+{
+    snprintf (key, 96, "%s:%s:%d", id1, id2, fold_dir_diff ? 1 : 0);
+}
+
+static GList *
+dup_diff_results (GList *results)
+{
+    GList *copy = NULL, *ptr;
+
+    for (ptr = results; ptr; ptr = ptr->next)
+        copy = g_list_prepend (copy, diff_entry_dup (ptr->data));
+    return g_list_reverse (copy);
+}
+
+static void
+diff_cache_remove_entry (SeafRepoManagerPriv *priv, DiffCacheEntry *entry)
+{
+    g_hash_table_remove (priv->diff_cache, entry->key);
+    g_queue_unlink (&priv->diff_cache_lru, &entry->link);
+    g_list_free_full (entry->results, (GDestroyNotify)diff_entry_free);
+    g_free (entry);
+}
+
+/* Returns TRUE and a copy of the results in @results if cached. */
+static gboolean
+diff_cache_lookup (const char *id1, const char *id2, gboolean fold_dir_diff,
+                   GList **results)
+{
+    SeafRepoManagerPriv *priv = seaf->repo_mgr->priv;
+    char key[96];
+    DiffCacheEntry *entry;
+    gboolean ret = FALSE;
+
+    diff_cache_make_key (key, id1, id2, fold_dir_diff);
+
+    pthread_mutex_lock (&priv->diff_cache_lock);
+
+    entry = g_hash_table_lookup (priv->diff_cache, key);
+    if (entry) {
+        g_queue_unlink (&priv->diff_cache_lru, &entry->link);
+        g_queue_push_head_link (&priv->diff_cache_lru, &entry->link);
+        *results = dup_diff_results (entry->results);
+        ret = TRUE;
+    }
+
+    pthread_mutex_unlock (&priv->diff_cache_lock);
+
+    return ret;
+}
+
+/* Caches a copy of @results. */
+static void
+diff_cache_insert (const char *id1, const char *id2, gboolean fold_dir_diff,
+                   GList *results)
+{
+    SeafRepoManagerPriv *priv = seaf->repo_mgr->priv;
+    DiffCacheEntry *entry, *old;
+
+    if (g_list_length (results) > DIFF_CACHE_MAX_RESULTS)
+        return;
+
+    entry = g_new0 (DiffCacheEntry, 1);
+    diff_cache_make_key (entry->key, id1, id2, fold_dir_diff);
+    entry->results = dup_diff_results (results);
+    entry->link.data = entry;
+
+    pthread_mutex_lock (&priv->diff_cache_lock);
+
+    old = g_hash_table_lookup (priv->diff_cache, entry->key);
+    if (old)
+        diff_cache_remove_entry (priv, old);
+
+    g_hash_table_insert (priv->diff_cache, entry->key, entry);
+    g_queue_push_head_link (&priv->diff_cache_lru, &entry->link);
+
+    while (priv->diff_cache_lru.length > DIFF_CACHE_SIZE)
+        diff_cache_remove_entry (priv, priv->diff_cache_lru.tail->data);
+
+    pthread_mutex_unlock (&priv->diff_cache_lock);
+}
+
 GList *
 seaf_repo_diff (SeafRepo *repo, const char *old, const char *new, int fold_dir_diff, char **error)
 {
@@ -4601,13 +6238,21 @@ seaf_repo_diff (SeafRepo *repo, const char *old, const char *new, int fold_dir_d
 
     if (old == NULL || old[0] == '\0') {
         if (c2->parent_id && c2->second_parent_id) {
+            if (diff_cache_lookup ("merge", c2->commit_id, fold_dir_diff,
+                                   &diff_entries)) {
+                seaf_commit_unref (c2);
+                return diff_entries;
+            }
             ret = diff_merge (c2, &diff_entries, fold_dir_diff);
-            seaf_commit_unref (c2);
             if (ret < 0) {
+                seaf_commit_unref (c2);
                 *error = g_strdup("Failed to do diff");
                 g_list_free_full (diff_entries, (GDestroyNotify)diff_entry_free);
                 return NULL;
             }
+            diff_cache_insert ("merge", c2->commit_id, fold_dir_diff,
+                               diff_entries);
+            seaf_commit_unref (c2);
             return diff_entries;
         }
 
@@ -4629,14 +6274,22 @@ seaf_repo_diff (SeafRepo *repo, const char *old, const char *new, int fold_dir_d
         return NULL;
     }
 
+    if (diff_cache_lookup (c1->root_id, c2->root_id, fold_dir_diff,
+                           &diff_entries))
+        goto out;
+
     /* do diff */
     ret = diff_commits (c1, c2, &diff_entries, fold_dir_diff);
     if (ret < 0) {
         g_list_free_full (diff_entries, (GDestroyNotify)diff_entry_free);
         diff_entries = NULL;
         *error = g_strdup("Failed to do diff");
+    } else {
+        diff_cache_insert (c1->root_id, c2->root_id, fold_dir_diff,
+                           diff_entries);
     }
 
+out:
     seaf_commit_unref (c1);
     seaf_commit_unref (c2);
 
@@ -4675,16 +6328,11 @@ checkout_empty_dir (const char *worktree,
 }
 
 static struct cache_entry *
-cache_entry_from_diff_entry (DiffEntry *de)
+cache_entry_from_diff_entry (struct index_state *istate, DiffEntry *de)
 {
-    int size, namelen;
     struct cache_entry *ce;
 
-    namelen = strlen(de->name);
-    size = cache_entry_size(namelen);
-    ce = calloc(1, size);
-    memcpy(ce->name, de->name, namelen);
-    ce->ce_flags = namelen;
+    ce = index_new_cache_entry (istate, de->name, strlen(de->name));
 
     memcpy (ce->sha1, de->sha1, 20);
     ce->modifier = g_strdup(de->modifier);
@@ -4707,9 +6355,44 @@ typedef struct FileTxData {
     SeafileCrypt *crypt;
     HttpTxTask *http_task;
     char conflict_head_id[41];
+    const char *worktree;
     GAsyncQueue *finished_tasks;
+    /* Local files that blocks can be taken from, raw file id ->
+     * LocalFileSource. Read only once the downloads have started. */
+    GHashTable *local_files;
+    /* Write downloaded blocks straight to the worktree files, see
+     * http_tx_task_download_file_to_fd(). */
+    gboolean direct_checkout;
+    /* Check out new files as placeholders. @placeholders holds the
+     * existing ones, path -> PlaceholderFile. */
+    gboolean on_demand;
+    GHashTable *placeholders;
 } FileTxData;
 
+/* Files smaller than this are downloaded without looking for local blocks. */
+#define LOCAL_BLOCK_REUSE_MIN_SIZE (1 << 20) /* 1MB */
+
+/* A worktree file as it was recorded in the index. */
+typedef struct LocalFileSource {
+    char *name;
+    unsigned char sha1[20];
+    gint64 mtime;
+    gint64 size;
+} LocalFileSource;
+
+static void
+local_file_source_free (LocalFileSource *src)
+{
+    if (!src)
+        return;
+    g_free (src->name);
+    g_free (src);
+}
+
+/* Files up to this size are fetched in batches, if the server supports it. */
+#define BATCH_FETCH_FILE_SIZE (64 << 10) /* 64KB */
+#define BATCH_FETCH_FILES 256
+
 typedef struct FileTxTask {
     char *path;
     struct cache_entry *ce;
@@ -4720,6 +6403,21 @@ typedef struct FileTxTask {
     int result;
     gboolean no_checkout;
     gboolean force_conflict;
+
+    /* Set by checkout_file_http() in the download thread. The index entry
+     * and the locked file set are only updated on the main thread.
+     */
+    int checkout_result;
+    gboolean checked_out;
+    gboolean conflicted;
+    gboolean locked;
+    SeafStat st;
+
+    /* Check out an empty placeholder instead of the content. */
+    gboolean placeholder;
+
+    /* The version of the file that is in the worktree, if any. */
+    LocalFileSource *old_src;
 } FileTxTask;
 
 static void
@@ -4729,9 +6427,117 @@ file_tx_task_free (FileTxTask *task)
         return;
 
     g_free (task->path);
+    local_file_source_free (task->old_src);
     g_free (task);
 }
 
+/*
+ * Write the blocks of the file to download that can be found in local
+ * files to the block store, so that only the other blocks are downloaded.
+ * The source is an identical file elsewhere in the worktree, e.g. a copy,
+ * or else the old version of the same file, e.g. before a small edit.
+ *
+ * Block ids are the hash of their content, so the blocks written are
+ * correct even if the source file is changed meanwhile.
+ */
+static void
+reuse_local_blocks (FileTxData *data, FileTxTask *file_task,
+                    const char *file_id)
+{
+    DiffEntry *de = file_task->de;
+    LocalFileSource *src = NULL;
+    Seafile *file = NULL, *src_file = NULL;
+    GHashTable *src_blocks = NULL, *wanted = NULL;
+    char src_id[41];
+    char *path = NULL;
+    SeafStat st;
+    int i, n;
+
+    if (seaf->disable_block_hash || de->size < LOCAL_BLOCK_REUSE_MIN_SIZE)
+        return;
+
+    if (data->local_files)
+        src = g_hash_table_lookup (data->local_files, de->sha1);
+    if (!src)
+        src = file_task->old_src;
+    if (!src)
+        return;
+
+    path = g_build_filename (data->worktree, src->name, NULL);
+    if (seaf_stat (path, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_mtime != src->mtime || st.st_size != src->size)
+        goto out;
+
+    rawdata_to_hex (src->sha1, src_id, 20);
+    src_file = seaf_fs_manager_get_seafile (seaf->fs_mgr, data->repo_id,
+                                            data->repo_version, src_id);
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr, data->repo_id,
+                                        data->repo_version, file_id);
+    if (!src_file || !file)
+        goto out;
+
+    src_blocks = g_hash_table_new (ccnet_sha1_hash, ccnet_sha1_equal);
+    for (i = 0; i < src_file->n_blocks; ++i)
+        g_hash_table_add (src_blocks, src_file->blk_ids + i * 20);
+
+    wanted = g_hash_table_new (g_str_hash, g_str_equal);
+    for (i = 0; i < file->n_blocks; ++i) {
+        if (g_hash_table_contains (src_blocks, file->blk_ids + i * 20) &&
+            !seaf_block_manager_block_exists (seaf->block_mgr,
+                                              data->repo_id, data->repo_version,
+                                              file->blk_sha1s[i]))
+            g_hash_table_add (wanted, file->blk_sha1s[i]);
+    }
+    if (g_hash_table_size (wanted) == 0)
+        goto out;
+
+    n = seaf_fs_manager_write_blocks_from_file (seaf->fs_mgr, data->repo_id,
+                                                data->repo_version, path,
+                                                data->crypt, wanted);
+    if (n > 0)
+        seaf_debug ("Took %d blocks of %s from local file %s.\n",
+                    n, de->name, src->name);
+
+out:
+    if (src_blocks)
+        g_hash_table_destroy (src_blocks);
+    if (wanted)
+        g_hash_table_destroy (wanted);
+    seafile_unref (src_file);
+    seafile_unref (file);
+    g_free (path);
+}
+
+/* Called on the main thread before the downloads start. */
+static GHashTable *
+collect_local_files (struct index_state *istate)
+{
+    GHashTable *local_files;
+    struct cache_entry *ce;
+    LocalFileSource *src;
+    unsigned int i;
+
+    local_files = g_hash_table_new_full (ccnet_sha1_hash, ccnet_sha1_equal,
+                                         NULL,
+                                         (GDestroyNotify)local_file_source_free);
+
+    for (i = 0; i < istate->cache_nr; ++i) {
+        ce = istate->cache[i];
+        if ((ce->ce_flags & CE_REMOVE) || !S_ISREG(ce->ce_mode) ||
+            ce->ce_size < LOCAL_BLOCK_REUSE_MIN_SIZE)
+            continue;
+
+        src = g_new0 (LocalFileSource, 1);
+        src->name = g_strdup (ce->name);
+        memcpy (src->sha1, ce->sha1, 20);
+        src->mtime = ce->ce_mtime.sec;
+        src->size = ce->ce_size;
+        g_hash_table_replace (local_files, src->sha1, src);
+    }
+
+    return local_files;
+}
+
 static int
 fetch_file_http (FileTxData *data, FileTxTask *file_task)
 {
@@ -4776,7 +6582,8 @@ fetch_file_http (FileTxData *data, FileTxTask *file_task)
             }
             /* otherwise we have to checkout the file. */
         } else {
-            if (compare_file_content (path, &st, de->sha1, crypt, repo_version) == 0) {
+            if (compare_file_content (path, &st, data->repo_id,
+                                      de->sha1, crypt, repo_version) == 0) {
                 /* This happens after the worktree file was updated,
                  * but the index was not. Just need to update the index.
                  */
@@ -4793,6 +6600,35 @@ fetch_file_http (FileTxData *data, FileTxTask *file_task)
         }
     }
 
+    /* New files, and files that were never opened, are left for
+     * seaf_repo_manager_hydrate_file(). */
+    if (data->on_demand && de->size > 0 && !file_task->force_conflict &&
+        (!path_exists ||
+         placeholder_is_untouched (g_hash_table_lookup (data->placeholders,
+                                                        de->name),
+                                   &st))) {
+        file_task->placeholder = TRUE;
+        return FETCH_CHECKOUT_SUCCESS;
+    }
+
+    reuse_local_blocks (data, file_task, file_id);
+
+#if defined WIN32 || defined __APPLE__
+    /* A file locked by an application is checked out later from the locked
+     * file set, which reads the blocks from the block store. So they're
+     * downloaded to the store even with direct checkout. */
+    if (data->direct_checkout &&
+        do_check_file_locked (de->name, data->worktree,
+                              seaf_filelock_manager_is_file_locked (seaf->filelock_mgr,
+                                                                    data->repo_id,
+                                                                    de->name)))
+        file_task->locked = TRUE;
+#endif
+
+    /* The blocks are downloaded while the file is written. */
+    if (data->direct_checkout && !file_task->locked)
+        return FETCH_CHECKOUT_SUCCESS;
+
     /* Download the blocks of this file. */
     int rc;
     rc = http_tx_task_download_file_blocks (http_task, file_id);
@@ -4806,6 +6642,12 @@ fetch_file_http (FileTxData *data, FileTxTask *file_task)
     return FETCH_CHECKOUT_SUCCESS;
 }
 
+static int
+checkout_file_http (FileTxData *data,
+                    FileTxTask *file_task,
+                    const char *worktree,
+                    const char *conflict_head_id);
+
 static void
 fetch_file_thread_func (gpointer data, gpointer user_data)
 {
@@ -4845,6 +6687,18 @@ fetch_file_thread_func (gpointer data, gpointer user_data)
     }
 
 out:
+    /* Write the file here too, so that decrypting and writing files
+     * overlap with downloading the others.
+     */
+    if (rc == FETCH_CHECKOUT_SUCCESS) {
+        task->checkout_result = checkout_file_http (tx_data, task,
+                                                    tx_data->worktree,
+                                                    tx_data->conflict_head_id);
+        /* With direct checkout, transfer errors happen here. */
+        if (task->checkout_result == FETCH_CHECKOUT_CANCELED ||
+            task->checkout_result == FETCH_CHECKOUT_TRANSFER_ERROR)
+            rc = task->checkout_result;
+    }
     task->result = rc;
     g_async_queue_push (finished_tasks, task);
 }
@@ -4882,25 +6736,38 @@ out:
     return ret;
 }
 
+/* Hash and compare paths ignoring ASCII case, as strcasecmp() does. */
+static guint
+path_case_hash (gconstpointer key)
+{
+    const char *p = key;
+    guint h = 5381;
+
+    for (; *p; ++p)
+        h = (h << 5) + h + g_ascii_tolower (*p);
+    return h;
+}
+
+static gboolean
+path_case_equal (gconstpointer a, gconstpointer b)
+{
+    return (g_ascii_strcasecmp (a, b) == 0);
+}
+
 // Since file creation is asynchronous, the file may not have been created locally at the time of checking for case conflicts, 
 // so an additional check for the name of the file being created is required.
+// @adding_files holds the names of the diff entries being added, compared
+// by path_case_equal().
 static gboolean
-is_adding_files_case_conflict (GList **adding_files, const char *name, char **conflict_path)
+is_adding_files_case_conflict (GHashTable *adding_files, const char *name, char **conflict_path)
 {
-    GList *ptr;
-    SeafStat st;
-
-    ptr = *adding_files;
+    const char *path;
 
-    char *path;
-    for (; ptr; ptr = ptr->next) {
-        path = ptr->data;
-        if (check_case_conflict (path, name, conflict_path)){
-            return TRUE;
-        }
-    }
+    path = g_hash_table_lookup (adding_files, name);
+    if (!path)
+        return FALSE;
 
-    return FALSE;
+    return check_case_conflict (path, name, conflict_path);
 }
 
 static int
@@ -4912,8 +6779,9 @@ schedule_file_fetch (GThreadPool *tpool,
                      DiffEntry *de,
                      GHashTable *pending_tasks,
                      GHashTable *case_conflict_hash,
-                     GHashTable *no_case_conflict_hash,
-                     GList **adding_files)
+                     CaseConflictCache *case_cache,
+                     GHashTable *adding_files,
+                     GList **small_files)
 {
     struct cache_entry *ce;
     gboolean new_ce = FALSE;
@@ -4925,7 +6793,7 @@ schedule_file_fetch (GThreadPool *tpool,
 
     ce = index_name_exists (istate, de->name, strlen(de->name), 0);
     if (!ce) {
-        ce = cache_entry_from_diff_entry (de);
+        ce = cache_entry_from_diff_entry (istate, de);
         new_ce = TRUE;
     }
 
@@ -4942,7 +6810,7 @@ schedule_file_fetch (GThreadPool *tpool,
         skip_fetch = TRUE;
     }
 
-    if (!skip_fetch && (is_path_case_conflict (worktree, de->name, &conflict_path, no_case_conflict_hash) ||
+    if (!skip_fetch && (is_path_case_conflict (worktree, de->name, &conflict_path, case_cache) ||
         is_adding_files_case_conflict(adding_files, de->name, &conflict_path))) {
         if (conflict_path && !g_hash_table_lookup(case_conflict_hash, conflict_path)) {
             seaf_message ("Path %s is case conflict, skip checkout\n", conflict_path);
@@ -4965,8 +6833,8 @@ schedule_file_fetch (GThreadPool *tpool,
         }
     }
 
-    char *de_name = g_strdup(de->name);
-    *adding_files = g_list_prepend (*adding_files, de_name);
+    if (!g_hash_table_contains (adding_files, de->name))
+        g_hash_table_insert (adding_files, de->name, de->name);
 
     file_task = g_new0 (FileTxTask, 1);
     file_task->de = de;
@@ -4976,9 +6844,23 @@ schedule_file_fetch (GThreadPool *tpool,
     file_task->skip_fetch = skip_fetch;
     file_task->no_checkout = no_checkout;
 
+    if (!new_ce && !skip_fetch && S_ISREG(ce->ce_mode) &&
+        ce->ce_size >= LOCAL_BLOCK_REUSE_MIN_SIZE) {
+        file_task->old_src = g_new0 (LocalFileSource, 1);
+        file_task->old_src->name = g_strdup (ce->name);
+        memcpy (file_task->old_src->sha1, ce->sha1, 20);
+        file_task->old_src->mtime = ce->ce_mtime.sec;
+        file_task->old_src->size = ce->ce_size;
+    }
+
     if (!g_hash_table_lookup (pending_tasks, de->name)) {
-        g_hash_table_insert (pending_tasks, g_strdup(de->name), file_task);
-        g_thread_pool_push (tpool, file_task, NULL);
+        g_hash_table_insert (pending_tasks, de->name, file_task);
+        /* Small files are fetched later, after their blocks are prefetched
+         * in batches. */
+        if (small_files && !skip_fetch && de->size <= BATCH_FETCH_FILE_SIZE)
+            *small_files = g_list_prepend (*small_files, file_task);
+        else
+            g_thread_pool_push (tpool, file_task, NULL);
     } else {
         file_tx_task_free (file_task);
     }
@@ -4986,13 +6868,32 @@ schedule_file_fetch (GThreadPool *tpool,
     return FETCH_CHECKOUT_SUCCESS;
 }
 
+/* Drop one reference taken on @block_id in blk_ref_cnts. The block is
+ * removed with the last one. */
+static void
+release_block_ref (HttpTxTask *task, const char *block_id)
+{
+    int *pcnt;
+
+    pthread_mutex_lock (&task->ref_cnt_lock);
+
+    pcnt = g_hash_table_lookup (task->blk_ref_cnts, block_id);
+    if (pcnt && --(*pcnt) == 0) {
+        g_hash_table_remove (task->blk_ref_cnts, block_id);
+        seaf_block_manager_unpin_block (seaf->block_mgr, task->repo_id,
+                                        block_id, TRUE);
+    }
+
+    pthread_mutex_unlock (&task->ref_cnt_lock);
+}
+
+/* Release the references that http_tx_task_download_file_blocks() took,
+ * one per block of the file. */
 static void
 cleanup_file_blocks_http (HttpTxTask *task, const char *file_id)
 {
     Seafile *file;
     int i;
-    char *block_id;
-    int *pcnt;
 
     file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
                                         task->repo_id, task->repo_version,
@@ -5003,27 +6904,8 @@ cleanup_file_blocks_http (HttpTxTask *task, const char *file_id)
         return;
     }
 
-    for (i = 0; i < file->n_blocks; ++i) {
-        block_id = file->blk_sha1s[i];
-
-        pthread_mutex_lock (&task->ref_cnt_lock);
-
-        pcnt = g_hash_table_lookup (task->blk_ref_cnts, block_id);
-        if (pcnt) {
-            --(*pcnt);
-            if (*pcnt > 0) {
-                pthread_mutex_unlock (&task->ref_cnt_lock);
-                continue;
-            }
-        }
-
-        seaf_block_manager_remove_block (seaf->block_mgr,
-                                         task->repo_id, task->repo_version,
-                                         block_id);
-        g_hash_table_remove (task->blk_ref_cnts, block_id);
-
-        pthread_mutex_unlock (&task->ref_cnt_lock);
-    }
+    for (i = 0; i < file->n_blocks; ++i)
+        release_block_ref (task, file->blk_sha1s[i]);
 
     seafile_unref (file);
 }
@@ -5045,12 +6927,58 @@ check_path_conflict (const char *path, char **orig_path)
     return is_conflict;
 }
 
+typedef struct DirectCheckoutData {
+    HttpTxTask *http_task;
+    const char *file_id;
+    SeafileCrypt *crypt;
+    gboolean transfer_failed;
+    /* Blocks read from the block store, referenced once each. */
+    GList *refs;
+} DirectCheckoutData;
+
+/* Make @fd a sparse file of *@vdata bytes. */
+static int
+placeholder_write (int fd, void *vdata)
+{
+    gint64 *size = vdata;
+
+    return (seaf_util_lseek (fd, *size, SEEK_SET) < 0) ? -1 : 0;
+}
+
+static int
+direct_checkout_write (int fd, void *vdata)
+{
+    DirectCheckoutData *data = vdata;
+
+    if (http_tx_task_download_file_to_fd (data->http_task, data->file_id,
+                                          fd, data->crypt, &data->refs) < 0) {
+        data->transfer_failed = TRUE;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+release_direct_refs (HttpTxTask *task, DirectCheckoutData *data)
+{
+    GList *ptr;
+
+    for (ptr = data->refs; ptr; ptr = ptr->next)
+        release_block_ref (task, ptr->data);
+    g_list_free_full (data->refs, g_free);
+    data->refs = NULL;
+}
+
+/*
+ * Called in the download threads. Must not modify the index entry, it may
+ * be saved by the main thread at any time. The results are recorded in
+ * @file_task instead.
+ */
 static int
 checkout_file_http (FileTxData *data,
                     FileTxTask *file_task,
                     const char *worktree,
-                    const char *conflict_head_id,
-                    LockedFileSet *fset)
+                    const char *conflict_head_id)
 {
     char *repo_id = data->repo_id;
     int repo_version = data->repo_version;
@@ -5077,15 +7005,21 @@ checkout_file_http (FileTxData *data,
                                                              repo_id, de->name);
 
 #if defined WIN32 || defined __APPLE__
-    if (do_check_file_locked (de->name, worktree, locked_on_server)) {
-        if (!locked_file_set_lookup (fset, de->name))
-            send_file_sync_error_notification (repo_id, NULL, de->name,
-                                               SYNC_ERROR_ID_FILE_LOCKED_BY_APP);
-
-        locked_file_set_add_update (fset, de->name, LOCKED_OP_UPDATE,
-                                    ce->ce_mtime.sec, file_id);
-        /* Stay in syncing status if the file is locked. */
+    if (file_task->locked)
+        return FETCH_CHECKOUT_SUCCESS;
 
+    if (do_check_file_locked (de->name, worktree, locked_on_server)) {
+        /* Locked after fetch_file_http(). With direct checkout the blocks
+         * aren't in the store yet, get them for the retry. */
+        if (data->direct_checkout) {
+            int rc = http_tx_task_download_file_blocks (http_task, file_id);
+            if (http_task->state == HTTP_TASK_STATE_CANCELED)
+                return FETCH_CHECKOUT_CANCELED;
+            if (rc < 0)
+                return FETCH_CHECKOUT_TRANSFER_ERROR;
+        }
+        /* Added to the locked file set by the main thread. */
+        file_task->locked = TRUE;
         return FETCH_CHECKOUT_SUCCESS;
     }
 #endif
@@ -5112,19 +7046,37 @@ checkout_file_http (FileTxData *data,
 
     /* then checkout the file. */
     gboolean conflicted = FALSE;
-    if (seaf_fs_manager_checkout_file (seaf->fs_mgr,
-                                       repo_id,
-                                       repo_version,
-                                       file_id,
-                                       file_task->path,
-                                       de->mode,
-                                       de->mtime,
-                                       crypt,
-                                       de->name,
-                                       conflict_head_id,
-                                       force_conflict,
-                                       &conflicted,
-                                       http_task->email) < 0) {
+    DirectCheckoutData direct;
+    memset (&direct, 0, sizeof(direct));
+    direct.http_task = http_task;
+    direct.file_id = file_id;
+    direct.crypt = crypt;
+
+    CheckoutWriteFunc write_func = NULL;
+    void *write_data = NULL;
+    if (file_task->placeholder) {
+        write_func = placeholder_write;
+        write_data = &de->size;
+    } else if (data->direct_checkout) {
+        write_func = direct_checkout_write;
+        write_data = &direct;
+    }
+
+    if (seaf_fs_manager_checkout_file_with_writer (seaf->fs_mgr,
+                                                   repo_id,
+                                                   repo_version,
+                                                   file_id,
+                                                   file_task->path,
+                                                   de->mode,
+                                                   de->mtime,
+                                                   crypt,
+                                                   de->name,
+                                                   conflict_head_id,
+                                                   force_conflict,
+                                                   &conflicted,
+                                                   http_task->email,
+                                                   write_func,
+                                                   write_data) < 0) {
         seaf_warning ("Failed to checkout file %s.\n", file_task->path);
 
         if (seaf_filelock_manager_is_file_locked (seaf->filelock_mgr,
@@ -5132,6 +7084,13 @@ checkout_file_http (FileTxData *data,
             seaf_filelock_manager_lock_wt_file (seaf->filelock_mgr,
                                                 repo_id, de->name);
 
+        /* A retry streams the file again and takes its own references. */
+        release_direct_refs (http_task, &direct);
+
+        if (http_task->state == HTTP_TASK_STATE_CANCELED)
+            return FETCH_CHECKOUT_CANCELED;
+        if (direct.transfer_failed)
+            return FETCH_CHECKOUT_TRANSFER_ERROR;
         return FETCH_CHECKOUT_FAILED;
     }
 
@@ -5139,9 +7098,63 @@ checkout_file_http (FileTxData *data,
         seaf_filelock_manager_lock_wt_file (seaf->filelock_mgr,
                                             repo_id, de->name);
 
-    cleanup_file_blocks_http (http_task, file_id);
+    /* Only the blocks that were referenced for this file are released.
+     * Blocks streamed by a direct checkout were never referenced. */
+    if (write_func == direct_checkout_write)
+        release_direct_refs (http_task, &direct);
+    else if (!file_task->placeholder)
+        cleanup_file_blocks_http (http_task, file_id);
+
+    file_task->conflicted = conflicted;
+
+    /* The stat info is filled into the index entry by the main thread,
+     * together with the new file id.
+     */
+    seaf_stat (file_task->path, &file_task->st);
+
+#ifndef WIN32
+    /* Keep applications from writing to the placeholder without
+     * hydrating it first. Only the owner x bit is in the index. */
+    if (file_task->placeholder && !conflicted) {
+        chmod (file_task->path, file_task->st.st_mode & 0555);
+        seaf_stat (file_task->path, &file_task->st);
+    }
+#endif
+    file_task->checked_out = TRUE;
+
+    return FETCH_CHECKOUT_SUCCESS;
+}
+
+/* Called on the main thread after checkout_file_http(). */
+static void
+finish_checkout_file_http (FileTxTask *file_task,
+                           const char *repo_id,
+                           HttpTxTask *http_task,
+                           LockedFileSet *fset)
+{
+    struct cache_entry *ce = file_task->ce;
+    DiffEntry *de = file_task->de;
+
+#if defined WIN32 || defined __APPLE__
+    if (file_task->locked) {
+        char file_id[41];
+
+        rawdata_to_hex (de->sha1, file_id, 20);
+        if (!locked_file_set_lookup (fset, de->name))
+            send_file_sync_error_notification (repo_id, NULL, de->name,
+                                               SYNC_ERROR_ID_FILE_LOCKED_BY_APP);
+
+        locked_file_set_add_update (fset, de->name, LOCKED_OP_UPDATE,
+                                    ce->ce_mtime.sec, file_id);
+        /* Stay in syncing status if the file is locked. */
+        return;
+    }
+#endif
+
+    if (!file_task->checked_out)
+        return;
 
-    if (conflicted) {
+    if (file_task->conflicted) {
         send_file_sync_error_notification (repo_id, NULL, de->name, SYNC_ERROR_ID_CONFLICT);
     } else if (!http_task->is_clone) {
         char *orig_path = NULL;
@@ -5154,10 +7167,28 @@ checkout_file_http (FileTxData *data,
     /* Only update index if we checked out the file without any error
      * or conflicts. The ctime of the entry will remain 0 if error.
      */
-    seaf_stat (file_task->path, &st);
-    fill_stat_cache_info (ce, &st);
+    fill_stat_cache_info (ce, &file_task->st);
+}
 
-    return FETCH_CHECKOUT_SUCCESS;
+/* Called on the main thread after finish_checkout_file_http(). */
+static void
+update_placeholder_record (FileTxData *data, FileTxTask *file_task)
+{
+    DiffEntry *de = file_task->de;
+    char file_id[41];
+
+    if (!file_task->checked_out || file_task->conflicted)
+        return;
+
+    if (file_task->placeholder) {
+        rawdata_to_hex (de->sha1, file_id, 20);
+        save_placeholder (seaf->repo_mgr, data->repo_id, de->name, file_id,
+                          file_task->st.st_mtime, file_task->st.st_size,
+                          de->mode);
+    } else if (data->placeholders &&
+               g_hash_table_contains (data->placeholders, de->name)) {
+        remove_placeholder (seaf->repo_mgr, data->repo_id, de->name);
+    }
 }
 
 static void
@@ -5166,7 +7197,7 @@ handle_dir_added_de (const char *repo_id,
                      const char *worktree,
                      struct index_state *istate,
                      DiffEntry *de,
-                     GHashTable *no_case_conflict_hash)
+                     CaseConflictCache *case_cache)
 {
     seaf_debug ("Checkout empty dir %s.\n", de->name);
 
@@ -5175,7 +7206,7 @@ handle_dir_added_de (const char *repo_id,
 
     ce = index_name_exists (istate, de->name, strlen(de->name), 0);
     if (!ce) {
-        ce = cache_entry_from_diff_entry (de);
+        ce = cache_entry_from_diff_entry (istate, de);
         add_ce = TRUE;
     }
 
@@ -5192,7 +7223,7 @@ handle_dir_added_de (const char *repo_id,
         goto update_index;
     }
 
-    if (is_path_case_conflict(worktree, de->name, NULL, no_case_conflict_hash)) {
+    if (is_path_case_conflict(worktree, de->name, NULL, case_cache)) {
         seaf_message ("Path %s is case conflict, skip checkout\n", de->name);
         send_file_sync_error_notification (repo_id, repo_name, de->name,
                                            SYNC_ERROR_ID_CASE_CONFLICT);
@@ -5203,6 +7234,7 @@ handle_dir_added_de (const char *repo_id,
                         de->name,
                         de->mtime,
                         ce);
+    case_conflict_cache_update (case_cache, de->name);
 
     seaf_sync_manager_update_active_path (seaf->sync_mgr,
                                           repo_id,
@@ -5222,6 +7254,95 @@ update_index:
 }
 
 #define DEFAULT_DOWNLOAD_THREADS 3
+#define MAX_DOWNLOAD_THREADS 32
+
+static int
+get_download_threads ()
+{
+    int n = seafile_session_config_get_int (seaf, KEY_DOWNLOAD_THREADS, NULL);
+
+    if (n <= 0)
+        return DEFAULT_DOWNLOAD_THREADS;
+    return MIN (n, MAX_DOWNLOAD_THREADS);
+}
+
+/* Queued files are downloaded biggest first, so that the long transfers
+ * start early and don't end up alone at the end of the checkout.
+ */
+static gint
+compare_file_task_size (gconstpointer a, gconstpointer b, gpointer unused)
+{
+    const FileTxTask *ta = a, *tb = b;
+
+    if (ta->de->size > tb->de->size)
+        return -1;
+    if (ta->de->size < tb->de->size)
+        return 1;
+    return 0;
+}
+
+/* Prefetch the blocks of up to BATCH_FETCH_FILES small files at a time,
+ * then hand the files to the download threads. */
+static void
+schedule_small_file_fetch (GThreadPool *tpool, HttpTxTask *http_task,
+                           GList *small_files)
+{
+    GList *ptr, *batch_start, *file_ids;
+    FileTxTask *file_task;
+    char file_id[41];
+    int n;
+
+    ptr = small_files;
+    while (ptr) {
+        batch_start = ptr;
+        file_ids = NULL;
+        for (n = 0; ptr && n < BATCH_FETCH_FILES; ++n, ptr = ptr->next) {
+            file_task = ptr->data;
+            rawdata_to_hex (file_task->de->sha1, file_id, 20);
+            file_ids = g_list_prepend (file_ids, g_strdup(file_id));
+        }
+
+        if (http_task->state != HTTP_TASK_STATE_CANCELED && !http_task->all_stop)
+            http_tx_task_prefetch_file_blocks (http_task, file_ids);
+        g_list_free_full (file_ids, g_free);
+
+        for (; batch_start != ptr; batch_start = batch_start->next)
+            g_thread_pool_push (tpool, batch_start->data, NULL);
+    }
+}
+
+/*
+ * Placeholders are sparse files, which only save disk space on file
+ * systems with sparse file support. Windows needs Cloud Files API
+ * placeholders instead, so on-demand checkout is not done there.
+ *
+ * Without a hydration provider nothing fills a placeholder before an
+ * application reads it, and an editor that saves by writing a new file
+ * and renaming it over the old one would turn the zeros into a real
+ * change. Files are then checked out with their content.
+ */
+static gboolean
+is_on_demand_checkout (HttpTxTask *http_task)
+{
+#ifdef WIN32
+    return FALSE;
+#else
+    SeafRepo *repo;
+
+    if (!seaf_repo_manager_has_hydration_provider (seaf->repo_mgr))
+        return FALSE;
+
+    /* The repo is only created after the first checkout. */
+    if (http_task->is_clone) {
+        CloneTask *task = seaf_clone_manager_get_task (seaf->clone_mgr,
+                                                       http_task->repo_id);
+        return (task && task->on_demand);
+    }
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, http_task->repo_id);
+    return (repo && repo->on_demand);
+#endif
+}
 
 static int
 download_files_http (const char *repo_id,
@@ -5234,7 +7355,7 @@ download_files_http (const char *repo_id,
                      GList *results,
                      const char *conflict_head_id,
                      LockedFileSet *fset,
-                     GHashTable *no_case_conflict_hash)
+                     CaseConflictCache *case_cache)
 {
     struct cache_entry *ce;
     DiffEntry *de;
@@ -5243,7 +7364,8 @@ download_files_http (const char *repo_id,
     GAsyncQueue *finished_tasks;
     GHashTable *pending_tasks;
     GHashTable *case_conflict_hash;
-    GList *adding_files = NULL;
+    GHashTable *adding_files;
+    GList *small_files = NULL;
     GList *ptr;
     FileTxTask *task;
     int ret = FETCH_CHECKOUT_SUCCESS;
@@ -5258,17 +7380,37 @@ download_files_http (const char *repo_id,
     data.crypt = crypt;
     data.http_task = http_task;
     memcpy (data.conflict_head_id, conflict_head_id, 40);
+    data.worktree = worktree;
     data.finished_tasks = finished_tasks;
+    data.direct_checkout = seafile_session_config_get_bool (seaf,
+                                                            KEY_DIRECT_CHECKOUT);
+    data.on_demand = is_on_demand_checkout (http_task);
+    if (data.on_demand)
+        data.placeholders = load_placeholders (seaf->repo_mgr, repo_id, NULL);
 
     tpool = g_thread_pool_new (fetch_file_thread_func, &data,
-                               DEFAULT_DOWNLOAD_THREADS, FALSE, NULL);
+                               get_download_threads (), FALSE, NULL);
+    g_thread_pool_set_sort_function (tpool, compare_file_task_size, NULL);
 
+    /* Diff entries outlive the download, so their names are used as keys
+     * without copying. */
     pending_tasks = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                           g_free, (GDestroyNotify)file_tx_task_free);
+                                           NULL, (GDestroyNotify)file_tx_task_free);
+    adding_files = g_hash_table_new (path_case_hash, path_case_equal);
 
     case_conflict_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
                                             g_free, NULL);
 
+    /* Added files may be copies of files that are already in the worktree. */
+    for (ptr = results; ptr != NULL; ptr = ptr->next) {
+        de = ptr->data;
+        if (de->status == DIFF_STATUS_ADDED &&
+            de->size >= LOCAL_BLOCK_REUSE_MIN_SIZE) {
+            data.local_files = collect_local_files (istate);
+            break;
+        }
+    }
+
     for (ptr = results; ptr != NULL; ptr = ptr->next) {
         de = ptr->data;
 
@@ -5277,7 +7419,7 @@ download_files_http (const char *repo_id,
         }
 
         if (de->status == DIFF_STATUS_DIR_ADDED) {
-            handle_dir_added_de (repo_id, http_task->repo_name, worktree, istate, de, no_case_conflict_hash);
+            handle_dir_added_de (repo_id, http_task->repo_name, worktree, istate, de, case_cache);
         } else if (de->status == DIFF_STATUS_ADDED ||
                    de->status == DIFF_STATUS_MODIFIED) {
             if (FETCH_CHECKOUT_FAILED == schedule_file_fetch (tpool,
@@ -5288,12 +7430,19 @@ download_files_http (const char *repo_id,
                                                               de,
                                                               pending_tasks,
                                                               case_conflict_hash,
-                                                              no_case_conflict_hash,
-                                                              &adding_files))
+                                                              case_cache,
+                                                              adding_files,
+                                                              (http_tx_task_block_packs_supported (http_task) &&
+                                                               !data.on_demand) ?
+                                                              &small_files : NULL))
                 continue;
         }
     }
 
+    small_files = g_list_reverse (small_files);
+    schedule_small_file_fetch (tpool, http_task, small_files);
+    g_list_free (small_files);
+
     /* If there is no file need to be downloaded, return immediately. */
     if (g_hash_table_size(pending_tasks) == 0) {
         if (results != NULL)
@@ -5319,8 +7468,10 @@ download_files_http (const char *repo_id,
             goto out;
         }
 
-        int rc = checkout_file_http (&data, task, worktree,
-                                     conflict_head_id, fset);
+        int rc = task->checkout_result;
+        finish_checkout_file_http (task, repo_id, http_task, fset);
+        if (data.on_demand)
+            update_placeholder_record (&data, task);
 
         // Record a file-level sync error when failed to checkout file.
         if (rc == FETCH_CHECKOUT_FAILED) {
@@ -5357,48 +7508,205 @@ download_files_http (const char *repo_id,
             ce->ce_mtime.sec = de->mtime;
             ce->ce_size = de->size;
             memcpy (ce->sha1, de->sha1, 20);
-            if (ce->modifier) g_free (ce->modifier);
-            ce->modifier = g_strdup(de->modifier);
+            cache_entry_set_modifier (ce, de->modifier);
             ce->ce_mode = create_ce_mode (de->mode);
         }
 
-        g_hash_table_remove (pending_tasks, de->name);
+        g_hash_table_remove (pending_tasks, de->name);
+
+        if (g_hash_table_size (pending_tasks) == 0)
+            break;
+
+        /* Save index file to disk after checking out some size of files.
+         * This way we don't need to re-compare too many files if this
+         * checkout is interrupted.
+         */
+        checkout_size += ce->ce_size;
+        if (checkout_size >= UPDATE_CACHE_SIZE_LIMIT) {
+            update_index (istate, index_path);
+            checkout_size = 0;
+        }
+    }
+
+    update_index (istate, index_path);
+
+out:
+    /* Wait until all threads exit.
+     * This is necessary when the download is canceled or encountered error.
+     */
+    g_thread_pool_free (tpool, TRUE, TRUE);
+
+    /* Free all pending file task structs. */
+    g_hash_table_destroy (pending_tasks);
+
+    g_hash_table_destroy (case_conflict_hash);
+
+    if (data.local_files)
+        g_hash_table_destroy (data.local_files);
+
+    if (data.placeholders)
+        g_hash_table_destroy (data.placeholders);
+
+    g_hash_table_destroy (adding_files);
+
+    g_async_queue_unref (finished_tasks);
+
+    return ret;
+}
+
+/*
+ * Sync filters on checkout.
+ *
+ * The paths left out by the filter are skipped when diffing and
+ * expanding the trees. When the filter has changed since the last
+ * checkout, the paths synced by both filters are diffed as usual, and the
+ * paths only synced by the new one are checked out from scratch. Index
+ * entries of the paths no longer synced are dropped, their files are left
+ * in the worktree.
+ */
+typedef struct CheckoutFilter {
+    SyncFilter *filter;
+    /* The filter of the last checkout, only set if it has changed. */
+    SyncFilter *old_filter;
+    gboolean changed;
+    /* The REPO_PROP_SYNC_FILTER value @filter was made from. */
+    char *value;
+} CheckoutFilter;
+
+static void
+load_checkout_filter (HttpTxTask *http_task, CheckoutFilter *cf)
+{
+    char *applied;
+
+    memset (cf, 0, sizeof(*cf));
+
+    if (http_task->is_clone) {
+        CloneTask *task = seaf_clone_manager_get_task (seaf->clone_mgr,
+                                                       http_task->repo_id);
+        if (task && task->sync_filter)
+            cf->value = g_strdup (task->sync_filter);
+        cf->filter = sync_filter_new (cf->value);
+        return;
+    }
+
+    cf->value = load_repo_property (seaf->repo_mgr, http_task->repo_id,
+                                    REPO_PROP_SYNC_FILTER);
+    applied = load_repo_property (seaf->repo_mgr, http_task->repo_id,
+                                  REPO_PROP_SYNC_FILTER_APPLIED);
+    cf->filter = sync_filter_new (cf->value);
+    cf->changed = sync_filter_prop_changed (cf->value, applied);
+    if (cf->changed)
+        cf->old_filter = sync_filter_new (applied);
+    g_free (applied);
+}
+
+static void
+save_checkout_filter (HttpTxTask *http_task, CheckoutFilter *cf)
+{
+    SeafRepo *repo;
+    char *value;
+
+    if (!cf->changed && !(http_task->is_clone && cf->value))
+        return;
 
-        if (g_hash_table_size (pending_tasks) == 0)
-            break;
+    save_repo_property (seaf->repo_mgr, http_task->repo_id,
+                        REPO_PROP_SYNC_FILTER_APPLIED,
+                        cf->value ? cf->value : "");
 
-        /* Save index file to disk after checking out some size of files.
-         * This way we don't need to re-compare too many files if this
-         * checkout is interrupted.
-         */
-        checkout_size += ce->ce_size;
-        if (checkout_size >= UPDATE_CACHE_SIZE_LIMIT) {
-            update_index (istate, index_path);
-            checkout_size = 0;
-        }
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, http_task->repo_id);
+    if (!repo)
+        return;
+
+    /* The filter may have been changed again during the download. */
+    value = load_repo_property (seaf->repo_mgr, http_task->repo_id,
+                                REPO_PROP_SYNC_FILTER);
+    pthread_mutex_lock (&repo->lock);
+    repo->sync_filter_changed = sync_filter_prop_changed (value, cf->value);
+    pthread_mutex_unlock (&repo->lock);
+    g_free (value);
+}
+
+static void
+checkout_filter_free (CheckoutFilter *cf)
+{
+    sync_filter_unref (cf->filter);
+    sync_filter_unref (cf->old_filter);
+    g_free (cf->value);
+}
+
+SyncFilter *
+seaf_repo_manager_get_download_filter (SeafRepoManager *mgr,
+                                       const char *repo_id,
+                                       gboolean is_clone,
+                                       gboolean *changed)
+{
+    SeafRepo *repo;
+    SyncFilter *filter;
+
+    *changed = FALSE;
+
+    if (is_clone) {
+        CloneTask *task = seaf_clone_manager_get_task (seaf->clone_mgr, repo_id);
+        return task ? sync_filter_new (task->sync_filter) : NULL;
     }
 
-    update_index (istate, index_path);
+    repo = seaf_repo_manager_get_repo (mgr, repo_id);
+    if (!repo)
+        return NULL;
 
-out:
-    /* Wait until all threads exit.
-     * This is necessary when the download is canceled or encountered error.
-     */
-    g_thread_pool_free (tpool, TRUE, TRUE);
+    pthread_mutex_lock (&repo->lock);
+    filter = sync_filter_ref (repo->sync_filter);
+    *changed = repo->sync_filter_changed;
+    pthread_mutex_unlock (&repo->lock);
 
-    /* Free all pending file task structs. */
-    g_hash_table_destroy (pending_tasks);
+    return filter;
+}
 
-    g_hash_table_destroy (case_conflict_hash);
+/* Skips the paths not synced by both the new and the last filter. */
+static gboolean
+skip_unsynced_path (const char *path, gboolean is_dir, void *data)
+{
+    CheckoutFilter *cf = data;
 
-    if (adding_files)
-        string_list_free (adding_files);
+    return (!sync_filter_is_synced (cf->filter, path, is_dir) ||
+            !sync_filter_is_synced (cf->old_filter, path, is_dir));
+}
 
-    g_async_queue_unref (finished_tasks);
+/* Skips the paths not synced by the new filter, or fully synced by the
+ * last one. */
+static gboolean
+skip_synced_before (const char *path, gboolean is_dir, void *data)
+{
+    CheckoutFilter *cf = data;
 
-    return ret;
+    return (!sync_filter_is_synced (cf->filter, path, is_dir) ||
+            sync_filter_check (cf->old_filter, path) == SYNC_FILTER_INCLUDED);
+}
+
+static void
+remove_unsynced_index_entries (struct index_state *istate, SyncFilter *filter)
+{
+    struct cache_entry *ce;
+    unsigned int i;
+
+    if (!filter)
+        return;
+
+    for (i = 0; i < istate->cache_nr; ++i) {
+        ce = istate->cache[i];
+        if (!sync_filter_is_synced (filter, ce->name, S_ISDIR(ce->ce_mode)))
+            ce->ce_flags |= CE_REMOVE;
+    }
+    remove_marked_cache_entries (istate);
 }
 
+typedef struct ExpandData {
+    GList *expanded;
+    /* Optional, the paths to leave out. */
+    DiffSkipFunc skip_path;
+    void *skip_data;
+} ExpandData;
+
 static gboolean
 expand_dir_added_cb (SeafFSManager *mgr,
                      const char *path,
@@ -5406,10 +7714,16 @@ expand_dir_added_cb (SeafFSManager *mgr,
                      void *user_data,
                      gboolean *stop)
 {
-    GList **expanded = user_data;
+    ExpandData *data = user_data;
     DiffEntry *de = NULL;
     unsigned char sha1[20];
 
+    if (data->skip_path &&
+        data->skip_path (path, S_ISDIR(dent->mode), data->skip_data)) {
+        *stop = TRUE;
+        return TRUE;
+    }
+
     hex_to_rawdata (dent->id, sha1, 20);
 
     if (S_ISDIR(dent->mode) && strcmp(dent->id, EMPTY_SHA1) == 0)
@@ -5422,7 +7736,7 @@ expand_dir_added_cb (SeafFSManager *mgr,
         de->mode = dent->mode;
         de->modifier = g_strdup(dent->modifier);
         de->size = dent->size;
-        *expanded = g_list_prepend (*expanded, de);
+        data->expanded = g_list_prepend (data->expanded, de);
     }
 
     return TRUE;
@@ -5434,12 +7748,17 @@ expand_dir_added_cb (SeafFSManager *mgr,
 static int
 expand_diff_results (const char *repo_id, int version,
                      const char *remote_root, const char *local_root,
-                     GList **results)
+                     GList **results,
+                     DiffSkipFunc skip_path, void *skip_data)
 {
     GList *ptr, *next;
     DiffEntry *de;
     char obj_id[41];
-    GList *expanded = NULL;
+    ExpandData data;
+
+    memset (&data, 0, sizeof(data));
+    data.skip_path = skip_path;
+    data.skip_data = skip_data;
 
     ptr = *results;
     while (ptr) {
@@ -5456,7 +7775,7 @@ expand_diff_results (const char *repo_id, int version,
                                                remote_root,
                                                de->name,
                                                expand_dir_added_cb,
-                                               &expanded) < 0) {
+                                               &data) < 0) {
                 diff_entry_free (de);
                 goto error;
             }
@@ -5466,13 +7785,13 @@ expand_diff_results (const char *repo_id, int version,
         ptr = next;
     }
 
-    expanded = g_list_reverse (expanded);
-    *results = g_list_concat (*results, expanded);
+    data.expanded = g_list_reverse (data.expanded);
+    *results = g_list_concat (*results, data.expanded);
 
     return 0;
 
 error:
-    g_list_free_full (expanded, (GDestroyNotify)diff_entry_free);
+    g_list_free_full (data.expanded, (GDestroyNotify)diff_entry_free);
     return -1;
 }
 
@@ -5557,7 +7876,7 @@ delete_worktree_dir_recursive_win32 (struct index_state *istate,
     wcscpy (pattern, path_w);
     wcscat (pattern, L"\\*");
 
-    handle = FindFirstFileW (pattern, &fdata);
+    handle = seaf_util_find_first_file (pattern, &fdata);
     g_free (pattern);
 
     if (handle == INVALID_HANDLE_VALUE) {
@@ -5655,36 +7974,30 @@ delete_worktree_dir_recursive (struct index_state *istate,
                                const char *path,
                                const char *full_path)
 {
-    GDir *dir;
-    const char *dname;
+    GPtrArray *dents;
+    SeafDirEntry *dent;
     char *dname_nfc;
-    GError *error = NULL;
     char *sub_path, *full_sub_path;
     SeafStat st;
+    guint i;
     int ret = 0;
     gboolean builtin_ignored = FALSE;
 
-    dir = g_dir_open (full_path, 0, &error);
-    if (!dir) {
-        seaf_warning ("Failed to open dir %s: %s.\n", full_path, error->message);
+    dents = seaf_util_read_dir_entries (full_path, FALSE);
+    if (!dents) {
+        seaf_warning ("Failed to open dir %s: %s.\n", full_path, strerror(errno));
         return -1;
     }
 
-    while ((dname = g_dir_read_name (dir)) != NULL) {
-        dname_nfc = g_utf8_normalize (dname, -1, G_NORMALIZE_NFC);
+    for (i = 0; i < dents->len; ++i) {
+        dent = g_ptr_array_index (dents, i);
+        st = dent->st;
+        dname_nfc = g_utf8_normalize (dent->name, -1, G_NORMALIZE_NFC);
         sub_path = g_build_path ("/", path, dname_nfc, NULL);
         full_sub_path = g_build_path ("/", full_path, dname_nfc, NULL);
         builtin_ignored = is_built_in_ignored_file (dname_nfc);
         g_free (dname_nfc);
 
-        if (lstat (full_sub_path, &st) < 0) {
-            seaf_warning ("Failed to stat %s.\n", full_sub_path);
-            g_free (sub_path);
-            g_free (full_sub_path);
-            ret = -1;
-            continue;
-        }
-
         if (S_ISDIR(st.st_mode)) {
             if (delete_worktree_dir_recursive (istate, sub_path, full_sub_path) < 0)
                 ret = -1;
@@ -5714,7 +8027,7 @@ delete_worktree_dir_recursive (struct index_state *istate,
         g_free (full_sub_path);
     }
 
-    g_dir_close (dir);
+    g_ptr_array_free (dents, TRUE);
 
     if (ret < 0)
         return ret;
@@ -5823,10 +8136,12 @@ convert_rename_to_checkout (const char *repo_id,
                             int repo_version,
                             const char *root_id,
                             DiffEntry *de,
+                            CheckoutFilter *cf,
                             GList **entries)
 {
     if (de->status == DIFF_STATUS_RENAMED) {
         char file_id[41];
+        unsigned char sha1[20];
         SeafDirent *dent = NULL;
         DiffEntry *new_de = NULL;
 
@@ -5843,8 +8158,11 @@ convert_rename_to_checkout (const char *repo_id,
             return -1;
         }
 
+        /* The content may have changed too, if the rename was detected
+         * by block similarity. */
+        hex_to_rawdata (dent->id, sha1, 20);
         new_de = diff_entry_new (DIFF_TYPE_COMMITS, DIFF_STATUS_ADDED,
-                                 de->sha1, de->new_name);
+                                 sha1, de->new_name);
         if (new_de) {
             new_de->mtime = dent->mtime;
             new_de->mode = dent->mode;
@@ -5855,19 +8173,23 @@ convert_rename_to_checkout (const char *repo_id,
 
         seaf_dirent_free (dent);
     } else if (de->status == DIFF_STATUS_DIR_RENAMED) {
-        GList *expanded = NULL;
+        ExpandData data;
+
+        memset (&data, 0, sizeof(data));
+        data.skip_path = skip_unsynced_path;
+        data.skip_data = cf;
 
         if (seaf_fs_manager_traverse_path (seaf->fs_mgr,
                                            repo_id, repo_version,
                                            root_id,
                                            de->new_name,
                                            expand_dir_added_cb,
-                                           &expanded) < 0) {
-            g_list_free_full (expanded, (GDestroyNotify)diff_entry_free);
+                                           &data) < 0) {
+            g_list_free_full (data.expanded, (GDestroyNotify)diff_entry_free);
             return -1;
         }
 
-        *entries = g_list_concat (*entries, expanded);
+        *entries = g_list_concat (*entries, data.expanded);
     }
 
     return 0;
@@ -5896,28 +8218,46 @@ load_enc_keys_cb (sqlite3_stmt *stmt, void *vcrypt)
 static int
 load_crypt_from_enc_info (SeafRepoManager *manager, const char *repo_id, SeafileCrypt *crypt)
 {
-    sqlite3 *db = manager->priv->db;
+    sqlite3 *db;
     char sql[256];
     int n;
 
-    pthread_mutex_lock (&manager->priv->db_lock);
+    db = acquire_read_db (manager);
 
     snprintf (sql, sizeof(sql), 
               "SELECT key, iv FROM RepoKeys WHERE repo_id='%s'",
               repo_id);
     n = sqlite_foreach_selected_row (db, sql, load_enc_keys_cb, crypt);
     if (n < 0) {
-        pthread_mutex_unlock (&manager->priv->db_lock);
+        release_read_db (manager, db);
         return -1;
     }
 
-    pthread_mutex_unlock (&manager->priv->db_lock);
+    release_read_db (manager, db);
 
     return 0;
 }
 
-int
-seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
+/* Rough memory used by the diff results of a checkout. */
+static gint64
+diff_results_mem_size (GList *results)
+{
+    GList *ptr;
+    DiffEntry *de;
+    gint64 size = 0;
+
+    for (ptr = results; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        size += sizeof(GList) + sizeof(DiffEntry) + strlen(de->name) + 1;
+        if (de->new_name)
+            size += strlen(de->new_name) + 1;
+    }
+
+    return size;
+}
+
+static int
+fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
 {
     char *repo_id;
     int repo_version;
@@ -5933,9 +8273,11 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
     int ret = FETCH_CHECKOUT_SUCCESS;
     GList *results = NULL;
     SeafileCrypt *crypt = NULL;
-    GList *ignore_list = NULL;
+    SeafIgnoreList *ignore_list = NULL;
     LockedFileSet *fset = NULL;
-    GHashTable *no_case_conflict_hash = NULL;
+    CaseConflictCache *case_cache = NULL;
+    CheckoutFilter cf;
+    gint64 reserved = 0;
 
     repo_id = http_task->repo_id;
     repo_version = http_task->repo_version;
@@ -5943,16 +8285,18 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
     worktree = http_task->worktree;
     passwd = http_task->passwd;
 
+    load_checkout_filter (http_task, &cf);
+
     memset (&istate, 0, sizeof(istate));
     snprintf (index_path, SEAF_PATH_MAX, "%s/%s",
               seaf->repo_mgr->index_dir, repo_id);
     if (read_index_from (&istate, index_path, repo_version) < 0) {
         seaf_warning ("Failed to load index.\n");
+        checkout_filter_free (&cf);
         return FETCH_CHECKOUT_FAILED;
     }
 
-    no_case_conflict_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                            g_free, NULL);
+    case_cache = case_conflict_cache_new (worktree);
 
     if (!is_clone) {
         repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
@@ -5996,10 +8340,13 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
         goto out;
     }
 
-    if (diff_commit_roots (repo_id, repo_version,
-                           master_head ? master_head->root_id : EMPTY_SHA1,
-                           remote_head->root_id,
-                           &results, TRUE) < 0) {
+    if (diff_commit_roots_filtered (repo_id, repo_version,
+                                    master_head ? master_head->root_id : EMPTY_SHA1,
+                                    remote_head->root_id,
+                                    &results, TRUE,
+                                    (cf.filter || cf.changed) ?
+                                    skip_unsynced_path : NULL,
+                                    &cf) < 0) {
         seaf_warning ("Failed to diff for repo %.8s.\n", repo_id);
         ret = FETCH_CHECKOUT_FAILED;
         goto out;
@@ -6012,11 +8359,48 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
     if (expand_diff_results (repo_id, repo_version,
                              remote_head->root_id,
                              master_head ? master_head->root_id : EMPTY_SHA1,
-                             &results) < 0) {
+                             &results,
+                             (cf.filter || cf.changed) ?
+                             skip_unsynced_path : NULL,
+                             &cf) < 0) {
         ret = FETCH_CHECKOUT_FAILED;
         goto out;
     }
 
+    /* Check out the paths the new filter adds, as if they were added on
+     * the server. Dirs are not folded, so that the filter is checked
+     * on every path. */
+    if (cf.changed && master_head) {
+        GList *added = NULL;
+
+        if (diff_commit_roots_filtered (repo_id, repo_version,
+                                        EMPTY_SHA1, remote_head->root_id,
+                                        &added, FALSE,
+                                        skip_synced_before, &cf) < 0) {
+            seaf_warning ("Failed to diff for repo %.8s.\n", repo_id);
+            g_list_free_full (added, (GDestroyNotify)diff_entry_free);
+            ret = FETCH_CHECKOUT_FAILED;
+            goto out;
+        }
+
+        for (ptr = added; ptr; ptr = ptr->next) {
+            de = ptr->data;
+            /* Parents of the old included paths are already there. */
+            if (de->status == DIFF_STATUS_DIR_ADDED &&
+                sync_filter_is_synced (cf.old_filter, de->name, TRUE)) {
+                diff_entry_free (de);
+                continue;
+            }
+            results = g_list_prepend (results, de);
+        }
+        g_list_free (added);
+
+        remove_unsynced_index_entries (&istate, cf.filter);
+    }
+
+    reserved = diff_results_mem_size (results);
+    mem_budget_reserve (reserved);
+
 #ifdef WIN32
     for (ptr = results; ptr; ptr = ptr->next) {
         de = ptr->data;
@@ -6102,8 +8486,9 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
 #if defined WIN32 || defined __APPLE__
             if (!do_check_file_locked (de->name, worktree, locked_on_server)) {
                 locked_file_set_remove (fset, de->name, FALSE);
-                if (!is_path_case_conflict (worktree, de->name, NULL, no_case_conflict_hash)) {
+                if (!is_path_case_conflict (worktree, de->name, NULL, case_cache)) {
                     delete_path (worktree, de->name, de->mode, ce->ce_mtime.sec);
+                    case_conflict_cache_update (case_cache, de->name);
                 } else {
                     seaf_message ("Path %s is case conflict, skip delete\n", de->name);
                     send_file_sync_error_notification (repo_id, NULL, de->name,
@@ -6141,8 +8526,9 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
                 continue;
             }
 
-            if (!is_path_case_conflict (worktree, de->name, NULL, no_case_conflict_hash)) {
+            if (!is_path_case_conflict (worktree, de->name, NULL, case_cache)) {
                 delete_worktree_dir (repo_id, http_task->repo_name, &istate, worktree, de->name);
+                case_conflict_cache_update (case_cache, de->name);
             } else {
                 seaf_message ("Path %s is case conflict, skip delete\n", de->name);
                 send_file_sync_error_notification (repo_id, NULL, de->name,
@@ -6183,7 +8569,7 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
                  */
                 convert_rename_to_checkout (repo_id, repo_version,
                                             remote_head->root_id,
-                                            de, &results);
+                                            de, &cf, &results);
                 continue;
             }
 #endif
@@ -6193,15 +8579,17 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
                 seaf_filelock_manager_unlock_wt_file (seaf->filelock_mgr,
                                                       repo_id, de->name);
 
-            gboolean old_path_conflict = is_path_case_conflict(worktree, de->name, NULL, no_case_conflict_hash);
-            gboolean new_path_conflict = is_path_case_conflict(worktree, de->new_name, NULL, no_case_conflict_hash);
+            gboolean old_path_conflict = is_path_case_conflict(worktree, de->name, NULL, case_cache);
+            gboolean new_path_conflict = is_path_case_conflict(worktree, de->new_name, NULL, case_cache);
             if (!old_path_conflict && !new_path_conflict) {
                 do_rename_in_worktree (de, worktree);
+                case_conflict_cache_update (case_cache, de->name);
+                case_conflict_cache_update (case_cache, de->new_name);
             } else if (old_path_conflict) {
                 seaf_message ("Case conflict path %s is renamed to %s without case conflict, check it out\n", de->name, de->new_name);
                 convert_rename_to_checkout (repo_id, repo_version,
                                             remote_head->root_id,
-                                            de, &results);
+                                            de, &cf, &results);
                 continue;
             } else if (new_path_conflict) {
                 // check if file has been changed and delete old path.
@@ -6210,6 +8598,7 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
                     send_file_sync_error_notification (repo_id, NULL, de->new_name,
                                    SYNC_ERROR_ID_CASE_CONFLICT);
                     delete_worktree_dir (repo_id, http_task->repo_name, &istate, worktree, de->name);
+                    case_conflict_cache_update (case_cache, de->name);
                 } else {
                     ce = index_name_exists (&istate, de->name, strlen(de->name), 0);
                     if (ce) {
@@ -6217,66 +8606,397 @@ seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
                         send_file_sync_error_notification (repo_id, NULL, de->new_name,
                                        SYNC_ERROR_ID_CASE_CONFLICT);
                         delete_path (worktree, de->name, de->mode, ce->ce_mtime.sec);
+                        case_conflict_cache_update (case_cache, de->name);
                     }
                 }
             }
             /* update_sync_status updates the sync status for each renamed path.
              * The renamed file/folder becomes "synced" immediately after rename.
              */
-            if (!is_clone)
+            if (!is_clone) {
                 rename_index_entries (&istate, de->name, de->new_name, NULL,
                                       update_sync_status, repo_id);
-            else
+                if (repo->on_demand)
+                    rename_placeholders (seaf->repo_mgr, repo_id,
+                                         de->name, de->new_name);
+            } else
                 rename_index_entries (&istate, de->name, de->new_name, NULL,
                                       NULL, NULL);
 
-            /* Moving files out of a dir may make it empty. */
-            try_add_empty_parent_dir_entry (worktree, &istate, de->name);
-        }
+            /* Moving files out of a dir may make it empty. */
+            try_add_empty_parent_dir_entry (worktree, &istate, de->name);
+        }
+    }
+
+    if (istate.cache_changed)
+        update_index (&istate, index_path);
+
+    for (ptr = results; ptr; ptr = ptr->next) {
+        de = ptr->data;
+        if (de->status == DIFF_STATUS_ADDED || de->status == DIFF_STATUS_MODIFIED) {
+            http_task->total_download += de->size;
+        }
+    }
+    if (http_task->total_download >= BULK_TRANSFER_SIZE)
+        http_task->bulk = TRUE;
+
+    ret = download_files_http (repo_id,
+                               repo_version,
+                               worktree,
+                               &istate,
+                               index_path,
+                               crypt,
+                               http_task,
+                               results,
+                               remote_head_id,
+                               fset,
+                               case_cache);
+    if (ret == FETCH_CHECKOUT_SUCCESS)
+        save_checkout_filter (http_task, &cf);
+
+out:
+    discard_index (&istate);
+    checkout_filter_free (&cf);
+
+    seaf_branch_unref (master);
+    seaf_commit_unref (master_head);
+    seaf_commit_unref (remote_head);
+
+    g_list_free_full (results, (GDestroyNotify)diff_entry_free);
+    mem_budget_release (reserved);
+
+    g_free (crypt);
+
+    if (ignore_list)
+        seaf_repo_free_ignore_files (ignore_list);
+
+#if defined WIN32 || defined __APPLE__
+    locked_file_set_free (fset);
+#endif
+
+    case_conflict_cache_free (case_cache);
+
+    return ret;
+}
+
+int
+seaf_repo_fetch_and_checkout (HttpTxTask *http_task, const char *remote_head_id)
+{
+    SeafRepo *repo = NULL;
+    int ret;
+
+    /* A cloned repo is not visible to hydration until the clone is done. */
+    if (!http_task->is_clone)
+        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, http_task->repo_id);
+
+    if (repo)
+        pthread_mutex_lock (&repo->worktree_lock);
+    ret = fetch_and_checkout (http_task, remote_head_id);
+    if (repo)
+        pthread_mutex_unlock (&repo->worktree_lock);
+
+    return ret;
+}
+
+/* Write a block fetched for hydration to the block store of the repo. */
+static int
+store_hydrate_block (const char *block_id, const void *buf, int len,
+                     void *user_data)
+{
+    SeafRepo *repo = user_data;
+    BlockHandle *block;
+    int ret = 0;
+
+    block = seaf_block_manager_open_block (seaf->block_mgr,
+                                           repo->id, repo->version,
+                                           block_id, BLOCK_WRITE);
+    if (!block)
+        return -1;
+
+    if (seaf_block_manager_write_block (seaf->block_mgr, block, buf, len) != len) {
+        seaf_warning ("Failed to write block %s in repo %.8s.\n",
+                      block_id, repo->id);
+        ret = -1;
+    }
+    if (seaf_block_manager_close_block (seaf->block_mgr, block) < 0)
+        ret = -1;
+    if (ret == 0 &&
+        seaf_block_manager_commit_block (seaf->block_mgr, block) < 0) {
+        seaf_warning ("Failed to commit block %s in repo %.8s.\n",
+                      block_id, repo->id);
+        ret = -1;
+    }
+    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+
+    return ret;
+}
+
+/*
+ * Get the blocks of @file that are not in the block store, from the LAN
+ * peers first and then from the server. All blocks of the file are pinned
+ * and returned in @pinned, so that they stay until the file is checked
+ * out. The ids of the blocks written are returned in @fetched, so that
+ * they are removed after checkout.
+ */
+static int
+fetch_blocks_for_hydrate (SeafRepo *repo, Seafile *file,
+                          GList **pinned, GList **fetched)
+{
+    GList *needed = NULL, *ptr;
+    char *block_id, *buf = NULL;
+    gint64 len;
+    int i, ret = 0;
+
+    for (i = 0; i < file->n_blocks; ++i) {
+        block_id = file->blk_sha1s[i];
+        if (g_list_find_custom (*pinned, block_id, (GCompareFunc)g_strcmp0))
+            continue;
+
+        seaf_block_manager_pin_block (seaf->block_mgr, repo->id,
+                                      repo->version, block_id);
+        *pinned = g_list_prepend (*pinned, block_id);
+        if (!seaf_block_manager_block_exists (seaf->block_mgr,
+                                              repo->id, repo->version,
+                                              block_id))
+            needed = g_list_prepend (needed, block_id);
+    }
+    needed = g_list_reverse (needed);
+
+    for (ptr = needed; ptr; ptr = ptr->next)
+        *fetched = g_list_prepend (*fetched, ptr->data);
+
+    needed = seaf_peer_block_manager_fetch_blocks (seaf->peer_block_mgr,
+                                                   repo->id,
+                                                   repo->head->commit_id,
+                                                   needed,
+                                                   store_hydrate_block, repo);
+
+    for (ptr = needed; ptr; ptr = ptr->next) {
+        block_id = ptr->data;
+        if (http_tx_manager_get_block (seaf->http_tx_mgr,
+                                       repo->effective_host,
+                                       repo->use_fileserver_port,
+                                       repo->token, repo->id, block_id,
+                                       &buf, &len) < 0) {
+            ret = -1;
+            break;
+        }
+
+        if (store_hydrate_block (block_id, buf, (int)len, repo) < 0)
+            ret = -1;
+        g_free (buf);
+        buf = NULL;
+        if (ret < 0)
+            break;
+    }
+
+    g_list_free (needed);
+    return ret;
+}
+
+/* Returns the placeholder record of @path if the worktree file and the
+ * index entry are still those checked out for it. Called with the
+ * worktree lock held. */
+static PlaceholderFile *
+lookup_untouched_placeholder (SeafRepo *repo, const char *path,
+                              const char *full_path)
+{
+    GHashTable *placeholders;
+    PlaceholderFile *ph, *ret = NULL;
+    struct index_state istate;
+    struct cache_entry *ce;
+    char index_path[SEAF_PATH_MAX];
+    unsigned char sha1[20];
+    SeafStat st;
+
+    placeholders = load_placeholders (repo->manager, repo->id, path);
+    ph = g_hash_table_lookup (placeholders, path);
+    if (!ph)
+        goto out;
+
+    if (seaf_stat (full_path, &st) < 0 || !placeholder_is_untouched (ph, &st)) {
+        /* Removed, or written by the user. */
+        remove_placeholder (repo->manager, repo->id, path);
+        goto out;
+    }
+
+    memset (&istate, 0, sizeof(istate));
+    snprintf (index_path, SEAF_PATH_MAX, "%s/%s",
+              repo->manager->index_dir, repo->id);
+    if (read_index_from (&istate, index_path, repo->version) < 0) {
+        seaf_warning ("Failed to load index of repo %.8s.\n", repo->id);
+        goto out;
+    }
+
+    hex_to_rawdata (ph->file_id, sha1, 20);
+    ce = index_name_exists (&istate, path, strlen(path), 0);
+    if (ce && memcmp (ce->sha1, sha1, 20) == 0 &&
+        ce->ce_mtime.sec == ph->mtime && ce->ce_size == ph->size) {
+        ret = g_new0 (PlaceholderFile, 1);
+        memcpy (ret, ph, sizeof(PlaceholderFile));
+    }
+    discard_index (&istate);
+
+out:
+    g_hash_table_destroy (placeholders);
+    return ret;
+}
+
+int
+seaf_repo_manager_register_hydration_provider (SeafRepoManager *mgr,
+                                               const char *name)
+{
+    SeafRepoManagerPriv *priv = mgr->priv;
+    int ret = 0;
+
+    pthread_mutex_lock (&priv->hydration_lock);
+    if (!priv->hydration_provider) {
+        priv->hydration_provider = g_strdup (name);
+        seaf_message ("Hydration provider %s registered.\n", name);
+    } else if (strcmp (priv->hydration_provider, name) != 0) {
+        seaf_warning ("Hydration provider %s is already registered, "
+                      "refusing %s.\n", priv->hydration_provider, name);
+        ret = -1;
+    }
+    pthread_mutex_unlock (&priv->hydration_lock);
+
+    return ret;
+}
+
+void
+seaf_repo_manager_unregister_hydration_provider (SeafRepoManager *mgr,
+                                                 const char *name)
+{
+    SeafRepoManagerPriv *priv = mgr->priv;
+
+    pthread_mutex_lock (&priv->hydration_lock);
+    if (g_strcmp0 (priv->hydration_provider, name) == 0) {
+        g_free (priv->hydration_provider);
+        priv->hydration_provider = NULL;
+        seaf_message ("Hydration provider %s unregistered.\n", name);
+    }
+    pthread_mutex_unlock (&priv->hydration_lock);
+}
+
+gboolean
+seaf_repo_manager_has_hydration_provider (SeafRepoManager *mgr)
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&mgr->priv->hydration_lock);
+    ret = (mgr->priv->hydration_provider != NULL);
+    pthread_mutex_unlock (&mgr->priv->hydration_lock);
+
+    return ret;
+}
+
+int
+seaf_repo_manager_hydrate_file (SeafRepoManager *mgr,
+                                const char *repo_id,
+                                const char *path,
+                                GError **error)
+{
+    SeafRepo *repo;
+    PlaceholderFile *ph, *current = NULL;
+    Seafile *file = NULL;
+    SeafileCrypt *crypt = NULL;
+    GList *pinned = NULL, *fetched = NULL, *ptr;
+    char *full_path = NULL;
+    gboolean conflicted = FALSE;
+    int ret = 0;
+
+    repo = seaf_repo_manager_get_repo (mgr, repo_id);
+    if (!repo || !repo->worktree || !repo->head) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_REPO, "Invalid repo");
+        return -1;
     }
 
-    if (istate.cache_changed)
-        update_index (&istate, index_path);
+    full_path = g_build_filename (repo->worktree, path, NULL);
 
-    for (ptr = results; ptr; ptr = ptr->next) {
-        de = ptr->data;
-        if (de->status == DIFF_STATUS_ADDED || de->status == DIFF_STATUS_MODIFIED) {
-            http_task->total_download += de->size;
-        }
+    pthread_mutex_lock (&repo->worktree_lock);
+    ph = lookup_untouched_placeholder (repo, path, full_path);
+    pthread_mutex_unlock (&repo->worktree_lock);
+    if (!ph) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "File is not a placeholder");
+        ret = -1;
+        goto out;
     }
 
-    ret = download_files_http (repo_id,
-                               repo_version,
-                               worktree,
-                               &istate,
-                               index_path,
-                               crypt,
-                               http_task,
-                               results,
-                               remote_head_id,
-                               fset,
-                               no_case_conflict_hash);
+    if (!repo->effective_host || !repo->token) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Server of the repo is not connected yet");
+        ret = -1;
+        goto out;
+    }
 
-out:
-    discard_index (&istate);
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr, repo_id, repo->version,
+                                        ph->file_id);
+    if (!file) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_FILE,
+                     "File object is not found");
+        ret = -1;
+        goto out;
+    }
 
-    seaf_branch_unref (master);
-    seaf_commit_unref (master_head);
-    seaf_commit_unref (remote_head);
+    /* The blocks are downloaded without the worktree lock, so that
+     * indexing and checkout aren't held up by the network. */
+    if (fetch_blocks_for_hydrate (repo, file, &pinned, &fetched) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to download the file");
+        ret = -1;
+        goto out;
+    }
 
-    g_list_free_full (results, (GDestroyNotify)diff_entry_free);
+    if (repo->encrypted)
+        crypt = seafile_crypt_new (repo->enc_version, repo->enc_key, repo->enc_iv);
 
-    g_free (crypt);
+    pthread_mutex_lock (&repo->worktree_lock);
 
-    if (ignore_list)
-        seaf_repo_free_ignore_files (ignore_list);
+    /* The file may have been written, renamed or updated by a checkout
+     * during the download. */
+    current = lookup_untouched_placeholder (repo, path, full_path);
+    if (!current || strcmp (current->file_id, ph->file_id) != 0) {
+        pthread_mutex_unlock (&repo->worktree_lock);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "File was changed during the download");
+        ret = -1;
+        goto out;
+    }
 
-#if defined WIN32 || defined __APPLE__
-    locked_file_set_free (fset);
-#endif
+    /* The file is checked out with the mtime of the placeholder, so the
+     * index entry stays valid. */
+    if (seaf_fs_manager_checkout_file (seaf->fs_mgr, repo_id, repo->version,
+                                       ph->file_id, full_path,
+                                       ph->mode, ph->mtime, crypt,
+                                       path, repo->head->commit_id,
+                                       FALSE, &conflicted, repo->email) < 0 ||
+        conflicted) {
+        pthread_mutex_unlock (&repo->worktree_lock);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to write the file");
+        ret = -1;
+        goto out;
+    }
+
+    remove_placeholder (mgr, repo_id, path);
+
+    pthread_mutex_unlock (&repo->worktree_lock);
 
-    g_hash_table_destroy (no_case_conflict_hash);
+    seaf_debug ("Hydrated %s in repo %.8s.\n", path, repo_id);
 
+out:
+    /* Blocks fetched here are removed once no download uses them. */
+    for (ptr = pinned; ptr; ptr = ptr->next)
+        seaf_block_manager_unpin_block (seaf->block_mgr, repo_id, ptr->data,
+                                        g_list_find (fetched, ptr->data) != NULL);
+    g_list_free (pinned);
+    g_list_free (fetched);
+    seafile_unref (file);
+    g_free (crypt);
+    g_free (full_path);
+    g_free (ph);
+    g_free (current);
     return ret;
 }
 
@@ -6298,6 +9018,7 @@ seaf_repo_manager_set_repo_worktree (SeafRepoManager *mgr,
         return -1;
 
     repo->worktree_invalid = FALSE;
+    seaf_repo_manager_bump_repo_list_seq (mgr);
 
     return 0;
 }
@@ -6310,6 +9031,7 @@ seaf_repo_manager_invalidate_repo_worktree (SeafRepoManager *mgr,
         return;
 
     repo->worktree_invalid = TRUE;
+    seaf_repo_manager_bump_repo_list_seq (mgr);
 
     if (repo->auto_sync && (repo->sync_interval == 0)) {
         if (seaf_wt_monitor_unwatch_repo (seaf->wt_monitor, repo->id) < 0) {
@@ -6326,6 +9048,7 @@ seaf_repo_manager_validate_repo_worktree (SeafRepoManager *mgr,
         return;
 
     repo->worktree_invalid = FALSE;
+    seaf_repo_manager_bump_repo_list_seq (mgr);
 
     if (repo->auto_sync && (repo->sync_interval == 0)) {
         if (seaf_wt_monitor_watch_repo (seaf->wt_monitor, repo->id, repo->worktree) < 0) {
@@ -6377,11 +9100,29 @@ seaf_repo_manager_new (SeafileSession *seaf)
 
     mgr->priv->repo_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
-    pthread_rwlock_init (&mgr->priv->lock, NULL);
+    pthread_mutex_init (&mgr->priv->repo_hash_lock, NULL);
 
     mgr->priv->lock_office_job_queue = g_async_queue_new ();
 
     pthread_mutex_init (&mgr->priv->errors_lock, NULL);
+    mgr->priv->notified_errors = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                        g_free, NULL);
+    mgr->priv->error_groups = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free,
+                                                     (GDestroyNotify)sync_error_group_free);
+    mgr->priv->pending_errors = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                       g_free,
+                                                       (GDestroyNotify)sync_error_free);
+
+    mgr->priv->histories = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free,
+                                                  (GDestroyNotify)commit_history_free);
+    pthread_mutex_init (&mgr->priv->history_lock, NULL);
+
+    mgr->priv->diff_cache = g_hash_table_new (g_str_hash, g_str_equal);
+    pthread_mutex_init (&mgr->priv->diff_cache_lock, NULL);
+
+    pthread_mutex_init (&mgr->priv->hydration_lock, NULL);
 
     return mgr;
 }
@@ -6425,58 +9166,158 @@ watch_repos (SeafRepoManager *mgr)
     }
 }
 
+/*
+ * Removal of deleted stores.
+ *
+ * Stores are moved into "deleted_store" when a repo is deleted, which is
+ * instant. This thread removes them in the background. The top level dirs
+ * of a store are removed in parallel by REMOVE_STORE_THREADS threads, each
+ * pausing after REMOVE_OBJECTS_BATCH files so that the removal doesn't
+ * take all the disk I/O.
+ */
+
 #define REMOVE_OBJECTS_BATCH 1000
+#define REMOVE_BATCH_PAUSE_MSEC 200
+#define REMOVE_STORE_THREADS 4
 
-static int
-remove_store (const char *top_store_dir, const char *store_id, int *count)
+static void
+count_removed_object (int *count)
 {
-    char *obj_dir = NULL;
-    GDir *dir1, *dir2;
-    const char *dname1, *dname2;
-    char *path1, *path2;
+    if (++(*count) > REMOVE_OBJECTS_BATCH) {
+        g_usleep (REMOVE_BATCH_PAUSE_MSEC * 1000);
+        *count = 0;
+    }
+}
 
-    obj_dir = g_build_filename (top_store_dir, store_id, NULL);
+#ifdef __linux__
 
-    dir1 = g_dir_open (obj_dir, 0, NULL);
-    if (!dir1) {
-        g_free (obj_dir);
-        return 0;
+/* Relative to an open parent dir, and using the file types from readdir(),
+ * there's no path lookup or stat for each file. */
+static void
+remove_tree_at (int parent_fd, const char *name, int *count)
+{
+    int fd;
+    DIR *dir;
+    struct dirent *dent;
+
+    fd = openat (parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        unlinkat (parent_fd, name, 0);
+        count_removed_object (count);
+        return;
     }
 
-    seaf_message ("Removing store %s\n", obj_dir);
+    dir = fdopendir (fd);
+    if (!dir) {
+        close (fd);
+        return;
+    }
 
-    while ((dname1 = g_dir_read_name(dir1)) != NULL) {
-        path1 = g_build_filename (obj_dir, dname1, NULL);
+    while ((dent = readdir (dir)) != NULL) {
+        if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
+            continue;
 
-        dir2 = g_dir_open (path1, 0, NULL);
-        if (!dir2) {
-            seaf_warning ("Failed to open obj dir %s.\n", path1);
-            g_dir_close (dir1);
-            g_free (path1);
-            g_free (obj_dir);
-            return -1;
+        if (dent->d_type == DT_DIR ||
+            (dent->d_type == DT_UNKNOWN &&
+             unlinkat (fd, dent->d_name, 0) < 0 && errno == EISDIR)) {
+            remove_tree_at (fd, dent->d_name, count);
+            continue;
         }
 
-        while ((dname2 = g_dir_read_name(dir2)) != NULL) {
-            path2 = g_build_filename (path1, dname2, NULL);
-            g_unlink (path2);
+        if (dent->d_type != DT_UNKNOWN)
+            unlinkat (fd, dent->d_name, 0);
+        count_removed_object (count);
+    }
 
-            /* To prevent using too much IO, only remove 1000 objects per 5 seconds.
-             */
-            if (++(*count) > REMOVE_OBJECTS_BATCH) {
-                g_usleep (5 * G_USEC_PER_SEC);
-                *count = 0;
-            }
+    closedir (dir);
+    unlinkat (parent_fd, name, AT_REMOVEDIR);
+}
+
+static void
+remove_tree (const char *path, int *count)
+{
+    remove_tree_at (AT_FDCWD, path, count);
+}
+
+#else
+
+static void
+remove_tree (const char *path, int *count)
+{
+    GDir *dir;
+    const char *dname;
+    char *child;
 
-            g_free (path2);
+    dir = g_dir_open (path, 0, NULL);
+    if (!dir) {
+        g_unlink (path);
+        count_removed_object (count);
+        return;
+    }
+
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        child = g_build_filename (path, dname, NULL);
+        if (g_file_test (child, G_FILE_TEST_IS_DIR) &&
+            !g_file_test (child, G_FILE_TEST_IS_SYMLINK)) {
+            remove_tree (child, count);
+        } else {
+            g_unlink (child);
+            count_removed_object (count);
         }
-        g_dir_close (dir2);
+        g_free (child);
+    }
 
-        g_rmdir (path1);
-        g_free (path1);
+    g_dir_close (dir);
+    g_rmdir (path);
+}
+
+#endif
+
+static void
+remove_tree_thread (gpointer data, gpointer user_data)
+{
+    char *path = data;
+    int count = 0;
+
+    remove_tree (path, &count);
+    g_free (path);
+}
+
+static int
+remove_store (const char *top_store_dir, const char *store_id)
+{
+    char *obj_dir = NULL;
+    GDir *dir;
+    const char *dname;
+    GThreadPool *pool;
+
+    obj_dir = g_build_filename (top_store_dir, store_id, NULL);
+
+    dir = g_dir_open (obj_dir, 0, NULL);
+    if (!dir) {
+        /* Stores may also be single files. */
+        g_unlink (obj_dir);
+        g_free (obj_dir);
+        return 0;
+    }
+
+    seaf_message ("Removing store %s\n", obj_dir);
+
+    pool = g_thread_pool_new (remove_tree_thread, NULL,
+                              REMOVE_STORE_THREADS, FALSE, NULL);
+    if (!pool) {
+        g_dir_close (dir);
+        g_free (obj_dir);
+        return -1;
     }
 
-    g_dir_close (dir1);
+    while ((dname = g_dir_read_name(dir)) != NULL)
+        g_thread_pool_push (pool, g_build_filename (obj_dir, dname, NULL), NULL);
+
+    /* Wait for all the dirs to be removed. */
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+    g_dir_close (dir);
     g_rmdir (obj_dir);
     g_free (obj_dir);
 
@@ -6500,9 +9341,8 @@ cleanup_deleted_stores_by_type (const char *type)
         return;
     }
 
-    int count = 0;
     while ((repo_id = g_dir_read_name(dir)) != NULL) {
-        remove_store (top_store_dir, repo_id, &count);
+        remove_store (top_store_dir, repo_id);
     }
 
     g_free (top_store_dir);
@@ -6515,6 +9355,8 @@ cleanup_deleted_stores (void *vdata)
     while (1) {
         cleanup_deleted_stores_by_type ("commits");
         cleanup_deleted_stores_by_type ("fs");
+        cleanup_deleted_stores_by_type ("fs-bin");
+        cleanup_deleted_stores_by_type ("chunk-maps");
         cleanup_deleted_stores_by_type ("blocks");
         g_usleep (60 * G_USEC_PER_SEC);
     }
@@ -6529,14 +9371,20 @@ seaf_repo_manager_start (SeafRepoManager *mgr)
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     int rc;
+    StartupTimer timer;
 
+    startup_timer_start (&timer, FALSE);
     watch_repos (mgr);
+    startup_profile_add_phase ("watch repos", &timer);
 
     rc = pthread_create (&tid, &attr, cleanup_deleted_stores, NULL);
     if (rc != 0) {
         seaf_warning ("Failed to start cleanup thread: %s\n", strerror(rc));
     }
 
+    mgr->priv->errors_timer = seaf_timer_new (sync_errors_pulse, mgr,
+                                              SYNC_ERRORS_FLUSH_INTERVAL);
+
 #if defined WIN32 || defined __APPLE__
     rc = pthread_create (&tid, &attr, lock_office_file_worker,
                          mgr->priv->lock_office_job_queue);
@@ -6574,6 +9422,39 @@ seaf_repo_manager_create_new_repo (SeafRepoManager *mgr,
     return repo;
 }
 
+/*
+ * Replace the entry of @repo_id in repo_hash with @repo, or remove it if
+ * @repo is NULL. Readers keep using the old table until they leave their
+ * read section; it's freed after that.
+ */
+static void
+publish_repo_hash (SeafRepoManager *mgr, const char *repo_id, SeafRepo *repo)
+{
+    SeafRepoManagerPriv *priv = mgr->priv;
+    GHashTable *old, *table;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    pthread_mutex_lock (&priv->repo_hash_lock);
+
+    old = priv->repo_hash;
+    table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_iter_init (&iter, old);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        g_hash_table_insert (table, g_strdup(key), value);
+
+    if (repo)
+        g_hash_table_replace (table, g_strdup(repo_id), repo);
+    else
+        g_hash_table_remove (table, repo_id);
+
+    g_atomic_pointer_set (&priv->repo_hash, table);
+
+    pthread_mutex_unlock (&priv->repo_hash_lock);
+
+    seaf_epoch_retire (old, (GDestroyNotify)g_hash_table_destroy);
+}
+
 int
 seaf_repo_manager_add_repo (SeafRepoManager *manager,
                             SeafRepo *repo)
@@ -6595,14 +9476,9 @@ seaf_repo_manager_add_repo (SeafRepoManager *manager,
 
     repo->manager = manager;
 
-    if (pthread_rwlock_wrlock (&manager->priv->lock) < 0) {
-        seaf_warning ("[repo mgr] failed to lock repo cache.\n");
-        return -1;
-    }
-
-    g_hash_table_insert (manager->priv->repo_hash, g_strdup(repo->id), repo);
+    publish_repo_hash (manager, repo->id, repo);
 
-    pthread_rwlock_unlock (&manager->priv->lock);
+    seaf_repo_manager_bump_repo_list_seq (manager);
 
     return 0;
 }
@@ -6624,6 +9500,7 @@ seaf_repo_manager_mark_repo_deleted (SeafRepoManager *mgr, SeafRepo *repo)
     pthread_mutex_unlock (&mgr->priv->db_lock);
 
     repo->delete_pending = TRUE;
+    seaf_repo_manager_bump_repo_list_seq (mgr);
 
     return 0;
 }
@@ -6644,13 +9521,14 @@ GList *
 seaf_repo_manager_list_garbage_repos (SeafRepoManager *mgr)
 {
     GList *repo_ids = NULL;
+    sqlite3 *db;
 
-    pthread_mutex_lock (&mgr->priv->db_lock);
+    db = acquire_read_db (mgr);
 
-    sqlite_foreach_selected_row (mgr->priv->db,
+    sqlite_foreach_selected_row (db,
                                  "SELECT repo_id FROM GarbageRepos",
                                  get_garbage_repo_id, &repo_ids);
-    pthread_mutex_unlock (&mgr->priv->db_lock);
+    release_read_db (mgr, db);
 
     return repo_ids;
 }
@@ -6706,6 +9584,19 @@ seaf_repo_manager_remove_repo_ondisk (SeafRepoManager *mgr,
     char path[SEAF_PATH_MAX];
     snprintf (path, SEAF_PATH_MAX, "%s/%s", mgr->index_dir, repo_id);
     seaf_util_unlink (path);
+    snprintf (path, SEAF_PATH_MAX, "%s/%s%s", mgr->index_dir, repo_id,
+              INDEX_JOURNAL_SUFFIX);
+    seaf_util_unlink (path);
+    snprintf (path, SEAF_PATH_MAX, "%s/%s%s", mgr->index_dir, repo_id,
+              DIR_CACHE_SUFFIX);
+    seaf_util_unlink (path);
+
+    changeset_drop_cached_tree (repo_id);
+    seaf_fs_manager_drop_cached_objects (seaf->fs_mgr, repo_id);
+    seaf_commit_manager_drop_cached_commits (seaf->commit_mgr, repo_id);
+    commit_graph_remove (repo_id);
+    drop_commit_history (mgr, repo_id);
+    http_tx_manager_remove_checkpoints (seaf->http_tx_mgr, repo_id);
 
     /* remove branch */
     GList *p;
@@ -6738,6 +9629,10 @@ seaf_repo_manager_remove_repo_ondisk (SeafRepoManager *mgr,
               repo_id);
     sqlite_query_exec (mgr->priv->db, sql);
 
+    snprintf (sql, sizeof(sql), "DELETE FROM PlaceholderFiles WHERE repo_id = '%s'",
+              repo_id);
+    sqlite_query_exec (mgr->priv->db, sql);
+
     snprintf (sql, sizeof(sql), "DELETE FROM FolderUserPerms WHERE repo_id = '%s'", 
               repo_id);
     sqlite_query_exec (mgr->priv->db, sql);
@@ -6780,29 +9675,59 @@ gen_deleted_store_path (const char *type, const char *repo_id)
     return path;
 }
 
+int
+seaf_repo_manager_move_to_deleted_store (SeafRepoManager *mgr,
+                                         const char *type,
+                                         const char *repo_id,
+                                         const char *path)
+{
+    char *dst = NULL;
+    int ret = 0;
+
+    if (!g_file_test (path, G_FILE_TEST_EXISTS))
+        return 0;
+
+    dst = gen_deleted_store_path (type, repo_id);
+    if (!dst)
+        return -1;
+
+    if (g_rename (path, dst) < 0) {
+        seaf_warning ("Failed to move %s to %s: %s.\n",
+                      path, dst, strerror(errno));
+        ret = -1;
+    }
+
+    g_free (dst);
+    return ret;
+}
+
 void
 seaf_repo_manager_move_repo_store (SeafRepoManager *mgr,
                                    const char *type,
                                    const char *repo_id)
 {
     char *src = NULL;
-    char *dst = NULL;
 
     src = g_build_filename (seaf->seaf_dir, "storage", type, repo_id, NULL);
-    dst = gen_deleted_store_path (type, repo_id);
-    if (dst) {
-        g_rename (src, dst);
-    }
+    seaf_repo_manager_move_to_deleted_store (mgr, type, repo_id, src);
     g_free (src);
-    g_free (dst);
 }
 
-/* Move commits, fs stores into "deleted_store" directory. */
+/* Move commits, fs and block stores into "deleted_store" directory. */
 static void
 move_repo_stores (SeafRepoManager *mgr, SeafRepo *repo)
 {
     seaf_repo_manager_move_repo_store (mgr, "commits", repo->id);
     seaf_repo_manager_move_repo_store (mgr, "fs", repo->id);
+    seaf_repo_manager_move_repo_store (mgr, "fs-bin", repo->id);
+    seaf_repo_manager_move_repo_store (mgr, "chunk-maps", repo->id);
+    seaf_repo_manager_move_repo_store (mgr, "blocks", repo->id);
+
+    /* Objects and blocks in pack files are not in the stores moved above.
+     * Removing the pack files of a repo is cheap, so do it here. */
+    seaf_commit_manager_remove_store (seaf->commit_mgr, repo->id);
+    seaf_fs_manager_remove_store (seaf->fs_mgr, repo->id);
+    seaf_block_manager_remove_store (seaf->block_mgr, repo->id);
 }
 
 int
@@ -6818,20 +9743,16 @@ seaf_repo_manager_del_repo (SeafRepoManager *mgr,
 
     move_repo_stores (mgr, repo);
 
-    if (pthread_rwlock_wrlock (&mgr->priv->lock) < 0) {
-        seaf_warning ("[repo mgr] failed to lock repo cache.\n");
-        return -1;
-    }
-
-    g_hash_table_remove (mgr->priv->repo_hash, repo->id);
+    publish_repo_hash (mgr, repo->id, NULL);
 
-    pthread_rwlock_unlock (&mgr->priv->lock);
+    seaf_repo_manager_bump_repo_list_seq (mgr);
 
 #if defined WIN32 || defined __APPLE__ || defined COMPILE_LINUX_WS
     seaf_notif_manager_unsubscribe_repo (seaf->notif_mgr, repo);
 #endif
 
-    seaf_repo_free (repo);
+    /* Readers may still be walking the old table and using this repo. */
+    seaf_epoch_retire (repo, (GDestroyNotify)seaf_repo_free);
 
     return 0;
 }
@@ -6844,14 +9765,9 @@ seaf_repo_manager_get_repo (SeafRepoManager *manager, const gchar *id)
 {
     SeafRepo *res;
 
-    if (pthread_rwlock_rdlock (&manager->priv->lock) < 0) {
-        seaf_warning ("[repo mgr] failed to lock repo cache.\n");
-        return NULL;
-    }
-
-    res = g_hash_table_lookup (manager->priv->repo_hash, id);
-
-    pthread_rwlock_unlock (&manager->priv->lock);
+    seaf_epoch_enter ();
+    res = g_hash_table_lookup (g_atomic_pointer_get (&manager->priv->repo_hash), id);
+    seaf_epoch_leave ();
 
     if (res && !res->delete_pending)
         return res;
@@ -6864,14 +9780,9 @@ seaf_repo_manager_repo_exists (SeafRepoManager *manager, const gchar *id)
 {
     SeafRepo *res;
 
-    if (pthread_rwlock_rdlock (&manager->priv->lock) < 0) {
-        seaf_warning ("[repo mgr] failed to lock repo cache.\n");
-        return FALSE;
-    }
-
-    res = g_hash_table_lookup (manager->priv->repo_hash, id);
-
-    pthread_rwlock_unlock (&manager->priv->lock);
+    seaf_epoch_enter ();
+    res = g_hash_table_lookup (g_atomic_pointer_get (&manager->priv->repo_hash), id);
+    seaf_epoch_leave ();
 
     if (res && !res->delete_pending)
         return TRUE;
@@ -6966,81 +9877,67 @@ load_keys_cb (sqlite3_stmt *stmt, void *vrepo)
 static int
 load_repo_passwd (SeafRepoManager *manager, SeafRepo *repo)
 {
-    sqlite3 *db = manager->priv->db;
+    sqlite3 *db;
     char sql[256];
     int n;
 
-    pthread_mutex_lock (&manager->priv->db_lock);
+    db = acquire_read_db (manager);
 
     snprintf (sql, sizeof(sql), 
               "SELECT key, iv FROM RepoKeys WHERE repo_id='%s'",
               repo->id);
     n = sqlite_foreach_selected_row (db, sql, load_keys_cb, repo);
     if (n < 0) {
-        pthread_mutex_unlock (&manager->priv->db_lock);
+        release_read_db (manager, db);
         return -1;
     }
 
-    pthread_mutex_unlock (&manager->priv->db_lock);
+    release_read_db (manager, db);
 
     return 0;
     
 }
 
-static gboolean
-load_property_cb (sqlite3_stmt *stmt, void *pvalue)
-{
-    char **value = pvalue;
-
-    char *v = (char *) sqlite3_column_text (stmt, 0);
-    *value = g_strdup (v);
-
-    /* Only one result. */
-    return FALSE;
-}
-
 static char *
 load_repo_property (SeafRepoManager *manager,
                     const char *repo_id,
                     const char *key)
 {
-    sqlite3 *db = manager->priv->db;
-    char sql[256];
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
     char *value = NULL;
+    int rc;
 
-    pthread_mutex_lock (&manager->priv->db_lock);
+    db = acquire_read_db (manager);
 
-    snprintf(sql, 256, "SELECT value FROM RepoProperty WHERE "
-             "repo_id='%s' and key='%s'", repo_id, key);
-    if (sqlite_foreach_selected_row (db, sql, load_property_cb, &value) < 0) {
-        seaf_warning ("Error read property %s for repo %s.\n", key, repo_id);
-        pthread_mutex_unlock (&manager->priv->db_lock);
+    stmt = sqlite_query_prepare_cached (db, "SELECT value FROM RepoProperty WHERE "
+                                        "repo_id=? and key=?");
+    if (!stmt) {
+        release_read_db (manager, db);
         return NULL;
     }
+    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (stmt, 2, key, -1, SQLITE_TRANSIENT);
 
-    pthread_mutex_unlock (&manager->priv->db_lock);
+    rc = sqlite3_step (stmt);
+    if (rc == SQLITE_ROW)
+        value = g_strdup ((const char *)sqlite3_column_text (stmt, 0));
+    else if (rc != SQLITE_DONE)
+        seaf_warning ("Error read property %s for repo %s.\n", key, repo_id);
+    sqlite_query_release (stmt);
+
+    release_read_db (manager, db);
 
     return value;
 }
 
-static gboolean
-load_branch_cb (sqlite3_stmt *stmt, void *vrepo)
-{
-    SeafRepo *repo = vrepo;
-    SeafRepoManager *manager = repo->manager;
-
-    char *branch_name = (char *) sqlite3_column_text (stmt, 0);
-    SeafBranch *branch =
-        seaf_branch_manager_get_branch (manager->seaf->branch_mgr,
-                                        repo->id, branch_name);
-    if (branch == NULL) {
-        seaf_warning ("Broken branch name for repo %s\n", repo->id); 
-        repo->is_corrupted = TRUE;
-        return FALSE;
-    }
-    load_repo_commit (manager, repo, branch);
-    seaf_branch_unref (branch);
-
+static gboolean
+load_branch_cb (sqlite3_stmt *stmt, void *vname)
+{
+    char **branch_name = vname;
+
+    *branch_name = g_strdup ((const char *) sqlite3_column_text (stmt, 0));
+
     /* Only one result. */
     return FALSE;
 }
@@ -7055,10 +9952,30 @@ is_wt_repo_name_same (const char *worktree, const char *repo_name)
     return ret;
 }
 
+/*
+ * Repos are loaded at startup in two steps. load_repo() reads the repo
+ * records, head commit and worktree status. It only reads from the db and
+ * the object store, so repos are loaded by LOAD_REPO_THREADS threads at the
+ * same time. add_loaded_repo() then makes the changes that need the write
+ * db, and adds the repo to repo_hash, one repo at a time.
+ */
+
+#define LOAD_REPO_THREADS 8
+
+typedef struct LoadRepoTask {
+    char repo_id[37];
+    SeafRepo *repo;
+    gboolean invalid_worktree;
+} LoadRepoTask;
+
 static SeafRepo *
-load_repo (SeafRepoManager *manager, const char *repo_id)
+load_repo (SeafRepoManager *manager, const char *repo_id,
+           gboolean *invalid_worktree)
 {
     char sql[256];
+    sqlite3 *db;
+    char *branch_name = NULL;
+    int n;
 
     SeafRepo *repo = seaf_repo_new(repo_id, NULL, NULL);
     if (!repo) {
@@ -7070,13 +9987,29 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
 
     snprintf(sql, 256, "SELECT branch_name FROM RepoBranch WHERE repo_id='%s'",
              repo->id);
-    if (sqlite_foreach_selected_row (manager->priv->db, sql, 
-                                     load_branch_cb, repo) < 0) {
+    db = acquire_read_db (manager);
+    n = sqlite_foreach_selected_row (db, sql, load_branch_cb, &branch_name);
+    release_read_db (manager, db);
+    if (n < 0) {
         seaf_warning ("Error read branch for repo %s.\n", repo->id);
         seaf_repo_free (repo);
         return NULL;
     }
 
+    if (branch_name) {
+        SeafBranch *branch =
+            seaf_branch_manager_get_branch (manager->seaf->branch_mgr,
+                                            repo->id, branch_name);
+        if (branch == NULL) {
+            seaf_warning ("Broken branch name for repo %s\n", repo->id); 
+            repo->is_corrupted = TRUE;
+        } else {
+            load_repo_commit (manager, repo, branch);
+            seaf_branch_unref (branch);
+        }
+        g_free (branch_name);
+    }
+
     /* If repo head is set but failed to load branch or commit. */
     if (repo->is_corrupted) {
         seaf_repo_free (repo);
@@ -7139,18 +10072,8 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
     /* May be NULL if this property is not set in db. */
     repo->server_url = load_repo_property (manager, repo->id, REPO_PROP_SERVER_URL);
 
-    if (repo->head != NULL && seaf_repo_check_worktree (repo) < 0) {
-        if (seafile_session_config_get_allow_invalid_worktree(seaf)) {
-            seaf_warning ("Worktree for repo \"%s\" is invalid, but still keep it.\n",
-                          repo->name);
-            repo->worktree_invalid = TRUE;
-        } else {
-            seaf_message ("Worktree for repo \"%s\" is invalid, delete it.\n",
-                          repo->name);
-            seaf_repo_manager_del_repo (manager, repo);
-            return NULL;
-        }
-    }
+    *invalid_worktree = (repo->head != NULL &&
+                         seaf_repo_check_worktree (repo) < 0);
 
     /* load readonly property */
     value = load_repo_property (manager, repo->id, REPO_PROP_IS_READONLY);
@@ -7160,6 +10083,20 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
         repo->is_readonly = FALSE;
     g_free (value);
 
+    value = load_repo_property (manager, repo->id, REPO_PROP_ON_DEMAND);
+    repo->on_demand = (g_strcmp0 (value, "true") == 0);
+    g_free (value);
+
+    value = load_repo_property (manager, repo->id, REPO_PROP_SYNC_FILTER);
+    if (value) {
+        char *applied = load_repo_property (manager, repo->id,
+                                            REPO_PROP_SYNC_FILTER_APPLIED);
+        repo->sync_filter = sync_filter_new (value);
+        repo->sync_filter_changed = sync_filter_prop_changed (value, applied);
+        g_free (applied);
+        g_free (value);
+    }
+
     /* load sync period property */
     value = load_repo_property (manager, repo->id, REPO_PROP_SYNC_INTERVAL);
     if (value) {
@@ -7169,6 +10106,28 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
     }
     g_free (value);
 
+    return repo;
+}
+
+static void
+add_loaded_repo (SeafRepoManager *manager, SeafRepo *repo,
+                 gboolean invalid_worktree)
+{
+    char *value;
+
+    if (invalid_worktree) {
+        if (seafile_session_config_get_allow_invalid_worktree(seaf)) {
+            seaf_warning ("Worktree for repo \"%s\" is invalid, but still keep it.\n",
+                          repo->name);
+            repo->worktree_invalid = TRUE;
+        } else {
+            seaf_message ("Worktree for repo \"%s\" is invalid, delete it.\n",
+                          repo->name);
+            seaf_repo_manager_del_repo (manager, repo);
+            return;
+        }
+    }
+
     if (repo->worktree) {
         gboolean wt_repo_name_same = is_wt_repo_name_same (repo->worktree, repo->name);
         value = load_repo_property (manager, repo->id, REPO_SYNC_WORKTREE_NAME);
@@ -7186,9 +10145,49 @@ load_repo (SeafRepoManager *manager, const char *repo_id)
         g_free (value);
     }
 
+    /* Repos are loaded before anything else can read repo_hash, so the
+     * table can be filled in place. */
     g_hash_table_insert (manager->priv->repo_hash, g_strdup(repo->id), repo);
+}
 
-    return repo;
+static void
+load_repo_thread (gpointer data, gpointer user_data)
+{
+    LoadRepoTask *task = data;
+    SeafRepoManager *manager = user_data;
+    StartupTimer timer;
+
+    startup_timer_start (&timer, TRUE);
+    task->repo = load_repo (manager, task->repo_id, &task->invalid_worktree);
+    startup_profile_add_repo (task->repo_id, &timer);
+}
+
+static void
+open_read_dbs (SeafRepoManager *manager, const char *db_path)
+{
+    sqlite3 *db;
+    char *mode;
+    int i;
+
+    /* Without WAL, readers would still be blocked by the writer. */
+    mode = sqlite_get_string (manager->priv->db, "PRAGMA journal_mode;");
+    if (g_ascii_strcasecmp (mode ? mode : "", "wal") != 0) {
+        g_free (mode);
+        return;
+    }
+    g_free (mode);
+
+    manager->priv->read_dbs = g_async_queue_new ();
+    for (i = 0; i < READ_DB_POOL_SIZE; ++i) {
+        if (sqlite_open_db_readonly (db_path, &db) < 0)
+            break;
+        g_async_queue_push (manager->priv->read_dbs, db);
+    }
+
+    if (i == 0) {
+        g_async_queue_unref (manager->priv->read_dbs);
+        manager->priv->read_dbs = NULL;
+    }
 }
 
 static sqlite3*
@@ -7200,7 +10199,6 @@ open_db (SeafRepoManager *manager, const char *seaf_dir)
     db_path = g_build_filename (seaf_dir, "repo.db", NULL);
     if (sqlite_open_db (db_path, &db) < 0)
         return NULL;
-    g_free (db_path);
     manager->priv->db = db;
 
     char *sql = "CREATE TABLE IF NOT EXISTS Repo (repo_id TEXT PRIMARY KEY);";
@@ -7256,6 +10254,11 @@ open_db (SeafRepoManager *manager, const char *seaf_dir)
         "PRIMARY KEY (repo_id, path));";
     sqlite_query_exec (db, sql);
 
+    sql = "CREATE TABLE IF NOT EXISTS PlaceholderFiles (repo_id TEXT, path TEXT, "
+        "file_id TEXT, mtime INTEGER, size INTEGER, mode INTEGER, "
+        "PRIMARY KEY (repo_id, path));";
+    sqlite_query_exec (db, sql);
+
     sql = "CREATE TABLE IF NOT EXISTS FolderUserPerms ("
         "repo_id TEXT, path TEXT, permission TEXT);";
     sqlite_query_exec (db, sql);
@@ -7291,18 +10294,26 @@ open_db (SeafRepoManager *manager, const char *seaf_dir)
     sql = "CREATE INDEX IF NOT EXISTS FileSyncErrorIndex ON FileSyncError (repo_id, path)";
     sqlite_query_exec (db, sql);
 
+    open_read_dbs (manager, db_path);
+    g_free (db_path);
+
     return db;
 }
 
 static gboolean
-load_repo_cb (sqlite3_stmt *stmt, void *vmanager)
+load_repo_cb (sqlite3_stmt *stmt, void *vtasks)
 {
-    SeafRepoManager *manager = vmanager;
+    GPtrArray *tasks = vtasks;
+    LoadRepoTask *task;
     const char *repo_id;
 
     repo_id = (const char *) sqlite3_column_text (stmt, 0);
+    if (!repo_id)
+        return TRUE;
 
-    load_repo (manager, repo_id);
+    task = g_new0 (LoadRepoTask, 1);
+    g_strlcpy (task->repo_id, repo_id, sizeof(task->repo_id));
+    g_ptr_array_add (tasks, task);
 
     return TRUE;
 }
@@ -7334,11 +10345,38 @@ load_repos (SeafRepoManager *manager, const char *seaf_dir)
         return;
     }
 
+    GPtrArray *tasks = g_ptr_array_new_with_free_func (g_free);
+    GThreadPool *pool;
+    LoadRepoTask *task;
+    guint i;
+
     sql = "SELECT repo_id FROM Repo;";
-    if (sqlite_foreach_selected_row (db, sql, load_repo_cb, manager) < 0) {
+    if (sqlite_foreach_selected_row (db, sql, load_repo_cb, tasks) < 0) {
         seaf_warning ("Error read repo db.\n");
+        g_ptr_array_free (tasks, TRUE);
         return;
     }
+
+    pool = g_thread_pool_new (load_repo_thread, manager,
+                              LOAD_REPO_THREADS, FALSE, NULL);
+    for (i = 0; i < tasks->len; ++i) {
+        task = g_ptr_array_index (tasks, i);
+        if (pool)
+            g_thread_pool_push (pool, task, NULL);
+        else
+            load_repo_thread (task, manager);
+    }
+    /* Wait for all the repos to be loaded. */
+    if (pool)
+        g_thread_pool_free (pool, FALSE, TRUE);
+
+    for (i = 0; i < tasks->len; ++i) {
+        task = g_ptr_array_index (tasks, i);
+        if (task->repo)
+            add_loaded_repo (manager, task->repo, task->invalid_worktree);
+    }
+
+    g_ptr_array_free (tasks, TRUE);
 }
 
 static void
@@ -7346,28 +10384,44 @@ save_repo_property (SeafRepoManager *manager,
                     const char *repo_id,
                     const char *key, const char *value)
 {
-    char *sql;
     sqlite3 *db = manager->priv->db;
+    sqlite3_stmt *stmt;
+    gboolean exists = FALSE;
 
     pthread_mutex_lock (&manager->priv->db_lock);
 
-    sql = sqlite3_mprintf ("SELECT repo_id FROM RepoProperty WHERE repo_id=%Q AND key=%Q",
-                           repo_id, key);
-    if (sqlite_check_for_existence(db, sql)) {
-        sqlite3_free (sql);
-        sql = sqlite3_mprintf ("UPDATE RepoProperty SET value=%Q"
-                               "WHERE repo_id=%Q and key=%Q",
-                               value, repo_id, key);
-        sqlite_query_exec (db, sql);
-        sqlite3_free (sql);
+    stmt = sqlite_query_prepare_cached (db, "SELECT repo_id FROM RepoProperty "
+                                        "WHERE repo_id=? AND key=?");
+    if (!stmt)
+        goto out;
+    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (stmt, 2, key, -1, SQLITE_TRANSIENT);
+    exists = (sqlite3_step (stmt) == SQLITE_ROW);
+    sqlite_query_release (stmt);
+
+    if (exists) {
+        stmt = sqlite_query_prepare_cached (db, "UPDATE RepoProperty SET value=? "
+                                            "WHERE repo_id=? and key=?");
+        if (!stmt)
+            goto out;
+        sqlite3_bind_text (stmt, 1, value, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 2, repo_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 3, key, -1, SQLITE_TRANSIENT);
     } else {
-        sqlite3_free (sql);
-        sql = sqlite3_mprintf ("INSERT INTO RepoProperty VALUES (%Q, %Q, %Q)",
-                               repo_id, key, value);
-        sqlite_query_exec (db, sql);
-        sqlite3_free (sql);
+        stmt = sqlite_query_prepare_cached (db, "INSERT INTO RepoProperty "
+                                            "VALUES (?, ?, ?)");
+        if (!stmt)
+            goto out;
+        sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 2, key, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text (stmt, 3, value, -1, SQLITE_TRANSIENT);
     }
+    if (sqlite3_step (stmt) != SQLITE_DONE)
+        seaf_warning ("Failed to save property %s for repo %.8s: %s.\n",
+                      key, repo_id, sqlite3_errmsg (db));
+    sqlite_query_release (stmt);
 
+out:
     pthread_mutex_unlock (&manager->priv->db_lock);
 }
 
@@ -7395,8 +10449,12 @@ seaf_repo_manager_set_repo_property (SeafRepoManager *manager,
                 seaf_wt_monitor_watch_repo (seaf->wt_monitor, repo->id,
                                             repo->worktree);
             repo->last_sync_time = 0;
+            seaf_sync_manager_wakeup_repo (seaf->sync_mgr, repo->id);
+            seaf_sync_manager_bump_status_seq (seaf->sync_mgr);
+            seaf_repo_manager_bump_repo_list_seq (manager);
         } else {
             repo->auto_sync = 0;
+            seaf_repo_manager_bump_repo_list_seq (manager);
             if (repo->sync_interval == 0)
                 seaf_wt_monitor_unwatch_repo (seaf->wt_monitor, repo->id);
             /* Cancel current sync task if any. */
@@ -7423,6 +10481,7 @@ seaf_repo_manager_set_repo_property (SeafRepoManager *manager,
                 seaf_wt_monitor_watch_repo (seaf->wt_monitor, repo->id,
                                             repo->worktree);
         }
+        seaf_sync_manager_wakeup_repo (seaf->sync_mgr, repo->id);
     }
 
     if (strcmp (key, REPO_PROP_SERVER_URL) == 0) {
@@ -7443,6 +10502,39 @@ seaf_repo_manager_set_repo_property (SeafRepoManager *manager,
         return 0;
     }
 
+    if (strcmp (key, REPO_PROP_ON_DEMAND) == 0)
+        repo->on_demand = (g_strcmp0 (value, "true") == 0);
+
+    if (strcmp (key, REPO_PROP_SYNC_FILTER) == 0) {
+        SyncFilter *filter = sync_filter_new (value), *old_filter;
+        char *applied;
+
+        applied = load_repo_property (manager, repo_id,
+                                      REPO_PROP_SYNC_FILTER_APPLIED);
+
+        pthread_mutex_lock (&repo->lock);
+        old_filter = repo->sync_filter;
+        repo->sync_filter = filter;
+        repo->sync_filter_changed = sync_filter_prop_changed (value, applied);
+        pthread_mutex_unlock (&repo->lock);
+
+        sync_filter_unref (old_filter);
+        g_free (applied);
+
+        save_repo_property (manager, repo_id, key, value);
+
+        if (seaf->started) {
+            /* Watch the dirs included now, and stop watching the others. */
+            if (repo->auto_sync && repo->sync_interval == 0) {
+                seaf_wt_monitor_unwatch_repo (seaf->wt_monitor, repo->id);
+                seaf_wt_monitor_watch_repo (seaf->wt_monitor, repo->id,
+                                            repo->worktree);
+            }
+            seaf_sync_manager_wakeup_repo (seaf->sync_mgr, repo->id);
+        }
+        return 0;
+    }
+
     if (strcmp (key, REPO_PROP_IS_READONLY) == 0) {
        if (g_strcmp0 (value, "true") == 0)
            repo->is_readonly = TRUE;
@@ -7577,11 +10669,8 @@ seaf_repo_manager_get_repo_list (SeafRepoManager *manager, int start, int limit)
     SeafRepo *repo;
     gpointer key, value;
 
-    if (pthread_rwlock_rdlock (&manager->priv->lock) < 0) {
-        seaf_warning ("[repo mgr] failed to lock repo cache.\n");
-        return NULL;
-    }
-    g_hash_table_iter_init (&iter, manager->priv->repo_hash);
+    seaf_epoch_enter ();
+    g_hash_table_iter_init (&iter, g_atomic_pointer_get (&manager->priv->repo_hash));
 
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         repo = value;
@@ -7589,7 +10678,7 @@ seaf_repo_manager_get_repo_list (SeafRepoManager *manager, int start, int limit)
             repo_list = g_list_prepend (repo_list, repo);
     }
 
-    pthread_rwlock_unlock (&manager->priv->lock);
+    seaf_epoch_leave ();
 
     return repo_list;
 }
@@ -7602,11 +10691,8 @@ seaf_repo_manager_get_repo_id_list_by_server (SeafRepoManager *manager, const ch
     SeafRepo *repo;
     gpointer key, value;
 
-    if (pthread_rwlock_rdlock (&manager->priv->lock) < 0) {
-        seaf_warning ("[repo mgr] failed to lock repo cache.\n");
-        return NULL;
-    }
-    g_hash_table_iter_init (&iter, manager->priv->repo_hash);
+    seaf_epoch_enter ();
+    g_hash_table_iter_init (&iter, g_atomic_pointer_get (&manager->priv->repo_hash));
 
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         repo = value;
@@ -7614,7 +10700,35 @@ seaf_repo_manager_get_repo_id_list_by_server (SeafRepoManager *manager, const ch
             repo_id_list = g_list_prepend (repo_id_list, g_strdup(repo->id));
     }
 
-    pthread_rwlock_unlock (&manager->priv->lock);
+    seaf_epoch_leave ();
+
+    return repo_id_list;
+}
+
+GList *
+seaf_repo_manager_get_block_share_repos (SeafRepoManager *mgr,
+                                         const char *repo_id,
+                                         int version,
+                                         const char *host)
+{
+    GList *repo_id_list = NULL;
+    GHashTableIter iter;
+    SeafRepo *repo;
+    gpointer key, value;
+
+    seaf_epoch_enter ();
+    g_hash_table_iter_init (&iter, g_atomic_pointer_get (&mgr->priv->repo_hash));
+
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        repo = value;
+        if (repo->delete_pending || repo->encrypted ||
+            repo->version != version || strcmp (repo->id, repo_id) == 0 ||
+            g_strcmp0 (repo->effective_host, host) != 0)
+            continue;
+        repo_id_list = g_list_prepend (repo_id_list, g_strdup(repo->id));
+    }
+
+    seaf_epoch_leave ();
 
     return repo_id_list;
 }
@@ -7640,6 +10754,8 @@ seaf_repo_manager_set_repo_token (SeafRepoManager *manager,
     repo->token = g_strdup(token);
 
     save_repo_property (manager, repo->id, REPO_PROP_TOKEN, token);
+    if (seaf->sync_mgr)
+        seaf_sync_manager_wakeup_repo (seaf->sync_mgr, repo->id);
     return 0;
 }
 
@@ -7750,13 +10866,14 @@ seaf_repo_manager_get_server_property (SeafRepoManager *mgr,
     char *sql = sqlite3_mprintf ("SELECT value FROM ServerProperty WHERE "
                                  "server_url=%Q AND key=%Q;",
                                  server_url, key);
+    sqlite3 *db;
     char *value;
 
-    pthread_mutex_lock (&mgr->priv->db_lock);
+    db = acquire_read_db (mgr);
 
-    value = sqlite_get_string (mgr->priv->db, sql);
+    value = sqlite_get_string (db, sql);
 
-    pthread_mutex_unlock (&mgr->priv->db_lock);
+    release_read_db (mgr, db);
 
     sqlite3_free (sql);
     return value;
@@ -7802,25 +10919,103 @@ seaf_repo_manager_server_is_pro (SeafRepoManager *mgr,
 }
 
 /*
- * Read ignored files from ignore.txt
+ * Ignore lists are compiled once and cached per worktree, until
+ * seafile-ignore.txt is modified. Most patterns are matched with hash
+ * lookups:
+ *
+ * - patterns without wildcards are looked up as full paths;
+ * - '*.ext' patterns are looked up by the extension of the path;
+ * - 'foo/' patterns are looked up for each parent dir of the path;
+ *
+ * Other patterns are compiled to GPatternSpec's. Directories are matched
+ * with a trailing slash. To find out if a path is a directory, it's only
+ * stat'ed if it matches one of the forms.
  */
-GList *seaf_repo_load_ignore_files (const char *worktree)
+struct _SeafIgnoreList {
+    gint ref;
+    char *worktree;
+    gint64 mtime;
+    gint64 size;
+    /* Full paths of patterns without wildcards. */
+    GHashTable *literals;
+    /* Extensions of '*.ext' patterns. */
+    GHashTable *extensions;
+    /* Full paths of 'foo/' patterns, with trailing slash. */
+    GHashTable *dirs;
+    GPtrArray *specs;
+    /* The specs that can match a trailing slash. */
+    GPtrArray *dir_specs;
+};
+
+static GHashTable *ignore_lists;
+static pthread_mutex_t ignore_lists_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline gboolean
+has_wildcard (const char *str)
 {
-    GList *list = NULL;
-    SeafStat st;
+    return (strchr (str, '*') != NULL || strchr (str, '?') != NULL);
+}
+
+static void
+add_ignore_pattern (SeafIgnoreList *list, const char *worktree, char *line)
+{
+    int len = strlen(line);
+    char *pattern, c;
+    GPatternSpec *spec;
+
+    if (line[len-1] == '/') {
+        if (!has_wildcard (line)) {
+            g_hash_table_add (list->dirs,
+                              g_strdup_printf ("%s/%s", worktree, line));
+            return;
+        }
+        /* Change 'foo/' to 'foo/ *'. */
+        pattern = g_strdup_printf("%s/%s*", worktree, line);
+    } else {
+        if (!has_wildcard (line)) {
+            g_hash_table_add (list->literals,
+                              g_strdup_printf ("%s/%s", worktree, line));
+            return;
+        }
+        if (line[0] == '*' && line[1] == '.' && line[2] != '\0' &&
+            !has_wildcard (line + 1) && !strchr (line + 2, '.') &&
+            !strchr (line, '/')) {
+            g_hash_table_add (list->extensions, g_strdup (line + 2));
+            return;
+        }
+        pattern = g_strdup_printf("%s/%s", worktree, line);
+    }
+
+    spec = g_pattern_spec_new (pattern);
+    g_ptr_array_add (list->specs, spec);
+    c = pattern[strlen(pattern)-1];
+    if (c == '*' || c == '?')
+        g_ptr_array_add (list->dir_specs, spec);
+    g_free (pattern);
+}
+
+static SeafIgnoreList *
+compile_ignore_file (const char *worktree, const char *full_path,
+                     SeafStat *st)
+{
+    SeafIgnoreList *list;
     FILE *fp;
-    char *full_path, *pattern;
     char path[SEAF_PATH_MAX];
 
-    full_path = g_build_path (PATH_SEPERATOR, worktree,
-                              IGNORE_FILE, NULL);
-    if (seaf_stat (full_path, &st) < 0)
-        goto error;
-    if (!S_ISREG(st.st_mode))
-        goto error;
     fp = g_fopen(full_path, "r");
     if (fp == NULL)
-        goto error;
+        return NULL;
+
+    list = g_new0 (SeafIgnoreList, 1);
+    list->ref = 1;
+    list->worktree = g_strdup (worktree);
+    list->mtime = (gint64)st->st_mtime;
+    list->size = (gint64)st->st_size;
+    list->literals = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    list->extensions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    list->dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    list->specs = g_ptr_array_new_with_free_func ((GDestroyNotify)g_pattern_spec_free);
+    list->dir_specs = g_ptr_array_new ();
 
     while (fgets(path, SEAF_PATH_MAX, fp) != NULL) {
         /* remove leading and trailing whitespace, including \n \r. */
@@ -7830,68 +11025,170 @@ GList *seaf_repo_load_ignore_files (const char *worktree)
         if (path[0] == '#' || path[0] == '\0')
             continue;
 
-        /* Change 'foo/' to 'foo/ *'. */
-        if (path[strlen(path)-1] == '/')
-            pattern = g_strdup_printf("%s/%s*", worktree, path);
-        else
-            pattern = g_strdup_printf("%s/%s", worktree, path);
-
-        list = g_list_prepend(list, pattern);
+        add_ignore_pattern (list, worktree, path);
     }
 
     fclose(fp);
-    g_free (full_path);
     return list;
+}
 
-error:
-    g_free (full_path);
-    return NULL;
+static void
+ignore_list_unref (SeafIgnoreList *list)
+{
+    if (!list || !g_atomic_int_dec_and_test (&list->ref))
+        return;
+
+    g_free (list->worktree);
+    g_hash_table_destroy (list->literals);
+    g_hash_table_destroy (list->extensions);
+    g_hash_table_destroy (list->dirs);
+    g_ptr_array_free (list->dir_specs, TRUE);
+    g_ptr_array_free (list->specs, TRUE);
+    g_free (list);
 }
 
-gboolean
-seaf_repo_check_ignore_file (GList *ignore_list, const char *fullpath)
+/*
+ * Read ignored files from ignore.txt
+ */
+SeafIgnoreList *seaf_repo_load_ignore_files (const char *worktree)
 {
-    char *str;
+    SeafIgnoreList *list = NULL;
     SeafStat st;
-    GPatternSpec *ignore_spec;
-    GList *p;
+    char *full_path;
 
-    str = g_strdup(fullpath);
+    full_path = g_build_path (PATH_SEPERATOR, worktree,
+                              IGNORE_FILE, NULL);
 
-    int rc = seaf_stat(str, &st);
-    if (rc == 0 && S_ISDIR(st.st_mode)) {
-        g_free (str);
-        str = g_strconcat (fullpath, "/", NULL);
+    pthread_mutex_lock (&ignore_lists_lock);
+
+    if (!ignore_lists)
+        ignore_lists = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free,
+                                              (GDestroyNotify)ignore_list_unref);
+
+    if (seaf_stat (full_path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        g_hash_table_remove (ignore_lists, worktree);
+        goto out;
+    }
+
+    list = g_hash_table_lookup (ignore_lists, worktree);
+    if (list && list->mtime == (gint64)st.st_mtime &&
+        list->size == (gint64)st.st_size) {
+        g_atomic_int_inc (&list->ref);
+        goto out;
+    }
+
+    list = compile_ignore_file (worktree, full_path, &st);
+    if (!list) {
+        g_hash_table_remove (ignore_lists, worktree);
+        goto out;
     }
+    g_atomic_int_inc (&list->ref);
+    g_hash_table_replace (ignore_lists, g_strdup(worktree), list);
+
+out:
+    pthread_mutex_unlock (&ignore_lists_lock);
+    g_free (full_path);
+    return list;
+}
+
+static gboolean
+path_is_dir (const char *path)
+{
+    SeafStat st;
+
+    return (seaf_stat (path, &st) == 0 && S_ISDIR(st.st_mode));
+}
 
-    for (p = ignore_list; p != NULL; p = p->next) {
-        char *pattern = (char *)p->data;
+static gboolean
+match_specs (GPtrArray *specs, const char *str)
+{
+    guint i;
 
-        ignore_spec = g_pattern_spec_new(pattern);
-        if (g_pattern_match_string(ignore_spec, str)) {
-            g_free (str);
-            g_pattern_spec_free(ignore_spec);
+    for (i = 0; i < specs->len; ++i) {
+        if (g_pattern_match_string (g_ptr_array_index (specs, i), str))
             return TRUE;
+    }
+    return FALSE;
+}
+
+/* Match @fullpath as a file, i.e. without trailing slash. */
+static gboolean
+match_as_file (SeafIgnoreList *list, const char *fullpath)
+{
+    const char *dot, *slash;
+
+    if (g_hash_table_contains (list->literals, fullpath))
+        return TRUE;
+
+    dot = strrchr (fullpath, '.');
+    slash = strrchr (fullpath, '/');
+    if (dot && (!slash || dot > slash) &&
+        g_hash_table_contains (list->extensions, dot + 1))
+        return TRUE;
+
+    return match_specs (list->specs, fullpath);
+}
+
+gboolean
+seaf_repo_check_ignore_file (SeafIgnoreList *ignore_list, const char *fullpath)
+{
+    char buf[SEAF_PATH_MAX], *str, *p, c;
+    int len;
+    gboolean as_file, as_dir = FALSE;
+    gboolean ret = FALSE;
+
+    if (!ignore_list)
+        return FALSE;
+
+    len = strlen(fullpath);
+    if (len + 2 <= sizeof(buf))
+        str = buf;
+    else
+        str = g_malloc (len + 2);
+    memcpy (str, fullpath, len);
+    str[len] = '/';
+    str[len+1] = '\0';
+
+    /* Paths under dirs of 'foo/' patterns. */
+    for (p = str + 1; *p; ++p) {
+        if (*p != '/')
+            continue;
+        c = p[1];
+        p[1] = '\0';
+        if (g_hash_table_contains (ignore_list->dirs, str)) {
+            p[1] = c;
+            if (p != str + len) {
+                ret = TRUE;
+                goto out;
+            }
+            /* The dir itself. */
+            as_dir = TRUE;
+            break;
         }
-        g_pattern_spec_free(ignore_spec);
+        p[1] = c;
     }
 
-    g_free (str);
-    return FALSE;
+    /* Directories are matched with trailing slash. */
+    if (!as_dir)
+        as_dir = match_specs (ignore_list->dir_specs, str);
+    as_file = match_as_file (ignore_list, fullpath);
+
+    if (as_dir && as_file)
+        ret = TRUE;
+    else if (as_dir || as_file)
+        ret = (path_is_dir (fullpath) == as_dir);
+
+out:
+    if (str != buf)
+        g_free (str);
+    return ret;
 }
 
 /*
  * Free ignored file list
  */
-void seaf_repo_free_ignore_files (GList *ignore_list)
+void seaf_repo_free_ignore_files (SeafIgnoreList *ignore_list)
 {
-    GList *p;
-
-    if (ignore_list == NULL)
-        return;
-
-    for (p = ignore_list; p != NULL; p = p->next)
-        free(p->data);
-
-    g_list_free (ignore_list);
+    ignore_list_unref (ignore_list);
 }
@@ -23,12 +23,22 @@
 #define REPO_PROP_IS_READONLY "is-readonly"
 #define REPO_PROP_SERVER_URL  "server-url"
 #define REPO_PROP_SYNC_INTERVAL "sync-interval"
+#define REPO_PROP_UPLOAD_LIMIT "upload-limit"
+#define REPO_PROP_DOWNLOAD_LIMIT "download-limit"
+#define REPO_PROP_FSEVENTS_ID "fsevents-id"
+#define REPO_PROP_USN_JOURNAL "usn-journal"
 #define REPO_SYNC_WORKTREE_NAME "sync-worktree-name"
+#define REPO_PROP_ON_DEMAND   "on-demand"
+/* JSON filter of the synced subfolders, see sync-filter.h. */
+#define REPO_PROP_SYNC_FILTER "sync-filter"
+/* The filter the worktree was last checked out with. */
+#define REPO_PROP_SYNC_FILTER_APPLIED "sync-filter-applied"
 
 struct _SeafRepoManager;
 typedef struct _SeafRepo SeafRepo;
 
 struct _ChangeSet;
+struct _SyncFilter;
 
 /* The caller can use the properties directly. But the caller should
  * always write on repos via the API. 
@@ -74,6 +84,9 @@ struct _SeafRepo {
     gint64     last_check_jwt_token;
 
     pthread_mutex_t lock;
+    /* Held while the worktree and the index are updated by indexing,
+     * checkout or hydration. */
+    pthread_mutex_t worktree_lock;
 
     gboolean      worktree_invalid; /* true if worktree moved or deleted */
     gboolean      index_corrupted;
@@ -99,6 +112,17 @@ struct _SeafRepo {
 
     /* Non-zero if periodic sync is set for this repo. */
     int sync_interval;
+
+    /* New files are checked out as placeholders and only downloaded
+     * when they are opened. See seaf_repo_manager_hydrate_file(). */
+    gboolean on_demand;
+
+    /* Subfolders left out of sync, NULL if the whole library is synced.
+     * Protected by lock, use seaf_repo_ref_sync_filter() from other
+     * threads. */
+    struct _SyncFilter *sync_filter;
+    /* Set until a download has checked out with the current filter. */
+    gboolean sync_filter_changed;
 };
 
 
@@ -119,6 +143,10 @@ seaf_repo_get_head_commit (const char *repo_id);
 void
 seaf_repo_set_readonly (SeafRepo *repo);
 
+/* Returns a new reference to the sync filter of @repo, or NULL. */
+struct _SyncFilter *
+seaf_repo_ref_sync_filter (SeafRepo *repo);
+
 void
 seaf_repo_unset_readonly (SeafRepo *repo);
 
@@ -145,6 +173,17 @@ seaf_repo_set_name (SeafRepo *repo, const char *new_name);
 GList *
 seaf_repo_get_commits (SeafRepo *repo);
 
+/*
+ * Returns at most @limit commits of the history of the repo's head,
+ * starting from the @offset-th, latest first. Only the commits up to the
+ * requested page are walked, and the order is cached, so showing the
+ * first pages of a long history is cheap. @truncated is set if parents of
+ * walked commits are missing locally, so the history is incomplete.
+ */
+GList *
+seaf_repo_get_commits_page (SeafRepo *repo, int offset, int limit,
+                            gboolean *truncated, GError **error);
+
 char *
 seaf_repo_index_commit (SeafRepo *repo,
                         gboolean is_force_commit,
@@ -188,6 +227,16 @@ seaf_repo_manager_move_repo_store (SeafRepoManager *mgr,
                                    const char *type,
                                    const char *repo_id);
 
+/*
+ * Move @path, a store of @type for @repo_id, into "deleted_store", where
+ * it's removed in the background. Returns 0 if @path doesn't exist.
+ */
+int
+seaf_repo_manager_move_to_deleted_store (SeafRepoManager *mgr,
+                                         const char *type,
+                                         const char *repo_id,
+                                         const char *path);
+
 void
 seaf_repo_manager_remove_repo_ondisk (SeafRepoManager *mgr, const char *repo_id,
                                       gboolean add_deleted_record);
@@ -209,6 +258,16 @@ seaf_repo_manager_get_repo_list (SeafRepoManager *mgr, int start, int limit);
 GList *
 seaf_repo_manager_get_repo_id_list_by_server (SeafRepoManager *mgr, const char *server_url);
 
+/*
+ * Ids of the unencrypted repos of @version synced through @host, other
+ * than @repo_id. Their blocks can be shared with @repo_id.
+ */
+GList *
+seaf_repo_manager_get_block_share_repos (SeafRepoManager *mgr,
+                                         const char *repo_id,
+                                         int version,
+                                         const char *host);
+
 GList *
 seaf_repo_manager_list_garbage_repos (SeafRepoManager *mgr);
 
@@ -314,14 +373,19 @@ gboolean
 seaf_repo_manager_server_is_pro (SeafRepoManager *mgr,
                                  const char *server_url);
 
-GList *
+/* Compiled patterns of a worktree's seafile-ignore.txt.
+ * NULL if the worktree has no ignore file.
+ */
+typedef struct _SeafIgnoreList SeafIgnoreList;
+
+SeafIgnoreList *
 seaf_repo_load_ignore_files (const char *worktree);
 
 gboolean
-seaf_repo_check_ignore_file (GList *ignore_list, const char *fullpath);
+seaf_repo_check_ignore_file (SeafIgnoreList *ignore_list, const char *fullpath);
 
 void
-seaf_repo_free_ignore_files (GList *ignore_list);
+seaf_repo_free_ignore_files (SeafIgnoreList *ignore_list);
 
 enum {
     FETCH_CHECKOUT_SUCCESS = 0,
@@ -377,6 +441,51 @@ locked_file_set_remove (LockedFileSet *fset, const char *path, gboolean db_only)
 LockedFile *
 locked_file_set_lookup (LockedFileSet *fset, const char *path);
 
+/* On-demand files. */
+
+/*
+ * Placeholders are only checked out while a hydration provider, the file
+ * system integration that calls seaf_repo_manager_hydrate_file() before a
+ * file is read, is registered. Registrations are not persisted, so the
+ * provider registers again after the daemon restarts. Only one provider
+ * may be registered at a time. Returns -1 if another one is.
+ */
+int
+seaf_repo_manager_register_hydration_provider (SeafRepoManager *mgr,
+                                               const char *name);
+
+void
+seaf_repo_manager_unregister_hydration_provider (SeafRepoManager *mgr,
+                                                 const char *name);
+
+gboolean
+seaf_repo_manager_has_hydration_provider (SeafRepoManager *mgr);
+
+/*
+ * Download the content of the placeholder file @path in an on-demand
+ * repo and write it to the worktree. Called by the file system
+ * integration before an application reads the file. Returns -1 if @path
+ * isn't a placeholder (any more), or was changed during the download.
+ */
+int
+seaf_repo_manager_hydrate_file (SeafRepoManager *mgr,
+                                const char *repo_id,
+                                const char *path,
+                                GError **error);
+
+/* Selective sync. */
+
+/*
+ * The filter to download @repo_id with, from the clone task for a clone.
+ * @changed is set if the worktree was checked out with another filter,
+ * so that paths it left out may have to be fetched now.
+ */
+struct _SyncFilter *
+seaf_repo_manager_get_download_filter (SeafRepoManager *mgr,
+                                       const char *repo_id,
+                                       gboolean is_clone,
+                                       gboolean *changed);
+
 /* Folder Permissions. */
 
 typedef enum FolderPermType {
@@ -438,6 +547,21 @@ seaf_repo_manager_get_file_sync_errors (SeafRepoManager *mgr, int offset, int li
 int
 seaf_repo_manager_del_file_sync_error_by_id (SeafRepoManager *mgr, int id);
 
+/*
+ * Change sequence numbers for clients that poll. The repo list number is
+ * increased when a repo is added or removed or its head, name, worktree or
+ * auto sync setting changes, but not for last_sync_time alone. The sync
+ * error number is increased when file sync errors are recorded or removed.
+ */
+void
+seaf_repo_manager_bump_repo_list_seq (SeafRepoManager *mgr);
+
+int
+seaf_repo_manager_get_repo_list_seq (SeafRepoManager *mgr);
+
+int
+seaf_repo_manager_get_sync_errors_seq (SeafRepoManager *mgr);
+
 /* Record sync error and send notification. */
 void
 send_file_sync_error_notification (const char *repo_id,
@@ -0,0 +1,654 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#ifdef WIN32
+#include <windows.h>
+#elif defined __APPLE__
+#include <sys/resource.h>
+#elif defined __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <pthread.h>
+
+#include "seafile-session.h"
+#include "seafile-error.h"
+#include "seafile-crypt.h"
+#include "peer-block-mgr.h"
+#include "sync-filter.h"
+#include "repo-verify.h"
+#include "utils.h"
+#include "log.h"
+
+#define VERIFY_THREADS 4
+/* Ids reported of each kind, the rest are only counted. */
+#define MAX_REPORTED_IDS 1000
+#define FS_REPAIR_BATCH 100
+
+enum {
+    VERIFY_RUNNING = 0,
+    VERIFY_DONE,
+    VERIFY_ERROR,
+};
+
+typedef struct VerifyTask {
+    char repo_id[37];
+    int version;
+    char *head_id;
+    gboolean repair;
+    char *host;
+    char *token;
+    gboolean use_fileserver_port;
+    SyncFilter *filter;
+
+    /* Protects everything below. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* Signaled when n_pending drops to 0. */
+    int n_pending;
+
+    int status;
+    char *error;
+    gint64 start_time;
+    gint64 finish_time;
+
+    GHashTable *visited_fs;
+    GHashTable *visited_blocks;
+    /* Items found in the current level, checked in the next one. */
+    GList *next_items;
+    /* Broken items and block ids of the current level. */
+    GList *bad_items;
+    GList *bad_blocks;
+
+    gint64 n_fs_checked;
+    gint64 n_blocks_checked;
+    gint64 n_repaired;
+    GPtrArray *corrupt_fs;
+    GPtrArray *missing_fs;
+    GPtrArray *corrupt_blocks;
+} VerifyTask;
+
+typedef struct VerifyItem {
+    int type;                   /* SEAF_METADATA_TYPE_DIR or _FILE */
+    char id[41];
+    char *path;
+    /* Checked again after being downloaded. */
+    gboolean retry;
+} VerifyItem;
+
+/* repo id -> VerifyTask, the last verification of each repo. */
+static GHashTable *tasks;
+static pthread_mutex_t tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static VerifyItem *
+verify_item_new (int type, const char *id, const char *path)
+{
+    VerifyItem *item = g_new0 (VerifyItem, 1);
+
+    item->type = type;
+    memcpy (item->id, id, 40);
+    item->path = g_strdup (path);
+    return item;
+}
+
+static void
+verify_item_free (VerifyItem *item)
+{
+    g_free (item->path);
+    g_free (item);
+}
+
+static void
+verify_task_free (VerifyTask *task)
+{
+    g_free (task->head_id);
+    g_free (task->host);
+    g_free (task->token);
+    sync_filter_unref (task->filter);
+    g_free (task->error);
+    g_hash_table_destroy (task->visited_fs);
+    g_hash_table_destroy (task->visited_blocks);
+    g_ptr_array_free (task->corrupt_fs, TRUE);
+    g_ptr_array_free (task->missing_fs, TRUE);
+    g_ptr_array_free (task->corrupt_blocks, TRUE);
+    pthread_mutex_destroy (&task->lock);
+    pthread_cond_destroy (&task->cond);
+    g_free (task);
+}
+
+/* Lower the I/O priority of the verify threads, once per thread. */
+static void
+set_background_io_priority ()
+{
+    static GPrivate done;
+
+    if (g_private_get (&done))
+        return;
+    g_private_set (&done, GINT_TO_POINTER(1));
+
+#ifdef WIN32
+    SetThreadPriority (GetCurrentThread (), THREAD_MODE_BACKGROUND_BEGIN);
+#elif defined __APPLE__
+    setiopolicy_np (IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, IOPOL_THROTTLE);
+#elif defined __linux__ && defined SYS_ioprio_set
+    /* IOPRIO_WHO_PROCESS with id 0 is the calling thread. The idle class
+     * only gets the disk when no one else uses it. */
+    syscall (SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0,
+             3 << 13 /* IOPRIO_CLASS_IDLE */);
+#endif
+}
+
+static void
+report_id (GPtrArray *ids, const char *id)
+{
+    if (ids->len < MAX_REPORTED_IDS)
+        g_ptr_array_add (ids, g_strdup (id));
+}
+
+/* Called with the task locked. @item is kept to be repaired. */
+static void
+add_bad_item (VerifyTask *task, VerifyItem *item, gboolean missing)
+{
+    if (item->retry) {
+        seaf_warning ("Fs object %s of repo %.8s is still broken after "
+                      "download.\n", item->id, task->repo_id);
+        verify_item_free (item);
+        return;
+    }
+
+    report_id (missing ? task->missing_fs : task->corrupt_fs, item->id);
+    task->bad_items = g_list_prepend (task->bad_items, item);
+}
+
+static void
+verify_dir (VerifyTask *task, VerifyItem *item)
+{
+    SeafDir *dir;
+    SeafDirent *dent;
+    VerifyItem *next;
+    GList *ptr;
+    char *path;
+    gboolean is_dir;
+    gboolean io_error = FALSE;
+
+    if (!seaf_fs_manager_verify_seafdir (seaf->fs_mgr,
+                                         task->repo_id, task->version,
+                                         item->id, TRUE, &io_error)) {
+        pthread_mutex_lock (&task->lock);
+        add_bad_item (task, item, io_error);
+        pthread_mutex_unlock (&task->lock);
+        return;
+    }
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr,
+                                       task->repo_id, task->version, item->id);
+    if (!dir) {
+        pthread_mutex_lock (&task->lock);
+        add_bad_item (task, item, TRUE);
+        pthread_mutex_unlock (&task->lock);
+        return;
+    }
+
+    pthread_mutex_lock (&task->lock);
+    if (item->retry)
+        ++task->n_repaired;
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        is_dir = S_ISDIR(dent->mode);
+        if (!is_dir && !S_ISREG(dent->mode))
+            continue;
+
+        path = g_build_path ("/", item->path, dent->name, NULL);
+        if (!sync_filter_is_synced (task->filter, path, is_dir) ||
+            g_hash_table_lookup (task->visited_fs, dent->id)) {
+            g_free (path);
+            continue;
+        }
+        g_hash_table_add (task->visited_fs, g_strdup (dent->id));
+
+        next = verify_item_new (is_dir ? SEAF_METADATA_TYPE_DIR :
+                                SEAF_METADATA_TYPE_FILE,
+                                dent->id, path);
+        task->next_items = g_list_prepend (task->next_items, next);
+        g_free (path);
+    }
+    pthread_mutex_unlock (&task->lock);
+
+    seaf_dir_free (dir);
+    verify_item_free (item);
+}
+
+static void
+verify_file (VerifyTask *task, VerifyItem *item)
+{
+    Seafile *file;
+    char *block_id;
+    gboolean io_error = FALSE;
+    gboolean ok;
+    int i;
+
+    if (!seaf_fs_manager_verify_seafile (seaf->fs_mgr,
+                                         task->repo_id, task->version,
+                                         item->id, TRUE, &io_error)) {
+        pthread_mutex_lock (&task->lock);
+        add_bad_item (task, item, io_error);
+        pthread_mutex_unlock (&task->lock);
+        return;
+    }
+
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr,
+                                        task->repo_id, task->version, item->id);
+    if (!file) {
+        pthread_mutex_lock (&task->lock);
+        add_bad_item (task, item, TRUE);
+        pthread_mutex_unlock (&task->lock);
+        return;
+    }
+
+    pthread_mutex_lock (&task->lock);
+    if (item->retry)
+        ++task->n_repaired;
+    pthread_mutex_unlock (&task->lock);
+
+    /* Random block ids can't be checked against the content. */
+    for (i = 0; i < file->n_blocks && !seaf->disable_block_hash; ++i) {
+        block_id = file->blk_sha1s[i];
+
+        pthread_mutex_lock (&task->lock);
+        if (g_hash_table_lookup (task->visited_blocks, block_id)) {
+            pthread_mutex_unlock (&task->lock);
+            continue;
+        }
+        g_hash_table_add (task->visited_blocks, g_strdup (block_id));
+        pthread_mutex_unlock (&task->lock);
+
+        if (!seaf_block_manager_block_exists (seaf->block_mgr,
+                                              task->repo_id, task->version,
+                                              block_id))
+            continue;
+
+        ok = seaf_block_manager_verify_block (seaf->block_mgr,
+                                              task->repo_id, task->version,
+                                              block_id, &io_error);
+
+        pthread_mutex_lock (&task->lock);
+        ++task->n_blocks_checked;
+        if (!ok) {
+            report_id (task->corrupt_blocks, block_id);
+            task->bad_blocks = g_list_prepend (task->bad_blocks,
+                                               g_strdup (block_id));
+        }
+        pthread_mutex_unlock (&task->lock);
+    }
+
+    seafile_unref (file);
+    verify_item_free (item);
+}
+
+static void
+verify_item_func (gpointer data, gpointer user_data)
+{
+    VerifyItem *item = data;
+    VerifyTask *task = user_data;
+
+    set_background_io_priority ();
+
+    if (item->type == SEAF_METADATA_TYPE_DIR)
+        verify_dir (task, item);
+    else
+        verify_file (task, item);
+
+    pthread_mutex_lock (&task->lock);
+    ++task->n_fs_checked;
+    if (--task->n_pending == 0)
+        pthread_cond_signal (&task->cond);
+    pthread_mutex_unlock (&task->lock);
+}
+
+/* Check @items in the thread pool and wait for them. The list is consumed. */
+static void
+verify_items (VerifyTask *task, GThreadPool *pool, GList *items)
+{
+    GList *ptr;
+
+    pthread_mutex_lock (&task->lock);
+    task->n_pending = g_list_length (items);
+    pthread_mutex_unlock (&task->lock);
+
+    for (ptr = items; ptr; ptr = ptr->next)
+        g_thread_pool_push (pool, ptr->data, NULL);
+    g_list_free (items);
+
+    pthread_mutex_lock (&task->lock);
+    while (task->n_pending > 0)
+        pthread_cond_wait (&task->cond, &task->lock);
+    pthread_mutex_unlock (&task->lock);
+}
+
+/* Download the broken fs objects again, and check them again. */
+static void
+repair_fs_objects (VerifyTask *task, GThreadPool *pool, GList *items)
+{
+    GList *ptr, *ids = NULL;
+    VerifyItem *item;
+    int n = 0;
+
+    for (ptr = items; ptr; ptr = ptr->next) {
+        item = ptr->data;
+        item->retry = TRUE;
+        ids = g_list_prepend (ids, item->id);
+        if (++n < FS_REPAIR_BATCH && ptr->next)
+            continue;
+
+        if (http_tx_manager_get_fs_objects (seaf->http_tx_mgr, task->host,
+                                            task->use_fileserver_port,
+                                            task->token, task->repo_id,
+                                            task->version, ids) < 0)
+            seaf_warning ("Failed to download fs objects of repo %.8s.\n",
+                          task->repo_id);
+        g_list_free (ids);
+        ids = NULL;
+        n = 0;
+    }
+
+    /* Items that are still broken are dropped; the ones that are good now
+     * add their children to the next level. */
+    verify_items (task, pool, items);
+}
+
+static gboolean
+block_id_matches (const char *block_id, const void *buf, int len)
+{
+    unsigned char sha1[20];
+    char hex[41];
+
+    seafile_sha1 (buf, len, sha1);
+    rawdata_to_hex (sha1, hex, 20);
+    return strcmp (hex, block_id) == 0;
+}
+
+/* Replace a corrupt block with a good copy. */
+static int
+replace_block (const char *block_id, const void *buf, int len, void *user_data)
+{
+    VerifyTask *task = user_data;
+    BlockHandle *block;
+    int ret = 0;
+
+    if (!block_id_matches (block_id, buf, len)) {
+        seaf_warning ("Downloaded block %s of repo %.8s is corrupt too.\n",
+                      block_id, task->repo_id);
+        return -1;
+    }
+
+    seaf_block_manager_remove_block (seaf->block_mgr,
+                                     task->repo_id, task->version, block_id);
+
+    block = seaf_block_manager_open_block (seaf->block_mgr,
+                                           task->repo_id, task->version,
+                                           block_id, BLOCK_WRITE);
+    if (!block)
+        return -1;
+
+    if (seaf_block_manager_write_block (seaf->block_mgr, block, buf, len) != len)
+        ret = -1;
+    if (seaf_block_manager_close_block (seaf->block_mgr, block) < 0)
+        ret = -1;
+    if (ret == 0 && seaf_block_manager_commit_block (seaf->block_mgr, block) < 0)
+        ret = -1;
+    seaf_block_manager_block_handle_free (seaf->block_mgr, block);
+
+    if (ret < 0) {
+        seaf_warning ("Failed to write block %s of repo %.8s.\n",
+                      block_id, task->repo_id);
+        return -1;
+    }
+
+    seaf_block_manager_cache_add (seaf->block_mgr,
+                                  task->repo_id, task->version, block_id, len);
+
+    pthread_mutex_lock (&task->lock);
+    ++task->n_repaired;
+    pthread_mutex_unlock (&task->lock);
+
+    return 0;
+}
+
+static void
+repair_blocks (VerifyTask *task, GList *block_ids)
+{
+    GList *needed, *ptr;
+    char *buf = NULL;
+    gint64 len;
+
+    needed = seaf_peer_block_manager_fetch_blocks (seaf->peer_block_mgr,
+                                                   task->repo_id,
+                                                   task->head_id,
+                                                   g_list_copy (block_ids),
+                                                   replace_block, task);
+
+    for (ptr = needed; ptr; ptr = ptr->next) {
+        if (http_tx_manager_get_block (seaf->http_tx_mgr, task->host,
+                                       task->use_fileserver_port,
+                                       task->token, task->repo_id, ptr->data,
+                                       &buf, &len) < 0) {
+            seaf_warning ("Failed to download block %s of repo %.8s.\n",
+                          (char *)ptr->data, task->repo_id);
+            continue;
+        }
+        replace_block (ptr->data, buf, (int)len, task);
+        g_free (buf);
+        buf = NULL;
+    }
+
+    g_list_free (needed);
+    g_list_free_full (block_ids, g_free);
+}
+
+static void *
+verify_repo_job (void *vdata)
+{
+    VerifyTask *task = vdata;
+    SeafCommit *head;
+    GThreadPool *pool;
+    GList *level, *bad_items, *bad_blocks;
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           task->repo_id, task->version,
+                                           task->head_id);
+    if (!head) {
+        pthread_mutex_lock (&task->lock);
+        task->status = VERIFY_ERROR;
+        task->error = g_strdup ("Failed to load head commit");
+        pthread_mutex_unlock (&task->lock);
+        return task;
+    }
+
+    /* The threads are owned by the pool, so the lowered I/O priority
+     * doesn't leak to other pools. */
+    pool = g_thread_pool_new (verify_item_func, task, VERIFY_THREADS, TRUE, NULL);
+
+    level = g_list_prepend (NULL, verify_item_new (SEAF_METADATA_TYPE_DIR,
+                                                   head->root_id, ""));
+    seaf_commit_unref (head);
+
+    while (level) {
+        verify_items (task, pool, level);
+
+        pthread_mutex_lock (&task->lock);
+        bad_items = task->bad_items;
+        bad_blocks = task->bad_blocks;
+        task->bad_items = NULL;
+        task->bad_blocks = NULL;
+        pthread_mutex_unlock (&task->lock);
+
+        if (task->repair && task->host && task->token) {
+            if (bad_items)
+                repair_fs_objects (task, pool, bad_items);
+            if (bad_blocks)
+                repair_blocks (task, bad_blocks);
+        } else {
+            g_list_free_full (bad_items, (GDestroyNotify)verify_item_free);
+            g_list_free_full (bad_blocks, g_free);
+        }
+
+        pthread_mutex_lock (&task->lock);
+        level = task->next_items;
+        task->next_items = NULL;
+        pthread_mutex_unlock (&task->lock);
+    }
+
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+    pthread_mutex_lock (&task->lock);
+    task->status = VERIFY_DONE;
+    pthread_mutex_unlock (&task->lock);
+
+    return task;
+}
+
+static void
+verify_repo_done (void *vresult)
+{
+    VerifyTask *task = vresult;
+
+    pthread_mutex_lock (&task->lock);
+    task->finish_time = (gint64)time(NULL);
+    if (task->status == VERIFY_ERROR)
+        seaf_warning ("Failed to verify repo %.8s: %s.\n",
+                      task->repo_id, task->error);
+    else
+        seaf_message ("Verified repo %.8s: %" G_GINT64_FORMAT " fs objects, %"
+                      G_GINT64_FORMAT " blocks, %u corrupt, %u missing, %"
+                      G_GINT64_FORMAT " repaired.\n",
+                      task->repo_id, task->n_fs_checked, task->n_blocks_checked,
+                      task->corrupt_fs->len + task->corrupt_blocks->len,
+                      task->missing_fs->len, task->n_repaired);
+    pthread_mutex_unlock (&task->lock);
+}
+
+int
+seaf_repo_verify_start (const char *repo_id, gboolean repair, GError **error)
+{
+    SeafRepo *repo;
+    VerifyTask *task, *old;
+    gboolean running = FALSE;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo || !repo->head) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_REPO, "Invalid repo");
+        return -1;
+    }
+
+    if (repair && (!repo->effective_host || !repo->token)) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Server of the repo is not connected yet");
+        return -1;
+    }
+
+    pthread_mutex_lock (&tasks_lock);
+
+    if (!tasks)
+        tasks = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                       (GDestroyNotify)verify_task_free);
+
+    old = g_hash_table_lookup (tasks, repo_id);
+    if (old) {
+        pthread_mutex_lock (&old->lock);
+        running = (old->finish_time == 0);
+        pthread_mutex_unlock (&old->lock);
+    }
+    if (running) {
+        pthread_mutex_unlock (&tasks_lock);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Repo is being verified");
+        return -1;
+    }
+
+    task = g_new0 (VerifyTask, 1);
+    memcpy (task->repo_id, repo->id, 36);
+    task->version = repo->version;
+    task->head_id = g_strdup (repo->head->commit_id);
+    task->repair = repair;
+    task->host = g_strdup (repo->effective_host);
+    task->token = g_strdup (repo->token);
+    task->use_fileserver_port = repo->use_fileserver_port;
+    task->filter = seaf_repo_ref_sync_filter (repo);
+    pthread_mutex_init (&task->lock, NULL);
+    pthread_cond_init (&task->cond, NULL);
+    task->start_time = (gint64)time(NULL);
+    task->visited_fs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, NULL);
+    task->visited_blocks = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, NULL);
+    task->corrupt_fs = g_ptr_array_new_with_free_func (g_free);
+    task->missing_fs = g_ptr_array_new_with_free_func (g_free);
+    task->corrupt_blocks = g_ptr_array_new_with_free_func (g_free);
+
+    g_hash_table_replace (tasks, task->repo_id, task);
+
+    pthread_mutex_unlock (&tasks_lock);
+
+    seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                 JOB_PRIORITY_BULK,
+                                                 verify_repo_job,
+                                                 verify_repo_done,
+                                                 task);
+    return 0;
+}
+
+static json_t *
+ids_to_json (GPtrArray *ids)
+{
+    json_t *array = json_array ();
+    guint i;
+
+    for (i = 0; i < ids->len; ++i)
+        json_array_append_new (array, json_string (g_ptr_array_index (ids, i)));
+    return array;
+}
+
+json_t *
+seaf_repo_verify_get_status (const char *repo_id)
+{
+    VerifyTask *task;
+    json_t *object = NULL;
+    const char *status;
+
+    pthread_mutex_lock (&tasks_lock);
+
+    task = tasks ? g_hash_table_lookup (tasks, repo_id) : NULL;
+    if (!task)
+        goto out;
+
+    pthread_mutex_lock (&task->lock);
+
+    if (task->finish_time == 0)
+        status = "running";
+    else if (task->status == VERIFY_ERROR)
+        status = "error";
+    else
+        status = "done";
+
+    object = json_object ();
+    json_object_set_new (object, "status", json_string (status));
+    if (task->error)
+        json_object_set_new (object, "error", json_string (task->error));
+    json_object_set_new (object, "repair", json_boolean (task->repair));
+    json_object_set_new (object, "start_time", json_integer (task->start_time));
+    json_object_set_new (object, "finish_time", json_integer (task->finish_time));
+    json_object_set_new (object, "fs_checked", json_integer (task->n_fs_checked));
+    json_object_set_new (object, "blocks_checked",
+                         json_integer (task->n_blocks_checked));
+    json_object_set_new (object, "repaired", json_integer (task->n_repaired));
+    json_object_set_new (object, "corrupt_fs", ids_to_json (task->corrupt_fs));
+    json_object_set_new (object, "missing_fs", ids_to_json (task->missing_fs));
+    json_object_set_new (object, "corrupt_blocks",
+                         ids_to_json (task->corrupt_blocks));
+
+    pthread_mutex_unlock (&task->lock);
+
+out:
+    pthread_mutex_unlock (&tasks_lock);
+    return object;
+}
@@ -0,0 +1,36 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_REPO_VERIFY_H
+#define SEAF_REPO_VERIFY_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Background scrub of the local objects of a repo.
+ *
+ * The tree of the repo's head commit is walked level by level. The fs
+ * objects and the blocks of each level are re-hashed by a few threads
+ * with background I/O priority, so that the check doesn't slow down the
+ * rest of the system. Blocks that are not stored locally are skipped,
+ * since the client only keeps the blocks it still needs.
+ *
+ * With @repair, corrupt and missing fs objects and corrupt blocks are
+ * downloaded again, from the LAN peers first for blocks, and checked
+ * again. A block is only replaced once a good copy has been received, so
+ * a block that was never uploaded is never lost.
+ */
+
+/* Returns -1 if the repo doesn't exist or is being verified already. */
+int
+seaf_repo_verify_start (const char *repo_id, gboolean repair, GError **error);
+
+/*
+ * Returns the state of the last verification of @repo_id: "status" is
+ * "running", "done" or "error", with the number of objects checked and
+ * the ids found corrupt or missing. NULL if it was never verified.
+ */
+json_t *
+seaf_repo_verify_get_status (const char *repo_id);
+
+#endif
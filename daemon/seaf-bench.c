@@ -0,0 +1,646 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Throughput benchmarks of the data path of indexing a file: CDC chunking,
+ * seaf_fs_manager_index_blocks(), block encryption and compression.
+ *
+ * Each benchmark runs on synthetic files of the given sizes and on the
+ * files passed on the command line, and the best of several runs is
+ * reported in MB/s. The chunk size distribution of every file is printed
+ * too, since chunker changes must not change it by accident.
+ *
+ * Built with --enable-benchmark. The program creates a scratch seafile
+ * data dir, and removes it on exit unless -d is given.
+ */
+
+#include "common.h"
+
+#include <getopt.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+
+#include "seafile-session.h"
+#include "seafile-crypt.h"
+#include "fs-mgr.h"
+#include "utils.h"
+#include "log.h"
+#include "cdc/cdc.h"
+#include "bench-utils.h"
+
+SeafileSession *seaf;
+
+#define MB (1 << 20)
+
+#define DEFAULT_SIZES "1,16,128"
+#define DEFAULT_REPEATS 3
+
+/* Data is encrypted and compressed in pieces the size of a chunk read by
+ * split_file_to_block(). */
+#define PIECE_SIZE (1 << 20)
+
+#define WRITE_BUF_SIZE (1 << 20)
+
+/* Chunk size distribution buckets, one per MB. */
+#define N_CHUNK_BUCKETS 16
+
+typedef struct Corpus {
+    char *name;
+    char *path;
+    gint64 size;
+    gboolean generated;
+} Corpus;
+
+static const char *short_options = "hd:s:r:b:V:e:w";
+static struct option long_options[] = {
+    { "help", no_argument, NULL, 'h', },
+    { "workdir", required_argument, NULL, 'd', },
+    { "sizes", required_argument, NULL, 's', },
+    { "repeats", required_argument, NULL, 'r', },
+    { "block-size", required_argument, NULL, 'b', },
+    { "repo-version", required_argument, NULL, 'V', },
+    { "engine", required_argument, NULL, 'e', },
+    { "write-blocks", no_argument, NULL, 'w', },
+    { NULL, 0, NULL, 0, },
+};
+
+static int repeats = DEFAULT_REPEATS;
+static int repo_version = CURRENT_REPO_VERSION;
+static CDCEngineType engine = CDC_ENGINE_RABIN;
+static gboolean write_blocks = FALSE;
+
+static void usage ()
+{
+    fprintf (stderr,
+             "usage: seaf-bench [-d workdir] [-s sizes] [-r repeats] [-b block_size]\n"
+             "                  [-V repo_version] [-e engine] [-w] [file ...]\n"
+             "  -s  sizes of the synthetic files in MB, default " DEFAULT_SIZES "\n"
+             "  -r  runs of each benchmark, the best one is reported\n"
+             "  -b  average CDC block size in MB, as in the client settings\n"
+             "  -V  repo version\n"
+             "  -e  chunking engine of the CDC benchmark, rabin or fastcdc.\n"
+             "      Indexing always uses rabin, as the client does\n"
+             "  -w  also index into the block store, writing every block\n");
+}
+
+/* xorshift64*, fast enough to not dominate writing the file. */
+static guint64
+next_random (guint64 *state)
+{
+    guint64 x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void
+fill_random (char *buf, int len, guint64 *state)
+{
+    guint64 v;
+    int i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        v = next_random (state);
+        memcpy (buf + i, &v, 8);
+    }
+    for (; i < len; ++i)
+        buf[i] = (char)next_random (state);
+}
+
+/* Text made of common words, compressible like source code or documents. */
+static void
+fill_text (char *buf, int len, guint64 *state)
+{
+    static const char *words[] = {
+        "the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+        "was", "with", "be", "by", "on", "not", "he", "this", "are", "or",
+        "file", "sync", "library", "block", "commit", "server", "client",
+        "return", "static", "int", "char", "if", "else", "while", "struct",
+    };
+    const char *word;
+    int i = 0, n;
+    guint64 r;
+
+    while (i < len) {
+        r = next_random (state);
+        word = words[r % G_N_ELEMENTS(words)];
+        n = MIN ((int)strlen(word), len - i);
+        memcpy (buf + i, word, n);
+        i += n;
+        if (i < len)
+            buf[i++] = ((r >> 32) % 12 == 0) ? '\n' : ' ';
+    }
+}
+
+typedef void (*FillFunc) (char *buf, int len, guint64 *state);
+
+static int
+generate_file (const char *path, gint64 size, FillFunc fill)
+{
+    char *buf = g_malloc (WRITE_BUF_SIZE);
+    guint64 state = 0x9E3779B97F4A7C15ULL;
+    gint64 done = 0;
+    int fd, len;
+    int ret = 0;
+
+    fd = seaf_util_create (path, O_WRONLY | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        seaf_warning ("Failed to create %s: %s.\n", path, strerror(errno));
+        g_free (buf);
+        return -1;
+    }
+
+    while (done < size) {
+        len = (int)MIN (size - done, WRITE_BUF_SIZE);
+        fill (buf, len, &state);
+        if (writen (fd, buf, len) != len) {
+            seaf_warning ("Failed to write %s: %s.\n", path, strerror(errno));
+            ret = -1;
+            break;
+        }
+        done += len;
+    }
+
+    close (fd);
+    g_free (buf);
+    return ret;
+}
+
+static char *
+read_file (Corpus *corpus)
+{
+    char *buf = g_malloc (corpus->size);
+    int fd;
+
+    fd = seaf_util_open (corpus->path, O_RDONLY | O_BINARY);
+    if (fd < 0 || readn (fd, buf, corpus->size) != corpus->size) {
+        seaf_warning ("Failed to read %s.\n", corpus->path);
+        if (fd >= 0)
+            close (fd);
+        g_free (buf);
+        return NULL;
+    }
+
+    close (fd);
+    return buf;
+}
+
+static double
+mb_per_sec (gint64 bytes, gint64 usec)
+{
+    if (usec <= 0)
+        usec = 1;
+    return (double)bytes / MB / ((double)usec / G_USEC_PER_SEC);
+}
+
+static void
+print_result (Corpus *corpus, const char *op, gint64 best)
+{
+    if (best < 0) {
+        printf ("%-24s %-14s %12s\n", corpus->name, op, "failed");
+        return;
+    }
+    printf ("%-24s %-14s %9.1f MB/s\n", corpus->name, op,
+            mb_per_sec (corpus->size, best));
+    fflush (stdout);
+}
+
+static void
+set_block_sizes (CDCFileDescriptor *cdc)
+{
+    /* Same as set_cdc_block_sizes() in fs-mgr.c. */
+    if (seaf->cdc_average_block_size == 0) {
+        cdc->block_sz = CDC_AVERAGE_BLOCK_SIZE;
+        cdc->block_min_sz = CDC_MIN_BLOCK_SIZE;
+        cdc->block_max_sz = CDC_MAX_BLOCK_SIZE;
+    } else {
+        cdc->block_sz = seaf->cdc_average_block_size;
+        cdc->block_min_sz = seaf->cdc_average_block_size >> 1;
+        cdc->block_max_sz = seaf->cdc_average_block_size << 1;
+    }
+}
+
+/* Records the chunk lengths and doesn't hash or write anything, so that only
+ * reading the file and finding the boundaries is measured. */
+static int
+record_chunk (const char *repo_id, int version, CDCDescriptor *chunk,
+              SeafileCrypt *crypt, uint8_t *checksum, gboolean write_data)
+{
+    GArray *lens = chunk->user_data;
+
+    memset (checksum, 0, CHECKSUM_LENGTH);
+    if (lens)
+        g_array_append_val (lens, chunk->len);
+    return 0;
+}
+
+static int
+chunk_file (Corpus *corpus, GArray *lens)
+{
+    CDCFileDescriptor cdc;
+    int ret;
+
+    memset (&cdc, 0, sizeof(cdc));
+    set_block_sizes (&cdc);
+    cdc.write_block = record_chunk;
+    cdc.user_data = lens;
+    cdc.version = repo_version;
+    cdc.engine = engine;
+
+    ret = filename_chunk_cdc (corpus->path, &cdc, NULL, FALSE);
+    free (cdc.blk_sha1s);
+    return ret;
+}
+
+static gint64
+bench_cdc (Corpus *corpus)
+{
+    gint64 start, t, best = -1;
+    int i;
+
+    for (i = 0; i < repeats; ++i) {
+        start = g_get_monotonic_time ();
+        if (chunk_file (corpus, NULL) < 0)
+            return -1;
+        t = g_get_monotonic_time () - start;
+        if (best < 0 || t < best)
+            best = t;
+    }
+
+    return best;
+}
+
+static gint64
+bench_index (Corpus *corpus, SeafileCrypt *crypt, gboolean write_data)
+{
+    unsigned char sha1[20];
+    char repo_id[37];
+    gint64 size;
+    gint64 start, t, best = -1;
+    int i;
+
+    for (i = 0; i < repeats; ++i) {
+        /* A new repo every run, otherwise existing blocks are skipped. */
+        gen_uuid_inplace (repo_id);
+
+        start = g_get_monotonic_time ();
+        if (seaf_fs_manager_index_blocks (seaf->fs_mgr, repo_id, repo_version,
+                                          corpus->path, sha1, &size, crypt,
+                                          write_data, TRUE) < 0)
+            return -1;
+        t = g_get_monotonic_time () - start;
+        if (best < 0 || t < best)
+            best = t;
+    }
+
+    return best;
+}
+
+typedef int (*PieceFunc) (const char *in, int in_len, char **out, int *out_len,
+                          void *ctx);
+
+static int
+encrypt_piece (const char *in, int in_len, char **out, int *out_len, void *ctx)
+{
+    return seafile_encrypt (out, out_len, in, in_len, ctx);
+}
+
+static int
+decrypt_piece (const char *in, int in_len, char **out, int *out_len, void *ctx)
+{
+    return seafile_decrypt (out, out_len, in, in_len, ctx);
+}
+
+static int
+compress_piece (const char *in, int in_len, char **out, int *out_len, void *ctx)
+{
+    return seaf_compress ((guint8 *)in, in_len, (guint8 **)out, out_len);
+}
+
+static int
+decompress_piece (const char *in, int in_len, char **out, int *out_len, void *ctx)
+{
+    return seaf_decompress ((guint8 *)in, in_len, (guint8 **)out, out_len);
+}
+
+/*
+ * Run @func on each of @pieces. If @outputs is not NULL, the outputs of
+ * the last run are kept in it for the reverse operation.
+ */
+static gint64
+bench_pieces (GPtrArray *pieces, GArray *lens, PieceFunc func, void *ctx,
+              GPtrArray *outputs, GArray *out_lens)
+{
+    char *out;
+    int out_len;
+    gint64 start, t, best = -1;
+    guint i;
+    int r;
+
+    for (r = 0; r < repeats; ++r) {
+        gboolean keep = (outputs && r == repeats - 1);
+
+        start = g_get_monotonic_time ();
+        for (i = 0; i < pieces->len; ++i) {
+            if (func (g_ptr_array_index (pieces, i), g_array_index (lens, int, i),
+                      &out, &out_len, ctx) < 0)
+                return -1;
+            if (keep) {
+                g_ptr_array_add (outputs, out);
+                g_array_append_val (out_lens, out_len);
+            } else {
+                g_free (out);
+            }
+        }
+        t = g_get_monotonic_time () - start;
+        if (best < 0 || t < best)
+            best = t;
+    }
+
+    return best;
+}
+
+static void
+split_pieces (char *data, gint64 size, GPtrArray *pieces, GArray *lens)
+{
+    gint64 offset;
+    int len;
+
+    for (offset = 0; offset < size; offset += len) {
+        len = (int)MIN (size - offset, PIECE_SIZE);
+        g_ptr_array_add (pieces, data + offset);
+        g_array_append_val (lens, len);
+    }
+}
+
+static void
+bench_reversible (Corpus *corpus, char *data, const char *op, PieceFunc func,
+                  const char *reverse_op, PieceFunc reverse, void *ctx)
+{
+    GPtrArray *pieces = g_ptr_array_new ();
+    GArray *lens = g_array_new (FALSE, FALSE, sizeof(int));
+    GPtrArray *outputs = g_ptr_array_new_with_free_func (g_free);
+    GArray *out_lens = g_array_new (FALSE, FALSE, sizeof(int));
+    gint64 best;
+
+    split_pieces (data, corpus->size, pieces, lens);
+
+    best = bench_pieces (pieces, lens, func, ctx, outputs, out_lens);
+    print_result (corpus, op, best);
+    if (best >= 0)
+        print_result (corpus, reverse_op,
+                      bench_pieces (outputs, out_lens, reverse, ctx, NULL, NULL));
+
+    g_ptr_array_free (pieces, TRUE);
+    g_array_free (lens, TRUE);
+    g_ptr_array_free (outputs, TRUE);
+    g_array_free (out_lens, TRUE);
+}
+
+static void
+print_chunk_distribution (Corpus *corpus)
+{
+    GArray *lens = g_array_new (FALSE, FALSE, sizeof(uint32_t));
+    int buckets[N_CHUNK_BUCKETS];
+    uint32_t len, min = G_MAXUINT32, max = 0;
+    guint i;
+    int b;
+
+    if (chunk_file (corpus, lens) < 0 || lens->len == 0) {
+        g_array_free (lens, TRUE);
+        return;
+    }
+
+    memset (buckets, 0, sizeof(buckets));
+    for (i = 0; i < lens->len; ++i) {
+        len = g_array_index (lens, uint32_t, i);
+        min = MIN (min, len);
+        max = MAX (max, len);
+        b = MIN (len / MB, N_CHUNK_BUCKETS - 1);
+        ++buckets[b];
+    }
+
+    printf ("%-24s chunks: %u, avg %.2f MB, min %.2f MB, max %.2f MB\n",
+            corpus->name, lens->len,
+            (double)corpus->size / lens->len / MB,
+            (double)min / MB, (double)max / MB);
+    for (b = 0; b < N_CHUNK_BUCKETS; ++b) {
+        if (buckets[b] == 0)
+            continue;
+        printf ("%-24s   %2d-%-2d%s MB: %d\n", corpus->name, b, b + 1,
+                b == N_CHUNK_BUCKETS - 1 ? "+" : " ", buckets[b]);
+    }
+    fflush (stdout);
+
+    g_array_free (lens, TRUE);
+}
+
+static void
+run_benchmarks (Corpus *corpus, SeafileCrypt *crypt)
+{
+    char *data;
+
+    print_result (corpus, "cdc", bench_cdc (corpus));
+    print_result (corpus, "index", bench_index (corpus, NULL, FALSE));
+    print_result (corpus, "index-enc", bench_index (corpus, crypt, FALSE));
+    if (write_blocks) {
+        print_result (corpus, "index-write", bench_index (corpus, NULL, TRUE));
+        print_result (corpus, "index-enc-write", bench_index (corpus, crypt, TRUE));
+    }
+
+    data = read_file (corpus);
+    if (data) {
+        bench_reversible (corpus, data, "encrypt", encrypt_piece,
+                          "decrypt", decrypt_piece, crypt);
+        bench_reversible (corpus, data, "compress", compress_piece,
+                          "decompress", decompress_piece, NULL);
+        g_free (data);
+    }
+
+    print_chunk_distribution (corpus);
+}
+
+static Corpus *
+corpus_new (const char *name, const char *path, gint64 size, gboolean generated)
+{
+    Corpus *corpus = g_new0 (Corpus, 1);
+
+    corpus->name = g_strdup (name);
+    corpus->path = g_strdup (path);
+    corpus->size = size;
+    corpus->generated = generated;
+    return corpus;
+}
+
+static void
+corpus_free (Corpus *corpus)
+{
+    if (corpus->generated)
+        seaf_util_unlink (corpus->path);
+    g_free (corpus->name);
+    g_free (corpus->path);
+    g_free (corpus);
+}
+
+static GList *
+generate_corpora (const char *dir, const char *sizes)
+{
+    static const struct {
+        const char *name;
+        FillFunc fill;
+    } kinds[] = {
+        { "random", fill_random },
+        { "text", fill_text },
+    };
+    GList *corpora = NULL;
+    char **tokens, *name, *path;
+    gint64 size;
+    int i, k;
+
+    tokens = g_strsplit (sizes, ",", -1);
+    for (i = 0; tokens[i]; ++i) {
+        size = g_ascii_strtoll (tokens[i], NULL, 10) * MB;
+        if (size <= 0)
+            continue;
+
+        for (k = 0; k < G_N_ELEMENTS(kinds); ++k) {
+            name = g_strdup_printf ("%s-%sMB", kinds[k].name, tokens[i]);
+            path = g_build_filename (dir, name, NULL);
+            if (generate_file (path, size, kinds[k].fill) == 0)
+                corpora = g_list_prepend (corpora, corpus_new (name, path, size, TRUE));
+            g_free (name);
+            g_free (path);
+        }
+    }
+    g_strfreev (tokens);
+
+    return g_list_reverse (corpora);
+}
+
+int
+main (int argc, char **argv)
+{
+    char *workdir = NULL;
+    const char *sizes = DEFAULT_SIZES;
+    gboolean remove_workdir = FALSE;
+    int block_size_mb = 0;
+    char *seafile_dir = NULL, *worktree_dir = NULL, *corpus_dir = NULL;
+    unsigned char key[32], iv[16];
+    SeafileCrypt *crypt = NULL;
+    GList *corpora, *ptr;
+    SeafStat st;
+    int c, i;
+
+    while ((c = getopt_long (argc, argv, short_options,
+                             long_options, NULL)) != EOF) {
+        switch (c) {
+        case 'h':
+            usage ();
+            exit (0);
+        case 'd':
+            workdir = g_strdup (optarg);
+            break;
+        case 's':
+            sizes = optarg;
+            break;
+        case 'r':
+            repeats = MAX (atoi (optarg), 1);
+            break;
+        case 'b':
+            block_size_mb = atoi (optarg);
+            break;
+        case 'V':
+            repo_version = atoi (optarg);
+            break;
+        case 'e':
+            if (strcmp (optarg, "fastcdc") == 0)
+                engine = CDC_ENGINE_FASTCDC;
+            else if (strcmp (optarg, "rabin") == 0)
+                engine = CDC_ENGINE_RABIN;
+            else {
+                usage ();
+                exit (1);
+            }
+            break;
+        case 'w':
+            write_blocks = TRUE;
+            break;
+        default:
+            usage ();
+            exit (1);
+        }
+    }
+
+#if !GLIB_CHECK_VERSION(2, 35, 0)
+    g_type_init();
+#endif
+
+    cdc_init ();
+
+    if (seafile_log_init ("-", "info", "warning") < 0) {
+        fprintf (stderr, "Failed to init log.\n");
+        exit (1);
+    }
+
+    if (!workdir) {
+        workdir = g_dir_make_tmp ("seaf-bench-XXXXXX", NULL);
+        if (!workdir) {
+            seaf_warning ("Failed to create a temporary dir.\n");
+            exit (1);
+        }
+        remove_workdir = TRUE;
+    }
+
+    seafile_dir = g_build_filename (workdir, "seafile-data", NULL);
+    worktree_dir = g_build_filename (workdir, "worktree", NULL);
+    corpus_dir = g_build_filename (workdir, "corpus", NULL);
+    if (checkdir_with_mkdir (corpus_dir) < 0) {
+        seaf_warning ("Failed to create %s.\n", corpus_dir);
+        exit (1);
+    }
+
+    seaf = seafile_session_new (seafile_dir, worktree_dir, workdir);
+    if (!seaf) {
+        seaf_warning ("Failed to create session in %s.\n", workdir);
+        exit (1);
+    }
+    if (seaf_fs_manager_init (seaf->fs_mgr) < 0)
+        exit (1);
+    seaf->cdc_average_block_size = (uint32_t)block_size_mb * MB;
+
+    for (i = 0; i < sizeof(key); ++i)
+        key[i] = (unsigned char)g_random_int ();
+    for (i = 0; i < sizeof(iv); ++i)
+        iv[i] = (unsigned char)g_random_int ();
+    crypt = seafile_crypt_new (2, key, iv);
+
+    corpora = generate_corpora (corpus_dir, sizes);
+    for (i = optind; i < argc; ++i) {
+        if (seaf_stat (argv[i], &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            seaf_warning ("Skipping %s, not a non-empty regular file.\n", argv[i]);
+            continue;
+        }
+        corpora = g_list_append (corpora, corpus_new (argv[i], argv[i],
+                                                      st.st_size, FALSE));
+    }
+
+    printf ("repo version %d, %s chunker, %d runs per benchmark\n",
+            repo_version, cdc_get_chunker (engine)->name, repeats);
+    for (ptr = corpora; ptr; ptr = ptr->next)
+        run_benchmarks (ptr->data, crypt);
+
+    g_list_free_full (corpora, (GDestroyNotify)corpus_free);
+    g_free (crypt);
+
+    if (remove_workdir)
+        bench_remove_dir (workdir);
+
+    g_free (seafile_dir);
+    g_free (worktree_dir);
+    g_free (corpus_dir);
+    g_free (workdir);
+
+    return 0;
+}
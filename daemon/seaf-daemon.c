@@ -40,6 +40,8 @@
 #include "utils.h"
 #include "vc-utils.h"
 #include "seafile-config.h"
+#include "startup-profile.h"
+#include "trace.h"
 #ifndef USE_GPL_CRYPTO
 #include "curl-init.h"
 #endif
@@ -54,7 +56,7 @@
 
 SeafileSession *seaf;
 
-static const char *short_options = "hvc:d:w:l:D:bg:G:p:";
+static const char *short_options = "hvc:d:w:l:D:bg:G:p:P";
 static struct option long_options[] = {
     { "help", no_argument, NULL, 'h', },
     { "version", no_argument, NULL, 'v', },
@@ -67,12 +69,14 @@ static struct option long_options[] = {
     { "ccnet-debug-level", required_argument, NULL, 'g' },
     { "seafile-debug-level", required_argument, NULL, 'G' },
     { "port", required_argument, NULL, 'p' },
+    { "pack-objects", no_argument, NULL, 'P' },
     { NULL, 0, NULL, 0, },
 };
 
 static void usage ()
 {
     fprintf (stderr, "usage: seaf-daemon [-c config_dir] [-d seafile_dir] [-w worktree_dir] [-p port] [--daemon]\n");
+    fprintf (stderr, "       seaf-daemon [-c config_dir] [-d seafile_dir] --pack-objects\n");
 }
 
 #include <searpc.h>
@@ -224,6 +228,10 @@ register_rpc_service ()
                                      seafile_get_repo_list,
                                      "seafile_get_repo_list",
                                      searpc_signature_objlist__int_int());
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_repo_list_json,
+                                     "seafile_get_repo_list_json",
+                                     searpc_signature_string__int());
     searpc_server_register_function ("seafile-rpcserver",
                                      seafile_get_repo,
                                      "seafile_get_repo",
@@ -244,6 +252,11 @@ register_rpc_service ()
                                      "seafile_get_path_sync_status",
                                      searpc_signature_string__string_string_int());
 
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_paths_sync_status,
+                                     "seafile_get_paths_sync_status",
+                                     searpc_signature_json__string_string_string_int());
+
     searpc_server_register_function ("seafile-rpcserver",
                                      seafile_mark_file_locked,
                                      "seafile_mark_file_locked",
@@ -254,6 +267,36 @@ register_rpc_service ()
                                      "seafile_mark_file_unlocked",
                                      searpc_signature_int__string_string());
 
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_hydrate_file,
+                                     "seafile_hydrate_file",
+                                     searpc_signature_int__string_string());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_register_hydration_provider,
+                                     "seafile_register_hydration_provider",
+                                     searpc_signature_int__string());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_unregister_hydration_provider,
+                                     "seafile_unregister_hydration_provider",
+                                     searpc_signature_int__string());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_verify_repo,
+                                     "seafile_verify_repo",
+                                     searpc_signature_int__string_int());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_repo_verify_status,
+                                     "seafile_get_repo_verify_status",
+                                     searpc_signature_json__string());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_commit_history,
+                                     "seafile_get_commit_history",
+                                     searpc_signature_json__string_int_int());
+
     searpc_server_register_function ("seafile-rpcserver",
                                      seafile_generate_magic_and_random_key,
                                      "seafile_generate_magic_and_random_key",
@@ -284,6 +327,36 @@ register_rpc_service ()
                                      "seafile_get_sync_notification",
                                      searpc_signature_json__void());
 
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_wait_sync_notification,
+                                     "seafile_wait_sync_notification",
+                                     searpc_signature_json__int());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_fs_cache_stats,
+                                     "seafile_get_fs_cache_stats",
+                                     searpc_signature_json__void());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_change_seqs,
+                                     "seafile_get_change_seqs",
+                                     searpc_signature_json__void());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_startup_profile,
+                                     "seafile_get_startup_profile",
+                                     searpc_signature_json__void());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_sync_latency_stats,
+                                     "seafile_get_sync_latency_stats",
+                                     searpc_signature_json__void());
+
+    searpc_server_register_function ("seafile-rpcserver",
+                                     seafile_get_metrics,
+                                     "seafile_get_metrics",
+                                     searpc_signature_string__void());
+
     searpc_server_register_function ("seafile-rpcserver",
                                      seafile_shutdown,
                                      "seafile_shutdown",
@@ -426,6 +499,7 @@ main (int argc, char **argv)
     char *ccnet_debug_level_str = "info";
     char *seafile_debug_level_str = "debug";
     int port = 9090;
+    int pack_objects = 0;
 
 #ifdef WIN32
     LoadLibraryA ("exchndl.dll");
@@ -471,6 +545,9 @@ main (int argc, char **argv)
         case 'p':
             port = atoi(optarg);
             break;
+        case 'P':
+            pack_objects = 1;
+            break;
         default:
             usage ();
             exit (1);
@@ -540,17 +617,38 @@ main (int argc, char **argv)
 
     seafile_event_message("Starting record seafile events.\n");
 
+    /* Tracing is meant for investigations and is off by default. */
+    const char *trace_file = g_getenv ("SEAFILE_TRACE_FILE");
+    if (trace_file && *trace_file && seaf_trace_init (trace_file) == 0)
+        atexit (seaf_trace_close);
+
     /* init seafile */
     if (seafile_dir == NULL)
         seafile_dir = g_build_filename (config_dir, "seafile-data", NULL);
     if (worktree_dir == NULL)
         worktree_dir = g_build_filename (g_get_home_dir(), "seafile", NULL);
 
+    /* Convert the object store to pack files and exit. The daemon must not
+     * be running on the same data directory. */
+    if (pack_objects) {
+        if (seaf_obj_store_pack_loose_objects (seafile_dir, "commits") < 0 ||
+            seaf_obj_store_pack_loose_objects (seafile_dir, "fs") < 0) {
+            seaf_warning ("Failed to pack objects in %s.\n", seafile_dir);
+            exit (1);
+        }
+        seaf_message ("Packed objects in %s.\n", seafile_dir);
+        exit (0);
+    }
+
+    StartupTimer timer;
+
+    startup_timer_start (&timer, FALSE);
     seaf = seafile_session_new (seafile_dir, worktree_dir, config_dir);
     if (!seaf) {
         seaf_warning ("Failed to create seafile session.\n");
         exit (1);
     }
+    startup_profile_add_phase ("session new", &timer);
     seaf->port = port;
 
     pidfile = g_build_filename (seafile_dir, "seaf-daemon.pid", NULL);
@@ -585,10 +683,12 @@ main (int argc, char **argv)
     seafile_session_prepare (seaf);
     seafile_session_start (seaf);
 
+    startup_timer_start (&timer, FALSE);
     if (start_searpc_server () < 0) {
         seaf_warning ("Failed to start searpc server.\n");
         exit (1);
     }
+    startup_profile_add_phase ("rpc server start", &timer);
 
     seaf_message ("rpc server started.\n");
 
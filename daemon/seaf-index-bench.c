@@ -0,0 +1,526 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Benchmark of the index and worktree scan code paths on generated trees.
+ *
+ * For each tree, a local repo is created without a server, and the phases
+ * below are run through the repo manager:
+ * - commit: the initial seaf_repo_index_commit(), which adds the whole
+ *   worktree to the index (add_recursive) and commits it;
+ * - read_index / write_index: loading and saving the resulting index;
+ * - rescan: a forced commit without changes, i.e.
+ *   scan_worktree_for_changes() on an up-to-date index;
+ * - commit_changes: a forced commit after rewriting 1% of the files.
+ *
+ * Wall and CPU time, RSS and I/O calls are reported per phase. Trees are
+ * given as shape:files:size, where shape is "wide" (1000 entries per dir)
+ * or "deep" (dirs nested 32 levels).
+ *
+ * Built with --enable-benchmark.
+ */
+
+#include "common.h"
+
+#include <getopt.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+
+#include "seafile-session.h"
+#include "commit-mgr.h"
+#include "branch-mgr.h"
+#include "repo-mgr.h"
+#include "index/index.h"
+#include "utils.h"
+#include "log.h"
+#include "cdc/cdc.h"
+#include "bench-utils.h"
+
+SeafileSession *seaf;
+
+#define DEFAULT_TREES "wide:1000:4096", "wide:100000:64", "deep:100000:64", \
+        "wide:16:67108864"
+
+#define WIDE_FILES_PER_DIR 1000
+#define DEEP_DEPTH 32
+#define DEEP_FILES_PER_DIR 8
+
+#define WRITE_BUF_SIZE (1 << 20)
+
+/* Percentage of the files rewritten before the commit_changes phase. */
+#define MODIFIED_PERCENT 1
+
+typedef enum {
+    TREE_WIDE,
+    TREE_DEEP,
+} TreeShape;
+
+typedef struct TreeSpec {
+    char *name;
+    TreeShape shape;
+    gint64 n_files;
+    gint64 file_size;
+} TreeSpec;
+
+static const char *short_options = "hd:t:r:";
+static struct option long_options[] = {
+    { "help", no_argument, NULL, 'h', },
+    { "workdir", required_argument, NULL, 'd', },
+    { "tree", required_argument, NULL, 't', },
+    { "repeats", required_argument, NULL, 'r', },
+    { NULL, 0, NULL, 0, },
+};
+
+static int repeats = 3;
+
+static void usage ()
+{
+    fprintf (stderr,
+             "usage: seaf-index-bench [-d workdir] [-t shape:files:size ...] [-r repeats]\n"
+             "  -t  a tree to generate, e.g. wide:100000:64 or deep:5000000:16,\n"
+             "      may be given several times\n"
+             "  -r  runs of read_index and write_index, the best one is reported\n");
+}
+
+static TreeSpec *
+parse_tree_spec (const char *str)
+{
+    char **tokens = g_strsplit (str, ":", -1);
+    TreeSpec *spec = NULL;
+    TreeShape shape;
+
+    if (g_strv_length (tokens) != 3)
+        goto out;
+
+    if (strcmp (tokens[0], "wide") == 0)
+        shape = TREE_WIDE;
+    else if (strcmp (tokens[0], "deep") == 0)
+        shape = TREE_DEEP;
+    else
+        goto out;
+
+    spec = g_new0 (TreeSpec, 1);
+    spec->name = g_strdup (str);
+    spec->shape = shape;
+    spec->n_files = g_ascii_strtoll (tokens[1], NULL, 10);
+    spec->file_size = g_ascii_strtoll (tokens[2], NULL, 10);
+    if (spec->n_files <= 0 || spec->file_size < 0) {
+        g_free (spec->name);
+        g_free (spec);
+        spec = NULL;
+    }
+
+out:
+    if (!spec)
+        seaf_warning ("Invalid tree %s.\n", str);
+    g_strfreev (tokens);
+    return spec;
+}
+
+static void
+tree_spec_free (TreeSpec *spec)
+{
+    g_free (spec->name);
+    g_free (spec);
+}
+
+/* The dir of the @i-th file, relative to the worktree. */
+static char *
+file_dir (TreeSpec *spec, gint64 i)
+{
+    GString *dir;
+    gint64 chain;
+    int level, l;
+
+    if (spec->shape == TREE_WIDE)
+        return g_strdup_printf ("d%06" G_GINT64_FORMAT, i / WIDE_FILES_PER_DIR);
+
+    chain = i / (DEEP_DEPTH * DEEP_FILES_PER_DIR);
+    level = (int)((i / DEEP_FILES_PER_DIR) % DEEP_DEPTH);
+
+    dir = g_string_new (NULL);
+    g_string_append_printf (dir, "c%06" G_GINT64_FORMAT, chain);
+    for (l = 0; l <= level; ++l)
+        g_string_append_printf (dir, "/l%02d", l);
+    return g_string_free (dir, FALSE);
+}
+
+static char *
+file_path (const char *worktree, TreeSpec *spec, gint64 i)
+{
+    char *dir = file_dir (spec, i);
+    char *path;
+
+    path = g_strdup_printf ("%s/%s/f%08" G_GINT64_FORMAT, worktree, dir, i);
+    g_free (dir);
+    return path;
+}
+
+/* Content is unique per @seed, so that no block is shared between files or
+ * between versions of a file. */
+static int
+write_file (const char *path, gint64 size, gint64 seed, char *buf)
+{
+    guint64 state = (guint64)seed * 0x9E3779B97F4A7C15ULL + 1;
+    gint64 done = 0;
+    int fd, len, i;
+
+    fd = seaf_util_create (path, O_WRONLY | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        seaf_warning ("Failed to create %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (done < size) {
+        len = (int)MIN (size - done, WRITE_BUF_SIZE);
+        for (i = 0; i < len; ++i) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            buf[i] = (char)state;
+        }
+        if (writen (fd, buf, len) != len) {
+            seaf_warning ("Failed to write %s: %s.\n", path, strerror(errno));
+            close (fd);
+            return -1;
+        }
+        done += len;
+    }
+
+    close (fd);
+    return 0;
+}
+
+static int
+generate_tree (const char *worktree, TreeSpec *spec)
+{
+    char *buf = g_malloc (WRITE_BUF_SIZE);
+    char *last_dir = NULL, *dir, *abs_dir, *path;
+    gint64 i;
+    int ret = 0;
+
+    for (i = 0; i < spec->n_files && ret == 0; ++i) {
+        dir = file_dir (spec, i);
+        if (g_strcmp0 (dir, last_dir) != 0) {
+            abs_dir = g_build_filename (worktree, dir, NULL);
+            if (g_mkdir_with_parents (abs_dir, 0755) < 0) {
+                seaf_warning ("Failed to create %s.\n", abs_dir);
+                ret = -1;
+            }
+            g_free (abs_dir);
+        }
+        g_free (last_dir);
+        last_dir = dir;
+        if (ret < 0)
+            break;
+
+        path = file_path (worktree, spec, i);
+        ret = write_file (path, spec->file_size, i, buf);
+        g_free (path);
+    }
+
+    g_free (last_dir);
+    g_free (buf);
+    return ret;
+}
+
+static int
+modify_tree (const char *worktree, TreeSpec *spec)
+{
+    char *buf = g_malloc (WRITE_BUF_SIZE);
+    gint64 step, i;
+    char *path;
+    int ret = 0;
+
+    step = MAX (100 / MODIFIED_PERCENT, 1);
+    for (i = 0; i < spec->n_files && ret == 0; i += step) {
+        path = file_path (worktree, spec, i);
+        ret = write_file (path, spec->file_size, i + spec->n_files, buf);
+        g_free (path);
+    }
+
+    g_free (buf);
+    return ret;
+}
+
+static SeafRepo *
+create_local_repo (const char *worktree)
+{
+    SeafRepoManager *mgr = seaf->repo_mgr;
+    SeafCommit *commit;
+    SeafBranch *branch;
+    SeafRepo *repo = NULL;
+    char *repo_id = gen_uuid ();
+
+    commit = seaf_commit_new (NULL, repo_id, EMPTY_SHA1, "bench",
+                              seaf->client_id, "Initial commit", 0);
+    commit->repo_name = g_strdup ("bench");
+    commit->repo_desc = g_strdup ("");
+    commit->version = CURRENT_REPO_VERSION;
+    if (seaf_commit_manager_add_commit (seaf->commit_mgr, commit) < 0) {
+        seaf_warning ("Failed to add commit.\n");
+        goto out;
+    }
+
+    branch = seaf_branch_new ("local", repo_id, commit->commit_id);
+    seaf_branch_manager_add_branch (seaf->branch_mgr, branch);
+    seaf_branch_unref (branch);
+    branch = seaf_branch_new ("master", repo_id, commit->commit_id);
+    seaf_branch_manager_add_branch (seaf->branch_mgr, branch);
+
+    repo = seaf_repo_new (repo_id, NULL, NULL);
+    seaf_repo_from_commit (repo, commit);
+    seaf_repo_manager_add_repo (mgr, repo);
+
+    if (seaf_repo_manager_set_repo_worktree (mgr, repo, worktree) < 0 ||
+        seaf_repo_set_head (repo, branch) < 0) {
+        seaf_warning ("Failed to set up repo %s.\n", repo_id);
+        repo = NULL;
+    }
+    seaf_branch_unref (branch);
+
+out:
+    seaf_commit_unref (commit);
+    g_free (repo_id);
+    return repo;
+}
+
+static void
+print_header ()
+{
+    printf ("%-24s %-16s %10s %10s %9s %9s %12s\n", "tree", "phase",
+            "wall_ms", "cpu_ms", "rss_mb", "peak_mb", "io_calls");
+}
+
+static void
+print_phase (TreeSpec *spec, const char *phase, BenchProcStats *before,
+             BenchProcStats *after)
+{
+    char io_calls[32];
+
+    if (before->io_calls >= 0 && after->io_calls >= 0)
+        snprintf (io_calls, sizeof(io_calls), "%" G_GINT64_FORMAT,
+                  after->io_calls - before->io_calls);
+    else
+        snprintf (io_calls, sizeof(io_calls), "-");
+
+    printf ("%-24s %-16s %10.1f %10.1f %9.1f %9.1f %12s\n", spec->name, phase,
+            (after->wall - before->wall) / 1000.0,
+            (after->cpu - before->cpu) / 1000.0,
+            after->rss / 1048576.0, after->peak_rss / 1048576.0, io_calls);
+    fflush (stdout);
+}
+
+static int
+run_commit (SeafRepo *repo, gboolean is_initial_commit)
+{
+    GError *error = NULL;
+    char *commit_id;
+
+    commit_id = seaf_repo_index_commit (repo, TRUE, is_initial_commit, &error);
+    if (error) {
+        seaf_warning ("Failed to commit: %s.\n", error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+    g_free (commit_id);
+    return 0;
+}
+
+/* Print the best of @repeats runs of reading the index, or of writing it if
+ * @write is set. */
+static int
+bench_index_io (SeafRepo *repo, TreeSpec *spec, gboolean write)
+{
+    struct index_state istate;
+    BenchProcStats before, after, best_before, best_after;
+    char *index_path, *tmp_path;
+    gint64 best = -1;
+    int i, fd, ret = 0;
+
+    memset (&best_before, 0, sizeof(best_before));
+    memset (&best_after, 0, sizeof(best_after));
+
+    index_path = g_build_filename (seaf->repo_mgr->index_dir, repo->id, NULL);
+    tmp_path = g_strconcat (index_path, ".bench", NULL);
+
+    for (i = 0; i < repeats; ++i) {
+        memset (&istate, 0, sizeof(istate));
+        if (!write)
+            bench_get_proc_stats (&before);
+        if (read_index_from (&istate, index_path, repo->version) < 0) {
+            seaf_warning ("Failed to read index %s.\n", index_path);
+            ret = -1;
+            break;
+        }
+
+        if (write) {
+            fd = seaf_util_create (tmp_path, O_WRONLY | O_TRUNC | O_BINARY, 0644);
+            if (fd < 0) {
+                discard_index (&istate);
+                ret = -1;
+                break;
+            }
+            bench_get_proc_stats (&before);
+            ret = write_index (&istate, fd);
+            close (fd);
+        }
+
+        bench_get_proc_stats (&after);
+        discard_index (&istate);
+        if (ret < 0)
+            break;
+
+        if (best < 0 || after.wall - before.wall < best) {
+            best = after.wall - before.wall;
+            best_before = before;
+            best_after = after;
+        }
+    }
+
+    if (ret == 0)
+        print_phase (spec, write ? "write_index" : "read_index",
+                     &best_before, &best_after);
+
+    seaf_util_unlink (tmp_path);
+    g_free (index_path);
+    g_free (tmp_path);
+    return ret;
+}
+
+static void
+run_tree (const char *workdir, TreeSpec *spec, int n)
+{
+    BenchProcStats before, after;
+    char *worktree;
+    SeafRepo *repo;
+
+    worktree = g_strdup_printf ("%s/worktree-%d", workdir, n);
+    if (checkdir_with_mkdir (worktree) < 0) {
+        seaf_warning ("Failed to create %s.\n", worktree);
+        goto out;
+    }
+
+    bench_get_proc_stats (&before);
+    if (generate_tree (worktree, spec) < 0)
+        goto out;
+    bench_get_proc_stats (&after);
+    print_phase (spec, "generate", &before, &after);
+
+    repo = create_local_repo (worktree);
+    if (!repo)
+        goto out;
+
+    bench_get_proc_stats (&before);
+    if (run_commit (repo, TRUE) < 0)
+        goto out;
+    bench_get_proc_stats (&after);
+    print_phase (spec, "commit", &before, &after);
+
+    if (bench_index_io (repo, spec, FALSE) < 0 ||
+        bench_index_io (repo, spec, TRUE) < 0)
+        goto out;
+
+    bench_get_proc_stats (&before);
+    if (run_commit (repo, FALSE) < 0)
+        goto out;
+    bench_get_proc_stats (&after);
+    print_phase (spec, "rescan", &before, &after);
+
+    if (modify_tree (worktree, spec) < 0)
+        goto out;
+
+    bench_get_proc_stats (&before);
+    if (run_commit (repo, FALSE) < 0)
+        goto out;
+    bench_get_proc_stats (&after);
+    print_phase (spec, "commit_changes", &before, &after);
+
+out:
+    bench_remove_dir (worktree);
+    g_free (worktree);
+}
+
+int
+main (int argc, char **argv)
+{
+    static const char *default_trees[] = { DEFAULT_TREES };
+    char *workdir = NULL;
+    gboolean remove_workdir = FALSE;
+    char *seafile_dir, *default_worktree;
+    GList *specs = NULL, *ptr;
+    TreeSpec *spec;
+    int c, i;
+
+    while ((c = getopt_long (argc, argv, short_options,
+                             long_options, NULL)) != EOF) {
+        switch (c) {
+        case 'h':
+            usage ();
+            exit (0);
+        case 'd':
+            workdir = g_strdup (optarg);
+            break;
+        case 't':
+            spec = parse_tree_spec (optarg);
+            if (!spec)
+                exit (1);
+            specs = g_list_append (specs, spec);
+            break;
+        case 'r':
+            repeats = MAX (atoi (optarg), 1);
+            break;
+        default:
+            usage ();
+            exit (1);
+        }
+    }
+
+    if (!specs) {
+        for (i = 0; i < G_N_ELEMENTS(default_trees); ++i)
+            specs = g_list_append (specs, parse_tree_spec (default_trees[i]));
+    }
+
+#if !GLIB_CHECK_VERSION(2, 35, 0)
+    g_type_init();
+#endif
+
+    cdc_init ();
+
+    if (seafile_log_init ("-", "info", "warning") < 0) {
+        fprintf (stderr, "Failed to init log.\n");
+        exit (1);
+    }
+
+    if (!workdir) {
+        workdir = g_dir_make_tmp ("seaf-index-bench-XXXXXX", NULL);
+        if (!workdir) {
+            seaf_warning ("Failed to create a temporary dir.\n");
+            exit (1);
+        }
+        remove_workdir = TRUE;
+    }
+
+    seafile_dir = g_build_filename (workdir, "seafile-data", NULL);
+    default_worktree = g_build_filename (workdir, "seafile", NULL);
+    seaf = seafile_session_new (seafile_dir, default_worktree, workdir);
+    if (!seaf) {
+        seaf_warning ("Failed to create session in %s.\n", workdir);
+        exit (1);
+    }
+    seafile_session_prepare (seaf);
+
+    print_header ();
+    for (ptr = specs, i = 0; ptr; ptr = ptr->next, ++i)
+        run_tree (workdir, ptr->data, i);
+
+    g_list_free_full (specs, (GDestroyNotify)tree_spec_free);
+
+    if (remove_workdir)
+        bench_remove_dir (workdir);
+
+    g_free (seafile_dir);
+    g_free (default_worktree);
+    g_free (workdir);
+
+    return 0;
+}
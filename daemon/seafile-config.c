@@ -4,6 +4,7 @@
 #include "db.h"
 
 #include "seafile-config.h"
+#include "mem-budget.h"
 
 gboolean
 seafile_session_config_exists (SeafileSession *session, const char *key)
@@ -125,6 +126,13 @@ seafile_session_config_set_string (SeafileSession *session,
             session->disable_verify_certificate = FALSE;
     }
 
+    if (g_strcmp0(key, KEY_ENABLE_HTTP3) == 0) {
+        if (g_strcmp0(value, "true") == 0)
+            session->enable_http3 = TRUE;
+        else
+            session->enable_http3 = FALSE;
+    }
+
     if (g_strcmp0(key, KEY_USE_PROXY) == 0) {
         if (g_strcmp0(value, "true") == 0)
             session->use_http_proxy = TRUE;
@@ -196,6 +204,16 @@ seafile_session_config_set_int (SeafileSession *session,
     if (g_strcmp0(key, KEY_DELETE_CONFIRM_THRESHOLD) == 0) {
         session->delete_confirm_threshold = value;
     }
+    if (g_strcmp0(key, KEY_WRITE_SETTLE_TIME) == 0) {
+        session->write_settle_time = value >= 0 ? value : DEFAULT_WRITE_SETTLE_TIME;
+    }
+    if (g_strcmp0(key, KEY_MAX_SYNC_TASKS) == 0 && session->sync_mgr) {
+        session->sync_mgr->max_running_tasks =
+            value > 0 ? value : DEFAULT_MAX_RUNNING_SYNC_TASKS;
+    }
+    if (g_strcmp0(key, KEY_MEMORY_BUDGET) == 0) {
+        mem_budget_set_limit ((gint64)value << 20);
+    }
 
     return 0;
 }
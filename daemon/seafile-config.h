@@ -17,16 +17,64 @@
 #define KEY_DB_NAME "db_name"
 #define KEY_UPLOAD_LIMIT "upload_limit"
 #define KEY_DOWNLOAD_LIMIT "download_limit"
+/* Limits applied to the transfers with each server. */
+#define KEY_SERVER_UPLOAD_LIMIT "server_upload_limit"
+#define KEY_SERVER_DOWNLOAD_LIMIT "server_download_limit"
 #define KEY_CDC_AVERAGE_BLOCK_SIZE "block_size"
 #define KEY_ALLOW_INVALID_WORKTREE "allow_invalid_worktree"
 #define KEY_ALLOW_REPO_NOT_FOUND_ON_SERVER "allow_repo_not_found_on_server"
 #define KEY_SYNC_EXTRA_TEMP_FILE "sync_extra_temp_file"
 #define KEY_DISABLE_BLOCK_HASH "disable_block_hash"
+/* "pack" stores blocks in pack files, see block-backend-pack.c */
+#define KEY_BLOCK_BACKEND "block_backend"
+/* "pack" stores fs and commit objects in pack files, see obj-backend-pack.c */
+#define KEY_OBJ_BACKEND "obj_backend"
+/* Size of the parsed fs object cache in MB, 0 disables it. */
+#define KEY_FS_CACHE_SIZE "fs_cache_size"
+/* Number of parsed commits to cache, 0 disables it. */
+#define KEY_COMMIT_CACHE_SIZE "commit_cache_size"
+/* Size in MB of the blocks kept that can be downloaded again, see block-mgr.h */
+#define KEY_BLOCK_CACHE_SIZE "block_cache_size"
+/* Number of threads that download and write files on checkout. */
+#define KEY_DOWNLOAD_THREADS "download_threads"
+/* Write downloaded blocks straight to the worktree, bypassing the block store. */
+#define KEY_DIRECT_CHECKOUT "direct_checkout"
+/* Create the next partial commit of a large import while the previous
+ * one is being uploaded. */
+#define KEY_PIPELINE_PARTIAL_COMMITS "pipeline_partial_commits"
+/* Send new blocks to the server while indexing, so that the upload task
+ * doesn't send them again. Always on with upload_only. */
+#define KEY_STREAM_UPLOAD "stream_upload"
+/* Link blocks that other unencrypted repos from the same server already
+ * have, instead of downloading them again. */
+#define KEY_SHARE_BLOCKS_ACROSS_REPOS "share_blocks_across_repos"
+/* Shared by the clients of a LAN that serve blocks to each other, see
+ * peer-block-mgr.h. Peer sharing is off if unset. */
+#define KEY_PEER_BLOCK_SECRET "peer_block_secret"
+/* Port to serve blocks to peers on. */
+#define KEY_PEER_BLOCK_PORT "peer_block_port"
+/* Comma separated host:port of the peers to get blocks from. */
+#define KEY_PEER_BLOCK_PEERS "peer_block_peers"
+/* Number of repos that can be synced at the same time. */
+#define KEY_MAX_SYNC_TASKS "max_sync_tasks"
+/* Memory budget of the sync tasks in MB, see mem-budget.h. */
+#define KEY_MEMORY_BUDGET "memory_budget"
+/* Seconds a frequently rewritten file must stay unchanged before it's
+ * committed, see wt-monitor-structs.h. 0 disables the deferral. */
+#define KEY_WRITE_SETTLE_TIME "write_settle_time"
+#define DEFAULT_WRITE_SETTLE_TIME 30
+/* Watch worktrees with fanotify on Linux, if the daemon is privileged. */
+#define KEY_USE_FANOTIFY "use_fanotify"
+/* Don't keep binary copies of dir objects, see fs-mgr.c */
+#define KEY_DISABLE_FS_BIN_CACHE "disable_fs_bin_cache"
 #define KEY_HIDE_WINDOWS_INCOMPATIBLE_PATH_NOTIFICATION "hide_windows_incompatible_path_notification"
 
 /* Http sync settings. */
 #define KEY_ENABLE_HTTP_SYNC "enable_http_sync"
 #define KEY_DISABLE_VERIFY_CERTIFICATE "disable_verify_certificate"
+/* Move block and fs object transfers to HTTP/3 when the server advertises
+ * it with Alt-Svc, see http-tx-mgr.c. */
+#define KEY_ENABLE_HTTP3 "enable_http3"
 
 /* SNI settings. */
 #define KEY_ENABLE_SNI "enable_sni"
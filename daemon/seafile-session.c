@@ -32,6 +32,7 @@
 #include "seafile-config.h"
 #include "vc-utils.h"
 #include "log.h"
+#include "startup-profile.h"
 
 #define MAX_THREADS 50
 
@@ -97,7 +98,8 @@ seafile_session_class_init (SeafileSessionClass *klass)
 static int
 create_deleted_store_dirs (const char *deleted_store)
 {
-    char *commits = NULL, *fs = NULL, *blocks = NULL;
+    char *commits = NULL, *fs = NULL, *fs_bin = NULL, *chunk_maps = NULL;
+    char *blocks = NULL;
     int ret = 0;
 
     if (checkdir_with_mkdir (deleted_store) < 0) {
@@ -122,6 +124,22 @@ create_deleted_store_dirs (const char *deleted_store)
         goto out;
     }
 
+    fs_bin = g_build_filename (deleted_store, "fs-bin", NULL);
+    if (checkdir_with_mkdir (fs_bin) < 0) {
+        seaf_warning ("Directory %s does not exist and is unable to create\n",
+                      fs_bin);
+        ret = -1;
+        goto out;
+    }
+
+    chunk_maps = g_build_filename (deleted_store, "chunk-maps", NULL);
+    if (checkdir_with_mkdir (chunk_maps) < 0) {
+        seaf_warning ("Directory %s does not exist and is unable to create\n",
+                      chunk_maps);
+        ret = -1;
+        goto out;
+    }
+
     blocks = g_build_filename (deleted_store, "blocks", NULL);
     if (checkdir_with_mkdir (blocks) < 0) {
         seaf_warning ("Directory %s does not exist and is unable to create\n",
@@ -133,6 +151,8 @@ create_deleted_store_dirs (const char *deleted_store)
 out:
     g_free (commits);
     g_free (fs);
+    g_free (fs_bin);
+    g_free (chunk_maps);
     g_free (blocks);
     return ret;
 }
@@ -227,6 +247,8 @@ seafile_session_new(const char *seafile_dir,
     if (!session->filelock_mgr)
         goto onerror;
 
+    session->peer_block_mgr = seaf_peer_block_manager_new (session);
+
     session->job_mgr = seaf_job_manager_new (session, MAX_THREADS);
     session->ev_mgr = cevent_manager_new ();
     if (!session->ev_mgr)
@@ -358,6 +380,9 @@ void
 seafile_session_prepare (SeafileSession *session)
 {
     char *client_id = NULL, *client_name = NULL;
+    StartupTimer timer;
+
+    startup_timer_start (&timer, FALSE);
 
     /* load config */
 
@@ -400,6 +425,9 @@ seafile_session_prepare (SeafileSession *session)
     session->disable_verify_certificate = seafile_session_config_get_bool
         (session, KEY_DISABLE_VERIFY_CERTIFICATE);
 
+    session->enable_http3 =
+        seafile_session_config_get_bool (session, KEY_ENABLE_HTTP3);
+
     session->use_http_proxy =
         seafile_session_config_get_bool(session, KEY_USE_PROXY);
 
@@ -425,6 +453,11 @@ seafile_session_prepare (SeafileSession *session)
     if (session->delete_confirm_threshold <= 0)
         session->delete_confirm_threshold = MAX_DELETED_FILES_NUM;
 
+    gboolean exists;
+    session->write_settle_time = seafile_session_config_get_int (session, KEY_WRITE_SETTLE_TIME, &exists);
+    if (!exists || session->write_settle_time < 0)
+        session->write_settle_time = DEFAULT_WRITE_SETTLE_TIME;
+
     int block_size = seafile_session_config_get_int(session, KEY_CDC_AVERAGE_BLOCK_SIZE, NULL);
     if (block_size >= 1024) {
         session->cdc_average_block_size = block_size;
@@ -444,18 +477,33 @@ seafile_session_prepare (SeafileSession *session)
     session->use_sni = seafile_session_config_get_bool (session, KEY_ENABLE_SNI);
     session->sni_hostname = seafile_session_config_get_string (session, KEY_SNI_HOSTNAME);
     session->upload_only = seafile_session_config_get_bool (session, KEY_UPLOAD_ONLY);
+
+    startup_profile_add_phase ("load config", &timer);
     
+    startup_timer_start (&timer, FALSE);
     /* Start mq manager earlier, so that we can send notifications
      * when start repo manager. */
     seaf_mq_manager_init (session->mq_mgr);
     seaf_commit_manager_init (session->commit_mgr);
     seaf_fs_manager_init (session->fs_mgr);
     seaf_branch_manager_init (session->branch_mgr);
+    startup_profile_add_phase ("object managers init", &timer);
+
+    startup_timer_start (&timer, FALSE);
     seaf_filelock_manager_init (session->filelock_mgr);
+    startup_profile_add_phase ("filelock manager init", &timer);
+
+    startup_timer_start (&timer, FALSE);
     seaf_repo_manager_init (session->repo_mgr);
+    startup_profile_add_phase ("repo manager init", &timer);
+
+    startup_timer_start (&timer, FALSE);
     seaf_clone_manager_init (session->clone_mgr);
+    startup_profile_add_phase ("clone manager init", &timer);
 #ifndef SEAF_TOOL    
+    startup_timer_start (&timer, FALSE);
     seaf_sync_manager_init (session->sync_mgr);
+    startup_profile_add_phase ("sync manager init", &timer);
 #endif
 }
 
@@ -545,9 +593,13 @@ on_start_cleanup_job (void *vdata)
      */
     /* migrate_client_v0_repos (); */
 
+    StartupTimer timer;
+
+    startup_timer_start (&timer, TRUE);
     cleanup_unused_repo_stores ("commits");
     cleanup_unused_repo_stores ("fs");
     cleanup_unused_repo_stores ("blocks");
+    startup_profile_add_phase ("clean up unused stores", &timer);
 
     return vdata;
 }
@@ -556,6 +608,9 @@ static void
 cleanup_job_done (void *vdata)
 {
     SeafileSession *session = vdata;
+    StartupTimer timer;
+
+    startup_timer_start (&timer, FALSE);
 
     if (cevent_manager_start (session->ev_mgr) < 0) {
         g_error ("Failed to start event manager.\n");
@@ -567,22 +622,35 @@ cleanup_job_done (void *vdata)
         return;
     }
 
+    if (seaf_peer_block_manager_start (session->peer_block_mgr) < 0) {
+        g_error ("Failed to start peer block manager.\n");
+        return;
+    }
+
     if (seaf_sync_manager_start (session->sync_mgr) < 0) {
         g_error ("Failed to start sync manager.\n");
         return;
     }
 
+    startup_profile_add_phase ("transfer and sync managers start", &timer);
+    startup_timer_start (&timer, FALSE);
+
     if (seaf_wt_monitor_start (session->wt_monitor) < 0) {
         g_error ("Failed to start worktree monitor.\n");
         return;
     }
 
-    /* Must be after wt monitor, since we may add watch to repo worktree. */
+    startup_profile_add_phase ("worktree monitor start", &timer);
+
+    /* Must be after wt monitor, since we may add watch to repo worktree.
+     * The time to watch the repos is recorded by repo manager. */
     if (seaf_repo_manager_start (session->repo_mgr) < 0) {
         g_error ("Failed to start repo manager.\n");
         return;
     }
 
+    startup_timer_start (&timer, FALSE);
+
     if (seaf_clone_manager_start (session->clone_mgr) < 0) {
         g_error ("Failed to start clone manager.\n");
         return;
@@ -593,17 +661,22 @@ cleanup_job_done (void *vdata)
         return;
     }
 
+    startup_profile_add_phase ("clone and filelock managers start", &timer);
+
     /* The system is up and running. */
     session->started = TRUE;
+
+    startup_profile_finish ();
 }
 
 static void
 on_start_cleanup (SeafileSession *session)
 {
-    seaf_job_manager_schedule_job (seaf->job_mgr, 
-                                   on_start_cleanup_job, 
-                                   cleanup_job_done,
-                                   session);
+    seaf_job_manager_schedule_job_with_priority (seaf->job_mgr, 
+                                                 JOB_PRIORITY_BULK,
+                                                 on_start_cleanup_job, 
+                                                 cleanup_job_done,
+                                                 session);
 }
 
 void
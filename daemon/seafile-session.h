@@ -22,6 +22,7 @@
 
 #include "http-tx-mgr.h"
 #include "filelock-mgr.h"
+#include "peer-block-mgr.h"
 
 
 #define SEAFILE_TYPE_SESSION                  (seafile_session_get_type ())
@@ -73,6 +74,8 @@ struct _SeafileSession {
 
     SeafFilelockManager *filelock_mgr;
 
+    SeafPeerBlockManager *peer_block_mgr;
+
     SeafNotifManager    *notif_mgr;
 
     /* Set after all components are up and running. */
@@ -81,6 +84,7 @@ struct _SeafileSession {
     gboolean             sync_extra_temp_file;
     gboolean             enable_http_sync;
     gboolean             disable_verify_certificate;
+    gboolean             enable_http3;
 
     gboolean             disable_block_hash;
     
@@ -93,6 +97,7 @@ struct _SeafileSession {
     char                *http_proxy_username;
     char                *http_proxy_password;
     int                 delete_confirm_threshold;
+    int                 write_settle_time;
 
     gboolean             use_sni;
     char                *sni_hostname;
@@ -2,6 +2,8 @@
 
 #include "common.h"
 
+#include <pthread.h>
+
 #include "utils.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_SYNC
 #include "log.h"
@@ -68,8 +70,8 @@ unset_permissions (PACL dacl)
     return 0;
 }
 
-int
-seaf_set_path_permission (const char *path, SeafPathPerm perm, gboolean recursive)
+static int
+do_set_path_permission (const char *path, SeafPathPerm perm, gboolean recursive)
 {
     wchar_t *wpath = NULL;
     int ret = 0;
@@ -118,7 +120,9 @@ seaf_set_path_permission (const char *path, SeafPathPerm perm, gboolean recursiv
         goto cleanup;
     }  
 
-    // Attach the new ACL as the object's DACL.
+    // Attach the new ACL as the object's DACL. The ACE is inheritable, so
+    // for a subtree it's only set here, and Windows propagates it to the
+    // entries under @path in the same call.
 
     if (recursive) {
         res = SetNamedSecurityInfoW(wpath, SE_FILE_OBJECT, 
@@ -151,8 +155,8 @@ seaf_set_path_permission (const char *path, SeafPathPerm perm, gboolean recursiv
     return ret;
 }
 
-int
-seaf_unset_path_permission (const char *path, gboolean recursive)
+static int
+do_unset_path_permission (const char *path, gboolean recursive)
 {
     wchar_t *wpath = NULL;
     int ret = 0;
@@ -293,8 +297,8 @@ cleanup:
 
 #include <sys/stat.h>
 
-int
-seaf_set_path_permission (const char *path, SeafPathPerm perm, gboolean recursive)
+static int
+do_set_path_permission (const char *path, SeafPathPerm perm, gboolean recursive)
 {
     struct stat st;
     mode_t new_mode;
@@ -318,8 +322,8 @@ seaf_set_path_permission (const char *path, SeafPathPerm perm, gboolean recursiv
     return 0;
 }
 
-int
-seaf_unset_path_permission (const char *path, gboolean recursive)
+static int
+do_unset_path_permission (const char *path, gboolean recursive)
 {
     return 0;
 }
@@ -331,3 +335,172 @@ seaf_get_path_permission (const char *path)
 }
 
 #endif  /* WIN32 */
+
+/*
+ * Queued permission changes.
+ *
+ * Changes queued with seaf_queue_path_permission() are applied in batches
+ * by one background thread. A later change to the same path replaces the
+ * queued one. Changes made directly with seaf_set_path_permission() and
+ * seaf_unset_path_permission() cancel the queued change of the path, and
+ * are serialized with the background thread, so the last change made to
+ * a path always wins.
+ */
+
+typedef struct PermRequest {
+    char *path;
+    /* SEAF_PATH_PERM_UNKNOWN to unset. */
+    SeafPathPerm perm;
+    gboolean recursive;
+    SeafPathPermDone done;
+    /* Taken by the background thread, which frees it. */
+    gboolean taken;
+    gboolean cancelled;
+} PermRequest;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+/* path -> PermRequest */
+static GHashTable *pending;
+static GThreadPool *perm_worker;
+static gboolean worker_scheduled;
+
+/* Held while a change is applied. */
+static pthread_mutex_t apply_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+perm_request_free (PermRequest *req)
+{
+    g_free (req->path);
+    g_free (req);
+}
+
+/* Called with queue_lock held. */
+static void
+cancel_pending (const char *path)
+{
+    PermRequest *req;
+
+    if (!pending)
+        return;
+
+    req = g_hash_table_lookup (pending, path);
+    if (!req)
+        return;
+
+    g_hash_table_remove (pending, path);
+    if (req->taken)
+        req->cancelled = TRUE;
+    else
+        perm_request_free (req);
+}
+
+static int
+apply_request (PermRequest *req)
+{
+    if (req->perm == SEAF_PATH_PERM_UNKNOWN)
+        return do_unset_path_permission (req->path, req->recursive);
+    return do_set_path_permission (req->path, req->perm, req->recursive);
+}
+
+static void
+apply_pending_func (gpointer data, gpointer user_data)
+{
+    GList *batch, *ptr;
+    PermRequest *req;
+    gboolean cancelled;
+
+    pthread_mutex_lock (&queue_lock);
+    batch = g_hash_table_get_values (pending);
+    for (ptr = batch; ptr; ptr = ptr->next)
+        ((PermRequest *)ptr->data)->taken = TRUE;
+    worker_scheduled = FALSE;
+    pthread_mutex_unlock (&queue_lock);
+
+    for (ptr = batch; ptr; ptr = ptr->next) {
+        req = ptr->data;
+
+        pthread_mutex_lock (&apply_lock);
+
+        pthread_mutex_lock (&queue_lock);
+        cancelled = req->cancelled;
+        if (!cancelled && g_hash_table_lookup (pending, req->path) == req)
+            g_hash_table_remove (pending, req->path);
+        pthread_mutex_unlock (&queue_lock);
+
+        if (!cancelled && seaf_util_exists (req->path) &&
+            apply_request (req) == 0 && req->done)
+            req->done (req->path);
+
+        pthread_mutex_unlock (&apply_lock);
+
+        perm_request_free (req);
+    }
+
+    g_list_free (batch);
+}
+
+void
+seaf_queue_path_permission (const char *path, SeafPathPerm perm,
+                            gboolean recursive, SeafPathPermDone done)
+{
+    PermRequest *req;
+
+    req = g_new0 (PermRequest, 1);
+    req->path = g_strdup (path);
+    req->perm = perm;
+    req->recursive = recursive;
+    req->done = done;
+
+    pthread_mutex_lock (&queue_lock);
+
+    if (!pending) {
+        pending = g_hash_table_new (g_str_hash, g_str_equal);
+        perm_worker = g_thread_pool_new (apply_pending_func, NULL, 1, FALSE, NULL);
+    }
+
+    cancel_pending (path);
+    g_hash_table_insert (pending, req->path, req);
+
+    if (!worker_scheduled) {
+        worker_scheduled = TRUE;
+        g_thread_pool_push (perm_worker, GINT_TO_POINTER(1), NULL);
+    }
+
+    pthread_mutex_unlock (&queue_lock);
+}
+
+int
+seaf_set_path_permission (const char *path, SeafPathPerm perm, gboolean recursive)
+{
+    int ret;
+
+    pthread_mutex_lock (&apply_lock);
+
+    pthread_mutex_lock (&queue_lock);
+    cancel_pending (path);
+    pthread_mutex_unlock (&queue_lock);
+
+    ret = do_set_path_permission (path, perm, recursive);
+
+    pthread_mutex_unlock (&apply_lock);
+
+    return ret;
+}
+
+int
+seaf_unset_path_permission (const char *path, gboolean recursive)
+{
+    int ret;
+
+    pthread_mutex_lock (&apply_lock);
+
+    pthread_mutex_lock (&queue_lock);
+    cancel_pending (path);
+    pthread_mutex_unlock (&queue_lock);
+
+    ret = do_unset_path_permission (path, recursive);
+
+    pthread_mutex_unlock (&apply_lock);
+
+    return ret;
+}
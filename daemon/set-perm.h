@@ -17,4 +17,16 @@ seaf_unset_path_permission (const char *path, gboolean recursive);
 SeafPathPerm
 seaf_get_path_permission (const char *path);
 
+typedef void (*SeafPathPermDone) (const char *path);
+
+/*
+ * Apply the permission change on a background thread, batched with other
+ * queued changes. @perm is SEAF_PATH_PERM_UNKNOWN to unset. If @done is
+ * set, it's called on the background thread once the change has been
+ * applied, not if it fails or is replaced by a later change.
+ */
+void
+seaf_queue_path_permission (const char *path, SeafPathPerm perm,
+                            gboolean recursive, SeafPathPermDone done);
+
 #endif
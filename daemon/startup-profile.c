@@ -0,0 +1,236 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "startup-profile.h"
+#include "log.h"
+
+/* Number of the slowest repos written to the log. */
+#define LOGGED_SLOW_REPOS 10
+
+typedef struct ProfileEntry {
+    char *name;
+    gint64 wall;
+    gint64 cpu;
+} ProfileEntry;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static gint64 profile_start;
+static gboolean profile_finished;
+static gint64 total_wall;
+static gint64 total_cpu;
+/* Protected by profile_lock. */
+static GPtrArray *phases;
+static GPtrArray *repos;
+
+#ifdef WIN32
+
+static gint64
+filetime_to_usec (const FILETIME *ft)
+{
+    ULARGE_INTEGER t;
+
+    t.LowPart = ft->dwLowDateTime;
+    t.HighPart = ft->dwHighDateTime;
+    /* FILETIME is in 100 nanosecond units. */
+    return (gint64)(t.QuadPart / 10);
+}
+
+/* Returns the CPU time in microseconds. */
+static gint64
+get_cpu_time (gboolean thread_cpu)
+{
+    FILETIME creation, exit, kernel, user;
+    BOOL ok;
+
+    if (thread_cpu)
+        ok = GetThreadTimes (GetCurrentThread (), &creation, &exit, &kernel, &user);
+    else
+        ok = GetProcessTimes (GetCurrentProcess (), &creation, &exit, &kernel, &user);
+    if (!ok)
+        return 0;
+
+    return filetime_to_usec (&kernel) + filetime_to_usec (&user);
+}
+
+#else
+
+/* Returns the CPU time in microseconds. */
+static gint64
+get_cpu_time (gboolean thread_cpu)
+{
+    struct timespec ts;
+
+    if (clock_gettime (thread_cpu ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID,
+                       &ts) < 0)
+        return 0;
+
+    return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+#endif
+
+void
+startup_timer_start (StartupTimer *timer, gboolean thread_cpu)
+{
+    timer->wall = g_get_monotonic_time ();
+    timer->cpu = get_cpu_time (thread_cpu);
+    timer->thread_cpu = thread_cpu;
+
+    pthread_mutex_lock (&profile_lock);
+    if (profile_start == 0 || timer->wall < profile_start)
+        profile_start = timer->wall;
+    pthread_mutex_unlock (&profile_lock);
+}
+
+static ProfileEntry *
+new_entry (const char *name, StartupTimer *timer)
+{
+    ProfileEntry *entry = g_new0 (ProfileEntry, 1);
+
+    entry->name = g_strdup (name);
+    entry->wall = g_get_monotonic_time () - timer->wall;
+    entry->cpu = get_cpu_time (timer->thread_cpu) - timer->cpu;
+
+    return entry;
+}
+
+static void
+free_entry (ProfileEntry *entry)
+{
+    g_free (entry->name);
+    g_free (entry);
+}
+
+void
+startup_profile_add_phase (const char *name, StartupTimer *timer)
+{
+    ProfileEntry *entry = new_entry (name, timer);
+    gboolean finished;
+
+    pthread_mutex_lock (&profile_lock);
+    if (!phases)
+        phases = g_ptr_array_new_with_free_func ((GDestroyNotify)free_entry);
+    g_ptr_array_add (phases, entry);
+    finished = profile_finished;
+    pthread_mutex_unlock (&profile_lock);
+
+    if (finished)
+        seaf_message ("Startup phase %s took %" G_GINT64_FORMAT " ms "
+                      "(%" G_GINT64_FORMAT " ms CPU).\n",
+                      name, entry->wall / 1000, entry->cpu / 1000);
+}
+
+void
+startup_profile_add_repo (const char *repo_id, StartupTimer *timer)
+{
+    ProfileEntry *entry = new_entry (repo_id, timer);
+
+    pthread_mutex_lock (&profile_lock);
+    if (!repos)
+        repos = g_ptr_array_new_with_free_func ((GDestroyNotify)free_entry);
+    g_ptr_array_add (repos, entry);
+    pthread_mutex_unlock (&profile_lock);
+}
+
+static gint
+compare_entry_wall_desc (gconstpointer a, gconstpointer b)
+{
+    const ProfileEntry *e1 = *(ProfileEntry **)a;
+    const ProfileEntry *e2 = *(ProfileEntry **)b;
+
+    if (e1->wall == e2->wall)
+        return 0;
+    return (e1->wall > e2->wall) ? -1 : 1;
+}
+
+void
+startup_profile_finish ()
+{
+    ProfileEntry *entry;
+    GPtrArray *slow_repos;
+    guint i;
+
+    pthread_mutex_lock (&profile_lock);
+
+    if (profile_finished) {
+        pthread_mutex_unlock (&profile_lock);
+        return;
+    }
+    profile_finished = TRUE;
+    total_wall = profile_start ? g_get_monotonic_time () - profile_start : 0;
+    total_cpu = get_cpu_time (FALSE);
+
+    seaf_message ("Startup took %" G_GINT64_FORMAT " ms "
+                  "(%" G_GINT64_FORMAT " ms CPU), %u repos loaded.\n",
+                  total_wall / 1000, total_cpu / 1000, repos ? repos->len : 0);
+
+    for (i = 0; phases && i < phases->len; ++i) {
+        entry = g_ptr_array_index (phases, i);
+        seaf_message ("  %s: %" G_GINT64_FORMAT " ms (%" G_GINT64_FORMAT " ms CPU)\n",
+                      entry->name, entry->wall / 1000, entry->cpu / 1000);
+    }
+
+    if (repos && repos->len > 0) {
+        /* Sort a copy, the repos are returned in load order. */
+        slow_repos = g_ptr_array_sized_new (repos->len);
+        for (i = 0; i < repos->len; ++i)
+            g_ptr_array_add (slow_repos, g_ptr_array_index (repos, i));
+        g_ptr_array_sort (slow_repos, compare_entry_wall_desc);
+
+        seaf_message ("  Slowest repos to load:\n");
+        for (i = 0; i < slow_repos->len && i < LOGGED_SLOW_REPOS; ++i) {
+            entry = g_ptr_array_index (slow_repos, i);
+            seaf_message ("    %.8s: %" G_GINT64_FORMAT " ms (%" G_GINT64_FORMAT " ms CPU)\n",
+                          entry->name, entry->wall / 1000, entry->cpu / 1000);
+        }
+        g_ptr_array_free (slow_repos, TRUE);
+    }
+
+    pthread_mutex_unlock (&profile_lock);
+}
+
+static json_t *
+entries_to_json (GPtrArray *entries, const char *name_key)
+{
+    json_t *array = json_array ();
+    json_t *object;
+    ProfileEntry *entry;
+    guint i;
+
+    for (i = 0; entries && i < entries->len; ++i) {
+        entry = g_ptr_array_index (entries, i);
+        object = json_object ();
+        json_object_set_new (object, name_key, json_string (entry->name));
+        json_object_set_new (object, "wall_ms", json_integer (entry->wall / 1000));
+        json_object_set_new (object, "cpu_ms", json_integer (entry->cpu / 1000));
+        json_array_append_new (array, object);
+    }
+
+    return array;
+}
+
+json_t *
+startup_profile_to_json ()
+{
+    json_t *object = json_object ();
+
+    pthread_mutex_lock (&profile_lock);
+
+    json_object_set_new (object, "finished", json_boolean (profile_finished));
+    json_object_set_new (object, "total_wall_ms", json_integer (total_wall / 1000));
+    json_object_set_new (object, "total_cpu_ms", json_integer (total_cpu / 1000));
+    json_object_set_new (object, "phases", entries_to_json (phases, "name"));
+    json_object_set_new (object, "repos", entries_to_json (repos, "repo_id"));
+
+    pthread_mutex_unlock (&profile_lock);
+
+    return object;
+}
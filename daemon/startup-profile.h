@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_STARTUP_PROFILE_H
+#define SEAF_STARTUP_PROFILE_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Wall and CPU time of the daemon's startup phases and of loading each
+ * repo. A phase is timed by starting a StartupTimer before it and adding
+ * the phase when it's done. When startup is finished, a summary is written
+ * to the log. The profile can also be read with seafile_get_startup_profile().
+ *
+ * Phases that first run after startup, such as loading certificates for
+ * the first connection, may still be added. They are logged one by one.
+ */
+
+typedef struct StartupTimer {
+    gint64 wall;
+    gint64 cpu;
+    gboolean thread_cpu;
+} StartupTimer;
+
+/*
+ * If @thread_cpu is TRUE, the CPU time of the calling thread is measured,
+ * otherwise the CPU time of the process. Use thread CPU time for work that
+ * runs in parallel with other work.
+ */
+void
+startup_timer_start (StartupTimer *timer, gboolean thread_cpu);
+
+void
+startup_profile_add_phase (const char *name, StartupTimer *timer);
+
+void
+startup_profile_add_repo (const char *repo_id, StartupTimer *timer);
+
+/* Mark startup as finished and write the summary to the log. */
+void
+startup_profile_finish ();
+
+json_t *
+startup_profile_to_json ();
+
+#endif
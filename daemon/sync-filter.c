@@ -0,0 +1,164 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <jansson.h>
+
+#include "sync-filter.h"
+#include "log.h"
+
+struct _SyncFilter {
+    gint ref;
+    /* Paths without leading or trailing slash. */
+    GPtrArray *includes;
+    GPtrArray *excludes;
+};
+
+static int
+load_paths (json_t *object, const char *key, GPtrArray *paths)
+{
+    json_t *array, *item;
+    size_t i;
+    const char *str;
+    char *path;
+
+    array = json_object_get (object, key);
+    if (!array)
+        return 0;
+    if (!json_is_array (array))
+        return -1;
+
+    json_array_foreach (array, i, item) {
+        str = json_string_value (item);
+        if (!str)
+            return -1;
+        while (*str == '/')
+            ++str;
+        path = g_strdup (str);
+        while (*path && path[strlen(path)-1] == '/')
+            path[strlen(path)-1] = '\0';
+        if (*path == '\0' || !g_utf8_validate (path, -1, NULL)) {
+            g_free (path);
+            return -1;
+        }
+        g_ptr_array_add (paths, path);
+    }
+
+    return 0;
+}
+
+SyncFilter *
+sync_filter_new (const char *json)
+{
+    json_t *object;
+    json_error_t jerror;
+    SyncFilter *filter;
+
+    if (!json || *json == '\0')
+        return NULL;
+
+    object = json_loads (json, 0, &jerror);
+    if (!object || !json_is_object (object)) {
+        seaf_warning ("Invalid sync filter %s.\n", json);
+        json_decref (object);
+        return NULL;
+    }
+
+    filter = g_new0 (SyncFilter, 1);
+    filter->ref = 1;
+    filter->includes = g_ptr_array_new_with_free_func (g_free);
+    filter->excludes = g_ptr_array_new_with_free_func (g_free);
+
+    if (load_paths (object, "include", filter->includes) < 0 ||
+        load_paths (object, "exclude", filter->excludes) < 0) {
+        seaf_warning ("Invalid sync filter %s.\n", json);
+        json_decref (object);
+        sync_filter_unref (filter);
+        return NULL;
+    }
+    json_decref (object);
+
+    if (filter->includes->len == 0 && filter->excludes->len == 0) {
+        sync_filter_unref (filter);
+        return NULL;
+    }
+
+    return filter;
+}
+
+SyncFilter *
+sync_filter_ref (SyncFilter *filter)
+{
+    if (filter)
+        g_atomic_int_inc (&filter->ref);
+    return filter;
+}
+
+void
+sync_filter_unref (SyncFilter *filter)
+{
+    if (!filter || !g_atomic_int_dec_and_test (&filter->ref))
+        return;
+
+    g_ptr_array_free (filter->includes, TRUE);
+    g_ptr_array_free (filter->excludes, TRUE);
+    g_free (filter);
+}
+
+/* TRUE if @path is @prefix or under it. */
+static gboolean
+is_under (const char *path, const char *prefix)
+{
+    size_t len = strlen (prefix);
+
+    return (strncmp (path, prefix, len) == 0 &&
+            (path[len] == '\0' || path[len] == '/'));
+}
+
+int
+sync_filter_check (SyncFilter *filter, const char *path)
+{
+    guint i;
+    const char *include;
+
+    if (!filter)
+        return SYNC_FILTER_INCLUDED;
+
+    while (*path == '/')
+        ++path;
+
+    for (i = 0; i < filter->excludes->len; ++i) {
+        if (is_under (path, g_ptr_array_index (filter->excludes, i)))
+            return SYNC_FILTER_EXCLUDED;
+    }
+
+    if (filter->includes->len == 0)
+        return SYNC_FILTER_INCLUDED;
+
+    for (i = 0; i < filter->includes->len; ++i) {
+        if (is_under (path, g_ptr_array_index (filter->includes, i)))
+            return SYNC_FILTER_INCLUDED;
+    }
+
+    for (i = 0; i < filter->includes->len; ++i) {
+        include = g_ptr_array_index (filter->includes, i);
+        if (*path == '\0' || is_under (include, path))
+            return SYNC_FILTER_PARTIAL;
+    }
+
+    return SYNC_FILTER_EXCLUDED;
+}
+
+gboolean
+sync_filter_is_synced (SyncFilter *filter, const char *path, gboolean is_dir)
+{
+    int ret;
+
+    if (!filter)
+        return TRUE;
+
+    ret = sync_filter_check (filter, path);
+    if (is_dir)
+        return ret != SYNC_FILTER_EXCLUDED;
+    return ret == SYNC_FILTER_INCLUDED;
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_SYNC_FILTER_H
+#define SEAF_SYNC_FILTER_H
+
+#include <glib.h>
+
+/*
+ * Selective sync of the subfolders of a library.
+ *
+ * A filter is set on a repo as a JSON object with two lists of paths
+ * relative to the library root:
+ *
+ *   {"include": ["docs", "src/lib"], "exclude": ["docs/old"]}
+ *
+ * A path is synced if it's in or under one of the "include" paths (or if
+ * "include" is empty), and not in or under one of the "exclude" paths.
+ * The parents of the included paths are only synced as far as needed to
+ * reach them; their other files and subfolders are left out.
+ */
+
+enum {
+    SYNC_FILTER_EXCLUDED = 0,
+    SYNC_FILTER_INCLUDED,
+    /* A parent dir of an included path. */
+    SYNC_FILTER_PARTIAL,
+};
+
+typedef struct _SyncFilter SyncFilter;
+
+/* Returns NULL if @json is not a valid filter or doesn't filter anything. */
+SyncFilter *
+sync_filter_new (const char *json);
+
+SyncFilter *
+sync_filter_ref (SyncFilter *filter);
+
+void
+sync_filter_unref (SyncFilter *filter);
+
+/* @path has no leading slash. "" is the library root. */
+int
+sync_filter_check (SyncFilter *filter, const char *path);
+
+/*
+ * TRUE if @path should be synced. A dir is synced if it's included or
+ * on the way to an included path. A NULL filter includes everything.
+ */
+gboolean
+sync_filter_is_synced (SyncFilter *filter, const char *path, gboolean is_dir);
+
+#endif
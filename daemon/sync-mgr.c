@@ -25,13 +25,15 @@
 #include "log.h"
 
 #include "timer.h"
+#include "latency-stats.h"
+#include "mem-budget.h"
 
 #define DEFAULT_SYNC_INTERVAL 30 /* 30s */
 #define CHECK_SYNC_INTERVAL  1000 /* 1s */
 #define UPDATE_TX_STATE_INTERVAL 1000 /* 1s */
-#define MAX_RUNNING_SYNC_TASKS 5
 #define CHECK_LOCKED_FILES_INTERVAL 10 /* 10s */
 #define CHECK_FOLDER_PERMS_INTERVAL 30 /* 30s */
+#define CHECK_IDLE_REPO_INTERVAL 10 /* 10s */
 #define JWT_TOKEN_EXPIRE_TIME 3*24*3600 /* 3 days */
 
 #define SYNC_PERM_ERROR_RETRY_TIME 2
@@ -69,6 +71,13 @@ struct _HttpServerState {
     pthread_mutex_t head_commit_map_lock;
     gboolean head_commit_map_init;
     gint64 last_update_head_commit_map_time;
+    /*
+     * Repos subscribed to the notification server whose head was fetched
+     * after the subscription. Their entries in head_commit_map are kept up
+     * to date by pushed events, so they're no longer polled.
+     * Protected by head_commit_map_lock.
+     */
+    GHashTable *pushed_repos;
 
     gint64 n_jwt_token_request;
 };
@@ -81,13 +90,23 @@ typedef struct DelConfirmationResult {
 struct _SeafSyncManagerPriv {
     struct SeafTimer *check_sync_timer;
     struct SeafTimer *update_tx_state_timer;
+    /* Last published transfer state, only changes are published. */
+    char  *last_tx_state;
+    /* Sync state messages not published yet, repo_id -> message. Only the
+     * last state of a repo is published, see publish_sync_state(). */
+    GHashTable *pending_sync_states;
     int    pulse_count;
 
     /* When FALSE, auto sync is globally disabled */
     gboolean   auto_sync_enabled;
 
+    /* The hash is protected by paths_lock, the content of each repo's
+     * ActivePathsInfo by its own lock. Path status queries only take read
+     * locks, so they don't wait for each other.
+     */
     GHashTable *active_paths;
-    pthread_mutex_t paths_lock;
+    pthread_rwlock_t paths_lock;
+    gint status_seq;
 
 #ifdef WIN32
     GAsyncQueue *refresh_paths;
@@ -99,6 +118,7 @@ struct _SeafSyncManagerPriv {
 };
 
 struct _ActivePathsInfo {
+    pthread_rwlock_t lock;
     GHashTable *paths;
     struct SyncStatusTree *syncing_tree;
     struct SyncStatusTree *synced_tree;
@@ -128,11 +148,22 @@ check_http_protocol (SeafSyncManager *mgr, SeafRepo *repo);
 static void
 active_paths_info_free (ActivePathsInfo *info);
 
+static gboolean
+is_repo_subscribed (SeafRepo *repo)
+{
+#if defined WIN32 || defined __APPLE__ || defined COMPILE_LINUX_WS
+    return seaf_notif_manager_is_repo_subscribed (seaf->notif_mgr, repo);
+#else
+    return FALSE;
+#endif
+}
+
 static HttpServerState *
 http_server_state_new ()
 {
     HttpServerState *state = g_new0 (HttpServerState, 1);
     state->head_commit_map = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    state->pushed_repos = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
     pthread_mutex_init (&state->head_commit_map_lock, NULL);
     return state;
 }
@@ -143,6 +174,7 @@ http_server_state_free (HttpServerState *state)
     if (!state)
         return;
     g_hash_table_destroy (state->head_commit_map);
+    g_hash_table_destroy (state->pushed_repos);
     pthread_mutex_destroy (&state->head_commit_map_lock);
     g_free (state);
 }
@@ -158,6 +190,16 @@ seaf_sync_manager_new (SeafileSession *seaf)
     mgr->sync_interval = DEFAULT_SYNC_INTERVAL;
     mgr->sync_infos = g_hash_table_new (g_str_hash, g_str_equal);
 
+    mgr->max_running_tasks = seafile_session_config_get_int (seaf,
+                                                             KEY_MAX_SYNC_TASKS,
+                                                             NULL);
+    if (mgr->max_running_tasks <= 0)
+        mgr->max_running_tasks = DEFAULT_MAX_RUNNING_SYNC_TASKS;
+
+    mem_budget_set_limit ((gint64)seafile_session_config_get_int (seaf,
+                                                                  KEY_MEMORY_BUDGET,
+                                                                  NULL) << 20);
+
     mgr->http_server_states = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                      g_free,
                                                      (GDestroyNotify)http_server_state_free);
@@ -178,7 +220,11 @@ seaf_sync_manager_new (SeafileSession *seaf)
     mgr->priv->active_paths = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                      g_free,
                                                      (GDestroyNotify)active_paths_info_free);
-    pthread_mutex_init (&mgr->priv->paths_lock, NULL);
+    pthread_rwlock_init (&mgr->priv->paths_lock, NULL);
+    mgr->priv->status_seq = 1;
+    mgr->priv->pending_sync_states = g_hash_table_new_full (g_str_hash,
+                                                            g_str_equal,
+                                                            g_free, g_free);
 
 #ifdef WIN32
     mgr->priv->refresh_paths = g_async_queue_new ();
@@ -248,6 +294,20 @@ format_http_task_detail (HttpTxTask *task, GString *buf)
     g_string_append_printf (buf, "%s\t%d %s\n", type, rate, repo_name);
 }
 
+static void
+flush_sync_states (SeafSyncManager *mgr)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init (&iter, mgr->priv->pending_sync_states);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        seaf_mq_manager_publish_notification (seaf->mq_mgr, "sync.state",
+                                              value);
+        g_hash_table_iter_remove (&iter);
+    }
+}
+
 /*
  * Publish a notification message to report :
  *
@@ -265,6 +325,8 @@ update_tx_state (void *vmanager)
     g_atomic_int_set (&mgr->sent_bytes, 0);
     mgr->last_recv_bytes = g_atomic_int_get (&mgr->recv_bytes);
     g_atomic_int_set (&mgr->recv_bytes, 0);
+    mgr->total_sent_bytes += mgr->last_sent_bytes;
+    mgr->total_recv_bytes += mgr->last_recv_bytes;
 
     tasks = http_tx_manager_get_upload_tasks (seaf->http_tx_mgr);
     for (ptr = tasks; ptr; ptr = ptr->next) {
@@ -280,12 +342,19 @@ update_tx_state (void *vmanager)
     }
     g_list_free (tasks);
 
-    if (buf->len != 0)
+    /* An empty message tells that all transfers are finished. */
+    if (g_strcmp0 (buf->str, mgr->priv->last_tx_state ?
+                   mgr->priv->last_tx_state : "") != 0) {
         seaf_mq_manager_publish_notification (seaf->mq_mgr, "transfer",
                                               buf->str);
+        g_free (mgr->priv->last_tx_state);
+        mgr->priv->last_tx_state = g_strdup (buf->str);
+    }
 
     g_string_free (buf, TRUE);
 
+    flush_sync_states (mgr);
+
     return TRUE;
 }
 
@@ -328,10 +397,11 @@ seaf_sync_manager_start (SeafSyncManager *mgr)
                       (GCallback)on_repo_http_uploaded, mgr);
 
 #ifdef WIN32
-    seaf_job_manager_schedule_job (seaf->job_mgr,
-                                   refresh_windows_explorer_thread,
-                                   NULL,
-                                   mgr->priv->refresh_paths);
+    seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                 JOB_PRIORITY_INTERACTIVE,
+                                                 refresh_windows_explorer_thread,
+                                                 NULL,
+                                                 mgr->priv->refresh_paths);
 
     mgr->priv->refresh_windows_timer = seaf_timer_new (
         refresh_all_windows_on_startup, mgr, STARTUP_REFRESH_WINDOWS_DELAY);
@@ -423,6 +493,7 @@ seaf_sync_manager_cancel_sync_task (SeafSyncManager *mgr,
             info->err_cnt = 0;
             info->in_error = FALSE;
             info->sync_perm_err_cnt = 0;
+            info->next_check = 0;
         }
         return;
     }
@@ -563,6 +634,30 @@ update_sync_info_error_state (SyncTask *task, int new_state)
 }
 
 static void commit_repo (SyncTask *task);
+static void start_lookahead_commit (SyncTask *task);
+static void handle_upload_result (SyncTask *task, int tx_state, int tx_error,
+                                  const char *head);
+
+/*
+ * Publish a notification message on sync state changes:
+ *
+ *      [repo-id]\t[state]\t[error]
+ *
+ * Messages share the notification queue with the other notifications, so
+ * they're published with the transfer state, every
+ * UPDATE_TX_STATE_INTERVAL. Only the last state of each repo is sent.
+ */
+static void
+publish_sync_state (SyncTask *task)
+{
+    char *msg;
+
+    msg = g_strdup_printf ("%s\t%s\t%s", task->repo->id,
+                           sync_state_str[task->state],
+                           sync_error_id_to_str (task->error));
+    g_hash_table_replace (task->mgr->priv->pending_sync_states,
+                          g_strdup (task->repo->id), msg);
+}
 
 static void
 transition_sync_state (SyncTask *task, int new_state)
@@ -572,6 +667,8 @@ transition_sync_state (SyncTask *task, int new_state)
     SyncInfo *info = task->info;
 
     if (task->state != new_state) {
+        seaf_sync_manager_bump_status_seq (seaf->sync_mgr);
+
         if (((task->state == SYNC_STATE_INIT && task->uploaded) ||
              task->state == SYNC_STATE_FETCH) &&
             new_state == SYNC_STATE_DONE &&
@@ -612,6 +709,7 @@ transition_sync_state (SyncTask *task, int new_state)
             new_state == SYNC_STATE_CANCELED ||
             new_state == SYNC_STATE_ERROR) {
             info->in_sync = FALSE;
+            info->next_check = 0;
             --(task->mgr->n_running_tasks);
             update_sync_info_error_state (task, new_state);
 
@@ -624,6 +722,8 @@ transition_sync_state (SyncTask *task, int new_state)
             }
         }
 
+        publish_sync_state (task);
+
 #ifdef WIN32
         seaf_sync_manager_add_refresh_path (seaf->sync_mgr, task->repo->worktree);
 #endif
@@ -650,6 +750,8 @@ set_task_error (SyncTask *task, int error)
         --(task->mgr->n_running_tasks);
         update_sync_info_error_state (task, SYNC_STATE_ERROR);
 
+        publish_sync_state (task);
+
         /* For repo-level errors, only need to record in database, but not send notifications.
          * File-level errors are recorded and notified in the location they happens, not here.
          */
@@ -702,9 +804,12 @@ start_upload_if_necessary (SyncTask *task)
         set_task_error (task, SYNC_ERROR_ID_NOT_ENOUGH_MEMORY);
         return;
     }
+    g_free (task->tx_id);
     task->tx_id = g_strdup(repo->id);
 
     transition_sync_state (task, SYNC_STATE_UPLOAD);
+
+    start_lookahead_commit (task);
 }
 
 static void
@@ -796,6 +901,8 @@ load_locked_files_blocks (const char *repo_id)
     return block_id_hash;
 }
 
+#endif
+
 static gboolean
 remove_block_cb (const char *store_id,
                  int version,
@@ -810,33 +917,104 @@ remove_block_cb (const char *store_id,
     return TRUE;
 }
 
-#endif
+static void
+restore_kept_block (const char *from_dir, const char *to_dir,
+                    const char *block_id)
+{
+    char prefix[3];
+    char *src, *dst_dir, *dst;
+
+    memcpy (prefix, block_id, 2);
+    prefix[2] = 0;
+
+    src = g_build_filename (from_dir, prefix, block_id + 2, NULL);
+    dst_dir = g_build_filename (to_dir, prefix, NULL);
+    dst = g_build_filename (dst_dir, block_id + 2, NULL);
+
+    if (g_file_test (src, G_FILE_TEST_EXISTS) &&
+        (checkdir_with_mkdir (dst_dir) < 0 || g_rename (src, dst) < 0))
+        seaf_warning ("Failed to keep block %s: %s.\n", dst, strerror(errno));
+
+    g_free (src);
+    g_free (dst_dir);
+    g_free (dst);
+}
+
+/*
+ * Removing a large block store one file at a time can take hours. Instead,
+ * the loose block store of the repo is moved into "deleted_store", which is
+ * emptied by the throttled cleanup thread of the repo manager. The blocks
+ * in @keep are moved back first, so the work done here only depends on
+ * the number of kept blocks.
+ */
+static int
+move_block_store_aside (const char *repo_id, GHashTable *keep)
+{
+    char *store_dir, *staging_dir;
+    GHashTableIter iter;
+    gpointer key, value;
+    int ret = 0;
+
+    store_dir = g_build_filename (seaf->seaf_dir, "storage", "blocks",
+                                  repo_id, NULL);
+    staging_dir = g_strconcat (store_dir, ".removing", NULL);
+
+    if (!g_file_test (store_dir, G_FILE_TEST_IS_DIR))
+        goto out;
+
+    /* Left over from an interrupted removal. */
+    seaf_repo_manager_move_to_deleted_store (seaf->repo_mgr, "blocks",
+                                             repo_id, staging_dir);
+
+    if (g_rename (store_dir, staging_dir) < 0) {
+        seaf_warning ("Failed to move block store %s: %s.\n",
+                      store_dir, strerror(errno));
+        ret = -1;
+        goto out;
+    }
+
+    if (keep) {
+        g_hash_table_iter_init (&iter, keep);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            restore_kept_block (staging_dir, store_dir, key);
+    }
+
+    /* If this fails, the staging dir is picked up as an unused store on
+     * the next start. */
+    seaf_repo_manager_move_to_deleted_store (seaf->repo_mgr, "blocks",
+                                             repo_id, staging_dir);
+
+out:
+    g_free (store_dir);
+    g_free (staging_dir);
+    return ret;
+}
 
 static void *
 remove_repo_blocks (void *vtask)
 {
     SyncTask *task = vtask;
+    GHashTable *block_hash = NULL;
 
 #if defined WIN32 || defined __APPLE__
-    GHashTable *block_hash;
-
     block_hash = load_locked_files_blocks (task->repo->id);
-    if (g_hash_table_size (block_hash) == 0) {
-        g_hash_table_destroy (block_hash);
-        seaf_block_manager_remove_store (seaf->block_mgr, task->repo->id);
-        return vtask;
-    }
+#endif
 
-    seaf_block_manager_foreach_block (seaf->block_mgr,
-                                      task->repo->id,
-                                      task->repo->version,
-                                      remove_block_cb,
-                                      block_hash);
+    /* What is left afterwards is only the kept blocks and the blocks in
+     * packs, unless the store couldn't be moved. */
+    move_block_store_aside (task->repo->id, block_hash);
 
-    g_hash_table_destroy (block_hash);
-#else
-    seaf_block_manager_remove_store (seaf->block_mgr, task->repo->id);
-#endif
+    if (!block_hash || g_hash_table_size (block_hash) == 0)
+        seaf_block_manager_remove_store (seaf->block_mgr, task->repo->id);
+    else
+        seaf_block_manager_foreach_block (seaf->block_mgr,
+                                          task->repo->id,
+                                          task->repo->version,
+                                          remove_block_cb,
+                                          block_hash);
+
+    if (block_hash)
+        g_hash_table_destroy (block_hash);
 
     return vtask;
 }
@@ -897,18 +1075,24 @@ update_sync_status_v2 (SyncTask *task)
     } else if (info->deleted_on_relay) {
         on_repo_deleted_on_server (task, repo);
     } else {
-        /* If local head is the same as remote head, already in sync. */
-        if (strcmp (local->commit_id, info->head_commit) == 0) {
+        /* If local head is the same as remote head, already in sync.
+         * A new sync filter still needs a download to check out the
+         * newly included paths. */
+        if (strcmp (local->commit_id, info->head_commit) == 0 &&
+            repo->sync_filter_changed && !seaf->upload_only) {
+            start_fetch_if_necessary (task, info->head_commit);
+        } else if (strcmp (local->commit_id, info->head_commit) == 0) {
             /* As long as the repo is synced with the server. All the local
              * blocks are not useful any more.
              */
             if (repo_block_store_exists (repo)) {
                 seaf_message ("Removing blocks for repo %s(%.8s).\n",
                               repo->name, repo->id);
-                seaf_job_manager_schedule_job (seaf->job_mgr,
-                                               remove_repo_blocks,
-                                               remove_blocks_done,
-                                               task);
+                seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                             JOB_PRIORITY_BULK,
+                                                             remove_repo_blocks,
+                                                             remove_blocks_done,
+                                                             task);
             } else
                 transition_sync_state (task, SYNC_STATE_DONE);
         } else {
@@ -935,6 +1119,8 @@ check_head_commit_done (HttpHeadCommit *result, void *user_data)
         return;
     }
 
+    latency_stats_record_since ("sync.check_head", task->check_head_start);
+
     info->deleted_on_relay = result->is_deleted;
     info->repo_corrupted = result->is_corrupt;
     memcpy (info->head_commit, result->head_commit, 40);
@@ -947,6 +1133,7 @@ check_head_commit_http (SyncTask *task)
 {
     SeafRepo *repo = task->repo;
 
+    task->check_head_start = g_get_monotonic_time ();
     int ret = http_tx_manager_check_head_commit (seaf->http_tx_mgr,
                                                  repo->id, repo->version,
                                                  repo->effective_host,
@@ -968,6 +1155,106 @@ struct CommitResult {
     gboolean success;
 };
 
+/*
+ * Stream-through upload.
+ *
+ * Normally every new block is written to the local block store while a
+ * commit is created, and read back by the upload task. When streaming is
+ * on, the chunking workers also PUT new blocks to the server directly, so
+ * the upload task, which asks the server which blocks it needs, doesn't
+ * read and send them again. After the first failure the rest of the
+ * commit isn't streamed.
+ *
+ * The streamed blocks are still stored locally. Until the commit is
+ * uploaded, nothing on the server references them and they may be
+ * garbage collected there, or the upload may fail for good. The local
+ * copies are removed with the rest of the block store once the repo is
+ * in sync, see update_sync_status_v2().
+ */
+typedef struct BlockStream {
+    char *host;
+    char *token;
+    gboolean use_fileserver_port;
+    gint failed;
+} BlockStream;
+
+static int
+stream_block_to_server (const char *repo_id, int version,
+                        const char *block_id, const char *buf, int len,
+                        void *user_data)
+{
+    BlockStream *stream = user_data;
+
+    if (g_atomic_int_get (&stream->failed))
+        return -1;
+
+    if (http_tx_manager_put_block (seaf->http_tx_mgr,
+                                   stream->host,
+                                   stream->use_fileserver_port,
+                                   stream->token,
+                                   repo_id, block_id, buf, len) < 0) {
+        seaf_message ("Failed to stream block %s of repo %.8s, "
+                      "the upload task will send the new blocks.\n",
+                      block_id, repo_id);
+        g_atomic_int_set (&stream->failed, 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+static BlockStream *
+begin_block_stream (SeafRepo *repo)
+{
+    BlockStream *stream;
+
+    if (!repo->effective_host || !repo->token)
+        return NULL;
+
+    if (!seaf->upload_only &&
+        !seafile_session_config_get_bool (seaf, KEY_STREAM_UPLOAD))
+        return NULL;
+
+    stream = g_new0 (BlockStream, 1);
+    stream->host = g_strdup (repo->effective_host);
+    stream->token = g_strdup (repo->token);
+    stream->use_fileserver_port = repo->use_fileserver_port;
+
+    seaf_fs_manager_set_block_sink (seaf->fs_mgr, repo->id,
+                                    stream_block_to_server, stream);
+    return stream;
+}
+
+static void
+end_block_stream (SeafRepo *repo, BlockStream *stream)
+{
+    if (!stream)
+        return;
+
+    seaf_fs_manager_set_block_sink (seaf->fs_mgr, repo->id, NULL, NULL);
+    g_free (stream->host);
+    g_free (stream->token);
+    g_free (stream);
+}
+
+/* Indexing has finished when seaf_repo_index_commit() returns, so no
+ * block of the repo is being written when the stream is ended.
+ */
+static char *
+index_commit (SeafRepo *repo, gboolean is_manual_sync,
+              gboolean is_initial_commit, GError **error)
+{
+    BlockStream *stream;
+    char *commit_id;
+
+    stream = begin_block_stream (repo);
+    commit_id = seaf_repo_index_commit (repo, is_manual_sync,
+                                        is_initial_commit, error);
+    end_block_stream (repo, stream);
+
+    return commit_id;
+}
+
 static void *
 commit_job (void *vtask)
 {
@@ -984,16 +1271,20 @@ commit_job (void *vtask)
     res->changed = TRUE;
     res->success = TRUE;
 
-    char *commit_id = seaf_repo_index_commit (repo,
-                                              task->is_manual_sync,
-                                              task->is_initial_commit,
-                                              &error);
+    gint64 start = g_get_monotonic_time ();
+    char *commit_id = index_commit (repo,
+                                    task->is_manual_sync,
+                                    task->is_initial_commit,
+                                    &error);
     if (commit_id == NULL && error != NULL) {
         seaf_warning ("[Sync mgr] Failed to commit to repo %s(%.8s).\n",
                       repo->name, repo->id);
         res->success = FALSE;
     } else if (commit_id == NULL) {
         res->changed = FALSE;
+        latency_stats_record_since ("sync.commit_unchanged", start);
+    } else {
+        latency_stats_record_since ("sync.commit", start);
     }
     g_free (commit_id);
 
@@ -1005,6 +1296,25 @@ exceed_max_deleted_files (SeafRepo *repo);
 static void
 notify_delete_confirmation (const char *repo_name, const char *desc, const char *confirmation_id);
 
+/* Upload the commit just created, unless it deletes too many files. */
+static void
+upload_new_commit (SyncTask *task)
+{
+    SeafRepo *repo = task->repo;
+    char *desc = NULL;
+
+    desc = exceed_max_deleted_files (repo);
+    if (desc) {
+        notify_delete_confirmation (repo->name, desc, repo->head->commit_id);
+        seaf_warning ("Delete more than %d files, add delete confirmation.\n", seaf->delete_confirm_threshold);
+        task->info->del_confirmation_pending = TRUE;
+        set_task_error (task, SYNC_ERROR_ID_DEL_CONFIRMATION_PENDING);
+        g_free (desc);
+        return;
+    }
+    start_upload_if_necessary (task);
+}
+
 static void
 commit_job_done (void *vres)
 {
@@ -1033,20 +1343,8 @@ commit_job_done (void *vres)
         return;
     }
 
-    if (res->changed) {
-        char *desc = NULL;
-        desc = exceed_max_deleted_files (repo);
-        if (desc) {
-            notify_delete_confirmation (repo->name, desc, repo->head->commit_id);
-            seaf_warning ("Delete more than %d files, add delete confirmation.\n", seaf->delete_confirm_threshold);
-            task->info->del_confirmation_pending = TRUE;
-            set_task_error (res->task, SYNC_ERROR_ID_DEL_CONFIRMATION_PENDING);
-            g_free (desc);
-            g_free (res);
-            return;
-        }
-        start_upload_if_necessary (res->task);
-    }
+    if (res->changed)
+        upload_new_commit (task);
     else if (task->is_manual_sync || task->is_initial_commit)
         check_head_commit_http (task);
     else
@@ -1093,6 +1391,116 @@ check_commit_state (void *data)
     return 1;
 }
 
+/*
+ * Pipelined partial commits.
+ *
+ * A large import is committed in batches of MAX_COMMIT_SIZE. Normally a
+ * batch is only indexed after the previous one has been uploaded, so disk,
+ * CPU and network take turns. When KEY_PIPELINE_PARTIAL_COMMITS is set,
+ * the next batch is indexed and committed while the previous commit is
+ * uploaded. The upload task took its head commit when it was added, so
+ * moving the local branch meanwhile doesn't affect it. When the upload
+ * finishes, the new commit is uploaded right away, its parent being the
+ * commit the server just accepted.
+ */
+static gboolean
+need_lookahead_commit (SyncTask *task)
+{
+    WTStatus *status;
+    gboolean ret = FALSE;
+
+    /* Only one commit job runs at a time. If another repo is committing,
+     * just fall back to committing after the upload.
+     */
+    if (task->mgr->commit_job_running)
+        return FALSE;
+
+    if (!seafile_session_config_get_bool (seaf, KEY_PIPELINE_PARTIAL_COMMITS))
+        return FALSE;
+
+    status = seaf_wt_monitor_get_worktree_status (seaf->wt_monitor,
+                                                  task->repo->id);
+    if (status) {
+        ret = status->partial_commit;
+        wt_status_unref (status);
+    }
+
+    return ret;
+}
+
+static void *
+lookahead_commit_job (void *vtask)
+{
+    SyncTask *task = vtask;
+    SeafRepo *repo = task->repo;
+    struct CommitResult *res = g_new0 (struct CommitResult, 1);
+    GError *error = NULL;
+    char *commit_id;
+
+    res->task = task;
+    res->success = TRUE;
+
+    if (repo->delete_pending)
+        return res;
+
+    gint64 start = g_get_monotonic_time ();
+    commit_id = index_commit (repo, FALSE, FALSE, &error);
+    if (commit_id == NULL && error != NULL) {
+        seaf_warning ("[Sync mgr] Failed to commit to repo %s(%.8s).\n",
+                      repo->name, repo->id);
+        res->success = FALSE;
+        g_clear_error (&error);
+    } else if (commit_id != NULL) {
+        res->changed = TRUE;
+        latency_stats_record_since ("sync.commit", start);
+    }
+    g_free (commit_id);
+
+    return res;
+}
+
+static void
+lookahead_commit_done (void *vres)
+{
+    struct CommitResult *res = vres;
+    SyncTask *task = res->task;
+
+    task->mgr->commit_job_running = FALSE;
+    task->lookahead_running = FALSE;
+
+    if (!res->success)
+        task->lookahead_failed = TRUE;
+    else if (res->changed)
+        task->lookahead_ready = TRUE;
+    g_free (res);
+
+    if (task->upload_deferred) {
+        task->upload_deferred = FALSE;
+        handle_upload_result (task,
+                              task->deferred_tx_state,
+                              task->deferred_tx_error,
+                              task->deferred_head);
+    }
+}
+
+static void
+start_lookahead_commit (SyncTask *task)
+{
+    if (!need_lookahead_commit (task))
+        return;
+
+    task->mgr->commit_job_running = TRUE;
+    task->lookahead_running = TRUE;
+
+    if (seaf_job_manager_schedule_job (seaf->job_mgr,
+                                       lookahead_commit_job,
+                                       lookahead_commit_done,
+                                       task) < 0) {
+        task->mgr->commit_job_running = FALSE;
+        task->lookahead_running = FALSE;
+    }
+}
+
 static SyncTask *
 create_sync_task_v2 (SeafSyncManager *manager, SeafRepo *repo,
                      gboolean is_manual_sync, gboolean is_initial_commit)
@@ -1112,6 +1520,7 @@ create_sync_task_v2 (SeafSyncManager *manager, SeafRepo *repo,
     task->error = SYNC_ERROR_ID_NO_ERROR;
 
     repo->last_sync_time = time(NULL);
+    seaf_repo_manager_bump_repo_list_seq (seaf->repo_mgr);
     ++(manager->n_running_tasks);
 
     /* Free the last task when a new task is started.
@@ -1148,6 +1557,11 @@ create_commit_from_event_queue (SeafSyncManager *manager, SeafRepo *repo,
     status = seaf_wt_monitor_get_worktree_status (manager->seaf->wt_monitor,
                                                   repo->id);
     if (status) {
+        /* Commit the deferred updates of the files that have settled. */
+        if (wt_status_requeue_settled (status, now,
+                                       manager->seaf->write_settle_time) > 0)
+            g_atomic_int_set (&status->last_changed, now);
+
         last_changed = g_atomic_int_get (&status->last_changed);
         if (status->last_check == 0) {
             /* Force commit and sync after a new repo is added. */
@@ -1179,6 +1593,49 @@ create_commit_from_event_queue (SeafSyncManager *manager, SeafRepo *repo,
     return ret;
 }
 
+/* Transfers that are still running after their sync task has ended,
+ * e.g. while a cancel or an error is being handled. */
+static int
+count_detached_tasks (SeafSyncManager *manager, GList *tasks)
+{
+    GList *ptr;
+    HttpTxTask *task;
+    SyncInfo *info;
+    int n = 0;
+
+    for (ptr = tasks; ptr; ptr = ptr->next) {
+        task = ptr->data;
+        if (task->is_clone || task->runtime_state == HTTP_TASK_RT_STATE_FINISHED)
+            continue;
+        info = seaf_sync_manager_get_sync_info (manager, task->repo_id);
+        if (!info || !info->in_sync)
+            ++n;
+    }
+
+    return n;
+}
+
+/*
+ * A sync task holds a slot from the time it's started until it's DONE,
+ * CANCELED or in ERROR, including while a cancel is pending. A transfer
+ * that outlives its sync task keeps holding the slot until it's gone.
+ */
+static int
+n_occupied_slots (SeafSyncManager *manager)
+{
+    GList *tasks;
+    int n = manager->n_running_tasks;
+
+    tasks = http_tx_manager_get_upload_tasks (seaf->http_tx_mgr);
+    n += count_detached_tasks (manager, tasks);
+    g_list_free (tasks);
+    tasks = http_tx_manager_get_download_tasks (seaf->http_tx_mgr);
+    n += count_detached_tasks (manager, tasks);
+    g_list_free (tasks);
+
+    return n;
+}
+
 static gboolean
 can_schedule_repo (SeafSyncManager *manager, SeafRepo *repo)
 {
@@ -1186,7 +1643,7 @@ can_schedule_repo (SeafSyncManager *manager, SeafRepo *repo)
 
     return ((repo->last_sync_time == 0 ||
              repo->last_sync_time < now - manager->sync_interval) &&
-            manager->n_running_tasks < MAX_RUNNING_SYNC_TASKS);
+            n_occupied_slots (manager) < manager->max_running_tasks);
 }
 
 static gboolean
@@ -1214,7 +1671,9 @@ need_check_on_server (SeafSyncManager *manager, SeafRepo *repo, const char *mast
     }
 
     gint64 now = (gint64)time(NULL);
-    if (now - state->last_update_head_commit_map_time >= HEAD_COMMIT_MAP_TTL) {
+    if (now - state->last_update_head_commit_map_time >= HEAD_COMMIT_MAP_TTL &&
+        !(g_hash_table_lookup (state->pushed_repos, repo->id) &&
+          is_repo_subscribed (repo))) {
         ret = TRUE;
         goto out;
     }
@@ -1245,16 +1704,36 @@ get_basename (char *path)
     return (slash + 1);
 }
 
+typedef struct DeletedFilesData {
+    int n_deleted;
+    char *deleted_file;
+} DeletedFilesData;
+
+static int
+count_deleted_file (DiffEntry *de, void *vdata)
+{
+    DeletedFilesData *data = vdata;
+
+    if (de->status == DIFF_STATUS_DELETED) {
+        if (data->n_deleted == 0)
+            data->deleted_file = g_strdup (get_basename(de->name));
+        data->n_deleted++;
+    }
+
+    return 0;
+}
+
 static char *
 exceed_max_deleted_files (SeafRepo *repo)
 {
     SeafBranch *master = NULL, *local = NULL;
     SeafCommit *local_head = NULL, *master_head = NULL;
-    GList *diff_results = NULL;
-    char *deleted_file = NULL;
+    DeletedFilesData data;
     GString *desc = NULL;
     char *ret = NULL;
 
+    memset (&data, 0, sizeof(data));
+
     local = seaf_branch_manager_get_branch (seaf->branch_mgr, repo->id, "local");
     if (!local) {
         seaf_warning ("No local branch found for repo %s(%.8s).\n",
@@ -1283,29 +1762,19 @@ exceed_max_deleted_files (SeafRepo *repo)
         goto out;
     }
 
-    diff_commit_roots (repo->id, repo->version, master_head->root_id, local_head->root_id, &diff_results, FALSE);
-    if (!diff_results) {
+    /* Only deleted files are counted, no need to keep the whole diff. */
+    if (diff_commit_roots_foreach (repo->id, repo->version,
+                                   master_head->root_id, local_head->root_id,
+                                   FALSE, count_deleted_file, &data) < 0) {
+        seaf_warning ("Failed to diff for repo %s.\n", repo->id);
         goto out;
     }
-    GList *p;
-    DiffEntry *de;
-    int n_deleted = 0;
-
-    for (p = diff_results; p != NULL; p = p->next) {
-        de = p->data;
-        switch (de->status) {
-        case DIFF_STATUS_DELETED:
-            if (n_deleted == 0)
-                deleted_file = get_basename(de->name);
-            n_deleted++;
-            break;
-        }
-    }
 
-    if (n_deleted >= seaf->delete_confirm_threshold) {
+    if (data.n_deleted > 0 &&
+        data.n_deleted >= seaf->delete_confirm_threshold) {
         desc = g_string_new ("");
         g_string_append_printf (desc, "Deleted \"%s\" and %d more files.\n",
-                                deleted_file, n_deleted - 1);
+                                data.deleted_file, data.n_deleted - 1);
         ret = g_string_free (desc, FALSE);
     }
 
@@ -1314,7 +1783,7 @@ out:
     seaf_branch_unref (master);
     seaf_commit_unref (local_head);
     seaf_commit_unref (master_head);
-    g_list_free_full (diff_results, (GDestroyNotify)diff_entry_free);
+    g_free (data.deleted_file);
 
     return ret;
 }
@@ -1530,6 +1999,7 @@ sync_repo_v2 (SeafSyncManager *manager, SeafRepo *repo, gboolean is_manual_sync)
         if (!is_manual_sync && !need_check_on_server (manager, repo, master->commit_id)) {
             seaf_debug ("Repo %s is not changed on server %s.\n", repo->name, repo->server_url);
             repo->last_sync_time = time(NULL);
+            seaf_repo_manager_bump_repo_list_seq (seaf->repo_mgr);
             goto out;
         }
 
@@ -1561,19 +2031,33 @@ seaf_sync_manager_update_repo (SeafSyncManager *manager, SeafRepo *repo,
         return;
     }
 
+    /* The cached head of a pushed repo is only updated here, so record it
+     * even if it's already synced.
+     */
+    pthread_mutex_lock (&state->head_commit_map_lock);
+    g_hash_table_replace (state->head_commit_map, g_strdup (repo->id), g_strdup (head_commit));
+    pthread_mutex_unlock (&state->head_commit_map_lock);
+
     if (g_strcmp0(head_commit, master->commit_id) != 0) {
-        pthread_mutex_lock (&state->head_commit_map_lock);
-        g_hash_table_replace (state->head_commit_map, g_strdup (repo->id), g_strdup (head_commit));
-        pthread_mutex_unlock (&state->head_commit_map_lock);
         // Set last_sync_time to 0 to allow the repo to be sync immediately.
         // Otherwise it only gets synced after 30 seconds since the last sync.
         repo->last_sync_time = 0;
+        seaf_sync_manager_wakeup_repo (manager, repo->id);
     }
 
     seaf_branch_unref (master);
     return;
 }
 
+void
+seaf_sync_manager_wakeup_repo (SeafSyncManager *manager, const char *repo_id)
+{
+    SyncInfo *info = g_hash_table_lookup (manager->sync_infos, repo_id);
+
+    if (info)
+        info->next_check = 0;
+}
+
 void
 seaf_sync_manager_check_locks_and_folder_perms (SeafSyncManager *manager, const char *server_url)
 {
@@ -2509,12 +2993,89 @@ check_and_subscribe_repo (SeafSyncManager *mgr, SeafRepo *repo)
 }
 #endif
 
+/*
+ * A repo is only evaluated by the sync pulse when its timer expires or
+ * something happened to it: a worktree change, a notification from the
+ * server, or the end of its last sync task. Evaluating a repo costs
+ * several db lookups and a stat of the worktree, which add up to a
+ * constant load with hundreds of idle repos.
+ */
+static gboolean
+repo_is_ready (SeafSyncManager *manager, SeafRepo *repo, SyncInfo *info,
+               gint64 now)
+{
+    WTStatus *status;
+    gint last_changed;
+
+    if (info->next_check <= now)
+        return TRUE;
+
+    if (repo->sync_interval != 0)
+        return FALSE;
+
+    status = seaf_wt_monitor_get_worktree_status (manager->seaf->wt_monitor,
+                                                  repo->id);
+    if (!status)
+        return FALSE;
+    last_changed = g_atomic_int_get (&status->last_changed);
+    wt_status_unref (status);
+
+    if (last_changed != info->last_wt_change) {
+        info->last_wt_change = last_changed;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Set when the pulse should look at a repo again if nothing happens to it. */
+static void
+schedule_next_check (SeafSyncManager *manager, SeafRepo *repo, SyncInfo *info,
+                     gint64 now)
+{
+    gint64 next = now + CHECK_IDLE_REPO_INTERVAL;
+    gint64 due;
+    WTStatus *status;
+
+    if (repo->sync_interval == 0) {
+        /* Time when can_schedule_repo() is true again. */
+        due = (gint64)repo->last_sync_time + manager->sync_interval + 1;
+
+        /* Changes are committed after the worktree is quiet for 2 seconds,
+         * and partial commits are continued right away.
+         */
+        status = seaf_wt_monitor_get_worktree_status (manager->seaf->wt_monitor,
+                                                      repo->id);
+        if (status) {
+            gint last_changed = g_atomic_int_get (&status->last_changed);
+            info->last_wt_change = last_changed;
+            if (status->partial_commit || status->last_check == 0 ||
+                (last_changed != 0 && status->last_check <= last_changed))
+                due = now + 1;
+            wt_status_unref (status);
+        }
+    } else {
+        due = (gint64)repo->last_sync_time + repo->sync_interval + 1;
+    }
+    next = MIN (next, due);
+
+#if defined WIN32 || defined __APPLE__
+    if (repo->version > 0 && !repo->checking_locked_files)
+        next = MIN (next, repo->last_check_locked_time + CHECK_LOCKED_FILES_INTERVAL);
+#endif
+
+    info->next_check = MAX (next, now + 1);
+}
+
 static int
 auto_sync_pulse (void *vmanager)
 {
     SeafSyncManager *manager = vmanager;
     GList *repos, *ptr;
+    GList *ready = NULL;
     SeafRepo *repo;
+    SyncInfo *info;
+    gint64 now;
 
     repos = seaf_repo_manager_get_repo_list (manager->seaf->repo_mgr, -1, -1);
 
@@ -2522,19 +3083,44 @@ auto_sync_pulse (void *vmanager)
 
     check_server_locked_files (manager, repos);
 
-    /* Sort repos by last_sync_time, so that we don't "starve" any repo. */
-    repos = g_list_sort_with_data (repos, cmp_repos_by_sync_time, NULL);
+#if defined WIN32 || defined __APPLE__ || defined COMPILE_LINUX_WS
+    seaf_notif_manager_apply_repo_updates (seaf->notif_mgr);
+#endif
 
+    if (!manager->priv->auto_sync_enabled) {
+        g_list_free (repos);
+        return TRUE;
+    }
+
+    now = (gint64)time(NULL);
     for (ptr = repos; ptr != NULL; ptr = ptr->next) {
         repo = ptr->data;
-
-        if (!manager->priv->auto_sync_enabled || !repo->auto_sync)
+        if (!repo->auto_sync)
             continue;
+        info = get_sync_info (manager, repo->id);
+        if (!info->in_sync && repo_is_ready (manager, repo, info, now))
+            ready = g_list_prepend (ready, repo);
+    }
+    g_list_free (repos);
 
-        /* Every second, we'll check the worktree to see if it still exists.
+    /* Sort repos by last_sync_time, so that we don't "starve" any repo. */
+    ready = g_list_sort_with_data (ready, cmp_repos_by_sync_time, NULL);
+
+    for (ptr = ready; ptr != NULL; ptr = ptr->next) {
+        repo = ptr->data;
+        info = get_sync_info (manager, repo->id);
+
+        /* Things that only have to be retried are checked again when the
+         * repo's timer expires.
+         */
+        info->next_check = now + CHECK_IDLE_REPO_INTERVAL;
+
+        /* Every time the repo is checked, we'll check the worktree to see if
+         * it still exists. Moving or deleting the worktree produces a
+         * worktree event, otherwise it's noticed when the repo's timer expires.
          * We'll invalidate worktree if it gets moved or deleted.
          * But there is a hole here: If the user delete the worktree dir and
-         * recreate a dir with the same name within a second, we'll falsely
+         * recreate a dir with the same name before it's checked, we'll falsely
          * see the worktree as valid. What's worse, the new worktree dir won't
          * be monitored.
          * This problem can only be solved by restart.
@@ -2558,12 +3144,16 @@ auto_sync_pulse (void *vmanager)
                     // The repo worktree was invalid, but now it's valid again,
                     // so we start watch it
                     seaf_repo_manager_validate_repo_worktree (seaf->repo_mgr, repo);
+                    info->next_check = now + 1;
                     continue;
                 }
             }
         }
 
-        repo->worktree_invalid = FALSE;
+        if (repo->worktree_invalid) {
+            repo->worktree_invalid = FALSE;
+            seaf_repo_manager_bump_repo_list_seq (seaf->repo_mgr);
+        }
 
 #ifdef USE_GPL_CRYPTO
         if (repo->version == 0 || (repo->encrypted && repo->enc_version < 2)) {
@@ -2582,21 +3172,22 @@ auto_sync_pulse (void *vmanager)
         if (!repo->head)
             continue;
 
-        gint64 now = (gint64)time(NULL);
-
 #if defined WIN32 || defined __APPLE__
         if (repo->version > 0) {
-            if (repo->checking_locked_files)
+            if (repo->checking_locked_files) {
+                info->next_check = now + 1;
                 continue;
+            }
 
             if (repo->last_check_locked_time == 0 ||
                 now - repo->last_check_locked_time >= CHECK_LOCKED_FILES_INTERVAL)
             {
                 repo->checking_locked_files = TRUE;
-                if (seaf_job_manager_schedule_job (seaf->job_mgr,
-                                                   check_locked_files,
-                                                   check_locked_files_done,
-                                                   repo) < 0) {
+                if (seaf_job_manager_schedule_job_with_priority (seaf->job_mgr,
+                                                                 JOB_PRIORITY_INTERACTIVE,
+                                                                 check_locked_files,
+                                                                 check_locked_files_done,
+                                                                 repo) < 0) {
                     seaf_warning ("Failed to schedule check local locked files\n");
                     repo->checking_locked_files = FALSE;
                 } else {
@@ -2607,45 +3198,46 @@ auto_sync_pulse (void *vmanager)
         }
 #endif
 
-        SyncInfo *info = get_sync_info (manager, repo->id);
-
-        if (info->in_sync)
-            continue;
-
         if (info->sync_perm_err_cnt > SYNC_PERM_ERROR_RETRY_TIME)
             continue;
 
         if (repo->version > 0) {
             /* For repo version > 0, only use http sync. */
-            if (check_http_protocol (manager, repo)) {
+            if (!check_http_protocol (manager, repo)) {
+                info->next_check = now + 1;
+                continue;
+            }
+
 #if defined WIN32 || defined __APPLE__ || defined COMPILE_LINUX_WS
-                if (check_notif_server (manager, repo)) {
-                    seaf_notif_manager_connect_server (seaf->notif_mgr, repo->server_url, repo->use_fileserver_port);
-                }
+            if (check_notif_server (manager, repo)) {
+                seaf_notif_manager_connect_server (seaf->notif_mgr, repo->server_url, repo->use_fileserver_port);
+            }
 #endif
 
-                if (repo->sync_interval == 0) {
-                    if (sync_repo_v2 (manager, repo, FALSE) < 0) 
-                        continue;
+            if (repo->sync_interval == 0) {
+                if (sync_repo_v2 (manager, repo, FALSE) < 0) 
+                    continue;
 #if defined WIN32 || defined __APPLE__ || defined COMPILE_LINUX_WS
-                    check_and_subscribe_repo (manager, repo);
+                check_and_subscribe_repo (manager, repo);
 #endif
-                }
-                else if (periodic_sync_due (repo)) {
-                    if (sync_repo_v2 (manager, repo, TRUE) < 0)
-                        continue;
+            }
+            else if (periodic_sync_due (repo)) {
+                if (sync_repo_v2 (manager, repo, TRUE) < 0)
+                    continue;
 #if defined WIN32 || defined __APPLE__ || defined COMPILE_LINUX_WS
-                    check_and_subscribe_repo (manager, repo);
+                check_and_subscribe_repo (manager, repo);
 #endif
-                }
             }
+
+            if (!info->in_sync)
+                schedule_next_check (manager, repo, info, now);
         } else {
             seaf_warning ("Repo %s(%s) is version 0 library. Syncing is no longer supported.\n",
                           repo->name, repo->id);
         }
     }
 
-    g_list_free (repos);
+    g_list_free (ready);
     return TRUE;
 }
 
@@ -2682,14 +3274,15 @@ on_repo_http_fetched (SeafileSession *seaf,
 }
 
 static void
-on_repo_http_uploaded (SeafileSession *seaf,
-                       HttpTxTask *tx_task,
-                       SeafSyncManager *manager)
+handle_upload_result (SyncTask *task, int tx_state, int tx_error,
+                      const char *head)
 {
-    SyncInfo *info = get_sync_info (manager, tx_task->repo_id);
-    SyncTask *task = info->current_task;
+    SyncInfo *info = task->info;
+    gboolean lookahead_ready = task->lookahead_ready;
+    gboolean lookahead_failed = task->lookahead_failed;
 
-    g_return_if_fail (task != NULL && info->in_sync);
+    task->lookahead_ready = FALSE;
+    task->lookahead_failed = FALSE;
 
     if (task->repo->delete_pending) {
         transition_sync_state (task, SYNC_STATE_CANCELED);
@@ -2697,27 +3290,58 @@ on_repo_http_uploaded (SeafileSession *seaf,
         return;
     }
 
-    if (tx_task->state == HTTP_TASK_STATE_FINISHED) {
-        memcpy (info->head_commit, tx_task->head, 41);
+    if (tx_state == HTTP_TASK_STATE_FINISHED) {
+        memcpy (info->head_commit, head, 41);
 
-        /* Save current head commit id for GC. */
+        /* Save uploaded head commit id for GC. The local head may already
+         * be ahead of it with pipelined partial commits.
+         */
         seaf_repo_manager_set_repo_property (seaf->repo_mgr,
                                              task->repo->id,
                                              REPO_LOCAL_HEAD,
-                                             task->repo->head->commit_id);
+                                             head);
         task->uploaded = TRUE;
-        check_head_commit_http (task);
-    } else if (tx_task->state == HTTP_TASK_STATE_CANCELED) {
+        if (lookahead_failed)
+            set_task_error (task, SYNC_ERROR_ID_INDEX_ERROR);
+        else if (lookahead_ready)
+            upload_new_commit (task);
+        else
+            check_head_commit_http (task);
+    } else if (tx_state == HTTP_TASK_STATE_CANCELED) {
         transition_sync_state (task, SYNC_STATE_CANCELED);
-    } else if (tx_task->state == HTTP_TASK_STATE_ERROR) {
-        if (tx_task->error == SYNC_ERROR_ID_SERVER_REPO_DELETED) {
+    } else if (tx_state == HTTP_TASK_STATE_ERROR) {
+        if (tx_error == SYNC_ERROR_ID_SERVER_REPO_DELETED) {
             on_repo_deleted_on_server (task, task->repo);
         } else {
-            set_task_error (task, tx_task->error);
+            set_task_error (task, tx_error);
         }
     }
 }
 
+static void
+on_repo_http_uploaded (SeafileSession *seaf,
+                       HttpTxTask *tx_task,
+                       SeafSyncManager *manager)
+{
+    SyncInfo *info = get_sync_info (manager, tx_task->repo_id);
+    SyncTask *task = info->current_task;
+
+    g_return_if_fail (task != NULL && info->in_sync);
+
+    /* Finish the sync step only after the pipelined commit is done, the
+     * commit job still uses the task.
+     */
+    if (task->lookahead_running) {
+        task->upload_deferred = TRUE;
+        task->deferred_tx_state = tx_task->state;
+        task->deferred_tx_error = tx_task->error;
+        memcpy (task->deferred_head, tx_task->head, 41);
+        return;
+    }
+
+    handle_upload_result (task, tx_task->state, tx_task->error, tx_task->head);
+}
+
 const char *
 sync_state_to_str (int state)
 {
@@ -2759,6 +3383,7 @@ seaf_sync_manager_disable_auto_sync (SeafSyncManager *mgr)
     disable_auto_sync_for_repos (mgr);
 
     mgr->priv->auto_sync_enabled = FALSE;
+    seaf_sync_manager_bump_status_seq (mgr);
     g_debug ("[sync mgr] auto sync is disabled\n");
     return 0;
 }
@@ -2775,6 +3400,7 @@ enable_auto_sync_for_repos (SeafSyncManager *mgr)
         repo = ptr->data;
         if (repo->sync_interval == 0)
             seaf_wt_monitor_watch_repo (seaf->wt_monitor, repo->id, repo->worktree);
+        seaf_sync_manager_wakeup_repo (mgr, repo->id);
     }
 
     g_list_free (repos);
@@ -2791,6 +3417,7 @@ seaf_sync_manager_enable_auto_sync (SeafSyncManager *mgr)
     enable_auto_sync_for_repos (mgr);
 
     mgr->priv->auto_sync_enabled = TRUE;
+    seaf_sync_manager_bump_status_seq (mgr);
     g_debug ("[sync mgr] auto sync is enabled\n");
     return 0;
 }
@@ -2809,6 +3436,7 @@ active_paths_info_new (SeafRepo *repo)
 {
     ActivePathsInfo *info = g_new0 (ActivePathsInfo, 1);
 
+    pthread_rwlock_init (&info->lock, NULL);
     info->paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
     info->syncing_tree = sync_status_tree_new (repo->worktree);
     info->synced_tree = sync_status_tree_new (repo->worktree);
@@ -2824,6 +3452,7 @@ active_paths_info_free (ActivePathsInfo *info)
     g_hash_table_destroy (info->paths);
     sync_status_tree_free (info->syncing_tree);
     sync_status_tree_free (info->synced_tree);
+    pthread_rwlock_destroy (&info->lock);
     g_free (info);
 }
 
@@ -2848,20 +3477,31 @@ seaf_sync_manager_update_active_path (SeafSyncManager *mgr,
         return;
     }
 
-    pthread_mutex_lock (&mgr->priv->paths_lock);
+    pthread_rwlock_rdlock (&mgr->priv->paths_lock);
 
     info = g_hash_table_lookup (mgr->priv->active_paths, repo_id);
     if (!info) {
+        pthread_rwlock_unlock (&mgr->priv->paths_lock);
+
         repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
-        if (!repo) {
-            pthread_mutex_unlock (&mgr->priv->paths_lock);
+        if (!repo)
             return;
+
+        /* Keep the write lock for the rest, adding a repo is rare. */
+        pthread_rwlock_wrlock (&mgr->priv->paths_lock);
+        info = g_hash_table_lookup (mgr->priv->active_paths, repo_id);
+        if (!info) {
+            info = active_paths_info_new (repo);
+            g_hash_table_insert (mgr->priv->active_paths, g_strdup(repo_id), info);
         }
-        info = active_paths_info_new (repo);
-        g_hash_table_insert (mgr->priv->active_paths, g_strdup(repo_id), info);
     }
 
+    pthread_rwlock_wrlock (&info->lock);
+
     SyncStatus existing = (SyncStatus) g_hash_table_lookup (info->paths, path);
+    if (existing != status)
+        seaf_sync_manager_bump_status_seq (mgr);
+
     if (!existing) {
         g_hash_table_insert (info->paths, g_strdup(path), (void*)status);
         if (status == SYNC_STATUS_SYNCING)
@@ -2890,7 +3530,8 @@ seaf_sync_manager_update_active_path (SeafSyncManager *mgr,
 #endif
     }
 
-    pthread_mutex_unlock (&mgr->priv->paths_lock);
+    pthread_rwlock_unlock (&info->lock);
+    pthread_rwlock_unlock (&mgr->priv->paths_lock);
 }
 
 void
@@ -2905,19 +3546,22 @@ seaf_sync_manager_delete_active_path (SeafSyncManager *mgr,
         return;
     }
 
-    pthread_mutex_lock (&mgr->priv->paths_lock);
+    pthread_rwlock_rdlock (&mgr->priv->paths_lock);
 
     info = g_hash_table_lookup (mgr->priv->active_paths, repo_id);
     if (!info) {
-        pthread_mutex_unlock (&mgr->priv->paths_lock);
+        pthread_rwlock_unlock (&mgr->priv->paths_lock);
         return;
     }
 
-    g_hash_table_remove (info->paths, path);
+    pthread_rwlock_wrlock (&info->lock);
+    if (g_hash_table_remove (info->paths, path))
+        seaf_sync_manager_bump_status_seq (mgr);
     sync_status_tree_del (info->syncing_tree, path);
     sync_status_tree_del (info->synced_tree, path);
+    pthread_rwlock_unlock (&info->lock);
 
-    pthread_mutex_unlock (&mgr->priv->paths_lock);
+    pthread_rwlock_unlock (&mgr->priv->paths_lock);
 }
 
 static char *path_status_tbl[] = {
@@ -2991,15 +3635,17 @@ seaf_sync_manager_get_path_sync_status (SeafSyncManager *mgr,
         goto out;
     }
 
-    pthread_mutex_lock (&mgr->priv->paths_lock);
+    pthread_rwlock_rdlock (&mgr->priv->paths_lock);
 
     info = g_hash_table_lookup (mgr->priv->active_paths, repo_id);
     if (!info) {
-        pthread_mutex_unlock (&mgr->priv->paths_lock);
+        pthread_rwlock_unlock (&mgr->priv->paths_lock);
         ret = SYNC_STATUS_NONE;
         goto out;
     }
 
+    pthread_rwlock_rdlock (&info->lock);
+
     ret = (SyncStatus) g_hash_table_lookup (info->paths, path);
     if (is_dir && (ret == SYNC_STATUS_NONE)) {
         /* If a dir is not in the syncing tree but in the synced tree,
@@ -3012,7 +3658,8 @@ seaf_sync_manager_get_path_sync_status (SeafSyncManager *mgr,
             ret = SYNC_STATUS_SYNCED;
     }
 
-    pthread_mutex_unlock (&mgr->priv->paths_lock);
+    pthread_rwlock_unlock (&info->lock);
+    pthread_rwlock_unlock (&mgr->priv->paths_lock);
 
     if (ret == SYNC_STATUS_SYNCED) {
         if (!seaf_repo_manager_is_path_writable(seaf->repo_mgr, repo_id, path))
@@ -3029,6 +3676,18 @@ out:
     return g_strdup(path_status_tbl[ret]);
 }
 
+void
+seaf_sync_manager_bump_status_seq (SeafSyncManager *mgr)
+{
+    g_atomic_int_inc (&mgr->priv->status_seq);
+}
+
+int
+seaf_sync_manager_get_status_seq (SeafSyncManager *mgr)
+{
+    return g_atomic_int_get (&mgr->priv->status_seq);
+}
+
 static json_t *
 active_paths_to_json (GHashTable *paths)
 {
@@ -3065,7 +3724,7 @@ seaf_sync_manager_list_active_paths_json (SeafSyncManager *mgr)
     ActivePathsInfo *info;
     char *ret = NULL;
 
-    pthread_mutex_lock (&mgr->priv->paths_lock);
+    pthread_rwlock_rdlock (&mgr->priv->paths_lock);
 
     array = json_array ();
 
@@ -3075,14 +3734,16 @@ seaf_sync_manager_list_active_paths_json (SeafSyncManager *mgr)
         info = value;
 
         obj = json_object();
+        pthread_rwlock_rdlock (&info->lock);
         path_array = active_paths_to_json (info->paths);
+        pthread_rwlock_unlock (&info->lock);
         json_object_set (obj, "repo_id", json_string(repo_id));
         json_object_set (obj, "paths", path_array);
 
         json_array_append (array, obj);
     }
 
-    pthread_mutex_unlock (&mgr->priv->paths_lock);
+    pthread_rwlock_unlock (&mgr->priv->paths_lock);
 
     ret = json_dumps (array, JSON_INDENT(4));
     if (!ret) {
@@ -3102,23 +3763,31 @@ seaf_sync_manager_active_paths_number (SeafSyncManager *mgr)
     ActivePathsInfo *info;
     int ret = 0;
 
+    pthread_rwlock_rdlock (&mgr->priv->paths_lock);
+
     g_hash_table_iter_init (&iter, mgr->priv->active_paths);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         info = value;
+        pthread_rwlock_rdlock (&info->lock);
         ret += g_hash_table_size(info->paths);
+        pthread_rwlock_unlock (&info->lock);
     }
 
+    pthread_rwlock_unlock (&mgr->priv->paths_lock);
+
     return ret;
 }
 
 void
 seaf_sync_manager_remove_active_path_info (SeafSyncManager *mgr, const char *repo_id)
 {
-    pthread_mutex_lock (&mgr->priv->paths_lock);
+    pthread_rwlock_wrlock (&mgr->priv->paths_lock);
 
     g_hash_table_remove (mgr->priv->active_paths, repo_id);
 
-    pthread_mutex_unlock (&mgr->priv->paths_lock);
+    pthread_rwlock_unlock (&mgr->priv->paths_lock);
+
+    seaf_sync_manager_bump_status_seq (mgr);
 
 #ifdef WIN32
     /* This is a hack to tell Windows Explorer to refresh all open windows. */
@@ -3189,25 +3858,72 @@ seaf_sync_manager_refresh_path (SeafSyncManager *mgr, const char *path)
 
 #endif
 
+/*
+ * Only the repos that are not kept up to date by the notification server are
+ * polled. A repo that was just subscribed is polled once more after its
+ * subscribe request is written, to catch up with changes made before that. So when the notification server
+ * is up, only a single request per server is sent after (re)connecting.
+ */
+static GList *
+get_repos_to_poll (HttpServerState *state, const char *server_url,
+                   GList **subscribed)
+{
+    GList *repo_id_list, *ptr, *ret = NULL;
+    SeafRepo *repo;
+    char *repo_id;
+
+    repo_id_list = seaf_repo_manager_get_repo_id_list_by_server (seaf->repo_mgr,
+                                                                server_url);
+
+    pthread_mutex_lock (&state->head_commit_map_lock);
+    for (ptr = repo_id_list; ptr; ptr = ptr->next) {
+        repo_id = ptr->data;
+        repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+        if (repo && is_repo_subscribed (repo) &&
+            seaf_notif_manager_is_subscription_sent (seaf->notif_mgr, repo)) {
+            if (g_hash_table_lookup (state->pushed_repos, repo_id)) {
+                g_free (repo_id);
+                continue;
+            }
+            *subscribed = g_list_prepend (*subscribed, g_strdup (repo_id));
+        } else {
+            g_hash_table_remove (state->pushed_repos, repo_id);
+        }
+        ret = g_list_prepend (ret, repo_id);
+    }
+    pthread_mutex_unlock (&state->head_commit_map_lock);
+
+    g_list_free (repo_id_list);
+    return ret;
+}
+
 static void
 update_head_commit_ids_for_server (gpointer key, gpointer value, gpointer user_data)
 {
     char *server_url = key;
     HttpServerState *state = value;
     int status = 200;
+    GList *subscribed = NULL, *ptr;
+    char *head;
 
     /* Only get head commit ids from server if:
      * 1. syncing protocol version has been checked, and
      * 2. protocol version is at least 2.
      */
     if (state->http_version >= 2) {
-        seaf_debug ("Updating repo head commit ids for server %s.\n", server_url);
-        GList *repo_id_list = seaf_repo_manager_get_repo_id_list_by_server (seaf->repo_mgr,
-                                                                            server_url);
+        GList *repo_id_list = get_repos_to_poll (state, server_url, &subscribed);
         if (!repo_id_list) {
+            /* All repos are pushed, the cached heads are still current. */
+            pthread_mutex_lock (&state->head_commit_map_lock);
+            if (state->head_commit_map_init)
+                state->last_update_head_commit_map_time = (gint64)time(NULL);
+            pthread_mutex_unlock (&state->head_commit_map_lock);
             return;
         }
 
+        seaf_debug ("Updating head commit ids of %d repos for server %s.\n",
+                    g_list_length (repo_id_list), server_url);
+
         GHashTable *new_map = http_tx_manager_get_head_commit_ids (seaf->http_tx_mgr,
                                                                    state->effective_host,
                                                                    state->use_fileserver_port,
@@ -3221,12 +3937,23 @@ update_head_commit_ids_for_server (gpointer key, gpointer value, gpointer user_d
             }
             state->server_disconnected = FALSE;
             pthread_mutex_lock (&state->head_commit_map_lock);
-            g_hash_table_destroy (state->head_commit_map);
-            state->head_commit_map = new_map;
+            /* Repos missing from the result were removed on the server. */
+            for (ptr = repo_id_list; ptr; ptr = ptr->next) {
+                head = g_hash_table_lookup (new_map, ptr->data);
+                if (head)
+                    g_hash_table_replace (state->head_commit_map,
+                                          g_strdup (ptr->data), g_strdup (head));
+                else
+                    g_hash_table_remove (state->head_commit_map, ptr->data);
+            }
+            for (ptr = subscribed; ptr; ptr = ptr->next)
+                g_hash_table_replace (state->pushed_repos, g_strdup (ptr->data),
+                                      GINT_TO_POINTER(1));
             if (!state->head_commit_map_init)
                 state->head_commit_map_init = TRUE;
             state->last_update_head_commit_map_time = (gint64)time(NULL);
             pthread_mutex_unlock (&state->head_commit_map_lock);
+            g_hash_table_destroy (new_map);
         } else {
             if (status == HTTP_SERVERR_BAD_GATEWAY ||
                 status == HTTP_SERVERR_UNAVAILABLE ||
@@ -3236,6 +3963,7 @@ update_head_commit_ids_for_server (gpointer key, gpointer value, gpointer user_d
         }
 
         g_list_free_full (repo_id_list, g_free);
+        g_list_free_full (subscribed, g_free);
     }
 }
 
@@ -36,6 +36,13 @@ struct _SyncInfo {
 
     gint       sync_perm_err_cnt;
     gboolean   del_confirmation_pending;
+
+    /* The sync pulse skips the repo until this time, unless it's woken up
+     * by a worktree change or seaf_sync_manager_wakeup_repo(). 0 means the
+     * repo is checked in the next pulse.
+     */
+    gint64     next_check;
+    gint       last_wt_change;
 };
 
 enum {
@@ -62,9 +69,22 @@ struct _SyncTask {
     char            *tx_id;
     char            *token;
     struct SeafTimer *commit_timer;
+    gint64           check_head_start;
 
     gboolean         uploaded;
 
+    /* With pipelined partial commits, the next partial commit is created
+     * while the previous one is being uploaded. An upload result that
+     * arrives before that commit is done is kept here until it is.
+     */
+    gboolean         lookahead_running;
+    gboolean         lookahead_ready;
+    gboolean         lookahead_failed;
+    gboolean         upload_deferred;
+    int              deferred_tx_state;
+    int              deferred_tx_error;
+    char             deferred_head[41];
+
     int              http_version;
 
     SeafRepo        *repo;  /* for convenience, only valid when in_sync. */
@@ -86,11 +106,14 @@ typedef enum _SyncStatus SyncStatus;
 
 struct _SeafileSession;
 
+#define DEFAULT_MAX_RUNNING_SYNC_TASKS 5
+
 struct _SeafSyncManager {
     struct _SeafileSession   *seaf;
 
     GHashTable *sync_infos;
     int         n_running_tasks;
+    int         max_running_tasks;
     gboolean    commit_job_running;
     int         sync_interval;
 
@@ -104,6 +127,9 @@ struct _SeafSyncManager {
     gint             recv_bytes;
     gint             last_sent_bytes;
     gint             last_recv_bytes;
+    /* Bytes sent/recv since the daemon started, updated every second. */
+    gint64           total_sent_bytes;
+    gint64           total_recv_bytes;
     /* Upload/download rate limits. */
     gint             upload_limit;
     gint             download_limit;
@@ -166,6 +192,18 @@ seaf_sync_manager_get_path_sync_status (SeafSyncManager *mgr,
                                         const char *path,
                                         gboolean is_dir);
 
+/*
+ * The status sequence number is increased whenever the sync status of some
+ * path may have changed: active paths, sync states, locks, permissions or
+ * auto sync. Clients that cache path statuses can keep them as long as the
+ * number stays the same.
+ */
+void
+seaf_sync_manager_bump_status_seq (SeafSyncManager *mgr);
+
+int
+seaf_sync_manager_get_status_seq (SeafSyncManager *mgr);
+
 char *
 seaf_sync_manager_list_active_paths_json (SeafSyncManager *mgr);
 
@@ -194,6 +232,10 @@ void
 seaf_sync_manager_update_repo (SeafSyncManager *manager, SeafRepo *repo,
                                const char *commit_id);
 
+/* Check @repo_id in the next sync pulse, instead of waiting for its timer. */
+void
+seaf_sync_manager_wakeup_repo (SeafSyncManager *manager, const char *repo_id);
+
 void
 seaf_sync_manager_check_locks_and_folder_perms (SeafSyncManager *manager,
                                                 const char *server_url);
@@ -7,15 +7,16 @@
 #include "log.h"
 
 struct _SyncStatusDir {
-    GHashTable *dirents;        /* name -> dirent. */
+    GHashTable *dirents;        /* dirent->name -> dirent. */
 };
 typedef struct _SyncStatusDir SyncStatusDir;
 
 struct _SyncStatusDirent {
-    char *name;
     int mode;
     /* Only used for directories. */
     SyncStatusDir *subdir;
+    /* Allocated together with the dirent, also used as the hash key. */
+    char name[1];
 };
 typedef struct _SyncStatusDirent SyncStatusDirent;
 
@@ -33,7 +34,7 @@ sync_status_dir_new ()
 {
     SyncStatusDir *dir = g_new0 (SyncStatusDir, 1);
     dir->dirents = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                          g_free,
+                                          NULL,
                                           (GDestroyNotify)sync_status_dirent_free);
     return dir;
 }
@@ -50,8 +51,10 @@ sync_status_dir_free (SyncStatusDir *dir)
 static SyncStatusDirent *
 sync_status_dirent_new (const char *name, int mode)
 {
-    SyncStatusDirent *dirent = g_new0(SyncStatusDirent, 1);
-    dirent->name = g_strdup(name);
+    size_t len = strlen (name);
+    SyncStatusDirent *dirent = g_malloc0 (sizeof(SyncStatusDirent) + len);
+
+    memcpy (dirent->name, name, len);
     dirent->mode = mode;
 
     if (S_ISDIR(mode))
@@ -65,7 +68,6 @@ sync_status_dirent_free (SyncStatusDirent *dirent)
 {
     if (!dirent)
         return;
-    g_free (dirent->name);
     sync_status_dir_free (dirent->subdir);
     g_free (dirent);
 }
@@ -161,10 +163,10 @@ sync_status_tree_add (SyncStatusTree *tree,
         } else {
             if (i == (n-1)) {
                 dirent = sync_status_dirent_new (dname, mode);
-                g_hash_table_insert (dir->dirents, g_strdup(dname), dirent);
+                g_hash_table_insert (dir->dirents, dirent->name, dirent);
             } else {
                 dirent = sync_status_dirent_new (dname, S_IFDIR);
-                g_hash_table_insert (dir->dirents, g_strdup(dname), dirent);
+                g_hash_table_insert (dir->dirents, dirent->name, dirent);
                 dir = dirent->subdir;
             }
 #ifdef WIN32
@@ -242,47 +244,49 @@ sync_status_tree_del (SyncStatusTree *tree,
     g_strfreev (dnames);
 }
 
+/* Called for every path status query, so it doesn't allocate memory for
+ * normal paths.
+ */
 int
 sync_status_tree_exists (SyncStatusTree *tree,
                          const char *path)
 {
-    char **dnames = NULL;
-    guint n, i;
-    char *dname;
+    char buf[SEAF_PATH_MAX];
+    char *copy = NULL;
+    char *dname, *slash;
+    size_t len;
     SyncStatusDir *dir = tree->root;
     SyncStatusDirent *dirent;
     int ret = 0;
 
-    dnames = g_strsplit (path, "/", 0);
-    if (!dnames)
-        return ret;
-    n = g_strv_length (dnames);
+    len = strlen (path);
+    if (len < sizeof(buf)) {
+        memcpy (buf, path, len + 1);
+        dname = buf;
+    } else {
+        copy = g_strdup (path);
+        dname = copy;
+    }
+
+    while (1) {
+        slash = strchr (dname, '/');
+        if (slash)
+            *slash = 0;
 
-    for (i = 0; i < n; i++) {
-        dname = dnames[i];
         dirent = g_hash_table_lookup (dir->dirents, dname);
-        if (dirent) {
-            if (S_ISDIR(dirent->mode)) {
-                if (i == (n-1)) {
-                    ret = 1;
-                    goto out;
-                } else {
-                    dir = dirent->subdir;
-                }
-            } else {
-                if (i == (n-1)) {
-                    ret = 1;
-                    goto out;
-                } else {
-                    goto out;
-                }
-            }
-        } else {
-            goto out;
+        if (!dirent)
+            break;
+        if (!slash) {
+            ret = 1;
+            break;
         }
+        if (!S_ISDIR(dirent->mode))
+            break;
+
+        dir = dirent->subdir;
+        dname = slash + 1;
     }
 
-out:
-    g_strfreev (dnames);
+    g_free (copy);
     return ret;
 }
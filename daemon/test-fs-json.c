@@ -0,0 +1,215 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Checks that the json of fs objects, which fs-mgr.c writes by hand, is
+ * byte for byte what json_dumps() with JSON_SORT_KEYS produces for the
+ * same object. Object ids are hashes of the json, so any difference would
+ * change the id of every new object.
+ *
+ * Run by make check.
+ */
+
+#include "common.h"
+
+#include <jansson.h>
+
+#include "seafile-session.h"
+#include "fs-mgr.h"
+#include "utils.h"
+#include "cdc/cdc.h"
+
+SeafileSession *seaf;
+
+static int n_failed;
+
+#define ID1 "0123456789abcdef0123456789abcdef01234567"
+#define ID2 "fedcba9876543210fedcba9876543210fedcba98"
+
+static void
+check_equal (const char *what, const char *expected,
+             const char *got, int got_len)
+{
+    if (got && strlen(expected) == (size_t)got_len &&
+        memcmp (expected, got, got_len) == 0) {
+        printf ("ok %s\n", what);
+        return;
+    }
+
+    printf ("FAIL %s\n  expected: %s\n  got:      %.*s\n",
+            what, expected, got ? got_len : 6, got ? got : "(null)");
+    ++n_failed;
+}
+
+/* The objects as fs-mgr.c used to build them before dumping. */
+static char *
+reference_dir_json (SeafDir *dir)
+{
+    json_t *object, *array, *dent_obj;
+    SeafDirent *dent;
+    GList *ptr;
+    char *data;
+
+    object = json_object ();
+    json_object_set_int_member (object, "type", SEAF_METADATA_TYPE_DIR);
+    json_object_set_int_member (object, "version", dir->version);
+
+    array = json_array ();
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        dent_obj = json_object ();
+        json_object_set_int_member (dent_obj, "mode", dent->mode);
+        json_object_set_string_member (dent_obj, "id", dent->id);
+        json_object_set_string_member (dent_obj, "name", dent->name);
+        json_object_set_int_member (dent_obj, "mtime", dent->mtime);
+        if (S_ISREG(dent->mode)) {
+            json_object_set_string_member (dent_obj, "modifier", dent->modifier);
+            json_object_set_int_member (dent_obj, "size", dent->size);
+        }
+        json_array_append_new (array, dent_obj);
+    }
+    json_object_set_new (object, "dirents", array);
+
+    data = json_dumps (object, JSON_SORT_KEYS);
+    json_decref (object);
+    return data;
+}
+
+static char *
+reference_seafile_json (CDCFileDescriptor *cdc)
+{
+    json_t *object, *array;
+    char block_id[41];
+    char *data;
+    guint32 i;
+
+    object = json_object ();
+    json_object_set_int_member (object, "type", SEAF_METADATA_TYPE_FILE);
+    json_object_set_int_member (object, "version",
+                                seafile_version_from_repo_version (CURRENT_REPO_VERSION));
+    json_object_set_int_member (object, "size", cdc->file_size);
+
+    array = json_array ();
+    for (i = 0; i < cdc->block_nr; ++i) {
+        rawdata_to_hex (cdc->blk_sha1s + i * 20, block_id, 20);
+        json_array_append_new (array, json_string (block_id));
+    }
+    json_object_set_new (object, "block_ids", array);
+
+    data = json_dumps (object, JSON_SORT_KEYS);
+    json_decref (object);
+    return data;
+}
+
+static SeafDirent *
+file_dent (const char *name, const char *modifier, gint64 mtime, gint64 size)
+{
+    return seaf_dirent_new (dir_version_from_repo_version (CURRENT_REPO_VERSION),
+                            ID1, S_IFREG, name, mtime, modifier, size);
+}
+
+static SeafDirent *
+dir_dent (const char *name, gint64 mtime)
+{
+    return seaf_dirent_new (dir_version_from_repo_version (CURRENT_REPO_VERSION),
+                            ID2, S_IFDIR, name, mtime, NULL, 0);
+}
+
+/* Takes @entries. */
+static void
+check_dir (const char *what, GList *entries)
+{
+    SeafDir *dir;
+    char *expected;
+    void *data;
+    guint8 *json = NULL;
+    int len, json_len = 0;
+
+    dir = seaf_dir_new (NULL, entries,
+                        dir_version_from_repo_version (CURRENT_REPO_VERSION));
+    expected = reference_dir_json (dir);
+
+    data = seaf_dir_to_data (dir, &len);
+    if (!data || seaf_decompress (data, len, &json, &json_len) < 0)
+        json = NULL;
+    check_equal (what, expected, (char *)json, json_len);
+
+    g_free (json);
+    g_free (data);
+    free (expected);
+    seaf_dir_free (dir);
+}
+
+static void
+check_seafile (const char *what, guint64 file_size, guint32 n_blocks)
+{
+    CDCFileDescriptor cdc;
+    char *expected, *got;
+    guint32 i;
+
+    memset (&cdc, 0, sizeof(cdc));
+    cdc.file_size = file_size;
+    cdc.block_nr = n_blocks;
+    cdc.blk_sha1s = g_malloc0 (n_blocks * 20 + 1);
+    for (i = 0; i < n_blocks * 20; ++i)
+        cdc.blk_sha1s[i] = (uint8_t)(i * 37 + 11);
+
+    expected = reference_seafile_json (&cdc);
+    got = seaf_fs_manager_dump_seafile_json (CURRENT_REPO_VERSION, &cdc);
+    check_equal (what, expected, got, strlen(got));
+
+    g_free (got);
+    free (expected);
+    g_free (cdc.blk_sha1s);
+}
+
+int
+main (int argc, char **argv)
+{
+    GList *entries;
+
+    check_dir ("empty dir", NULL);
+
+    entries = NULL;
+    entries = g_list_append (entries, file_dent ("README.md", "me@example.com",
+                                                 1500000000, 1234));
+    entries = g_list_append (entries, dir_dent ("src", 1500000001));
+    check_dir ("plain names", entries);
+
+    entries = NULL;
+    entries = g_list_append (entries, file_dent ("quote\" back\\ slash / end",
+                                                 "a\"b\\c", 1, 2));
+    entries = g_list_append (entries, file_dent ("tab\t nl\n cr\r bs\b ff\f",
+                                                 "x", 3, 4));
+    entries = g_list_append (entries, dir_dent ("ctl\x01 \x1f del\x7f", 5));
+    check_dir ("escaped names", entries);
+
+    entries = NULL;
+    entries = g_list_append (entries, file_dent ("\xe6\x96\x87\xe6\xa1\xa3.txt",
+                                                 "\xe7\x94\xa8\xe6\x88\xb7@example.com",
+                                                 1700000000, 42));
+    entries = g_list_append (entries, file_dent ("\xc3\x9c" "n\xc3\xaf" "c\xc3\xb6" "d\xc3\xa9",
+                                                 "x", 0, 0));
+    entries = g_list_append (entries, dir_dent ("emoji \xf0\x9f\x98\x80", 7));
+    check_dir ("non-ASCII names", entries);
+
+    /* Strings that are not UTF-8 are left out, as jansson does. */
+    entries = NULL;
+    entries = g_list_append (entries, file_dent ("ok", "bad\xff", 8, 9));
+    check_dir ("invalid UTF-8 modifier", entries);
+
+    entries = NULL;
+    entries = g_list_append (entries, file_dent ("big", "x", (gint64)1 << 40,
+                                                 (gint64)5 << 30));
+    entries = g_list_append (entries, file_dent ("old", "x", -1, 0));
+    check_dir ("large and negative numbers", entries);
+
+    check_seafile ("empty file", 0, 0);
+    check_seafile ("one block", 100, 1);
+    check_seafile ("several blocks", (guint64)5 << 30, 5);
+
+    if (n_failed > 0) {
+        printf ("%d checks failed\n", n_failed);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,187 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Checks that rabin_scan(), with whichever implementation it picks on this
+ * machine, returns the same positions as rolling the fingerprint byte by
+ * byte with rabin_rolling_checksum(). The cut points decide the block ids,
+ * so any difference would stop new blocks from deduplicating against old
+ * ones.
+ *
+ * Buffers are allocated with their exact size, so that reads past the end
+ * show up under valgrind or ASan.
+ *
+ * Run by make check.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "cdc/rabin-checksum.h"
+#include "cdc/rabin-scan.h"
+
+static int n_failed;
+static int n_checked;
+
+static uint32_t
+reference_scan (const unsigned char *buf, int win, uint32_t first,
+                uint32_t start, uint32_t end,
+                uint32_t mask, uint32_t value)
+{
+    uint32_t fp, i;
+
+    fp = rabin_checksum ((char *)buf + first - win + 1, win);
+    for (i = first; i < end; ++i) {
+        if (i > first)
+            fp = rabin_rolling_checksum (fp, win, buf[i - win], buf[i]);
+        if (i >= start && (fp & mask) == value)
+            return i;
+    }
+
+    return end;
+}
+
+static void
+check_scan (const char *what, const unsigned char *buf, int win,
+            uint32_t first, uint32_t start, uint32_t end,
+            uint32_t mask, uint32_t value)
+{
+    uint32_t expected, got;
+
+    expected = reference_scan (buf, win, first, start, end, mask, value);
+    got = rabin_scan (buf, first, start, end, mask, value);
+    ++n_checked;
+    if (got == expected)
+        return;
+
+    printf ("FAIL %s: win %d first %u start %u end %u mask %x value %x: "
+            "expected %u, got %u\n",
+            what, win, first, start, end, mask, value, expected, got);
+    ++n_failed;
+}
+
+static unsigned char *
+random_buf (GRand *rand, uint32_t len)
+{
+    unsigned char *buf = g_malloc (len ? len : 1);
+    uint32_t i;
+
+    for (i = 0; i < len; ++i)
+        buf[i] = (unsigned char)g_rand_int (rand);
+    return buf;
+}
+
+static const uint32_t masks[] = { 0, 0x1, 0x3, 0xf, 0xff, 0x1fff, 0xffffffff };
+
+/*
+ * Every length from a bare window up to a few vector steps past it, with
+ * starts around the end of the initial window. This covers inputs too
+ * short for a single vector step and every tail length.
+ */
+static void
+check_short_inputs (GRand *rand, int win)
+{
+    unsigned char *buf;
+    uint32_t len, first, start, end;
+    guint m;
+
+    first = win - 1;
+    for (len = win; len <= (uint32_t)win + 64; ++len) {
+        buf = random_buf (rand, len);
+        for (start = first; start <= first + 9 && start <= len; ++start) {
+            for (end = start; end <= len; ++end) {
+                for (m = 0; m < G_N_ELEMENTS(masks); ++m) {
+                    check_scan ("short input", buf, win, first, start, end,
+                                masks[m], g_rand_int (rand) & masks[m]);
+                }
+            }
+        }
+        g_free (buf);
+    }
+}
+
+/*
+ * Walk a large buffer from cut point to cut point, as cdc.c does. The
+ * reference fingerprint is rolled once over the whole buffer.
+ */
+static void
+check_cut_points (const char *what, const unsigned char *buf, uint32_t len,
+                  int win, uint32_t first, uint32_t mask, uint32_t value)
+{
+    uint32_t fp, i, pos, got;
+
+    fp = rabin_checksum ((char *)buf + first - win + 1, win);
+    pos = first;
+    for (i = first; i <= len; ++i) {
+        if (i < len) {
+            if (i > first)
+                fp = rabin_rolling_checksum (fp, win, buf[i - win], buf[i]);
+            if ((fp & mask) != value)
+                continue;
+        }
+
+        got = rabin_scan (buf, first, pos, len, mask, value);
+        ++n_checked;
+        if (got != i) {
+            printf ("FAIL %s: win %d first %u start %u mask %x value %x: "
+                    "expected %u, got %u\n",
+                    what, win, first, pos, mask, value, i, got);
+            ++n_failed;
+            return;
+        }
+        pos = i + 1;
+    }
+}
+
+static void
+check_long_inputs (GRand *rand, int win)
+{
+    uint32_t len = 1 << 20;
+    unsigned char *buf;
+    guint m;
+
+    buf = random_buf (rand, len);
+    for (m = 1; m < 6; ++m) {
+        check_cut_points ("random data", buf, len, win, win - 1,
+                          masks[m], 0x0013 & masks[m]);
+        check_cut_points ("random data", buf, len, win, 2047 + win,
+                          masks[m], 0x0013 & masks[m]);
+    }
+
+    /* Runs of one byte give the same fingerprint at many positions. */
+    memset (buf, 0, len);
+    memset (buf + len / 2, 0xff, len / 4);
+    for (m = 0; m < 6; ++m)
+        check_cut_points ("zeros", buf, len, win, win - 1, masks[m], 0);
+
+    for (m = 0; m < len; ++m)
+        buf[m] = "abc"[m % 3];
+    check_cut_points ("pattern", buf, len, win, win - 1, 0xff, 0x61);
+
+    g_free (buf);
+}
+
+int
+main (int argc, char **argv)
+{
+    static const int windows[] = { 8, 16, 48, 64 };
+    GRand *rand = g_rand_new_with_seed (20130416);
+    guint w;
+
+    for (w = 0; w < G_N_ELEMENTS(windows); ++w) {
+        rabin_init (windows[w]);
+        rabin_scan_init (windows[w]);
+        check_short_inputs (rand, windows[w]);
+        check_long_inputs (rand, windows[w]);
+    }
+
+    g_rand_free (rand);
+
+    if (n_failed > 0) {
+        printf ("%d of %d checks failed\n", n_failed, n_checked);
+        return 1;
+    }
+    printf ("ok %d checks\n", n_checked);
+    return 0;
+}
@@ -0,0 +1,346 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "tx-checkpoint.h"
+#include "utils.h"
+#include "log.h"
+
+#include "db.h"
+
+struct _TxCheckpointStore {
+    sqlite3 *db;
+    pthread_mutex_t db_lock;
+};
+
+TxCheckpointStore *
+tx_checkpoint_store_new (const char *db_path)
+{
+    TxCheckpointStore *store;
+    sqlite3 *db;
+    char *sql;
+
+    if (sqlite_open_db (db_path, &db) < 0)
+        return NULL;
+
+    sql = "CREATE TABLE IF NOT EXISTS TxCheckpoint ("
+        "repo_id TEXT, type INTEGER, head_id TEXT, stage INTEGER, "
+        "mtime INTEGER, PRIMARY KEY (repo_id, type));";
+    if (sqlite_query_exec (db, sql) < 0)
+        goto error;
+
+    sql = "CREATE TABLE IF NOT EXISTS TxCheckpointIds ("
+        "repo_id TEXT, type INTEGER, obj_id TEXT, done INTEGER, "
+        "PRIMARY KEY (repo_id, type, obj_id));";
+    if (sqlite_query_exec (db, sql) < 0)
+        goto error;
+
+    store = g_new0 (TxCheckpointStore, 1);
+    store->db = db;
+    pthread_mutex_init (&store->db_lock, NULL);
+
+    return store;
+
+error:
+    sqlite_close_db (db);
+    return NULL;
+}
+
+int
+tx_checkpoint_get_stage (TxCheckpointStore *store,
+                         const char *repo_id, int type, const char *head_id)
+{
+    sqlite3_stmt *stmt;
+    char *sql;
+    int stage = TX_CHECKPOINT_NONE;
+    gint64 mtime;
+
+    if (!store)
+        return TX_CHECKPOINT_NONE;
+
+    pthread_mutex_lock (&store->db_lock);
+
+    sql = "SELECT head_id, stage, mtime FROM TxCheckpoint "
+        "WHERE repo_id = ? AND type = ?";
+    stmt = sqlite_query_prepare (store->db, sql);
+    if (!stmt) {
+        pthread_mutex_unlock (&store->db_lock);
+        return TX_CHECKPOINT_NONE;
+    }
+    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int (stmt, 2, type);
+
+    if (sqlite3_step (stmt) == SQLITE_ROW) {
+        const char *saved_head = (const char *)sqlite3_column_text (stmt, 0);
+        mtime = sqlite3_column_int64 (stmt, 2);
+
+        if (g_strcmp0 (saved_head, head_id) == 0 &&
+            (gint64)time(NULL) - mtime < TX_CHECKPOINT_TTL)
+            stage = sqlite3_column_int (stmt, 1);
+    }
+
+    sqlite3_finalize (stmt);
+    pthread_mutex_unlock (&store->db_lock);
+
+    return stage;
+}
+
+int
+tx_checkpoint_set_stage (TxCheckpointStore *store,
+                         const char *repo_id, int type, const char *head_id,
+                         int stage)
+{
+    sqlite3_stmt *stmt;
+    char *sql;
+    int ret = 0;
+
+    if (!store)
+        return -1;
+
+    pthread_mutex_lock (&store->db_lock);
+
+    sql = "REPLACE INTO TxCheckpoint (repo_id, type, head_id, stage, mtime) "
+        "VALUES (?, ?, ?, ?, ?)";
+    stmt = sqlite_query_prepare (store->db, sql);
+    if (!stmt) {
+        pthread_mutex_unlock (&store->db_lock);
+        return -1;
+    }
+    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int (stmt, 2, type);
+    sqlite3_bind_text (stmt, 3, head_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int (stmt, 4, stage);
+    sqlite3_bind_int64 (stmt, 5, (gint64)time(NULL));
+
+    if (sqlite3_step (stmt) != SQLITE_DONE) {
+        seaf_warning ("Failed to save transfer checkpoint for %.8s: %s.\n",
+                      repo_id, sqlite3_errmsg (store->db));
+        ret = -1;
+    }
+
+    sqlite3_finalize (stmt);
+    pthread_mutex_unlock (&store->db_lock);
+
+    return ret;
+}
+
+static int
+delete_ids (TxCheckpointStore *store, const char *repo_id, int type)
+{
+    sqlite3_stmt *stmt;
+    char *sql;
+    int ret = 0;
+
+    sql = "DELETE FROM TxCheckpointIds WHERE repo_id = ? AND type = ?";
+    stmt = sqlite_query_prepare (store->db, sql);
+    if (!stmt)
+        return -1;
+    sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int (stmt, 2, type);
+
+    if (sqlite3_step (stmt) != SQLITE_DONE) {
+        seaf_warning ("Failed to remove checkpoint ids for %.8s: %s.\n",
+                      repo_id, sqlite3_errmsg (store->db));
+        ret = -1;
+    }
+
+    sqlite3_finalize (stmt);
+    return ret;
+}
+
+int
+tx_checkpoint_save_ids (TxCheckpointStore *store,
+                        const char *repo_id, int type, GList *ids)
+{
+    sqlite3_stmt *stmt;
+    char *sql;
+    GList *ptr;
+    int ret = 0;
+
+    if (!store)
+        return -1;
+
+    pthread_mutex_lock (&store->db_lock);
+
+    sqlite_begin_transaction (store->db);
+
+    if (delete_ids (store, repo_id, type) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    sql = "INSERT OR IGNORE INTO TxCheckpointIds (repo_id, type, obj_id, done) "
+        "VALUES (?, ?, ?, 0)";
+    stmt = sqlite_query_prepare (store->db, sql);
+    if (!stmt) {
+        ret = -1;
+        goto out;
+    }
+
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int (stmt, 2, type);
+        sqlite3_bind_text (stmt, 3, ptr->data, -1, SQLITE_TRANSIENT);
+
+        if (sqlite3_step (stmt) != SQLITE_DONE) {
+            seaf_warning ("Failed to save checkpoint ids for %.8s: %s.\n",
+                          repo_id, sqlite3_errmsg (store->db));
+            ret = -1;
+            break;
+        }
+
+        sqlite3_reset (stmt);
+        sqlite3_clear_bindings (stmt);
+    }
+
+    sqlite3_finalize (stmt);
+
+out:
+    if (ret < 0)
+        sqlite_query_exec (store->db, "ROLLBACK TRANSACTION;");
+    else
+        sqlite_end_transaction (store->db);
+    pthread_mutex_unlock (&store->db_lock);
+
+    return ret;
+}
+
+static gboolean
+collect_id (sqlite3_stmt *stmt, void *data)
+{
+    GList **pids = data;
+
+    *pids = g_list_prepend (*pids,
+                            g_strdup ((const char *)sqlite3_column_text (stmt, 0)));
+    return TRUE;
+}
+
+int
+tx_checkpoint_load_pending_ids (TxCheckpointStore *store,
+                                const char *repo_id, int type, GList **ids)
+{
+    char *sql;
+    int ret = 0;
+
+    *ids = NULL;
+
+    if (!store)
+        return -1;
+
+    sql = sqlite3_mprintf ("SELECT obj_id FROM TxCheckpointIds "
+                           "WHERE repo_id = '%q' AND type = %d AND done = 0",
+                           repo_id, type);
+
+    pthread_mutex_lock (&store->db_lock);
+    if (sqlite_foreach_selected_row (store->db, sql, collect_id, ids) < 0) {
+        seaf_warning ("Failed to load checkpoint ids for %.8s.\n", repo_id);
+        string_list_free (*ids);
+        *ids = NULL;
+        ret = -1;
+    }
+    pthread_mutex_unlock (&store->db_lock);
+
+    sqlite3_free (sql);
+
+    *ids = g_list_reverse (*ids);
+    return ret;
+}
+
+int
+tx_checkpoint_mark_ids_done (TxCheckpointStore *store,
+                             const char *repo_id, int type, GList *ids)
+{
+    sqlite3_stmt *stmt;
+    char *sql;
+    GList *ptr;
+    int ret = 0;
+
+    if (!store || !ids)
+        return 0;
+
+    pthread_mutex_lock (&store->db_lock);
+
+    sql = "UPDATE TxCheckpointIds SET done = 1 "
+        "WHERE repo_id = ? AND type = ? AND obj_id = ?";
+    stmt = sqlite_query_prepare (store->db, sql);
+    if (!stmt) {
+        pthread_mutex_unlock (&store->db_lock);
+        return -1;
+    }
+
+    sqlite_begin_transaction (store->db);
+
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int (stmt, 2, type);
+        sqlite3_bind_text (stmt, 3, ptr->data, -1, SQLITE_TRANSIENT);
+
+        if (sqlite3_step (stmt) != SQLITE_DONE) {
+            seaf_warning ("Failed to update checkpoint ids for %.8s: %s.\n",
+                          repo_id, sqlite3_errmsg (store->db));
+            ret = -1;
+            break;
+        }
+
+        sqlite3_reset (stmt);
+        sqlite3_clear_bindings (stmt);
+    }
+
+    sqlite3_finalize (stmt);
+    sqlite_end_transaction (store->db);
+    pthread_mutex_unlock (&store->db_lock);
+
+    return ret;
+}
+
+void
+tx_checkpoint_clear (TxCheckpointStore *store, const char *repo_id, int type)
+{
+    sqlite3_stmt *stmt;
+    char *sql;
+
+    if (!store)
+        return;
+
+    pthread_mutex_lock (&store->db_lock);
+
+    sql = "DELETE FROM TxCheckpoint WHERE repo_id = ? AND type = ?";
+    stmt = sqlite_query_prepare (store->db, sql);
+    if (stmt) {
+        sqlite3_bind_text (stmt, 1, repo_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int (stmt, 2, type);
+        if (sqlite3_step (stmt) != SQLITE_DONE)
+            seaf_warning ("Failed to remove transfer checkpoint for %.8s: %s.\n",
+                          repo_id, sqlite3_errmsg (store->db));
+        sqlite3_finalize (stmt);
+    }
+
+    delete_ids (store, repo_id, type);
+
+    pthread_mutex_unlock (&store->db_lock);
+}
+
+void
+tx_checkpoint_remove_repo (TxCheckpointStore *store, const char *repo_id)
+{
+    char *sql;
+
+    if (!store)
+        return;
+
+    pthread_mutex_lock (&store->db_lock);
+
+    sql = sqlite3_mprintf ("DELETE FROM TxCheckpoint WHERE repo_id = '%q'",
+                           repo_id);
+    sqlite_query_exec (store->db, sql);
+    sqlite3_free (sql);
+
+    sql = sqlite3_mprintf ("DELETE FROM TxCheckpointIds WHERE repo_id = '%q'",
+                           repo_id);
+    sqlite_query_exec (store->db, sql);
+    sqlite3_free (sql);
+
+    pthread_mutex_unlock (&store->db_lock);
+}
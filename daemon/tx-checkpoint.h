@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_TX_CHECKPOINT_H
+#define SEAF_TX_CHECKPOINT_H
+
+#include <glib.h>
+
+/*
+ * Persisted progress of upload and download tasks.
+ *
+ * A task that is interrupted (network error, daemon restart) records how
+ * far it got for the head commit it was transferring. When a task for the
+ * same repo and head is started again, it skips the stages that were
+ * already done instead of re-computing and re-checking everything with the
+ * server.
+ *
+ * A checkpoint is only valid for the head commit it was saved with, and
+ * expires after TX_CHECKPOINT_TTL seconds, since the server may have
+ * garbage-collected unreferenced objects in the meantime.
+ */
+
+enum {
+    TX_CHECKPOINT_NONE = 0,
+    /* Upload: all needed fs objects have been sent. */
+    TX_CHECKPOINT_FS_SENT,
+    /* Upload: the blocks the server doesn't have are recorded as ids. */
+    TX_CHECKPOINT_BLOCKS_LISTED,
+    /* Download: all needed fs objects have been fetched. */
+    TX_CHECKPOINT_FS_FETCHED,
+};
+
+#define TX_CHECKPOINT_TTL (24 * 3600)
+
+typedef struct _TxCheckpointStore TxCheckpointStore;
+
+TxCheckpointStore *
+tx_checkpoint_store_new (const char *db_path);
+
+/* Returns the stage saved for @repo_id and @head_id, or TX_CHECKPOINT_NONE
+ * if there is no valid checkpoint. */
+int
+tx_checkpoint_get_stage (TxCheckpointStore *store,
+                         const char *repo_id, int type, const char *head_id);
+
+int
+tx_checkpoint_set_stage (TxCheckpointStore *store,
+                         const char *repo_id, int type, const char *head_id,
+                         int stage);
+
+/* Replace the recorded ids with @ids, all pending. */
+int
+tx_checkpoint_save_ids (TxCheckpointStore *store,
+                        const char *repo_id, int type, GList *ids);
+
+/* Sets @ids to the ids that are not marked as done yet. Returns -1 if
+ * they can't be read, which is different from an empty list. */
+int
+tx_checkpoint_load_pending_ids (TxCheckpointStore *store,
+                                const char *repo_id, int type, GList **ids);
+
+int
+tx_checkpoint_mark_ids_done (TxCheckpointStore *store,
+                             const char *repo_id, int type, GList *ids);
+
+void
+tx_checkpoint_clear (TxCheckpointStore *store, const char *repo_id, int type);
+
+/* Remove the checkpoints of all task types of a deleted repo. */
+void
+tx_checkpoint_remove_repo (TxCheckpointStore *store, const char *repo_id);
+
+#endif
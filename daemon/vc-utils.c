@@ -141,9 +141,17 @@ int
 update_index (struct index_state *istate, const char *index_path)
 {
     char index_shadow[SEAF_PATH_MAX];
+    char journal_path[SEAF_PATH_MAX];
     int index_fd;
     int ret = 0;
 
+    /* Usually only the changed entries need to be written to the journal. */
+    ret = update_index_journal (istate, index_path);
+    if (ret == 0)
+        return 0;
+    if (ret < 0)
+        seaf_warning ("Failed to update index journal, writing the whole index.\n");
+
     snprintf (index_shadow, SEAF_PATH_MAX, "%s.shadow", index_path);
     index_fd = seaf_util_create (index_shadow, O_RDWR | O_CREAT | O_TRUNC | O_BINARY,
                                  0666);
@@ -164,6 +172,11 @@ update_index (struct index_state *istate, const char *index_path)
         seaf_warning ("Failed to update index errno=%d %s\n", errno, strerror(errno));
         return -1;
     }
+
+    /* The journal now refers to an old base and would be ignored anyway. */
+    snprintf (journal_path, SEAF_PATH_MAX, "%s%s", index_path, INDEX_JOURNAL_SUFFIX);
+    seaf_util_unlink (journal_path);
+
     return 0;
 }
 
@@ -293,6 +306,7 @@ compute_file_id_with_cdc (const char *path, SeafStat *st,
     cdc.block_min_sz = blk_min_size;
     cdc.block_max_sz = blk_max_size;
     cdc.write_block = seafile_write_chunk;
+    cdc.version = repo_version;
     if (filename_chunk_cdc (path, &cdc, crypt, FALSE) < 0) {
         seaf_warning ("Failed to chunk file.\n");
         return -1;
@@ -309,16 +323,97 @@ compute_file_id_with_cdc (const char *path, SeafStat *st,
     return 0;
 }
 
+/*
+ * Returns 1 if the first chunk of @path, split with the given block sizes,
+ * is not the first block of @file.
+ */
+static int
+first_block_differs (const char *path, Seafile *file,
+                     SeafileCrypt *crypt, int repo_version,
+                     uint32_t blk_avg_size, uint32_t blk_min_size, uint32_t blk_max_size)
+{
+    CDCFileDescriptor cdc;
+    unsigned char checksum[20];
+
+    memset (&cdc, 0, sizeof(cdc));
+    cdc.block_sz = blk_avg_size;
+    cdc.block_min_sz = blk_min_size;
+    cdc.block_max_sz = blk_max_size;
+    cdc.write_block = seafile_write_chunk;
+    cdc.version = repo_version;
+    if (filename_first_chunk_cdc (path, &cdc, crypt, checksum) < 0)
+        return -1;
+
+    return memcmp (checksum, file->blk_ids, 20) != 0 ? 1 : 0;
+}
+
+/*
+ * Cheap checks before chunking the whole file. Returns 1 if @path surely
+ * doesn't have the content of @file, 0 if it may have.
+ *
+ * The file id depends on the block sizes used to chunk the file, so the
+ * first block is tried with the current sizes and the old ones, like the
+ * full comparison below.
+ */
+static int
+quick_check_differs (const char *path, SeafStat *st, Seafile *file,
+                     SeafileCrypt *crypt, int repo_version)
+{
+    uint32_t avg_size = seaf->cdc_average_block_size;
+    uint32_t block_size;
+    int rc;
+
+    if (file->file_size != (guint64)st->st_size)
+        return 1;
+
+    /* The full comparison costs the same for files with a single block. */
+    if (file->n_blocks <= 1)
+        return 0;
+
+    if (avg_size == 0)
+        rc = first_block_differs (path, file, crypt, repo_version,
+                                  CDC_AVERAGE_BLOCK_SIZE,
+                                  CDC_MIN_BLOCK_SIZE,
+                                  CDC_MAX_BLOCK_SIZE);
+    else
+        rc = first_block_differs (path, file, crypt, repo_version,
+                                  avg_size, avg_size >> 1, avg_size << 1);
+    if (rc != 1)
+        return 0;
+
+    block_size = calculate_chunk_size (st->st_size);
+    rc = first_block_differs (path, file, crypt, repo_version,
+                              block_size, block_size >> 2, block_size << 2);
+
+    return rc == 1 ? 1 : 0;
+}
+
 int
-compare_file_content (const char *path, SeafStat *st, const unsigned char *ce_sha1,
+compare_file_content (const char *path, SeafStat *st,
+                      const char *repo_id, const unsigned char *ce_sha1,
                       SeafileCrypt *crypt, int repo_version)
 {
     unsigned char sha1[20];
+    char file_id[41];
+    Seafile *file;
+    int differs = 0;
 
     if (st->st_size == 0) {
         memset (sha1, 0, 20);
         return hashcmp (sha1, ce_sha1);
     } else {
+        /* The fs object of the new version has been downloaded before
+         * checkout. If it can't be loaded, just do the full comparison. */
+        rawdata_to_hex (ce_sha1, file_id, 20);
+        file = seaf_fs_manager_get_seafile (seaf->fs_mgr, repo_id,
+                                            repo_version, file_id);
+        if (file) {
+            differs = quick_check_differs (path, st, file, crypt, repo_version);
+            seafile_unref (file);
+            if (differs)
+                return 1;
+        }
+
         if (seaf->cdc_average_block_size == 0) {
             if (compute_file_id_with_cdc (path, st, crypt, repo_version,
                                           CDC_AVERAGE_BLOCK_SIZE,
@@ -537,7 +632,7 @@ check_dir_locked_recursive (const wchar_t *path_w)
     wcscpy (pattern, path_w);
     wcscat (pattern, L"\\*");
 
-    handle = FindFirstFileW (pattern, &fdata);
+    handle = seaf_util_find_first_file (pattern, &fdata);
     if (handle == INVALID_HANDLE_VALUE) {
         seaf_warning ("FindFirstFile failed %s: %lu.\n",
                       path, GetLastError());
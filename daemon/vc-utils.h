@@ -47,7 +47,8 @@ gboolean
 files_locked_on_windows (struct index_state *index, const char *worktree);
 
 int
-compare_file_content (const char *path, SeafStat *st, 
+compare_file_content (const char *path, SeafStat *st,
+                      const char *repo_id,
                       const unsigned char *ce_sha1,
                       struct SeafileCrypt *crypt,
                       int repo_version);
@@ -1,9 +1,16 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* for open_by_handle_at() */
+#endif
+
 #include "common.h"
 
 #include <sys/select.h>
 #include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
 #include <sys/ioctl.h>
+#include <fcntl.h>
 #include <dirent.h>
 
 #include <sys/time.h>
@@ -14,6 +21,8 @@
 #include "seafile-session.h"
 #include "utils.h"
 #include "wt-monitor.h"
+#include "sync-filter.h"
+#include "seafile-config.h"
 #define DEBUG_FLAG SEAFILE_DEBUG_WATCH
 #include "log.h"
 
@@ -40,16 +49,47 @@ typedef struct RepoWatchInfo {
     RenameInfo *rename_info;
     EventInfo last_event;
     char *worktree;
+    /* Set if the repo is watched by the fanotify group. The handle of
+     * the repo is then an fd of the worktree, used to resolve the file
+     * handles in the events. */
+    gboolean fanotify;
+    fsid_t fsid;
+    char *real_worktree;
+
+    /* The watches of a worktree are set up in the background. @lock
+     * protects @mapping and @removed between the setup thread and the
+     * monitor thread. */
+    pthread_mutex_t lock;
+    gboolean removed;
+    gint ref_count;
 } RepoWatchInfo;
 
 #define WATCH_MASK IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB
 
+/* Number of worktrees whose watches are set up at the same time. */
+#define WATCH_SETUP_THREADS 4
+
+/* Initial size of the buffer events are read into. */
+#define EVENT_BUF_SIZE 65536
+
 struct SeafWTMonitorPriv {
     pthread_mutex_t hash_lock;
-    GHashTable *handle_hash;        /* repo_id -> inotify_fd */
-    GHashTable *info_hash;          /* inotify_fd -> RepoWatchInfo */
+    GHashTable *handle_hash;        /* repo_id -> inotify_fd or worktree fd */
+    GHashTable *info_hash;          /* inotify_fd or worktree fd -> RepoWatchInfo */
     fd_set read_fds;
     int maxfd;
+
+    /* Reused for reading the events of all repos. */
+    char *event_buf;
+    size_t event_buf_size;
+
+    /* fanotify group reporting the events of the filesystems of all
+     * worktrees, -1 if fanotify is not used. */
+    int fan_fd;
+    /* Packed file handle of a dir -> its absolute path. */
+    GHashTable *dir_handles;
+
+    GThreadPool *setup_pool;
 };
 
 static void *wt_monitor_job_linux (void *vmonitor);
@@ -61,6 +101,9 @@ add_watch_recursive (RepoWatchInfo *info, int in_fd,
                      const char *worktree, const char *path,
                      gboolean add_events);
 
+static void
+repo_watch_info_unref (RepoWatchInfo *info);
+
 /* WatchPathMapping */
 
 static WatchPathMapping *create_mapping ()
@@ -133,6 +176,8 @@ create_repo_watch_info (const char *repo_id, const char *worktree)
     info->mapping = mapping;
     info->rename_info = rename_info;
     info->worktree = g_strdup(worktree);
+    pthread_mutex_init (&info->lock, NULL);
+    info->ref_count = 1;
 
     return info;
 }
@@ -140,13 +185,28 @@ create_repo_watch_info (const char *repo_id, const char *worktree)
 static void
 free_repo_watch_info (RepoWatchInfo *info)
 {
+    pthread_mutex_destroy (&info->lock);
     wt_status_unref (info->status);
     free_mapping (info->mapping);
     free_rename_info (info->rename_info);
     g_free (info->worktree);
+    g_free (info->real_worktree);
     g_free (info);
 }
 
+static void
+repo_watch_info_ref (RepoWatchInfo *info)
+{
+    g_atomic_int_inc (&info->ref_count);
+}
+
+static void
+repo_watch_info_unref (RepoWatchInfo *info)
+{
+    if (g_atomic_int_dec_and_test (&info->ref_count))
+        free_repo_watch_info (info);
+}
+
 static void
 add_event_to_queue (WTStatus *status,
                     int type, const char *path, const char *new_path)
@@ -179,9 +239,7 @@ add_event_to_queue (WTStatus *status,
 
     seaf_debug ("Adding event: %s, %s %s\n", name, path, new_path?new_path:"");
 
-    pthread_mutex_lock (&status->q_lock);
-    g_queue_push_tail (status->event_q, event);
-    pthread_mutex_unlock (&status->q_lock);
+    wt_status_push_event (status, event);
 
     if (type == WT_EVENT_CREATE_OR_UPDATE) {
         pthread_mutex_lock (&status->ap_q_lock);
@@ -409,7 +467,11 @@ process_events (SeafWTMonitorPriv *priv, const char *repo_id, int in_fd)
         seaf_warning ("Cannot get inotify event buf size: %s.\n", strerror(errno));
         return FALSE;
     }
-    event_buf = g_new (char, buf_size);
+    if (buf_size > priv->event_buf_size) {
+        priv->event_buf_size = MAX (buf_size, EVENT_BUF_SIZE);
+        priv->event_buf = g_realloc (priv->event_buf, priv->event_buf_size);
+    }
+    event_buf = priv->event_buf;
 
     n = readn (in_fd, event_buf, buf_size);
     if (n < 0) {
@@ -431,8 +493,10 @@ process_events (SeafWTMonitorPriv *priv, const char *repo_id, int in_fd)
         event = (struct inotify_event *)&event_buf[offset];
         offset += sizeof(struct inotify_event) + event->len;
 
-        dir = g_hash_table_lookup (info->mapping->wd_to_path,
-                                   (gpointer)(long)event->wd);
+        pthread_mutex_lock (&info->lock);
+        dir = g_strdup (g_hash_table_lookup (info->mapping->wd_to_path,
+                                             (gpointer)(long)event->wd));
+        pthread_mutex_unlock (&info->lock);
         if (!dir) {
             seaf_warning ("Cannot find path from wd.\n");
             goto out;
@@ -440,15 +504,410 @@ process_events (SeafWTMonitorPriv *priv, const char *repo_id, int in_fd)
 
         process_one_event (in_fd, info, info->worktree, dir,
                            event, (offset >= buf_size));
+        g_free (dir);
     }
 
     ret = TRUE;
 
 out:
-    g_free (event_buf);
     return ret;
 }
 
+/*
+ * fanotify mode.
+ *
+ * Watching a worktree with inotify takes one watch per dir, added by
+ * walking the whole tree, which is slow for large trees and runs into
+ * max_user_watches. When "use_fanotify" is set and the daemon has the
+ * privileges, one fanotify group with a filesystem mark per worktree is
+ * used instead. Events carry the file handle of the parent dir and the
+ * entry name; the dir is resolved to a path with open_by_handle_at() and
+ * the paths are cached. Events outside of all worktrees are dropped.
+ *
+ * fanotify reports no rename cookies. A MOVED_FROM event immediately
+ * followed by a MOVED_TO event in the same repo is taken as a rename,
+ * like the consecutive events with the same cookie in inotify mode.
+ */
+
+#ifdef FAN_REPORT_DFID_NAME
+
+#define FAN_WATCH_MASK (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | \
+                        FAN_MODIFY | FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_ONDIR)
+
+#define DIR_HANDLES_CACHE_MAX 10000
+
+static int
+init_fanotify ()
+{
+    int fd;
+
+    fd = fanotify_init (FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                        FAN_CLOEXEC | FAN_NONBLOCK,
+                        O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        seaf_message ("[wt mon] fanotify is not available (%s), "
+                      "use inotify instead.\n", strerror(errno));
+        return -1;
+    }
+
+    seaf_message ("[wt mon] Use fanotify to watch worktrees.\n");
+    return fd;
+}
+
+static int
+add_fanotify_watch (SeafWTMonitorPriv *priv,
+                    const char *repo_id, const char *worktree)
+{
+    RepoWatchInfo *info;
+    struct statfs stfs;
+    char *real_worktree;
+    int fd;
+
+    fd = open (worktree, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        seaf_warning ("[wt mon] Failed to open %s: %s.\n",
+                      worktree, strerror(errno));
+        return -1;
+    }
+
+    real_worktree = realpath (worktree, NULL);
+    if (!real_worktree || fstatfs (fd, &stfs) < 0) {
+        seaf_warning ("[wt mon] Failed to stat %s: %s.\n",
+                      worktree, strerror(errno));
+        goto error;
+    }
+
+    if (fanotify_mark (priv->fan_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                       FAN_WATCH_MASK, fd, NULL) < 0) {
+        seaf_message ("[wt mon] Failed to add fanotify mark for %s: %s, "
+                      "use inotify instead.\n", worktree, strerror(errno));
+        goto error;
+    }
+
+    info = create_repo_watch_info (repo_id, worktree);
+    info->fanotify = TRUE;
+    info->fsid = stfs.f_fsid;
+    info->real_worktree = g_strdup (real_worktree);
+    free (real_worktree);
+
+    pthread_mutex_lock (&priv->hash_lock);
+    g_hash_table_insert (priv->handle_hash, g_strdup(repo_id), (gpointer)(long)fd);
+    g_hash_table_insert (priv->info_hash, (gpointer)(long)fd, info);
+    pthread_mutex_unlock (&priv->hash_lock);
+
+    add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+
+    return fd;
+
+error:
+    free (real_worktree);
+    close (fd);
+    return -1;
+}
+
+static char *
+handle_to_key (struct file_handle *handle)
+{
+    GString *key = g_string_sized_new (2 * handle->handle_bytes + 8);
+    unsigned int i;
+
+    g_string_append_printf (key, "%d:", handle->handle_type);
+    for (i = 0; i < handle->handle_bytes; ++i)
+        g_string_append_printf (key, "%02x", handle->f_handle[i]);
+
+    return g_string_free (key, FALSE);
+}
+
+/* Returns the absolute path of the dir in @fid, or NULL if it isn't on the
+ * filesystem of a watched worktree or can't be resolved. */
+static const char *
+resolve_dir_handle (SeafWTMonitorPriv *priv, struct fanotify_event_info_fid *fid)
+{
+    struct file_handle *handle = (struct file_handle *)fid->handle;
+    GHashTableIter iter;
+    gpointer key, value;
+    RepoWatchInfo *info;
+    int mount_fd = -1, fd;
+    char proc_path[64];
+    char path[SEAF_PATH_MAX];
+    ssize_t len;
+    char *hkey;
+    const char *ret;
+
+    hkey = handle_to_key (handle);
+    ret = g_hash_table_lookup (priv->dir_handles, hkey);
+    if (ret) {
+        g_free (hkey);
+        return ret;
+    }
+
+    g_hash_table_iter_init (&iter, priv->info_hash);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        info = value;
+        if (info->fanotify &&
+            memcmp (&info->fsid, &fid->fsid, sizeof(info->fsid)) == 0) {
+            mount_fd = (int)(long)key;
+            break;
+        }
+    }
+    if (mount_fd < 0) {
+        g_free (hkey);
+        return NULL;
+    }
+
+    fd = open_by_handle_at (mount_fd, handle, O_PATH | O_CLOEXEC);
+    if (fd < 0) {
+        /* The dir may have been removed already. */
+        g_free (hkey);
+        return NULL;
+    }
+
+    snprintf (proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    len = readlink (proc_path, path, sizeof(path) - 1);
+    close (fd);
+    if (len < 0) {
+        g_free (hkey);
+        return NULL;
+    }
+    path[len] = 0;
+
+    if (g_hash_table_size (priv->dir_handles) >= DIR_HANDLES_CACHE_MAX)
+        g_hash_table_remove_all (priv->dir_handles);
+    ret = g_strdup (path);
+    g_hash_table_insert (priv->dir_handles, hkey, (char *)ret);
+
+    return ret;
+}
+
+/* Find the repo @path is in. Returns the path relative to the worktree. */
+static RepoWatchInfo *
+find_fanotify_repo (SeafWTMonitorPriv *priv, const char *path, const char **relpath)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    RepoWatchInfo *info;
+    size_t len;
+
+    g_hash_table_iter_init (&iter, priv->info_hash);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        info = value;
+        if (!info->fanotify)
+            continue;
+        len = strlen (info->real_worktree);
+        if (strncmp (path, info->real_worktree, len) != 0)
+            continue;
+        if (path[len] == 0) {
+            *relpath = "";
+            return info;
+        }
+        if (path[len] == '/') {
+            *relpath = path + len + 1;
+            return info;
+        }
+    }
+
+    return NULL;
+}
+
+typedef struct FanMove {
+    RepoWatchInfo *info;
+    char *path;
+} FanMove;
+
+static void
+flush_fan_move (FanMove *move)
+{
+    if (!move->info)
+        return;
+
+    add_event_to_queue (move->info->status, WT_EVENT_DELETE, move->path, NULL);
+    g_atomic_int_set (&move->info->status->last_changed, (gint)time(NULL));
+    g_free (move->path);
+    move->path = NULL;
+    move->info = NULL;
+}
+
+#define FAN_MOVE_MASK(m) ((m) & ~FAN_ONDIR)
+
+static void
+process_one_fan_event (SeafWTMonitorPriv *priv, guint64 mask,
+                       struct fanotify_event_info_fid *fid, FanMove *move)
+{
+    struct file_handle *handle = (struct file_handle *)fid->handle;
+    const char *name = (const char *)handle->f_handle + handle->handle_bytes;
+    const char *dir, *relpath;
+    RepoWatchInfo *info;
+    WTStatus *status;
+    char *filename, *fullpath;
+    SeafStat st;
+    gboolean exists;
+    gboolean update_last_changed = TRUE;
+
+    /* Renamed or removed dirs invalidate the cached paths. */
+    if ((mask & FAN_ONDIR) && (mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE)))
+        g_hash_table_remove_all (priv->dir_handles);
+
+    dir = resolve_dir_handle (priv, fid);
+    if (!dir) {
+        flush_fan_move (move);
+        return;
+    }
+    info = find_fanotify_repo (priv, dir, &relpath);
+    if (!info) {
+        flush_fan_move (move);
+        return;
+    }
+    status = info->status;
+
+    if (strcmp (name, ".") == 0) {
+        /* Event on the dir itself. */
+        if (relpath[0] == 0)
+            return;
+        filename = g_strdup (relpath);
+    } else {
+        filename = g_build_filename (relpath, name, NULL);
+    }
+
+    if (FAN_MOVE_MASK(mask) == FAN_MOVED_TO && move->info == info) {
+        add_event_to_queue (status, WT_EVENT_RENAME, move->path, filename);
+        g_free (move->path);
+        move->path = NULL;
+        move->info = NULL;
+        goto out;
+    }
+    flush_fan_move (move);
+
+    if (FAN_MOVE_MASK(mask) == FAN_MOVED_FROM) {
+        move->info = info;
+        move->path = filename;
+        filename = NULL;
+        update_last_changed = FALSE;
+        goto out;
+    }
+
+    /* Events on the same entry may be merged into one, so check whether
+     * the entry still exists instead of relying on the order of the bits.
+     */
+    fullpath = g_build_filename (info->worktree, filename, NULL);
+    exists = (seaf_stat (fullpath, &st) == 0 || lstat (fullpath, &st) == 0);
+    g_free (fullpath);
+
+    if (!exists) {
+        if (mask & (FAN_DELETE | FAN_MOVED_FROM))
+            add_event_to_queue (status, WT_EVENT_DELETE, filename, NULL);
+        else
+            update_last_changed = FALSE;
+    } else if (mask & (FAN_MODIFY | FAN_CLOSE_WRITE | FAN_MOVED_TO)) {
+        add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, filename, NULL);
+    } else if (mask & FAN_CREATE) {
+        /* Like in inotify mode, files are only indexed after they're
+         * written. */
+        if (S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode))
+            add_event_to_queue (status, WT_EVENT_CREATE_OR_UPDATE, filename, NULL);
+        else
+            update_last_changed = FALSE;
+    } else if (mask & FAN_ATTRIB) {
+        add_event_to_queue (status, WT_EVENT_ATTRIB, filename, NULL);
+    } else {
+        update_last_changed = FALSE;
+    }
+
+out:
+    g_free (filename);
+    if (update_last_changed)
+        g_atomic_int_set (&status->last_changed, (gint)time(NULL));
+}
+
+static void
+add_overflow_events (SeafWTMonitorPriv *priv)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    RepoWatchInfo *info;
+
+    g_hash_table_iter_init (&iter, priv->info_hash);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        info = value;
+        if (info->fanotify)
+            add_event_to_queue (info->status, WT_EVENT_OVERFLOW, NULL, NULL);
+    }
+}
+
+static void
+process_fan_events (SeafWTMonitorPriv *priv)
+{
+    struct fanotify_event_metadata *meta;
+    struct fanotify_event_info_fid *fid;
+    FanMove move = { NULL, NULL };
+    ssize_t len;
+
+    if (!priv->event_buf) {
+        priv->event_buf_size = EVENT_BUF_SIZE;
+        priv->event_buf = g_malloc (priv->event_buf_size);
+    }
+
+    /* Drain the queue in batches of whole events. */
+    while (1) {
+        len = read (priv->fan_fd, priv->event_buf, priv->event_buf_size);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            if (len < 0 && errno != EAGAIN)
+                seaf_warning ("[wt mon] Failed to read fanotify events: %s.\n",
+                              strerror(errno));
+            break;
+        }
+
+        meta = (struct fanotify_event_metadata *)priv->event_buf;
+        for (; FAN_EVENT_OK (meta, len); meta = FAN_EVENT_NEXT (meta, len)) {
+            if (meta->vers != FANOTIFY_METADATA_VERSION) {
+                seaf_warning ("[wt mon] Unsupported fanotify metadata version.\n");
+                goto out;
+            }
+
+            if (meta->mask & FAN_Q_OVERFLOW) {
+                flush_fan_move (&move);
+                add_overflow_events (priv);
+                continue;
+            }
+
+            fid = (struct fanotify_event_info_fid *)(meta + 1);
+            if (meta->event_len < sizeof(*meta) + sizeof(*fid) ||
+                fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+                continue;
+
+            process_one_fan_event (priv, meta->mask, fid, &move);
+        }
+    }
+
+out:
+    /* A MOVED_FROM event without MOVED_TO means the entry was moved out. */
+    flush_fan_move (&move);
+}
+
+#else
+
+static int
+init_fanotify ()
+{
+    seaf_message ("[wt mon] fanotify is not supported, use inotify instead.\n");
+    return -1;
+}
+
+static int
+add_fanotify_watch (SeafWTMonitorPriv *priv,
+                    const char *repo_id, const char *worktree)
+{
+    return -1;
+}
+
+static void
+process_fan_events (SeafWTMonitorPriv *priv)
+{
+}
+
+#endif  /* FAN_REPORT_DFID_NAME */
+
 static void *
 wt_monitor_job_linux (void *vmonitor)
 {
@@ -466,6 +925,10 @@ wt_monitor_job_linux (void *vmonitor)
 
     FD_SET (monitor->cmd_pipe[0], &priv->read_fds);
     priv->maxfd = monitor->cmd_pipe[0];
+    if (priv->fan_fd >= 0) {
+        FD_SET (priv->fan_fd, &priv->read_fds);
+        priv->maxfd = MAX (priv->fan_fd, priv->maxfd);
+    }
 
     while (1) {
         fds = priv->read_fds;
@@ -487,6 +950,9 @@ wt_monitor_job_linux (void *vmonitor)
             handle_watch_command (monitor, &cmd);
         }
 
+        if (priv->fan_fd >= 0 && FD_ISSET (priv->fan_fd, &fds))
+            process_fan_events (priv);
+
         g_hash_table_iter_init (&iter, priv->handle_hash);
         while (g_hash_table_iter_next (&iter, &key, &value)) {
             repo_id = key;
@@ -507,11 +973,12 @@ wt_monitor_job_linux (void *vmonitor)
  * need to add empty dirs to index.
  */
 static int
-add_watch_recursive (RepoWatchInfo *info,
-                     int in_fd,
-                     const char *worktree,
-                     const char *path,
-                     gboolean add_events)
+add_watch_filtered (RepoWatchInfo *info,
+                    int in_fd,
+                    const char *worktree,
+                    const char *path,
+                    gboolean add_events,
+                    SyncFilter *filter)
 {
     char *full_path;
     SeafStat st;
@@ -526,6 +993,10 @@ add_watch_recursive (RepoWatchInfo *info,
         goto out;
     }
 
+    /* Paths left out by the sync filter are not watched. */
+    if (!sync_filter_is_synced (filter, path, S_ISDIR(st.st_mode)))
+        goto out;
+
     if (add_events && path[0] != 0)
         add_event_to_queue (info->status, WT_EVENT_CREATE_OR_UPDATE,
                             path, NULL);
@@ -533,14 +1004,21 @@ add_watch_recursive (RepoWatchInfo *info,
     if (S_ISDIR (st.st_mode)) {
         seaf_debug ("Watching %s.\n", full_path);
 
+        /* The fd is closed once the repo is removed. */
+        pthread_mutex_lock (&info->lock);
+        if (info->removed) {
+            pthread_mutex_unlock (&info->lock);
+            goto out;
+        }
         wd = inotify_add_watch (in_fd, full_path, (uint32_t)WATCH_MASK);
         if (wd < 0) {
+            pthread_mutex_unlock (&info->lock);
             seaf_warning ("[wt mon] fail to add watch to %s: %s.\n",
                           full_path, strerror(errno));
             goto out;
         }
-
         add_mapping (info->mapping, path, wd);
+        pthread_mutex_unlock (&info->lock);
 
         dir = opendir (full_path);
         if (!dir) {
@@ -565,9 +1043,11 @@ add_watch_recursive (RepoWatchInfo *info,
              */
             if (dent->d_type == DT_DIR || dent->d_type == DT_LNK ||
                 dent->d_type == DT_UNKNOWN)
-                add_watch_recursive (info, in_fd, worktree, sub_path, add_events);
+                add_watch_filtered (info, in_fd, worktree, sub_path, add_events,
+                                    filter);
 
-            if (dent->d_type == DT_REG && add_events)
+            if (dent->d_type == DT_REG && add_events &&
+                sync_filter_is_synced (filter, sub_path, FALSE))
                 add_event_to_queue (info->status, WT_EVENT_CREATE_OR_UPDATE,
                                     sub_path, NULL);
             g_free (sub_path);
@@ -581,11 +1061,63 @@ out:
     return 0;
 }
 
+static int
+add_watch_recursive (RepoWatchInfo *info,
+                     int in_fd,
+                     const char *worktree,
+                     const char *path,
+                     gboolean add_events)
+{
+    SeafRepo *repo;
+    SyncFilter *filter = NULL;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, info->status->repo_id);
+    if (repo)
+        filter = seaf_repo_ref_sync_filter (repo);
+
+    add_watch_filtered (info, in_fd, worktree, path, add_events, filter);
+
+    sync_filter_unref (filter);
+    return 0;
+}
+
+typedef struct WatchSetupJob {
+    RepoWatchInfo *info;
+    int in_fd;
+} WatchSetupJob;
+
+static void
+setup_watches (gpointer data, gpointer user_data)
+{
+    WatchSetupJob *job = data;
+    RepoWatchInfo *info = job->info;
+    gboolean removed;
+
+    add_watch_recursive (info, job->in_fd, info->worktree, "", FALSE);
+
+    pthread_mutex_lock (&info->lock);
+    removed = info->removed;
+    pthread_mutex_unlock (&info->lock);
+
+    /* Changes made before a dir was watched are not reported, so the whole
+     * worktree is scanned once all the watches are in place.
+     */
+    if (!removed) {
+        add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+        g_atomic_int_set (&info->status->last_changed, (gint)time(NULL));
+    }
+
+    repo_watch_info_unref (info);
+    g_free (job);
+}
+
 static int
 add_watch (SeafWTMonitorPriv *priv, const char *repo_id, const char *worktree)
 {
     int inotify_fd;
     RepoWatchInfo *info;
+    WatchSetupJob *job;
+    int wd;
 
     inotify_fd = inotify_init ();
     if (inotify_fd < 0) {
@@ -601,7 +1133,13 @@ add_watch (SeafWTMonitorPriv *priv, const char *repo_id, const char *worktree)
     g_hash_table_insert (priv->info_hash, (gpointer)(long)inotify_fd, info);
     pthread_mutex_unlock (&priv->hash_lock);
 
-    if (add_watch_recursive (info, inotify_fd, worktree, "", FALSE) < 0) {
+    /* Only the root is watched here, so that a large worktree doesn't
+     * block the monitor thread. The subdirs are walked by the setup pool.
+     */
+    wd = inotify_add_watch (inotify_fd, worktree, (uint32_t)WATCH_MASK);
+    if (wd < 0) {
+        seaf_warning ("[wt mon] fail to add watch to %s: %s.\n",
+                      worktree, strerror(errno));
         close (inotify_fd);
         pthread_mutex_lock (&priv->hash_lock);
         g_hash_table_remove (priv->handle_hash, repo_id);
@@ -609,9 +1147,15 @@ add_watch (SeafWTMonitorPriv *priv, const char *repo_id, const char *worktree)
         pthread_mutex_unlock (&priv->hash_lock);
         return -1;
     }
+    pthread_mutex_lock (&info->lock);
+    add_mapping (info->mapping, "", wd);
+    pthread_mutex_unlock (&info->lock);
 
-    /* A special event indicates repo-mgr to scan the whole worktree. */
-    add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+    job = g_new0 (WatchSetupJob, 1);
+    repo_watch_info_ref (info);
+    job->info = info;
+    job->in_fd = inotify_fd;
+    g_thread_pool_push (priv->setup_pool, job, NULL);
 
     return inotify_fd;
 }
@@ -622,6 +1166,9 @@ static int handle_add_repo (SeafWTMonitorPriv *priv,
 {
     int inotify_fd;
 
+    if (priv->fan_fd >= 0 && add_fanotify_watch (priv, repo_id, worktree) >= 0)
+        return 0;
+
     inotify_fd = add_watch (priv, repo_id, worktree);
     if (inotify_fd < 0) {
         return -1;
@@ -638,7 +1185,7 @@ update_maxfd (SeafWTMonitor *monitor)
     SeafWTMonitorPriv *priv = monitor->priv;
     GHashTableIter iter;
     gpointer key, value;
-    int fd, maxfd = monitor->cmd_pipe[0];
+    int fd, maxfd = MAX (monitor->cmd_pipe[0], priv->fan_fd);
 
     g_hash_table_iter_init (&iter, priv->info_hash);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
@@ -656,16 +1203,31 @@ static int handle_rm_repo (SeafWTMonitor *monitor,
 {
     SeafWTMonitorPriv *priv = monitor->priv;
     int inotify_fd = (int)(long)handle;
+    RepoWatchInfo *info;
 
+    /* Stop the setup thread from adding watches to the fd. */
+    pthread_mutex_lock (&priv->hash_lock);
+    info = g_hash_table_lookup (priv->info_hash, (gpointer)(long)inotify_fd);
+    pthread_mutex_unlock (&priv->hash_lock);
+    if (info) {
+        pthread_mutex_lock (&info->lock);
+        info->removed = TRUE;
+        pthread_mutex_unlock (&info->lock);
+    }
+
+    /* For fanotify repos this is the worktree fd. The filesystem mark is
+     * kept, since it may be shared with other worktrees.
+     */
     close (inotify_fd);
     FD_CLR (inotify_fd, &priv->read_fds);
-    update_maxfd (monitor);
 
     pthread_mutex_lock (&priv->hash_lock);
     g_hash_table_remove (priv->handle_hash, repo_id);
     g_hash_table_remove (priv->info_hash, (gpointer)(long)inotify_fd);
     pthread_mutex_unlock (&priv->hash_lock);
 
+    update_maxfd (monitor);
+
     return 0;
 }
 
@@ -740,7 +1302,15 @@ seaf_wt_monitor_new (SeafileSession *seaf)
         (g_str_hash, g_str_equal, g_free, NULL);
 
     priv->info_hash = g_hash_table_new_full
-        (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)free_repo_watch_info);
+        (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)repo_watch_info_unref);
+
+    priv->dir_handles = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, g_free);
+    priv->setup_pool = g_thread_pool_new (setup_watches, NULL,
+                                          WATCH_SETUP_THREADS, FALSE, NULL);
+    priv->fan_fd = -1;
+    if (seafile_session_config_get_bool (seaf, KEY_USE_FANOTIFY))
+        priv->fan_fd = init_fanotify ();
 
     monitor->priv = priv;
     monitor->seaf = seaf;
@@ -19,6 +19,16 @@
 typedef struct RepoWatchInfo {
     WTStatus *status;
     char *worktree;
+
+    /* FSEvents database of the worktree's volume. Event ids are only
+     * meaningful within the same database.
+     */
+    char *device_uuid;
+    /* Id of the last event delivered, and the one saved in the repo
+     * properties. Only accessed in the monitor thread.
+     */
+    FSEventStreamEventId last_event_id;
+    FSEventStreamEventId saved_event_id;
 } RepoWatchInfo;
 
 struct SeafWTMonitorPriv {
@@ -27,6 +37,9 @@ struct SeafWTMonitorPriv {
     GHashTable *info_hash;          /* inotify_fd(or handle in deeed) -> RepoWatchInfo */
 };
 
+/* How often the event ids of the repos are saved, in seconds. */
+#define SAVE_EVENT_ID_INTERVAL 10
+
 static void
 add_event_to_queue (WTStatus *status,
                     int type, const char *path, const char *new_path);
@@ -52,6 +65,7 @@ free_repo_watch_info (RepoWatchInfo *info)
 {
     wt_status_unref (info->status);
     g_free (info->worktree);
+    g_free (info->device_uuid);
     g_free (info);
 }
 
@@ -97,9 +111,7 @@ add_event_to_queue (WTStatus *status,
 
     seaf_debug ("Adding event: %s, %s %s\n", name, path, new_path?new_path:"");
 
-    pthread_mutex_lock (&status->q_lock);
-    g_queue_push_tail (status->event_q, event);
-    pthread_mutex_unlock (&status->q_lock);
+    wt_status_push_event (status, event);
 
     if (type == WT_EVENT_CREATE_OR_UPDATE) {
         pthread_mutex_lock (&status->ap_q_lock);
@@ -253,17 +265,175 @@ stream_callback (ConstFSEventStreamRef streamRef,
     for (i = 0; i < numEvents; i++) {
         seaf_debug("%ld Change %llu in %s, flags %x\n", (long)CFRunLoopGetCurrent(),
                    eventIds[i], paths[i], eventFlags[i]);
+        if (eventIds[i] > info->last_event_id)
+            info->last_event_id = eventIds[i];
+
+        if (eventFlags[i] & kFSEventStreamEventFlagHistoryDone)
+            continue;
+
+        /* Events were coalesced or lost, e.g. the history we resumed from
+         * has been purged. Fall back to a full scan.
+         */
+        if (eventFlags[i] & (kFSEventStreamEventFlagMustScanSubDirs |
+                             kFSEventStreamEventFlagUserDropped |
+                             kFSEventStreamEventFlagKernelDropped |
+                             kFSEventStreamEventFlagEventIdsWrapped |
+                             kFSEventStreamEventFlagRootChanged)) {
+            seaf_message ("[wt mon] Events of %s were dropped, rescan worktree.\n",
+                          info->worktree);
+            add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+            g_atomic_int_set (&info->status->last_changed, (gint)time(NULL));
+            continue;
+        }
+
         process_one_event (paths[i], info, info->worktree,
                            eventIds[i], eventFlags[i]);
     }
 }
 
+/*
+ * The last event id is saved in the repo property REPO_PROP_FSEVENTS_ID as
+ * "<device uuid>:<event id>". When the daemon restarts, the stream resumes
+ * from there and FSEvents replays the changes made while it was down, so
+ * there's no need to scan the whole worktree.
+ */
+
+static char *
+get_device_uuid (const char *worktree)
+{
+    SeafStat st;
+    CFUUIDRef uuid;
+    CFStringRef str;
+    char buf[64];
+    char *ret = NULL;
+
+    if (seaf_stat (worktree, &st) < 0)
+        return NULL;
+
+    uuid = FSEventsCopyUUIDForDevice (st.st_dev);
+    if (!uuid)
+        return NULL;
+
+    str = CFUUIDCreateString (kCFAllocatorDefault, uuid);
+    if (str && CFStringGetCString (str, buf, sizeof(buf), kCFStringEncodingUTF8))
+        ret = g_strdup (buf);
+
+    if (str)
+        CFRelease (str);
+    CFRelease (uuid);
+    return ret;
+}
+
+static FSEventStreamEventId
+load_event_id (const char *repo_id, const char *device_uuid)
+{
+    char *value, *sep;
+    FSEventStreamEventId id = kFSEventStreamEventIdSinceNow;
+
+    if (!device_uuid)
+        return id;
+
+    value = seaf_repo_manager_get_repo_property (seaf->repo_mgr, repo_id,
+                                                 REPO_PROP_FSEVENTS_ID);
+    if (!value)
+        return id;
+
+    sep = strrchr (value, ':');
+    if (sep) {
+        *sep = '\0';
+        if (strcmp (value, device_uuid) == 0)
+            id = (FSEventStreamEventId)g_ascii_strtoull (sep + 1, NULL, 10);
+    }
+    if (id == 0)
+        id = kFSEventStreamEventIdSinceNow;
+
+    g_free (value);
+    return id;
+}
+
+typedef struct SavedEventId {
+    char repo_id[37];
+    char *value;
+} SavedEventId;
+
+static void
+collect_event_id (gpointer key, gpointer value, gpointer user_data)
+{
+    RepoWatchInfo *info = value;
+    GList **pids = user_data;
+    SavedEventId *saved;
+    gboolean drained;
+
+    if (!info->device_uuid || info->last_event_id == info->saved_event_id)
+        return;
+
+    /* Only save the id after repo-mgr has taken all the queued events.
+     * Otherwise they would be lost if the daemon exits now.
+     */
+    pthread_mutex_lock (&info->status->q_lock);
+    drained = g_queue_is_empty (info->status->event_q);
+    pthread_mutex_unlock (&info->status->q_lock);
+    if (!drained)
+        return;
+
+    saved = g_new0 (SavedEventId, 1);
+    memcpy (saved->repo_id, info->status->repo_id, 36);
+    saved->value = g_strdup_printf ("%s:%llu", info->device_uuid,
+                                    (unsigned long long)info->last_event_id);
+    *pids = g_list_prepend (*pids, saved);
+
+    info->saved_event_id = info->last_event_id;
+}
+
+static void
+save_event_ids_cb (CFRunLoopTimerRef timer, void *vmonitor)
+{
+    SeafWTMonitor *monitor = vmonitor;
+    SeafWTMonitorPriv *priv = monitor->priv;
+    GList *ids = NULL, *ptr;
+    SavedEventId *saved;
+
+    pthread_mutex_lock (&priv->hash_lock);
+    g_hash_table_foreach (priv->info_hash, collect_event_id, &ids);
+    pthread_mutex_unlock (&priv->hash_lock);
+
+    for (ptr = ids; ptr; ptr = ptr->next) {
+        saved = ptr->data;
+        seaf_repo_manager_set_repo_property (seaf->repo_mgr, saved->repo_id,
+                                             REPO_PROP_FSEVENTS_ID, saved->value);
+        g_free (saved->value);
+        g_free (saved);
+    }
+    g_list_free (ids);
+}
+
+static void
+add_save_event_ids_timer (SeafWTMonitor *monitor)
+{
+    CFRunLoopTimerContext ctx = {0, monitor, NULL, NULL, NULL};
+    CFRunLoopTimerRef timer;
+
+    timer = CFRunLoopTimerCreate (kCFAllocatorDefault,
+                                  CFAbsoluteTimeGetCurrent() + SAVE_EVENT_ID_INTERVAL,
+                                  SAVE_EVENT_ID_INTERVAL, 0, 0,
+                                  save_event_ids_cb, &ctx);
+    CFRunLoopAddTimer (CFRunLoopGetCurrent(), timer, kCFRunLoopDefaultMode);
+    CFRelease (timer);
+}
+
 static FSEventStreamRef
 add_watch (SeafWTMonitor *monitor, const char* repo_id, const char* worktree)
 {
     SeafWTMonitorPriv *priv = monitor->priv;
     RepoWatchInfo *info;
     double latency = 0.25; /* unit: second */
+    char *device_uuid;
+    FSEventStreamEventId since, current;
+
+    device_uuid = get_device_uuid (worktree);
+    since = load_event_id (repo_id, device_uuid);
+    /* Taken before the stream starts, so no event after it is missed. */
+    current = FSEventsGetCurrentEventId ();
 
     char *worktree_nfd = g_utf8_normalize (worktree, -1, G_NORMALIZE_NFD);
 
@@ -282,7 +452,7 @@ add_watch (SeafWTMonitor *monitor, const char* repo_id, const char* worktree)
                                  stream_callback,
                                  &ctx,
                                  pathsToWatch,
-                                 kFSEventStreamEventIdSinceNow,
+                                 since,
                                  latency,
                                  kFSEventStreamCreateFlagFileEvents
                                  );
@@ -292,6 +462,7 @@ add_watch (SeafWTMonitor *monitor, const char* repo_id, const char* worktree)
 
     if (!stream) {
         seaf_warning ("[wt] Failed to create event stream.\n");
+        g_free (device_uuid);
         return stream;
     }
 
@@ -305,11 +476,20 @@ add_watch (SeafWTMonitor *monitor, const char* repo_id, const char* worktree)
                          g_strdup(repo_id), (gpointer)(long)stream);
 
     info = create_repo_watch_info (repo_id, worktree);
+    info->device_uuid = device_uuid;
     g_hash_table_insert (priv->info_hash, (gpointer)(long)stream, info);
     pthread_mutex_unlock (&priv->hash_lock);
 
+    if (since != kFSEventStreamEventIdSinceNow) {
+        seaf_debug ("[wt mon] Resume events of repo %s from %llu.\n",
+                    repo_id, (unsigned long long)since);
+        info->last_event_id = info->saved_event_id = since;
+        return stream;
+    }
+
     /* A special event indicates repo-mgr to scan the whole worktree. */
     add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+    info->last_event_id = current;
     return stream;
 }
 
@@ -359,6 +539,7 @@ wt_monitor_job_darwin (void *vmonitor)
     SeafWTMonitor *monitor = (SeafWTMonitor *)vmonitor;
 
     add_command_pipe (monitor);
+    add_save_event_ids_timer (monitor);
     while (1) {
         CFRunLoopRun();
     }
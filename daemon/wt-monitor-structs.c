@@ -1,4 +1,5 @@
 #include <string.h>
+#include <time.h>
 
 #include "wt-monitor-structs.h"
 
@@ -42,6 +43,10 @@ WTStatus *create_wt_status (const char *repo_id)
     memcpy (status->repo_id, repo_id, 36);
     status->event_q = g_queue_new ();
     pthread_mutex_init (&status->q_lock, NULL);
+    status->pending_updates = g_hash_table_new (g_str_hash, g_str_equal);
+    status->pending_attribs = g_hash_table_new (g_str_hash, g_str_equal);
+    status->write_stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, g_free);
 
     status->active_paths = g_queue_new ();
     pthread_mutex_init (&status->ap_q_lock, NULL);
@@ -66,6 +71,9 @@ static void free_wt_status (WTStatus *status)
         g_queue_foreach (status->event_q, free_event_cb, NULL);
         g_queue_free (status->event_q);
     }
+    g_hash_table_destroy (status->pending_updates);
+    g_hash_table_destroy (status->pending_attribs);
+    g_hash_table_destroy (status->write_stats);
     pthread_mutex_destroy (&status->q_lock);
     g_free (status);
 }
@@ -84,3 +92,285 @@ wt_status_unref (WTStatus *status)
     if (--(status->ref_count) <= 0)
         free_wt_status (status);
 }
+
+/*
+ * Event coalescing.
+ *
+ * Processing a CREATE_OR_UPDATE or ATTRIB event looks at the current state
+ * of the path in the worktree, so a second such event for the same path
+ * adds nothing as long as the first one is still queued. Tools that rewrite
+ * the same files over and over then only cost one event per path.
+ *
+ * Other events depend on their order, so when a delete, rename, overflow
+ * or scan event is queued, the pending paths are forgotten and later events
+ * are queued as usual. A delete removes the queued updates of its path
+ * first, since there's nothing left to update. The event at the head of the
+ * queue may be looked at by the committer, so it's never removed.
+ */
+
+static void
+forget_pending_event (WTStatus *status, GList *link)
+{
+    WTEvent *event = link->data;
+    GHashTable *pending;
+
+    if (!event->path)
+        return;
+
+    if (event->ev_type == WT_EVENT_CREATE_OR_UPDATE)
+        pending = status->pending_updates;
+    else if (event->ev_type == WT_EVENT_ATTRIB)
+        pending = status->pending_attribs;
+    else
+        return;
+
+    if (g_hash_table_lookup (pending, event->path) == link)
+        g_hash_table_remove (pending, event->path);
+}
+
+static void
+drop_pending_event (WTStatus *status, GHashTable *pending, const char *path)
+{
+    GList *link = g_hash_table_lookup (pending, path);
+
+    if (!link || link == status->event_q->head)
+        return;
+
+    g_hash_table_remove (pending, path);
+    /* Not the head, so there is an event before it. */
+    if (link->data == status->last_event)
+        status->last_event = link->prev->data;
+    wt_event_free (link->data);
+    g_queue_delete_link (status->event_q, link);
+}
+
+typedef struct WriteStats {
+    gint64 window_start;
+    int n_writes;
+    gint64 last_write;
+    /* When the update was first deferred, 0 if not deferred. */
+    gint64 deferred_since;
+    /* The deferred update has been queued again. */
+    gboolean requeued;
+} WriteStats;
+
+/*
+ * A single save raises several events for the path (one per write() on
+ * Linux, and one when the file is closed). They are all merged into the
+ * pending update, so only an update that isn't pending yet is counted as a
+ * write, i.e. at most one write per path per index pass. Every event still
+ * moves the time of the last write.
+ */
+static void
+count_write (WTStatus *status, const char *path, gint64 now)
+{
+    WriteStats *stats = g_hash_table_lookup (status->write_stats, path);
+
+    if (!stats) {
+        stats = g_new0 (WriteStats, 1);
+        g_hash_table_insert (status->write_stats, g_strdup (path), stats);
+    }
+
+    if (now - stats->window_start >= WT_HOT_WINDOW) {
+        stats->window_start = now;
+        stats->n_writes = 0;
+    }
+    if (!g_hash_table_lookup (status->pending_updates, path))
+        ++stats->n_writes;
+    stats->last_write = now;
+}
+
+/* Called with q_lock held. */
+static void
+queue_event (WTStatus *status, WTEvent *event)
+{
+    GHashTable *pending = NULL;
+
+    switch (event->ev_type) {
+    case WT_EVENT_CREATE_OR_UPDATE:
+        pending = status->pending_updates;
+        break;
+    case WT_EVENT_ATTRIB:
+        pending = status->pending_attribs;
+        break;
+    case WT_EVENT_DELETE:
+        if (event->path) {
+            drop_pending_event (status, status->pending_updates, event->path);
+            drop_pending_event (status, status->pending_attribs, event->path);
+        }
+        /* fall through */
+    default:
+        g_hash_table_remove_all (status->pending_updates);
+        g_hash_table_remove_all (status->pending_attribs);
+    }
+
+    if (pending && event->path) {
+        if (g_hash_table_lookup (pending, event->path)) {
+            wt_event_free (event);
+            return;
+        }
+        g_queue_push_tail (status->event_q, event);
+        g_hash_table_insert (pending, event->path, status->event_q->tail);
+    } else {
+        g_queue_push_tail (status->event_q, event);
+    }
+}
+
+void
+wt_status_push_event (WTStatus *status, WTEvent *event)
+{
+    pthread_mutex_lock (&status->q_lock);
+
+    if (event->path) {
+        if (event->ev_type == WT_EVENT_CREATE_OR_UPDATE)
+            count_write (status, event->path, (gint64)time(NULL));
+        else if (event->ev_type == WT_EVENT_DELETE)
+            g_hash_table_remove (status->write_stats, event->path);
+    }
+
+    queue_event (status, event);
+
+    pthread_mutex_unlock (&status->q_lock);
+}
+
+gboolean
+wt_status_update_is_hot (WTStatus *status, const char *path,
+                         gint64 now, int settle_time)
+{
+    WriteStats *stats;
+    gboolean ret = FALSE;
+
+    if (settle_time <= 0)
+        return FALSE;
+
+    pthread_mutex_lock (&status->q_lock);
+
+    stats = g_hash_table_lookup (status->write_stats, path);
+    if (stats && !stats->requeued &&
+        stats->n_writes >= WT_HOT_WRITES &&
+        now - stats->last_write < settle_time) {
+        if (stats->deferred_since == 0 ||
+            now - stats->deferred_since < WT_MAX_DEFER_TIME)
+            ret = TRUE;
+    }
+    if (!ret && stats) {
+        stats->deferred_since = 0;
+        stats->requeued = FALSE;
+    }
+
+    pthread_mutex_unlock (&status->q_lock);
+
+    return ret;
+}
+
+void
+wt_status_defer_update (WTStatus *status, const char *path, gint64 now)
+{
+    WriteStats *stats;
+
+    pthread_mutex_lock (&status->q_lock);
+
+    stats = g_hash_table_lookup (status->write_stats, path);
+    if (stats && stats->deferred_since == 0)
+        stats->deferred_since = now;
+
+    pthread_mutex_unlock (&status->q_lock);
+}
+
+int
+wt_status_requeue_settled (WTStatus *status, gint64 now, int settle_time)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    WriteStats *stats;
+    gboolean settled;
+    int n = 0;
+
+    pthread_mutex_lock (&status->q_lock);
+
+    g_hash_table_iter_init (&iter, status->write_stats);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        stats = value;
+
+        if (stats->requeued)
+            continue;
+
+        if (stats->deferred_since == 0) {
+            if (now - stats->last_write >= WT_HOT_WINDOW)
+                g_hash_table_iter_remove (&iter);
+            continue;
+        }
+
+        settled = (now - stats->last_write >= settle_time ||
+                   now - stats->deferred_since >= WT_MAX_DEFER_TIME);
+        if (settled) {
+            /* Not counted as a write. */
+            queue_event (status, wt_event_new (WT_EVENT_CREATE_OR_UPDATE,
+                                               key, NULL));
+            stats->requeued = TRUE;
+            ++n;
+        }
+    }
+
+    pthread_mutex_unlock (&status->q_lock);
+
+    return n;
+}
+
+WTEvent *
+wt_status_pop_event (WTStatus *status, WTEvent **next_event)
+{
+    WTEvent *event = NULL;
+
+    pthread_mutex_lock (&status->q_lock);
+
+    if (status->event_q->head) {
+        forget_pending_event (status, status->event_q->head);
+        event = g_queue_pop_head (status->event_q);
+    }
+    if (next_event)
+        *next_event = g_queue_peek_head (status->event_q);
+
+    pthread_mutex_unlock (&status->q_lock);
+
+    return event;
+}
+
+gboolean
+wt_status_mark_last_event (WTStatus *status)
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&status->q_lock);
+    status->last_event = g_queue_peek_tail (status->event_q);
+    ret = (status->last_event != NULL);
+    pthread_mutex_unlock (&status->q_lock);
+
+    return ret;
+}
+
+gboolean
+wt_status_is_last_event (WTStatus *status, WTEvent *event)
+{
+    gboolean ret;
+
+    pthread_mutex_lock (&status->q_lock);
+    ret = (event == status->last_event);
+    if (ret)
+        status->last_event = NULL;
+    pthread_mutex_unlock (&status->q_lock);
+
+    return ret;
+}
+
+void
+wt_status_get_queue_lengths (WTStatus *status, int *n_events, int *n_active_paths)
+{
+    pthread_mutex_lock (&status->q_lock);
+    *n_events = g_queue_get_length (status->event_q);
+    pthread_mutex_unlock (&status->q_lock);
+
+    pthread_mutex_lock (&status->ap_q_lock);
+    *n_active_paths = g_queue_get_length (status->active_paths);
+    pthread_mutex_unlock (&status->ap_q_lock);
+}
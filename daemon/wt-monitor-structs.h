@@ -43,6 +43,19 @@ typedef struct WTStatus {
 
     pthread_mutex_t q_lock;
     GQueue *event_q;
+    /* Queued CREATE_OR_UPDATE and ATTRIB events, path -> link in event_q.
+     * Protected by q_lock. See wt_status_push_event().
+     */
+    GHashTable *pending_updates;
+    GHashTable *pending_attribs;
+    /* Write frequency of the updated paths, path -> WriteStats.
+     * Protected by q_lock. See wt_status_update_is_hot().
+     */
+    GHashTable *write_stats;
+    /* The last event to process in the current index pass, see
+     * wt_status_mark_last_event(). Protected by q_lock.
+     */
+    WTEvent *last_event;
 
     /* Paths that're updated. They corresponds to CREATE_OR_UPDATE events.
      * Use a separate queue since we need to process them simultaneously with
@@ -59,4 +72,54 @@ void wt_status_ref (WTStatus *status);
 
 void wt_status_unref (WTStatus *status);
 
+/* Add @event to the event queue of @status, taking its ownership. Events
+ * made redundant by the events already queued are merged into them.
+ */
+void wt_status_push_event (WTStatus *status, WTEvent *event);
+
+/* Take the first event from the queue, NULL if the queue is empty. If
+ * @next_event is not NULL, it's set to the event now at the head.
+ */
+WTEvent *wt_status_pop_event (WTStatus *status, WTEvent **next_event);
+
+/* Remember the event now at the tail as the last one of an index pass.
+ * Returns FALSE if the queue is empty.
+ */
+gboolean wt_status_mark_last_event (WTStatus *status);
+
+/* TRUE if @event, just popped, is the last event of the index pass. If
+ * the marked event has been merged into a later one, the event queued
+ * before it becomes the last one.
+ */
+gboolean wt_status_is_last_event (WTStatus *status, WTEvent *event);
+
+/*
+ * Write-settle detection.
+ *
+ * Files that are rewritten over and over, e.g. sqlite databases or mail
+ * stores, would be chunked and uploaded again in every commit. A path
+ * updated at least WT_HOT_WRITES times within WT_HOT_WINDOW seconds is
+ * "hot". Its update is deferred until the file hasn't been written for
+ * @settle_time seconds, then the file is indexed once. A file that never
+ * settles is still indexed every WT_MAX_DEFER_TIME seconds.
+ */
+#define WT_HOT_WRITES 3
+#define WT_HOT_WINDOW 60
+#define WT_MAX_DEFER_TIME 600
+
+/* TRUE if the update of @path should be deferred. */
+gboolean wt_status_update_is_hot (WTStatus *status, const char *path,
+                                  gint64 now, int settle_time);
+
+/* Remember to queue the update of @path again once it settles. */
+void wt_status_defer_update (WTStatus *status, const char *path, gint64 now);
+
+/* Queue the updates of the deferred paths that have settled, and forget
+ * the paths not written for a while. Returns the number of updates queued.
+ */
+int wt_status_requeue_settled (WTStatus *status, gint64 now, int settle_time);
+
+/* Number of queued events and active paths. */
+void wt_status_get_queue_lengths (WTStatus *status, int *n_events, int *n_active_paths);
+
 #endif
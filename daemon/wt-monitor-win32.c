@@ -2,10 +2,11 @@
 #include "common.h"
 
 #ifndef _WIN32_WINNT
-#define _WIN32_WINNT 0x500
+#define _WIN32_WINNT 0x600
 #endif
 
 #include <windows.h>
+#include <winioctl.h>
 
 #ifndef WIN32
 #include <unistd.h>
@@ -51,6 +52,21 @@ typedef struct RepoWatchInfo {
     RenameInfo *rename_info;
     EventInfo last_event;
     char *worktree;
+
+    /* USN change journal of the worktree's volume, NULL if not available. */
+    HANDLE volume_handle;
+    DWORD read_journal_code;
+    DWORDLONG journal_id;
+    /* Journal position when the last two batches of dir changes were
+     * received. Changes lost in an overflow are after @replay_usn.
+     */
+    USN replay_usn;
+    USN last_batch_usn;
+    /* Journal position at the last save tick, and the position saved in
+     * the repo properties.
+     */
+    USN checked_usn;
+    USN saved_usn;
 } RepoWatchInfo;
 
 struct SeafWTMonitorPriv {
@@ -60,11 +76,23 @@ struct SeafWTMonitorPriv {
     GHashTable *buf_hash;       /* handle -> aux buf */
 
     HANDLE iocp_handle;
+    gint64 last_usn_save;
 
     int cmd_bytes_read;
     WatchCommand cmd;
 };
 
+/* How often the journal positions of the repos are saved, in seconds. */
+#define SAVE_USN_INTERVAL 10
+
+#define USN_READ_BUFSIZE (64 << 10)
+
+#define USN_WATCH_REASONS                                               \
+    (USN_REASON_DATA_OVERWRITE | USN_REASON_DATA_EXTEND |               \
+     USN_REASON_DATA_TRUNCATION | USN_REASON_FILE_CREATE |              \
+     USN_REASON_FILE_DELETE | USN_REASON_RENAME_OLD_NAME |              \
+     USN_REASON_RENAME_NEW_NAME | USN_REASON_BASIC_INFO_CHANGE)
+
 static void *wt_monitor_job_win32 (void *vmonitor);
 
 static void handle_watch_command (SeafWTMonitor *monitor, WatchCommand *cmd);
@@ -118,6 +146,8 @@ create_repo_watch_info (const char *repo_id, const char *worktree)
 static void
 free_repo_watch_info (RepoWatchInfo *info)
 {
+    if (info->volume_handle)
+        CloseHandle (info->volume_handle);
     wt_status_unref (info->status);
     free_rename_info (info->rename_info);
     g_free (info->worktree);
@@ -166,9 +196,7 @@ add_event_to_queue (WTStatus *status,
 
     seaf_debug ("Adding event: %s, %s %s\n", name, path, new_path?new_path:"");
 
-    pthread_mutex_lock (&status->q_lock);
-    g_queue_push_tail (status->event_q, event);
-    pthread_mutex_unlock (&status->q_lock);
+    wt_status_push_event (status, event);
 
     if (type == WT_EVENT_CREATE_OR_UPDATE) {
         pthread_mutex_lock (&status->ap_q_lock);
@@ -181,6 +209,362 @@ add_event_to_queue (WTStatus *status,
     }
 }
 
+/*
+ * USN change journal.
+ *
+ * On NTFS volumes every change to a file is recorded in the volume's change
+ * journal, identified by its file reference and its parent dir's. The
+ * journal position is saved per repo in REPO_PROP_USN_JOURNAL as
+ * "<journal id>:<usn>". When the daemon restarts, or the dir change buffer
+ * overflows, the changed files are read back from the journal instead of
+ * scanning the whole worktree. A full scan is still done if the journal is
+ * not available, was re-created or has been truncated past our position.
+ */
+
+static HANDLE
+open_volume_of_path (const char *worktree, DWORD *read_code)
+{
+    wchar_t *path;
+    wchar_t mount_point[MAX_PATH];
+    wchar_t volume_name[MAX_PATH];
+    HANDLE handle;
+    int len;
+
+    path = wchar_from_utf8 (worktree);
+    if (!GetVolumePathNameW (path, mount_point, MAX_PATH) ||
+        !GetVolumeNameForVolumeMountPointW (mount_point, volume_name, MAX_PATH)) {
+        g_free (path);
+        return NULL;
+    }
+    g_free (path);
+
+    /* Opening the volume requires no trailing backslash. */
+    len = wcslen (volume_name);
+    if (len > 0 && volume_name[len - 1] == L'\\')
+        volume_name[len - 1] = 0;
+
+    *read_code = FSCTL_READ_USN_JOURNAL;
+    handle = CreateFileW (volume_name, GENERIC_READ,
+                          FILE_SHARE_READ | FILE_SHARE_WRITE,
+                          NULL, OPEN_EXISTING, 0, NULL);
+#ifdef FSCTL_READ_UNPRIVILEGED_USN_JOURNAL
+    /* Reading the journal through a read handle of the volume requires
+     * admin rights. Windows 10 allows normal users to read it too.
+     */
+    if (handle == INVALID_HANDLE_VALUE) {
+        *read_code = FSCTL_READ_UNPRIVILEGED_USN_JOURNAL;
+        handle = CreateFileW (volume_name, FILE_READ_ATTRIBUTES,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE,
+                              NULL, OPEN_EXISTING, 0, NULL);
+    }
+#endif
+    if (handle == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    return handle;
+}
+
+static gboolean
+query_usn_journal (HANDLE volume, USN_JOURNAL_DATA_V0 *data)
+{
+    DWORD n;
+
+    return DeviceIoControl (volume, FSCTL_QUERY_USN_JOURNAL, NULL, 0,
+                            data, sizeof(*data), &n, NULL);
+}
+
+static gboolean
+get_next_usn (RepoWatchInfo *info, USN *next_usn)
+{
+    USN_JOURNAL_DATA_V0 data;
+
+    if (!info->volume_handle ||
+        !query_usn_journal (info->volume_handle, &data) ||
+        data.UsnJournalID != info->journal_id)
+        return FALSE;
+
+    *next_usn = data.NextUsn;
+    return TRUE;
+}
+
+/* Returns the path of a dir relative to the worktree, NULL if the dir is
+ * outside the worktree or doesn't exist any more.
+ */
+static char *
+get_dir_path_by_id (RepoWatchInfo *info, HANDLE hint, DWORDLONG file_ref)
+{
+    FILE_ID_DESCRIPTOR desc;
+    HANDLE handle;
+    wchar_t buf[SEAF_PATH_MAX];
+    DWORD len;
+    char *path, *p, *ret = NULL;
+    int wt_len;
+
+    memset (&desc, 0, sizeof(desc));
+    desc.dwSize = sizeof(desc);
+    desc.Type = FileIdType;
+    desc.FileId.QuadPart = file_ref;
+
+    handle = OpenFileById (hint, &desc, 0,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, FILE_FLAG_BACKUP_SEMANTICS);
+    if (handle == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    len = GetFinalPathNameByHandleW (handle, buf, SEAF_PATH_MAX,
+                                     FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+    CloseHandle (handle);
+    if (len == 0 || len >= SEAF_PATH_MAX)
+        return NULL;
+
+    path = g_utf16_to_utf8 (buf, len, NULL, NULL, NULL);
+    if (!path)
+        return NULL;
+
+    for (p = path; *p != 0; ++p)
+        if (*p == '\\')
+            *p = '/';
+
+    /* Strip the "\\?\" prefix. */
+    p = path;
+    if (strncmp (p, "//?/", 4) == 0)
+        p += 4;
+
+    wt_len = strlen (info->worktree);
+    if (g_ascii_strncasecmp (p, info->worktree, wt_len) == 0) {
+        if (p[wt_len] == 0)
+            ret = g_strdup ("");
+        else if (p[wt_len] == '/')
+            ret = g_strdup (p + wt_len + 1);
+    }
+
+    g_free (path);
+    return ret;
+}
+
+static void
+process_usn_record (RepoWatchInfo *info, HANDLE hint,
+                    USN_RECORD *record, GHashTable *dir_paths)
+{
+    gpointer value;
+    char *dir, *name, *path;
+    DWORDLONG parent = record->ParentFileReferenceNumber;
+
+    if (!g_hash_table_lookup_extended (dir_paths, &parent, NULL, &value)) {
+        DWORDLONG *key = g_new (DWORDLONG, 1);
+        *key = parent;
+        value = get_dir_path_by_id (info, hint, parent);
+        g_hash_table_insert (dir_paths, key, value);
+    }
+    dir = value;
+    if (!dir)
+        return;
+
+    name = g_utf16_to_utf8 ((wchar_t *)((char *)record + record->FileNameOffset),
+                            record->FileNameLength / sizeof(wchar_t),
+                            NULL, NULL, NULL);
+    if (!name)
+        return;
+
+    if (dir[0] == 0)
+        path = name;
+    else {
+        path = g_strconcat (dir, "/", name, NULL);
+        g_free (name);
+    }
+
+    if (record->Reason & (USN_REASON_FILE_DELETE | USN_REASON_RENAME_OLD_NAME))
+        add_event_to_queue (info->status, WT_EVENT_DELETE, path, NULL);
+    else
+        add_event_to_queue (info->status, WT_EVENT_CREATE_OR_UPDATE, path, NULL);
+
+    g_free (path);
+}
+
+/* Queue events for the changes recorded in the journal from @start_usn to
+ * @end_usn.
+ */
+static gboolean
+replay_usn_journal (RepoWatchInfo *info, HANDLE hint,
+                    USN start_usn, USN end_usn)
+{
+    READ_USN_JOURNAL_DATA_V0 rd;
+    GHashTable *dir_paths;
+    char *buf;
+    DWORD n;
+    USN_RECORD *record;
+    gboolean ret = TRUE;
+    int n_records = 0;
+
+    if (start_usn >= end_usn)
+        return TRUE;
+
+    memset (&rd, 0, sizeof(rd));
+    rd.StartUsn = start_usn;
+    rd.ReasonMask = USN_WATCH_REASONS;
+    rd.UsnJournalID = info->journal_id;
+
+    dir_paths = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                       g_free, g_free);
+    buf = g_malloc (USN_READ_BUFSIZE);
+
+    while (rd.StartUsn < end_usn) {
+        if (!DeviceIoControl (info->volume_handle, info->read_journal_code,
+                              &rd, sizeof(rd), buf, USN_READ_BUFSIZE, &n, NULL)) {
+            seaf_warning ("[wt mon] Failed to read change journal for %s, "
+                          "error code %lu.\n", info->worktree, GetLastError());
+            ret = FALSE;
+            break;
+        }
+        if (n <= sizeof(USN))
+            break;
+
+        record = (USN_RECORD *)(buf + sizeof(USN));
+        while ((char *)record < buf + n) {
+            if (record->MajorVersion == 2 && record->Usn < end_usn) {
+                process_usn_record (info, hint, record, dir_paths);
+                ++n_records;
+            }
+            record = (USN_RECORD *)((char *)record + record->RecordLength);
+        }
+
+        rd.StartUsn = *(USN *)buf;
+    }
+
+    seaf_debug ("[wt mon] Replayed %d journal records for %s.\n",
+                n_records, info->worktree);
+
+    g_free (buf);
+    g_hash_table_destroy (dir_paths);
+
+    if (ret)
+        g_atomic_int_set (&info->status->last_changed, (gint)time(NULL));
+    return ret;
+}
+
+/* Open the change journal of the worktree and replay the changes since
+ * the saved position. Returns FALSE if the worktree has to be scanned.
+ */
+static gboolean
+resume_from_usn_journal (RepoWatchInfo *info, HANDLE dir_handle)
+{
+    USN_JOURNAL_DATA_V0 data;
+    char *value;
+    DWORDLONG saved_id;
+    USN saved_usn;
+    gboolean ret = FALSE;
+
+    info->volume_handle = open_volume_of_path (info->worktree,
+                                               &info->read_journal_code);
+    if (!info->volume_handle)
+        return FALSE;
+
+    if (!query_usn_journal (info->volume_handle, &data)) {
+        CloseHandle (info->volume_handle);
+        info->volume_handle = NULL;
+        return FALSE;
+    }
+
+    info->journal_id = data.UsnJournalID;
+    info->replay_usn = info->last_batch_usn = data.NextUsn;
+    info->checked_usn = data.NextUsn;
+
+    value = seaf_repo_manager_get_repo_property (seaf->repo_mgr,
+                                                 info->status->repo_id,
+                                                 REPO_PROP_USN_JOURNAL);
+    if (!value)
+        return FALSE;
+
+    if (sscanf (value, "%" G_GINT64_MODIFIER "x:%" G_GINT64_MODIFIER "d",
+                &saved_id, &saved_usn) == 2 &&
+        saved_id == data.UsnJournalID &&
+        saved_usn >= data.FirstUsn &&
+        saved_usn <= data.NextUsn) {
+        info->saved_usn = saved_usn;
+        ret = replay_usn_journal (info, dir_handle, saved_usn, data.NextUsn);
+    }
+
+    g_free (value);
+    return ret;
+}
+
+/* Called when a batch of dir changes is received. If the dir change buffer
+ * overflowed, replay the changes since the previous batch from the journal.
+ */
+static void
+update_batch_usn (RepoWatchInfo *info, HANDLE dir_handle, gboolean overflow)
+{
+    USN next_usn;
+
+    if (!get_next_usn (info, &next_usn)) {
+        if (overflow)
+            add_event_to_queue (info->status, WT_EVENT_OVERFLOW, NULL, NULL);
+        return;
+    }
+
+    if (overflow &&
+        !replay_usn_journal (info, dir_handle, info->replay_usn, next_usn))
+        add_event_to_queue (info->status, WT_EVENT_OVERFLOW, NULL, NULL);
+
+    info->replay_usn = info->last_batch_usn;
+    info->last_batch_usn = next_usn;
+}
+
+typedef struct SavedUsn {
+    char repo_id[37];
+    char *value;
+} SavedUsn;
+
+static void
+save_usn_positions (SeafWTMonitorPriv *priv)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    RepoWatchInfo *info;
+    GList *saved = NULL, *ptr;
+    SavedUsn *pos;
+    USN next_usn;
+    gboolean drained;
+
+    pthread_mutex_lock (&priv->hash_lock);
+    g_hash_table_iter_init (&iter, priv->info_hash);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        info = value;
+        if (!get_next_usn (info, &next_usn))
+            continue;
+
+        /* Changes before the position of the last tick have been delivered
+         * by now. Only save it once repo-mgr has taken all the queued events,
+         * otherwise they would be lost if the daemon exits.
+         */
+        pthread_mutex_lock (&info->status->q_lock);
+        drained = g_queue_is_empty (info->status->event_q);
+        pthread_mutex_unlock (&info->status->q_lock);
+
+        if (drained && info->checked_usn != info->saved_usn) {
+            pos = g_new0 (SavedUsn, 1);
+            memcpy (pos->repo_id, info->status->repo_id, 36);
+            pos->value = g_strdup_printf ("%" G_GINT64_MODIFIER "x:%"
+                                          G_GINT64_MODIFIER "d",
+                                          (guint64)info->journal_id,
+                                          (gint64)info->checked_usn);
+            saved = g_list_prepend (saved, pos);
+            info->saved_usn = info->checked_usn;
+        }
+        info->checked_usn = next_usn;
+    }
+    pthread_mutex_unlock (&priv->hash_lock);
+
+    for (ptr = saved; ptr; ptr = ptr->next) {
+        pos = ptr->data;
+        seaf_repo_manager_set_repo_property (seaf->repo_mgr, pos->repo_id,
+                                             REPO_PROP_USN_JOURNAL, pos->value);
+        g_free (pos->value);
+        g_free (pos);
+    }
+    g_list_free (saved);
+}
+
 /* Every time after a read event is processed, we should call
  * ReadDirectoryChangesW() on the dir handle asynchronously for the IOCP to
  * detect the change of the workthree.
@@ -234,7 +618,7 @@ retry:
              * add an overflow event and retry watch.
              */
             info = g_hash_table_lookup (priv->info_hash, dir_handle);
-            add_event_to_queue (info->status, WT_EVENT_OVERFLOW, NULL, NULL);
+            update_batch_usn (info, dir_handle, TRUE);
             goto retry;
         }
     } else {
@@ -563,10 +947,19 @@ wt_monitor_job_win32 (void *vmonitor)
              &bytesRead,                  /* length of info */
              &key,                        /* completion key */
              &ol,                         /* OVERLAPPED */
-             INFINITE);                   /* timeout */
+             SAVE_USN_INTERVAL * 1000);   /* timeout */
 
         static int retry;
 
+        gint64 now = (gint64)time(NULL);
+        if (now - priv->last_usn_save >= SAVE_USN_INTERVAL) {
+            save_usn_positions (priv);
+            priv->last_usn_save = now;
+        }
+
+        if (!ret && !ol && GetLastError() == WAIT_TIMEOUT)
+            continue;
+
         if (!ret) {
             seaf_warning ("GetQueuedCompletionStatus failed, "
                           "error code %lu", GetLastError());
@@ -610,7 +1003,13 @@ wt_monitor_job_win32 (void *vmonitor)
                 DirWatchAux *aux = g_hash_table_lookup (priv->buf_hash,
                                                         (gconstpointer)hTriggered);
 
-                process_events (info->status->repo_id, info, aux->buf, bytesRead);
+                /* No bytes are returned if the buffer overflowed. */
+                if (bytesRead == 0)
+                    update_batch_usn (info, hTriggered, TRUE);
+                else {
+                    update_batch_usn (info, hTriggered, FALSE);
+                    process_events (info->status->repo_id, info, aux->buf, bytesRead);
+                }
 
                 reset_overlapped(ol);
                 if (!start_watch_dir_change(priv, hTriggered)) {
@@ -688,8 +1087,6 @@ static HANDLE add_watch (SeafWTMonitorPriv *priv,
     g_hash_table_insert (priv->info_hash, (gpointer)dir_handle, info);
     pthread_mutex_unlock (&priv->hash_lock);
 
-    add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
-
     return dir_handle;
 }
 
@@ -698,6 +1095,7 @@ static int handle_add_repo (SeafWTMonitor *monitor,
                             const char *worktree)
 {
     HANDLE handle;
+    RepoWatchInfo *info;
 
     handle = add_watch (monitor->priv, repo_id, worktree);
     if (handle == NULL ||
@@ -705,6 +1103,13 @@ static int handle_add_repo (SeafWTMonitor *monitor,
         return -1;
     }
 
+    /* Replay the journal after the dir watch is started, so that no change
+     * falls between the two.
+     */
+    info = g_hash_table_lookup (monitor->priv->info_hash, handle);
+    if (!resume_from_usn_journal (info, handle))
+        add_event_to_queue (info->status, WT_EVENT_SCAN_DIR, "", NULL);
+
     return 0;
 }
 
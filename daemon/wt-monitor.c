@@ -26,9 +26,10 @@ seaf_wt_monitor_start (SeafWTMonitor *monitor)
         return -1;
     }
 
-    if (seaf_job_manager_schedule_job (monitor->seaf->job_mgr,
-                                       monitor->job_func,
-                                       NULL, monitor) < 0) {
+    if (seaf_job_manager_schedule_job_with_priority (monitor->seaf->job_mgr,
+                                                     JOB_PRIORITY_INTERACTIVE,
+                                                     monitor->job_func,
+                                                     NULL, monitor) < 0) {
         seaf_warning ("[wt mon] failed to start monitor thread.\n");
         return -1;
     }
@@ -12,6 +12,14 @@
  */
 GList* seafile_get_repo_list (int start, int limit, GError **error);
 
+/*
+ * Returns the repo list as JSON: {"seq": N, "repos": [...]}, with the
+ * fields of the repo objects returned by seafile_get_repo_list(). If @seq
+ * is the current repo list sequence number, only "seq" is returned. The
+ * serialized list is cached until the repo list changes.
+ */
+char * seafile_get_repo_list_json (int seq, GError **error);
+
 /**
  * seafile_get_repo:
  *
@@ -92,12 +100,65 @@ seafile_get_path_sync_status (const char *repo_id,
                               int is_dir,
                               GError **error);
 
+/*
+ * Get the sync status of many entries of @dir in one call. @names is a
+ * JSON array of entry names, names of directories end with '/'.
+ *
+ * Returns {"seq": <n>, "statuses": {<name>: <status>, ...}}. If @seq is
+ * the current status sequence number, nothing has changed since the
+ * caller got it, and only {"seq": <n>} is returned.
+ */
+json_t *
+seafile_get_paths_sync_status (const char *repo_id,
+                               const char *dir,
+                               const char *names,
+                               int seq,
+                               GError **error);
+
 int
 seafile_mark_file_locked (const char *repo_id, const char *path, GError **error);
 
 int
 seafile_mark_file_unlocked (const char *repo_id, const char *path, GError **error);
 
+/*
+ * Download the content of a placeholder file in an on-demand repo.
+ * Blocks until the file is written.
+ */
+int
+seafile_hydrate_file (const char *repo_id, const char *path, GError **error);
+
+/*
+ * Called by the file system integration that hydrates placeholders when it
+ * starts and stops. On-demand checkout is refused while none is
+ * registered.
+ */
+int
+seafile_register_hydration_provider (const char *name, GError **error);
+
+int
+seafile_unregister_hydration_provider (const char *name, GError **error);
+
+/*
+ * Re-hash the local fs objects and blocks of a repo in the background.
+ * With @repair, broken ones are downloaded again.
+ */
+int
+seafile_verify_repo (const char *repo_id, int repair, GError **error);
+
+/* State and findings of the last seafile_verify_repo(). */
+json_t *
+seafile_get_repo_verify_status (const char *repo_id, GError **error);
+
+/*
+ * A page of the commit history of a repo, latest first, as a json array
+ * of commits. A commit whose parents are missing locally has
+ * "truncated": true, the history below it can't be shown.
+ */
+json_t *
+seafile_get_commit_history (const char *repo_id, int offset, int limit,
+                            GError **error);
+
 char *
 seafile_get_server_property (const char *server_url, const char *key, GError **error);
 
@@ -211,6 +272,42 @@ seafile_generate_magic_and_random_key(int enc_version,
                                       GError **error);
 json_t * seafile_get_sync_notification (GError **error);
 
+/*
+ * Like seafile_get_sync_notification(), but waits up to @timeout
+ * milliseconds for a message, so that a client can block on it instead of
+ * polling. The call blocks the RPC connection it's sent on.
+ */
+json_t * seafile_wait_sync_notification (int timeout, GError **error);
+
+/* Hit and miss counts and size of the fs object cache. */
+json_t * seafile_get_fs_cache_stats (GError **error);
+
+/*
+ * Wall and CPU time of the daemon's startup phases and of loading each
+ * repo, in milliseconds.
+ */
+json_t * seafile_get_startup_profile (GError **error);
+
+/*
+ * Latency histograms of the sync stages and http requests since the daemon
+ * started. Maps each stage or endpoint to its count, min, max, mean and
+ * p50/p90/p99/p999, in microseconds.
+ */
+json_t * seafile_get_sync_latency_stats (GError **error);
+
+/*
+ * Transfer, connection, job queue, worktree event and object store
+ * counters, in the OpenMetrics text format.
+ */
+char * seafile_get_metrics (GError **error);
+
+/*
+ * Returns the change sequence numbers of the repo list, the file sync
+ * errors and the path statuses. A client that polls only needs to fetch
+ * a list again when its number changed.
+ */
+json_t * seafile_get_change_seqs (GError **error);
+
 int
 seafile_shutdown (GError **error);
 
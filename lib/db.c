@@ -11,6 +11,7 @@ sqlite_open_db (const char *db_path, sqlite3 **db)
 {
     int result;
     const char *errmsg;
+    char *mode;
 
     result = sqlite3_open (db_path, db);
     if (result) {
@@ -23,11 +24,65 @@ sqlite_open_db (const char *db_path, sqlite3 **db)
         return -1;
     }
 
+    /* With WAL, a commit only appends to the log, and synchronous=NORMAL
+     * lets it skip the fsync. The db stays consistent after a crash, only
+     * the last commits may be lost on power failure. WAL can't be used on
+     * some network filesystems; keep the default journal there. The pragma
+     * returns the mode in effect, which is the old one if WAL can't be set.
+     */
+    mode = sqlite_get_string (*db, "PRAGMA journal_mode=WAL;");
+    if (mode && g_ascii_strcasecmp (mode, "wal") == 0)
+        sqlite_query_exec (*db, "PRAGMA synchronous=NORMAL;");
+    g_free (mode);
+
+    return 0;
+}
+
+int
+sqlite_open_db_readonly (const char *db_path, sqlite3 **db)
+{
+    int result;
+    const char *errmsg;
+
+    result = sqlite3_open_v2 (db_path, db, SQLITE_OPEN_READONLY, NULL);
+    if (result) {
+        errmsg = sqlite3_errmsg (*db);
+
+        g_warning ("Couldn't open database:'%s' for reading, %s\n",
+                   db_path, errmsg ? errmsg : "no error given");
+
+        sqlite3_close (*db);
+        return -1;
+    }
+
+    /* Readers only wait while a WAL checkpoint or recovery is running. */
+    sqlite3_busy_timeout (*db, 1000);
+
     return 0;
 }
 
+/* Cached statements of each connection, db -> (sql -> stmt). */
+static GHashTable *stmt_caches;
+static GMutex stmt_caches_lock;
+
+static void
+drop_stmt_cache (sqlite3 *db)
+{
+    GHashTable *cache;
+
+    g_mutex_lock (&stmt_caches_lock);
+    cache = stmt_caches ? g_hash_table_lookup (stmt_caches, db) : NULL;
+    if (cache)
+        g_hash_table_steal (stmt_caches, db);
+    g_mutex_unlock (&stmt_caches_lock);
+
+    if (cache)
+        g_hash_table_destroy (cache);
+}
+
 int sqlite_close_db (sqlite3 *db)
 {
+    drop_stmt_cache (db);
     return sqlite3_close (db);
 }
 
@@ -51,6 +106,45 @@ sqlite_query_prepare (sqlite3 *db, const char *sql)
     return stmt;
 }
 
+sqlite3_stmt *
+sqlite_query_prepare_cached (sqlite3 *db, const char *sql)
+{
+    GHashTable *cache;
+    sqlite3_stmt *stmt;
+
+    g_mutex_lock (&stmt_caches_lock);
+
+    if (!stmt_caches)
+        stmt_caches = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    cache = g_hash_table_lookup (stmt_caches, db);
+    if (!cache) {
+        cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify)sqlite3_finalize);
+        g_hash_table_insert (stmt_caches, db, cache);
+    }
+
+    stmt = g_hash_table_lookup (cache, sql);
+    if (!stmt) {
+        stmt = sqlite_query_prepare (db, sql);
+        if (stmt)
+            g_hash_table_insert (cache, g_strdup(sql), stmt);
+    }
+
+    g_mutex_unlock (&stmt_caches_lock);
+
+    return stmt;
+}
+
+void
+sqlite_query_release (sqlite3_stmt *stmt)
+{
+    if (!stmt)
+        return;
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+}
+
 int
 sqlite_query_exec (sqlite3 *db, const char *sql)
 {
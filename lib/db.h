@@ -7,10 +7,28 @@
 
 int sqlite_open_db (const char *db_path, sqlite3 **db);
 
+/*
+ * Open an extra read-only connection to a db that is already opened with
+ * sqlite_open_db(). When the db is in WAL mode, queries on this connection
+ * don't wait for transactions on the writer connection.
+ */
+int sqlite_open_db_readonly (const char *db_path, sqlite3 **db);
+
 int sqlite_close_db (sqlite3 *db);
 
 sqlite3_stmt *sqlite_query_prepare (sqlite3 *db, const char *sql);
 
+/*
+ * Return a statement for @sql that is prepared once per connection and
+ * reused. @sql should be a constant query that uses parameters, not one
+ * with values formatted into it. The caller must hold whatever lock guards
+ * the connection while using the statement, and give it back with
+ * sqlite_query_release() instead of finalizing it.
+ */
+sqlite3_stmt *sqlite_query_prepare_cached (sqlite3 *db, const char *sql);
+
+void sqlite_query_release (sqlite3_stmt *stmt);
+
 int sqlite_query_exec (sqlite3 *db, const char *sql);
 int sqlite_begin_transaction (sqlite3 *db);
 int sqlite_end_transaction (sqlite3 *db);
@@ -0,0 +1,140 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "epoch.h"
+
+typedef struct EpochSlot {
+    /* The global epoch when the thread entered, 0 outside of read
+     * sections. Only written by the thread that owns the slot. */
+    volatile gint epoch;
+    int depth;
+    /* Protected by lock. Slots are reused after their thread exits. */
+    gboolean in_use;
+    struct EpochSlot *next;
+    /* Keep the slots of different threads on different cache lines. */
+    char pad[64];
+} EpochSlot;
+
+typedef struct Retired {
+    gpointer data;
+    GDestroyNotify destroy;
+    /* Readers that entered at this epoch or later can't see @data. */
+    gint epoch;
+} Retired;
+
+static volatile gint global_epoch = 1;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* Protected by lock. */
+static EpochSlot *slots;
+static GQueue retired = G_QUEUE_INIT;
+
+static void
+release_slot (gpointer p)
+{
+    EpochSlot *slot = p;
+
+    pthread_mutex_lock (&lock);
+    slot->in_use = FALSE;
+    pthread_mutex_unlock (&lock);
+}
+
+static GPrivate slot_key = G_PRIVATE_INIT (release_slot);
+
+static EpochSlot *
+get_slot ()
+{
+    EpochSlot *slot = g_private_get (&slot_key);
+
+    if (slot)
+        return slot;
+
+    pthread_mutex_lock (&lock);
+    for (slot = slots; slot; slot = slot->next) {
+        if (!slot->in_use)
+            break;
+    }
+    if (!slot) {
+        slot = g_new0 (EpochSlot, 1);
+        slot->next = slots;
+        slots = slot;
+    }
+    slot->in_use = TRUE;
+    pthread_mutex_unlock (&lock);
+
+    g_private_set (&slot_key, slot);
+    return slot;
+}
+
+void
+seaf_epoch_enter ()
+{
+    EpochSlot *slot = get_slot ();
+
+    /* The slot is set before the caller loads the published pointer, so a
+     * writer either sees the reader, or the reader gets the new version. */
+    if (slot->depth++ == 0)
+        g_atomic_int_set (&slot->epoch, g_atomic_int_get (&global_epoch));
+}
+
+void
+seaf_epoch_leave ()
+{
+    EpochSlot *slot = g_private_get (&slot_key);
+
+    if (--slot->depth == 0)
+        g_atomic_int_set (&slot->epoch, 0);
+}
+
+/* Called with lock held. */
+static gint
+oldest_reader_epoch ()
+{
+    EpochSlot *slot;
+    gint oldest = G_MAXINT, epoch;
+
+    for (slot = slots; slot; slot = slot->next) {
+        epoch = g_atomic_int_get (&slot->epoch);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    return oldest;
+}
+
+void
+seaf_epoch_retire (gpointer data, GDestroyNotify destroy)
+{
+    Retired *item = g_new0 (Retired, 1);
+    GList *done = NULL, *ptr;
+    gint oldest;
+
+    item->data = data;
+    item->destroy = destroy;
+
+    pthread_mutex_lock (&lock);
+
+    /* @data has already been replaced, readers entering from now on only
+     * find the new version. */
+    item->epoch = g_atomic_int_add (&global_epoch, 1) + 1;
+    g_queue_push_tail (&retired, item);
+
+    oldest = oldest_reader_epoch ();
+    while ((item = g_queue_peek_head (&retired)) != NULL &&
+           item->epoch <= oldest) {
+        g_queue_pop_head (&retired);
+        done = g_list_prepend (done, item);
+    }
+
+    pthread_mutex_unlock (&lock);
+
+    for (ptr = done; ptr; ptr = ptr->next) {
+        item = ptr->data;
+        item->destroy (item->data);
+        g_free (item);
+    }
+    g_list_free (done);
+}
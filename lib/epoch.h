@@ -0,0 +1,33 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_EPOCH_H
+#define SEAF_EPOCH_H
+
+#include <glib.h>
+
+/*
+ * Epoch based reclamation, for data that is read without locks.
+ *
+ * Readers access the data between seaf_epoch_enter() and
+ * seaf_epoch_leave(). Each thread only writes to its own slot, so
+ * readers on different cores don't bounce a shared lock between them.
+ *
+ * Writers, which must be serialized by other means, publish a new version
+ * with g_atomic_pointer_set() and hand the old one to seaf_epoch_retire().
+ * It's destroyed once all the readers that may still see it have left,
+ * at that call or at a later one.
+ *
+ * Read sections may nest. They must be short, and must not call
+ * seaf_epoch_retire().
+ */
+
+void
+seaf_epoch_enter ();
+
+void
+seaf_epoch_leave ();
+
+void
+seaf_epoch_retire (gpointer data, GDestroyNotify destroy);
+
+#endif
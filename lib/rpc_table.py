@@ -92,4 +92,8 @@ func_table = [
     [ "object", ["string", "string", "string", "string", "string", "string", "string", "int", "int"] ],
     [ "object", ["string", "string", "string", "string", "string", "string", "int", "string", "int", "int"] ],
     [ "json", [] ],
+    [ "json", ["int"] ],
+    [ "json", ["string"] ],
+    [ "json", ["string", "int", "int"] ],
+    [ "json", ["string", "string", "string", "int"] ],
 ]
@@ -0,0 +1,211 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib/gstdio.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "trace.h"
+#include "log.h"
+
+/* Flush the file after this many events, so that a trace of a daemon that
+ * is killed is still useful. */
+#define FLUSH_INTERVAL 256
+
+volatile gint seaf_trace_on;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Protected by trace_lock. */
+static FILE *trace_fp;
+static guint64 n_events;
+
+static int trace_pid;
+static volatile gint next_tid;
+static volatile gint next_async_id;
+static pthread_key_t tid_key;
+static pthread_once_t tid_key_once = PTHREAD_ONCE_INIT;
+
+static void
+create_tid_key ()
+{
+    pthread_key_create (&tid_key, NULL);
+}
+
+/* Small sequential ids are easier to read in the viewer than the system
+ * thread ids, and are portable. */
+static int
+get_tid ()
+{
+    int tid;
+
+    pthread_once (&tid_key_once, create_tid_key);
+
+    tid = GPOINTER_TO_INT (pthread_getspecific (tid_key));
+    if (tid == 0) {
+        tid = g_atomic_int_add (&next_tid, 1) + 1;
+        pthread_setspecific (tid_key, GINT_TO_POINTER (tid));
+    }
+
+    return tid;
+}
+
+int
+seaf_trace_init (const char *path)
+{
+    FILE *fp;
+
+    fp = g_fopen (path, "w");
+    if (!fp) {
+        seaf_warning ("Failed to open trace file %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+
+#ifdef WIN32
+    trace_pid = (int)GetCurrentProcessId ();
+#else
+    trace_pid = (int)getpid ();
+#endif
+
+    pthread_mutex_lock (&trace_lock);
+    if (trace_fp)
+        fclose (trace_fp);
+    trace_fp = fp;
+    n_events = 0;
+    /* The closing bracket is optional in the array format, the file can
+     * be loaded even if seaf_trace_close() isn't called. */
+    fputs ("[\n", trace_fp);
+    pthread_mutex_unlock (&trace_lock);
+
+    g_atomic_int_set (&seaf_trace_on, 1);
+
+    seaf_message ("Writing trace events to %s.\n", path);
+
+    return 0;
+}
+
+void
+seaf_trace_close ()
+{
+    g_atomic_int_set (&seaf_trace_on, 0);
+
+    pthread_mutex_lock (&trace_lock);
+    if (trace_fp) {
+        fputs ("\n]\n", trace_fp);
+        fclose (trace_fp);
+        trace_fp = NULL;
+    }
+    pthread_mutex_unlock (&trace_lock);
+}
+
+static void
+append_json_string (GString *buf, const char *s)
+{
+    const char *p;
+
+    g_string_append_c (buf, '"');
+    for (p = s; *p; ++p) {
+        if (*p == '"' || *p == '\\')
+            g_string_append_c (buf, '\\');
+        if ((unsigned char)*p < 0x20)
+            g_string_append_printf (buf, "\\u%04x", (unsigned char)*p);
+        else
+            g_string_append_c (buf, *p);
+    }
+    g_string_append_c (buf, '"');
+}
+
+/* Append the fields shared by all events, without the enclosing braces. */
+static void
+append_event_head (GString *buf, const char *cat, const char *name,
+                   const char *ph, gint64 ts, int tid)
+{
+    g_string_append (buf, "{\"cat\":");
+    append_json_string (buf, cat);
+    g_string_append (buf, ",\"name\":");
+    append_json_string (buf, name);
+    g_string_append_printf (buf, ",\"ph\":\"%s\",\"ts\":%" G_GINT64_FORMAT
+                            ",\"pid\":%d,\"tid\":%d", ph, ts, trace_pid, tid);
+}
+
+static void
+append_args (GString *buf, const char *id)
+{
+    if (!id)
+        return;
+    g_string_append (buf, ",\"args\":{\"id\":");
+    append_json_string (buf, id);
+    g_string_append_c (buf, '}');
+}
+
+static void
+write_events (GString *buf)
+{
+    pthread_mutex_lock (&trace_lock);
+    if (trace_fp) {
+        if (n_events > 0)
+            fputs (",\n", trace_fp);
+        fputs (buf->str, trace_fp);
+        if (++n_events % FLUSH_INTERVAL == 0)
+            fflush (trace_fp);
+    }
+    pthread_mutex_unlock (&trace_lock);
+}
+
+void
+seaf_trace_end (const char *cat, const char *name, gint64 start, const char *id)
+{
+    GString *buf;
+    gint64 now;
+
+    if (start == 0 || !seaf_trace_on)
+        return;
+
+    now = g_get_monotonic_time ();
+    buf = g_string_new (NULL);
+
+    append_event_head (buf, cat, name, "X", start, get_tid ());
+    g_string_append_printf (buf, ",\"dur\":%" G_GINT64_FORMAT, now - start);
+    append_args (buf, id);
+    g_string_append_c (buf, '}');
+
+    write_events (buf);
+    g_string_free (buf, TRUE);
+}
+
+void
+seaf_trace_end_async (const char *cat, const char *name, gint64 start,
+                      const char *id)
+{
+    GString *buf;
+    gint64 now;
+    int tid, async_id;
+
+    if (start == 0 || !seaf_trace_on)
+        return;
+
+    now = g_get_monotonic_time ();
+    tid = get_tid ();
+    async_id = g_atomic_int_add (&next_async_id, 1) + 1;
+    buf = g_string_new (NULL);
+
+    /* Both events are written at the end, so that they are always paired. */
+    append_event_head (buf, cat, name, "b", start, tid);
+    g_string_append_printf (buf, ",\"id\":%d", async_id);
+    append_args (buf, id);
+    g_string_append (buf, "},\n");
+
+    append_event_head (buf, cat, name, "e", now, tid);
+    g_string_append_printf (buf, ",\"id\":%d}", async_id);
+
+    write_events (buf);
+    g_string_free (buf, TRUE);
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_TRACE_H
+#define SEAF_TRACE_H
+
+#include <glib.h>
+
+/*
+ * Tracing spans of chunking, block store and block transfer operations,
+ * written in the Chrome trace event format. The file can be loaded into
+ * chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Tracing is off unless seaf_trace_init() is called. When it's off,
+ * seaf_trace_begin() returns 0 and ending a span costs a branch.
+ *
+ * Usage:
+ *
+ *     gint64 start = seaf_trace_begin ();
+ *     ...
+ *     seaf_trace_end ("block", "commit", start, block_id);
+ */
+
+extern volatile gint seaf_trace_on;
+
+/* Start writing trace events to @path. The file is overwritten. */
+int
+seaf_trace_init (const char *path);
+
+/* Finish the trace file. Events recorded afterwards are dropped. */
+void
+seaf_trace_close ();
+
+/* Returns the start time of a span, or 0 if tracing is off. */
+#define seaf_trace_begin() (seaf_trace_on ? g_get_monotonic_time () : 0)
+
+/*
+ * Record a span of category @cat that started at @start on the calling
+ * thread. Spans on one thread must nest. @id (e.g. a block id) may be NULL.
+ */
+void
+seaf_trace_end (const char *cat, const char *name, gint64 start, const char *id);
+
+/*
+ * Record a span that overlaps other spans on the same thread, such as the
+ * requests of a curl multi handle. It is shown on its own track.
+ */
+void
+seaf_trace_end_async (const char *cat, const char *name, gint64 start,
+                      const char *id);
+
+#endif
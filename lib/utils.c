@@ -724,7 +724,7 @@ traverse_directory_win32 (wchar_t *path_w,
     wcscpy (pattern, path_w);
     wcscat (pattern, L"\\*");
 
-    handle = FindFirstFileW (pattern, &fdata);
+    handle = seaf_util_find_first_file (pattern, &fdata);
     if (handle == INVALID_HANDLE_VALUE) {
         g_warning ("FindFirstFile failed %s: %lu.\n",
                    path, GetLastError());
@@ -766,6 +766,75 @@ out:
     return ret;
 }
 
+HANDLE
+seaf_util_find_first_file (const wchar_t *pattern, WIN32_FIND_DATAW *fdata)
+{
+    return FindFirstFileExW (pattern, FindExInfoBasic, fdata,
+                             FindExSearchNameMatch, NULL,
+                             FIND_FIRST_EX_LARGE_FETCH);
+}
+
+#else
+
+static void
+seaf_dir_entry_free (SeafDirEntry *entry)
+{
+    g_free (entry->name);
+    g_free (entry);
+}
+
+GPtrArray *
+seaf_util_read_dir_entries (const char *path, gboolean follow_links)
+{
+    DIR *dir;
+    struct dirent *dent;
+    SeafDirEntry *entry;
+    SeafStat st;
+    GPtrArray *entries;
+    int dfd, saved_errno;
+    int flags = follow_links ? 0 : AT_SYMLINK_NOFOLLOW;
+
+    dir = opendir (path);
+    if (!dir)
+        return NULL;
+    dfd = dirfd (dir);
+
+    entries = g_ptr_array_new_with_free_func ((GDestroyNotify)seaf_dir_entry_free);
+
+    while (1) {
+        /* readdir() returns NULL both at the end and on errors. */
+        errno = 0;
+        dent = readdir (dir);
+        if (!dent)
+            break;
+
+        if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
+            continue;
+
+        if (fstatat (dfd, dent->d_name, &st, flags) < 0) {
+            seaf_warning ("Failed to stat %s/%s: %s.\n",
+                          path, dent->d_name, strerror(errno));
+            continue;
+        }
+
+        entry = g_new0 (SeafDirEntry, 1);
+        entry->name = g_strdup (dent->d_name);
+        entry->st = st;
+        g_ptr_array_add (entries, entry);
+    }
+
+    if (errno != 0) {
+        saved_errno = errno;
+        closedir (dir);
+        g_ptr_array_free (entries, TRUE);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    closedir (dir);
+    return entries;
+}
+
 #endif
 
 #ifdef WIN32
@@ -882,6 +951,68 @@ writen(int fd, const void *vptr, size_t n)
 }
 
 
+gboolean
+is_zero_buf (const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    if (len == 0)
+        return TRUE;
+    /* Each byte equals the one before it, and the first is 0. */
+    return p[0] == 0 && memcmp (p, p + 1, len - 1) == 0;
+}
+
+#define SPARSE_PAGE_SIZE 4096
+
+ssize_t
+writen_sparse (int fd, const void *vptr, size_t n)
+{
+#ifdef WIN32
+    return writen (fd, vptr, n);
+#else
+    const char *p = vptr, *end = p + n, *data = p, *hole;
+
+    while (p < end) {
+        if ((size_t)(end - p) < SPARSE_PAGE_SIZE) {
+            p = end;
+            break;
+        }
+        if (!is_zero_buf (p, SPARSE_PAGE_SIZE)) {
+            p += SPARSE_PAGE_SIZE;
+            continue;
+        }
+
+        if (p > data && writen (fd, data, p - data) < 0)
+            return -1;
+        hole = p;
+        while ((size_t)(end - p) >= SPARSE_PAGE_SIZE &&
+               is_zero_buf (p, SPARSE_PAGE_SIZE))
+            p += SPARSE_PAGE_SIZE;
+        if (seaf_util_lseek (fd, p - hole, SEEK_CUR) < 0)
+            return -1;
+        data = p;
+    }
+
+    if (p > data && writen (fd, data, p - data) < 0)
+        return -1;
+    return n;
+#endif
+}
+
+int
+sparse_write_finish (int fd)
+{
+#ifdef WIN32
+    return 0;
+#else
+    gint64 offset = seaf_util_lseek (fd, 0, SEEK_CUR);
+
+    if (offset < 0)
+        return -1;
+    return ftruncate (fd, (off_t)offset);
+#endif
+}
+
 ssize_t						/* Read "n" bytes from a descriptor. */
 recvn(evutil_socket_t fd, void *vptr, size_t n)
 {
@@ -1261,14 +1392,11 @@ calculate_sha1 (unsigned char *sha1, const char *msg, int len)
 uint32_t
 ccnet_sha1_hash (const void *v)
 {
-    /* 31 bit hash function */
-    const unsigned char *p = v;
-    uint32_t h = 0;
-    int i;
-
-    for (i = 0; i < 20; i++)
-        h = (h << 5) - h + p[i];
+    /* The bytes of a sha1 are evenly distributed, so the first 4 are
+     * good enough as hash. */
+    uint32_t h;
 
+    memcpy (&h, v, sizeof(h));
     return h;
 }
 
@@ -1276,15 +1404,7 @@ int
 ccnet_sha1_equal (const void *v1,
                   const void *v2)
 {
-    const unsigned char *p1 = v1;
-    const unsigned char *p2 = v2;
-    int i;
-
-    for (i = 0; i < 20; i++)
-        if (p1[i] != p2[i])
-            return 0;
-    
-    return 1;
+    return (memcmp (v1, v2, 20) == 0);
 }
 
 #ifndef WIN32
@@ -2367,106 +2487,203 @@ normalize_utf8_path (const char *path)
     return g_utf8_normalize (path, -1, G_NORMALIZE_NFC);
 }
 
-/* zlib related wrapper functions. */
+/* Returns the lower case of the character at *@p and moves @p past it.
+ * Bytes that are not valid UTF-8 are taken as they are.
+ */
+static inline gunichar
+next_folded_char (const char **p)
+{
+    const unsigned char *s = (const unsigned char *)*p;
+    gunichar c;
+
+    if (*s < 0x80) {
+        ++(*p);
+        return g_ascii_tolower (*s);
+    }
+
+    c = g_utf8_get_char_validated (*p, -1);
+    if (c == (gunichar)-1 || c == (gunichar)-2) {
+        ++(*p);
+        return *s;
+    }
+    *p = g_utf8_next_char (*p);
+    return g_unichar_tolower (c);
+}
+
+guint
+utf8_case_hash (gconstpointer key)
+{
+    const char *p = key;
+    guint h = 5381;
+
+    while (*p)
+        h = (h << 5) + h + next_folded_char (&p);
+    return h;
+}
+
+gboolean
+utf8_case_equal (gconstpointer a, gconstpointer b)
+{
+    const char *p1 = a, *p2 = b;
+
+    while (*p1 && *p2) {
+        if (next_folded_char (&p1) != next_folded_char (&p2))
+            return FALSE;
+    }
+    return (*p1 == *p2);
+}
+
+/* zlib related wrapper functions.
+ *
+ * The streams are kept per thread and reset between calls. deflateInit()
+ * allocates and clears about 256KB, which costs more than compressing a
+ * typical fs object.
+ */
 
 #define ZLIB_BUF_SIZE 16384
 
+typedef struct ZStreams {
+    z_stream deflate;
+    z_stream inflate;
+    gboolean deflate_ready;
+    gboolean inflate_ready;
+} ZStreams;
+
+static void
+zstreams_free (gpointer p)
+{
+    ZStreams *zs = p;
+
+    if (zs->deflate_ready)
+        deflateEnd (&zs->deflate);
+    if (zs->inflate_ready)
+        inflateEnd (&zs->inflate);
+    g_free (zs);
+}
+
+static GPrivate zstreams_key = G_PRIVATE_INIT (zstreams_free);
+
+static ZStreams *
+get_zstreams ()
+{
+    ZStreams *zs = g_private_get (&zstreams_key);
+
+    if (!zs) {
+        zs = g_new0 (ZStreams, 1);
+        g_private_set (&zstreams_key, zs);
+    }
+    return zs;
+}
+
 int
 seaf_compress (guint8 *input, int inlen, guint8 **output, int *outlen)
 {
+    ZStreams *zs;
+    z_stream *strm;
+    uLong bound;
+    guint8 *out;
     int ret;
-    unsigned have;
-    z_stream strm;
-    guint8 out[ZLIB_BUF_SIZE];
-    GByteArray *barray;
 
     if (inlen == 0)
         return -1;
 
-    /* allocate deflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    ret = deflateInit(&strm, Z_DEFAULT_COMPRESSION);
-    if (ret != Z_OK) {
-        g_warning ("deflateInit failed.\n");
+    zs = get_zstreams ();
+    strm = &zs->deflate;
+    if (!zs->deflate_ready) {
+        if (deflateInit (strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            g_warning ("deflateInit failed.\n");
+            return -1;
+        }
+        zs->deflate_ready = TRUE;
+    } else if (deflateReset (strm) != Z_OK) {
+        g_warning ("deflateReset failed.\n");
         return -1;
     }
 
-    strm.avail_in = inlen;
-    strm.next_in = input;
-    barray = g_byte_array_new ();
+    /* The output always fits, so a single call is enough. */
+    bound = deflateBound (strm, inlen);
+    out = g_malloc (bound);
+
+    strm->next_in = input;
+    strm->avail_in = inlen;
+    strm->next_out = out;
+    strm->avail_out = bound;
+    ret = deflate (strm, Z_FINISH);
+    if (ret != Z_STREAM_END) {
+        g_warning ("Failed to deflate.\n");
+        g_free (out);
+        return -1;
+    }
+
+    *outlen = (int)(bound - strm->avail_out);
+    *output = g_realloc (out, *outlen);
 
-    do {
-        strm.avail_out = ZLIB_BUF_SIZE;
-        strm.next_out = out;
-        ret = deflate(&strm, Z_FINISH);    /* no bad return value */
-        have = ZLIB_BUF_SIZE - strm.avail_out;
-        g_byte_array_append (barray, out, have);
-    } while (ret != Z_STREAM_END);
-
-    *outlen = barray->len;
-    *output = g_byte_array_free (barray, FALSE);
-
-    /* clean up and return */
-    (void)deflateEnd(&strm);
     return 0;
 }
 
 int
 seaf_decompress (guint8 *input, int inlen, guint8 **output, int *outlen)
 {
+    ZStreams *zs;
+    z_stream *strm;
+    gsize size, have;
+    guint8 *out;
     int ret;
-    unsigned have;
-    z_stream strm;
-    unsigned char out[ZLIB_BUF_SIZE];
-    GByteArray *barray;
 
     if (inlen == 0) {
         g_warning ("Empty input for zlib, invalid.\n");
         return -1;
     }
 
-    /* allocate inflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    ret = inflateInit(&strm);
-    if (ret != Z_OK) {
-        g_warning ("inflateInit failed.\n");
+    zs = get_zstreams ();
+    strm = &zs->inflate;
+    if (!zs->inflate_ready) {
+        if (inflateInit (strm) != Z_OK) {
+            g_warning ("inflateInit failed.\n");
+            return -1;
+        }
+        zs->inflate_ready = TRUE;
+    } else if (inflateReset (strm) != Z_OK) {
+        g_warning ("inflateReset failed.\n");
         return -1;
     }
 
-    strm.avail_in = inlen;
-    strm.next_in = input;
-    barray = g_byte_array_new ();
+    /* JSON fs objects usually shrink about 4 times. */
+    size = MAX ((gsize)inlen * 4, ZLIB_BUF_SIZE);
+    out = g_malloc (size);
 
-    do {
-        strm.avail_out = ZLIB_BUF_SIZE;
-        strm.next_out = out;
-        ret = inflate(&strm, Z_NO_FLUSH);
-        if (ret < 0) {
+    strm->next_in = input;
+    strm->avail_in = inlen;
+    strm->next_out = out;
+    strm->avail_out = size;
+
+    while (1) {
+        ret = inflate (strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+            break;
+        if ((ret != Z_OK && ret != Z_BUF_ERROR) || strm->avail_out > 0) {
+            /* Corrupted, or truncated if there is room left. */
             g_warning ("Failed to inflate.\n");
-            goto out;
+            g_free (out);
+            return -1;
         }
-        have = ZLIB_BUF_SIZE - strm.avail_out;
-        g_byte_array_append (barray, out, have);
-    } while (ret != Z_STREAM_END);
-
-out:
-    /* clean up and return */
-    (void)inflateEnd(&strm);
 
-    if (ret == Z_STREAM_END) {
-        *outlen = barray->len;
-        *output = g_byte_array_free (barray, FALSE);
-        return 0;
-    } else {
-        g_byte_array_free (barray, TRUE);
-        return -1;
+        have = size - strm->avail_out;
+        if (size >= G_MAXINT / 2) {
+            g_warning ("Inflated data is too large.\n");
+            g_free (out);
+            return -1;
+        }
+        size *= 2;
+        out = g_realloc (out, size);
+        strm->next_out = out + have;
+        strm->avail_out = size - have;
     }
+
+    *outlen = (int)(size - strm->avail_out);
+    *output = out;
+
+    return 0;
 }
 
 char*
@@ -2528,138 +2745,297 @@ canonical_server_url (const char *url_in)
     return url;
 }
 
-#ifdef __APPLE__
-static gboolean
-case_conflict_recursive (const char *worktree, const char *path, char **conflict_path, GHashTable *no_case_conflict_hash)
+/*
+ * Case conflicts are checked against the names listed from each directory of
+ * the worktree. Each directory is listed once and cached in @listings, which
+ * maps the directory path to a table from lowercase names to the names on
+ * disk.
+ *
+ * When a path is created, removed or renamed, only its name is updated in
+ * the listing of its parent, so that a checkout deleting many files in one
+ * directory doesn't list it again for each of them. The listings under the
+ * path are dropped. To find them without going through all the listings,
+ * @subdirs records, for each directory, its subdirs that have listings
+ * under them.
+ */
+
+struct CaseConflictCache {
+    char *worktree;
+    GHashTable *listings;
+    /* dir -> set of subdir paths */
+    GHashTable *subdirs;
+};
+
+CaseConflictCache *
+case_conflict_cache_new (const char *worktree)
 {
-    if (!path || g_strcmp0 (path, ".") == 0) {
-        return FALSE;
-    }
+    CaseConflictCache *cache = g_new0 (CaseConflictCache, 1);
 
-    if (g_hash_table_lookup (no_case_conflict_hash, path)) {
-        return FALSE;
-    }
+    cache->worktree = g_strdup (worktree);
+    cache->listings = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify)g_hash_table_destroy);
+    cache->subdirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)g_hash_table_destroy);
+    return cache;
+}
 
-    SeafStat st;
-    gboolean ret = FALSE;
-    int fd = -1;
-    char *full_path = g_build_path ("/", worktree, path, NULL);
-    char *no_conflict_path = NULL;
-
-    if (seaf_stat (full_path, &st) < 0) {
-        char *sub_path = g_path_get_dirname (path);
-        ret = case_conflict_recursive (worktree, sub_path, conflict_path, no_case_conflict_hash);
-        g_free (sub_path);
-        goto out;
+void
+case_conflict_cache_free (CaseConflictCache *cache)
+{
+    if (!cache)
+        return;
+
+    g_free (cache->worktree);
+    g_hash_table_destroy (cache->listings);
+    g_hash_table_destroy (cache->subdirs);
+    g_free (cache);
+}
+
+/* "" for the top-level paths. */
+static char *
+parent_dir (const char *path)
+{
+    char *slash = strrchr (path, '/');
+
+    return slash ? g_strndup (path, slash - path) : g_strdup ("");
+}
+
+/* Record @dir in the subdirs of its parent, and so on up to the top. */
+static void
+add_to_subdirs (CaseConflictCache *cache, const char *dir)
+{
+    char *path = g_strdup (dir), *parent;
+    GHashTable *set;
+
+    while (path[0] != '\0') {
+        parent = parent_dir (path);
+        set = g_hash_table_lookup (cache->subdirs, parent);
+        if (!set) {
+            set = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+            g_hash_table_insert (cache->subdirs, g_strdup (parent), set);
+        }
+        if (g_hash_table_contains (set, path)) {
+            /* So are the ancestors. */
+            g_free (parent);
+            break;
+        }
+        g_hash_table_add (set, path);
+        path = parent;
     }
+    g_free (path);
+}
 
-    int len = strlen (path);
-    fd = open (full_path, O_RDONLY);
-    if (fd < 0) {
-        goto out;
+/* Drop the listings of @dir and of all dirs under it. */
+static void
+drop_listings (CaseConflictCache *cache, const char *dir)
+{
+    gpointer key, value;
+    GHashTableIter iter;
+    gpointer subdir;
+
+    g_hash_table_remove (cache->listings, dir);
+
+    if (!g_hash_table_lookup_extended (cache->subdirs, dir, &key, &value))
+        return;
+    g_hash_table_steal (cache->subdirs, dir);
+
+    g_hash_table_iter_init (&iter, value);
+    while (g_hash_table_iter_next (&iter, &subdir, NULL))
+        drop_listings (cache, subdir);
+
+    g_hash_table_destroy (value);
+    g_free (key);
+}
+
+void
+case_conflict_cache_update (CaseConflictCache *cache, const char *path)
+{
+    char *parent, *full_path, *lower;
+    const char *name;
+    GHashTable *names, *set;
+
+    parent = parent_dir (path);
+
+    names = g_hash_table_lookup (cache->listings, parent);
+    if (names) {
+        name = strrchr (path, '/');
+        name = name ? name + 1 : path;
+        lower = g_ascii_strdown (name, -1);
+
+        /* The case of @path has been checked before it was changed, so the
+         * name on disk is @name if it exists. */
+        full_path = g_build_path ("/", cache->worktree, path, NULL);
+        if (seaf_util_exists (full_path)) {
+            g_hash_table_replace (names, lower, g_strdup (name));
+        } else {
+            g_hash_table_remove (names, lower);
+            g_free (lower);
+        }
+        g_free (full_path);
     }
-    char buffer[SEAF_PATH_MAX];
-    if (fcntl (fd, F_GETPATH, buffer) < 0) {
-        goto out;
+
+    drop_listings (cache, path);
+    set = g_hash_table_lookup (cache->subdirs, parent);
+    if (set)
+        g_hash_table_remove (set, path);
+
+    g_free (parent);
+}
+
+#if defined __APPLE__ || defined WIN32
+
+static void
+add_dir_name (GHashTable *names, const char *name)
+{
+    g_hash_table_replace (names, g_ascii_strdown (name, -1), g_strdup (name));
+}
+
+#ifdef WIN32
+static int
+add_dir_name_win32 (wchar_t *parent, WIN32_FIND_DATAW *fdata,
+                    void *user_data, gboolean *stop)
+{
+    char *name = g_utf16_to_utf8 (fdata->cFileName, -1, NULL, NULL, NULL);
+
+    if (name)
+        add_dir_name (user_data, name);
+    g_free (name);
+    return 0;
+}
+#endif
+
+/* Returns NULL if the directory can't be listed. */
+static GHashTable *
+list_dir_names (const char *worktree, const char *dir)
+{
+    GHashTable *names;
+    char *full_path;
+
+    if (dir[0] == '\0')
+        full_path = g_strdup (worktree);
+    else
+        full_path = g_build_path ("/", worktree, dir, NULL);
+
+    names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+#ifdef WIN32
+    wchar_t *wpath = win32_long_path (full_path);
+    if (traverse_directory_win32 (wpath, add_dir_name_win32, names) < 0) {
+        g_hash_table_destroy (names);
+        names = NULL;
     }
-    int offset = strlen (buffer) - len;
-    if (strcasecmp (buffer + offset, path) == 0 &&
-        strcmp (buffer + offset, path) != 0) {
-        if (conflict_path) {
-            *conflict_path = g_strdup(path);
-        }
-        ret = TRUE;
-        goto out;
+    g_free (wpath);
+#else
+    DIR *dp;
+    struct dirent *dent;
+
+    dp = opendir (full_path);
+    if (!dp) {
+        g_hash_table_destroy (names);
+        names = NULL;
     } else {
-        no_conflict_path = g_strdup (path);
-        g_hash_table_insert (no_case_conflict_hash, no_conflict_path, no_conflict_path);
+        while ((dent = readdir (dp)) != NULL) {
+            if (strcmp (dent->d_name, ".") == 0 ||
+                strcmp (dent->d_name, "..") == 0)
+                continue;
+            add_dir_name (names, dent->d_name);
+        }
+        closedir (dp);
     }
-    
-out:
-    if (fd >= 0)
-        close (fd);
+#endif
+
     g_free (full_path);
-    return ret;
+    return names;
 }
-#elif defined WIN32
-static gboolean
-case_conflict_recursive (const char *worktree, const char *path, char **conflict_path, GHashTable *no_case_conflict_hash)
+
+static GHashTable *
+get_dir_names (const char *worktree, const char *dir, CaseConflictCache *case_cache)
 {
-    if (!path || g_strcmp0 (path, ".") == 0) {
-        return FALSE;
-    }
+    GHashTable *names;
 
-    if (g_hash_table_lookup (no_case_conflict_hash, path)) {
-        return FALSE;
+    names = g_hash_table_lookup (case_cache->listings, dir);
+    if (names)
+        return names;
+
+    names = list_dir_names (worktree, dir);
+    if (names) {
+        g_hash_table_insert (case_cache->listings, g_strdup(dir), names);
+        add_to_subdirs (case_cache, dir);
     }
+    return names;
+}
 
-    SeafStat st;
-    gboolean ret = FALSE;
-    int fd = -1;
-    char *full_path = g_build_path ("/", worktree, path, NULL);
-    wchar_t *wpath = win32_long_path (full_path);
-    char *no_conflict_path = NULL;
+/*
+ * A path is case conflict if some of its components exists on disk with
+ * different case. @conflict_path is set to the longest part of the path
+ * that exists.
+ */
+static gboolean
+check_path_case_conflict (const char *worktree, const char *path,
+                          char **conflict_path, CaseConflictCache *case_cache)
+{
+    char buf[SEAF_PATH_MAX];
+    char *name, *end, *lower;
+    GHashTable *names;
+    const char *real_name;
+    int existing_len = 0;
+    gboolean conflict = FALSE;
+
+    memcpy (buf, path, strlen(path) + 1);
+
+    name = buf;
+    while (*name) {
+        end = strchr (name, '/');
+        if (end)
+            *end = '\0';
+
+        /* buf holds the parent dir, followed by the name. */
+        if (name > buf)
+            name[-1] = '\0';
+        names = get_dir_names (worktree, name > buf ? buf : "", case_cache);
+        if (name > buf)
+            name[-1] = '/';
+        if (!names)
+            break;
 
-    if (seaf_stat (full_path, &st) < 0) {
-        char *sub_path = g_path_get_dirname (path);
-        ret = case_conflict_recursive (worktree, sub_path, conflict_path, no_case_conflict_hash);
-        g_free (sub_path);
-        goto out;
-    }
+        lower = g_ascii_strdown (name, -1);
+        real_name = g_hash_table_lookup (names, lower);
+        g_free (lower);
+        if (!real_name)
+            break;
 
-    HANDLE handle;
-    WIN32_FIND_DATAW fdata;
-    handle = FindFirstFileW (wpath, &fdata);
-    if (handle == INVALID_HANDLE_VALUE) {
-        seaf_warning ("Checkinng path case, FindFirstFile failed %s: %lu.\n", full_path, GetLastError());
-        goto out;
-    }
-    char *real_path = g_utf16_to_utf8 (fdata.cFileName, -1, NULL, NULL, NULL);
-    int offset = strlen (real_path) - strlen(path);
-    if (strcasecmp (real_path + offset, path) == 0 &&
-        strcmp (real_path + offset, path) != 0) {
-        if (conflict_path) {
-            *conflict_path = g_strdup(path);
-        }
-        ret = TRUE;
-        g_free (real_path);
-        FindClose (handle);
-        goto out;
-    } else if (strcmp (real_path + offset, path) == 0) {
-        no_conflict_path = g_strdup (path);
-        g_hash_table_insert (no_case_conflict_hash, no_conflict_path, no_conflict_path);
+        if (strcmp (real_name, name) != 0)
+            conflict = TRUE;
+        existing_len = (name - buf) + strlen(name);
 
-        g_free (real_path);
-        FindClose (handle);
-        goto out;
+        if (!end)
+            break;
+        *end = '/';
+        name = end + 1;
     }
-    g_free (real_path);
-    FindClose (handle);
 
-    char *sub_path = g_path_get_dirname (path);
-    ret = case_conflict_recursive (worktree, sub_path, conflict_path, no_case_conflict_hash);
-    g_free (sub_path);
+    if (conflict && conflict_path)
+        *conflict_path = g_strndup (path, existing_len);
 
-out:
-    g_free (full_path);
-    g_free (wpath);
-    return ret;
+    return conflict;
 }
+
 #else
 static gboolean
-case_conflict_recursive (const char *worktree, const char *path, char **conflict_path, GHashTable *no_case_conflict_hash)
+check_path_case_conflict (const char *worktree, const char *path,
+                          char **conflict_path, CaseConflictCache *case_cache)
 {
     return FALSE;
 }
 #endif
 
 gboolean
-is_path_case_conflict (const char *worktree, const char *path, char **conflict_path, GHashTable *no_case_conflict_hash)
+is_path_case_conflict (const char *worktree, const char *path, char **conflict_path, CaseConflictCache *case_cache)
 {
     if (strlen(path) >= SEAF_PATH_MAX) {
         return FALSE;
     }
-    if (case_conflict_recursive (worktree, path, conflict_path, no_case_conflict_hash))
+    if (check_path_case_conflict (worktree, path, conflict_path, case_cache))
         return TRUE;
     return FALSE;
 }
@@ -114,6 +114,33 @@ int
 traverse_directory_win32 (wchar_t *path_w,
                           DirentCallback callback,
                           void *user_data);
+
+/*
+ * FindFirstFileW() without short names, and fetching entries from the
+ * file system in large batches.
+ */
+HANDLE
+seaf_util_find_first_file (const wchar_t *pattern, WIN32_FIND_DATAW *fdata);
+
+#else
+
+typedef struct SeafDirEntry {
+    char *name;
+    SeafStat st;
+} SeafDirEntry;
+
+/*
+ * Read the entries of the dir @path with their stat info. Each entry is
+ * stat'ed relative to the open dir, so the path isn't looked up again for
+ * each of them. Symbolic links are followed if @follow_links is set.
+ * Entries that fail to be stat'ed are skipped.
+ *
+ * Returns an array of SeafDirEntry, or NULL with errno set if the dir
+ * can't be read.
+ */
+GPtrArray *
+seaf_util_read_dir_entries (const char *path, gboolean follow_links);
+
 #endif
 
 #ifndef O_BINARY
@@ -213,6 +240,18 @@ char** strsplit_by_space (char *string, int *length);
 ssize_t	readn(int fd, void *vptr, size_t n);
 ssize_t writen(int fd, const void *vptr, size_t n);
 
+gboolean is_zero_buf (const void *buf, size_t len);
+
+/*
+ * Like writen(), but pages of zeros are skipped with lseek(), leaving
+ * holes in the file. After the last write, sparse_write_finish() must be
+ * called to extend the file over a trailing hole. Files are written
+ * densely on Windows.
+ */
+ssize_t writen_sparse (int fd, const void *vptr, size_t n);
+
+int sparse_write_finish (int fd);
+
 /* Read "n" bytes from a socket. */
 ssize_t	recvn(evutil_socket_t fd, void *vptr, size_t n);
 ssize_t sendn(evutil_socket_t fd, const void *vptr, size_t n);
@@ -394,6 +433,16 @@ clean_utf8_data (char *data, int len);
 char *
 normalize_utf8_path (const char *path);
 
+/* Hash and compare UTF-8 strings ignoring case, as a GHashTable with
+ * case-insensitive keys needs, without allocating the lower case strings.
+ * Characters are folded one by one with g_unichar_tolower().
+ */
+guint
+utf8_case_hash (gconstpointer key);
+
+gboolean
+utf8_case_equal (gconstpointer a, gconstpointer b);
+
 /* zlib related functions. */
 
 int
@@ -417,6 +466,18 @@ is_eml_file (const char *path);
 char *
 canonical_server_url (const char *url_in);
 
+typedef struct CaseConflictCache CaseConflictCache;
+
+CaseConflictCache *
+case_conflict_cache_new (const char *worktree);
+
+void
+case_conflict_cache_free (CaseConflictCache *cache);
+
+/* Called after @path is created, removed or renamed in the worktree. */
+void
+case_conflict_cache_update (CaseConflictCache *cache, const char *path);
+
 gboolean
-is_path_case_conflict (const char *full_path, const char *path, char **conflict_path, GHashTable *no_case_conflict_hash);
+is_path_case_conflict (const char *full_path, const char *path, char **conflict_path, CaseConflictCache *case_cache);
 #endif
@@ -69,6 +69,11 @@ class SeafileRpcClient(NamedPipeClient):
         pass
     get_repo_list = seafile_get_repo_list
 
+    @searpc_func("string", ["int"])
+    def seafile_get_repo_list_json(seq):
+        pass
+    get_repo_list_json = seafile_get_repo_list_json
+
     @searpc_func("object", ["string"])
     def seafile_get_repo():
         pass
@@ -114,7 +119,7 @@ class SeafileRpcClient(NamedPipeClient):
     def gen_default_worktree(worktree_parent, repo_name):
         pass
 
-    @searpc_func("string", ["string", "int", "string", "string", "string", "string", "string", "string", "int", "string"])
+    @searpc_func("string", ["string", "int", "string", "string", "string", "string", "string", "string", "string", "int", "string"])
     def seafile_clone(repo_id, repo_version, repo_name, worktree, token, password, magic, email, random_key, enc_version, more_info):
         pass
     clone = seafile_clone
@@ -216,3 +221,68 @@ class SeafileRpcClient(NamedPipeClient):
     def seafile_add_del_confirmation(key, value):
         pass
     add_del_confirmation = seafile_add_del_confirmation
+
+    @searpc_func("json", [])
+    def seafile_get_fs_cache_stats():
+        pass
+    get_fs_cache_stats = seafile_get_fs_cache_stats
+
+    @searpc_func("json", [])
+    def seafile_get_startup_profile():
+        pass
+    get_startup_profile = seafile_get_startup_profile
+
+    @searpc_func("json", [])
+    def seafile_get_sync_latency_stats():
+        pass
+    get_sync_latency_stats = seafile_get_sync_latency_stats
+
+    @searpc_func("string", [])
+    def seafile_get_metrics():
+        pass
+    get_metrics = seafile_get_metrics
+
+    @searpc_func("json", [])
+    def seafile_get_change_seqs():
+        pass
+    get_change_seqs = seafile_get_change_seqs
+
+    @searpc_func("json", ["int"])
+    def seafile_wait_sync_notification(timeout):
+        pass
+    wait_sync_notification = seafile_wait_sync_notification
+
+    @searpc_func("json", ["string", "string", "string", "int"])
+    def seafile_get_paths_sync_status(repo_id, dir, names, seq):
+        pass
+    get_paths_sync_status = seafile_get_paths_sync_status
+
+    @searpc_func("int", ["string", "string"])
+    def seafile_hydrate_file(repo_id, path):
+        pass
+    hydrate_file = seafile_hydrate_file
+
+    @searpc_func("int", ["string"])
+    def seafile_register_hydration_provider(name):
+        pass
+    register_hydration_provider = seafile_register_hydration_provider
+
+    @searpc_func("int", ["string"])
+    def seafile_unregister_hydration_provider(name):
+        pass
+    unregister_hydration_provider = seafile_unregister_hydration_provider
+
+    @searpc_func("int", ["string", "int"])
+    def seafile_verify_repo(repo_id, repair):
+        pass
+    verify_repo = seafile_verify_repo
+
+    @searpc_func("json", ["string"])
+    def seafile_get_repo_verify_status(repo_id):
+        pass
+    get_repo_verify_status = seafile_get_repo_verify_status
+
+    @searpc_func("json", ["string", "int", "int"])
+    def seafile_get_commit_history(repo_id, offset, limit):
+        pass
+    get_commit_history = seafile_get_commit_history
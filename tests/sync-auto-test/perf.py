@@ -0,0 +1,149 @@
+#coding: utf-8
+
+'''
+Performance mode of the sync test.
+
+The workloads in test_cases/test_perf.py write files in worktree1 and
+measure how long it takes until they are checked out in worktree2. For
+each workload, the wall-clock time, the throughput and the time spent in
+each sync phase of both daemons are recorded. The phase times come from
+the latency stats RPC, and the transferred bytes come from the metrics
+RPC.
+
+The results are written as JSON to PERF_OUTPUT (default perf-result.json),
+so that runs of different releases can be compared.
+'''
+
+import os
+import json
+import time
+import platform
+
+import seaf_op
+
+POLL_INTERVAL = 0.1
+
+def parse_metrics(text):
+    '''Parse the OpenMetrics text of the daemon into {sample: value}.'''
+    samples = {}
+    for line in text.splitlines():
+        if not line or line.startswith('#'):
+            continue
+        name, _, value = line.rpartition(' ')
+        try:
+            samples[name] = int(value)
+        except ValueError:
+            pass
+    return samples
+
+class ClientSnapshot():
+    '''Latency stats and metrics of a daemon at one point in time.'''
+    def __init__(self, conf_dir):
+        self.latency = seaf_op.seaf_get_sync_latency_stats(conf_dir)
+        self.metrics = parse_metrics(seaf_op.seaf_get_metrics(conf_dir))
+
+    def phases_since(self, before):
+        '''Time spent in each phase since @before. The histograms are kept
+        since the daemon started, so only the count and the total time can
+        be told apart. Percentiles are those of the whole run.'''
+        phases = {}
+        for name, stats in self.latency.items():
+            prev = before.latency.get(name, {'count': 0, 'mean': 0})
+            count = stats['count'] - prev['count']
+            if count <= 0:
+                continue
+            total = stats['count'] * stats['mean'] - prev['count'] * prev['mean']
+            phases[name] = {
+                'count': count,
+                'total_usec': max(total, 0),
+                'p50_usec': stats['p50'],
+                'p90_usec': stats['p90'],
+                'p99_usec': stats['p99'],
+            }
+        return phases
+
+    def delta(self, before, sample):
+        return self.metrics.get(sample, 0) - before.metrics.get(sample, 0)
+
+class PerfRecorder():
+    def __init__(self, test_util):
+        self.test_util = test_util
+        self.output = os.environ.get('PERF_OUTPUT',
+                                     os.path.join(os.getcwd(), 'perf-result.json'))
+        self.result = {
+            'label': os.environ.get('PERF_LABEL', ''),
+            'time': int(time.time()),
+            'platform': platform.platform(),
+            'encrypted': test_util.enc_repo,
+            'workloads': [],
+        }
+
+    def heads_equal(self):
+        util = self.test_util
+        repo1 = seaf_op.seaf_get_repo(util.cli1_dir, util.repo_id)
+        repo2 = seaf_op.seaf_get_repo(util.cli2_dir, util.repo_id)
+        return repo1 and repo2 and repo1.head_cmmt_id == repo2.head_cmmt_id
+
+    def wait_until(self, check, timeout):
+        '''Poll until @check() is true and both clients have the same head.
+        Returns the seconds waited.'''
+        start = time.time()
+        while True:
+            if check() and self.heads_equal():
+                return time.time() - start
+            if time.time() - start > timeout:
+                raise Exception('Sync did not finish in %d seconds' % timeout)
+            time.sleep(POLL_INTERVAL)
+
+    def run(self, name, prepare, check, n_files=0, n_bytes=0, timeout=3600):
+        '''Run @prepare() on worktree1 and wait until @check() is true on
+        worktree2. Records and returns the elapsed seconds.'''
+        util = self.test_util
+        before1 = ClientSnapshot(util.cli1_dir)
+        before2 = ClientSnapshot(util.cli2_dir)
+
+        start = time.time()
+        prepare()
+        self.wait_until(check, timeout)
+        elapsed = time.time() - start
+
+        after1 = ClientSnapshot(util.cli1_dir)
+        after2 = ClientSnapshot(util.cli2_dir)
+
+        sent = after1.delta(before1, 'seafile_sent_bytes_total')
+        recv = after2.delta(before2, 'seafile_recv_bytes_total')
+        self.result['workloads'].append({
+            'name': name,
+            'files': n_files,
+            'bytes': n_bytes,
+            'elapsed_sec': round(elapsed, 3),
+            'files_per_sec': round(n_files / elapsed, 2) if n_files else 0,
+            'bytes_per_sec': int(n_bytes / elapsed) if n_bytes else 0,
+            'uploaded_bytes': sent,
+            'downloaded_bytes': recv,
+            'phases': {
+                'cli1': after1.phases_since(before1),
+                'cli2': after2.phases_since(before2),
+            },
+        })
+        print '%s: %.3f s' % (name, elapsed)
+        return elapsed
+
+    def add_latency(self, name, samples):
+        '''Record end-to-end latencies, in seconds.'''
+        samples = sorted(samples)
+        n = len(samples)
+        self.result['workloads'].append({
+            'name': name,
+            'samples': n,
+            'min_sec': round(samples[0], 3),
+            'median_sec': round(samples[n / 2], 3),
+            'max_sec': round(samples[-1], 3),
+            'latencies_sec': [round(s, 3) for s in samples],
+        })
+        print '%s: median %.3f s' % (name, samples[n / 2])
+
+    def save(self):
+        with open(self.output, 'w') as fd:
+            json.dump(self.result, fd, indent=2, sort_keys=True)
+        print 'Performance results written to %s' % self.output
@@ -346,3 +346,13 @@ def seaf_get_repo(conf_dir, repo_id):
     pool = ccnet.ClientPool(conf_dir)
     seafile_rpc = seafile.RpcClient(pool, req_pool=False)
     return seafile_rpc.seafile_get_repo(repo_id)
+
+def seaf_get_sync_latency_stats(conf_dir):
+    pool = ccnet.ClientPool(conf_dir)
+    seafile_rpc = seafile.RpcClient(pool, req_pool=False)
+    return seafile_rpc.get_sync_latency_stats()
+
+def seaf_get_metrics(conf_dir):
+    pool = ccnet.ClientPool(conf_dir)
+    seafile_rpc = seafile.RpcClient(pool, req_pool=False)
+    return seafile_rpc.get_metrics()
@@ -0,0 +1,103 @@
+#coding: utf-8
+
+'''
+Performance workloads, run with "./run.sh perf". See perf.py.
+
+The sizes can be changed with PERF_SMALL_FILES, PERF_HUGE_FILE_MB,
+PERF_RENAME_FILES and PERF_LATENCY_SAMPLES.
+'''
+
+import os
+import time
+from perf import PerfRecorder
+from . import test_util
+
+def env_int(name, default):
+    return int(os.environ.get(name, default))
+
+N_SMALL_FILES = env_int('PERF_SMALL_FILES', 1000)
+SMALL_FILE_SIZE = 4096
+HUGE_FILE_MB = env_int('PERF_HUGE_FILE_MB', 512)
+N_RENAME_FILES = env_int('PERF_RENAME_FILES', 500)
+N_LATENCY_SAMPLES = env_int('PERF_LATENCY_SAMPLES', 10)
+
+recorder = None
+
+def setup():
+    global recorder
+    recorder = PerfRecorder(test_util)
+
+def teardown():
+    recorder.save()
+
+def file_size(worktree, path):
+    try:
+        return os.path.getsize(test_util.getpath(worktree, path))
+    except OSError:
+        return -1
+
+def test_latency():
+    test_util.set_test_root('perf_latency')
+
+    samples = []
+    for i in range(N_LATENCY_SAMPLES):
+        path = '%d.txt' % i
+        con = 'latency %d\n' % i
+        start = time.time()
+        test_util.mkfile(1, path, con)
+        recorder.wait_until(lambda: file_size(2, path) == len(con), 600)
+        samples.append(time.time() - start)
+
+    recorder.add_latency('latency', samples)
+
+def test_small_files():
+    test_util.set_test_root('perf_small_files')
+    con = 'x' * SMALL_FILE_SIZE
+
+    def prepare():
+        for i in range(N_SMALL_FILES):
+            test_util.mkfile(1, 'd%d/%d.txt' % (i / 100, i), con)
+
+    def check():
+        last = N_SMALL_FILES - 1
+        if file_size(2, 'd%d/%d.txt' % (last / 100, last)) != SMALL_FILE_SIZE:
+            return False
+        return all(file_size(2, 'd%d/%d.txt' % (i / 100, i)) == SMALL_FILE_SIZE
+                   for i in range(N_SMALL_FILES))
+
+    recorder.run('small_files', prepare, check,
+                 n_files=N_SMALL_FILES, n_bytes=N_SMALL_FILES * SMALL_FILE_SIZE)
+
+def test_huge_file():
+    test_util.set_test_root('perf_huge_file')
+    size = HUGE_FILE_MB << 20
+
+    def prepare():
+        test_util.mkdir(1, '')
+        # Random data, so that neither compression nor dedup helps.
+        with open(test_util.getpath(1, 'huge.bin'), 'wb') as fd:
+            for i in range(HUGE_FILE_MB):
+                fd.write(os.urandom(1 << 20))
+
+    recorder.run('huge_file', prepare,
+                 lambda: file_size(2, 'huge.bin') == size,
+                 n_files=1, n_bytes=size)
+
+def test_rename_storm():
+    test_util.set_test_root('perf_rename_storm')
+    for i in range(N_RENAME_FILES):
+        test_util.mkfile(1, 'src/%d.txt' % i, 'rename %d\n' % i)
+    test_util.verify_result()
+
+    def prepare():
+        test_util.mkdir(1, 'dst')
+        for i in range(N_RENAME_FILES):
+            test_util.move(1, 'src/%d.txt' % i, 'dst/%d.txt' % i)
+        test_util.move(1, 'dst', 'moved')
+
+    def check():
+        return (not os.path.exists(test_util.getpath(2, 'src/0.txt')) and
+                all(os.path.exists(test_util.getpath(2, 'moved/%d.txt' % i))
+                    for i in range(N_RENAME_FILES)))
+
+    recorder.run('rename_storm', prepare, check, n_files=N_RENAME_FILES)
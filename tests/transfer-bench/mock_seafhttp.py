@@ -0,0 +1,468 @@
+#!/usr/bin/env python3
+#-*- coding:utf-8 -*-
+
+'''
+A minimal in-memory seafhttp server, for benchmarking the transfer code of
+the client.
+
+It serves a single library and implements the endpoints used by clone,
+download and upload: protocol-version, commit, fs-id-list, check-fs,
+recv-fs, pack-fs, check-blocks and block PUT/GET, plus the permission,
+quota and head commit checks. Objects are kept in memory and are not
+verified.
+
+Latency, bandwidth and errors can be injected:
+
+    --latency MS        delay every request by MS milliseconds
+    --bandwidth KB      limit the upload and the download rate to KB KB/s
+    --error-rate P      fail a fraction P of the object transfer requests
+
+Request counts, bytes and time per endpoint are returned by
+GET /_bench/stats and cleared by POST /_bench/reset.
+
+It can be run on its own, or started from transfer_bench.py.
+'''
+
+import argparse
+import hashlib
+import json
+import random
+import re
+import stat
+import struct
+import sys
+import threading
+import time
+import uuid
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import urlparse, parse_qs
+
+EMPTY_SHA1 = '0' * 40
+OBJECT_HEADER = struct.Struct('!40sI')
+IO_CHUNK = 64 * 1024
+
+# Object transfer endpoints, where errors are injected.
+ERROR_ENDPOINTS = ('recv-fs', 'pack-fs', 'block')
+
+
+class Throttle(object):
+    '''Token bucket that limits a direction to @rate bytes per second.'''
+
+    def __init__(self, rate):
+        self.rate = rate
+        self.lock = threading.Lock()
+        self.next_time = time.monotonic()
+
+    def consume(self, n):
+        if not self.rate:
+            return
+        with self.lock:
+            now = time.monotonic()
+            start = max(now, self.next_time)
+            self.next_time = start + float(n) / self.rate
+            delay = self.next_time - now
+        if delay > 0:
+            time.sleep(delay)
+
+
+class EndpointStats(object):
+    def __init__(self):
+        self.count = 0
+        self.errors = 0
+        self.bytes_in = 0
+        self.bytes_out = 0
+        self.time = 0.0
+
+    def to_dict(self):
+        return {
+            'count': self.count,
+            'errors': self.errors,
+            'bytes_in': self.bytes_in,
+            'bytes_out': self.bytes_out,
+            'time': round(self.time, 6),
+        }
+
+
+class Library(object):
+    '''The objects and the head commit of the served library.'''
+
+    def __init__(self, repo_id, name):
+        self.repo_id = repo_id
+        self.lock = threading.Lock()
+        self.commits = {}
+        self.fs = {}
+        self.blocks = {}
+        self.head = self._create_initial_commit(name)
+
+    def _create_initial_commit(self, name):
+        commit = {
+            'repo_id': self.repo_id,
+            'root_id': EMPTY_SHA1,
+            'creator_name': 'bench@example.com',
+            'creator': EMPTY_SHA1,
+            'description': 'Created library',
+            'ctime': int(time.time()),
+            'parent_id': None,
+            'second_parent_id': None,
+            'repo_name': name,
+            'repo_desc': '',
+            'repo_category': None,
+            'no_local_history': 1,
+            'version': 1,
+        }
+        data = json.dumps(commit, sort_keys=True).encode()
+        commit_id = hashlib.sha1(data).hexdigest()
+        commit['commit_id'] = commit_id
+        self.commits[commit_id] = json.dumps(commit).encode()
+        return commit_id
+
+    def _load_fs(self, obj_id):
+        data = self.fs.get(obj_id)
+        if data is None:
+            return None
+        try:
+            return json.loads(zlib.decompress(data))
+        except (zlib.error, ValueError):
+            return json.loads(data)
+
+    def _reachable_fs(self, commit_id):
+        '''Ids of the fs objects reachable from commit @commit_id.'''
+        ids = []
+        seen = set()
+        data = self.commits.get(commit_id)
+        if data is None:
+            return ids, seen
+        stack = [json.loads(data)['root_id']]
+        while stack:
+            obj_id = stack.pop()
+            if obj_id == EMPTY_SHA1 or obj_id in seen:
+                continue
+            seen.add(obj_id)
+            ids.append(obj_id)
+            obj = self._load_fs(obj_id)
+            if obj is None or 'dirents' not in obj:
+                continue
+            for dent in obj['dirents']:
+                if stat.S_ISDIR(dent['mode']):
+                    stack.append(dent['id'])
+                elif dent['id'] != EMPTY_SHA1 and dent['id'] not in seen:
+                    seen.add(dent['id'])
+                    ids.append(dent['id'])
+        return ids, seen
+
+    def fs_id_list(self, server_head, client_head):
+        with self.lock:
+            ids, _ = self._reachable_fs(server_head)
+            if client_head:
+                _, known = self._reachable_fs(client_head)
+                ids = [i for i in ids if i not in known]
+            return ids
+
+
+class Server(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, addr, library, latency=0, bandwidth=0,
+                 error_rate=0.0, error_status=500, seed=None,
+                 block_compression=False):
+        ThreadingHTTPServer.__init__(self, addr, Handler)
+        self.library = library
+        self.block_compression = block_compression
+        self.latency = latency / 1000.0
+        self.upload_throttle = Throttle(bandwidth * 1024)
+        self.download_throttle = Throttle(bandwidth * 1024)
+        self.error_rate = error_rate
+        self.error_status = error_status
+        self.random = random.Random(seed)
+        self.stats_lock = threading.Lock()
+        self.stats = {}
+        self.quiet = True
+
+    def url(self):
+        return 'http://%s:%d' % self.server_address[:2]
+
+    def should_fail(self, endpoint):
+        if self.error_rate <= 0 or endpoint.split('/')[-1] not in ERROR_ENDPOINTS:
+            return False
+        with self.stats_lock:
+            return self.random.random() < self.error_rate
+
+    def record(self, method, endpoint, status, bytes_in, bytes_out, elapsed):
+        key = '%s %s' % (method, endpoint)
+        with self.stats_lock:
+            st = self.stats.setdefault(key, EndpointStats())
+            st.count += 1
+            if status >= 400:
+                st.errors += 1
+            st.bytes_in += bytes_in
+            st.bytes_out += bytes_out
+            st.time += elapsed
+
+    def get_stats(self):
+        with self.stats_lock:
+            return dict((k, v.to_dict()) for k, v in self.stats.items())
+
+    def reset_stats(self):
+        with self.stats_lock:
+            self.stats = {}
+
+
+ID_RE = re.compile(r'/[0-9a-f]{40}(?=/|$)|/[0-9a-f-]{36}(?=/|$)')
+
+
+def endpoint_name(path):
+    '''Replace the ids in @path, so that requests to the same endpoint are
+    counted together.'''
+    return ID_RE.sub('/:id', path.rstrip('/')) or '/'
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, fmt, *args):
+        if not self.server.quiet:
+            BaseHTTPRequestHandler.log_message(self, fmt, *args)
+
+    def read_body(self):
+        length = int(self.headers.get('Content-Length', 0))
+        chunks = []
+        while length > 0:
+            n = min(length, IO_CHUNK)
+            self.server.upload_throttle.consume(n)
+            chunk = self.rfile.read(n)
+            if not chunk:
+                break
+            chunks.append(chunk)
+            length -= len(chunk)
+        body = b''.join(chunks)
+        self.bytes_in += len(body)
+        return body
+
+    def reply(self, status, body=b'', content_type='application/octet-stream',
+              encoding=None):
+        if isinstance(body, str):
+            body = body.encode()
+        self.status = status
+        self.send_response(status)
+        self.send_header('Content-Type', content_type)
+        if encoding:
+            self.send_header('Content-Encoding', encoding)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        for off in range(0, len(body), IO_CHUNK):
+            chunk = body[off:off + IO_CHUNK]
+            self.server.download_throttle.consume(len(chunk))
+            self.wfile.write(chunk)
+        self.bytes_out += len(body)
+
+    def reply_json(self, obj):
+        self.reply(200, json.dumps(obj), 'application/json')
+
+    def handle_request(self, method):
+        start = time.monotonic()
+        self.status = 0
+        self.bytes_in = 0
+        self.bytes_out = 0
+
+        url = urlparse(self.path)
+        query = dict((k, v[0]) for k, v in parse_qs(url.query).items())
+        path = url.path
+        if path.startswith('/seafhttp'):
+            path = path[len('/seafhttp'):]
+        endpoint = endpoint_name(path)
+
+        if path.startswith('/_bench/'):
+            self.handle_bench(method, path)
+            return
+
+        if self.server.latency:
+            time.sleep(self.server.latency)
+
+        body = self.read_body() if method in ('PUT', 'POST') else b''
+
+        if self.server.should_fail(endpoint):
+            self.reply(self.server.error_status, 'Injected error')
+        else:
+            self.dispatch(method, path, query, body)
+
+        self.server.record(method, endpoint, self.status, self.bytes_in,
+                           self.bytes_out, time.monotonic() - start)
+
+    def handle_bench(self, method, path):
+        if method == 'GET' and path == '/_bench/stats':
+            self.reply_json({'head': self.server.library.head,
+                             'endpoints': self.server.get_stats()})
+        elif method == 'POST' and path == '/_bench/reset':
+            self.read_body()
+            self.server.reset_stats()
+            self.reply(200)
+        else:
+            self.reply(404)
+
+    def dispatch(self, method, path, query, body):
+        lib = self.server.library
+        parts = [p for p in path.split('/') if p]
+
+        if parts == ['protocol-version']:
+            # Block packs and compact id checks are not emulated, the client
+            # falls back to single block requests and JSON id lists.
+            info = {'version': 2}
+            if self.server.block_compression:
+                info['block_compression'] = ['deflate']
+            self.reply_json(info)
+            return
+
+        if parts == ['repo', 'head-commits-multi']:
+            ids = json.loads(body or b'[]')
+            self.reply_json(dict((i, lib.head) for i in ids if i == lib.repo_id))
+            return
+
+        if len(parts) < 3 or parts[0] != 'repo':
+            self.reply(404)
+            return
+        if parts[1] != lib.repo_id:
+            self.reply(404, 'Repo not found')
+            return
+
+        op = parts[2]
+        arg = parts[3] if len(parts) > 3 else None
+
+        if op in ('permission-check', 'quota-check') and method == 'GET':
+            self.reply(200)
+        elif op == 'commit' and arg == 'HEAD':
+            if method == 'GET':
+                self.reply_json({'is_corrupted': 0, 'head_commit_id': lib.head})
+            elif method == 'PUT' and query.get('head') in lib.commits:
+                lib.head = query['head']
+                self.reply(200)
+            else:
+                self.reply(400)
+        elif op == 'commit' and arg:
+            if method == 'GET':
+                data = lib.commits.get(arg)
+                if data is None:
+                    self.reply(404)
+                else:
+                    self.reply(200, data, 'application/json')
+            elif method == 'PUT':
+                lib.commits[arg] = body
+                self.reply(200)
+            else:
+                self.reply(400)
+        elif op == 'fs-id-list' and method == 'GET':
+            server_head = query.get('server-head')
+            if server_head not in lib.commits:
+                self.reply(400, 'Invalid server-head')
+                return
+            self.reply_json(lib.fs_id_list(server_head, query.get('client-head')))
+        elif op == 'check-fs' and method == 'POST':
+            self.reply_json([i for i in json.loads(body) if i not in lib.fs])
+        elif op == 'check-blocks' and method == 'POST':
+            self.reply_json([i for i in json.loads(body) if i not in lib.blocks])
+        elif op == 'recv-fs' and method == 'POST':
+            off = 0
+            while off + OBJECT_HEADER.size <= len(body):
+                obj_id, size = OBJECT_HEADER.unpack_from(body, off)
+                off += OBJECT_HEADER.size
+                lib.fs[obj_id.decode()] = body[off:off + size]
+                off += size
+            self.reply(200)
+        elif op == 'pack-fs' and method == 'POST':
+            out = []
+            for obj_id in json.loads(body):
+                data = lib.fs.get(obj_id)
+                if data is not None:
+                    out.append(OBJECT_HEADER.pack(obj_id.encode(), len(data)))
+                    out.append(data)
+            self.reply(200, b''.join(out))
+        elif op == 'block' and arg:
+            if method == 'GET':
+                data = lib.blocks.get(arg)
+                if data is None:
+                    self.reply(404)
+                elif self.accepts_deflate():
+                    self.reply(200, zlib.compress(data, 1), encoding='deflate')
+                else:
+                    self.reply(200, data)
+            elif method == 'PUT':
+                encoding = self.headers.get('Content-Encoding', 'identity')
+                if encoding == 'deflate' and self.server.block_compression:
+                    try:
+                        body = zlib.decompress(body)
+                    except zlib.error:
+                        self.reply(400, 'Corrupt block')
+                        return
+                elif encoding != 'identity':
+                    self.reply(415, 'Unsupported encoding')
+                    return
+                lib.blocks[arg] = body
+                self.reply(200)
+            else:
+                self.reply(400)
+        else:
+            # Including recv-blocks and pack-blocks, so that the client
+            # disables block packs.
+            self.reply(404)
+
+    def accepts_deflate(self):
+        if not self.server.block_compression:
+            return False
+        accept = self.headers.get('Accept-Encoding', '')
+        return 'deflate' in [e.split(';')[0].strip() for e in accept.split(',')]
+
+    def do_GET(self):
+        self.handle_request('GET')
+
+    def do_PUT(self):
+        self.handle_request('PUT')
+
+    def do_POST(self):
+        self.handle_request('POST')
+
+
+def add_server_args(parser):
+    parser.add_argument('--latency', type=float, default=0,
+                        help='delay of every request, in milliseconds')
+    parser.add_argument('--bandwidth', type=int, default=0,
+                        help='upload and download limit in KB/s, 0 for none')
+    parser.add_argument('--error-rate', type=float, default=0,
+                        help='fraction of object transfer requests that fail')
+    parser.add_argument('--error-status', type=int, default=500,
+                        help='status code of the injected errors')
+    parser.add_argument('--seed', type=int, default=None,
+                        help='random seed for the error injection')
+    parser.add_argument('--block-compression', action='store_true',
+                        help='accept and send deflate encoded blocks')
+
+
+def create_server(args, host='127.0.0.1', port=0, repo_id=None):
+    library = Library(repo_id or str(uuid.uuid4()), 'bench')
+    return Server((host, port), library,
+                  latency=args.latency, bandwidth=args.bandwidth,
+                  error_rate=args.error_rate, error_status=args.error_status,
+                  seed=args.seed, block_compression=args.block_compression)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Emulated seafhttp server.')
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=8082)
+    parser.add_argument('--repo-id', default=None)
+    parser.add_argument('-v', '--verbose', action='store_true',
+                        help='log every request')
+    add_server_args(parser)
+    args = parser.parse_args()
+
+    server = create_server(args, args.host, args.port, args.repo_id)
+    server.quiet = not args.verbose
+    print('Serving library %s at %s/seafhttp' % (server.library.repo_id, server.url()))
+    sys.stdout.flush()
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,233 @@
+#!/usr/bin/env python3
+#-*- coding:utf-8 -*-
+
+'''
+Transfer benchmark of seaf-daemon against the emulated seafhttp server.
+
+The benchmark runs two daemons against mock_seafhttp.py:
+
+1. upload: daemon A clones the empty library, then a tree of random files
+   is written into its worktree, and A commits and uploads it;
+2. download: daemon B clones the library from scratch.
+
+Each phase reports the wall time, the throughput, the requests handled by
+the server per endpoint, and the time the daemon spent in each state of
+the transfer task, from seafile_get_sync_latency_stats().
+
+The server is written in Python, so the absolute throughput is bounded by
+it. Compare runs of the same harness on the same machine.
+'''
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+import mock_seafhttp
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, '..', '..', 'python'))
+
+import seafile
+
+POLL_INTERVAL = 0.1
+
+
+class Daemon(object):
+    def __init__(self, program, topdir, name, port):
+        self.name = name
+        self.confdir = os.path.join(topdir, name, 'conf')
+        self.datadir = os.path.join(topdir, name, 'seafile-data')
+        self.worktree = os.path.join(topdir, name, 'worktree')
+        self.logfile = os.path.join(topdir, name, 'seaf-daemon.out')
+        for d in (self.confdir, self.datadir):
+            os.makedirs(d)
+        cmd = [program, '-c', self.confdir, '-d', self.datadir,
+               '-w', os.path.join(topdir, name), '-p', str(port)]
+        self.log = open(self.logfile, 'w')
+        self.proc = subprocess.Popen(cmd, stdout=self.log, stderr=subprocess.STDOUT)
+        self.rpc = seafile.RpcClient(os.path.join(self.datadir, 'seafile.sock'))
+        self._wait_ready()
+
+    def _wait_ready(self, timeout=30):
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            if self.proc.poll() is not None:
+                raise RuntimeError('%s exited, see %s' % (self.name, self.logfile))
+            try:
+                self.rpc.get_repo_list(-1, -1)
+                return
+            except Exception:
+                time.sleep(POLL_INTERVAL)
+        raise RuntimeError('%s did not start, see %s' % (self.name, self.logfile))
+
+    def clone(self, server, token):
+        more_info = json.dumps({'server_url': server.url()})
+        self.rpc.clone(server.library.repo_id, 1, 'bench', self.worktree,
+                       token, None, None, 'bench@example.com', None, 0,
+                       more_info)
+
+    def wait_clone(self, repo_id, timeout):
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            for task in self.rpc.get_clone_tasks():
+                if task.repo_id != repo_id:
+                    continue
+                if task.state == 'done':
+                    return
+                if task.state == 'error':
+                    raise RuntimeError('%s failed to clone: %s' % (
+                        self.name, self.rpc.sync_error_id_to_str(task.error)))
+            time.sleep(POLL_INTERVAL)
+        raise RuntimeError('%s timed out cloning' % self.name)
+
+    def wait_synced(self, server, old_head, timeout):
+        repo_id = server.library.repo_id
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            task = self.rpc.get_repo_sync_task(repo_id)
+            if task and task.state == 'error':
+                raise RuntimeError('%s failed to sync: %s' % (
+                    self.name, self.rpc.sync_error_id_to_str(task.error)))
+            if server.library.head != old_head and task and \
+               task.state == 'synchronized':
+                return
+            time.sleep(POLL_INTERVAL)
+        raise RuntimeError('%s timed out uploading' % self.name)
+
+    def latency_stats(self):
+        return self.rpc.get_sync_latency_stats()
+
+    def stop(self):
+        if self.proc.poll() is None:
+            self.proc.terminate()
+            try:
+                self.proc.wait(10)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+                self.proc.wait()
+        self.log.close()
+
+
+def write_tree(root, n_files, file_size, files_per_dir=100):
+    '''Write @n_files random files of @file_size bytes below @root.'''
+    total = 0
+    for i in range(n_files):
+        d = os.path.join(root, 'dir%04d' % (i // files_per_dir))
+        if i % files_per_dir == 0:
+            os.makedirs(d, exist_ok=True)
+        with open(os.path.join(d, 'file%06d.bin' % i), 'wb') as f:
+            f.write(os.urandom(file_size))
+        total += file_size
+    return total
+
+
+def format_size(n):
+    for unit in ('B', 'KB', 'MB', 'GB'):
+        if n < 1024 or unit == 'GB':
+            return '%.1f %s' % (n, unit)
+        n /= 1024.0
+
+
+def report_phase(name, elapsed, nbytes, server, stats):
+    print('\n== %s ==' % name)
+    print('time:       %.3f s' % elapsed)
+    print('data:       %s' % format_size(nbytes))
+    print('throughput: %s/s' % format_size(nbytes / elapsed if elapsed > 0 else 0))
+
+    endpoints = server.get_stats()
+    n_requests = sum(e['count'] for e in endpoints.values())
+    n_errors = sum(e['errors'] for e in endpoints.values())
+    print('requests:   %d (%d errors)' % (n_requests, n_errors))
+    print('  %-44s %7s %6s %10s %10s %9s' % (
+        'endpoint', 'count', 'errors', 'in', 'out', 'time(s)'))
+    for key in sorted(endpoints):
+        e = endpoints[key]
+        print('  %-44s %7d %6d %10s %10s %9.3f' % (
+            key, e['count'], e['errors'], format_size(e['bytes_in']),
+            format_size(e['bytes_out']), e['time']))
+
+    prefix = name + '.'
+    print('task states (ms):')
+    print('  %-24s %7s %10s %10s %10s' % ('state', 'count', 'mean', 'p90', 'max'))
+    for key in sorted(stats):
+        if not key.startswith(prefix):
+            continue
+        s = stats[key]
+        print('  %-24s %7d %10.1f %10.1f %10.1f' % (
+            key[len(prefix):], s['count'], s['mean'] / 1000.0,
+            s['p90'] / 1000.0, s['max'] / 1000.0))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Benchmark uploads and downloads against an emulated server.')
+    parser.add_argument('--daemon', default='seaf-daemon',
+                        help='path of the seaf-daemon program')
+    parser.add_argument('-n', '--files', type=int, default=1000,
+                        help='number of files to upload')
+    parser.add_argument('-s', '--size', type=int, default=64 * 1024,
+                        help='size of each file, in bytes')
+    parser.add_argument('-t', '--timeout', type=float, default=600,
+                        help='timeout of each phase, in seconds')
+    parser.add_argument('-d', '--workdir', default=None,
+                        help='directory for the daemons, a temporary one by default')
+    parser.add_argument('-k', '--keep', action='store_true',
+                        help="don't remove the work directory")
+    mock_seafhttp.add_server_args(parser)
+    args = parser.parse_args()
+
+    workdir = args.workdir or tempfile.mkdtemp(prefix='seaf-transfer-bench-')
+    os.makedirs(workdir, exist_ok=True)
+
+    server = mock_seafhttp.create_server(args)
+    repo_id = server.library.repo_id
+    token = 'bench-token'
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+
+    print('server:  %s, library %s' % (server.url(), repo_id))
+    print('latency: %g ms, bandwidth: %s, error rate: %g' % (
+        args.latency, '%d KB/s' % args.bandwidth if args.bandwidth else 'unlimited',
+        args.error_rate))
+    print('files:   %d x %s' % (args.files, format_size(args.size)))
+
+    daemons = []
+    try:
+        uploader = Daemon(args.daemon, workdir, 'upload', 19090)
+        daemons.append(uploader)
+        uploader.clone(server, token)
+        uploader.wait_clone(repo_id, args.timeout)
+
+        old_head = server.library.head
+        server.reset_stats()
+        nbytes = write_tree(uploader.worktree, args.files, args.size)
+        start = time.monotonic()
+        uploader.wait_synced(server, old_head, args.timeout)
+        report_phase('upload', time.monotonic() - start, nbytes, server,
+                     uploader.latency_stats())
+
+        downloader = Daemon(args.daemon, workdir, 'download', 19091)
+        daemons.append(downloader)
+        server.reset_stats()
+        start = time.monotonic()
+        downloader.clone(server, token)
+        downloader.wait_clone(repo_id, args.timeout)
+        report_phase('download', time.monotonic() - start, nbytes, server,
+                     downloader.latency_stats())
+    finally:
+        for d in daemons:
+            d.stop()
+        server.shutdown()
+        if not args.keep:
+            shutil.rmtree(workdir, ignore_errors=True)
+        else:
+            print('\nwork directory: %s' % workdir)
+
+
+if __name__ == '__main__':
+    main()